@@ -0,0 +1,38 @@
+/*
+ * The reference application for kodev bench. Every handler does as
+ * little as possible so the numbers reflect Kore itself.
+ */
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+int		ws(struct http_request *);
+int		hello(struct http_request *);
+
+void		ws_message(struct connection *, u_int8_t, void *, size_t);
+
+static const char	hello_world[] = "hello world";
+
+int
+hello(struct http_request *req)
+{
+	http_response_header(req, "content-type", "text/plain");
+	http_response(req, HTTP_STATUS_OK, hello_world,
+	    sizeof(hello_world) - 1);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+ws(struct http_request *req)
+{
+	kore_websocket_handshake(req, NULL, "ws_message", NULL);
+	return (KORE_RESULT_OK);
+}
+
+/* Fan every message out to all other websocket clients. */
+void
+ws_message(struct connection *c, u_int8_t op, void *data, size_t len)
+{
+	kore_websocket_broadcast(c, op, data, len, WEBSOCKET_BROADCAST_GLOBAL);
+}
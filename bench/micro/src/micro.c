@@ -0,0 +1,651 @@
+/*
+ * Microbenchmarks for the hot paths of Kore. They run inside the first
+ * worker once it is configured, print one JSON object per benchmark on
+ * stdout and shut the server down again.
+ */
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MICRO_RUNS		5
+#define MICRO_CONNECTIONS	100000
+
+/* A timer as the old sorted list in timer.c kept it. */
+struct list_timer {
+	u_int64_t		nextrun;
+	TAILQ_ENTRY(list_timer)	list;
+};
+
+struct micro {
+	const char	*name;
+	void		(*setup)(void);
+	void		(*run)(u_int64_t);
+	void		(*teardown)(void);
+	u_int64_t	iterations;
+};
+
+void		kore_worker_configure(void);
+int		page(struct http_request *);
+
+static u_int64_t	micro_now(void);
+static void		micro_report(struct micro *, u_int64_t *);
+
+static void	header_recv_setup(void);
+static void	header_recv_run(u_int64_t);
+static void	pool_setup(void);
+static void	pool_run(u_int64_t);
+static void	pool_batch_run(u_int64_t);
+static void	pool_teardown(void);
+static void	malloc_small_run(u_int64_t);
+static void	malloc_medium_run(u_int64_t);
+static void	malloc_large_run(u_int64_t);
+static void	malloc_mixed_run(u_int64_t);
+static void	timer_add_run(u_int64_t);
+static void	timer_fire_run(u_int64_t);
+static void	timer_list_add_run(u_int64_t);
+static void	conn_setup(void);
+static void	conn_dispatch_run(u_int64_t);
+static void	conn_dispatch_cold_run(u_int64_t);
+static void	conn_teardown(void);
+static void	json_parse_run(u_int64_t);
+static void	json_tobuf_setup(void);
+static void	json_tobuf_run(u_int64_t);
+static void	json_tobuf_teardown(void);
+static void	routes_10_setup(void);
+static void	routes_100_setup(void);
+static void	routes_1000_setup(void);
+static void	routes_run(u_int64_t);
+static void	routes_teardown(void);
+static void	ws_frame_small_run(u_int64_t);
+static void	ws_frame_large_run(u_int64_t);
+
+static struct micro micros[] = {
+	{ "http_header_recv", header_recv_setup, header_recv_run, NULL,
+	    200000 },
+	{ "pool_get_put", pool_setup, pool_run, pool_teardown, 2000000 },
+	{ "pool_get_put_batch", pool_setup, pool_batch_run, pool_teardown,
+	    2000000 },
+	{ "malloc_64", NULL, malloc_small_run, NULL, 2000000 },
+	{ "malloc_1024", NULL, malloc_medium_run, NULL, 2000000 },
+	{ "malloc_16384", NULL, malloc_large_run, NULL, 500000 },
+	{ "malloc_mixed", NULL, malloc_mixed_run, NULL, 2000000 },
+	{ "timer_add_remove", NULL, timer_add_run, NULL, 200000 },
+	{ "timer_add_run", NULL, timer_fire_run, NULL, 200000 },
+	{ "timer_add_remove_20000", NULL, timer_add_run, NULL, 20000 },
+	{ "timer_list_add_remove_20000", NULL, timer_list_add_run, NULL,
+	    20000 },
+	{ "conn_dispatch_100000", conn_setup, conn_dispatch_run,
+	    conn_teardown, 2000000 },
+	{ "conn_dispatch_cold_100000", conn_setup, conn_dispatch_cold_run,
+	    conn_teardown, 2000000 },
+	{ "json_parse", NULL, json_parse_run, NULL, 100000 },
+	{ "json_tobuf", json_tobuf_setup, json_tobuf_run, json_tobuf_teardown,
+	    100000 },
+	{ "handler_find_10", routes_10_setup, routes_run, routes_teardown,
+	    1000000 },
+	{ "handler_find_100", routes_100_setup, routes_run, routes_teardown,
+	    1000000 },
+	{ "handler_find_1000", routes_1000_setup, routes_run, routes_teardown,
+	    1000000 },
+	{ "ws_frame_build_64", NULL, ws_frame_small_run, NULL, 2000000 },
+	{ "ws_frame_build_65536", NULL, ws_frame_large_run, NULL, 100000 },
+	{ NULL, NULL, NULL, NULL, 0 },
+};
+
+static const char *request =
+    "GET /bench?id=1234&sort=asc HTTP/1.1\r\n"
+    "Host: localhost:8890\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:78.0) Firefox/78.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://localhost:8890/\r\n"
+    "Connection: keep-alive\r\n"
+    "Cookie: session=0123456789abcdef; theme=dark\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char *json =
+    "{\"id\":1234,\"name\":\"kore\",\"active\":true,\"score\":98.5,"
+    "\"tags\":[\"http\",\"tls\",\"websocket\",\"json\"],"
+    "\"owner\":{\"name\":\"joris\",\"email\":\"joris@coders.se\","
+    "\"uid\":1000,\"groups\":[\"wheel\",\"staff\",\"users\"]},"
+    "\"servers\":[{\"host\":\"10.0.0.1\",\"port\":443,\"tls\":true},"
+    "{\"host\":\"10.0.0.2\",\"port\":80,\"tls\":false},"
+    "{\"host\":\"10.0.0.3\",\"port\":8443,\"tls\":true}],"
+    "\"description\":\"An easy to use web application platform for "
+    "writing scalable web APIs in C.\",\"nothing\":null}";
+
+static struct connection	*conn;
+static struct kore_pool		pool;
+static struct kore_json		parsed;
+static struct kore_buf		*out;
+static struct kore_domain	*dom;
+static size_t			nroutes;
+static u_int64_t		timers_fired;
+static struct connection	**conns;
+static u_int32_t		*conn_order;
+static TAILQ_HEAD(, list_timer)	list_timers;
+static volatile u_int64_t	sink;
+
+void
+kore_worker_configure(void)
+{
+	int		i, r;
+	u_int64_t	start, ns[MICRO_RUNS];
+
+	for (i = 0; micros[i].name != NULL; i++) {
+		if (micros[i].setup != NULL)
+			micros[i].setup();
+
+		for (r = 0; r < MICRO_RUNS; r++) {
+			start = micro_now();
+			micros[i].run(micros[i].iterations);
+			ns[r] = micro_now() - start;
+		}
+
+		if (micros[i].teardown != NULL)
+			micros[i].teardown();
+
+		micro_report(&micros[i], ns);
+	}
+
+	kore_shutdown();
+}
+
+int
+page(struct http_request *req)
+{
+	http_response(req, 200, NULL, 0);
+	return (KORE_RESULT_OK);
+}
+
+static u_int64_t
+micro_now(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000000 + (u_int64_t)ts.tv_nsec);
+}
+
+static int
+micro_cmp(const void *a, const void *b)
+{
+	u_int64_t	x = *(const u_int64_t *)a;
+	u_int64_t	y = *(const u_int64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Best and median of the runs, the best run is the least disturbed one. */
+static void
+micro_report(struct micro *m, u_int64_t *ns)
+{
+	double		best, median;
+
+	qsort(ns, MICRO_RUNS, sizeof(ns[0]), micro_cmp);
+
+	best = (double)ns[0] / m->iterations;
+	median = (double)ns[MICRO_RUNS / 2] / m->iterations;
+
+	printf("{\"bench\":\"%s\",\"iterations\":%" PRIu64 ",\"runs\":%d,"
+	    "\"ns_op\":%.2f,\"ns_op_median\":%.2f,\"ops_sec\":%.0f}\n",
+	    m->name, m->iterations, MICRO_RUNS, best, median, 1e9 / best);
+	fflush(stdout);
+}
+
+static void
+header_recv_setup(void)
+{
+	struct kore_server	*srv;
+
+	srv = LIST_FIRST(&kore_servers);
+	conn = kore_connection_new(LIST_FIRST(&srv->listeners));
+	conn->family = AF_INET;
+	conn->proto = CONN_PROTO_HTTP;
+	conn->state = CONN_STATE_ESTABLISHED;
+}
+
+static void
+header_recv_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct netbuf		nb;
+	size_t			len;
+	struct http_request	*req;
+
+	len = strlen(request);
+	memset(&nb, 0, sizeof(nb));
+
+	for (i = 0; i < n; i++) {
+		nb.owner = conn;
+		nb.buf = net_recvbuf_get(http_header_max, &nb.m_len);
+		nb.b_len = http_header_max;
+		nb.s_off = len;
+		memcpy(nb.buf, request, len);
+
+		if (http_header_recv(&nb) != KORE_RESULT_OK)
+			fatal("http_header_recv failed");
+
+		if ((req = TAILQ_FIRST(&conn->http_requests)) == NULL)
+			fatal("http_header_recv did not create a request");
+
+		http_request_free(req);
+
+		if (nb.buf != NULL)
+			net_recvbuf_put(nb.buf);
+	}
+}
+
+static void
+pool_setup(void)
+{
+	kore_pool_init(&pool, "micro", 128, 64);
+}
+
+static void
+pool_run(u_int64_t n)
+{
+	u_int64_t	i;
+	void		*p;
+
+	for (i = 0; i < n; i++) {
+		p = kore_pool_get(&pool);
+		sink += (uintptr_t)p;
+		kore_pool_put(&pool, p);
+	}
+}
+
+static void
+pool_batch_run(u_int64_t n)
+{
+	u_int64_t	i;
+	int		j;
+	void		*p[64];
+
+	for (i = 0; i < n; i += 64) {
+		for (j = 0; j < 64; j++)
+			p[j] = kore_pool_get(&pool);
+		for (j = 0; j < 64; j++)
+			kore_pool_put(&pool, p[j]);
+	}
+}
+
+static void
+pool_teardown(void)
+{
+	kore_pool_cleanup(&pool);
+}
+
+static void
+malloc_run(u_int64_t n, size_t len)
+{
+	u_int64_t	i;
+	void		*p;
+
+	for (i = 0; i < n; i++) {
+		p = kore_malloc(len);
+		sink += (uintptr_t)p;
+		kore_free(p);
+	}
+}
+
+static void
+malloc_small_run(u_int64_t n)
+{
+	malloc_run(n, 64);
+}
+
+static void
+malloc_medium_run(u_int64_t n)
+{
+	malloc_run(n, 1024);
+}
+
+static void
+malloc_large_run(u_int64_t n)
+{
+	malloc_run(n, 16384);
+}
+
+/* Keeps a window of live allocations of varying size classes around. */
+static void
+malloc_mixed_run(u_int64_t n)
+{
+	u_int64_t	i;
+	size_t		idx;
+	void		*p[256];
+
+	memset(p, 0, sizeof(p));
+
+	for (i = 0; i < n; i++) {
+		idx = i & 255;
+		kore_free(p[idx]);
+		p[idx] = kore_malloc(8 << ((i * 7) % 10));
+	}
+
+	for (idx = 0; idx < 256; idx++)
+		kore_free(p[idx]);
+}
+
+static void
+timer_cb(void *arg, u_int64_t now)
+{
+	timers_fired++;
+}
+
+static void
+timer_add_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct kore_timer	**t;
+
+	t = kore_calloc(n, sizeof(*t));
+
+	for (i = 0; i < n; i++) {
+		t[i] = kore_timer_add(timer_cb, 1000 + ((i * 7919) % 600000),
+		    NULL, KORE_TIMER_ONESHOT);
+	}
+
+	for (i = 0; i < n; i++)
+		kore_timer_remove(t[i]);
+
+	kore_free(t);
+}
+
+static void
+timer_fire_run(u_int64_t n)
+{
+	u_int64_t	i;
+
+	timers_fired = 0;
+
+	for (i = 0; i < n; i++)
+		kore_timer_add(timer_cb, 0, NULL, KORE_TIMER_ONESHOT);
+
+	while (timers_fired < n)
+		kore_timer_run(kore_time_ms());
+}
+
+/*
+ * Same workload as timer_add_run against the sorted list that the
+ * timer wheel replaced, inserting is a walk over the list.
+ */
+static void
+timer_list_add_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct list_timer	**t, *lt;
+
+	TAILQ_INIT(&list_timers);
+	t = kore_calloc(n, sizeof(*t));
+
+	for (i = 0; i < n; i++) {
+		t[i] = kore_malloc(sizeof(*t[i]));
+		t[i]->nextrun = kore_time_ms() + 1000 + ((i * 7919) % 600000);
+
+		TAILQ_FOREACH(lt, &list_timers, list) {
+			if (lt->nextrun > t[i]->nextrun) {
+				TAILQ_INSERT_BEFORE(lt, t[i], list);
+				break;
+			}
+		}
+
+		if (lt == NULL)
+			TAILQ_INSERT_TAIL(&list_timers, t[i], list);
+	}
+
+	for (i = 0; i < n; i++) {
+		TAILQ_REMOVE(&list_timers, t[i], list);
+		kore_free(t[i]);
+	}
+
+	kore_free(t);
+}
+
+/*
+ * A worker with MICRO_CONNECTIONS open connections, events arrive for
+ * them in random order so every dispatch misses the cache.
+ */
+static void
+conn_setup(void)
+{
+	u_int32_t		i, j, tmp;
+	struct kore_server	*srv;
+
+	srv = LIST_FIRST(&kore_servers);
+	conns = kore_calloc(MICRO_CONNECTIONS, sizeof(*conns));
+	conn_order = kore_calloc(MICRO_CONNECTIONS, sizeof(*conn_order));
+
+	for (i = 0; i < MICRO_CONNECTIONS; i++) {
+		conns[i] = kore_connection_new(LIST_FIRST(&srv->listeners));
+		conns[i]->fd = -1;
+		conns[i]->family = AF_INET;
+		conns[i]->state = CONN_STATE_ESTABLISHED;
+		conns[i]->handle = kore_connection_handle;
+		conn_order[i] = i;
+		worker_active_connections++;
+	}
+
+	srandom(1);
+	for (i = MICRO_CONNECTIONS - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		tmp = conn_order[i];
+		conn_order[i] = conn_order[j];
+		conn_order[j] = tmp;
+	}
+}
+
+/* What the event loop reads for a readable connection. */
+static void
+conn_dispatch_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct connection	*c;
+
+	for (i = 0; i < n; i++) {
+		c = conns[conn_order[i % MICRO_CONNECTIONS]];
+		if (c->evt.type != KORE_TYPE_CONNECTION)
+			continue;
+		c->evt.flags |= KORE_EVENT_READ;
+		if (c->state == CONN_STATE_ESTABLISHED && c->handle != NULL)
+			sink += c->fd + c->flags + c->idle_timer.start;
+	}
+}
+
+/* The same with one field from the cold part of the connection. */
+static void
+conn_dispatch_cold_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct connection	*c;
+
+	for (i = 0; i < n; i++) {
+		c = conns[conn_order[i % MICRO_CONNECTIONS]];
+		if (c->evt.type != KORE_TYPE_CONNECTION)
+			continue;
+		c->evt.flags |= KORE_EVENT_READ;
+		if (c->state == CONN_STATE_ESTABLISHED && c->handle != NULL) {
+			sink += c->fd + c->flags + c->idle_timer.start +
+			    c->addr.ipv4.sin_port;
+		}
+	}
+}
+
+static void
+conn_teardown(void)
+{
+	u_int32_t	i;
+
+	for (i = 0; i < MICRO_CONNECTIONS; i++)
+		kore_connection_remove(conns[i]);
+
+	kore_free(conns);
+	kore_free(conn_order);
+}
+
+static void
+json_parse_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct kore_json	j;
+	size_t			len;
+
+	len = strlen(json);
+
+	for (i = 0; i < n; i++) {
+		kore_json_init(&j, (const u_int8_t *)json, len);
+		if (!kore_json_parse(&j))
+			fatal("json_parse: %s", kore_json_strerror(&j));
+		kore_json_cleanup(&j);
+	}
+}
+
+static void
+json_tobuf_setup(void)
+{
+	kore_json_init(&parsed, (const u_int8_t *)json, strlen(json));
+	if (!kore_json_parse(&parsed))
+		fatal("json_parse: %s", kore_json_strerror(&parsed));
+
+	out = kore_buf_alloc(1024);
+}
+
+static void
+json_tobuf_run(u_int64_t n)
+{
+	u_int64_t	i;
+
+	for (i = 0; i < n; i++) {
+		kore_buf_reset(out);
+		kore_json_item_tobuf(parsed.root, out);
+	}
+}
+
+static void
+json_tobuf_teardown(void)
+{
+	kore_buf_free(out);
+	kore_json_cleanup(&parsed);
+}
+
+/*
+ * Static routes spread over a handful of prefixes plus a few regex
+ * routes, looked up round robin together with a path only a regex takes.
+ */
+static void
+routes_setup(size_t n)
+{
+	size_t		i;
+	char		path[64];
+
+	dom = kore_domain_new("micro.routes");
+	if (!kore_domain_attach(dom, LIST_FIRST(&kore_servers)))
+		fatal("failed to attach micro.routes");
+
+	nroutes = n;
+
+	for (i = 0; i < n; i++) {
+		(void)snprintf(path, sizeof(path), "/api/v%zu/resource/%zu",
+		    i % 4, i);
+		if (!kore_module_handler_new(dom, path, "page", NULL,
+		    HANDLER_TYPE_STATIC))
+			fatal("failed to add route %s", path);
+	}
+
+	for (i = 0; i < 4; i++) {
+		(void)snprintf(path, sizeof(path),
+		    "^/api/v%zu/users/[0-9]+$", i);
+		if (!kore_module_handler_new(dom, path, "page", NULL,
+		    HANDLER_TYPE_DYNAMIC))
+			fatal("failed to add route %s", path);
+	}
+
+	kore_module_routes_build(dom);
+}
+
+static void
+routes_10_setup(void)
+{
+	routes_setup(10);
+}
+
+static void
+routes_100_setup(void)
+{
+	routes_setup(100);
+}
+
+static void
+routes_1000_setup(void)
+{
+	routes_setup(1000);
+}
+
+static void
+routes_run(u_int64_t n)
+{
+	u_int64_t		i;
+	struct http_request	req;
+	char			paths[8][64];
+
+	memset(&req, 0, sizeof(req));
+
+	for (i = 0; i < 7; i++) {
+		(void)snprintf(paths[i], sizeof(paths[i]),
+		    "/api/v%zu/resource/%zu", (size_t)((i * nroutes / 7) % 4),
+		    (size_t)(i * nroutes / 7));
+	}
+	(void)snprintf(paths[7], sizeof(paths[7]), "/api/v2/users/1234");
+
+	for (i = 0; i < n; i++) {
+		req.path = paths[i & 7];
+		if (kore_module_handler_find(&req, dom) == NULL)
+			fatal("no route for %s", req.path);
+	}
+}
+
+static void
+routes_teardown(void)
+{
+	kore_domain_free(dom);
+	dom = NULL;
+}
+
+static void
+ws_frame_run(u_int64_t n, size_t len)
+{
+	u_int64_t		i;
+	struct kore_buf		frame;
+	u_int8_t		*payload;
+
+	payload = kore_calloc(1, len);
+	kore_buf_init(&frame, len + 16);
+
+	for (i = 0; i < n; i++) {
+		kore_buf_reset(&frame);
+		kore_websocket_frame_build(&frame, WEBSOCKET_OP_BINARY,
+		    payload, len);
+	}
+
+	kore_buf_cleanup(&frame);
+	kore_free(payload);
+}
+
+static void
+ws_frame_small_run(u_int64_t n)
+{
+	ws_frame_run(n, 64);
+}
+
+static void
+ws_frame_large_run(u_int64_t n)
+{
+	ws_frame_run(n, 65536);
+}
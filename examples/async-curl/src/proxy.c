@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * This example streams the upstream response to the client as it
+ * arrives instead of buffering it first, so it works for bodies of
+ * any size. When the client reads slower than the upstream sends
+ * the transfer is paused (see curl_stream_hwm).
+ */
+
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/curl.h>
+
+int		proxy(struct http_request *);
+
+static int	state_setup(struct http_request *);
+static int	state_result(struct http_request *);
+
+static struct http_state states[] = {
+	KORE_HTTP_STATE(state_setup),
+	KORE_HTTP_STATE(state_result)
+};
+
+int
+proxy(struct http_request *req)
+{
+	return (http_state_run(states, 2, req));
+}
+
+static int
+state_setup(struct http_request *req)
+{
+	struct kore_curl	*client;
+
+	client = http_state_create(req, sizeof(*client), NULL);
+
+	if (!kore_curl_init(client,
+	    "https://cdn.openbsd.org/pub/OpenBSD/7.0/amd64/bsd.rd",
+	    KORE_CURL_ASYNC)) {
+		http_response(req, 500, NULL, 0);
+		return (HTTP_STATE_COMPLETE);
+	}
+
+	kore_curl_stream_proxy(client, req);
+	kore_curl_run(client);
+
+	req->fsm_state = 1;
+	return (HTTP_STATE_RETRY);
+}
+
+static int
+state_result(struct http_request *req)
+{
+	struct kore_curl	*client;
+
+	client = http_state_get(req);
+
+	if (!kore_curl_success(client)) {
+		kore_curl_logerror(client);
+		if (!(client->flags & KORE_CURL_FLAG_PROXY_STARTED))
+			http_response(req, 502, NULL, 0);
+	}
+
+	kore_curl_cleanup(client);
+
+	return (HTTP_STATE_COMPLETE);
+}
@@ -14,15 +14,37 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <kore/kore.h>
-#include <kore/http.h>
+#include <kore/kore.hpp>
 
 #include "example_class.h"
 
 extern "C" {
+	int		init(int);
 	int		page(struct http_request *);
 }
 
+static int	hello(kore::request &, std::optional<std::string_view>);
+static int	sum(kore::request &, int32_t, int32_t);
+
+/* Arguments of the routes below, with their type. */
+static constexpr auto name = kore::arg<std::optional<std::string_view>>("name");
+static constexpr auto lhs = kore::arg<int32_t>("a");
+static constexpr auto rhs = kore::arg<int32_t>("b");
+
+static constexpr kore::route routes[] = {
+	kore::get<hello, name>("/hello"),
+	kore::post<sum, lhs, rhs>("/sum"),
+};
+
+int
+init(int state)
+{
+	if (state == KORE_MODULE_LOAD)
+		return (kore::install(routes));
+
+	return (KORE_RESULT_OK);
+}
+
 int
 page(struct http_request *req)
 {
@@ -34,3 +56,37 @@ page(struct http_request *req)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+hello(kore::request &req, std::optional<std::string_view> who)
+{
+	kore::buf	out(1024);
+
+	out.append("Hello ").append(who.value_or("world"));
+
+	if (auto agent = req.header("user-agent"))
+		out.append(" from ").append(*agent);
+
+	out.append("\n");
+	req.respond(200, std::move(out));
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+sum(kore::request &req, int32_t x, int32_t y)
+{
+	kore::buf		out(1024);
+	kore::json_writer	json(out);
+
+	json.object_begin().key("sum").integer((int64_t)x + y).object_end();
+	if (!json.finish()) {
+		req.respond(500);
+		return (KORE_RESULT_OK);
+	}
+
+	req.response_header("content-type", "application/json");
+	req.respond(200, std::move(out));
+
+	return (KORE_RESULT_OK);
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compares kore_json_init() against kore_json_init_arena() on a few
+ * generated documents of around 200KB each.
+ *
+ * The arena parser writes into its input so every round parses a
+ * fresh copy, the copy is included in its timings.
+ *
+ * It also times lookups in an object of 200 members with
+ * kore_json_find() against a path from kore_json_path_compile().
+ */
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#define BENCH_ROUNDS		200
+#define BENCH_MEMBERS		200
+#define BENCH_LOOKUPS		1000000
+
+int		bench(struct http_request *);
+
+static void	bench_records(struct kore_buf *, int);
+static void	bench_numbers(struct kore_buf *);
+static void	bench_strings(struct kore_buf *);
+static void	bench_run(struct kore_buf *, const char *, struct kore_buf *);
+static void	bench_lookup(struct kore_buf *, struct kore_buf *);
+
+int
+bench(struct http_request *req)
+{
+	struct kore_buf		out, doc;
+
+	kore_buf_init(&out, 1024);
+	kore_buf_init(&doc, 256 * 1024);
+
+	kore_buf_appendf(&out, "%-10s %8s %12s %12s %8s\n",
+	    "document", "bytes", "heap MB/s", "arena MB/s", "speedup");
+
+	bench_records(&doc, 0);
+	bench_run(&out, "records", &doc);
+
+	bench_records(&doc, 1);
+	bench_run(&out, "pretty", &doc);
+
+	bench_numbers(&doc);
+	bench_run(&out, "numbers", &doc);
+
+	bench_strings(&doc);
+	bench_run(&out, "strings", &doc);
+
+	bench_lookup(&out, &doc);
+
+	http_response_header(req, "content-type", "text/plain");
+	http_response(req, HTTP_STATUS_OK, out.data, out.offset);
+
+	kore_buf_cleanup(&doc);
+	kore_buf_cleanup(&out);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+bench_run(struct kore_buf *out, const char *name, struct kore_buf *doc)
+{
+	int			i;
+	u_int8_t		*copy;
+	struct kore_json	json;
+	u_int64_t		start, heap, arena;
+
+	copy = kore_malloc(doc->offset);
+
+	start = kore_time_us();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		kore_json_init(&json, doc->data, doc->offset);
+		if (!kore_json_parse(&json))
+			fatal("%s: %s", name, kore_json_strerror(&json));
+		kore_json_cleanup(&json);
+	}
+	heap = kore_time_us() - start;
+
+	start = kore_time_us();
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		memcpy(copy, doc->data, doc->offset);
+		kore_json_init_arena(&json, copy, doc->offset);
+		if (!kore_json_parse(&json))
+			fatal("%s: %s", name, kore_json_strerror(&json));
+		kore_json_cleanup(&json);
+	}
+	arena = kore_time_us() - start;
+
+	kore_free(copy);
+
+	kore_buf_appendf(out, "%-10s %8zu %12.1f %12.1f %7.2fx\n", name,
+	    doc->offset,
+	    ((double)doc->offset * BENCH_ROUNDS) / (double)MAX(heap, 1),
+	    ((double)doc->offset * BENCH_ROUNDS) / (double)MAX(arena, 1),
+	    (double)heap / (double)MAX(arena, 1));
+}
+
+static void
+bench_lookup(struct kore_buf *out, struct kore_buf *doc)
+{
+	int			i;
+	struct kore_json	json;
+	struct kore_json_path	*path;
+	u_int64_t		start, find, compiled;
+
+	kore_buf_reset(doc);
+	kore_buf_appendf(doc, "{");
+
+	for (i = 0; i < BENCH_MEMBERS; i++)
+		kore_buf_appendf(doc, "%s\"field_%d\": %d", i ? "," : "", i, i);
+
+	kore_buf_appendf(doc, "}");
+
+	kore_json_init(&json, doc->data, doc->offset);
+	if (!kore_json_parse(&json))
+		fatal("lookup: %s", kore_json_strerror(&json));
+
+	start = kore_time_us();
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		if (kore_json_find(json.root, "field_150",
+		    KORE_JSON_TYPE_NUMBER) == NULL)
+			fatal("lookup: field_150 not found");
+	}
+	find = kore_time_us() - start;
+
+	if ((path = kore_json_path_compile("field_150")) == NULL)
+		fatal("lookup: failed to compile path");
+
+	start = kore_time_us();
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		if (kore_json_find_path(json.root, path,
+		    KORE_JSON_TYPE_NUMBER) == NULL)
+			fatal("lookup: field_150 not found");
+	}
+	compiled = kore_time_us() - start;
+
+	kore_json_path_free(path);
+	kore_json_cleanup(&json);
+
+	kore_buf_appendf(out, "\n%-10s %8s %12s %12s %8s\n",
+	    "lookup", "members", "find ns", "path ns", "speedup");
+	kore_buf_appendf(out, "%-10s %8d %12.1f %12.1f %7.2fx\n", "object",
+	    BENCH_MEMBERS,
+	    ((double)find * 1000) / BENCH_LOOKUPS,
+	    ((double)compiled * 1000) / BENCH_LOOKUPS,
+	    (double)find / (double)MAX(compiled, 1));
+}
+
+/* An API style response: an array of small objects. */
+static void
+bench_records(struct kore_buf *doc, int pretty)
+{
+	int		i;
+	const char	*nl, *in;
+
+	nl = pretty ? "\n" : "";
+	in = pretty ? "        " : "";
+
+	kore_buf_reset(doc);
+	kore_buf_appendf(doc, "{%s\"users\": [", nl);
+
+	for (i = 0; i < 900; i++) {
+		kore_buf_appendf(doc, "%s%s{%s"
+		    "%s\"id\": %d,%s"
+		    "%s\"name\": \"user %d\",%s"
+		    "%s\"email\": \"user%d@example.com\",%s"
+		    "%s\"active\": %s,%s"
+		    "%s\"score\": %d.%02d,%s"
+		    "%s\"tags\": [\"admin\", \"beta\"],%s"
+		    "%s\"address\": {\"street\": \"Main street %d\", "
+		    "\"city\": \"Amsterdam\"}%s"
+		    "%s}", i ? "," : "", nl, nl,
+		    in, i, nl, in, i, nl, in, i, nl,
+		    in, (i % 3) ? "true" : "false", nl,
+		    in, i * 7, i % 100, nl, in, nl, in, i, nl, in);
+	}
+
+	kore_buf_appendf(doc, "%s]%s}", nl, nl);
+}
+
+static void
+bench_numbers(struct kore_buf *doc)
+{
+	int		i;
+
+	kore_buf_reset(doc);
+	kore_buf_appendf(doc, "[");
+
+	for (i = 0; i < 16000; i++) {
+		kore_buf_appendf(doc, "%s%d.%04d", i ? "," : "",
+		    i * 31, (i * 7919) % 10000);
+	}
+
+	kore_buf_appendf(doc, "]");
+}
+
+static void
+bench_strings(struct kore_buf *doc)
+{
+	int		i;
+
+	kore_buf_reset(doc);
+	kore_buf_appendf(doc, "[");
+
+	for (i = 0; i < 1800; i++) {
+		kore_buf_appendf(doc, "%s\"message %d: the quick brown fox "
+		    "jumps over the lazy dog, \\\"twice\\\"\\nand once "
+		    "more for good measure\\t(%d)\"", i ? "," : "", i, i);
+	}
+
+	kore_buf_appendf(doc, "]");
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Writes a large JSON array of records with http_response_json(),
+ * without ever holding more than a piece of it in memory.
+ *
+ * The handler is called again every time it had to wait for its output
+ * to go out, so it keeps track of where it was in its state.
+ */
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#define STREAM_RECORDS		100000
+
+struct stream_state {
+	int			next;
+	int			done;
+	struct kore_json_writer	*writer;
+};
+
+int		stream(struct http_request *);
+
+static void	stream_record(struct kore_json_writer *, int);
+
+int
+stream(struct http_request *req)
+{
+	struct stream_state		*state;
+
+	if (!http_state_exists(req)) {
+		state = http_state_create(req, sizeof(*state), NULL);
+		state->writer = http_response_json(req, HTTP_STATUS_OK, 0);
+		kore_json_writer_array_begin(state->writer);
+	} else {
+		state = http_state_get(req);
+	}
+
+	while (state->next < STREAM_RECORDS) {
+		if (http_response_json_ready(req) == KORE_RESULT_RETRY)
+			return (KORE_RESULT_RETRY);
+		stream_record(state->writer, state->next++);
+	}
+
+	if (!state->done) {
+		kore_json_writer_array_end(state->writer);
+		state->done = 1;
+	}
+
+	return (http_response_json_end(req));
+}
+
+static void
+stream_record(struct kore_json_writer *writer, int id)
+{
+	kore_json_writer_object_begin(writer);
+
+	kore_json_writer_key(writer, "id");
+	kore_json_writer_integer(writer, id);
+
+	kore_json_writer_key(writer, "name");
+	kore_json_writer_string(writer, "user \"quoted\"\n");
+
+	kore_json_writer_key(writer, "score");
+	kore_json_writer_number(writer, id / 8.0);
+
+	kore_json_writer_key(writer, "active");
+	kore_json_writer_literal(writer,
+	    (id % 2) ? KORE_JSON_TRUE : KORE_JSON_FALSE);
+
+	kore_json_writer_object_end(writer);
+}
@@ -0,0 +1,111 @@
+#include <yajl/yajl_gen.h>
+#include <yajl/yajl_tree.h>
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/jsonrpc.h>
+
+int	init(int);
+int	v2(struct http_request *);
+
+static int	echo(struct jsonrpc_request *);
+static int	primes(struct jsonrpc_request *);
+
+int
+init(int state)
+{
+	if (state == KORE_MODULE_UNLOAD)
+		return (KORE_RESULT_OK);
+
+	jsonrpc_method_add("echo", echo, 0);
+	jsonrpc_method_add("primes", primes, JSONRPC_METHOD_TASK);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Takes single calls as well as batches, the "primes" calls of a batch
+ * each run on their own task thread.
+ */
+int
+v2(struct http_request *req)
+{
+	if (req->method != HTTP_METHOD_POST) {
+		http_response_header(req, "allow", "POST");
+		http_response(req, HTTP_STATUS_METHOD_NOT_ALLOWED, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	return (jsonrpc_dispatch(req));
+}
+
+static int
+write_params(struct jsonrpc_request *req, void *ctx)
+{
+	size_t		i;
+	char		*str;
+	int		status;
+
+	if ((status = yajl_gen_array_open(req->gen)) != 0)
+		return (status);
+
+	for (i = 0; i < req->params->u.array.len; i++) {
+		str = YAJL_GET_STRING(req->params->u.array.values[i]);
+		status = yajl_gen_string(req->gen,
+		    (unsigned char *)str, strlen(str));
+		if (status != 0)
+			return (status);
+	}
+
+	return (yajl_gen_array_close(req->gen));
+}
+
+static int
+write_count(struct jsonrpc_request *req, void *ctx)
+{
+	return (yajl_gen_integer(req->gen, *(long long *)ctx));
+}
+
+static int
+echo(struct jsonrpc_request *req)
+{
+	size_t		i;
+
+	if (!YAJL_IS_ARRAY(req->params))
+		return (jsonrpc_error(req, JSONRPC_INVALID_PARAMS, NULL));
+
+	for (i = 0; i < req->params->u.array.len; i++) {
+		if (!YAJL_IS_STRING(req->params->u.array.values[i]))
+			return (jsonrpc_error(req,
+			    JSONRPC_INVALID_PARAMS, NULL));
+	}
+
+	return (jsonrpc_result(req, write_params, NULL));
+}
+
+/* Counts the primes below params[0], slow on purpose. */
+static int
+primes(struct jsonrpc_request *req)
+{
+	yajl_val	v;
+	long long	n, i, j, count;
+
+	if (!YAJL_IS_ARRAY(req->params) || req->params->u.array.len != 1)
+		return (jsonrpc_error(req, JSONRPC_INVALID_PARAMS, NULL));
+
+	v = req->params->u.array.values[0];
+	if (!YAJL_IS_INTEGER(v) || (n = YAJL_GET_INTEGER(v)) < 0 ||
+	    n > 10000000)
+		return (jsonrpc_error(req, JSONRPC_INVALID_PARAMS, NULL));
+
+	count = 0;
+	for (i = 2; i < n; i++) {
+		for (j = 2; j * j <= i; j++) {
+			if (i % j == 0)
+				break;
+		}
+		if (j * j > i)
+			count++;
+	}
+
+	return (jsonrpc_result(req, write_count, &count));
+}
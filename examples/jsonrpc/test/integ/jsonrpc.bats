@@ -31,13 +31,17 @@ query_with_content_type() {
 	    -d "$2" \
 	    -s -S \
 	    --insecure \
-	    "https://127.0.0.1:8888/v1"
+	    "https://127.0.0.1:8888/${3:-v1}"
 }
 
 query() {
 	query_with_content_type "application/json" "$1"
 }
 
+query_v2() {
+	query_with_content_type "application/json" "$1" v2
+}
+
 grepstr() {
 	declare result=$1
 	shift
@@ -119,3 +123,33 @@ printrep() {
 	grepstr "$result" '"result"[ \t\n]*:[ \t\n]*[[ \t\n]*"foobar"[ \t\n]*]'
 	grepstr "$result" '"id"[ \t\n]*:[ \t\n]*6'
 }
+
+@test "batches give back a response per call" {
+	query='[{"jsonrpc":"2.0","method":"echo","params":["a"],"id":1},{"jsonrpc":"2.0","method":"primes","params":[100],"id":2}]'
+	result=`query_v2 "$query"`
+	printrep "$query" "$result"
+	grepstr "$result" '"id"[ \t\n]*:[ \t\n]*1'
+	grepstr "$result" '"result"[ \t\n]*:[ \t\n]*25'
+}
+
+@test "batches skip notifications" {
+	query='[{"jsonrpc":"2.0","method":"echo","params":["a"]}]'
+	result=`query_v2 "$query"`
+	printrep "$query" "$result"
+	[ "$result" = "" ]
+}
+
+@test "batches report invalid calls" {
+	query='[1,{"jsonrpc":"2.0","method":"foobar","id":"foo"}]'
+	result=`query_v2 "$query"`
+	printrep "$query" "$result"
+	grepstr "$result" '"code"[ \t\n]*:[ \t\n]*-32600'
+	grepstr "$result" '"code"[ \t\n]*:[ \t\n]*-32601'
+}
+
+@test "empty batches raise errors" {
+	query='[]'
+	result=`query_v2 "$query"`
+	printrep "$query" "$result"
+	grepstr "$result" '"error"[ \t\n]*:[ \t\n]*{[ \t\n]*"code"'
+}
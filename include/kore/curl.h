@@ -27,16 +27,24 @@ extern "C" {
 
 #define KORE_CURL_TIMEOUT			60
 #define KORE_CURL_RECV_MAX			(1024 * 1024 * 2)
+#define KORE_CURL_HANDLE_POOL			32
+#define KORE_CURL_STREAM_HWM			(256 * 1024)
 
 #define KORE_CURL_FLAG_HTTP_PARSED_HEADERS	0x0001
 #define KORE_CURL_FLAG_BOUND			0x0002
+#define KORE_CURL_FLAG_PROXY			0x0004
+#define KORE_CURL_FLAG_PROXY_STARTED		0x0008
+#define KORE_CURL_FLAG_COALESCED		0x0010
 
 #define KORE_CURL_SYNC				0x1000
 #define KORE_CURL_ASYNC				0x2000
+#define KORE_CURL_COALESCE			0x4000
 
 #define KORE_CURL_TYPE_CUSTOM			1
 #define KORE_CURL_TYPE_HTTP_CLIENT		2
 
+struct kore_curl_flight;
+
 struct kore_curl {
 	int			type;
 	int			flags;
@@ -54,6 +62,7 @@ struct kore_curl {
 
 	/* For the simplified HTTP api. */
 	struct {
+		int				method;
 		long				status;
 		struct curl_slist		*hdrlist;
 
@@ -63,14 +72,32 @@ struct kore_curl {
 		TAILQ_HEAD(, http_header)	resp_hdrs;
 	} http;
 
+	/* For streamed responses, see kore_curl_stream(). */
+	struct {
+		void		*arg;
+		int		(*cb)(struct kore_curl *,
+				    const void *, size_t, void *);
+	} stream;
+
+	/* The shared transfer for KORE_CURL_COALESCE. */
+	struct kore_curl_flight		*flight;
+	LIST_ENTRY(kore_curl)		member;
+
 	LIST_ENTRY(kore_curl)		list;
 };
 
 extern u_int16_t	kore_curl_timeout;
 extern u_int64_t	kore_curl_recv_max;
+extern u_int32_t	kore_curl_handle_pool;
+extern u_int64_t	kore_curl_stream_hwm;
+extern u_int64_t	kore_curl_transfers;
+extern u_int64_t	kore_curl_reused;
+extern u_int64_t	kore_curl_connects;
+extern u_int64_t	kore_curl_coalesced;
 
 void	kore_curl_sysinit(void);
 void	kore_curl_do_timeout(void);
+int	kore_curl_running(void);
 void	kore_curl_run_scheduled(void);
 void	kore_curl_run(struct kore_curl *);
 void	kore_curl_cleanup(struct kore_curl *);
@@ -97,6 +124,11 @@ void	kore_curl_bind_request(struct kore_curl *, struct http_request *);
 void	kore_curl_bind_callback(struct kore_curl *,
 	    void (*cb)(struct kore_curl *, void *), void *);
 
+void	kore_curl_stream(struct kore_curl *,
+	    int (*cb)(struct kore_curl *, const void *, size_t, void *), void *);
+void	kore_curl_stream_resume(struct kore_curl *);
+void	kore_curl_stream_proxy(struct kore_curl *, struct http_request *);
+
 const char	*kore_curl_strerror(struct kore_curl *);
 
 #if defined(__cplusplus)
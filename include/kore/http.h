@@ -39,6 +39,7 @@ extern "C" {
 #define HTTP_USERAGENT_LEN	256
 #define HTTP_REFERER_LEN	256
 #define HTTP_REQ_HEADER_MAX	25
+#define HTTP_REQ_HEADER_SLOTS	16
 #define HTTP_MAX_QUERY_ARGS	20
 #define HTTP_MAX_COOKIES	10
 #define HTTP_MAX_COOKIENAME	255
@@ -53,6 +54,22 @@ extern "C" {
 #define HTTP_BOUNDARY_MAX	80
 #define HTTP_HEADER_TIMEOUT	10
 #define HTTP_BODY_TIMEOUT	60
+#define HTTP_COMPRESS_LEVEL	6
+#define HTTP_COMPRESS_MIN	1024
+#define HTTP_COMPRESS_FILE_MAX	(8 * 1024 * 1024)
+#define HTTP_RANGE_MAX		16
+#define HTTP_ARENA_PAGE		4096
+
+#define HTTP_CACHE_ENTRIES	128
+#define HTTP_CACHE_ENTRY_MAX	(64 * 1024)
+#define HTTP_CACHE_KEY_MAX	512
+#define HTTP_CACHE_VARY_MAX	8
+
+#define HTTP_CACHE_NONE		0
+#define HTTP_CACHE_FILLING	1
+
+#define HTTP_MULTIPART_HEADER_MAX	4096
+#define HTTP_MULTIPART_FIELD_MAX	(1024 * 1024)
 
 #define HTTP_ARG_TYPE_RAW	0
 #define HTTP_ARG_TYPE_BYTE	1
@@ -81,10 +98,58 @@ struct http_runlock {
 	LIST_HEAD(, http_runlock_queue)	queue;
 };
 
+/*
+ * Well-known request headers, these get a fixed slot in the request at
+ * parse time so looking them up needs no string comparison.
+ */
+enum http_header_id {
+	HTTP_HEADER_ACCEPT = 0,
+	HTTP_HEADER_ACCEPT_ENCODING,
+	HTTP_HEADER_ACCEPT_LANGUAGE,
+	HTTP_HEADER_AUTHORIZATION,
+	HTTP_HEADER_CACHE_CONTROL,
+	HTTP_HEADER_CONNECTION,
+	HTTP_HEADER_CONTENT_ENCODING,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_CONTENT_TYPE,
+	HTTP_HEADER_COOKIE,
+	HTTP_HEADER_EXPECT,
+	HTTP_HEADER_HOST,
+	HTTP_HEADER_IF_MATCH,
+	HTTP_HEADER_IF_MODIFIED_SINCE,
+	HTTP_HEADER_IF_NONE_MATCH,
+	HTTP_HEADER_IF_RANGE,
+	HTTP_HEADER_IF_UNMODIFIED_SINCE,
+	HTTP_HEADER_ORIGIN,
+	HTTP_HEADER_PRAGMA,
+	HTTP_HEADER_RANGE,
+	HTTP_HEADER_REFERER,
+	HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS,
+	HTTP_HEADER_SEC_WEBSOCKET_KEY,
+	HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL,
+	HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+	HTTP_HEADER_TE,
+	HTTP_HEADER_TRANSFER_ENCODING,
+	HTTP_HEADER_UPGRADE,
+	HTTP_HEADER_USER_AGENT,
+	HTTP_HEADER_X_FORWARDED_FOR,
+	HTTP_HEADER_X_FORWARDED_PROTO,
+	HTTP_HEADER_X_REAL_IP,
+	HTTP_HEADER_X_REQUESTED_WITH,
+	HTTP_HEADER_ID_MAX
+};
+
+struct http_range {
+	off_t			start;
+	off_t			len;
+};
+
 struct http_header {
 	char			*header;
 	char			*value;
+	u_int32_t		hash;
 
+	struct http_header		*next;
 	TAILQ_ENTRY(http_header)	list;
 };
 
@@ -198,6 +263,7 @@ struct http_file {
 	size_t			position;
 	size_t			offset;
 	size_t			length;
+	int			fd;
 	struct http_request	*req;
 	TAILQ_ENTRY(http_file)	list;
 };
@@ -217,13 +283,24 @@ struct http_file {
 #define HTTP_REQUEST_COMPLETE		0x0001
 #define HTTP_REQUEST_DELETE		0x0002
 #define HTTP_REQUEST_SLEEPING		0x0004
+#define HTTP_REQUEST_STARTED		0x0008
+#define HTTP_REQUEST_CACHE_CHECKED	0x0010
 #define HTTP_REQUEST_EXPECT_BODY	0x0020
 #define HTTP_REQUEST_RETAIN_EXTRA	0x0040
 #define HTTP_REQUEST_NO_CONTENT_LENGTH	0x0080
 #define HTTP_REQUEST_AUTHED		0x0100
+#define HTTP_REQUEST_BODY_STREAM	0x0200
+#define HTTP_REQUEST_BODY_PAUSED	0x0400
+#define HTTP_REQUEST_BODY_RECEIVED	0x0800
+
+#define HTTP_PRIO_HIGH			0
+#define HTTP_PRIO_NORMAL		1
+#define HTTP_PRIO_LOW			2
+#define HTTP_PRIO_MAX			3
 
 #define HTTP_VERSION_1_1		0x1000
 #define HTTP_VERSION_1_0		0x2000
+#define HTTP_VERSION_2			0x4000
 
 #define HTTP_VALIDATOR_IS_REQUEST	0x8000
 
@@ -235,6 +312,10 @@ struct http_file {
 struct reqcall;
 struct kore_task;
 struct http_client;
+struct http2_stream;
+struct http_multipart;
+struct http_arena;
+struct http_json_stream;
 
 struct http_redirect {
 	regex_t				rctx;
@@ -243,15 +324,99 @@ struct http_redirect {
 	TAILQ_ENTRY(http_redirect)	list;
 };
 
+/*
+ * Set by the "cache" route option, see cache.c. The key of an entry
+ * includes the named query string arguments and request headers.
+ */
+struct http_cache_rule {
+	u_int64_t			ttl;
+	int				nargs;
+	int				nheaders;
+	char				*args[HTTP_CACHE_VARY_MAX];
+	char				*headers[HTTP_CACHE_VARY_MAX];
+};
+
+/*
+ * An immutable response body that can be sent to many clients at once,
+ * see http_response_body_ref().
+ */
+struct http_body_ref {
+	u_int8_t			*data;
+	size_t				length;
+	u_int32_t			refs;
+};
+
+struct http_cache_stats {
+	u_int64_t			hits;
+	u_int64_t			misses;
+	u_int64_t			stale;
+	u_int64_t			stores;
+};
+
+/*
+ * Per priority class scheduling counters, wait is the time between
+ * the request headers coming in and the handler first running.
+ */
+struct http_prio_stats {
+	u_int32_t			queued;
+	u_int64_t			started;
+	u_int64_t			shed;
+	u_int64_t			wait_total;
+	u_int64_t			wait_max;
+};
+
+/* Where a wakeup for a sleeping request came from. */
+#define HTTP_WAKEUP_OTHER		0
+#define HTTP_WAKEUP_TASK		1
+#define HTTP_WAKEUP_PGSQL		2
+#define HTTP_WAKEUP_CURL		3
+#define HTTP_WAKEUP_MAX			4
+
+struct http_wakeup_stats {
+	u_int64_t			posted;
+	u_int64_t			coalesced;
+};
+
+/*
+ * Where a request is in its life, kore_time_us() timestamps that stay 0
+ * until the request gets there. http_request_timing() turns these into
+ * the HTTP_TIMING_* phase durations.
+ */
+struct http_timing {
+	u_int64_t			accept;
+	u_int64_t			first_byte;
+	u_int64_t			headers;
+	u_int64_t			body;
+	u_int64_t			handler;
+	u_int64_t			response;
+	u_int64_t			flushed;
+	u_int64_t			sleep_start;
+	u_int64_t			slept;
+	u_int32_t			sleeps;
+};
+
+#define HTTP_TIMING_RECV		0	/* first byte to headers */
+#define HTTP_TIMING_BODY		1	/* headers to body received */
+#define HTTP_TIMING_QUEUE		2	/* received to handler start */
+#define HTTP_TIMING_APP			3	/* in the handler, not asleep */
+#define HTTP_TIMING_SLEEP		4	/* asleep while in the handler */
+#define HTTP_TIMING_SEND		5	/* response to last byte sent */
+#define HTTP_TIMING_MAX			6
+
 struct http_request {
 	u_int8_t			method;
 	u_int8_t			fsm_state;
 	u_int16_t			flags;
 	u_int16_t			status;
+	u_int8_t			prio;
+	u_int32_t			wakeup;
 	u_int64_t			ms;
+	u_int64_t			ready;
+	u_int64_t			queued_us;
 	u_int64_t			start;
 	u_int64_t			end;
 	u_int64_t			total;
+	struct http_timing		timing;
 	const char			*path;
 	const char			*host;
 	const char			*agent;
@@ -272,8 +437,24 @@ struct http_request {
 	struct http_runlock_queue	*runlock;
 	void				(*onfree)(struct http_request *);
 
+	int				(*body_cb)(struct http_request *,
+					    const void *, size_t);
+	struct kore_buf			*body_pending;
+	struct http_multipart		*multipart;
+	struct http_arena		*arena;
+	struct http_json_stream		*json_stream;
+
+	int				cache_state;
+	u_int64_t			cache_hash;
+	void				*cache_slot;
+
+#if defined(KORE_USE_HTTP2)
+	struct http2_stream		*h2_stream;
+#endif
+
 #if defined(KORE_USE_PYTHON)
 	void				*py_req;
+	void				*py_body;
 	void				*py_coro;
 	void				*py_validator;
 	struct reqcall			*py_rqnext;
@@ -298,7 +479,10 @@ struct http_request {
 	TAILQ_HEAD(, http_cookie)	resp_cookies;
 	TAILQ_HEAD(, http_header)	req_headers;
 	TAILQ_HEAD(, http_header)	resp_headers;
+	struct http_header	*hdr_known[HTTP_HEADER_ID_MAX];
+	struct http_header	*hdr_slots[HTTP_REQ_HEADER_SLOTS];
 	TAILQ_HEAD(, http_arg)		arguments;
+	struct http_arg			**arg_slots;
 	TAILQ_HEAD(, http_file)		files;
 	TAILQ_ENTRY(http_request)	list;
 	TAILQ_ENTRY(http_request)	olist;
@@ -317,6 +501,30 @@ struct http_media_type {
 	LIST_ENTRY(http_media_type)	list;
 };
 
+#define KORE_PROXY_BALANCE_ROUNDROBIN	1
+#define KORE_PROXY_BALANCE_LEASTCONN	2
+
+#define KORE_PROXY_KEEPALIVE		16
+#define KORE_PROXY_TIMEOUT		60
+#define KORE_PROXY_CONNECT_TIMEOUT	5
+#define KORE_PROXY_HEALTH_CHECK		5
+
+struct kore_upstream_server;
+
+/* A named group of servers that proxy routes forward requests to. */
+struct kore_upstream {
+	char				*name;
+	int				balance;
+	u_int32_t			keepalive;
+	u_int64_t			timeout;
+	u_int64_t			connect_timeout;
+	u_int64_t			health_check;
+	u_int32_t			next;
+	u_int32_t			server_count;
+	struct kore_upstream_server	**servers;
+	LIST_ENTRY(kore_upstream)	list;
+};
+
 extern size_t		http_body_max;
 extern u_int16_t	http_body_timeout;
 extern u_int16_t	http_header_max;
@@ -327,12 +535,34 @@ extern u_int16_t	http_keepalive_time;
 extern u_int32_t	http_request_limit;
 extern u_int32_t	http_request_count;
 extern u_int64_t	http_body_disk_offload;
+extern u_int32_t	http_cache_entries;
+extern u_int32_t	http_cache_entry_max;
+extern int		http_cache_used;
 extern int		http_pretty_error;
+extern int		http_server_timing;
 extern char		*http_body_disk_path;
-extern struct kore_pool	http_header_pool;
+
+#if defined(KORE_USE_ZLIB)
+extern int		http_compress_level;
+extern size_t		http_compress_min;
+#endif
 
 void		kore_accesslog(struct http_request *);
 
+void		kore_metrics_init(void);
+void		kore_metrics_publish(void);
+void		kore_metrics_request(struct http_request *);
+void		kore_metrics_hist_add(struct kore_metrics_hist *, u_int64_t);
+int		kore_metrics_create(struct kore_domain *, const char *);
+
+struct kore_upstream		*kore_proxy_upstream_create(const char *);
+struct kore_upstream		*kore_proxy_upstream_lookup(const char *);
+int		kore_proxy_upstream_server(struct kore_upstream *,
+		    const char *, const char *);
+int		kore_proxy_create(struct kore_domain *, const char *,
+		    const char *);
+void		kore_proxy_worker_init(void);
+
 void		http_init(void);
 void		http_parent_init(void);
 void		http_cleanup(void);
@@ -345,14 +575,49 @@ char		*http_validate_header(char *);
 int		http_method_value(const char *);
 void		http_start_recv(struct connection *);
 void		http_request_free(struct http_request *);
+void		*http_request_alloc(struct http_request *, size_t);
+char		*http_request_strdup(struct http_request *, const char *);
+void		http_error_response(struct connection *, int);
+void		http_header_index(struct http_request *,
+		    struct http_header *);
+struct http_request	*http_request_new(struct connection *,
+			    const char *, const char *, char *, const char *);
 void		http_request_sleep(struct http_request *);
+void		http_request_ready(struct http_request *);
 void		http_request_wakeup(struct http_request *);
+void		http_request_wakeup_from(struct http_request *, int);
+int		http_wakeup_pending(void);
+void		http_wakeup_log(void);
+void		http_prio_log(void);
 void		http_process_request(struct http_request *);
+const char	*http_prio_name(int);
+void		http_cache_init(void);
+void		http_cache_reap(pid_t);
+int		http_cache_lookup(struct http_request *);
+void		http_cache_store(struct http_request *, int,
+		    const void *, size_t);
+void		http_cache_release(struct http_request *);
+void		http_cache_stats_get(struct http_cache_stats *);
+const struct http_prio_stats	*http_prio_stats_get(int);
+const struct http_wakeup_stats	*http_wakeup_stats_get(int);
 int		http_body_rewind(struct http_request *);
+int		http_body_stream(struct http_request *,
+		    int (*)(struct http_request *, const void *, size_t));
+void		http_body_stream_resume(struct http_request *);
+int		http_body_stream_data(struct http_request *,
+		    const void *, size_t);
+void		http_body_stream_end(struct http_request *);
+int		http_multipart_stream(struct http_request *,
+		    int (*)(struct http_request *, struct http_file *,
+		    const void *, size_t));
+int		http_multipart_body(struct http_request *,
+		    const void *, size_t);
 int		http_media_register(const char *, const char *);
 int		http_check_timeout(struct connection *, u_int64_t);
 ssize_t		http_body_read(struct http_request *, void *, size_t);
 int		http_body_digest(struct http_request *, char *, size_t);
+u_int64_t	http_request_timing(struct http_request *, int);
+const char	*http_timing_name(int);
 
 int		http_redirect_add(struct kore_domain *,
 		    const char *, int, const char *);
@@ -363,10 +628,29 @@ void		http_serveable(struct http_request *, const void *,
 		    size_t, const char *, const char *);
 void		http_response_stream(struct http_request *, int, void *,
 		    size_t, int (*cb)(struct netbuf *), void *);
+void		http_response_chunked(struct http_request *, int);
+void		http_response_chunk(struct http_request *, void *, size_t,
+		    int (*cb)(struct netbuf *), void *);
+void		http_response_chunk_end(struct http_request *);
+int		http_response_json_ready(struct http_request *);
+int		http_response_json_end(struct http_request *);
+struct kore_json_writer	*http_response_json(struct http_request *, int, int);
+void		http_response_buf(struct http_request *, int,
+		    struct kore_buf *);
+void		http_response_body_ref(struct http_request *, int,
+		    struct http_body_ref *);
+struct http_body_ref	*http_body_ref_create(struct kore_buf *);
+void		http_body_ref_release(struct http_body_ref *);
 int		http_request_header(struct http_request *,
 		    const char *, const char **);
+int		http_request_header_id(struct http_request *,
+		    enum http_header_id, const char **);
 void		http_response_header(struct http_request *,
 		    const char *, const char *);
+const char	*http_response_header_get(struct http_request *,
+		    const char *);
+int		http_request_accepts_encoding(struct http_request *,
+		    const char *);
 int		http_state_run(struct http_state *, u_int8_t,
 		    struct http_request *);
 int	 	http_request_cookie(struct http_request *,
@@ -388,6 +672,14 @@ void		http_state_cleanup(struct http_request *);
 void		*http_state_create(struct http_request *, size_t,
 		    void (*onfree)(struct http_request *));
 
+#if defined(KORE_USE_ZLIB)
+void		http_compress_cleanup(void);
+int		http_compress_response(struct http_request *, int,
+		    const void *, size_t, struct kore_buf *);
+int		http_compress_fileref(struct http_request *, int,
+		    struct kore_fileref *, const char *);
+#endif
+
 int		http_argument_urldecode(char *);
 int		http_header_recv(struct netbuf *);
 void		http_populate_qs(struct http_request *);
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __H_HTTP2_H
+#define __H_HTTP2_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define HTTP2_PREFACE			"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN		24
+#define HTTP2_ALPN			"\x02h2\x08http/1.1"
+
+#define HTTP2_FRAME_HDR_LEN		9
+#define HTTP2_FRAME_SIZE_MIN		16384
+#define HTTP2_FRAME_SIZE_MAX		16777215
+#define HTTP2_WINDOW_DEFAULT		65535
+#define HTTP2_WINDOW_MAX		0x7fffffff
+#define HTTP2_HPACK_TABLE_SIZE		4096
+
+/* What we advertise and how much we buffer. */
+#define HTTP2_MAX_STREAMS		100
+#define HTTP2_RECV_WINDOW		(256 * 1024)
+#define HTTP2_RECV_BUFSIZE		(64 * 1024)
+#define HTTP2_SEND_BATCH		(128 * 1024)
+
+/*
+ * PING and SETTINGS acks we queue while the peer is not reading them,
+ * and how many RST_STREAM frames a peer may send per interval.
+ */
+#define HTTP2_CTRL_QUEUED_MAX		64
+#define HTTP2_RST_MAX			100
+#define HTTP2_RST_INTERVAL		1000
+
+#define HTTP2_FRAME_DATA		0x0
+#define HTTP2_FRAME_HEADERS		0x1
+#define HTTP2_FRAME_PRIORITY		0x2
+#define HTTP2_FRAME_RST_STREAM		0x3
+#define HTTP2_FRAME_SETTINGS		0x4
+#define HTTP2_FRAME_PUSH_PROMISE	0x5
+#define HTTP2_FRAME_PING		0x6
+#define HTTP2_FRAME_GOAWAY		0x7
+#define HTTP2_FRAME_WINDOW_UPDATE	0x8
+#define HTTP2_FRAME_CONTINUATION	0x9
+
+#define HTTP2_FLAG_ACK			0x01
+#define HTTP2_FLAG_END_STREAM		0x01
+#define HTTP2_FLAG_END_HEADERS		0x04
+#define HTTP2_FLAG_PADDED		0x08
+#define HTTP2_FLAG_PRIORITY		0x20
+
+#define HTTP2_SETTING_HEADER_TABLE_SIZE		0x1
+#define HTTP2_SETTING_ENABLE_PUSH		0x2
+#define HTTP2_SETTING_MAX_CONCURRENT_STREAMS	0x3
+#define HTTP2_SETTING_INITIAL_WINDOW_SIZE	0x4
+#define HTTP2_SETTING_MAX_FRAME_SIZE		0x5
+#define HTTP2_SETTING_MAX_HEADER_LIST_SIZE	0x6
+
+#define HTTP2_ERROR_NO_ERROR		0x0
+#define HTTP2_ERROR_PROTOCOL		0x1
+#define HTTP2_ERROR_INTERNAL		0x2
+#define HTTP2_ERROR_FLOW_CONTROL	0x3
+#define HTTP2_ERROR_STREAM_CLOSED	0x5
+#define HTTP2_ERROR_FRAME_SIZE		0x6
+#define HTTP2_ERROR_REFUSED_STREAM	0x7
+#define HTTP2_ERROR_CANCEL		0x8
+#define HTTP2_ERROR_COMPRESSION		0x9
+#define HTTP2_ERROR_ENHANCE_YOUR_CALM	0xb
+
+#define HTTP2_STREAM_REMOTE_CLOSED	0x0001
+#define HTTP2_STREAM_LOCAL_CLOSED	0x0002
+#define HTTP2_STREAM_HEADERS_SENT	0x0004
+#define HTTP2_STREAM_PENDING		0x0008
+#define HTTP2_STREAM_HOLD		0x0010
+#define HTTP2_STREAM_MORE		0x0020
+
+#define HTTP2_CONN_PREFACE		0x0001
+#define HTTP2_CONN_GOAWAY		0x0002
+#define HTTP2_CONN_DRAIN_WAIT		0x0004
+
+#define HTTP2_DATA_NONE			0
+#define HTTP2_DATA_BUF			1
+#define HTTP2_DATA_STREAM		2
+#define HTTP2_DATA_FILEREF		3
+
+struct http2_hpack_entry {
+	char			*name;
+	char			*value;
+	size_t			nlen;
+	size_t			vlen;
+};
+
+struct http2_hpack {
+	struct http2_hpack_entry	*entries;
+	size_t				cap;
+	size_t				head;
+	size_t				count;
+	size_t				size;
+	size_t				max;
+};
+
+struct http2_data {
+	int			type;
+	u_int8_t		*buf;
+	size_t			len;
+	size_t			off;
+	int			(*cb)(struct netbuf *);
+	void			*arg;
+	struct kore_fileref	*ref;
+};
+
+struct http2_stream {
+	u_int32_t			id;
+	u_int16_t			flags;
+	int64_t				send_window;
+	int64_t				recv_window;
+	struct http2_conn		*h2;
+	struct http_request		*req;
+	struct http2_data		out;
+	TAILQ_ENTRY(http2_stream)	list;
+	TAILQ_ENTRY(http2_stream)	plist;
+};
+
+struct http2_conn {
+	u_int16_t			flags;
+	struct connection		*c;
+	u_int32_t			nstreams;
+	u_int32_t			last_stream;
+	u_int32_t			peer_frame_max;
+	int64_t				peer_window;
+	int64_t				send_window;
+	int64_t				recv_window;
+
+	u_int32_t			ctrl_queued;
+	u_int32_t			rst_count;
+	u_int64_t			rst_start;
+
+	u_int32_t			cont_stream;
+	u_int8_t			cont_flags;
+	struct kore_buf			hblock;
+	struct kore_buf			hlist;
+	struct kore_buf			hdrs;
+	struct http2_hpack		decoder;
+
+	struct http2_stream		*current;
+
+	TAILQ_HEAD(, http2_stream)	streams;
+	TAILQ_HEAD(, http2_stream)	pending;
+};
+
+extern int		http2_enable;
+extern u_int32_t	http2_max_streams;
+
+void	http2_init(void);
+void	http2_cleanup(void);
+int	http2_recv(struct netbuf *);
+int	http2_connection_start(struct connection *);
+void	http2_connection_free(struct connection *);
+void	http2_goaway(struct connection *);
+void	http2_request_free(struct http_request *);
+int	http2_request_reset(struct http_request *);
+void	http2_request_body_resume(struct http_request *);
+
+int	http2_response_begin(struct connection *,
+	    struct http_request *, int);
+void	http2_response_header(struct connection *,
+	    const char *, size_t, const char *, size_t);
+void	http2_response_end(struct connection *, struct http_request *,
+	    const void *, size_t, int);
+void	http2_response_stream(struct http_request *, void *, size_t,
+	    int (*cb)(struct netbuf *), void *);
+void	http2_response_fileref(struct http_request *,
+	    struct kore_fileref *, off_t, off_t);
+void	http2_response_chunked(struct http_request *);
+void	http2_response_chunk_end(struct http_request *);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* !__H_HTTP2_H */
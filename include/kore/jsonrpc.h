@@ -23,6 +23,8 @@
 extern "C" {
 #endif
 
+struct jsonrpc_call;
+
 /* JSON RPC request handling log entry. */
 struct jsonrpc_log
 {
@@ -44,8 +46,18 @@ struct jsonrpc_request
 	yajl_val		params;
 	unsigned int		flags;
 	int			log_levels;
+
+	/* Set for calls run by jsonrpc_dispatch(). */
+	struct jsonrpc_call	*call;
+	void			*state;
 };
 
+/* Run the method on a task thread (KORE_USE_TASKS). */
+#define JSONRPC_METHOD_TASK		0x0001
+
+/* Maximum number of calls in a single batch. */
+#define JSONRPC_BATCH_MAX		128
+
 #define YAJL_GEN_CONST_STRING(CTX, STR)	\
 	yajl_gen_string((CTX), (unsigned char *)(STR), sizeof (STR) - 1)
 
@@ -79,6 +91,9 @@ void	jsonrpc_destroy_request(struct jsonrpc_request *);
 int	jsonrpc_error(struct jsonrpc_request *, int, const char *);
 int	jsonrpc_result(struct jsonrpc_request *,
 	    int (*)(struct jsonrpc_request *, void *), void *);
+int	jsonrpc_dispatch(struct http_request *);
+void	jsonrpc_method_add(const char *,
+	    int (*)(struct jsonrpc_request *), int);
 #if defined(__cplusplus)
 }
 #endif
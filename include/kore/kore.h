@@ -78,6 +78,11 @@ extern int daemon(int, int);
 #define KORE_USE_PLATFORM_PLEDGE	1
 #endif
 
+#if defined(KORE_USE_PLATFORM_SENDFILE) && defined(SSL_OP_ENABLE_KTLS) && \
+    !defined(OPENSSL_NO_KTLS)
+#define KORE_USE_PLATFORM_KTLS		1
+#endif
+
 #define KORE_RSAKEY_BITS	4096
 
 #define KORE_RESULT_ERROR	0
@@ -104,6 +109,21 @@ extern int daemon(int, int);
 #define KORE_TEARDOWN_HOOK	"kore_parent_teardown"
 #define KORE_DAEMONIZED_HOOK	"kore_parent_daemonized"
 
+/*
+ * USDT probes (provider "kore") for tracing connections and requests with
+ * bpftrace or perf, compiled in with PROBES=1. A disabled probe is a nop.
+ */
+#if defined(KORE_USE_PROBES)
+#include <sys/sdt.h>
+#define KORE_PROBE1(n, a)		DTRACE_PROBE1(kore, n, a)
+#define KORE_PROBE2(n, a, b)		DTRACE_PROBE2(kore, n, a, b)
+#define KORE_PROBE3(n, a, b, c)		DTRACE_PROBE3(kore, n, a, b, c)
+#else
+#define KORE_PROBE1(n, a)
+#define KORE_PROBE2(n, a, b)
+#define KORE_PROBE3(n, a, b, c)
+#endif
+
 #if defined(KORE_DEBUG)
 #define kore_debug(...)		\
 	if (kore_debug)		\
@@ -115,6 +135,17 @@ extern int daemon(int, int);
 #define NETBUF_RECV			0
 #define NETBUF_SEND			1
 #define NETBUF_SEND_PAYLOAD_MAX		8192
+#define NETBUF_TLS_RECORD_MAX		16384
+
+/*
+ * New or idle TLS connections start out with records that fit a single
+ * segment (MSS minus TCP/IP and TLS overhead) so the peer can decrypt
+ * the first bytes as soon as they arrive, after KORE_TLS_RECORD_BOOST
+ * bytes we switch to full sized records for throughput.
+ */
+#define KORE_TLS_RECORD_SMALL		1369
+#define KORE_TLS_RECORD_BOOST		(64 * 1024)
+#define KORE_TLS_RECORD_IDLE		1000
 #define SENDFILE_PAYLOAD_MAX		(1024 * 1024 * 10)
 
 #define NETBUF_LAST_CHAIN		0
@@ -135,9 +166,12 @@ extern int daemon(int, int);
 #if !defined(KORE_NO_HTTP)
 struct http_request;
 struct http_redirect;
+struct http_cache_rule;
 #endif
 
 #define KORE_FILEREF_SOFT_REMOVED	0x1000
+#define KORE_FILEREF_GZIP_NONE		0x2000
+#define KORE_FILEREF_MEMORY		0x4000
 
 struct kore_fileref {
 	int				cnt;
@@ -145,11 +179,20 @@ struct kore_fileref {
 	int				ontls;
 	off_t				size;
 	char				*path;
+	u_int32_t			hash;
 	u_int64_t			mtime;
 	time_t				mtime_sec;
+	u_int64_t			checked;
 	u_int64_t			expiration;
+	char				etag[64];
+	char				modified[32];
 	void				*base;
 	int				fd;
+#if defined(KORE_USE_ZLIB)
+	void				*gzip;
+	size_t				gzip_len;
+#endif
+	LIST_ENTRY(kore_fileref)	hlist;
 	TAILQ_ENTRY(kore_fileref)	list;
 };
 
@@ -180,6 +223,7 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define KORE_TYPE_TASK		4
 #define KORE_TYPE_PYSOCKET	5
 #define KORE_TYPE_CURL_HANDLE	6
+#define KORE_TYPE_MSG_SHM	7
 
 #define CONN_STATE_UNKNOWN		0
 #define CONN_STATE_TLS_SHAKE		1
@@ -190,6 +234,7 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define CONN_PROTO_HTTP		1
 #define CONN_PROTO_WEBSOCKET	2
 #define CONN_PROTO_MSG		3
+#define CONN_PROTO_HTTP2	4
 
 #define KORE_EVENT_READ		0x01
 #define KORE_EVENT_WRITE	0x02
@@ -201,6 +246,9 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define CONN_IS_BUSY		0x08
 #define CONN_ACME_CHALLENGE	0x10
 #define CONN_LOG_TLS_FAILURE	0x20
+#define CONN_TLS_KTLS_SEND	0x40
+#define CONN_CHUNKED		0x80
+#define CONN_CLOSE_CHUNKED	0x100
 
 #define KORE_IDLE_TIMER_MAX	5000
 
@@ -214,6 +262,9 @@ TAILQ_HEAD(netbuf_head, netbuf);
 #define WEBSOCKET_BROADCAST_LOCAL	1
 #define WEBSOCKET_BROADCAST_GLOBAL	2
 
+#define WEBSOCKET_DEFLATE_TAKEOVER	1
+#define WEBSOCKET_DEFLATE_NO_TAKEOVER	2
+
 #define KORE_TIMER_ONESHOT	0x01
 #define KORE_TIMER_FLAGS	(KORE_TIMER_ONESHOT)
 
@@ -226,50 +277,88 @@ struct kore_event {
 	void		(*handle)(void *, int);
 } __attribute__((packed));
 
+struct http2_conn;
+struct websocket_sub;
+struct websocket_deflate;
+
+/*
+ * Connections come from a pool that aligns them on a cache line. The
+ * fields touched for every event come first, what is only needed at
+ * accept, TLS setup or for websockets is kept at the end.
+ */
+#define CONNECTION_ALIGN	64
+
 struct connection {
 	struct kore_event	evt;
 	int			fd;
 	u_int8_t		state;
 	u_int8_t		proto;
-	struct listener		*owner;
-	X509			*cert;
-	SSL			*ssl;
-	char			*tls_sni;
-	int			tls_reneg;
 	u_int16_t		flags;
-	void			*hdlr_extra;
-
 	int			(*handle)(struct connection *);
-	void			(*disconnect)(struct connection *);
 	int			(*read)(struct connection *, size_t *);
 	int			(*write)(struct connection *, size_t, size_t *);
+	struct netbuf_head	send_queue;
 
-	int			family;
-	union {
-		struct sockaddr_in	ipv4;
-		struct sockaddr_in6	ipv6;
-		struct sockaddr_un	sun;
-	} addr;
+	struct netbuf		*snb;
+	struct netbuf		*rnb;
+	SSL			*ssl;
+	void			*hdlr_extra;
+	struct listener		*owner;
+	void			(*disconnect)(struct connection *);
 
 	struct {
 		u_int64_t	length;
 		u_int64_t	start;
 	} idle_timer;
 
-	struct netbuf_head	send_queue;
-	struct netbuf		*snb;
-	struct netbuf		*rnb;
+	/* Position in the connection expiry wheel, see connection.c. */
+	struct {
+		u_int64_t		deadline;
+		u_int16_t		slot;
+		TAILQ_ENTRY(connection)	list;
+	} expire;
 
 #if !defined(KORE_NO_HTTP)
 	u_int64_t			http_start;
 	u_int64_t			http_timeout;
+	u_int64_t			http_accept;
+	u_int64_t			http_first;
+	size_t				http_scan;
+	u_int8_t			*http_pipelined;
+	size_t				http_pipelined_len;
+	TAILQ_HEAD(, http_request)	http_requests;
+#if defined(KORE_USE_HTTP2)
+	struct http2_conn		*h2;
+#endif
+#endif
+
+	TAILQ_ENTRY(connection)	list;
+
+	/* Cold, not used by the event loop. */
+	X509			*cert;
+	char			*tls_sni;
+	int			tls_reneg;
+
+	/* Dynamic TLS record sizing state, see net_tls_record_len(). */
+	size_t			tls_wlen;
+	u_int64_t		tls_wsent;
+	u_int64_t		tls_wlast;
+
+#if !defined(KORE_NO_HTTP)
 	struct kore_runtime_call	*ws_connect;
 	struct kore_runtime_call	*ws_message;
 	struct kore_runtime_call	*ws_disconnect;
-	TAILQ_HEAD(, http_request)	http_requests;
+	TAILQ_ENTRY(connection)		ws_list;
+	TAILQ_HEAD(, websocket_sub)	ws_subs;
+	struct websocket_deflate	*ws_deflate;
 #endif
 
-	TAILQ_ENTRY(connection)	list;
+	int			family;
+	union {
+		struct sockaddr_in	ipv4;
+		struct sockaddr_in6	ipv6;
+		struct sockaddr_un	sun;
+	} addr;
 };
 
 TAILQ_HEAD(connection_list, connection);
@@ -300,6 +389,8 @@ struct kore_runtime_call {
 	struct kore_runtime	*runtime;
 };
 
+struct kore_route_node;
+
 struct kore_domain {
 	u_int16_t				id;
 	int					logerr;
@@ -318,13 +409,25 @@ struct kore_domain {
 #endif
 	char					*cafile;
 	char					*crlfile;
+	char					*ocspfile;
+	void					*ocsp;
+	size_t					ocsp_len;
 	char					*certfile;
 	char					*certkey;
 	SSL_CTX					*ssl_ctx;
 	int					x509_verify_depth;
+	int					tls_prewarm;
+	void					*tls_pending;
+	size_t					tls_pending_len;
+	void					*tls_pending_crl;
+	size_t					tls_pending_crl_len;
 #if !defined(KORE_NO_HTTP)
 	TAILQ_HEAD(, kore_module_handle)	handlers;
 	TAILQ_HEAD(, http_redirect)		redirects;
+	struct kore_route_node			*routes;
+	struct kore_module_handle		**route_byid;
+	int					routes_dirty;
+	u_int16_t				route_ids;
 #endif
 	TAILQ_ENTRY(kore_domain)		list;
 };
@@ -342,13 +445,29 @@ struct listener {
 	struct kore_server		*server;
 	struct kore_runtime_call	*connect;
 
+	/* Per-worker sockets when socket_reuseport is enabled. */
+	int				*rfds;
+	u_int16_t			nrfds;
+	int				steer;
+	socklen_t			addrlen;
+	struct sockaddr_storage		addr;
+
+	/* Number of times the parent found the accept queue full. */
+	u_int64_t			backlog_full;
+
 	LIST_ENTRY(listener)		list;
 };
 
+struct kore_domain_index;
+
 struct kore_server {
 	int				tls;
 	char				*name;
 	struct kore_domain_h		domains;
+	struct kore_domain_index	*dindex;
+	size_t				tls_rec_small;
+	u_int64_t			tls_rec_boost;
+	u_int64_t			tls_rec_idle;
 	LIST_HEAD(, listener)		listeners;
 	LIST_ENTRY(kore_server)		list;
 };
@@ -365,6 +484,10 @@ struct kore_handler_params {
 	u_int8_t		method;
 	struct kore_validator	*validator;
 
+	/* Set when the routes are built, see kore_module_params_find(). */
+	u_int16_t		slot;
+	struct kore_handler_params	*next;
+
 	TAILQ_ENTRY(kore_handler_params)	list;
 };
 
@@ -372,6 +495,8 @@ struct kore_handler_params {
 #define KORE_AUTH_TYPE_HEADER		2
 #define KORE_AUTH_TYPE_REQUEST		3
 
+struct kore_auth_cache;
+
 struct kore_auth {
 	u_int8_t		type;
 	char			*name;
@@ -379,6 +504,12 @@ struct kore_auth {
 	char			*redirect;
 	struct kore_validator	*validator;
 
+	/* Successful checks are remembered if cache_size is set. */
+	u_int32_t		cache_size;
+	u_int64_t		cache_ttl;
+	int			cache_shared;
+	struct kore_auth_cache	*cache;
+
 	TAILQ_ENTRY(kore_auth)	list;
 };
 
@@ -427,24 +558,145 @@ struct kore_module_handle {
 	struct kore_domain			*dom;
 	struct kore_runtime_call		*rcall;
 	struct kore_auth			*auth;
+	int					direct;
 	int					methods;
+	int					stream;
+	int					priority;
+	u_int64_t				deadline;
+	struct http_cache_rule			*cache;
+#if defined(KORE_USE_ZLIB)
+	int					compress;
+	int					ws_deflate;
+	int					ws_deflate_bits;
+#endif
+	u_int16_t				id;
+	u_int16_t				metrics;
+	u_int16_t				nparams;
+	u_int32_t				params_seed;
+	u_int32_t				params_mask;
+	struct kore_handler_params		**params_table;
 	TAILQ_HEAD(, kore_handler_params)	params;
 	TAILQ_ENTRY(kore_module_handle)		list;
 };
 #endif
 
 /*
- * The workers get a 128KB log buffer per worker, and parent will fetch their
- * logs when it reached at least 75% of that or if its been > 1 second since
- * it was last synced.
+ * Each worker hands its accesslogs to the parent through a single
+ * producer, single consumer ring of fixed size records in shared memory.
+ * The worker never waits on the parent, if the ring is full the entry is
+ * dropped and counted instead. The parent drains the rings and formats
+ * the records, the binary accesslog_format writes them out as is.
  */
-#define KORE_ACCESSLOG_BUFLEN		131072U
-#define KORE_ACCESSLOG_SYNC		98304U
-
-struct kore_alog_header {
+#define KORE_ACCESSLOG_RECORDS		1024
+#define KORE_ACCESSLOG_RECORD_LEN	512
+#define KORE_ACCESSLOG_DATA_LEN		(KORE_ACCESSLOG_RECORD_LEN - 80)
+#define KORE_ACCESSLOG_TIMINGS		6
+
+#define KORE_ACCESSLOG_FORMAT_COMBINED	1
+#define KORE_ACCESSLOG_FORMAT_JSON	2
+#define KORE_ACCESSLOG_FORMAT_BINARY	3
+
+struct kore_alog_record {
+	u_int64_t		time;		/* ms since the epoch. */
+	u_int64_t		latency;	/* ms since request arrived. */
+	u_int64_t		length;
 	u_int16_t		domain;
-	u_int16_t		loglen;
-} __attribute__((packed));
+	u_int16_t		route;
+	u_int16_t		status;
+	u_int8_t		method;
+	u_int8_t		family;
+	u_int8_t		addr[16];
+	u_int16_t		path_len;
+	u_int16_t		referer_len;
+	u_int16_t		agent_len;
+	u_int16_t		cn_len;
+	u_int32_t		timing[KORE_ACCESSLOG_TIMINGS];	/* us */
+	char			data[KORE_ACCESSLOG_DATA_LEN];
+};
+
+/*
+ * Workers log into a ring of fixed size records in their shared memory
+ * instead of writing to syslog or stdout themselves, the parent drains
+ * the rings. Messages longer than a record are truncated.
+ */
+#define KORE_LOG_RECORDS		128
+#define KORE_LOG_RECORD_LEN		1024
+
+#define KORE_LOG_OVERFLOW_DROP		1
+#define KORE_LOG_OVERFLOW_SYNC		2
+
+struct kore_log_record {
+	u_int16_t		prio;
+	u_int16_t		len;
+	char			msg[KORE_LOG_RECORD_LEN - 4];
+};
+
+/*
+ * Metrics each worker keeps in its shared memory, only written by the
+ * worker itself and read by whichever worker serves the metrics route.
+ * Request latency goes into log-linear buckets, two per power of two
+ * starting at KORE_METRICS_BUCKET_MIN microseconds, the last bucket
+ * catches everything slower. Routes past KORE_METRICS_ROUTES - 1 share
+ * the last slot.
+ */
+#define KORE_METRICS_ROUTES		64
+#define KORE_METRICS_BUCKETS		32
+#define KORE_METRICS_BUCKET_MIN		128
+
+/* One per request priority class (HTTP_PRIO_*). */
+#define KORE_METRICS_PRIOS		3
+
+struct kore_metrics_route {
+	u_int64_t		requests;
+	u_int64_t		status[5];
+	u_int64_t		latency_sum;
+	u_int64_t		latency[KORE_METRICS_BUCKETS + 1];
+};
+
+struct kore_metrics_hist {
+	u_int64_t		count;
+	u_int64_t		sum;
+	u_int64_t		buckets[KORE_METRICS_BUCKETS + 1];
+};
+
+/* Copy of the http_prio_stats for a class, waits are in milliseconds. */
+struct kore_metrics_prio {
+	u_int32_t		queued;
+	u_int64_t		started;
+	u_int64_t		shed;
+	u_int64_t		wait_total;
+	u_int64_t		wait_max;
+};
+
+struct kore_metrics {
+	u_int32_t			pgsql_queued;
+	u_int64_t			pgsql_timeouts;
+	struct kore_metrics_hist	pgsql_wait[KORE_METRICS_PRIOS];
+	struct kore_metrics_prio	prio[KORE_METRICS_PRIOS];
+	u_int32_t			curl_running;
+	u_int64_t			curl_transfers;
+	u_int64_t			curl_reused;
+	u_int64_t			curl_connects;
+	u_int64_t			curl_coalesced;
+	u_int32_t			task_threads;
+	u_int32_t			task_idle;
+	u_int32_t			task_queued;
+	u_int64_t			fileref_bytes;
+	u_int64_t			fileref_hits;
+	u_int64_t			fileref_misses;
+	u_int64_t			fileref_evictions;
+	struct kore_metrics_route	routes[KORE_METRICS_ROUTES];
+	struct kore_metrics_hist	phases[KORE_ACCESSLOG_TIMINGS];
+};
+
+/* Phases of a worker event loop iteration, see worker_loop_account(). */
+#define KORE_LOOP_IO			0
+#define KORE_LOOP_TIMERS		1
+#define KORE_LOOP_CURL			2
+#define KORE_LOOP_HTTP			3
+#define KORE_LOOP_PYTHON		4
+#define KORE_LOOP_CONNECTIONS		5
+#define KORE_LOOP_PHASES		6
 
 struct kore_worker {
 	u_int16_t			id;
@@ -461,18 +713,73 @@ struct kore_worker {
 	u_int64_t			time_locked;
 	struct kore_module_handle	*active_hdlr;
 
-	/* Used by the workers to store accesslogs. */
+	/* When the parent forked it and how long it took to be ready. */
+	u_int64_t			spawned;
+	u_int32_t			ready_ms;
+
+	/* Accept statistics, rate is filled in by the parent. */
+	struct {
+		u_int64_t		accepted;
+		u_int64_t		errors;
+		u_int64_t		lock_ms;
+		u_int64_t		remote;
+		u_int32_t		rate;
+	} accept;
+
+	/*
+	 * Load published by the worker for its peers and the parent.
+	 * busy is when it left its event wait, 0 while waiting.
+	 */
+	struct {
+		u_int32_t		connections;
+		u_int32_t		requests;
+		u_int32_t		lag;
+		u_int32_t		cpu;
+		u_int64_t		busy;
+	} load;
+
+	/*
+	 * Event loop timing, phase holds the us spent per KORE_LOOP_*
+	 * and max the longest iteration in ms over the last second.
+	 */
 	struct {
-		int			lock;
-		size_t			offset;
-		char			buf[KORE_ACCESSLOG_BUFLEN];
+		u_int64_t		iterations;
+		u_int64_t		stalls;
+		u_int32_t		max;
+		u_int64_t		phase[KORE_LOOP_PHASES];
+	} loop;
+
+	/*
+	 * Accesslog ring, head and drops are written by the worker,
+	 * tail and reported by the parent.
+	 */
+	struct {
+		u_int32_t		head;
+		u_int32_t		tail;
+		u_int64_t		drops;
+		u_int64_t		reported;
+		struct kore_alog_record	ring[KORE_ACCESSLOG_RECORDS];
 	} lb;
+
+	struct kore_metrics		metrics;
+
+	/* Log ring, same ownership as the accesslog ring. */
+	struct {
+		u_int32_t		head;
+		u_int32_t		tail;
+		u_int64_t		drops;
+		u_int64_t		reported;
+		struct kore_log_record	ring[KORE_LOG_RECORDS];
+	} log;
 };
 
 #if !defined(KORE_NO_HTTP)
 
 #define KORE_VALIDATOR_TYPE_REGEX	1
 #define KORE_VALIDATOR_TYPE_FUNCTION	2
+#define KORE_VALIDATOR_TYPE_INT		3
+#define KORE_VALIDATOR_TYPE_UUID	4
+#define KORE_VALIDATOR_TYPE_LENGTH	5
 
 struct kore_validator {
 	u_int8_t			type;
@@ -481,11 +788,20 @@ struct kore_validator {
 	regex_t				rctx;
 	struct kore_runtime_call	*rcall;
 
+	/* Bounds for the int and length types. */
+	long long			min;
+	long long			max;
+
+	LIST_ENTRY(kore_validator)	hlist;
 	TAILQ_ENTRY(kore_validator)	list;
 };
 #endif /* !KORE_NO_HTTP */
 
 #define KORE_BUF_OWNER_API	0x0001
+#define KORE_BUF_INLINE		0x0002
+
+/* Room kore_buf_alloc() gives a small buffer next to the kore_buf. */
+#define KORE_BUF_INLINE_SIZE	224
 
 struct kore_buf {
 	u_int8_t		*data;
@@ -518,7 +834,10 @@ struct kore_buf {
 #define KORE_JSON_ERR_INVALID_SEARCH	9
 #define KORE_JSON_ERR_NOT_FOUND		10
 #define KORE_JSON_ERR_TYPE_MISMATCH	11
-#define KORE_JSON_ERR_LAST		KORE_JSON_ERR_TYPE_MISMATCH
+#define KORE_JSON_ERR_INVALID_WRITE	12
+#define KORE_JSON_ERR_LAST		KORE_JSON_ERR_INVALID_WRITE
+
+#define KORE_JSON_WRITER_PRETTY		0x0001
 
 #define kore_json_find_object(j, p)		\
     kore_json_find(j, p, KORE_JSON_TYPE_OBJECT)
@@ -550,6 +869,18 @@ struct kore_buf {
 #define kore_json_create_literal(o, n, v)			\
     kore_json_create_item(o, n, KORE_JSON_TYPE_LITERAL, v)
 
+struct kore_json_arena;
+struct kore_json_index;
+struct kore_json_path;
+
+struct kore_json_writer {
+	struct kore_buf		*buf;
+	int			flags;
+	int			depth;
+	int			error;
+	u_int8_t		levels[KORE_JSON_DEPTH_MAX + 1];
+};
+
 struct kore_json {
 	const u_int8_t			*data;
 	int				depth;
@@ -557,6 +888,9 @@ struct kore_json {
 	size_t				length;
 	size_t				offset;
 
+	u_int8_t			*insitu;
+	struct kore_json_arena		*arena;
+
 	struct kore_buf			tmpbuf;
 	struct kore_json_item		*root;
 };
@@ -576,12 +910,17 @@ struct kore_json_item {
 	int				(*parse)(struct kore_json *,
 					    struct kore_json_item *);
 
+	struct kore_json_index		*index;
 	TAILQ_ENTRY(kore_json_item)	list;
 };
 
 struct kore_pool_region {
 	void				*start;
 	size_t				length;
+	size_t				elms;
+	size_t				inuse;
+	u_int64_t			idle;
+	int				flags;
 	LIST_ENTRY(kore_pool_region)	list;
 };
 
@@ -594,16 +933,49 @@ struct kore_pool_entry {
 struct kore_pool {
 	size_t			elen;
 	size_t			slen;
+	size_t			pad;
 	size_t			elms;
 	size_t			inuse;
+	size_t			hwm;
 	size_t			growth;
 	volatile int		lock;
+	u_int32_t		id;
 	char			*name;
 
 	LIST_HEAD(, kore_pool_region)	regions;
 	LIST_HEAD(, kore_pool_entry)	freelist;
 };
 
+#define KORE_MEM_BLOCKS			11
+
+struct kore_mem_class {
+	u_int32_t		size;
+	u_int32_t		elms;
+	u_int32_t		inuse;
+	u_int32_t		hwm;
+	u_int64_t		allocs;
+	u_int64_t		rate;
+};
+
+struct kore_mem_stats {
+	struct kore_mem_class	classes[KORE_MEM_BLOCKS];
+
+	/* Allocations that were too big for any of the classes. */
+	u_int64_t		large_allocs;
+	u_int64_t		large_inuse;
+	u_int64_t		large_bytes;
+	u_int64_t		large_hwm;
+
+	/* Allocations from kore_malloc_tagged() or kore_mem_tag(). */
+	u_int32_t		tags;
+	u_int64_t		tag_bytes;
+
+	/* Regions over all pools and how many are on huge pages. */
+	u_int32_t		regions;
+	u_int32_t		regions_hugetlb;
+	u_int32_t		regions_thp;
+};
+
 struct kore_timer {
 	u_int64_t	nextrun;
 	u_int64_t	interval;
@@ -611,6 +983,11 @@ struct kore_timer {
 	void		*arg;
 	void		(*cb)(void *, u_int64_t);
 
+	/* Position in the timer wheel, see timer.c. */
+	u_int8_t	level;
+	u_int8_t	slot;
+	u_int8_t	state;
+
 	TAILQ_ENTRY(kore_timer)	list;
 };
 
@@ -628,6 +1005,9 @@ struct kore_timer {
 #define KORE_WORKER_POLICY_RESTART	1
 #define KORE_WORKER_POLICY_TERMINATE	2
 
+/* Longest key (including its terminating NUL) in the shared kv store. */
+#define KORE_KV_KEY_MAX			64
+
 /* Reserved message ids, registered on workers. */
 #define KORE_MSG_WEBSOCKET		1
 #define KORE_MSG_KEYMGR_REQ		2
@@ -640,6 +1020,13 @@ struct kore_timer {
 #define KORE_MSG_CRL			9
 #define KORE_MSG_ACCEPT_AVAILABLE	10
 #define KORE_PYTHON_SEND_OBJ		11
+#define KORE_MSG_MEM_STATS		12
+#define KORE_MSG_DRAIN			13
+#define KORE_MSG_TICKET_KEYS		14
+#define KORE_MSG_OCSP			15
+#define KORE_MSG_AUTH_INVALIDATE	16
+#define KORE_PYTHON_SEND_RAW		17
+#define KORE_PYTHON_SEND_MARSHAL	18
 #define KORE_MSG_ACME_BASE		100
 
 /* messages for applications should start at 201. */
@@ -656,8 +1043,18 @@ struct kore_msg {
 	size_t		length;
 };
 
+/* TLS session ticket key, generated by the keymgr. */
+#define KORE_TICKET_KEYS		2
+
+struct kore_ticket_key {
+	u_int8_t	name[16];
+	u_int8_t	aes[32];
+	u_int8_t	hmac[32];
+};
+
 struct kore_keyreq {
 	int		padding;
+	u_int32_t	id;
 	char		domain[KORE_DOMAINNAME_LEN + 1];
 	size_t		data_len;
 	u_int8_t	data[];
@@ -676,6 +1073,9 @@ extern char	*config_file;
 extern pid_t	kore_pid;
 extern int	foreground;
 extern int	kore_quiet;
+extern int	kore_accesslog_format;
+extern int	kore_log_overflow;
+extern u_int32_t	kore_log_rate_limit;
 extern int	kore_debug;
 extern int	skip_chroot;
 extern int	skip_runas;
@@ -687,11 +1087,19 @@ extern char	*kore_tls_cipher_list;
 extern volatile sig_atomic_t	sig_recv;
 
 extern int	tls_version;
+extern int	tls_ktls;
 extern DH	*tls_dhparam;
+extern int	tls_session_cache;
+extern int	tls_lazy;
+extern u_int32_t	tls_ticket_rotate;
+extern struct connection	*tls_handshake_conn;
 extern char	*rand_file;
 extern int	keymgr_active;
 extern char	*keymgr_runas_user;
 extern char	*keymgr_root_path;
+#if defined(KORE_USE_TASKS)
+extern u_int16_t	keymgr_threads;
+#endif
 extern char	*acme_runas_user;
 extern char	*acme_root_path;
 
@@ -705,9 +1113,28 @@ extern u_int32_t		worker_rlimit_nofiles;
 extern u_int32_t		worker_max_connections;
 extern u_int32_t		worker_active_connections;
 extern u_int32_t		worker_accept_threshold;
+extern u_int32_t		worker_accept_slack;
+extern u_int32_t		worker_stall_ms;
+extern u_int32_t		worker_warmup_timeout;
+extern u_int64_t		kore_loop_woke;
+extern u_int32_t		kore_kv_entries;
+extern u_int32_t		kore_kv_value_max;
+extern u_int64_t		kore_pool_idle;
+extern int			kore_pool_hugepages;
+#if defined(__linux__)
+extern int			kore_msg_shm;
+#endif
 extern u_int64_t		kore_websocket_maxframe;
 extern u_int64_t		kore_websocket_timeout;
 extern u_int32_t		kore_socket_backlog;
+extern int			kore_socket_reuseport;
+extern int			kore_graceful_upgrade;
+extern u_int32_t		worker_drain_timeout;
+
+#if defined(KORE_USE_IOURING)
+extern int			kore_io_uring;
+extern int			kore_uring_active;
+#endif
 
 extern struct kore_worker	*worker;
 extern struct kore_pool		nb_pool;
@@ -723,6 +1150,12 @@ void		kore_default_getopt(int, char **);
 void		kore_worker_reap(void);
 void		kore_worker_init(void);
 void		kore_worker_make_busy(void);
+void		kore_worker_warmup_hold(void);
+void		kore_worker_warmup_release(void);
+void		kore_worker_accept_stats(void *, u_int64_t);
+void		kore_worker_mem_stats(struct kore_msg *, const void *);
+void		kore_worker_load_stats(void);
+void		kore_worker_loop_note(const char *, const char *, u_int64_t);
 void		kore_worker_shutdown(void);
 void		kore_worker_dispatch_signal(int);
 void		kore_worker_privdrop(const char *, const char *);
@@ -734,6 +1167,23 @@ void	kore_worker_entry(struct kore_worker *) __attribute__((noreturn));
 
 struct kore_worker	*kore_worker_data(u_int8_t);
 
+void		kore_kv_init(void);
+void		kore_kv_reap(struct kore_worker *);
+int		kore_kv_del(const char *);
+int		kore_kv_get(const char *, void *, size_t *);
+int		kore_kv_put(const char *, const void *, size_t, u_int64_t);
+int		kore_kv_cas(const char *, const void *, size_t,
+		    const void *, size_t, u_int64_t);
+int		kore_kv_incr(const char *, int64_t, int64_t *, u_int64_t);
+
+void		kore_upgrade_start(void);
+void		kore_upgrade_finish(void);
+void		kore_upgrade_inherit(void);
+int		kore_upgrade_draining(void);
+void		kore_upgrade_save(int, char **);
+int		kore_upgrade_listener(struct listener *);
+int		kore_upgrade_reuseport(struct listener *, u_int16_t);
+
 void		kore_platform_init(void);
 void		kore_platform_sandbox(void);
 void		kore_platform_event_init(void);
@@ -751,6 +1201,18 @@ void		kore_platform_schedule_read(int, void *);
 void		kore_platform_schedule_write(int, void *);
 void		kore_platform_event_schedule(int, int, int, void *);
 void		kore_platform_worker_setcpu(struct kore_worker *);
+int		kore_platform_reuseport_cbpf(int, const u_int16_t *, u_int16_t);
+int		kore_platform_listen_backlog(int, u_int32_t *, u_int32_t *);
+int		kore_platform_incoming_cpu(int);
+void		kore_platform_incoming_cpu_set(int, u_int16_t);
+
+#if defined(KORE_USE_IOURING)
+int		kore_uring_init(void);
+void		kore_uring_remove(int);
+void		kore_uring_cleanup(void);
+void		kore_uring_wait(u_int64_t);
+void		kore_uring_schedule(int, u_int32_t, int, void *);
+#endif
 
 #if defined(KORE_USE_PLATFORM_SENDFILE)
 int		kore_platform_sendfile(struct connection *, struct netbuf *);
@@ -772,7 +1234,10 @@ int		kore_auth_cookie(struct http_request *, struct kore_auth *);
 int		kore_auth_header(struct http_request *, struct kore_auth *);
 int		kore_auth_request(struct http_request *, struct kore_auth *);
 void		kore_auth_init(void);
+void		kore_auth_worker_init(void);
 int		kore_auth_new(const char *);
+void		kore_auth_cache_create(struct kore_auth *);
+void		kore_auth_cache_invalidate(const char *, const char *);
 struct kore_auth	*kore_auth_lookup(const char *);
 #endif
 
@@ -784,6 +1249,7 @@ struct kore_timer	*kore_timer_add(void (*cb)(void *, u_int64_t),
 			    u_int64_t, void *, int);
 
 void		kore_server_closeall(void);
+void		kore_listener_closeall(void);
 void		kore_server_cleanup(void);
 void		kore_server_free(struct kore_server *);
 void		kore_server_finalize(struct kore_server *);
@@ -796,6 +1262,9 @@ struct listener	*kore_listener_lookup(const char *);
 void		kore_listener_free(struct listener *);
 struct listener	*kore_listener_create(struct kore_server *);
 int		kore_listener_init(struct listener *, int, const char *);
+void		kore_listener_reuseport_init(const u_int16_t *, u_int16_t);
+void		kore_listener_reuseport_select(u_int16_t, u_int16_t);
+void		kore_listener_backlog_check(u_int32_t);
 
 int		kore_sockopt(int, int, int);
 int		kore_server_bind_unix(struct kore_server *,
@@ -804,6 +1273,10 @@ int		kore_server_bind(struct kore_server *,
 		    const char *, const char *, const char *);
 
 int		kore_tls_sni_cb(SSL *, int *, void *);
+#if defined(KORE_USE_HTTP2) || defined(KORE_USE_ACME)
+int		kore_tls_alpn_cb(SSL *, const unsigned char **, unsigned char *,
+		    const unsigned char *, unsigned int, void *);
+#endif
 void		kore_tls_info_callback(const SSL *, int, int);
 
 void			kore_connection_init(void);
@@ -813,6 +1286,8 @@ struct connection	*kore_connection_new(void *);
 void			kore_connection_event(void *, int);
 int			kore_connection_nonblock(int, int);
 void			kore_connection_check_timeout(u_int64_t);
+void			kore_connection_timeout_update(struct connection *);
+u_int64_t		kore_connection_timeout_next(u_int64_t);
 int			kore_connection_handle(struct connection *);
 void			kore_connection_remove(struct connection *);
 void			kore_connection_disconnect(struct connection *);
@@ -824,7 +1299,10 @@ int			kore_connection_accept(struct listener *,
 			    struct connection **);
 
 u_int64_t	kore_time_ms(void);
+u_int64_t	kore_time_us(void);
 void		kore_log_init(void);
+void		kore_log_sync(void);
+void		kore_log_gather(void *, u_int64_t);
 
 #if defined(KORE_USE_PYTHON)
 int		kore_configure_setting(const char *, char *);
@@ -842,12 +1320,17 @@ void		kore_mem_untag(void *);
 void		*kore_mem_lookup(u_int32_t);
 void		kore_mem_tag(void *, u_int32_t);
 void		*kore_malloc_tagged(size_t, u_int32_t);
+void		kore_mem_stats_get(struct kore_mem_stats *);
 
 void		*kore_pool_get(struct kore_pool *);
 void		kore_pool_put(struct kore_pool *, void *);
 void		kore_pool_init(struct kore_pool *, const char *,
 		    size_t, size_t);
+void		kore_pool_init_aligned(struct kore_pool *, const char *,
+		    size_t, size_t, size_t);
 void		kore_pool_cleanup(struct kore_pool *);
+void		kore_pool_trim(void *, u_int64_t);
+void		kore_pool_regions(u_int32_t *, u_int32_t *, u_int32_t *);
 
 char		*kore_time_to_date(time_t);
 char		*kore_strdup(const char *);
@@ -878,10 +1361,19 @@ int		kore_x509_subject_name(struct connection *, char **, int);
 void		kore_websocket_handshake(struct http_request *,
 		    const char *, const char *, const char *);
 int		kore_websocket_send_clean(struct netbuf *);
+void		kore_websocket_frame_build(struct kore_buf *, u_int8_t,
+		    const void *, size_t);
 void		kore_websocket_send(struct connection *,
 		    u_int8_t, const void *, size_t);
 void		kore_websocket_broadcast(struct connection *,
 		    u_int8_t, const void *, size_t, int);
+void		kore_websocket_init(void);
+void		kore_websocket_cleanup(void);
+void		kore_websocket_msg(struct kore_msg *, const void *);
+int		kore_websocket_subscribe(struct connection *, const char *);
+void		kore_websocket_unsubscribe(struct connection *, const char *);
+void		kore_websocket_publish(const char *,
+		    u_int8_t, const void *, size_t, int);
 #endif
 
 void		kore_msg_init(void);
@@ -890,25 +1382,45 @@ void		kore_msg_parent_init(void);
 void		kore_msg_unregister(u_int8_t);
 void		kore_msg_parent_add(struct kore_worker *);
 void		kore_msg_parent_remove(struct kore_worker *);
+void		kore_msg_flush(void);
 void		kore_msg_send(u_int16_t, u_int8_t, const void *, size_t);
+void		kore_msg_queue(u_int16_t, u_int8_t, const void *, size_t);
+void		kore_msg_parent_send(u_int16_t, u_int8_t,
+		    const void *, size_t);
 int		kore_msg_register(u_int8_t,
 		    void (*cb)(struct kore_msg *, const void *));
+#if defined(__linux__)
+void		kore_msg_shm_init(void);
+void		kore_msg_shm_reap(struct kore_worker *);
+#endif
 
 #if !defined(KORE_NO_HTTP)
 void		kore_filemap_init(void);
 void		kore_filemap_resolve_paths(void);
+void		kore_filemap_preload_paths(void);
 int		kore_filemap_create(struct kore_domain *, const char *,
 		    const char *);
 extern char	*kore_filemap_ext;
 extern char	*kore_filemap_index;
+extern int	kore_filemap_precompressed;
+extern int	kore_filemap_preload;
 #endif
 
 void			kore_fileref_init(void);
+void			kore_fileref_sysinit(void);
 struct kore_fileref	*kore_fileref_get(const char *, int);
 struct kore_fileref	*kore_fileref_create(struct kore_server *,
 			    const char *, int, off_t, struct timespec *);
 void			kore_fileref_release(struct kore_fileref *);
 
+extern u_int64_t	kore_fileref_revalidate;
+extern u_int64_t	kore_fileref_memory_max;
+extern u_int64_t	kore_fileref_memory_file_max;
+extern u_int64_t	kore_fileref_memory_used;
+extern u_int64_t	kore_fileref_memory_hits;
+extern u_int64_t	kore_fileref_memory_misses;
+extern u_int64_t	kore_fileref_memory_evictions;
+
 struct kore_domain	*kore_domain_new(const char *);
 
 void		kore_domain_init(void);
@@ -923,17 +1435,36 @@ void		kore_domain_closelogs(void);
 void		*kore_module_getsym(const char *, struct kore_runtime **);
 void		kore_domain_load_crl(void);
 void		kore_domain_keymgr_init(void);
+void		kore_domain_keymgr_cancel(struct connection *);
+void		kore_domain_tls_stats_log(void);
+void		kore_domain_tls_handshake(SSL *);
 void		kore_domain_callback(void (*cb)(struct kore_domain *));
 int		kore_domain_attach(struct kore_domain *, struct kore_server *);
 void		kore_domain_tlsinit(struct kore_domain *, int,
 		    const void *, size_t);
 void		kore_domain_crl_add(struct kore_domain *, const void *, size_t);
+void		kore_domain_tls_certificate(struct kore_domain *,
+		    const void *, size_t);
+int		kore_domain_tls_ready(struct kore_domain *);
+void		kore_domain_ocsp_set(struct kore_domain *, const void *, size_t);
 #if !defined(KORE_NO_HTTP)
 int		kore_module_handler_new(struct kore_domain *, const char *,
 		    const char *, const char *, int);
+int		kore_module_handler_param(struct kore_module_handle *,
+		    const char *, u_int8_t, int, const char *);
+struct kore_module_handle	*kore_module_handler_callback(
+				    struct kore_domain *, const char *,
+				    const char *,
+				    int (*)(struct http_request *), int, int);
 void		kore_module_handler_free(struct kore_module_handle *);
 struct kore_module_handle	*kore_module_handler_find(struct http_request *,
 				    struct kore_domain *);
+void		kore_module_routes_build(struct kore_domain *);
+struct kore_module_handle	*kore_module_handler_byid(struct kore_domain *,
+				    u_int16_t);
+void		kore_module_routes_free(struct kore_domain *);
+struct kore_handler_params	*kore_module_params_find(
+		    struct kore_module_handle *, const char *);
 #endif
 
 struct kore_runtime_call	*kore_runtime_getcall(const char *);
@@ -958,6 +1489,7 @@ void	kore_runtime_wsmessage(struct kore_runtime_call *,
 
 struct kore_domain	*kore_domain_byid(u_int16_t);
 struct kore_domain	*kore_domain_lookup(struct kore_server *, const char *);
+void			kore_domain_index_free(struct kore_server *);
 
 #if !defined(KORE_NO_HTTP)
 void		kore_validator_init(void);
@@ -985,6 +1517,8 @@ void		net_write64(u_int8_t *, u_int64_t);
 void		net_init(void);
 void		net_cleanup(void);
 struct netbuf	*net_netbuf_get(void);
+u_int8_t	*net_recvbuf_get(size_t, size_t *);
+void		net_recvbuf_put(void *);
 int		net_send(struct connection *);
 int		net_send_flush(struct connection *);
 int		net_recv_flush(struct connection *);
@@ -992,6 +1526,7 @@ int		net_read(struct connection *, size_t *);
 int		net_read_tls(struct connection *, size_t *);
 int		net_write(struct connection *, size_t, size_t *);
 int		net_write_tls(struct connection *, size_t, size_t *);
+void		net_tls_stats_log(void);
 void		net_recv_reset(struct connection *, size_t,
 		    int (*cb)(struct netbuf *));
 void		net_remove_netbuf(struct connection *, struct netbuf *);
@@ -1003,6 +1538,8 @@ void		net_send_queue(struct connection *, const void *, size_t);
 void		net_send_stream(struct connection *, void *,
 		    size_t, int (*cb)(struct netbuf *), struct netbuf **);
 void		net_send_fileref(struct connection *, struct kore_fileref *);
+void		net_send_fileref_range(struct connection *,
+		    struct kore_fileref *, off_t, off_t);
 
 void		kore_buf_free(struct kore_buf *);
 struct kore_buf	*kore_buf_alloc(size_t);
@@ -1015,6 +1552,9 @@ void		kore_buf_cleanup(struct kore_buf *);
 char	*kore_buf_stringify(struct kore_buf *, size_t *);
 void	kore_buf_appendf(struct kore_buf *, const char *, ...);
 void	kore_buf_appendv(struct kore_buf *, const char *, va_list);
+void	kore_buf_append_uint(struct kore_buf *, u_int64_t);
+void	kore_buf_append_hex(struct kore_buf *, u_int64_t);
+void	kore_buf_append_header(struct kore_buf *, const char *, const char *);
 void	kore_buf_replace_string(struct kore_buf *,
 	    const char *, const void *, size_t);
 
@@ -1022,9 +1562,30 @@ int	kore_json_parse(struct kore_json *);
 void	kore_json_cleanup(struct kore_json *);
 void	kore_json_item_free(struct kore_json_item *);
 void	kore_json_init(struct kore_json *, const u_int8_t *, size_t);
+void	kore_json_init_arena(struct kore_json *, u_int8_t *, size_t);
 void	kore_json_item_tobuf(struct kore_json_item *, struct kore_buf *);
 
+void	kore_json_writer_init(struct kore_json_writer *,
+	    struct kore_buf *, int);
+int	kore_json_writer_object_begin(struct kore_json_writer *);
+int	kore_json_writer_object_end(struct kore_json_writer *);
+int	kore_json_writer_array_begin(struct kore_json_writer *);
+int	kore_json_writer_array_end(struct kore_json_writer *);
+int	kore_json_writer_key(struct kore_json_writer *, const char *);
+int	kore_json_writer_string(struct kore_json_writer *, const char *);
+int	kore_json_writer_integer(struct kore_json_writer *, int64_t);
+int	kore_json_writer_unsigned(struct kore_json_writer *, u_int64_t);
+int	kore_json_writer_number(struct kore_json_writer *, double);
+int	kore_json_writer_literal(struct kore_json_writer *, int);
+int	kore_json_writer_raw(struct kore_json_writer *, const void *, size_t);
+int	kore_json_writer_finish(struct kore_json_writer *);
+
 const char		*kore_json_strerror(struct kore_json *);
+const char		*kore_json_writer_strerror(struct kore_json_writer *);
+struct kore_json_path	*kore_json_path_compile(const char *);
+void			kore_json_path_free(struct kore_json_path *);
+struct kore_json_item	*kore_json_find_path(struct kore_json_item *,
+			    struct kore_json_path *, int);
 struct kore_json_item	*kore_json_find(struct kore_json_item *,
 			    const char *, int);
 struct kore_json_item	*kore_json_create_item(struct kore_json_item *,
@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A header-only C++17 layer on top of the C API: owning wrappers for
+ * kore_buf, kore_json, kore_pgsql and kore_curl, a request wrapper with
+ * std::string_view accessors and routes declared at compile time.
+ *
+ * Routes and their parameters are constant tables, kore::install()
+ * registers them on a domain from the onload callback of the module:
+ *
+ *	static constexpr auto id = kore::arg<int64_t>("id");
+ *	static constexpr auto q = kore::arg<std::optional<std::string_view>>("q");
+ *
+ *	static int	user(kore::request &, int64_t,
+ *			    std::optional<std::string_view>);
+ *
+ *	static constexpr kore::route routes[] = {
+ *		kore::get<user, id, q>("/user"),
+ *	};
+ *
+ *	extern "C" int
+ *	init(int state)
+ *	{
+ *		if (state == KORE_MODULE_LOAD)
+ *			return (kore::install(routes));
+ *		return (KORE_RESULT_OK);
+ *	}
+ *
+ * No exceptions are thrown, failures are reported as they are in C.
+ */
+
+#ifndef __H_KORE_HPP
+#define __H_KORE_HPP
+
+#if __cplusplus < 201703L
+#error "kore.hpp requires C++17"
+#endif
+
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/* The C headers name some functions after a struct (http_media_type). */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wshadow"
+
+#include "kore.h"
+#include "http.h"
+
+#if defined(KORE_USE_PGSQL)
+#include "pgsql.h"
+#endif
+
+#if defined(KORE_USE_CURL)
+#include "curl.h"
+#endif
+
+#pragma GCC diagnostic pop
+
+namespace kore {
+
+namespace detail {
+
+/* Frees objects allocated with kore_malloc() after their cleanup. */
+template <typename T, void (*Cleanup)(T *)>
+struct deleter {
+	void operator()(T *p) const {
+		Cleanup(p);
+		kore_free(p);
+	}
+};
+
+template <typename T>
+struct is_optional : std::false_type {};
+
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+template <typename T>
+struct unwrap {
+	using type = T;
+};
+
+template <typename T>
+struct unwrap<std::optional<T>> {
+	using type = T;
+};
+
+template <typename T>
+inline constexpr bool always_false = false;
+
+/* The HTTP_ARG_TYPE_* for an argument of type T. */
+template <typename T>
+constexpr int
+arg_type(void)
+{
+	if constexpr (std::is_same_v<T, std::string_view>)
+		return (HTTP_ARG_TYPE_STRING);
+	else if constexpr (std::is_same_v<T, int16_t>)
+		return (HTTP_ARG_TYPE_INT16);
+	else if constexpr (std::is_same_v<T, u_int16_t>)
+		return (HTTP_ARG_TYPE_UINT16);
+	else if constexpr (std::is_same_v<T, int32_t>)
+		return (HTTP_ARG_TYPE_INT32);
+	else if constexpr (std::is_same_v<T, u_int32_t>)
+		return (HTTP_ARG_TYPE_UINT32);
+	else if constexpr (std::is_same_v<T, int64_t>)
+		return (HTTP_ARG_TYPE_INT64);
+	else if constexpr (std::is_same_v<T, u_int64_t>)
+		return (HTTP_ARG_TYPE_UINT64);
+	else if constexpr (std::is_same_v<T, float>)
+		return (HTTP_ARG_TYPE_FLOAT);
+	else if constexpr (std::is_same_v<T, double>)
+		return (HTTP_ARG_TYPE_DOUBLE);
+	else
+		static_assert(always_false<T>, "unsupported argument type");
+}
+
+/*
+ * A parameter as handed to kore_module_handler_param(). Arguments
+ * without a validator of their own get one by type, which install()
+ * adds when it does not exist yet.
+ */
+struct param_desc {
+	const char	*name;
+	const char	*validator;
+	u_int8_t	vtype;
+	const char	*varg;
+};
+
+template <typename T>
+constexpr param_desc
+param_default(const char *name)
+{
+	if constexpr (std::is_same_v<T, int16_t>) {
+		return { name, "kore.hpp:int16",
+		    KORE_VALIDATOR_TYPE_INT, "-32768:32767" };
+	} else if constexpr (std::is_same_v<T, u_int16_t>) {
+		return { name, "kore.hpp:uint16",
+		    KORE_VALIDATOR_TYPE_INT, "0:65535" };
+	} else if constexpr (std::is_same_v<T, int32_t>) {
+		return { name, "kore.hpp:int32",
+		    KORE_VALIDATOR_TYPE_INT, "-2147483648:2147483647" };
+	} else if constexpr (std::is_same_v<T, u_int32_t>) {
+		return { name, "kore.hpp:uint32",
+		    KORE_VALIDATOR_TYPE_INT, "0:4294967295" };
+	} else if constexpr (std::is_same_v<T, int64_t>) {
+		return { name, "kore.hpp:int64", KORE_VALIDATOR_TYPE_INT,
+		    "-9223372036854775808:9223372036854775807" };
+	} else if constexpr (std::is_same_v<T, std::string_view>) {
+		return { name, "kore.hpp:string",
+		    KORE_VALIDATOR_TYPE_LENGTH, "0:9223372036854775807" };
+	} else {
+		/* The conversion in http_argument_get() checks the rest. */
+		(void)arg_type<T>();
+		return { name, "kore.hpp:number",
+		    KORE_VALIDATOR_TYPE_LENGTH, "1:64" };
+	}
+}
+
+}
+
+/*
+ * A move-only owner of a kore_buf. A moved-from buf holds nothing and
+ * may only be assigned to or destroyed.
+ */
+class buf {
+public:
+	explicit buf(size_t initial = 128) : b(kore_buf_alloc(initial)) {}
+	~buf() {
+		if (b != nullptr)
+			kore_buf_free(b);
+	}
+
+	buf(buf &&other) noexcept : b(std::exchange(other.b, nullptr)) {}
+	buf &operator=(buf &&other) noexcept {
+		if (this != &other) {
+			if (b != nullptr)
+				kore_buf_free(b);
+			b = std::exchange(other.b, nullptr);
+		}
+		return (*this);
+	}
+
+	buf(const buf &) = delete;
+	buf &operator=(const buf &) = delete;
+
+	buf &append(const void *data, size_t len) {
+		kore_buf_append(b, data, len);
+		return (*this);
+	}
+	buf &append(std::string_view s) {
+		return (append(s.data(), s.size()));
+	}
+	buf &append_uint(u_int64_t v) {
+		kore_buf_append_uint(b, v);
+		return (*this);
+	}
+	[[gnu::format(printf, 2, 3)]] buf &appendf(const char *fmt, ...) {
+		va_list		args;
+
+		va_start(args, fmt);
+		kore_buf_appendv(b, fmt, args);
+		va_end(args);
+		return (*this);
+	}
+
+	void reset(void) { kore_buf_reset(b); }
+	size_t size(void) const { return (b->offset); }
+	std::string_view view(void) const {
+		return (std::string_view((const char *)b->data, b->offset));
+	}
+
+	struct kore_buf *get(void) const { return (b); }
+
+	/* Hands the kore_buf over, free it with kore_buf_free(). */
+	struct kore_buf *release(void) { return (std::exchange(b, nullptr)); }
+
+private:
+	struct kore_buf		*b;
+};
+
+/*
+ * A parsed JSON document. The input must outlive it, the items found
+ * in it live as long as the json object.
+ */
+class json {
+public:
+	json(const void *data, size_t len) :
+	    j((struct kore_json *)kore_malloc(sizeof(struct kore_json))) {
+		kore_json_init(j.get(), (const u_int8_t *)data, len);
+	}
+	explicit json(std::string_view s) : json(s.data(), s.size()) {}
+
+	bool parse(void) { return (kore_json_parse(j.get()) == KORE_RESULT_OK); }
+	const char *error(void) const { return (kore_json_strerror(j.get())); }
+
+	struct kore_json_item *root(void) const { return (j->root); }
+	struct kore_json_item *find(const char *path, int type) const {
+		if (j->root == nullptr)
+			return (nullptr);
+		return (kore_json_find(j->root, path, type));
+	}
+
+	std::optional<std::string_view> string(const char *path) const {
+		struct kore_json_item	*item;
+
+		if ((item = find(path, KORE_JSON_TYPE_STRING)) == nullptr)
+			return (std::nullopt);
+		return (std::string_view(item->data.string));
+	}
+
+	std::optional<double> number(const char *path) const {
+		struct kore_json_item	*item;
+
+		if ((item = find(path, KORE_JSON_TYPE_NUMBER)) == nullptr)
+			return (std::nullopt);
+		return (item->data.number);
+	}
+
+	struct kore_json *get(void) const { return (j.get()); }
+
+private:
+	std::unique_ptr<struct kore_json,
+	    detail::deleter<struct kore_json, kore_json_cleanup>>	j;
+};
+
+/* Writes JSON into a buf, which must outlive the writer. */
+class json_writer {
+public:
+	explicit json_writer(buf &out, int flags = 0) {
+		kore_json_writer_init(&w, out.get(), flags);
+	}
+
+	json_writer(const json_writer &) = delete;
+	json_writer &operator=(const json_writer &) = delete;
+
+	json_writer &object_begin(void) {
+		(void)kore_json_writer_object_begin(&w);
+		return (*this);
+	}
+	json_writer &object_end(void) {
+		(void)kore_json_writer_object_end(&w);
+		return (*this);
+	}
+	json_writer &array_begin(void) {
+		(void)kore_json_writer_array_begin(&w);
+		return (*this);
+	}
+	json_writer &array_end(void) {
+		(void)kore_json_writer_array_end(&w);
+		return (*this);
+	}
+	json_writer &key(const char *name) {
+		(void)kore_json_writer_key(&w, name);
+		return (*this);
+	}
+	json_writer &string(const char *value) {
+		(void)kore_json_writer_string(&w, value);
+		return (*this);
+	}
+	json_writer &integer(int64_t value) {
+		(void)kore_json_writer_integer(&w, value);
+		return (*this);
+	}
+	json_writer &number(double value) {
+		(void)kore_json_writer_number(&w, value);
+		return (*this);
+	}
+	json_writer &literal(int value) {
+		(void)kore_json_writer_literal(&w, value);
+		return (*this);
+	}
+
+	/* Errors stick, so checking once at the end is enough. */
+	bool finish(void) {
+		return (kore_json_writer_finish(&w) == KORE_RESULT_OK);
+	}
+	const char *error(void) { return (kore_json_writer_strerror(&w)); }
+
+private:
+	struct kore_json_writer		w;
+};
+
+/* A view of a request, it does not own it. */
+class request {
+public:
+	explicit request(struct http_request *r) : req(r) {}
+
+	struct http_request *get(void) const { return (req); }
+	int method(void) const { return (req->method); }
+	std::string_view path(void) const { return (req->path); }
+
+	std::optional<std::string_view> header(const char *name) const {
+		const char	*value;
+
+		if (!http_request_header(req, name, &value))
+			return (std::nullopt);
+		return (std::string_view(value));
+	}
+
+	/* Only arguments named in the params of the route are kept. */
+	template <typename T>
+	std::optional<T> arg(const char *name) const {
+		if constexpr (std::is_same_v<T, std::string_view>) {
+			char	*s;
+
+			if (!http_argument_get(req, name, (void **)&s, NULL,
+			    HTTP_ARG_TYPE_STRING))
+				return (std::nullopt);
+			return (std::string_view(s));
+		} else {
+			T	value;
+
+			if (!http_argument_get(req, name, NULL, &value,
+			    detail::arg_type<T>()))
+				return (std::nullopt);
+			return (value);
+		}
+	}
+
+	void response_header(const char *name, const char *value) {
+		http_response_header(req, name, value);
+	}
+
+	void respond(int status) {
+		http_response(req, status, NULL, 0);
+	}
+	void respond(int status, std::string_view body) {
+		http_response(req, status, body.data(), body.size());
+	}
+
+	/* The data of the buf is sent as is, without a copy. */
+	void respond(int status, buf &&body) {
+		http_response_buf(req, status, body.release());
+	}
+
+private:
+	struct http_request	*req;
+};
+
+#if defined(KORE_USE_PGSQL)
+/*
+ * An owner of a kore_pgsql. Its address is stable, an asynchronous
+ * query can release() it to keep it alive across handler calls.
+ */
+class pgsql {
+public:
+	pgsql(void) :
+	    p((struct kore_pgsql *)kore_malloc(sizeof(struct kore_pgsql))) {
+		kore_pgsql_init(p.get());
+	}
+
+	pgsql(pgsql &&) noexcept = default;
+	pgsql &operator=(pgsql &&) noexcept = default;
+
+	bool setup(const char *db, int flags = KORE_PGSQL_SYNC) {
+		return (kore_pgsql_setup(p.get(), db, flags) == KORE_RESULT_OK);
+	}
+	bool query(const char *sql) {
+		return (kore_pgsql_query(p.get(), sql) == KORE_RESULT_OK);
+	}
+
+	template <typename... Args>
+	bool query_params(const char *sql, int format, Args... args) {
+		static_assert(sizeof...(Args) % 3 == 0,
+		    "parameters come as value, length, format");
+		return (kore_pgsql_query_params(p.get(), sql, format,
+		    (int)(sizeof...(Args) / 3), args...) == KORE_RESULT_OK);
+	}
+
+	int ntuples(void) const { return (kore_pgsql_ntuples(p.get())); }
+	int nfields(void) const { return (kore_pgsql_nfields(p.get())); }
+
+	std::string_view value(int row, int col) const {
+		return (std::string_view(kore_pgsql_getvalue(p.get(), row, col),
+		    kore_pgsql_getlength(p.get(), row, col)));
+	}
+
+	const char *error(void) const { return (p->error); }
+	void logerror(void) const { kore_pgsql_logerror(p.get()); }
+
+	struct kore_pgsql *get(void) const { return (p.get()); }
+
+	/* Free with kore_pgsql_cleanup() and kore_free(). */
+	struct kore_pgsql *release(void) { return (p.release()); }
+
+private:
+	std::unique_ptr<struct kore_pgsql,
+	    detail::deleter<struct kore_pgsql, kore_pgsql_cleanup>>	p;
+};
+#endif
+
+#if defined(KORE_USE_CURL)
+/*
+ * An owner of a kore_curl, check it with ok() after construction.
+ * Like pgsql its address is stable so it can be release()d.
+ */
+class curl {
+public:
+	curl(const char *url, int flags = KORE_CURL_SYNC) :
+	    c((struct kore_curl *)kore_calloc(1, sizeof(struct kore_curl))) {
+		if (!kore_curl_init(c.get(), url, flags)) {
+			kore_log(LOG_NOTICE, "curl init: %s", c->errbuf);
+			kore_free(c.release());
+		}
+	}
+
+	curl(curl &&) noexcept = default;
+	curl &operator=(curl &&) noexcept = default;
+
+	bool ok(void) const { return (c != nullptr); }
+
+	void http_setup(int method, std::string_view body = {}) {
+		kore_curl_http_setup(c.get(), method, body.data(), body.size());
+	}
+	void set_header(const char *name, const char *value) {
+		kore_curl_http_set_header(c.get(), name, value);
+	}
+
+	void run(void) { kore_curl_run(c.get()); }
+	bool success(void) const { return (kore_curl_success(c.get())); }
+	long status(void) const { return (c->http.status); }
+	const char *error(void) const { return (c->errbuf); }
+	void logerror(void) const { kore_curl_logerror(c.get()); }
+
+	std::optional<std::string_view> header(const char *name) const {
+		const char	*value;
+
+		if (!kore_curl_http_get_header(c.get(), name, &value))
+			return (std::nullopt);
+		return (std::string_view(value));
+	}
+
+	std::string_view response(void) const {
+		size_t		len;
+		const u_int8_t	*body;
+
+		kore_curl_response_as_bytes(c.get(), &body, &len);
+		return (std::string_view((const char *)body, len));
+	}
+
+	struct kore_curl *get(void) const { return (c.get()); }
+
+	/* Free with kore_curl_cleanup() and kore_free(). */
+	struct kore_curl *release(void) { return (c.release()); }
+
+private:
+	std::unique_ptr<struct kore_curl,
+	    detail::deleter<struct kore_curl, kore_curl_cleanup>>	c;
+};
+#endif
+
+/*
+ * A named argument of type T for a route. An std::optional<T> argument
+ * may be absent, a missing or invalid plain T answers with a 400.
+ */
+template <typename T>
+struct param {
+	using value_type = T;
+	using arg_type = typename detail::unwrap<T>::type;
+
+	const char	*name;
+	const char	*validator;
+
+	constexpr detail::param_desc desc(void) const {
+		detail::param_desc	d = detail::param_default<arg_type>(name);
+
+		if (validator != nullptr) {
+			d.validator = validator;
+			d.vtype = 0;
+		}
+
+		return (d);
+	}
+};
+
+/* The validator must exist when install() runs. */
+template <typename T>
+constexpr param<T>
+arg(const char *name, const char *validator = nullptr)
+{
+	return (param<T>{ name, validator });
+}
+
+struct route {
+	const char			*path;
+	u_int8_t			method;
+	int				(*cb)(struct http_request *);
+	const detail::param_desc	*params;
+	size_t				nparams;
+};
+
+namespace detail {
+
+template <typename T>
+T
+extract(const request &req, const param<T> &p, bool &ok)
+{
+	std::optional<typename param<T>::arg_type>	v;
+
+	v = req.arg<typename param<T>::arg_type>(p.name);
+
+	if constexpr (is_optional<T>::value) {
+		return (v);
+	} else {
+		if (!v) {
+			ok = false;
+			return (T{});
+		}
+		return (*v);
+	}
+}
+
+/* Generates the C handler for Fn and the params table of its route. */
+template <auto Fn, const auto &...P>
+struct binding {
+	static_assert(std::is_invocable_r_v<int, decltype(Fn), request &,
+	    typename std::decay_t<decltype(P)>::value_type...>,
+	    "handler does not match its arguments");
+
+	static constexpr param_desc params[] = {
+		P.desc()..., { nullptr, nullptr, 0, nullptr }
+	};
+
+	static int call(struct http_request *r) {
+		request		req(r);
+
+		if constexpr (sizeof...(P) == 0) {
+			return (Fn(req));
+		} else {
+			bool	ok = true;
+
+			if (r->method == HTTP_METHOD_POST)
+				http_populate_post(r);
+			else
+				http_populate_get(r);
+
+			/* A braced list keeps the arguments in order. */
+			std::tuple<typename std::decay_t<decltype(P)>::value_type...>
+			    args{ extract(req, P, ok)... };
+
+			if (!ok) {
+				http_response(r, HTTP_STATUS_BAD_REQUEST,
+				    NULL, 0);
+				return (KORE_RESULT_OK);
+			}
+
+			return (std::apply([&req](auto &...a) {
+				return (Fn(req, a...));
+			}, args));
+		}
+	}
+};
+
+}
+
+/*
+ * A route with arguments from the query string for GET (and HEAD)
+ * or from a form encoded body for POST. A path not starting with a
+ * slash is a regex, like in the configuration.
+ */
+template <auto Fn, const auto &...P>
+constexpr route
+get(const char *path)
+{
+	return (route{ path, HTTP_METHOD_GET, detail::binding<Fn, P...>::call,
+	    detail::binding<Fn, P...>::params, sizeof...(P) });
+}
+
+template <auto Fn, const auto &...P>
+constexpr route
+post(const char *path)
+{
+	return (route{ path, HTTP_METHOD_POST, detail::binding<Fn, P...>::call,
+	    detail::binding<Fn, P...>::params, sizeof...(P) });
+}
+
+/* A route for any method, without arguments. */
+template <auto Fn>
+constexpr route
+any(const char *path)
+{
+	return (route{ path, 0, detail::binding<Fn>::call,
+	    detail::binding<Fn>::params, 0 });
+}
+
+inline struct kore_domain *
+domain(const char *name)
+{
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			if (!strcmp(dom->domain, name))
+				return (dom);
+		}
+	}
+
+	return (nullptr);
+}
+
+/*
+ * Registers the routes on the domain named as in the configuration.
+ * Call it from the onload callback of the module: after a reload the
+ * routes are bound to the new code again.
+ */
+inline int
+install(const route *routes, size_t count, const char *name = "*")
+{
+	size_t				i, n;
+	u_int8_t			method;
+	int				type, flags, methods;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+	const detail::param_desc	*p;
+
+	if ((dom = domain(name)) == nullptr) {
+		kore_log(LOG_ERR, "kore.hpp: no domain '%s'", name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (routes[i].path[0] == '/')
+			type = HANDLER_TYPE_STATIC;
+		else
+			type = HANDLER_TYPE_DYNAMIC;
+
+		method = routes[i].method;
+		if (method == HTTP_METHOD_GET)
+			methods = HTTP_METHOD_GET | HTTP_METHOD_HEAD;
+		else if (method != 0)
+			methods = method;
+		else
+			methods = HTTP_METHOD_ALL;
+
+		hdlr = kore_module_handler_callback(dom, routes[i].path,
+		    routes[i].path, routes[i].cb, type, methods);
+		if (hdlr == nullptr)
+			return (KORE_RESULT_ERROR);
+
+		flags = (method == HTTP_METHOD_GET) ?
+		    KORE_PARAMS_QUERY_STRING : 0;
+
+		for (n = 0; n < routes[i].nparams; n++) {
+			p = &routes[i].params[n];
+
+			if (p->vtype != 0 &&
+			    kore_validator_lookup(p->validator) == nullptr &&
+			    !kore_validator_add(p->validator, p->vtype,
+			    p->varg))
+				return (KORE_RESULT_ERROR);
+
+			if (!kore_module_handler_param(hdlr, p->name,
+			    method, flags, p->validator))
+				return (KORE_RESULT_ERROR);
+
+			if (method == HTTP_METHOD_GET &&
+			    !kore_module_handler_param(hdlr, p->name,
+			    HTTP_METHOD_HEAD, flags, p->validator))
+				return (KORE_RESULT_ERROR);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+template <size_t N>
+inline int
+install(const route (&routes)[N], const char *name = "*")
+{
+	return (install(routes, N, name));
+}
+
+}
+
+#endif
@@ -25,6 +25,16 @@
 #define KORE_PGSQL_SYNC			0x0001
 #define KORE_PGSQL_ASYNC		0x0002
 #define KORE_PGSQL_SCHEDULED		0x0004
+#define KORE_PGSQL_READONLY		0x0008
+
+/* Queue classes, the same as the HTTP_PRIO_* route classes. */
+#define KORE_PGSQL_PRIO_HIGH		0
+#define KORE_PGSQL_PRIO_NORMAL		1
+#define KORE_PGSQL_PRIO_LOW		2
+#define KORE_PGSQL_PRIO_MAX		3
+
+/* Room for a uuid from kore_pgsql_getuuid(), including the NUL. */
+#define KORE_PGSQL_UUID_LEN		37
 
 #define KORE_PGSQL_PARAM_BINARY(v, l)	v, l, 1
 #define KORE_PGSQL_PARAM_TEXT_LEN(v, l)	v, l, 0
@@ -39,18 +49,38 @@ struct pgsql_conn {
 	u_int8_t			flags;
 	char				*name;
 
+	int				fd;
+	u_int64_t			created;
+	struct pgsql_db			*owner;
+
 	PGconn				*db;
 	struct pgsql_job		*job;
 	TAILQ_ENTRY(pgsql_conn)		list;
+
+	u_int16_t			nprepared;
+	TAILQ_HEAD(pgsql_prepared_list, pgsql_prepared)	prepared;
 };
 
 struct pgsql_db {
 	char			*name;
 	char			*conn_string;
+	int			flags;
+	u_int16_t		conn_min;
 	u_int16_t		conn_max;
 	u_int16_t		conn_count;
-
-	LIST_ENTRY(pgsql_db)	rlist;
+	u_int32_t		queued;
+
+	/* Replicas hang off their primary and are never looked up. */
+	struct pgsql_db			*primary;
+	struct pgsql_conn		*checking;
+	TAILQ_HEAD(, pgsql_db)		replicas;
+	TAILQ_ENTRY(pgsql_db)		replica;
+
+	TAILQ_HEAD(, pgsql_conn)	conn_free;
+	TAILQ_HEAD(, pgsql_wait)	queue[KORE_PGSQL_PRIO_MAX];
+	int64_t				credit[KORE_PGSQL_PRIO_MAX];
+	LIST_HEAD(, pgsql_statement)	statements;
+	LIST_ENTRY(pgsql_db)		rlist;
 };
 
 struct kore_pgsql {
@@ -60,11 +90,38 @@ struct kore_pgsql {
 	PGresult		*result;
 	struct pgsql_conn	*conn;
 
+	/*
+	 * Queue class and how long (in milliseconds, 0 for ever) to wait
+	 * for a connection. Taken from the bound request and the
+	 * pgsql_queue_timeout setting, may be changed before setup.
+	 */
+	int			prio;
+	u_int64_t		timeout;
+	u_int64_t		queued;
+	struct pgsql_wait	*wait;
+
 	struct {
 		char		*channel;
 		char		*extra;
 	} notify;
 
+	struct {
+		int		index;
+		int		count;
+		int		failed;
+	} pipeline;
+
+	struct {
+		u_int16_t	batch;
+		u_int16_t	count;
+		PGresult	**rows;
+	} stream;
+
+	struct {
+		char		*data;
+		size_t		len;
+	} copy;
+
 	struct http_request	*req;
 	void			*arg;
 	void			(*cb)(struct kore_pgsql *, void *);
@@ -72,11 +129,20 @@ struct kore_pgsql {
 	LIST_ENTRY(kore_pgsql)	rlist;
 };
 
+extern u_int16_t	pgsql_conn_min;
 extern u_int16_t	pgsql_conn_max;
+extern u_int32_t	pgsql_conn_check;
+extern u_int32_t	pgsql_conn_lifetime;
+extern u_int16_t	pgsql_statement_max;
+extern u_int32_t	pgsql_replica_lag;
 extern u_int32_t	pgsql_queue_limit;
+extern u_int32_t	pgsql_queue_count;
+extern u_int64_t	pgsql_queue_timeout;
+extern u_int64_t	pgsql_queue_timeouts;
 
 void	kore_pgsql_sys_init(void);
 void	kore_pgsql_sys_cleanup(void);
+void	kore_pgsql_worker_init(void);
 void	kore_pgsql_init(struct kore_pgsql *);
 void	kore_pgsql_bind_request(struct kore_pgsql *, struct http_request *);
 void	kore_pgsql_bind_callback(struct kore_pgsql *,
@@ -92,7 +158,21 @@ int	kore_pgsql_v_query_params(struct kore_pgsql *,
 	    const void *, int, int, va_list);
 int	kore_pgsql_query_param_fields(struct kore_pgsql *, const void *,
 	    int, int, const char **, int *, int *);
+int	kore_pgsql_query_prepared(struct kore_pgsql *,
+	    const char *, int, int, ...);
+int	kore_pgsql_v_query_prepared(struct kore_pgsql *,
+	    const char *, int, int, va_list);
+int	kore_pgsql_query_prepared_fields(struct kore_pgsql *, const char *,
+	    int, int, const char **, int *, int *);
+int	kore_pgsql_statement(const char *, const char *, const char *);
+int	kore_pgsql_pipeline(struct kore_pgsql *);
+int	kore_pgsql_pipeline_sync(struct kore_pgsql *);
+int	kore_pgsql_stream(struct kore_pgsql *, u_int16_t);
+int	kore_pgsql_copy_put(struct kore_pgsql *, const void *, size_t);
+int	kore_pgsql_copy_end(struct kore_pgsql *, const char *);
+int	kore_pgsql_copy_body(struct http_request *, const void *, size_t);
 int	kore_pgsql_register(const char *, const char *);
+int	kore_pgsql_register_replica(const char *, const char *);
 int	kore_pgsql_ntuples(struct kore_pgsql *);
 int	kore_pgsql_nfields(struct kore_pgsql *);
 void	kore_pgsql_logerror(struct kore_pgsql *);
@@ -100,6 +180,15 @@ char	*kore_pgsql_fieldname(struct kore_pgsql *, int);
 char	*kore_pgsql_getvalue(struct kore_pgsql *, int, int);
 int	kore_pgsql_getlength(struct kore_pgsql *, int, int);
 int	kore_pgsql_column_binary(struct kore_pgsql *, int);
+int	kore_pgsql_getint4(struct kore_pgsql *, int, int, int32_t *);
+int	kore_pgsql_getint8(struct kore_pgsql *, int, int, int64_t *);
+int	kore_pgsql_getfloat8(struct kore_pgsql *, int, int, double *);
+int	kore_pgsql_getbool(struct kore_pgsql *, int, int, int *);
+int	kore_pgsql_gettimestamp(struct kore_pgsql *, int, int, int64_t *);
+int	kore_pgsql_getuuid(struct kore_pgsql *, int, int, char *, size_t);
+int	kore_pgsql_getbytea(struct kore_pgsql *, int, int,
+	    const u_int8_t **, size_t *);
+int	kore_pgsql_json(struct kore_pgsql *, struct kore_buf *);
 
 #if defined(__cplusplus)
 }
@@ -112,5 +201,7 @@ int	kore_pgsql_column_binary(struct kore_pgsql *, int);
 #define KORE_PGSQL_STATE_DONE		5
 #define KORE_PGSQL_STATE_COMPLETE	6
 #define KORE_PGSQL_STATE_NOTIFY		7
+#define KORE_PGSQL_STATE_COPY_IN	8
+#define KORE_PGSQL_STATE_COPY_OUT	9
 
 #endif
@@ -25,6 +25,7 @@
 #include <frameobject.h>
 
 void		kore_python_init(void);
+void		kore_python_fork_prepare(void);
 void		kore_python_preinit(void);
 void		kore_python_cleanup(void);
 void		kore_python_coro_run(void);
@@ -33,6 +34,8 @@ int		kore_python_coro_pending(void);
 void		kore_python_path(const char *);
 void		kore_python_coro_delete(void *);
 void		kore_python_log_error(const char *);
+void		kore_python_body_detach(struct http_request *);
+void		kore_python_freelist_log(void);
 
 PyObject	*kore_python_callable(PyObject *, const char *);
 
@@ -45,6 +48,9 @@ void	kore_python_seccomp_hook(const char *);
 extern const char			*kore_pymodule;
 #endif
 
+extern u_int32_t			kore_python_coro_ms;
+extern u_int32_t			kore_python_coro_limit;
+extern int				kore_python_gc_freeze;
 extern struct kore_module_functions	kore_python_module;
 extern struct kore_runtime		kore_python_runtime;
 
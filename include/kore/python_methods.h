@@ -19,8 +19,13 @@
 
 struct python_coro {
 	u_int32_t			id;
+	int				prio;
 	int				state;
 	int				killed;
+	u_int32_t			runs;
+	u_int64_t			run_us;
+	u_int64_t			slice_us;
+	u_int64_t			slice_max;
 	PyObject			*obj;
 	char				*name;
 	PyObject			*result;
@@ -36,6 +41,12 @@ struct python_coro {
 TAILQ_HEAD(coro_list, python_coro);
 
 static PyObject		*python_kore_app(PyObject *, PyObject *);
+static PyObject		*python_kore_kv_get(PyObject *, PyObject *);
+static PyObject		*python_kore_kv_put(PyObject *, PyObject *);
+static PyObject		*python_kore_kv_cas(PyObject *, PyObject *);
+static PyObject		*python_kore_kv_del(PyObject *, PyObject *);
+static PyObject		*python_kore_kv_incr(PyObject *, PyObject *);
+static PyObject		*python_kore_auth_invalidate(PyObject *, PyObject *);
 static PyObject		*python_kore_log(PyObject *, PyObject *);
 static PyObject		*python_kore_time(PyObject *, PyObject *);
 static PyObject		*python_kore_lock(PyObject *, PyObject *);
@@ -48,7 +59,10 @@ static PyObject		*python_kore_fatalx(PyObject *, PyObject *);
 static PyObject		*python_kore_setname(PyObject *, PyObject *);
 static PyObject		*python_kore_suspend(PyObject *, PyObject *);
 static PyObject		*python_kore_shutdown(PyObject *, PyObject *);
+static PyObject		*python_kore_warmup_hold(PyObject *, PyObject *);
+static PyObject		*python_kore_warmup_release(PyObject *, PyObject *);
 static PyObject		*python_kore_coroname(PyObject *, PyObject *);
+static PyObject		*python_kore_corostats(PyObject *, PyObject *);
 static PyObject		*python_kore_corotrace(PyObject *, PyObject *);
 static PyObject		*python_kore_task_kill(PyObject *, PyObject *);
 static PyObject		*python_kore_prerequest(PyObject *, PyObject *);
@@ -83,6 +97,12 @@ static PyObject		*python_websocket_broadcast(PyObject *, PyObject *);
 
 static struct PyMethodDef pykore_methods[] = {
 	METHOD("app", python_kore_app, METH_VARARGS),
+	METHOD("kv_get", python_kore_kv_get, METH_VARARGS),
+	METHOD("kv_put", python_kore_kv_put, METH_VARARGS),
+	METHOD("kv_cas", python_kore_kv_cas, METH_VARARGS),
+	METHOD("kv_del", python_kore_kv_del, METH_VARARGS),
+	METHOD("kv_incr", python_kore_kv_incr, METH_VARARGS),
+	METHOD("auth_invalidate", python_kore_auth_invalidate, METH_VARARGS),
 	METHOD("log", python_kore_log, METH_VARARGS),
 	METHOD("time", python_kore_time, METH_NOARGS),
 	METHOD("lock", python_kore_lock, METH_NOARGS),
@@ -95,8 +115,11 @@ static struct PyMethodDef pykore_methods[] = {
 	METHOD("setname", python_kore_setname, METH_VARARGS),
 	METHOD("suspend", python_kore_suspend, METH_VARARGS),
 	METHOD("shutdown", python_kore_shutdown, METH_NOARGS),
+	METHOD("warmup_hold", python_kore_warmup_hold, METH_NOARGS),
+	METHOD("warmup_release", python_kore_warmup_release, METH_NOARGS),
 	METHOD("coroname", python_kore_coroname, METH_VARARGS),
 	METHOD("corotrace", python_kore_corotrace, METH_VARARGS),
+	METHOD("corostats", python_kore_corostats, METH_NOARGS),
 	METHOD("task_kill", python_kore_task_kill, METH_VARARGS),
 	METHOD("prerequest", python_kore_prerequest, METH_VARARGS),
 	METHOD("task_create", python_kore_task_create, METH_VARARGS),
@@ -689,6 +712,38 @@ struct pyhttp_request {
 	struct http_request	*req;
 	PyObject		*dict;
 	PyObject		*data;
+	PyObject		*body;
+};
+
+/*
+ * Exports a request body to memoryviews without copying it. The request
+ * owns the data until it is freed, then the buffer moves here so views
+ * that are still around stay valid. Offloaded bodies are mapped instead.
+ */
+struct pyhttp_body {
+	PyObject_HEAD
+	u_int8_t		*data;
+	size_t			length;
+	void			*map;
+	struct kore_buf		*buf;
+};
+
+static void	pyhttp_body_dealloc(struct pyhttp_body *);
+static int	pyhttp_body_getbuffer(struct pyhttp_body *, Py_buffer *, int);
+
+static PyBufferProcs pyhttp_body_buffer = {
+	.bf_getbuffer = (getbufferproc)pyhttp_body_getbuffer,
+	.bf_releasebuffer = NULL,
+};
+
+static PyTypeObject pyhttp_body_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kore.http_body",
+	.tp_doc = "http request body",
+	.tp_as_buffer = &pyhttp_body_buffer,
+	.tp_dealloc = (destructor)pyhttp_body_dealloc,
+	.tp_basicsize = sizeof(struct pyhttp_body),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
 };
 
 struct pyhttp_iterobj {
@@ -742,7 +797,9 @@ static PyObject	*pyhttp_get_body(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_agent(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_method(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_body_path(struct pyhttp_request *, void *);
+static PyObject	*pyhttp_get_body_view(struct pyhttp_request *, void *);
 static PyObject	*pyhttp_get_connection(struct pyhttp_request *, void *);
+static PyObject	*pyhttp_get_timing(struct pyhttp_request *, void *);
 
 static PyGetSetDef pyhttp_request_getset[] = {
 	GETTER("host", pyhttp_get_host),
@@ -751,7 +808,9 @@ static PyGetSetDef pyhttp_request_getset[] = {
 	GETTER("agent", pyhttp_get_agent),
 	GETTER("method", pyhttp_get_method),
 	GETTER("body_path", pyhttp_get_body_path),
+	GETTER("body_view", pyhttp_get_body_view),
 	GETTER("connection", pyhttp_get_connection),
+	GETTER("timing", pyhttp_get_timing),
 	GETTER(NULL, NULL)
 };
 
@@ -1000,3 +1059,100 @@ static PyTypeObject pykore_pgsql_type = {
 	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
 };
 #endif
+
+#if defined(KORE_USE_TASKS)
+
+#define PYFS_OP_OPEN		1
+#define PYFS_OP_READ		2
+#define PYFS_OP_WRITE		3
+#define PYFS_OP_FSYNC		4
+#define PYFS_OP_STAT		5
+#define PYFS_OP_CLOSE		6
+#define PYFS_OP_SENDFILE	7
+
+#define PYFS_STATE_INIT		1
+#define PYFS_STATE_WAIT		2
+#define PYFS_STATE_DONE		3
+
+/*
+ * The part of a kore.fs call that a task thread works on. It never
+ * touches python objects, the buffers it uses are set up beforehand
+ * and are kept alive by the job until the event loop reaps it. If the
+ * awaiting op goes away first the job is orphaned and cleans up after
+ * itself once the thread is done.
+ */
+struct pyfs_job {
+	struct kore_task	task;
+	struct pyfs_op		*op;
+
+	int			type;
+	int			fd;
+	int			flags;
+	int			error;
+	mode_t			mode;
+	off_t			offset;
+	size_t			length;
+	ssize_t			result;
+	struct stat		st;
+
+	const char		*path;
+	u_int8_t		*data;
+	PyObject		*path_obj;
+	PyObject		*buffer;
+	Py_buffer		view;
+};
+
+struct pyfs_op {
+	PyObject_HEAD
+	int			state;
+	int			status;
+	struct pyfs_job		*job;
+	struct python_coro	*coro;
+	struct http_request	*req;
+};
+
+static void	pyfs_op_dealloc(struct pyfs_op *);
+
+static PyObject	*pyfs_op_await(PyObject *);
+static PyObject	*pyfs_op_iternext(struct pyfs_op *);
+
+static PyAsyncMethods pyfs_op_async = {
+	(unaryfunc)pyfs_op_await,
+	NULL,
+	NULL
+};
+
+static PyTypeObject pyfs_op_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "kore.fs.op",
+	.tp_doc = "asynchronous file operation",
+	.tp_as_async = &pyfs_op_async,
+	.tp_iternext = (iternextfunc)pyfs_op_iternext,
+	.tp_basicsize = sizeof(struct pyfs_op),
+	.tp_dealloc = (destructor)pyfs_op_dealloc,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+};
+
+static PyObject	*pyfs_open(PyObject *, PyObject *);
+static PyObject	*pyfs_read(PyObject *, PyObject *);
+static PyObject	*pyfs_write(PyObject *, PyObject *);
+static PyObject	*pyfs_fsync(PyObject *, PyObject *);
+static PyObject	*pyfs_stat(PyObject *, PyObject *);
+static PyObject	*pyfs_close(PyObject *, PyObject *);
+static PyObject	*pyfs_sendfile(PyObject *, PyObject *);
+
+static struct PyMethodDef pyfs_methods[] = {
+	METHOD("open", pyfs_open, METH_VARARGS),
+	METHOD("read", pyfs_read, METH_VARARGS),
+	METHOD("write", pyfs_write, METH_VARARGS),
+	METHOD("fsync", pyfs_fsync, METH_VARARGS),
+	METHOD("stat", pyfs_stat, METH_VARARGS),
+	METHOD("close", pyfs_close, METH_VARARGS),
+	METHOD("sendfile", pyfs_sendfile, METH_VARARGS),
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef pyfs_module = {
+	PyModuleDef_HEAD_INIT, "kore.fs", NULL, -1, pyfs_methods
+};
+#endif
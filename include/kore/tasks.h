@@ -26,6 +26,17 @@
 
 #define KORE_TASK_THREADS		2
 
+#define KORE_TASK_PRIO_HIGH		0
+#define KORE_TASK_PRIO_NORMAL		1
+#define KORE_TASK_PRIO_LOW		2
+#define KORE_TASK_PRIO_MAX		3
+
+/* Size of each direction of a task channel, must be a power of 2. */
+#define KORE_TASK_CHANNEL_SIZE		4096
+
+/* Default for task_spill_max, about what the old socketpairs buffered. */
+#define KORE_TASK_SPILL_MAX		(256 * 1024)
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -34,21 +45,43 @@ extern "C" {
 struct http_request;
 #endif
 
+/*
+ * Single producer, single consumer ring. The writer only moves head,
+ * the reader only moves tail.
+ */
+struct kore_task_channel {
+	volatile u_int32_t	head;
+	volatile u_int32_t	tail;
+	u_int8_t		data[KORE_TASK_CHANNEL_SIZE];
+};
+
 struct kore_task {
-	struct kore_event	evt;
 	int			state;
 	int			result;
+	int			priority;
 	pthread_rwlock_t	lock;
 
 #if !defined(KORE_NO_HTTP)
 	struct http_request	*req;
 #endif
 
-	int			fds[2];
 	int			(*entry)(struct kore_task *);
 	void			(*cb)(struct kore_task *);
 
-	struct kore_task_thread		*thread;
+	/* Event loop -> task and task -> event loop. */
+	struct kore_task_channel	*in;
+	struct kore_task_channel	*out;
+
+	/* Data the event loop moved out of the out ring but did not read. */
+	struct kore_buf			*spill;
+	size_t				spill_off;
+
+	volatile int			done;
+	volatile u_int32_t		events;
+	volatile u_int32_t		sleepers;
+	pthread_mutex_t			wlock;
+	pthread_cond_t			wcond;
+	struct kore_task		*next;
 
 	TAILQ_ENTRY(kore_task)		list;
 	LIST_ENTRY(kore_task)		rlist;
@@ -58,10 +91,8 @@ struct kore_task_thread {
 	u_int8_t		idx;
 	pthread_t		tid;
 	pthread_mutex_t		lock;
-	pthread_cond_t		cond;
-	TAILQ_HEAD(, kore_task)	tasks;
-
-	TAILQ_ENTRY(kore_task_thread)	list;
+	volatile u_int32_t	queued;
+	TAILQ_HEAD(kore_task_list, kore_task)	tasks[KORE_TASK_PRIO_MAX];
 };
 
 void		kore_task_init(void);
@@ -70,6 +101,7 @@ void		kore_task_run(struct kore_task *);
 void		kore_task_finish(struct kore_task *);
 void		kore_task_destroy(struct kore_task *);
 int		kore_task_finished(struct kore_task *);
+void		kore_task_pool_stats(u_int32_t *, u_int32_t *, u_int32_t *);
 
 #if !defined(KORE_NO_HTTP)
 void		kore_task_bind_request(struct kore_task *,
@@ -84,12 +116,14 @@ u_int32_t	kore_task_channel_read(struct kore_task *, void *, u_int32_t);
 void		kore_task_channel_write(struct kore_task *, void *, u_int32_t);
 
 void		kore_task_set_state(struct kore_task *, int);
+void		kore_task_set_priority(struct kore_task *, int);
 void		kore_task_set_result(struct kore_task *, int);
 
 int		kore_task_state(struct kore_task *);
 int		kore_task_result(struct kore_task *);
 
 extern u_int16_t	kore_task_threads;
+extern u_int32_t	kore_task_spill_max;
 
 #if defined(__cplusplus)
 }
@@ -17,38 +17,46 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <arpa/inet.h>
+
+#include <inttypes.h>
+#include <stddef.h>
 #include <time.h>
-#include <signal.h>
 
 #include "kore.h"
 #include "http.h"
 
+#if KORE_ACCESSLOG_TIMINGS != HTTP_TIMING_MAX
+#error "KORE_ACCESSLOG_TIMINGS does not match HTTP_TIMING_MAX"
+#endif
+
 /*
- * The worker will write accesslogs to its worker data structure which is
- * held in shared memory.
- *
- * Each accesslog is prefixed with the internal domain ID (2 bytes) and
- * the length of the log entry (2 bytes) (packed in kore_alog_header).
+ * The worker writes its accesslogs as fixed size binary records into a
+ * ring held in its shared memory worker data structure. It only ever
+ * moves the head, the parent only ever moves the tail, so neither side
+ * takes a lock. When the ring is full the worker drops the entry and
+ * counts it rather than waiting on the parent.
  *
- * The parent will every 10ms fetch the produced accesslogs from the workers
- * and copy them to its own log buffer. Once this log buffer becomes full
- * or 1 second has passed the parent will parse the logs and append them
- * to the correct domain logbuffer which is eventually flushed to disk.
+ * Every 10ms the parent drains the rings, formats the records into the
+ * log buffer of their domain and writes that out once it becomes full or
+ * every 10 seconds, which is also when dropped entries are reported.
  */
 
-#define LOGBUF_SIZE			(KORE_ACCESSLOG_BUFLEN * worker_count)
 #define DOMAIN_LOGBUF_LEN		(1024 * 1024)
-#define LOG_ENTRY_MINSIZE_GUESS		90
 
-static void	accesslog_lock(struct kore_worker *);
-static void	accesslog_unlock(struct kore_worker *);
 static void	accesslog_flush_cb(struct kore_domain *);
 static void	accesslog_flush(struct kore_domain *, u_int64_t, int);
+static u_int16_t accesslog_string(struct kore_alog_record *, size_t *,
+		    const char *);
+static void	accesslog_format(struct kore_buf *, struct kore_domain *,
+		    struct kore_alog_record *);
+static void	accesslog_json_string(struct kore_buf *, const char *,
+		    const char *, size_t);
 
-static u_int64_t	time_cache = 0;
-static char		tbuf[128] = { '\0' };
+int		kore_accesslog_format = KORE_ACCESSLOG_FORMAT_COMBINED;
 
-static struct kore_buf	*logbuf = NULL;
+static time_t	time_cache = 0;
+static char	tbuf[128] = { '\0' };
 
 void
 kore_accesslog_worker_init(void)
@@ -60,143 +68,69 @@ void
 kore_accesslog(struct http_request *req)
 {
 	struct timespec		ts;
-	struct tm		*tm;
-	u_int64_t		now;
-	struct kore_alog_header	*hdr;
-	size_t			avail;
-	time_t			curtime;
-	int			len, attempts;
-	const char		*ptr, *method, *cn, *referer;
-	char			addr[INET6_ADDRSTRLEN], *cn_value;
-
-	switch (req->method) {
-	case HTTP_METHOD_GET:
-		method = "GET";
-		break;
-	case HTTP_METHOD_POST:
-		method = "POST";
-		break;
-	case HTTP_METHOD_PUT:
-		method = "PUT";
-		break;
-	case HTTP_METHOD_DELETE:
-		method = "DELETE";
-		break;
-	case HTTP_METHOD_HEAD:
-		method = "HEAD";
-		break;
-	case HTTP_METHOD_PATCH:
-		method = "PATCH";
-		break;
-	default:
-		method = "UNKNOWN";
-		break;
-	}
-
-	if (req->referer != NULL)
-		referer = req->referer;
-	else
-		referer = "-";
+	struct kore_alog_record	*rec;
+	size_t			off;
+	int			phase;
+	u_int32_t		head, tail;
+	char			*cn;
 
-	if (req->agent == NULL)
-		req->agent = "-";
+	head = worker->lb.head;
+	tail = __atomic_load_n(&worker->lb.tail, __ATOMIC_SEQ_CST);
 
-	cn = "-";
-	cn_value = NULL;
+	if (head - tail >= KORE_ACCESSLOG_RECORDS) {
+		__atomic_add_fetch(&worker->lb.drops, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
 
-	if (req->owner->cert != NULL) {
-		if (kore_x509_subject_name(req->owner, &cn_value,
-		    KORE_X509_COMMON_NAME_ONLY))
-			cn = cn_value;
+	rec = &worker->lb.ring[head & (KORE_ACCESSLOG_RECORDS - 1)];
+	memset(rec, 0, offsetof(struct kore_alog_record, data));
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	rec->time = (u_int64_t)ts.tv_sec * 1000 + (ts.tv_nsec / 1000000);
+	rec->latency = (kore_time_us() - req->queued_us) / 1000;
+	rec->length = req->content_length;
+	rec->domain = req->hdlr->dom->id;
+	rec->route = req->hdlr->id;
+	rec->status = req->status;
+	rec->method = req->method;
+	rec->family = req->owner->family;
+
+	for (phase = 0; phase < HTTP_TIMING_MAX; phase++) {
+		rec->timing[phase] = MIN(http_request_timing(req, phase),
+		    UINT32_MAX);
 	}
 
 	switch (req->owner->family) {
 	case AF_INET:
-		ptr = inet_ntop(req->owner->family,
-		    &(req->owner->addr.ipv4.sin_addr), addr, sizeof(addr));
+		memcpy(rec->addr, &req->owner->addr.ipv4.sin_addr,
+		    sizeof(req->owner->addr.ipv4.sin_addr));
 		break;
 	case AF_INET6:
-		ptr = inet_ntop(req->owner->family,
-		    &(req->owner->addr.ipv6.sin6_addr), addr, sizeof(addr));
+		memcpy(rec->addr, &req->owner->addr.ipv6.sin6_addr,
+		    sizeof(req->owner->addr.ipv6.sin6_addr));
 		break;
 	case AF_UNIX:
-		ptr = NULL;
 		break;
 	default:
 		fatal("unknown family %d", req->owner->family);
 	}
 
-	if (ptr == NULL) {
-		addr[0] = '-';
-		addr[1] = '\0';
-	}
+	off = 0;
+	rec->path_len = accesslog_string(rec, &off, req->path);
+	rec->referer_len = accesslog_string(rec, &off, req->referer);
+	rec->agent_len = accesslog_string(rec, &off, req->agent);
 
-	now = kore_time_ms();
-	if ((now - time_cache) >= 1000) {
-		time(&curtime);
-		tm = localtime(&curtime);
-		(void)strftime(tbuf, sizeof(tbuf), "%d/%b/%Y:%H:%M:%S %z", tm);
-		time_cache = now;
+	cn = NULL;
+	if (req->owner->cert != NULL) {
+		if (!kore_x509_subject_name(req->owner, &cn,
+		    KORE_X509_COMMON_NAME_ONLY))
+			cn = NULL;
 	}
 
-	attempts = 0;
-	ts.tv_sec = 0;
-	ts.tv_nsec = 1000000;
-
-	for (;;) {
-		if (attempts++ > 1000) {
-			if (getppid() == 1) {
-				if (kill(worker->pid, SIGQUIT) == -1)
-					fatal("failed to shutdown");
-				return;
-			}
-
-			attempts = 0;
-		}
-
-		accesslog_lock(worker);
-
-		avail = KORE_ACCESSLOG_BUFLEN - worker->lb.offset;
-		if (avail < sizeof(*hdr) + LOG_ENTRY_MINSIZE_GUESS) {
-			accesslog_unlock(worker);
-			nanosleep(&ts, NULL);
-			continue;
-		}
-
-		hdr = (struct kore_alog_header *)
-		    (worker->lb.buf + worker->lb.offset);
-		worker->lb.offset += sizeof(*hdr);
-
-		len = snprintf(worker->lb.buf + worker->lb.offset, avail,
-		    "%s - %s [%s] \"%s %s HTTP/1.1\" %d %zu \"%s\" \"%s\"\n",
-		    addr, cn, tbuf, method, req->path, req->status,
-		    req->content_length, referer, req->agent);
-		if (len == -1)
-			fatal("failed to create log entry");
-
-		if ((size_t)len >= avail) {
-			worker->lb.offset -= sizeof(*hdr);
-			accesslog_unlock(worker);
-			nanosleep(&ts, NULL);
-			continue;
-		}
-
-		if ((size_t)len > USHRT_MAX) {
-			kore_log(LOG_WARNING,
-			    "log entry length exceeds limit (%d)", len);
-			worker->lb.offset -= sizeof(*hdr);
-			break;
-		}
-
-		hdr->loglen = len;
-		hdr->domain = req->hdlr->dom->id;
-
-		worker->lb.offset += (size_t)len;
-		break;
-	}
+	rec->cn_len = accesslog_string(rec, &off, cn);
+	kore_free(cn);
 
-	kore_free(cn_value);
-	accesslog_unlock(worker);
+	__atomic_store_n(&worker->lb.head, head + 1, __ATOMIC_SEQ_CST);
 }
 
 void
@@ -204,76 +138,174 @@ kore_accesslog_gather(void *arg, u_int64_t now, int force)
 {
 	int				id;
 	struct kore_worker		*kw;
-	struct kore_alog_header		*hdr;
+	struct kore_alog_record		*rec;
 	struct kore_domain		*dom;
-	size_t				off, remain;
-
-	if (logbuf == NULL)
-		logbuf = kore_buf_alloc(LOGBUF_SIZE);
+	u_int64_t			drops;
+	u_int32_t			head, tail;
 
 	for (id = KORE_WORKER_BASE; id < worker_count; id++) {
 		kw = kore_worker_data(id);
 
-		accesslog_lock(kw);
+		tail = kw->lb.tail;
+		head = __atomic_load_n(&kw->lb.head, __ATOMIC_SEQ_CST);
+
+		while (tail != head) {
+			rec = &kw->lb.ring[tail & (KORE_ACCESSLOG_RECORDS - 1)];
+			tail++;
 
-		if (force || kw->lb.offset >= KORE_ACCESSLOG_SYNC) {
-			kore_buf_append(logbuf, kw->lb.buf, kw->lb.offset);
-			kw->lb.offset = 0;
+			if ((dom = kore_domain_byid(rec->domain)) == NULL)
+				fatal("unknown domain id %u", rec->domain);
+
+			if (dom->logbuf == NULL)
+				dom->logbuf = kore_buf_alloc(DOMAIN_LOGBUF_LEN);
+
+			accesslog_format(dom->logbuf, dom, rec);
+			accesslog_flush(dom, now, 0);
 		}
 
-		accesslog_unlock(kw);
+		__atomic_store_n(&kw->lb.tail, tail, __ATOMIC_SEQ_CST);
+
+		drops = __atomic_load_n(&kw->lb.drops, __ATOMIC_SEQ_CST);
+		if (force && drops != kw->lb.reported) {
+			kore_log(LOG_NOTICE,
+			    "worker %u dropped %" PRIu64 " accesslog entries",
+			    kw->id, drops - kw->lb.reported);
+			kw->lb.reported = drops;
+		}
 	}
 
-	if (force || logbuf->offset >= LOGBUF_SIZE) {
-		off = 0;
-		remain = logbuf->offset;
+	if (force)
+		kore_domain_callback(accesslog_flush_cb);
+}
 
-		while (remain > 0) {
-			if (remain < sizeof(*hdr)) {
-				kore_log(LOG_ERR,
-				    "invalid log buffer: (%zu remain)", remain);
-				break;
-			}
+void
+kore_accesslog_run(void *arg, u_int64_t now)
+{
+	static int	ticks = 0;
 
-			hdr = (struct kore_alog_header *)(logbuf->data + off);
-			off += sizeof(*hdr);
-			remain -= sizeof(*hdr);
+	kore_accesslog_gather(arg, now, ticks++ % 1000 ? 0 : 1);
+}
 
-			if (hdr->loglen > remain) {
-				kore_log(LOG_ERR,
-				    "invalid log header: %u (%zu remain)",
-				    hdr->loglen, remain);
-				break;
-			}
+static u_int16_t
+accesslog_string(struct kore_alog_record *rec, size_t *off, const char *str)
+{
+	size_t		len;
 
-			if ((dom = kore_domain_byid(hdr->domain)) == NULL)
-				fatal("unknown domain id %u", hdr->domain);
+	if (str == NULL)
+		return (0);
 
-			if (dom->logbuf == NULL)
-				dom->logbuf = kore_buf_alloc(DOMAIN_LOGBUF_LEN);
+	len = MIN(strlen(str), KORE_ACCESSLOG_DATA_LEN - *off);
+	memcpy(&rec->data[*off], str, len);
+	*off += len;
+
+	return ((u_int16_t)len);
+}
+
+static void
+accesslog_format(struct kore_buf *buf, struct kore_domain *dom,
+    struct kore_alog_record *rec)
+{
+	struct tm			*tm;
+	time_t				sec;
+	int				phase;
+	struct kore_module_handle	*hdlr;
+	const char			*method, *path, *referer, *agent, *cn;
+	char				addr[INET6_ADDRSTRLEN];
+
+	/* Only the used part of data, the record slot is reused as is. */
+	if (kore_accesslog_format == KORE_ACCESSLOG_FORMAT_BINARY) {
+		kore_buf_append(buf, rec, offsetof(struct kore_alog_record,
+		    data) + rec->path_len + rec->referer_len +
+		    rec->agent_len + rec->cn_len);
+		return;
+	}
+
+	if (rec->family == AF_INET || rec->family == AF_INET6) {
+		if (inet_ntop(rec->family, rec->addr,
+		    addr, sizeof(addr)) == NULL)
+			(void)kore_strlcpy(addr, "-", sizeof(addr));
+	} else {
+		(void)kore_strlcpy(addr, "-", sizeof(addr));
+	}
 
-			kore_buf_append(dom->logbuf, &logbuf->data[off],
-			    hdr->loglen);
+	method = http_method_text(rec->method);
+	if (*method == '\0')
+		method = "UNKNOWN";
 
-			off += hdr->loglen;
-			remain -= hdr->loglen;
+	path = rec->data;
+	referer = path + rec->path_len;
+	agent = referer + rec->referer_len;
+	cn = agent + rec->agent_len;
+
+	if (kore_accesslog_format == KORE_ACCESSLOG_FORMAT_JSON) {
+		kore_buf_appendf(buf, "{\"time\":%" PRIu64, rec->time);
+		accesslog_json_string(buf, "addr", addr, strlen(addr));
+		accesslog_json_string(buf, "cn", cn, rec->cn_len);
+		accesslog_json_string(buf, "method", method, strlen(method));
+		accesslog_json_string(buf, "path", path, rec->path_len);
+		kore_buf_appendf(buf, ",\"status\":%u,\"length\":%" PRIu64
+		    ",\"latency\":%" PRIu64, rec->status, rec->length,
+		    rec->latency);
+		accesslog_json_string(buf, "referer", referer,
+		    rec->referer_len);
+		accesslog_json_string(buf, "agent", agent, rec->agent_len);
+
+		if ((hdlr = kore_module_handler_byid(dom, rec->route)) != NULL) {
+			accesslog_json_string(buf, "route",
+			    hdlr->path, strlen(hdlr->path));
+		}
 
-			accesslog_flush(dom, now, force);
+		for (phase = 0; phase < HTTP_TIMING_MAX; phase++) {
+			kore_buf_appendf(buf, "%s\"%s\":%u",
+			    phase ? "," : ",\"timing\":{",
+			    http_timing_name(phase), rec->timing[phase]);
 		}
+		kore_buf_append(buf, "}", 1);
 
-		kore_buf_reset(logbuf);
+		kore_buf_append(buf, "}\n", 2);
+		return;
 	}
 
-	if (force)
-		kore_domain_callback(accesslog_flush_cb);
+	sec = rec->time / 1000;
+	if (sec != time_cache) {
+		tm = localtime(&sec);
+		(void)strftime(tbuf, sizeof(tbuf), "%d/%b/%Y:%H:%M:%S %z", tm);
+		time_cache = sec;
+	}
+
+	kore_buf_appendf(buf,
+	    "%s - %.*s [%s] \"%s %.*s HTTP/1.1\" %u %" PRIu64
+	    " \"%.*s\" \"%.*s\"\n",
+	    addr, rec->cn_len ? rec->cn_len : 1, rec->cn_len ? cn : "-",
+	    tbuf, method, rec->path_len, path, rec->status, rec->length,
+	    rec->referer_len ? rec->referer_len : 1,
+	    rec->referer_len ? referer : "-",
+	    rec->agent_len ? rec->agent_len : 1,
+	    rec->agent_len ? agent : "-");
 }
 
-void
-kore_accesslog_run(void *arg, u_int64_t now)
+static void
+accesslog_json_string(struct kore_buf *buf, const char *name,
+    const char *str, size_t len)
 {
-	static int	ticks = 0;
+	size_t		i, run;
+	u_int8_t	ch;
+
+	kore_buf_appendf(buf, ",\"%s\":\"", name);
+
+	run = 0;
+	for (i = 0; i < len; i++) {
+		ch = (u_int8_t)str[i];
+		if (ch != '"' && ch != '\\' && ch >= 0x20 && ch != 0x7f)
+			continue;
+
+		kore_buf_append(buf, &str[run], i - run);
+		kore_buf_appendf(buf, "\\u%04x", ch);
+		run = i + 1;
+	}
 
-	kore_accesslog_gather(arg, now, ticks++ % 100 ? 0 : 1);
+	kore_buf_append(buf, &str[run], len - run);
+	kore_buf_append(buf, "\"", 1);
 }
 
 static void
@@ -316,19 +348,3 @@ accesslog_flush(struct kore_domain *dom, u_int64_t now, int force)
 		kore_buf_reset(dom->logbuf);
 	}
 }
-
-static void
-accesslog_lock(struct kore_worker *kw)
-{
-	for (;;) {
-		if (__sync_bool_compare_and_swap(&kw->lb.lock, 0, 1))
-			break;
-	}
-}
-
-static void
-accesslog_unlock(struct kore_worker *kw)
-{
-	if (!__sync_bool_compare_and_swap(&kw->lb.lock, 1, 0))
-		fatal("accesslog_unlock: failed to release");
-}
@@ -296,6 +296,8 @@ kore_acme_run(void)
 #endif
 #if defined(KORE_USE_PYTHON)
 	kore_msg_unregister(KORE_PYTHON_SEND_OBJ);
+	kore_msg_unregister(KORE_PYTHON_SEND_RAW);
+	kore_msg_unregister(KORE_PYTHON_SEND_MARSHAL);
 #endif
 	kore_worker_privdrop(acme_runas_user, acme_root_path);
 
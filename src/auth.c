@@ -19,15 +19,57 @@
 
 #include <ctype.h>
 
+#include <openssl/sha.h>
+
 #include "kore.h"
 #include "http.h"
 
+/* How many slots an entry may land in past its home slot. */
+#define AUTH_CACHE_PROBE	4
+
+/*
+ * Per worker cache of credentials that passed their validator, these
+ * are only kept as a digest so the tokens themselves are never stored.
+ * With cache_shared set a hit is also put in the kv store so the other
+ * workers can pick it up.
+ */
+struct auth_cache_entry {
+	u_int64_t		expires;
+	u_int8_t		digest[SHA256_DIGEST_LENGTH];
+};
+
+struct kore_auth_cache {
+	struct kore_auth		*auth;
+	u_int32_t			mask;
+	struct auth_cache_entry		*entries;
+	LIST_ENTRY(kore_auth_cache)	list;
+};
+
+static int	auth_validate(struct http_request *, struct kore_auth *,
+		    const char *);
+static void	auth_cache_digest(struct kore_auth *, const char *,
+		    u_int8_t *);
+static void	auth_cache_key(const u_int8_t *, char *, size_t);
+static int	auth_cache_get(struct kore_auth_cache *, const u_int8_t *);
+static void	auth_cache_put(struct kore_auth_cache *, const u_int8_t *);
+static void	auth_cache_drop(struct kore_auth_cache *, const u_int8_t *);
+static void	auth_cache_remove(const char *, const char *, int);
+static void	auth_cache_msg(struct kore_msg *, const void *);
+
 TAILQ_HEAD(, kore_auth)		auth_list;
+static LIST_HEAD(, kore_auth_cache)	auth_caches;
 
 void
 kore_auth_init(void)
 {
 	TAILQ_INIT(&auth_list);
+	LIST_INIT(&auth_caches);
+}
+
+void
+kore_auth_worker_init(void)
+{
+	kore_msg_register(KORE_MSG_AUTH_INVALIDATE, auth_cache_msg);
 }
 
 int
@@ -43,6 +85,10 @@ kore_auth_new(const char *name)
 	auth->value = NULL;
 	auth->redirect = NULL;
 	auth->validator = NULL;
+	auth->cache_size = 0;
+	auth->cache_ttl = 0;
+	auth->cache_shared = 0;
+	auth->cache = NULL;
 	auth->name = kore_strdup(name);
 
 	TAILQ_INSERT_TAIL(&auth_list, auth, list);
@@ -108,7 +154,7 @@ kore_auth_cookie(struct http_request *req, struct kore_auth *auth)
 	size_t		len, slen;
 	char		*value, *c, *cookie, *cookies[HTTP_MAX_COOKIES];
 
-	if (!http_request_header(req, "cookie", &hdr))
+	if (!http_request_header_id(req, HTTP_HEADER_COOKIE, &hdr))
 		return (KORE_RESULT_ERROR);
 
 	cookie = kore_strdup(hdr);
@@ -135,7 +181,7 @@ kore_auth_cookie(struct http_request *req, struct kore_auth *auth)
 		return (KORE_RESULT_ERROR);
 	}
 
-	i = kore_validator_check(req, auth->validator, ++value);
+	i = auth_validate(req, auth, ++value);
 	kore_free(cookie);
 
 	return (i);
@@ -149,7 +195,7 @@ kore_auth_header(struct http_request *req, struct kore_auth *auth)
 	if (!http_request_header(req, auth->value, &header))
 		return (KORE_RESULT_ERROR);
 
-	return (kore_validator_check(req, auth->validator, header));
+	return (auth_validate(req, auth, header));
 }
 
 int
@@ -176,3 +222,229 @@ kore_auth_lookup(const char *name)
 
 	return (NULL);
 }
+
+/*
+ * Drops a cached credential from every auth block checking the cookie or
+ * header called name, in all workers. Only callable from a worker.
+ */
+void
+kore_auth_cache_invalidate(const char *name, const char *value)
+{
+	struct kore_buf		buf;
+
+	auth_cache_remove(name, value, 1);
+
+	kore_buf_init(&buf, 128);
+	kore_buf_append(&buf, name, strlen(name) + 1);
+	kore_buf_append(&buf, value, strlen(value) + 1);
+
+	kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_AUTH_INVALIDATE,
+	    buf.data, buf.offset);
+
+	kore_buf_cleanup(&buf);
+}
+
+static int
+auth_validate(struct http_request *req, struct kore_auth *auth,
+    const char *value)
+{
+	int			r;
+	size_t			len;
+	u_int8_t		hit;
+	char			key[KORE_KV_KEY_MAX];
+	u_int8_t		digest[SHA256_DIGEST_LENGTH];
+
+	if (auth->cache == NULL)
+		return (kore_validator_check(req, auth->validator, value));
+
+	auth_cache_digest(auth, value, digest);
+
+	if (auth_cache_get(auth->cache, digest))
+		return (KORE_RESULT_OK);
+
+	if (auth->cache_shared) {
+		len = sizeof(hit);
+		auth_cache_key(digest, key, sizeof(key));
+
+		if (kore_kv_get(key, &hit, &len)) {
+			auth_cache_put(auth->cache, digest);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	r = kore_validator_check(req, auth->validator, value);
+	if (r != KORE_RESULT_OK)
+		return (r);
+
+	auth_cache_put(auth->cache, digest);
+
+	if (auth->cache_shared) {
+		hit = 1;
+		(void)kore_kv_put(key, &hit, sizeof(hit), auth->cache_ttl);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Sets up the cache for an auth block with cache_size and cache_ttl
+ * filled in. Done while loading the configuration so that every worker
+ * knows about all caches when an invalidation comes in.
+ */
+void
+kore_auth_cache_create(struct kore_auth *auth)
+{
+	u_int32_t		size;
+	struct kore_auth_cache	*cache;
+
+	if (auth->type == KORE_AUTH_TYPE_REQUEST)
+		fatal("auth %s: request types cannot be cached", auth->name);
+
+	size = 16;
+	while (size < auth->cache_size && size < (1U << 24))
+		size <<= 1;
+
+	cache = kore_calloc(1, sizeof(*cache));
+	cache->auth = auth;
+	cache->mask = size - 1;
+	cache->entries = kore_calloc(size, sizeof(*cache->entries));
+
+	LIST_INSERT_HEAD(&auth_caches, cache, list);
+
+	auth->cache = cache;
+}
+
+/*
+ * The digest covers the validator and the cookie or header name so
+ * that two auth blocks never share their decisions.
+ */
+static void
+auth_cache_digest(struct kore_auth *auth, const char *value, u_int8_t *out)
+{
+	SHA256_CTX		sctx;
+
+	(void)SHA256_Init(&sctx);
+	(void)SHA256_Update(&sctx, auth->validator->name,
+	    strlen(auth->validator->name) + 1);
+	(void)SHA256_Update(&sctx, auth->value, strlen(auth->value) + 1);
+	(void)SHA256_Update(&sctx, value, strlen(value));
+	(void)SHA256_Final(out, &sctx);
+}
+
+static void
+auth_cache_key(const u_int8_t *digest, char *key, size_t len)
+{
+	int		i;
+	size_t		off;
+
+	off = kore_strlcpy(key, "kore.auth.", len);
+
+	for (i = 0; i < 20 && off + 2 < len; i++)
+		off += snprintf(key + off, len - off, "%02x", digest[i]);
+}
+
+static int
+auth_cache_get(struct kore_auth_cache *cache, const u_int8_t *digest)
+{
+	int			i;
+	u_int64_t		now;
+	u_int32_t		idx;
+	struct auth_cache_entry	*entry;
+
+	now = kore_time_ms();
+	memcpy(&idx, digest, sizeof(idx));
+
+	for (i = 0; i < AUTH_CACHE_PROBE; i++) {
+		entry = &cache->entries[(idx + i) & cache->mask];
+		if (entry->expires > now &&
+		    !memcmp(entry->digest, digest, sizeof(entry->digest)))
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+/* Takes a free or expired slot, otherwise the one closest to expiring. */
+static void
+auth_cache_put(struct kore_auth_cache *cache, const u_int8_t *digest)
+{
+	int			i;
+	u_int64_t		now;
+	u_int32_t		idx;
+	struct auth_cache_entry	*entry, *victim;
+
+	victim = NULL;
+	now = kore_time_ms();
+	memcpy(&idx, digest, sizeof(idx));
+
+	for (i = 0; i < AUTH_CACHE_PROBE; i++) {
+		entry = &cache->entries[(idx + i) & cache->mask];
+		if (entry->expires <= now ||
+		    !memcmp(entry->digest, digest, sizeof(entry->digest))) {
+			victim = entry;
+			break;
+		}
+
+		if (victim == NULL || entry->expires < victim->expires)
+			victim = entry;
+	}
+
+	memcpy(victim->digest, digest, sizeof(victim->digest));
+	victim->expires = now + cache->auth->cache_ttl;
+}
+
+static void
+auth_cache_drop(struct kore_auth_cache *cache, const u_int8_t *digest)
+{
+	int			i;
+	u_int32_t		idx;
+	struct auth_cache_entry	*entry;
+
+	memcpy(&idx, digest, sizeof(idx));
+
+	for (i = 0; i < AUTH_CACHE_PROBE; i++) {
+		entry = &cache->entries[(idx + i) & cache->mask];
+		if (!memcmp(entry->digest, digest, sizeof(entry->digest)))
+			entry->expires = 0;
+	}
+}
+
+/* The kv store is shared, only the invalidating worker clears it. */
+static void
+auth_cache_remove(const char *name, const char *value, int kv)
+{
+	struct kore_auth_cache	*cache;
+	char			key[KORE_KV_KEY_MAX];
+	u_int8_t		digest[SHA256_DIGEST_LENGTH];
+
+	LIST_FOREACH(cache, &auth_caches, list) {
+		if (strcmp(cache->auth->value, name))
+			continue;
+
+		auth_cache_digest(cache->auth, value, digest);
+		auth_cache_drop(cache, digest);
+
+		if (kv && cache->auth->cache_shared) {
+			auth_cache_key(digest, key, sizeof(key));
+			(void)kore_kv_del(key);
+		}
+	}
+}
+
+static void
+auth_cache_msg(struct kore_msg *msg, const void *data)
+{
+	size_t		len;
+	const char	*name, *value;
+
+	if (msg->length < 2 || ((const char *)data)[msg->length - 1] != '\0')
+		return;
+
+	name = data;
+	len = strlen(name) + 1;
+	if (len >= msg->length)
+		return;
+
+	value = name + len;
+	auth_cache_remove(name, value, 0);
+}
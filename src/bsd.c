@@ -76,6 +76,46 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 #endif /* __FreeBSD_version */
 }
 
+int
+kore_platform_reuseport_cbpf(int fd, const u_int16_t *cpus, u_int16_t count)
+{
+	return (KORE_RESULT_ERROR);
+}
+
+int
+kore_platform_incoming_cpu(int fd)
+{
+	return (-1);
+}
+
+void
+kore_platform_incoming_cpu_set(int fd, u_int16_t cpu)
+{
+}
+
+int
+kore_platform_listen_backlog(int fd, u_int32_t *len, u_int32_t *max)
+{
+#if defined(SO_LISTENQLEN) && defined(SO_LISTENQLIMIT)
+	int		val;
+	socklen_t	optlen;
+
+	optlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLEN, &val, &optlen) == -1)
+		return (KORE_RESULT_ERROR);
+	*len = val;
+
+	optlen = sizeof(val);
+	if (getsockopt(fd, SOL_SOCKET, SO_LISTENQLIMIT, &val, &optlen) == -1)
+		return (KORE_RESULT_ERROR);
+	*max = val;
+
+	return (KORE_RESULT_OK);
+#else
+	return (KORE_RESULT_ERROR);
+#endif
+}
+
 void
 kore_platform_event_init(void)
 {
@@ -128,6 +168,8 @@ kore_platform_event_wait(u_int64_t timer)
 		fatal("kevent(): %s", errno_s);
 	}
 
+	kore_loop_woke = kore_time_us();
+
 	if (n > 0)
 		kore_debug("main(): %d sockets available", n);
 
@@ -155,8 +197,14 @@ kore_platform_event_wait(u_int64_t timer)
 void
 kore_platform_event_all(int fd, void *c)
 {
-	kore_platform_event_schedule(fd, EVFILT_READ, EV_ADD | EV_CLEAR, c);
-	kore_platform_event_schedule(fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, c);
+	struct kevent		event[2];
+
+	/* Register both filters in a single kevent() call. */
+	EV_SET(&event[0], fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, c);
+	EV_SET(&event[1], fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, c);
+
+	if (kevent(kfd, event, 2, NULL, 0, NULL) == -1)
+		fatal("kevent: %s", errno_s);
 }
 
 void
@@ -19,15 +19,35 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "kore.h"
 
+/* Smallest heap allocation a buffer grows into. */
+#define KORE_BUF_MIN		64
+
+static void	buf_grow(struct kore_buf *, size_t);
+static void	buf_data_free(struct kore_buf *);
+
+/*
+ * Buffers that start out small keep their data in the same allocation
+ * as the kore_buf itself until they outgrow it.
+ */
 struct kore_buf *
 kore_buf_alloc(size_t initial)
 {
 	struct kore_buf		*buf;
 
+	if (initial <= KORE_BUF_INLINE_SIZE) {
+		buf = kore_malloc(sizeof(*buf) + KORE_BUF_INLINE_SIZE);
+		buf->data = (u_int8_t *)(buf + 1);
+		buf->length = KORE_BUF_INLINE_SIZE;
+		buf->offset = 0;
+		buf->flags = KORE_BUF_OWNER_API | KORE_BUF_INLINE;
+		return (buf);
+	}
+
 	buf = kore_malloc(sizeof(*buf));
 	kore_buf_init(buf, initial);
 	buf->flags = KORE_BUF_OWNER_API;
@@ -51,7 +71,7 @@ kore_buf_init(struct kore_buf *buf, size_t initial)
 void
 kore_buf_cleanup(struct kore_buf *buf)
 {
-	kore_free(buf->data);
+	buf_data_free(buf);
 	buf->data = NULL;
 	buf->offset = 0;
 	buf->length = 0;
@@ -71,39 +91,41 @@ kore_buf_append(struct kore_buf *buf, const void *data, size_t len)
 	if ((buf->offset + len) < len)
 		fatal("overflow in kore_buf_append");
 
-	if ((buf->offset + len) > buf->length) {
-		buf->length += len;
-		buf->data = kore_realloc(buf->data, buf->length);
-	}
+	if ((buf->offset + len) > buf->length)
+		buf_grow(buf, buf->offset + len);
 
 	memcpy((buf->data + buf->offset), data, len);
 	buf->offset += len;
 }
 
+/*
+ * Format straight into the free space of the buffer, only when that
+ * turns out too small is it grown and the format done a second time.
+ */
 void
 kore_buf_appendv(struct kore_buf *buf, const char *fmt, va_list args)
 {
 	int		l;
 	va_list		copy;
-	char		*b, sb[BUFSIZ];
+	size_t		avail;
 
 	va_copy(copy, args);
 
-	l = vsnprintf(sb, sizeof(sb), fmt, args);
+	avail = buf->length - buf->offset;
+	l = vsnprintf(avail > 0 ? (char *)buf->data + buf->offset : NULL,
+	    avail, fmt, args);
 	if (l == -1)
 		fatal("kore_buf_appendv(): vsnprintf error");
 
-	if ((size_t)l >= sizeof(sb)) {
-		l = vasprintf(&b, fmt, copy);
-		if (l == -1)
+	if ((size_t)l >= avail) {
+		buf_grow(buf, buf->offset + l + 1);
+		avail = buf->length - buf->offset;
+		if (vsnprintf((char *)buf->data + buf->offset,
+		    avail, fmt, copy) != l)
 			fatal("kore_buf_appendv(): error or truncation");
-	} else {
-		b = sb;
 	}
 
-	kore_buf_append(buf, b, l);
-	if (b != sb)
-		free(b);
+	buf->offset += l;
 
 	va_end(copy);
 }
@@ -118,6 +140,64 @@ kore_buf_appendf(struct kore_buf *buf, const char *fmt, ...)
 	va_end(args);
 }
 
+void
+kore_buf_append_uint(struct kore_buf *buf, u_int64_t v)
+{
+	char		*p, tmp[24];
+
+	p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + (v % 10);
+		v /= 10;
+	} while (v > 0);
+
+	kore_buf_append(buf, p, (tmp + sizeof(tmp)) - p);
+}
+
+void
+kore_buf_append_hex(struct kore_buf *buf, u_int64_t v)
+{
+	char			*p, tmp[16];
+	static const char	hex[] = "0123456789abcdef";
+
+	p = tmp + sizeof(tmp);
+
+	do {
+		*--p = hex[v & 0xf];
+		v >>= 4;
+	} while (v > 0);
+
+	kore_buf_append(buf, p, (tmp + sizeof(tmp)) - p);
+}
+
+/* Appends a "name: value\r\n" header line. */
+void
+kore_buf_append_header(struct kore_buf *buf, const char *name,
+    const char *value)
+{
+	size_t		nlen, vlen, total;
+
+	nlen = strlen(name);
+	vlen = strlen(value);
+	total = nlen + vlen + 4;
+
+	if (total < nlen || buf->offset + total < total)
+		fatal("overflow in kore_buf_append_header");
+
+	if (buf->offset + total > buf->length)
+		buf_grow(buf, buf->offset + total);
+
+	memcpy(buf->data + buf->offset, name, nlen);
+	buf->offset += nlen;
+	buf->data[buf->offset++] = ':';
+	buf->data[buf->offset++] = ' ';
+	memcpy(buf->data + buf->offset, value, vlen);
+	buf->offset += vlen;
+	buf->data[buf->offset++] = '\r';
+	buf->data[buf->offset++] = '\n';
+}
+
 char *
 kore_buf_stringify(struct kore_buf *buf, size_t *len)
 {
@@ -137,10 +217,18 @@ kore_buf_release(struct kore_buf *buf, size_t *len)
 {
 	u_int8_t	*p;
 
-	p = buf->data;
 	*len = buf->offset;
 
+	/* The data must outlive the kore_buf, so take it off inline. */
+	if (buf->flags & KORE_BUF_INLINE) {
+		p = kore_malloc(buf->offset);
+		memcpy(p, buf->data, buf->offset);
+	} else {
+		p = buf->data;
+	}
+
 	buf->data = NULL;
+	buf->flags &= ~KORE_BUF_INLINE;
 	kore_buf_free(buf);
 
 	return (p);
@@ -174,7 +262,7 @@ kore_buf_replace_string(struct kore_buf *b, const char *src,
 			memcpy((tmp + off), dst, len);
 		memcpy((tmp + off + len), end, off2);
 
-		kore_free(b->data);
+		buf_data_free(b);
 		b->data = (u_int8_t *)tmp;
 		b->offset = off + len + off2;
 		b->length = nlen;
@@ -188,3 +276,43 @@ kore_buf_reset(struct kore_buf *buf)
 {
 	buf->offset = 0;
 }
+
+/*
+ * Make room for at least len bytes, doubling the size so a buffer that
+ * is appended to piece by piece is not reallocated for every piece.
+ */
+static void
+buf_grow(struct kore_buf *buf, size_t len)
+{
+	u_int8_t	*p;
+	size_t		nlen;
+
+	nlen = buf->length > KORE_BUF_MIN ? buf->length : KORE_BUF_MIN;
+	while (nlen < len) {
+		if (nlen > SIZE_MAX / 2) {
+			nlen = len;
+			break;
+		}
+		nlen = nlen << 1;
+	}
+
+	if (buf->flags & KORE_BUF_INLINE) {
+		p = kore_malloc(nlen);
+		memcpy(p, buf->data, buf->offset);
+		buf->data = p;
+		buf->flags &= ~KORE_BUF_INLINE;
+	} else {
+		buf->data = kore_realloc(buf->data, nlen);
+	}
+
+	buf->length = nlen;
+}
+
+static void
+buf_data_free(struct kore_buf *buf)
+{
+	if (buf->flags & KORE_BUF_INLINE)
+		buf->flags &= ~KORE_BUF_INLINE;
+	else
+		kore_free(buf->data);
+}
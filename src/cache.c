@@ -0,0 +1,561 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Response microcache for routes marked with the "cache" option.
+ *
+ * Entries live in a shared memory segment set up by the parent so all
+ * workers see the same responses. The segment is split into sets of
+ * HTTP_CACHE_WAYS slots, each slot holding one response of at most
+ * http_cache_entry_max bytes of headers and body. A set is guarded by
+ * the lock in its first slot, which holds the pid of its owner and is
+ * only ever tried for a bounded number of times. When a worker dies
+ * the parent releases the locks it held and the entries it was filling.
+ *
+ * Once an entry expires the first worker to ask for it refreshes it,
+ * everybody else keeps getting the stale copy until it is done.
+ */
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "kore.h"
+#include "http.h"
+
+#define HTTP_CACHE_WAYS		4
+#define HTTP_CACHE_SPINS	1000
+#define HTTP_CACHE_FILL_TIMEOUT	10000
+
+#define CACHE_SLOT_VALID	0x0001
+
+struct cache_slot {
+	volatile int		lock;
+	u_int32_t		flags;
+	pid_t			filler;
+	u_int16_t		status;
+	u_int16_t		klen;
+	u_int64_t		fill_start;
+	u_int64_t		stored;
+	u_int64_t		expires;
+	u_int64_t		hash;
+	u_int32_t		hlen;
+	u_int32_t		blen;
+	char			key[HTTP_CACHE_KEY_MAX];
+	u_int8_t		data[];
+};
+
+struct cache_region {
+	volatile u_int64_t	hits;
+	volatile u_int64_t	misses;
+	volatile u_int64_t	stale;
+	volatile u_int64_t	stores;
+	u_int32_t		sets;
+	size_t			slot_len;
+	u_int8_t		slots[];
+};
+
+static int		cache_key(struct http_request *, char *, size_t *);
+static int		cache_key_add(char *, size_t *, const char *, size_t);
+static const char	*cache_query_arg(const char *, const char *, size_t *);
+static struct cache_slot	*cache_slot(u_int32_t);
+static int		cache_lock(struct cache_slot *);
+static void		cache_unlock(struct cache_slot *);
+static u_int64_t	cache_hash(const char *, size_t);
+static u_int8_t		*cache_copy(struct http_request *, struct cache_slot *,
+			    u_int64_t);
+static int		cache_filler_active(struct cache_slot *, u_int64_t);
+static pid_t		cache_pid(void);
+
+u_int32_t	http_cache_entries = HTTP_CACHE_ENTRIES;
+u_int32_t	http_cache_entry_max = HTTP_CACHE_ENTRY_MAX;
+int		http_cache_used = 0;
+
+static struct cache_region	*cache = NULL;
+
+/*
+ * Called from the parent before the workers are started, they inherit
+ * the segment. It is marked for removal right away and goes away once
+ * the last process that has it attached is gone.
+ */
+void
+http_cache_init(void)
+{
+	int		shm;
+	u_int32_t	sets;
+	size_t		len, slot_len;
+
+	if (!http_cache_used || cache != NULL)
+		return;
+
+	sets = (http_cache_entries + HTTP_CACHE_WAYS - 1) / HTTP_CACHE_WAYS;
+	slot_len = sizeof(struct cache_slot) + http_cache_entry_max;
+	slot_len = (slot_len + 7) & ~(size_t)7;
+	len = sizeof(struct cache_region) +
+	    (slot_len * sets * HTTP_CACHE_WAYS);
+
+	if ((shm = shmget(IPC_PRIVATE, len, IPC_CREAT | IPC_EXCL | 0700)) == -1)
+		fatal("http_cache_init(): shmget() %s", errno_s);
+
+	if ((cache = shmat(shm, NULL, 0)) == (void *)-1)
+		fatal("http_cache_init(): shmat() %s", errno_s);
+
+	if (shmctl(shm, IPC_RMID, NULL) == -1)
+		fatal("http_cache_init(): shmctl() %s", errno_s);
+
+	memset(cache, 0, len);
+	cache->sets = sets;
+	cache->slot_len = slot_len;
+}
+
+/*
+ * A worker went away, release the sets it died holding and let the
+ * next request refill the entries it was filling.
+ */
+void
+http_cache_reap(pid_t pid)
+{
+	u_int32_t		set, i;
+	struct cache_slot	*head, *slot;
+
+	if (cache == NULL)
+		return;
+
+	for (set = 0; set < cache->sets; set++) {
+		head = cache_slot(set * HTTP_CACHE_WAYS);
+		(void)__sync_bool_compare_and_swap(&head->lock, pid, 0);
+
+		if (!cache_lock(head))
+			continue;
+
+		for (i = 0; i < HTTP_CACHE_WAYS; i++) {
+			slot = cache_slot((set * HTTP_CACHE_WAYS) + i);
+			if (slot->filler == pid)
+				slot->filler = 0;
+		}
+
+		cache_unlock(head);
+	}
+}
+
+/*
+ * Answer the request from the cache if possible, returns KORE_RESULT_OK
+ * if a response was queued. On a miss the request may be picked to fill
+ * its entry: what it passes to http_response() is then stored.
+ */
+int
+http_cache_lookup(struct http_request *req)
+{
+	u_int8_t		*body;
+	u_int64_t		now;
+	u_int32_t		set, i;
+	size_t			klen, blen;
+	int			status;
+	char			key[HTTP_CACHE_KEY_MAX];
+	struct cache_slot	*head, *slot, *victim;
+
+	req->cache_state = HTTP_CACHE_NONE;
+
+	if (cache == NULL || req->hdlr->cache == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (KORE_RESULT_ERROR);
+
+	if (!cache_key(req, key, &klen))
+		return (KORE_RESULT_ERROR);
+
+	req->cache_hash = cache_hash(key, klen);
+	set = req->cache_hash % cache->sets;
+	head = cache_slot(set * HTTP_CACHE_WAYS);
+
+	if (!cache_lock(head)) {
+		__sync_fetch_and_add(&cache->misses, 1);
+		return (KORE_RESULT_ERROR);
+	}
+
+	now = kore_time_ms();
+	slot = NULL;
+	victim = NULL;
+
+	for (i = 0; i < HTTP_CACHE_WAYS; i++) {
+		slot = cache_slot((set * HTTP_CACHE_WAYS) + i);
+		if (slot->hash == req->cache_hash && slot->klen == klen &&
+		    !memcmp(slot->key, key, klen) &&
+		    ((slot->flags & CACHE_SLOT_VALID) ||
+		    cache_filler_active(slot, now)))
+			break;
+
+		if (cache_filler_active(slot, now))
+			continue;
+
+		/* Empty slots first, then whatever expires first. */
+		if (victim == NULL || !(slot->flags & CACHE_SLOT_VALID) ||
+		    ((victim->flags & CACHE_SLOT_VALID) &&
+		    slot->expires < victim->expires))
+			victim = slot;
+
+		slot = NULL;
+	}
+
+	if (slot != NULL && (slot->flags & CACHE_SLOT_VALID) &&
+	    (now < slot->expires || cache_filler_active(slot, now))) {
+		if (now < slot->expires)
+			__sync_fetch_and_add(&cache->hits, 1);
+		else
+			__sync_fetch_and_add(&cache->stale, 1);
+
+		status = slot->status;
+		blen = slot->blen;
+		body = cache_copy(req, slot, now);
+		cache_unlock(head);
+
+		http_response(req, status, body, blen);
+		return (KORE_RESULT_OK);
+	}
+
+	/*
+	 * An expired entry nobody is refreshing is ours to refresh. One
+	 * that is still being produced for the first time is a plain miss.
+	 */
+	if (slot != NULL && !(slot->flags & CACHE_SLOT_VALID)) {
+		cache_unlock(head);
+		__sync_fetch_and_add(&cache->misses, 1);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (slot == NULL && victim != NULL) {
+		slot = victim;
+		slot->flags = 0;
+		slot->klen = klen;
+		slot->hash = req->cache_hash;
+		memcpy(slot->key, key, klen);
+	}
+
+	if (slot != NULL) {
+		slot->filler = cache_pid();
+		slot->fill_start = now;
+		req->cache_state = HTTP_CACHE_FILLING;
+		req->cache_slot = slot;
+	}
+
+	cache_unlock(head);
+	__sync_fetch_and_add(&cache->misses, 1);
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Store the response of a request that was picked to fill its entry.
+ * Anything with cookies, a status other than 200 or that does not fit
+ * in a slot is not cached.
+ */
+void
+http_cache_store(struct http_request *req, int status, const void *d,
+    size_t len)
+{
+	u_int8_t		*p;
+	size_t			hlen, n;
+	struct http_header	*hdr;
+	struct cache_slot	*head, *slot;
+	u_int32_t		set;
+
+	if (req->cache_state != HTTP_CACHE_FILLING)
+		return;
+
+	if (status != HTTP_STATUS_OK || !TAILQ_EMPTY(&req->resp_cookies) ||
+	    (d == NULL && len > 0)) {
+		http_cache_release(req);
+		return;
+	}
+
+	hlen = 0;
+	TAILQ_FOREACH(hdr, &req->resp_headers, list)
+		hlen += strlen(hdr->header) + strlen(hdr->value) + 2;
+
+	if (hlen + len > http_cache_entry_max) {
+		http_cache_release(req);
+		return;
+	}
+
+	slot = req->cache_slot;
+	set = req->cache_hash % cache->sets;
+	head = cache_slot(set * HTTP_CACHE_WAYS);
+
+	if (!cache_lock(head))
+		return;
+
+	req->cache_state = HTTP_CACHE_NONE;
+
+	/* Our claim on the slot may have timed out and been taken. */
+	if (slot->filler != cache_pid() || slot->hash != req->cache_hash) {
+		cache_unlock(head);
+		return;
+	}
+
+	p = slot->data;
+	TAILQ_FOREACH(hdr, &req->resp_headers, list) {
+		n = strlen(hdr->header) + 1;
+		memcpy(p, hdr->header, n);
+		p += n;
+
+		n = strlen(hdr->value) + 1;
+		memcpy(p, hdr->value, n);
+		p += n;
+	}
+
+	if (len > 0)
+		memcpy(p, d, len);
+
+	slot->hlen = hlen;
+	slot->blen = len;
+	slot->filler = 0;
+	slot->status = status;
+	slot->stored = kore_time_ms();
+	slot->expires = slot->stored + req->hdlr->cache->ttl;
+	slot->flags |= CACHE_SLOT_VALID;
+
+	cache_unlock(head);
+	__sync_fetch_and_add(&cache->stores, 1);
+}
+
+/*
+ * Give up on filling an entry, the next request for it tries again.
+ */
+void
+http_cache_release(struct http_request *req)
+{
+	u_int32_t		set;
+	struct cache_slot	*head, *slot;
+
+	if (req->cache_state != HTTP_CACHE_FILLING)
+		return;
+
+	req->cache_state = HTTP_CACHE_NONE;
+
+	slot = req->cache_slot;
+	set = req->cache_hash % cache->sets;
+	head = cache_slot(set * HTTP_CACHE_WAYS);
+
+	if (!cache_lock(head))
+		return;
+
+	if (slot->filler == cache_pid() && slot->hash == req->cache_hash)
+		slot->filler = 0;
+
+	cache_unlock(head);
+}
+
+void
+http_cache_stats_get(struct http_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (cache == NULL)
+		return;
+
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->stale = cache->stale;
+	stats->stores = cache->stores;
+}
+
+/*
+ * Copy the entry into the request while the set is locked, the slot
+ * can be overwritten as soon as it is unlocked.
+ */
+static u_int8_t *
+cache_copy(struct http_request *req, struct cache_slot *slot, u_int64_t now)
+{
+	u_int8_t	*body;
+	const char	*name, *value, *p, *end;
+	char		age[32];
+	int		len;
+
+	p = (const char *)slot->data;
+	end = p + slot->hlen;
+
+	while (p < end) {
+		name = p;
+		p += strlen(p) + 1;
+		value = p;
+		p += strlen(p) + 1;
+		http_response_header(req, name, value);
+	}
+
+	len = snprintf(age, sizeof(age), "%" PRIu64,
+	    (now - slot->stored) / 1000);
+	if (len != -1 && (size_t)len < sizeof(age))
+		http_response_header(req, "age", age);
+
+	if (slot->blen == 0)
+		return (NULL);
+
+	body = http_request_alloc(req, slot->blen);
+	memcpy(body, slot->data + slot->hlen, slot->blen);
+
+	return (body);
+}
+
+/*
+ * The key is the method, host and path followed by the query string
+ * arguments and request headers the route its cache rule selected.
+ */
+static int
+cache_key(struct http_request *req, char *key, size_t *klen)
+{
+	int			i;
+	size_t			len;
+	const char		*val;
+	struct http_cache_rule	*rule;
+
+	*klen = 0;
+	rule = req->hdlr->cache;
+
+	val = http_method_text(req->method);
+	if (!cache_key_add(key, klen, val, strlen(val)))
+		return (KORE_RESULT_ERROR);
+	if (!cache_key_add(key, klen, req->host, strlen(req->host)))
+		return (KORE_RESULT_ERROR);
+	if (!cache_key_add(key, klen, req->path, strlen(req->path)))
+		return (KORE_RESULT_ERROR);
+
+	for (i = 0; i < rule->nargs; i++) {
+		val = cache_query_arg(req->query_string, rule->args[i], &len);
+		if (val == NULL) {
+			val = "";
+			len = 0;
+		}
+		if (!cache_key_add(key, klen, val, len))
+			return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 0; i < rule->nheaders; i++) {
+		if (!http_request_header(req, rule->headers[i], &val))
+			val = "";
+		if (!cache_key_add(key, klen, val, strlen(val)))
+			return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+cache_key_add(char *key, size_t *klen, const char *val, size_t len)
+{
+	if (len >= HTTP_CACHE_KEY_MAX - *klen)
+		return (KORE_RESULT_ERROR);
+
+	memcpy(key + *klen, val, len);
+	*klen += len;
+	key[(*klen)++] = '\n';
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * The raw value of the first name= in the query string, if any.
+ */
+static const char *
+cache_query_arg(const char *qs, const char *name, size_t *len)
+{
+	const char	*p, *end;
+	size_t		nlen;
+
+	if (qs == NULL)
+		return (NULL);
+
+	nlen = strlen(name);
+
+	for (p = qs; *p != '\0'; p = end + 1) {
+		if ((end = strchr(p, '&')) == NULL)
+			end = p + strlen(p);
+
+		if ((size_t)(end - p) > nlen && p[nlen] == '=' &&
+		    !strncmp(p, name, nlen)) {
+			*len = end - (p + nlen + 1);
+			return (p + nlen + 1);
+		}
+
+		if (*end == '\0')
+			break;
+	}
+
+	return (NULL);
+}
+
+static u_int64_t
+cache_hash(const char *key, size_t len)
+{
+	size_t		i;
+	u_int64_t	hash;
+
+	hash = 14695981039346656037ULL;
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)key[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash);
+}
+
+static struct cache_slot *
+cache_slot(u_int32_t idx)
+{
+	return ((struct cache_slot *)(cache->slots + (idx * cache->slot_len)));
+}
+
+static int
+cache_lock(struct cache_slot *head)
+{
+	int		i;
+
+	for (i = 0; i < HTTP_CACHE_SPINS; i++) {
+		if (__sync_bool_compare_and_swap(&head->lock, 0, cache_pid()))
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+cache_unlock(struct cache_slot *head)
+{
+	if (!__sync_bool_compare_and_swap(&head->lock, cache_pid(), 0))
+		kore_log(LOG_NOTICE, "cache_unlock(): wasn't locked");
+}
+
+static int
+cache_filler_active(struct cache_slot *slot, u_int64_t now)
+{
+	if (slot->filler == 0)
+		return (0);
+
+	return (now - slot->fill_start < HTTP_CACHE_FILL_TIMEOUT);
+}
+
+static pid_t
+cache_pid(void)
+{
+	if (worker != NULL)
+		return (worker->pid);
+
+	return (getpid());
+}
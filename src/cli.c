@@ -23,8 +23,15 @@
 #include <sys/time.h>
 
 #if !defined(KODEV_MINIMAL)
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
 #include <openssl/err.h>
 #include <openssl/pem.h>
+#include <openssl/ssl.h>
 #include <openssl/x509v3.h>
 #endif
 
@@ -34,12 +41,14 @@
 #include <libgen.h>
 #include <inttypes.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <utime.h>
 
@@ -120,6 +129,64 @@ struct cfile {
 
 TAILQ_HEAD(cfile_list, cfile);
 
+#if !defined(KODEV_MINIMAL)
+#define BENCH_RBUF		(64 * 1024)
+#define BENCH_STATIC_SIZE	(64 * 1024)
+#define BENCH_WS_KEY		"dGhlIHNhbXBsZSBub25jZQ=="
+
+#define BENCH_HTTP		1
+#define BENCH_WEBSOCKET		2
+
+#define BENCH_CONN_CONNECT	1
+#define BENCH_CONN_HANDSHAKE	2
+#define BENCH_CONN_UPGRADE	3
+#define BENCH_CONN_READY	4
+#define BENCH_CONN_CLOSED	5
+
+struct bench_scenario {
+	const char		*name;
+	int			type;
+	int			tls;
+	int			pipeline;
+	const char		*path;
+};
+
+struct bench_conn {
+	int			fd;
+	SSL			*ssl;
+	int			state;
+	int			wantw;
+	u_int32_t		inflight;
+	u_int64_t		sent;
+	const u_int8_t		*wdata;
+	size_t			wlen;
+	size_t			woff;
+	size_t			body;
+	size_t			roff;
+	u_int8_t		*rbuf;
+};
+
+struct bench_run {
+	const struct bench_scenario	*sc;
+	struct bench_conn		*conns;
+	struct pollfd			*pfds;
+	SSL_CTX				*ctx;
+	u_int32_t			depth;
+	char				*req;
+	size_t				reqlen;
+	u_int64_t			start;
+	u_int64_t			deadline;
+	u_int64_t			ops;
+	u_int64_t			errors;
+	u_int64_t			bytes;
+	u_int32_t			*lat;
+	size_t				nlat;
+	size_t				maxlat;
+	u_int32_t			ws_pending;
+	u_int64_t			ws_sent;
+};
+#endif
+
 static struct cli_buf	*cli_buf_alloc(size_t);
 static void		cli_buf_free(struct cli_buf *);
 static char		*cli_buf_stringify(struct cli_buf *, size_t *);
@@ -154,6 +221,7 @@ static void		cli_build_cflags(struct buildopt *);
 static void		cli_build_cxxflags(struct buildopt *);
 static void		cli_build_ldflags(struct buildopt *);
 static void		cli_file_read(int, char **, size_t *);
+static pid_t		cli_pid_read(const char *);
 static void		cli_file_writef(int, const char *, ...);
 static void		cli_file_open(const char *, int, int *);
 static void		cli_file_remove(char *, struct dirent *);
@@ -199,6 +267,7 @@ static void		cli_build(int, char **);
 static void		cli_clean(int, char **);
 static void		cli_source(int, char **);
 static void		cli_reload(int, char **);
+static void		cli_memstats(int, char **);
 static void		cli_flavor(int, char **);
 
 #if !defined(KODEV_MINIMAL)
@@ -213,18 +282,56 @@ static void		file_create_python_config(void);
 
 static void		cli_generate_certs(void);
 static void		cli_file_create(const char *, const char *, size_t);
+
+static void		cli_bench(int, char **);
+static void		cli_bench_help(void);
+
+static void		bench_start(void);
+static void		bench_stop(void);
+static void		bench_poll(struct bench_run *);
+static void		bench_scenario(const struct bench_scenario *);
+static void		bench_conn_open(struct bench_run *,
+			    struct bench_conn *);
+static void		bench_conn_close(struct bench_conn *);
+static int		bench_conn_io(struct bench_run *, struct bench_conn *);
+static void		bench_conn_established(struct bench_run *,
+			    struct bench_conn *);
+static void		bench_send(struct bench_conn *, const void *, size_t);
+static int		bench_flush(struct bench_conn *);
+static ssize_t		bench_read(struct bench_conn *, void *, size_t);
+static ssize_t		bench_write(struct bench_conn *, const void *, size_t);
+static ssize_t		bench_ssl_error(struct bench_conn *, int);
+static void		bench_consume(struct bench_conn *, size_t);
+static size_t		bench_header_end(struct bench_conn *);
+static size_t		bench_content_length(struct bench_conn *, size_t);
+static int		bench_http_parse(struct bench_run *,
+			    struct bench_conn *);
+static void		bench_http_done(struct bench_run *,
+			    struct bench_conn *);
+static void		bench_http_next(struct bench_run *,
+			    struct bench_conn *);
+static int		bench_ws_parse(struct bench_run *, struct bench_conn *);
+static void		bench_ws_done(struct bench_run *);
+static void		bench_ws_round(struct bench_run *);
+static void		bench_latency(struct bench_run *, u_int64_t);
+static u_int32_t	bench_percentile(struct bench_run *, double);
+static int		bench_cmp(const void *, const void *);
+static void		bench_report(struct bench_run *, u_int64_t);
+static u_int64_t	bench_now(void);
 #endif
 
 static struct cmd cmds[] = {
 	{ "help",	"this help text",			cli_help },
 	{ "run",	"run an application (-fnr implied)",	cli_run },
 	{ "reload",	"reload the application (SIGHUP)",	cli_reload },
+	{ "memstats",	"log memory and load stats (SIGUSR2)",	cli_memstats },
 	{ "info",	"show info on kore on this system",	cli_info },
 	{ "build",	"build an application",			cli_build },
 	{ "clean",	"cleanup the build files",		cli_clean },
 	{ "source",	"print the path to kore sources",	cli_source },
 #if !defined(KODEV_MINIMAL)
 	{ "create",	"create a new application skeleton",	cli_create },
+	{ "bench",	"benchmark the application",		cli_bench },
 #endif
 	{ "flavor",	"switch between build flavors",		cli_flavor },
 	{ NULL,		NULL,					NULL }
@@ -384,6 +491,30 @@ static const char *dh2048_data =
 
 static const char *gitignore = "*.o\n.flavor\n.objs\n%s.so\nassets.h\ncert\n";
 
+static struct bench_scenario bench_scenarios[] = {
+	{ "keepalive",	BENCH_HTTP,		0, 0, "/hello" },
+	{ "pipeline",	BENCH_HTTP,		0, 1, "/hello" },
+	{ "tls",	BENCH_HTTP,		1, 0, "/hello" },
+	{ "static",	BENCH_HTTP,		0, 0, "/static/static.bin" },
+	{ "websocket",	BENCH_WEBSOCKET,	0, 0, "/ws" },
+	{ NULL,		0,			0, 0, NULL },
+};
+
+static const u_int8_t bench_ws_frame[] = {
+	0x81, 0x88, 0x00, 0x00, 0x00, 0x00,
+	'k', 'o', 'r', 'e', 'b', 'e', 'n', 'c'
+};
+
+static FILE			*bench_out = NULL;
+static pid_t			bench_pid = 0;
+static const char		*bench_addr = "127.0.0.1";
+static u_int32_t		bench_conns = 64;
+static u_int32_t		bench_seconds = 10;
+static u_int32_t		bench_depth = 16;
+static u_int16_t		bench_port = 8888;
+static u_int16_t		bench_tls_port = 8889;
+static struct sockaddr_in	bench_sin;
+
 #endif /* !KODEV_MINIMAL */
 
 static int			s_fd = -1;
@@ -452,7 +583,8 @@ main(int argc, char **argv)
 
 	for (i = 0; cmds[i].name != NULL; i++) {
 		if (!strcmp(argv[0], cmds[i].name)) {
-			if (strcmp(argv[0], "create")) {
+			if (strcmp(argv[0], "create") &&
+			    strcmp(argv[0], "bench")) {
 				argc--;
 				argv++;
 			}
@@ -808,6 +940,24 @@ cli_run(int argc, char **argv)
 
 static void
 cli_reload(int argc, char **argv)
+{
+	if (kill(cli_pid_read("reload"), SIGHUP) == -1)
+		fatal("failed to reload: %s", errno_s);
+
+	printf("reloaded application\n");
+}
+
+static void
+cli_memstats(int argc, char **argv)
+{
+	if (kill(cli_pid_read("memstats"), SIGUSR2) == -1)
+		fatal("failed to signal kore: %s", errno_s);
+
+	printf("memory and load statistics will be in the kore log\n");
+}
+
+static pid_t
+cli_pid_read(const char *cmd)
 {
 	int		fd;
 	size_t		len;
@@ -819,16 +969,14 @@ cli_reload(int argc, char **argv)
 	cli_file_close(fd);
 
 	if (len == 0)
-		fatal("reload: pid file is empty");
+		fatal("%s: pid file is empty", cmd);
 
 	buf[len - 1] = '\0';
 
 	pid = cli_strtonum(buf, 0, UINT_MAX);
+	free(buf);
 
-	if (kill(pid, SIGHUP) == -1)
-		fatal("failed to reload: %s", errno_s);
-
-	printf("reloaded application\n");
+	return (pid);
 }
 
 static void
@@ -1477,6 +1625,833 @@ cli_generate_certs(void)
 	EVP_PKEY_free(pkey);
 	X509_free(x509);
 }
+
+/*
+ * kodev bench: build and start the application in the current directory
+ * (normally bench/app) and drive it with a fixed set of scenarios. Every
+ * connection is set up before the clock starts, after that each scenario
+ * runs for the given time. Results are written as one JSON object per
+ * scenario so runs of different commits can be compared with diff or jq.
+ */
+static void
+cli_bench_help(void)
+{
+	printf("Usage: kodev bench [options]\n");
+	printf("Synopsis:\n");
+	printf("  Build and start the application, run the benchmark\n");
+	printf("  scenarios against it and write the results as JSON.\n");
+	printf("\n");
+	printf("  Optional flags:\n");
+	printf("\t-a = address to connect to (default 127.0.0.1)\n");
+	printf("\t-c = number of connections (default 64)\n");
+	printf("\t-d = seconds per scenario (default 10)\n");
+	printf("\t-n = do not build and start, use a running server\n");
+	printf("\t-o = write the results to this file (default stdout)\n");
+	printf("\t-p = requests per pipelined batch (default 16)\n");
+	printf("\t-P = plaintext port (default 8888)\n");
+	printf("\t-s = comma separated scenarios (default all)\n");
+	printf("\t-T = TLS port (default 8889)\n");
+	printf("\n");
+	printf("  Scenarios:\n");
+	printf("\tkeepalive, pipeline, tls, static, websocket\n");
+
+	exit(1);
+}
+
+static void
+cli_bench(int argc, char **argv)
+{
+	int				ch, i, n, run;
+	char				*list, *names[16];
+	const struct bench_scenario	*sc, *todo[16];
+
+	run = 1;
+	list = NULL;
+	bench_out = stdout;
+
+	while ((ch = getopt(argc, argv, "a:c:d:hno:p:P:s:T:")) != -1) {
+		switch (ch) {
+		case 'a':
+			bench_addr = optarg;
+			break;
+		case 'c':
+			bench_conns = cli_strtonum(optarg, 2, 10000);
+			break;
+		case 'd':
+			bench_seconds = cli_strtonum(optarg, 1, 3600);
+			break;
+		case 'n':
+			run = 0;
+			break;
+		case 'o':
+			if ((bench_out = fopen(optarg, "w")) == NULL)
+				fatal("fopen(%s): %s", optarg, errno_s);
+			break;
+		case 'p':
+			bench_depth = cli_strtonum(optarg, 1, 1024);
+			break;
+		case 'P':
+			bench_port = cli_strtonum(optarg, 1, USHRT_MAX);
+			break;
+		case 's':
+			list = optarg;
+			break;
+		case 'T':
+			bench_tls_port = cli_strtonum(optarg, 1, USHRT_MAX);
+			break;
+		case 'h':
+		default:
+			cli_bench_help();
+			break;
+		}
+	}
+
+	if (list != NULL) {
+		n = cli_split_string(list, ",", names, 16);
+		for (i = 0; i < n; i++) {
+			for (sc = bench_scenarios; sc->name != NULL; sc++) {
+				if (!strcmp(sc->name, names[i]))
+					break;
+			}
+			if (sc->name == NULL)
+				fatal("unknown scenario '%s'", names[i]);
+			todo[i] = sc;
+		}
+	} else {
+		for (n = 0; bench_scenarios[n].name != NULL; n++)
+			todo[n] = &bench_scenarios[n];
+	}
+
+	if (inet_pton(AF_INET, bench_addr, &bench_sin.sin_addr) != 1)
+		fatal("'%s' is not an IPv4 address", bench_addr);
+
+	bench_sin.sin_family = AF_INET;
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	if (run)
+		bench_start();
+
+	for (i = 0; i < n; i++)
+		bench_scenario(todo[i]);
+
+	if (bench_out != stdout)
+		fclose(bench_out);
+
+	bench_stop();
+}
+
+/*
+ * Builds the application with the build output sent to stderr, keeping
+ * stdout for the results, and starts it with its log in kore-bench.log.
+ */
+static void
+bench_start(void)
+{
+	int		fd, saved, i, status;
+	char		*data;
+
+	(void)fflush(stdout);
+	if ((saved = dup(STDOUT_FILENO)) == -1)
+		fatal("dup: %s", errno_s);
+	if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+		fatal("dup2: %s", errno_s);
+
+	run_after = 1;
+	cli_build(0, NULL);
+
+	if (!cli_dir_exists("webroot"))
+		cli_mkdir("webroot", 0755);
+
+	if (!cli_file_exists("webroot/static.bin")) {
+		if ((data = malloc(BENCH_STATIC_SIZE)) == NULL)
+			fatal("malloc: %s", errno_s);
+		memset(data, 'k', BENCH_STATIC_SIZE);
+		cli_file_create("webroot/static.bin", data, BENCH_STATIC_SIZE);
+		free(data);
+	}
+
+	(void)fflush(stdout);
+	if (dup2(saved, STDOUT_FILENO) == -1)
+		fatal("dup2: %s", errno_s);
+	(void)close(saved);
+
+	if (atexit(bench_stop) == -1)
+		fatal("atexit: %s", errno_s);
+
+	switch ((bench_pid = fork())) {
+	case -1:
+		fatal("fork: %s", errno_s);
+		/* NOTREACHED */
+	case 0:
+		bench_pid = 0;
+		cli_file_open("kore-bench.log",
+		    O_CREAT | O_TRUNC | O_WRONLY, &fd);
+		if (dup2(fd, STDOUT_FILENO) == -1 ||
+		    dup2(fd, STDERR_FILENO) == -1)
+			fatal("dup2: %s", errno_s);
+		(void)close(fd);
+		cli_run_kore();
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	bench_sin.sin_port = htons(bench_port);
+
+	for (i = 0; i < 100; i++) {
+		if (waitpid(bench_pid, &status, WNOHANG) == bench_pid) {
+			bench_pid = 0;
+			fatal("kore exited, see kore-bench.log");
+		}
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			fatal("socket: %s", errno_s);
+
+		if (connect(fd, (struct sockaddr *)&bench_sin,
+		    sizeof(bench_sin)) == 0) {
+			(void)close(fd);
+			return;
+		}
+
+		(void)close(fd);
+		(void)usleep(100000);
+	}
+
+	fatal("kore did not start listening, see kore-bench.log");
+}
+
+static void
+bench_stop(void)
+{
+	int		status;
+
+	if (bench_pid <= 0)
+		return;
+
+	if (kill(bench_pid, SIGTERM) == 0)
+		(void)waitpid(bench_pid, &status, 0);
+
+	bench_pid = 0;
+}
+
+static void
+bench_scenario(const struct bench_scenario *sc)
+{
+	u_int32_t		i, ready;
+	struct bench_run	run;
+	u_int64_t		now, timeout;
+	char			*single;
+	size_t			len;
+
+	memset(&run, 0, sizeof(run));
+
+	run.sc = sc;
+	run.depth = sc->pipeline ? bench_depth : 1;
+	bench_sin.sin_port = htons(sc->tls ? bench_tls_port : bench_port);
+
+	fprintf(stderr, "%s: %u connections for %us\n",
+	    sc->name, bench_conns, bench_seconds);
+
+	if (sc->tls) {
+		if ((run.ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+			fatal("SSL_CTX_new: %s", ssl_errno_s);
+		SSL_CTX_set_verify(run.ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	if (sc->type == BENCH_WEBSOCKET) {
+		run.reqlen = cli_vasprintf(&run.req,
+		    "GET %s HTTP/1.1\r\nHost: %s\r\nUpgrade: websocket\r\n"
+		    "Connection: Upgrade\r\nSec-WebSocket-Key: %s\r\n"
+		    "Sec-WebSocket-Version: 13\r\n\r\n",
+		    sc->path, bench_addr, BENCH_WS_KEY);
+	} else {
+		len = cli_vasprintf(&single, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+		    sc->path, bench_addr);
+		run.reqlen = len * run.depth;
+		if ((run.req = malloc(run.reqlen)) == NULL)
+			fatal("malloc: %s", errno_s);
+		for (i = 0; i < run.depth; i++)
+			memcpy(run.req + (i * len), single, len);
+		free(single);
+	}
+
+	run.maxlat = 1024 * 1024;
+	if ((run.lat = calloc(run.maxlat, sizeof(*run.lat))) == NULL)
+		fatal("calloc: %s", errno_s);
+
+	if ((run.conns = calloc(bench_conns, sizeof(*run.conns))) == NULL ||
+	    (run.pfds = calloc(bench_conns, sizeof(*run.pfds))) == NULL)
+		fatal("calloc: %s", errno_s);
+
+	for (i = 0; i < bench_conns; i++)
+		bench_conn_open(&run, &run.conns[i]);
+
+	timeout = bench_now() + (10 * 1000000);
+
+	for (;;) {
+		ready = 0;
+		for (i = 0; i < bench_conns; i++) {
+			if (run.conns[i].state == BENCH_CONN_READY)
+				ready++;
+		}
+
+		if (ready == bench_conns)
+			break;
+
+		if (bench_now() > timeout)
+			fatal("%s: only %u connections came up", sc->name, ready);
+
+		bench_poll(&run);
+	}
+
+	run.start = bench_now();
+	run.deadline = run.start + ((u_int64_t)bench_seconds * 1000000);
+
+	if (sc->type == BENCH_WEBSOCKET) {
+		bench_ws_round(&run);
+	} else {
+		for (i = 0; i < bench_conns; i++)
+			bench_http_next(&run, &run.conns[i]);
+	}
+
+	while ((now = bench_now()) < run.deadline)
+		bench_poll(&run);
+
+	bench_report(&run, now - run.start);
+
+	for (i = 0; i < bench_conns; i++)
+		bench_conn_close(&run.conns[i]);
+
+	if (run.ctx != NULL)
+		SSL_CTX_free(run.ctx);
+
+	free(run.req);
+	free(run.lat);
+	free(run.pfds);
+	free(run.conns);
+}
+
+static void
+bench_poll(struct bench_run *run)
+{
+	u_int32_t		i;
+	struct bench_conn	*c;
+
+	for (i = 0; i < bench_conns; i++) {
+		c = &run->conns[i];
+		run->pfds[i].revents = 0;
+
+		if (c->state == BENCH_CONN_CLOSED) {
+			run->pfds[i].fd = -1;
+			continue;
+		}
+
+		run->pfds[i].fd = c->fd;
+		if (c->state == BENCH_CONN_CONNECT) {
+			run->pfds[i].events = POLLOUT;
+		} else {
+			run->pfds[i].events = POLLIN;
+			if (c->wantw || c->woff < c->wlen)
+				run->pfds[i].events |= POLLOUT;
+		}
+	}
+
+	if (poll(run->pfds, bench_conns, 100) == -1) {
+		if (errno == EINTR)
+			return;
+		fatal("poll: %s", errno_s);
+	}
+
+	for (i = 0; i < bench_conns; i++) {
+		if (run->pfds[i].revents == 0)
+			continue;
+
+		c = &run->conns[i];
+		if (bench_conn_io(run, c) == -1) {
+			if (run->start == 0)
+				fatal("%s: connection failed", run->sc->name);
+			run->errors++;
+			bench_conn_close(c);
+		}
+	}
+}
+
+static void
+bench_conn_open(struct bench_run *run, struct bench_conn *c)
+{
+	int		on;
+
+	if ((c->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		fatal("socket: %s", errno_s);
+
+	if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl: %s", errno_s);
+
+	on = 1;
+	(void)setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(c->fd, (struct sockaddr *)&bench_sin,
+	    sizeof(bench_sin)) == -1 && errno != EINPROGRESS)
+		fatal("connect: %s", errno_s);
+
+	if ((c->rbuf = malloc(BENCH_RBUF)) == NULL)
+		fatal("malloc: %s", errno_s);
+
+	c->state = BENCH_CONN_CONNECT;
+}
+
+static void
+bench_conn_close(struct bench_conn *c)
+{
+	if (c->ssl != NULL) {
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+
+	if (c->fd != -1) {
+		(void)close(c->fd);
+		c->fd = -1;
+	}
+
+	free(c->rbuf);
+	c->rbuf = NULL;
+	c->state = BENCH_CONN_CLOSED;
+}
+
+static int
+bench_conn_io(struct bench_run *run, struct bench_conn *c)
+{
+	int		r;
+	socklen_t	len;
+	ssize_t		ret;
+
+	c->wantw = 0;
+
+	switch (c->state) {
+	case BENCH_CONN_CONNECT:
+		len = sizeof(r);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &r, &len) == -1)
+			return (-1);
+		if (r != 0) {
+			fprintf(stderr, "connect: %s\n", strerror(r));
+			return (-1);
+		}
+		if (run->sc->tls == 0) {
+			bench_conn_established(run, c);
+			break;
+		}
+		if ((c->ssl = SSL_new(run->ctx)) == NULL ||
+		    !SSL_set_fd(c->ssl, c->fd))
+			fatal("SSL_new: %s", ssl_errno_s);
+		c->state = BENCH_CONN_HANDSHAKE;
+		/* FALLTHROUGH */
+	case BENCH_CONN_HANDSHAKE:
+		if ((r = SSL_connect(c->ssl)) != 1) {
+			switch (SSL_get_error(c->ssl, r)) {
+			case SSL_ERROR_WANT_READ:
+				return (0);
+			case SSL_ERROR_WANT_WRITE:
+				c->wantw = 1;
+				return (0);
+			default:
+				fprintf(stderr, "SSL_connect: %s\n",
+				    ssl_errno_s);
+				return (-1);
+			}
+		}
+		bench_conn_established(run, c);
+		break;
+	}
+
+	if (bench_flush(c) == -1)
+		return (-1);
+
+	for (;;) {
+		if (c->roff == BENCH_RBUF)
+			return (-1);
+
+		ret = bench_read(c, c->rbuf + c->roff, BENCH_RBUF - c->roff);
+		if (ret == -1)
+			return (-1);
+		if (ret == 0)
+			break;
+
+		c->roff += ret;
+		run->bytes += ret;
+
+		if (c->state == BENCH_CONN_UPGRADE ||
+		    run->sc->type == BENCH_HTTP) {
+			if (bench_http_parse(run, c) == -1)
+				return (-1);
+		}
+
+		if (c->state == BENCH_CONN_READY &&
+		    run->sc->type == BENCH_WEBSOCKET) {
+			if (bench_ws_parse(run, c) == -1)
+				return (-1);
+		}
+	}
+
+	return (bench_flush(c));
+}
+
+static void
+bench_conn_established(struct bench_run *run, struct bench_conn *c)
+{
+	if (run->sc->type == BENCH_WEBSOCKET) {
+		c->state = BENCH_CONN_UPGRADE;
+		bench_send(c, run->req, run->reqlen);
+	} else {
+		c->state = BENCH_CONN_READY;
+	}
+}
+
+static void
+bench_send(struct bench_conn *c, const void *data, size_t len)
+{
+	c->wdata = data;
+	c->wlen = len;
+	c->woff = 0;
+}
+
+static int
+bench_flush(struct bench_conn *c)
+{
+	ssize_t		ret;
+
+	while (c->woff < c->wlen) {
+		ret = bench_write(c, c->wdata + c->woff, c->wlen - c->woff);
+		if (ret == -1)
+			return (-1);
+		if (ret == 0)
+			break;
+		c->woff += ret;
+	}
+
+	return (0);
+}
+
+static ssize_t
+bench_read(struct bench_conn *c, void *buf, size_t len)
+{
+	int		r;
+	ssize_t		ret;
+
+	if (c->ssl != NULL) {
+		if ((r = SSL_read(c->ssl, buf, len)) > 0)
+			return (r);
+		return (bench_ssl_error(c, r));
+	}
+
+	if ((ret = read(c->fd, buf, len)) > 0)
+		return (ret);
+
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR))
+		return (0);
+
+	return (-1);
+}
+
+static ssize_t
+bench_write(struct bench_conn *c, const void *buf, size_t len)
+{
+	int		r;
+	ssize_t		ret;
+
+	if (c->ssl != NULL) {
+		if ((r = SSL_write(c->ssl, buf, len)) > 0)
+			return (r);
+		return (bench_ssl_error(c, r));
+	}
+
+	if ((ret = write(c->fd, buf, len)) > 0)
+		return (ret);
+
+	if (ret == -1 && (errno == EAGAIN || errno == EINTR)) {
+		c->wantw = 1;
+		return (0);
+	}
+
+	return (-1);
+}
+
+static ssize_t
+bench_ssl_error(struct bench_conn *c, int r)
+{
+	switch (SSL_get_error(c->ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		return (0);
+	case SSL_ERROR_WANT_WRITE:
+		c->wantw = 1;
+		return (0);
+	default:
+		return (-1);
+	}
+}
+
+static void
+bench_consume(struct bench_conn *c, size_t len)
+{
+	memmove(c->rbuf, c->rbuf + len, c->roff - len);
+	c->roff -= len;
+}
+
+/* Returns the length of the response headers, 0 if incomplete. */
+static size_t
+bench_header_end(struct bench_conn *c)
+{
+	size_t		i;
+
+	for (i = 3; i < c->roff; i++) {
+		if (c->rbuf[i] == '\n' && c->rbuf[i - 1] == '\r' &&
+		    c->rbuf[i - 2] == '\n' && c->rbuf[i - 3] == '\r')
+			return (i + 1);
+	}
+
+	return (0);
+}
+
+static size_t
+bench_content_length(struct bench_conn *c, size_t hlen)
+{
+	size_t		i, len;
+	const char	*p;
+
+	for (i = 0; i + 16 < hlen; i++) {
+		if (c->rbuf[i] != '\n')
+			continue;
+
+		p = (const char *)&c->rbuf[i + 1];
+		if (strncasecmp(p, "content-length:", 15))
+			continue;
+
+		len = 0;
+		for (i += 16; i < hlen && c->rbuf[i] == ' '; i++)
+			;
+		for (; i < hlen && isdigit(c->rbuf[i]); i++)
+			len = (len * 10) + (c->rbuf[i] - '0');
+
+		return (len);
+	}
+
+	return (0);
+}
+
+static int
+bench_http_parse(struct bench_run *run, struct bench_conn *c)
+{
+	int		status;
+	size_t		hlen, take;
+
+	for (;;) {
+		if (c->body > 0) {
+			take = MIN(c->body, c->roff);
+			bench_consume(c, take);
+			c->body -= take;
+			if (c->body > 0)
+				return (0);
+			bench_http_done(run, c);
+			continue;
+		}
+
+		if ((hlen = bench_header_end(c)) == 0)
+			return (0);
+
+		if (hlen < 12 || memcmp(c->rbuf, "HTTP/1.", 7))
+			return (-1);
+
+		status = (c->rbuf[9] - '0') * 100 +
+		    (c->rbuf[10] - '0') * 10 + (c->rbuf[11] - '0');
+
+		c->body = bench_content_length(c, hlen);
+		bench_consume(c, hlen);
+
+		if (c->state == BENCH_CONN_UPGRADE) {
+			if (status != 101)
+				return (-1);
+			c->state = BENCH_CONN_READY;
+			return (0);
+		}
+
+		if (status < 200 || status > 299)
+			run->errors++;
+
+		if (c->body == 0)
+			bench_http_done(run, c);
+	}
+}
+
+static void
+bench_http_done(struct bench_run *run, struct bench_conn *c)
+{
+	u_int64_t	now;
+
+	now = bench_now();
+	bench_latency(run, now - c->sent);
+
+	if (--c->inflight > 0)
+		return;
+
+	if (now < run->deadline)
+		bench_http_next(run, c);
+}
+
+static void
+bench_http_next(struct bench_run *run, struct bench_conn *c)
+{
+	c->sent = bench_now();
+	c->inflight = run->depth;
+	bench_send(c, run->req, run->reqlen);
+
+	/* Failures show up on the next poll of this connection. */
+	(void)bench_flush(c);
+}
+
+/*
+ * Websocket servers only receive, the frames are masked with an all
+ * zero key so the payload can be sent as is.
+ */
+static int
+bench_ws_parse(struct bench_run *run, struct bench_conn *c)
+{
+	int		i;
+	u_int8_t	op;
+	size_t		hlen;
+	u_int64_t	len;
+
+	while (c->roff >= 2) {
+		op = c->rbuf[0] & 0x0f;
+		len = c->rbuf[1] & 0x7f;
+		hlen = 2;
+
+		if (len == 126) {
+			if (c->roff < 4)
+				return (0);
+			len = (c->rbuf[2] << 8) | c->rbuf[3];
+			hlen = 4;
+		} else if (len == 127) {
+			if (c->roff < 10)
+				return (0);
+			len = 0;
+			for (i = 2; i < 10; i++)
+				len = (len << 8) | c->rbuf[i];
+			hlen = 10;
+		}
+
+		if (hlen + len > BENCH_RBUF)
+			return (-1);
+
+		if (c->roff < hlen + len)
+			return (0);
+
+		bench_consume(c, hlen + len);
+
+		switch (op) {
+		case 0x01:
+		case 0x02:
+			bench_ws_done(run);
+			break;
+		case 0x08:
+			return (-1);
+		default:
+			break;
+		}
+	}
+
+	return (0);
+}
+
+static void
+bench_ws_done(struct bench_run *run)
+{
+	u_int64_t	now;
+
+	now = bench_now();
+	bench_latency(run, now - run->ws_sent);
+
+	if (--run->ws_pending == 0 && now < run->deadline)
+		bench_ws_round(run);
+}
+
+/* One round: the first client sends, every other client receives it. */
+static void
+bench_ws_round(struct bench_run *run)
+{
+	struct bench_conn	*c;
+
+	c = &run->conns[0];
+	if (c->state != BENCH_CONN_READY)
+		return;
+
+	run->ws_sent = bench_now();
+	run->ws_pending = bench_conns - 1;
+	bench_send(c, bench_ws_frame, sizeof(bench_ws_frame));
+	(void)bench_flush(c);
+}
+
+static void
+bench_latency(struct bench_run *run, u_int64_t us)
+{
+	run->ops++;
+
+	if (run->nlat == run->maxlat) {
+		run->maxlat *= 2;
+		run->lat = realloc(run->lat, run->maxlat * sizeof(*run->lat));
+		if (run->lat == NULL)
+			fatal("realloc: %s", errno_s);
+	}
+
+	run->lat[run->nlat++] = (us > UINT_MAX) ? UINT_MAX : us;
+}
+
+static u_int32_t
+bench_percentile(struct bench_run *run, double pct)
+{
+	if (run->nlat == 0)
+		return (0);
+
+	return (run->lat[(size_t)(pct * (run->nlat - 1))]);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	u_int32_t	x = *(const u_int32_t *)a;
+	u_int32_t	y = *(const u_int32_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static void
+bench_report(struct bench_run *run, u_int64_t elapsed)
+{
+	double		secs;
+
+	secs = (double)elapsed / 1000000;
+	qsort(run->lat, run->nlat, sizeof(*run->lat), bench_cmp);
+
+	fprintf(bench_out, "{\"scenario\":\"%s\",\"conns\":%u,\"depth\":%u,"
+	    "\"seconds\":%.2f,\"ops\":%" PRIu64 ",\"errors\":%" PRIu64 ","
+	    "\"ops_sec\":%.1f,\"mb_sec\":%.2f,\"lat_us\":{\"p50\":%u,"
+	    "\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+	    run->sc->name, bench_conns, run->depth, secs, run->ops,
+	    run->errors, run->ops / secs,
+	    (run->bytes / secs) / (1024 * 1024),
+	    bench_percentile(run, 0.50), bench_percentile(run, 0.90),
+	    bench_percentile(run, 0.99), bench_percentile(run, 0.999),
+	    bench_percentile(run, 1.0));
+	(void)fflush(bench_out);
+}
+
+static u_int64_t
+bench_now(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec / 1000));
+}
 #endif
 
 static void
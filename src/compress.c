@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * gzip compression of response bodies for routes that were marked
+ * with the "compress" configuration option.
+ */
+
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "kore.h"
+#include "http.h"
+
+static int	compress_type(const char *);
+static int	compress_eligible(struct http_request *, int, size_t,
+		    const char *);
+static int	compress_gzip(struct kore_buf *, const void *, size_t);
+static int	compress_fileref_load(struct kore_fileref *);
+static int	compress_fileref_sent(struct netbuf *);
+
+int		http_compress_level = HTTP_COMPRESS_LEVEL;
+size_t		http_compress_min = HTTP_COMPRESS_MIN;
+
+static z_stream	gz_stream;
+static int	gz_initialized = 0;
+
+static const char *compress_types[] = {
+	"application/json",
+	"application/javascript",
+	"application/xml",
+	"image/svg+xml",
+	NULL
+};
+
+void
+http_compress_cleanup(void)
+{
+	if (gz_initialized) {
+		(void)deflateEnd(&gz_stream);
+		gz_initialized = 0;
+	}
+}
+
+/*
+ * Compress the body of a response if the route asked for it and the
+ * client takes gzip. On success the compressed body is in out and the
+ * caller sends that instead.
+ */
+int
+http_compress_response(struct http_request *req, int status,
+    const void *d, size_t len, struct kore_buf *out)
+{
+	const char	*type;
+
+	if (d == NULL || len < http_compress_min)
+		return (KORE_RESULT_ERROR);
+
+	type = http_response_header_get(req, "content-type");
+	if (!compress_eligible(req, status, len, type))
+		return (KORE_RESULT_ERROR);
+
+	if (!http_request_accepts_encoding(req, "gzip"))
+		return (KORE_RESULT_ERROR);
+
+	if (!compress_gzip(out, d, len))
+		return (KORE_RESULT_ERROR);
+
+	if (out->offset >= len)
+		return (KORE_RESULT_ERROR);
+
+	http_response_header(req, "content-encoding", "gzip");
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Serve the gzip'd copy of a fileref, compressing it the first time
+ * it is asked for. The compressed copy lives as long as the fileref.
+ * Returns KORE_RESULT_OK if the response went out.
+ */
+int
+http_compress_fileref(struct http_request *req, int status,
+    struct kore_fileref *ref, const char *type)
+{
+	if (ref->size < 0 || (uintmax_t)ref->size > HTTP_COMPRESS_FILE_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if ((size_t)ref->size < http_compress_min)
+		return (KORE_RESULT_ERROR);
+
+	if (!compress_eligible(req, status, ref->size, type))
+		return (KORE_RESULT_ERROR);
+
+	if (!http_request_accepts_encoding(req, "gzip"))
+		return (KORE_RESULT_ERROR);
+
+	if (ref->flags & KORE_FILEREF_GZIP_NONE)
+		return (KORE_RESULT_ERROR);
+
+	if (ref->gzip == NULL && !compress_fileref_load(ref)) {
+		ref->flags |= KORE_FILEREF_GZIP_NONE;
+		return (KORE_RESULT_ERROR);
+	}
+
+	http_response_header(req, "content-encoding", "gzip");
+
+	if (req->method == HTTP_METHOD_HEAD) {
+		http_response_stream(req, status,
+		    ref->gzip, ref->gzip_len, NULL, NULL);
+		kore_fileref_release(ref);
+	} else {
+		http_response_stream(req, status, ref->gzip, ref->gzip_len,
+		    compress_fileref_sent, ref);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Everything but the client its Accept-Encoding header. Responses that
+ * pass this differ per client and get a vary header, even when this
+ * particular client ends up without a compressed body.
+ */
+static int
+compress_eligible(struct http_request *req, int status, size_t len,
+    const char *type)
+{
+	if (req->hdlr == NULL || req->hdlr->compress == 0)
+		return (KORE_RESULT_ERROR);
+
+	if (status < 200 || status >= 300 || status == HTTP_STATUS_NO_CONTENT ||
+	    status == HTTP_STATUS_PARTIAL_CONTENT)
+		return (KORE_RESULT_ERROR);
+
+	if (len < http_compress_min || type == NULL || !compress_type(type))
+		return (KORE_RESULT_ERROR);
+
+	if (http_response_header_get(req, "content-encoding") != NULL)
+		return (KORE_RESULT_ERROR);
+
+	http_response_header(req, "vary", "accept-encoding");
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+compress_type(const char *type)
+{
+	int		i;
+	size_t		len;
+	const char	*p;
+
+	if ((p = strchr(type, ';')) != NULL)
+		len = p - type;
+	else
+		len = strlen(type);
+
+	if (len > 5 && !strncasecmp(type, "text/", 5))
+		return (KORE_RESULT_OK);
+
+	if (len > 5 && (!strncasecmp(type + len - 5, "+json", 5) ||
+	    !strncasecmp(type + len - 4, "+xml", 4)))
+		return (KORE_RESULT_OK);
+
+	for (i = 0; compress_types[i] != NULL; i++) {
+		if (strlen(compress_types[i]) == len &&
+		    !strncasecmp(compress_types[i], type, len))
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+static int
+compress_gzip(struct kore_buf *out, const void *d, size_t len)
+{
+	int		r;
+	uLong		bound;
+
+	if (len > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	/* One stream per worker, deflateReset() keeps its allocations. */
+	if (!gz_initialized) {
+		memset(&gz_stream, 0, sizeof(gz_stream));
+		if (deflateInit2(&gz_stream, http_compress_level, Z_DEFLATED,
+		    15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			kore_log(LOG_ERR, "deflateInit2: %s",
+			    gz_stream.msg != NULL ? gz_stream.msg : "failed");
+			return (KORE_RESULT_ERROR);
+		}
+		gz_initialized = 1;
+	} else if (deflateReset(&gz_stream) != Z_OK) {
+		return (KORE_RESULT_ERROR);
+	}
+
+	bound = deflateBound(&gz_stream, len);
+	if (bound > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_reset(out);
+	if (out->length < bound) {
+		out->data = kore_realloc(out->data, bound);
+		out->length = bound;
+	}
+
+	gz_stream.next_in = (Bytef *)(uintptr_t)d;
+	gz_stream.avail_in = len;
+	gz_stream.next_out = out->data;
+	gz_stream.avail_out = bound;
+
+	r = deflate(&gz_stream, Z_FINISH);
+	if (r != Z_STREAM_END) {
+		kore_log(LOG_ERR, "deflate: %d", r);
+		return (KORE_RESULT_ERROR);
+	}
+
+	out->offset = gz_stream.total_out;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+compress_fileref_load(struct kore_fileref *ref)
+{
+	struct kore_buf		buf;
+	u_int8_t		*data;
+	int			ret;
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+	ssize_t			r;
+	size_t			off;
+#endif
+
+	data = NULL;
+
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+	/* Plaintext filerefs are sent with sendfile() and not mapped. */
+	if (!ref->ontls) {
+		data = kore_malloc(ref->size);
+		for (off = 0; off < (size_t)ref->size; off += r) {
+			r = pread(ref->fd, data + off, ref->size - off, off);
+			if (r == -1 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			if (r <= 0) {
+				kore_log(LOG_NOTICE, "pread(%s): %s", ref->path,
+				    r == 0 ? "short read" : errno_s);
+				kore_free(data);
+				return (KORE_RESULT_ERROR);
+			}
+		}
+	}
+#endif
+
+	kore_buf_init(&buf, 0);
+	ret = compress_gzip(&buf, data != NULL ? data : ref->base, ref->size);
+	kore_free(data);
+
+	if (ret == KORE_RESULT_ERROR || buf.offset >= (size_t)ref->size) {
+		kore_buf_cleanup(&buf);
+		return (KORE_RESULT_ERROR);
+	}
+
+	ref->gzip = buf.data;
+	ref->gzip_len = buf.offset;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+compress_fileref_sent(struct netbuf *nb)
+{
+	kore_fileref_release(nb->extra);
+	return (KORE_RESULT_OK);
+}
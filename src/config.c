@@ -49,6 +49,10 @@
 #include "acme.h"
 #endif
 
+#if defined(KORE_USE_HTTP2)
+#include "http2.h"
+#endif
+
 #if defined(__linux__)
 #include "seccomp.h"
 #endif
@@ -75,6 +79,9 @@ static int		configure_acme_provider(char *);
 #endif
 
 static int		configure_tls(char *);
+static int		configure_tls_record_small(char *);
+static int		configure_tls_record_boost(char *);
+static int		configure_tls_record_idle(char *);
 static int		configure_server(char *);
 static int		configure_include(char *);
 static int		configure_bind(char *);
@@ -88,24 +95,58 @@ static int		configure_pidfile(char *);
 static int		configure_rlimit_nofiles(char *);
 static int		configure_max_connections(char *);
 static int		configure_accept_threshold(char *);
+static int		configure_accept_slack(char *);
+static int		configure_pool_idle_release(char *);
+static int		configure_memory_hugepages(char *);
 static int		configure_death_policy(char *);
+static int		configure_log_overflow(char *);
+static int		configure_log_rate_limit(char *);
 static int		configure_set_affinity(char *);
 static int		configure_socket_backlog(char *);
+static int		configure_socket_reuseport(char *);
+static int		configure_graceful_upgrade(char *);
+static int		configure_kv_entries(char *);
+static int		configure_kv_value_max(char *);
+static int		configure_drain_timeout(char *);
+static int		configure_stall_ms(char *);
+static int		configure_warmup_timeout(char *);
 
 #if defined(KORE_USE_PLATFORM_PLEDGE)
 static int		configure_add_pledge(char *);
 #endif
 
+#if defined(KORE_USE_IOURING)
+static int		configure_io_uring(char *);
+#endif
+
+#if defined(KORE_USE_HTTP2)
+static int		configure_http2_enable(char *);
+static int		configure_http2_max_streams(char *);
+#endif
+
+#if defined(KORE_USE_ZLIB)
+static int		configure_compress(char *);
+static int		configure_websocket_deflate(char *);
+static int		configure_http_compress_level(char *);
+static int		configure_http_compress_min(char *);
+#endif
+
 static int		configure_rand_file(char *);
 static int		configure_certfile(char *);
 static int		configure_certkey(char *);
 static int		configure_tls_version(char *);
+static int		configure_tls_ktls(char *);
 static int		configure_tls_cipher(char *);
 static int		configure_tls_dhparam(char *);
+static int		configure_tls_ticket_rotate(char *);
+static int		configure_tls_session_cache(char *);
+static int		configure_tls_lazy(char *);
 static int		configure_keymgr_root(char *);
 static int		configure_keymgr_runas(char *);
 static int		configure_client_verify(char *);
+static int		configure_ocsp_response(char *);
 static int		configure_client_verify_depth(char *);
+static int		configure_tls_prewarm(char *);
 
 #if !defined(KORE_NO_HTTP)
 static int		configure_route(char *);
@@ -115,13 +156,34 @@ static int		configure_redirect(char *);
 static int		configure_static_handler(char *);
 static int		configure_dynamic_handler(char *);
 static int		configure_restrict(char *);
+static int		configure_stream(char *);
+static int		configure_priority(char *);
+static int		configure_deadline(char *);
+static int		configure_cache(char *);
+static int		configure_http_cache_entries(char *);
+static int		configure_http_cache_entry_max(char *);
 static int		configure_accesslog(char *);
+static int		configure_accesslog_format(char *);
+static int		configure_metrics(char *);
+static int		configure_proxy(char *);
+static int		configure_upstream(char *);
+static int		configure_upstream_server(char *);
+static int		configure_upstream_balance(char *);
+static int		configure_upstream_keepalive(char *);
+static int		configure_upstream_timeout(char *);
+static int		configure_upstream_connect_timeout(char *);
+static int		configure_upstream_health_check(char *);
 static int		configure_http_header_max(char *);
 static int		configure_http_header_timeout(char *);
 static int		configure_http_body_max(char *);
 static int		configure_http_body_timeout(char *);
 static int		configure_filemap_ext(char *);
 static int		configure_filemap_index(char *);
+static int		configure_filemap_precompressed(char *);
+static int		configure_fileref_revalidate(char *);
+static int		configure_fileref_memory_max(char *);
+static int		configure_fileref_memory_file_max(char *);
+static int		configure_filemap_preload(char *);
 static int		configure_http_media_type(char *);
 static int		configure_http_hsts_enable(char *);
 static int		configure_http_keepalive_time(char *);
@@ -131,6 +193,7 @@ static int		configure_http_body_disk_offload(char *);
 static int		configure_http_body_disk_path(char *);
 static int		configure_http_server_version(char *);
 static int		configure_http_pretty_error(char *);
+static int		configure_http_server_timing(char *);
 static int		configure_validator(char *);
 static int		configure_params(char *);
 static int		configure_validate(char *);
@@ -139,32 +202,48 @@ static int		configure_authentication_uri(char *);
 static int		configure_authentication_type(char *);
 static int		configure_authentication_value(char *);
 static int		configure_authentication_validator(char *);
+static int		configure_authentication_cache(char *);
+static int		configure_authentication_cache_shared(char *);
 static int		configure_websocket_maxframe(char *);
 static int		configure_websocket_timeout(char *);
 #endif
 
 #if defined(KORE_USE_PGSQL)
+static int		configure_pgsql_conn_min(char *);
 static int		configure_pgsql_conn_max(char *);
+static int		configure_pgsql_conn_check(char *);
+static int		configure_pgsql_conn_lifetime(char *);
 static int		configure_pgsql_queue_limit(char *);
+static int		configure_pgsql_queue_timeout(char *);
+static int		configure_pgsql_statement_max(char *);
+static int		configure_pgsql_replica_lag(char *);
 #endif
 
 #if defined(KORE_USE_TASKS)
 static int		configure_task_threads(char *);
+static int		configure_task_spill_max(char *);
+static int		configure_keymgr_threads(char *);
 #endif
 
 #if defined(KORE_USE_PYTHON)
 static int		configure_deployment(char *);
 static int		configure_python_path(char *);
 static int		configure_python_import(char *);
+static int		configure_python_coro_ms(char *);
+static int		configure_python_coro_limit(char *);
+static int		configure_python_gc_freeze(char *);
 #endif
 
 #if defined(KORE_USE_CURL)
 static int		configure_curl_timeout(char *);
 static int		configure_curl_recv_max(char *);
+static int		configure_curl_handle_pool(char *);
+static int		configure_curl_stream_hwm(char *);
 #endif
 
 #if defined(__linux__)
 static int		configure_seccomp_tracing(char *);
+static int		configure_msg_shm(char *);
 #endif
 
 static struct {
@@ -172,6 +251,9 @@ static struct {
 	int			(*configure)(char *);
 } config_directives[] = {
 	{ "tls",			configure_tls },
+	{ "tls_record_small",		configure_tls_record_small },
+	{ "tls_record_boost",		configure_tls_record_boost },
+	{ "tls_record_idle",		configure_tls_record_idle },
 #if defined(KORE_USE_ACME)
 	{ "acme",			configure_acme },
 #endif
@@ -185,10 +267,15 @@ static struct {
 	{ "include",			configure_include },
 	{ "unix",			configure_bind_unix },
 	{ "client_verify",		configure_client_verify },
+	{ "ocsp_response",		configure_ocsp_response },
 	{ "client_verify_depth",	configure_client_verify_depth },
+	{ "tls_prewarm",		configure_tls_prewarm },
 #if defined(KORE_USE_PYTHON)
 	{ "python_path",		configure_python_path },
 	{ "python_import",		configure_python_import },
+	{ "python_coro_ms",		configure_python_coro_ms },
+	{ "python_coro_limit",		configure_python_coro_limit },
+	{ "python_gc_freeze",		configure_python_gc_freeze },
 #endif
 #if !defined(KORE_NO_HTTP)
 	{ "route",			configure_route},
@@ -198,7 +285,17 @@ static struct {
 	{ "static",			configure_static_handler },
 	{ "dynamic",			configure_dynamic_handler },
 	{ "accesslog",			configure_accesslog },
+	{ "metrics",			configure_metrics },
+	{ "proxy",			configure_proxy },
 	{ "restrict",			configure_restrict },
+	{ "stream",			configure_stream },
+	{ "priority",			configure_priority },
+	{ "deadline",			configure_deadline },
+	{ "cache",			configure_cache },
+#if defined(KORE_USE_ZLIB)
+	{ "compress",			configure_compress },
+	{ "websocket_deflate",		configure_websocket_deflate },
+#endif
 	{ "validator",			configure_validator },
 	{ "params",			configure_params },
 	{ "validate",			configure_validate },
@@ -207,6 +304,15 @@ static struct {
 	{ "authentication_type",	configure_authentication_type },
 	{ "authentication_value",	configure_authentication_value },
 	{ "authentication_validator",	configure_authentication_validator },
+	{ "authentication_cache",	configure_authentication_cache },
+	{ "authentication_cache_shared", configure_authentication_cache_shared },
+	{ "upstream",			configure_upstream },
+	{ "upstream_server",		configure_upstream_server },
+	{ "upstream_balance",		configure_upstream_balance },
+	{ "upstream_keepalive",		configure_upstream_keepalive },
+	{ "upstream_timeout",		configure_upstream_timeout },
+	{ "upstream_connect_timeout",	configure_upstream_connect_timeout },
+	{ "upstream_health_check",	configure_upstream_health_check },
 #endif
 	{ NULL,				NULL },
 };
@@ -222,13 +328,29 @@ static struct {
 	{ "worker_max_connections",	configure_max_connections },
 	{ "worker_rlimit_nofiles",	configure_rlimit_nofiles },
 	{ "worker_accept_threshold",	configure_accept_threshold },
+	{ "worker_accept_slack",	configure_accept_slack },
 	{ "worker_death_policy",	configure_death_policy },
 	{ "worker_set_affinity",	configure_set_affinity },
+	{ "worker_drain_timeout",	configure_drain_timeout },
+	{ "worker_stall_ms",		configure_stall_ms },
+	{ "worker_warmup_timeout",	configure_warmup_timeout },
+	{ "graceful_upgrade",		configure_graceful_upgrade },
+	{ "kv_entries",			configure_kv_entries },
+	{ "kv_value_max",		configure_kv_value_max },
+	{ "pool_idle_release",		configure_pool_idle_release },
+	{ "memory_hugepages",		configure_memory_hugepages },
 	{ "pidfile",			configure_pidfile },
+	{ "log_overflow",		configure_log_overflow },
+	{ "log_rate_limit",		configure_log_rate_limit },
 	{ "socket_backlog",		configure_socket_backlog },
+	{ "socket_reuseport",		configure_socket_reuseport },
 	{ "tls_version",		configure_tls_version },
+	{ "tls_ktls",			configure_tls_ktls },
 	{ "tls_cipher",			configure_tls_cipher },
 	{ "tls_dhparam",		configure_tls_dhparam },
+	{ "tls_ticket_rotate",		configure_tls_ticket_rotate },
+	{ "tls_session_cache",		configure_tls_session_cache },
+	{ "tls_lazy",			configure_tls_lazy },
 	{ "rand_file",			configure_rand_file },
 	{ "keymgr_runas",		configure_keymgr_runas },
 	{ "keymgr_root",		configure_keymgr_root },
@@ -243,10 +365,27 @@ static struct {
 #endif
 #if defined(__linux__)
 	{ "seccomp_tracing",		configure_seccomp_tracing },
+	{ "msg_shm",			configure_msg_shm },
+#endif
+#if defined(KORE_USE_IOURING)
+	{ "io_uring",			configure_io_uring },
+#endif
+#if defined(KORE_USE_HTTP2)
+	{ "http2_enable",		configure_http2_enable },
+	{ "http2_max_streams",		configure_http2_max_streams },
+#endif
+#if defined(KORE_USE_ZLIB)
+	{ "http_compress_level",	configure_http_compress_level },
+	{ "http_compress_min",		configure_http_compress_min },
 #endif
 #if !defined(KORE_NO_HTTP)
 	{ "filemap_ext",		configure_filemap_ext },
 	{ "filemap_index",		configure_filemap_index },
+	{ "filemap_precompressed",	configure_filemap_precompressed },
+	{ "fileref_revalidate",		configure_fileref_revalidate },
+	{ "fileref_memory_max",		configure_fileref_memory_max },
+	{ "fileref_memory_file_max",	configure_fileref_memory_file_max },
+	{ "filemap_preload",		configure_filemap_preload },
 	{ "http_media_type",		configure_http_media_type },
 	{ "http_header_max",		configure_http_header_max },
 	{ "http_header_timeout",	configure_http_header_timeout },
@@ -257,25 +396,39 @@ static struct {
 	{ "http_request_ms",		configure_http_request_ms },
 	{ "http_request_limit",		configure_http_request_limit },
 	{ "http_body_disk_offload",	configure_http_body_disk_offload },
+	{ "http_cache_entries",		configure_http_cache_entries },
+	{ "http_cache_entry_max",	configure_http_cache_entry_max },
 	{ "http_body_disk_path",	configure_http_body_disk_path },
 	{ "http_server_version",	configure_http_server_version },
 	{ "http_pretty_error",		configure_http_pretty_error },
+	{ "http_server_timing",		configure_http_server_timing },
 	{ "websocket_maxframe",		configure_websocket_maxframe },
 	{ "websocket_timeout",		configure_websocket_timeout },
+	{ "accesslog_format",		configure_accesslog_format },
 #endif
 #if defined(KORE_USE_PYTHON)
 	{ "deployment",			configure_deployment },
 #endif
 #if defined(KORE_USE_PGSQL)
+	{ "pgsql_conn_min",		configure_pgsql_conn_min },
 	{ "pgsql_conn_max",		configure_pgsql_conn_max },
+	{ "pgsql_conn_check",		configure_pgsql_conn_check },
+	{ "pgsql_conn_lifetime",	configure_pgsql_conn_lifetime },
 	{ "pgsql_queue_limit",		configure_pgsql_queue_limit },
+	{ "pgsql_queue_timeout",	configure_pgsql_queue_timeout },
+	{ "pgsql_statement_max",	configure_pgsql_statement_max },
+	{ "pgsql_replica_lag",		configure_pgsql_replica_lag },
 #endif
 #if defined(KORE_USE_TASKS)
 	{ "task_threads",		configure_task_threads },
+	{ "task_spill_max",		configure_task_spill_max },
+	{ "keymgr_threads",		configure_keymgr_threads },
 #endif
 #if defined(KORE_USE_CURL)
 	{ "curl_timeout",		configure_curl_timeout },
 	{ "curl_recv_max",		configure_curl_recv_max },
+	{ "curl_handle_pool",		configure_curl_handle_pool },
+	{ "curl_stream_hwm",		configure_curl_stream_hwm },
 #endif
 #if !defined(KORE_SINGLE_BINARY) && defined(KORE_USE_PYTHON)
 	{ "file",			configure_file },
@@ -293,6 +446,7 @@ char					*config_file = NULL;
 static u_int8_t				current_method = 0;
 static int				current_flags = 0;
 static struct kore_auth			*current_auth = NULL;
+static struct kore_upstream		*current_upstream = NULL;
 static struct kore_module_handle	*current_handler = NULL;
 #endif
 
@@ -376,6 +530,11 @@ kore_parse_config(void)
 	if (skip_chroot && !kore_quiet)
 		kore_log(LOG_WARNING, "privsep: will not chroot");
 
+	if (tls_session_cache && kore_kv_entries == 0)
+		fatal("tls_session_cache requires kv_entries to be set");
+
+	kore_fileref_sysinit();
+
 	finalized = 1;
 }
 
@@ -414,10 +573,24 @@ kore_parse_config_file(FILE *fp)
 				    current_auth->name);
 			}
 
+			if (current_auth->cache_size > 0)
+				kore_auth_cache_create(current_auth);
+
 			lineno++;
 			current_auth = NULL;
 			continue;
 		}
+
+		if (!strcmp(p, "}") && current_upstream != NULL) {
+			if (current_upstream->server_count == 0) {
+				fatal("no servers for upstream %s",
+				    current_upstream->name);
+			}
+
+			lineno++;
+			current_upstream = NULL;
+			continue;
+		}
 #endif
 
 		if (!strcmp(p, "}") && current_domain != NULL) {
@@ -593,6 +766,64 @@ configure_tls(char *yesno)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_record_small(char *option)
+{
+	int		err;
+
+	if (current_server == NULL) {
+		printf("tls_record_small not inside a server context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_server->tls_rec_small = kore_strtonum(option, 10,
+	    512, NETBUF_TLS_RECORD_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad tls_record_small value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_record_boost(char *option)
+{
+	int		err;
+
+	if (current_server == NULL) {
+		printf("tls_record_boost not inside a server context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_server->tls_rec_boost = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad tls_record_boost value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_record_idle(char *option)
+{
+	int		err;
+
+	if (current_server == NULL) {
+		printf("tls_record_idle not inside a server context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_server->tls_rec_idle = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad tls_record_idle value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 #if defined(KORE_USE_ACME)
 static int
 configure_acme(char *yesno)
@@ -780,6 +1011,54 @@ configure_tls_version(char *version)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_ktls(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		tls_ktls = 0;
+	} else if (!strcmp(yesno, "yes")) {
+#if !defined(KORE_USE_PLATFORM_KTLS)
+		printf("tls_ktls: kernel TLS not supported by this build\n");
+#endif
+		tls_ktls = 1;
+	} else {
+		printf("invalid '%s' for yes|no tls_ktls\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_ticket_rotate(char *option)
+{
+	int		err;
+
+	tls_ticket_rotate = kore_strtonum(option, 10, 0,
+	    UINT_MAX / 1000, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for tls_ticket_rotate: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_tls_session_cache(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		tls_session_cache = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		tls_session_cache = 1;
+	} else {
+		printf("invalid '%s' for yes|no tls_session_cache\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_tls_cipher(char *cipherlist)
 {
@@ -818,6 +1097,21 @@ configure_tls_dhparam(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_lazy(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		tls_lazy = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		tls_lazy = 1;
+	} else {
+		printf("invalid '%s' for yes|no tls_lazy\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_client_verify_depth(char *value)
 {
@@ -839,6 +1133,26 @@ configure_client_verify_depth(char *value)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_tls_prewarm(char *yesno)
+{
+	if (current_domain == NULL) {
+		printf("tls_prewarm not specified in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(yesno, "no")) {
+		current_domain->tls_prewarm = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		current_domain->tls_prewarm = 1;
+	} else {
+		printf("invalid '%s' for yes|no tls_prewarm\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_client_verify(char *options)
 {
@@ -868,6 +1182,20 @@ configure_client_verify(char *options)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_ocsp_response(char *path)
+{
+	if (current_domain == NULL) {
+		printf("ocsp_response not specified in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_free(current_domain->ocspfile);
+	current_domain->ocspfile = kore_strdup(path);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_rand_file(char *path)
 {
@@ -1146,6 +1474,68 @@ configure_accesslog(char *path)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_metrics(char *path)
+{
+	if (current_domain == NULL) {
+		printf("metrics outside of domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_metrics_create(current_domain, path)) {
+		printf("cannot create metrics route %s\n", path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_proxy(char *options)
+{
+	char		*argv[3];
+
+	if (current_domain == NULL) {
+		printf("proxy outside of domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL || argv[1] == NULL) {
+		printf("missing parameters for proxy\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (kore_proxy_upstream_lookup(argv[1]) == NULL) {
+		printf("upstream '%s' not found\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!kore_proxy_create(current_domain, argv[0], argv[1])) {
+		printf("cannot create proxy route %s\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_accesslog_format(char *format)
+{
+	if (!strcmp(format, "combined")) {
+		kore_accesslog_format = KORE_ACCESSLOG_FORMAT_COMBINED;
+	} else if (!strcmp(format, "json")) {
+		kore_accesslog_format = KORE_ACCESSLOG_FORMAT_JSON;
+	} else if (!strcmp(format, "binary")) {
+		kore_accesslog_format = KORE_ACCESSLOG_FORMAT_BINARY;
+	} else {
+		printf("unknown accesslog_format '%s'\n", format);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_restrict(char *options)
 {
@@ -1201,61 +1591,102 @@ configure_restrict(char *options)
 }
 
 static int
-configure_filemap_ext(char *ext)
+configure_stream(char *route)
 {
-	kore_free(kore_filemap_ext);
-	kore_filemap_ext = kore_strdup(ext);
+	struct kore_module_handle	*hdlr;
 
-	return (KORE_RESULT_OK);
-}
+	if (current_domain == NULL) {
+		printf("stream not used in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
 
-static int
-configure_filemap_index(char *index)
-{
-	kore_free(kore_filemap_index);
-	kore_filemap_index = kore_strdup(index);
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, route))
+			break;
+	}
+
+	if (hdlr == NULL) {
+		printf("bad stream option handler '%s' not found\n", route);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdlr->stream = 1;
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_media_type(char *type)
+configure_priority(char *options)
 {
-	int		i;
-	char		*extensions, *ext[10];
+	int				prio;
+	struct kore_module_handle	*hdlr;
+	char				*argv[3];
 
-	extensions = strchr(type, ' ');
-	if (extensions == NULL) {
-		printf("bad http_media_type value: %s\n", type);
+	if (current_domain == NULL) {
+		printf("priority not used in domain context\n");
 		return (KORE_RESULT_ERROR);
 	}
 
-	*(extensions)++ = '\0';
+	if (kore_split_string(options, " ", argv, 3) != 2) {
+		printf("priority requires a route and a class\n");
+		return (KORE_RESULT_ERROR);
+	}
 
-	kore_split_string(extensions, " \t", ext, 10);
-	for (i = 0; ext[i] != NULL; i++) {
-		if (!http_media_register(ext[i], type)) {
-			printf("duplicate extension found: %s\n", ext[i]);
-			return (KORE_RESULT_ERROR);
-		}
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[0]))
+			break;
 	}
 
-	if (i == 0) {
-		printf("missing extensions in: %s\n", type);
+	if (hdlr == NULL) {
+		printf("bad priority option handler '%s' not found\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!strcmp(http_prio_name(prio), argv[1]))
+			break;
+	}
+
+	if (prio == HTTP_PRIO_MAX) {
+		printf("unknown priority class %s for %s\n", argv[1], argv[0]);
 		return (KORE_RESULT_ERROR);
 	}
 
+	hdlr->priority = prio;
+
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_http_header_max(char *option)
+configure_deadline(char *options)
 {
-	int		err;
+	int				err;
+	struct kore_module_handle	*hdlr;
+	char				*argv[3];
 
-	http_header_max = kore_strtonum(option, 10, 1, 65535, &err);
+	if (current_domain == NULL) {
+		printf("deadline not used in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (kore_split_string(options, " ", argv, 3) != 2) {
+		printf("deadline requires a route and milliseconds\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[0]))
+			break;
+	}
+
+	if (hdlr == NULL) {
+		printf("bad deadline option handler '%s' not found\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdlr->deadline = kore_strtonum64(argv[1], 0, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad http_header_max value: %s\n", option);
+		printf("bad deadline for %s: %s\n", argv[0], argv[1]);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1263,9 +1694,208 @@ configure_http_header_max(char *option)
 }
 
 static int
-configure_http_header_timeout(char *option)
+configure_cache(char *options)
 {
-	int		err;
+	int				i, cnt, err;
+	struct kore_module_handle	*hdlr;
+	struct http_cache_rule		*rule;
+	char				*argv[(HTTP_CACHE_VARY_MAX * 2) + 3];
+
+	if (current_domain == NULL) {
+		printf("cache not used in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	cnt = kore_split_string(options, " ",
+	    argv, (HTTP_CACHE_VARY_MAX * 2) + 3);
+	if (cnt < 2) {
+		printf("cache requires a route and a ttl\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[0]))
+			break;
+	}
+
+	if (hdlr == NULL) {
+		printf("bad cache option handler '%s' not found\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (hdlr->cache != NULL) {
+		printf("cache already set for %s\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	rule = kore_calloc(1, sizeof(*rule));
+	hdlr->cache = rule;
+
+	rule->ttl = kore_strtonum64(argv[1], 0, &err);
+	if (err != KORE_RESULT_OK || rule->ttl == 0) {
+		printf("bad cache ttl for %s: %s\n", argv[0], argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	for (i = 2; i < cnt; i++) {
+		if (!strncmp(argv[i], "arg:", 4) && argv[i][4] != '\0' &&
+		    rule->nargs < HTTP_CACHE_VARY_MAX) {
+			rule->args[rule->nargs++] = kore_strdup(argv[i] + 4);
+		} else if (!strncmp(argv[i], "header:", 7) &&
+		    argv[i][7] != '\0' && rule->nheaders < HTTP_CACHE_VARY_MAX) {
+			rule->headers[rule->nheaders++] =
+			    kore_strdup(argv[i] + 7);
+		} else {
+			printf("bad cache key option for %s: %s\n",
+			    argv[0], argv[i]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	http_cache_used = 1;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_ext(char *ext)
+{
+	kore_free(kore_filemap_ext);
+	kore_filemap_ext = kore_strdup(ext);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_index(char *index)
+{
+	kore_free(kore_filemap_index);
+	kore_filemap_index = kore_strdup(index);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_precompressed(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_filemap_precompressed = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_filemap_precompressed = 1;
+	} else {
+		printf("invalid '%s' for yes|no filemap_precompressed\n",
+		    yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_revalidate(char *option)
+{
+	int		err;
+
+	kore_fileref_revalidate = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad fileref_revalidate value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_memory_max(char *option)
+{
+	int		err;
+
+	kore_fileref_memory_max = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad fileref_memory_max value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_fileref_memory_file_max(char *option)
+{
+	int		err;
+
+	kore_fileref_memory_file_max = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK || kore_fileref_memory_file_max > SIZE_MAX) {
+		printf("bad fileref_memory_file_max value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_filemap_preload(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_filemap_preload = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_filemap_preload = 1;
+	} else {
+		printf("invalid '%s' for yes|no filemap_preload\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_media_type(char *type)
+{
+	int		i;
+	char		*extensions, *ext[10];
+
+	extensions = strchr(type, ' ');
+	if (extensions == NULL) {
+		printf("bad http_media_type value: %s\n", type);
+		return (KORE_RESULT_ERROR);
+	}
+
+	*(extensions)++ = '\0';
+
+	kore_split_string(extensions, " \t", ext, 10);
+	for (i = 0; ext[i] != NULL; i++) {
+		if (!http_media_register(ext[i], type)) {
+			printf("duplicate extension found: %s\n", ext[i]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (i == 0) {
+		printf("missing extensions in: %s\n", type);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_header_max(char *option)
+{
+	int		err;
+
+	http_header_max = kore_strtonum(option, 10, 1, 65535, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_header_max value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_header_timeout(char *option)
+{
+	int		err;
 
 	http_header_timeout = kore_strtonum(option, 10, 1, 65535, &err);
 	if (err != KORE_RESULT_OK) {
@@ -1318,6 +1948,34 @@ configure_http_body_disk_offload(char *option)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_http_cache_entries(char *option)
+{
+	int		err;
+
+	http_cache_entries = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_cache_entries value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_cache_entry_max(char *option)
+{
+	int		err;
+
+	http_cache_entry_max = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad http_cache_entry_max value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_http_body_disk_path(char *path)
 {
@@ -1352,6 +2010,22 @@ configure_http_pretty_error(char *yesno)
 	return (KORE_RESULT_OK);
 }
 
+static int
+configure_http_server_timing(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		http_server_timing = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		http_server_timing = 1;
+	} else {
+		printf("invalid '%s' for yes|no http_server_timing option\n",
+		    yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 configure_http_hsts_enable(char *option)
 {
@@ -1421,23 +2095,35 @@ configure_validator(char *name)
 
 	*(tname)++ = '\0';
 	tname = kore_text_trim(tname, strlen(tname));
-	if ((value = strchr(tname, ' ')) == NULL) {
-		printf("missing validator value\n");
-		return (KORE_RESULT_ERROR);
+	if ((value = strchr(tname, ' ')) != NULL) {
+		*(value)++ = '\0';
+		value = kore_text_trim(value, strlen(value));
 	}
 
-	*(value)++ = '\0';
-	value = kore_text_trim(value, strlen(value));
-
 	if (!strcmp(tname, "regex")) {
 		type = KORE_VALIDATOR_TYPE_REGEX;
 	} else if (!strcmp(tname, "function")) {
 		type = KORE_VALIDATOR_TYPE_FUNCTION;
+	} else if (!strcmp(tname, "int")) {
+		type = KORE_VALIDATOR_TYPE_INT;
+	} else if (!strcmp(tname, "uuid")) {
+		type = KORE_VALIDATOR_TYPE_UUID;
+	} else if (!strcmp(tname, "length")) {
+		type = KORE_VALIDATOR_TYPE_LENGTH;
 	} else {
 		printf("bad type for validator %s\n", tname);
 		return (KORE_RESULT_ERROR);
 	}
 
+	/* Only the uuid type goes without a value. */
+	if (value == NULL) {
+		if (type != KORE_VALIDATOR_TYPE_UUID) {
+			printf("missing validator value\n");
+			return (KORE_RESULT_ERROR);
+		}
+		value = "";
+	}
+
 	if (!kore_validator_add(name, type, value)) {
 		printf("bad validator specified: %s\n", tname);
 		return (KORE_RESULT_ERROR);
@@ -1535,13 +2221,15 @@ configure_validate(char *options)
 		return (KORE_RESULT_ERROR);
 	}
 
-	p = kore_malloc(sizeof(*p));
+	p = kore_calloc(1, sizeof(*p));
 	p->validator = val;
 	p->flags = current_flags;
 	p->method = current_method;
 	p->name = kore_strdup(argv[0]);
 
 	TAILQ_INSERT_TAIL(&(current_handler->params), p, list);
+	current_handler->dom->routes_dirty = 1;
+
 	return (KORE_RESULT_OK);
 }
 
@@ -1632,28 +2320,56 @@ configure_authentication_validator(char *validator)
 }
 
 static int
-configure_authentication_uri(char *uri)
+configure_authentication_cache(char *options)
 {
+	int		err;
+	char		*argv[3];
+
 	if (current_auth == NULL) {
-		printf("authentication_uri outside authentication context\n");
+		printf("authentication_cache outside authentication\n");
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (current_auth->redirect != NULL)
-		kore_free(current_auth->redirect);
-	current_auth->redirect = kore_strdup(uri);
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL || argv[1] == NULL) {
+		printf("authentication_cache needs entries and seconds\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_auth->cache_size = kore_strtonum(argv[0], 10, 1,
+	    1 << 24, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad authentication_cache entries: %s\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_auth->cache_ttl = kore_strtonum(argv[1], 10, 1,
+	    86400, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad authentication_cache seconds: %s\n", argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_auth->cache_ttl *= 1000;
 
 	return (KORE_RESULT_OK);
 }
 
 static int
-configure_websocket_maxframe(char *option)
+configure_authentication_cache_shared(char *yesno)
 {
-	int	err;
+	if (current_auth == NULL) {
+		printf("authentication_cache_shared outside authentication\n");
+		return (KORE_RESULT_ERROR);
+	}
 
-	kore_websocket_maxframe = kore_strtonum64(option, 1, &err);
-	if (err != KORE_RESULT_OK) {
-		printf("bad kore_websocket_maxframe value: %s\n", option);
+	if (!strcmp(yesno, "no")) {
+		current_auth->cache_shared = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		current_auth->cache_shared = 1;
+	} else {
+		printf("invalid '%s' for yes|no authentication_cache_shared\n",
+		    yesno);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1661,29 +2377,210 @@ configure_websocket_maxframe(char *option)
 }
 
 static int
-configure_websocket_timeout(char *option)
+configure_upstream(char *options)
 {
-	int	err;
+	char		*argv[3];
 
-	kore_websocket_timeout = kore_strtonum64(option, 1, &err);
-	if (err != KORE_RESULT_OK) {
-		printf("bad kore_websocket_timeout value: %s\n", option);
+	if (current_upstream != NULL) {
+		printf("previous upstream block not closed\n");
 		return (KORE_RESULT_ERROR);
 	}
 
-	kore_websocket_timeout = kore_websocket_timeout * 1000;
-
-	return (KORE_RESULT_OK);
-}
+	kore_split_string(options, " ", argv, 3);
+	if (argv[1] == NULL) {
+		printf("missing name for upstream block\n");
+		return (KORE_RESULT_ERROR);
+	}
 
-#endif /* !KORE_NO_HTTP */
+	if (strcmp(argv[1], "{")) {
+		printf("missing { for upstream block\n");
+		return (KORE_RESULT_ERROR);
+	}
 
-static int
-configure_root(char *path)
-{
-	if (kore_root_path != NULL)
-		kore_free(kore_root_path);
-	kore_root_path = kore_strdup(path);
+	if ((current_upstream = kore_proxy_upstream_create(argv[0])) == NULL) {
+		printf("upstream '%s' already exists\n", argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_server(char *options)
+{
+	char		*argv[3];
+
+	if (current_upstream == NULL) {
+		printf("upstream_server outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_split_string(options, " ", argv, 3);
+	if (argv[0] == NULL || argv[1] == NULL) {
+		printf("upstream_server needs an ip and a port\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (kore_proxy_upstream_server(current_upstream, argv[0], argv[1]));
+}
+
+static int
+configure_upstream_balance(char *option)
+{
+	if (current_upstream == NULL) {
+		printf("upstream_balance outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!strcmp(option, "roundrobin")) {
+		current_upstream->balance = KORE_PROXY_BALANCE_ROUNDROBIN;
+	} else if (!strcmp(option, "leastconn")) {
+		current_upstream->balance = KORE_PROXY_BALANCE_LEASTCONN;
+	} else {
+		printf("unknown upstream_balance '%s'\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_keepalive(char *option)
+{
+	int		err;
+
+	if (current_upstream == NULL) {
+		printf("upstream_keepalive outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->keepalive = kore_strtonum(option, 10, 0, 1024, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad upstream_keepalive value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_timeout(char *option)
+{
+	int		err;
+
+	if (current_upstream == NULL) {
+		printf("upstream_timeout outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->timeout = kore_strtonum(option, 10, 1, 3600, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad upstream_timeout value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->timeout *= 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_connect_timeout(char *option)
+{
+	int		err;
+
+	if (current_upstream == NULL) {
+		printf("upstream_connect_timeout outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->connect_timeout =
+	    kore_strtonum(option, 10, 1, 3600, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad upstream_connect_timeout value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->connect_timeout *= 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_upstream_health_check(char *option)
+{
+	int		err;
+
+	if (current_upstream == NULL) {
+		printf("upstream_health_check outside upstream context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->health_check =
+	    kore_strtonum(option, 10, 0, 3600, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad upstream_health_check value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	current_upstream->health_check *= 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_authentication_uri(char *uri)
+{
+	if (current_auth == NULL) {
+		printf("authentication_uri outside authentication context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (current_auth->redirect != NULL)
+		kore_free(current_auth->redirect);
+	current_auth->redirect = kore_strdup(uri);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_websocket_maxframe(char *option)
+{
+	int	err;
+
+	kore_websocket_maxframe = kore_strtonum64(option, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad kore_websocket_maxframe value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_websocket_timeout(char *option)
+{
+	int	err;
+
+	kore_websocket_timeout = kore_strtonum64(option, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad kore_websocket_timeout value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_websocket_timeout = kore_websocket_timeout * 1000;
+
+	return (KORE_RESULT_OK);
+}
+
+#endif /* !KORE_NO_HTTP */
+
+static int
+configure_root(char *path)
+{
+	if (kore_root_path != NULL)
+		kore_free(kore_root_path);
+	kore_root_path = kore_strdup(path);
 
 	return (KORE_RESULT_OK);
 }
@@ -1699,13 +2596,266 @@ configure_runas(char *user)
 }
 
 static int
-configure_workers(char *option)
+configure_workers(char *option)
+{
+	int		err;
+
+	worker_count = kore_strtonum(option, 10, 1, KORE_WORKER_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("%s is not a valid worker number\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_pidfile(char *path)
+{
+	if (strcmp(kore_pidfile, KORE_PIDFILE_DEFAULT))
+		kore_free(kore_pidfile);
+	kore_pidfile = kore_strdup(path);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_max_connections(char *option)
+{
+	int		err;
+
+	worker_max_connections = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_max_connections: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_rlimit_nofiles(char *option)
+{
+	int		err;
+
+	worker_rlimit_nofiles = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_rlimit_nofiles: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_drain_timeout(char *option)
+{
+	int		err;
+
+	worker_drain_timeout = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_drain_timeout: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_stall_ms(char *option)
+{
+	int		err;
+
+	worker_stall_ms = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_stall_ms: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_warmup_timeout(char *option)
+{
+	int		err;
+
+	worker_warmup_timeout = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_warmup_timeout: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_accept_slack(char *option)
+{
+	int		err;
+
+	worker_accept_slack = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_accept_slack: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_accept_threshold(char *option)
+{
+	int		err;
+
+	worker_accept_threshold = kore_strtonum(option, 0, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_accept_threshold: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_pool_idle_release(char *option)
+{
+	int		err;
+
+	kore_pool_idle = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for pool_idle_release: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_memory_hugepages(char *option)
+{
+	if (!strcmp(option, "yes")) {
+		kore_pool_hugepages = 1;
+	} else if (!strcmp(option, "no")) {
+		kore_pool_hugepages = 0;
+	} else {
+		printf("bad memory_hugepages value: %s (expected yes|no)\n",
+		    option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_death_policy(char *option)
+{
+	if (!strcmp(option, "restart")) {
+		worker_policy = KORE_WORKER_POLICY_RESTART;
+	} else if (!strcmp(option, "terminate")) {
+		worker_policy = KORE_WORKER_POLICY_TERMINATE;
+	} else {
+		printf("bad value for worker_death_policy: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_log_overflow(char *option)
+{
+	if (!strcmp(option, "drop")) {
+		kore_log_overflow = KORE_LOG_OVERFLOW_DROP;
+	} else if (!strcmp(option, "sync")) {
+		kore_log_overflow = KORE_LOG_OVERFLOW_SYNC;
+	} else {
+		printf("bad value for log_overflow: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_log_rate_limit(char *option)
+{
+	int		err;
+
+	kore_log_rate_limit = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for log_rate_limit: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_set_affinity(char *option)
+{
+	int		err;
+
+	worker_set_affinity = kore_strtonum(option, 10, 0, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for worker_set_affinity: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_socket_backlog(char *option)
+{
+	int		err;
+
+	kore_socket_backlog = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad socket_backlog value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_socket_reuseport(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_socket_reuseport = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_socket_reuseport = 1;
+	} else {
+		printf("invalid '%s' for yes|no socket_reuseport\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_kv_entries(char *option)
+{
+	int		err;
+
+	kore_kv_entries = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for kv_entries: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_kv_value_max(char *option)
 {
 	int		err;
 
-	worker_count = kore_strtonum(option, 10, 1, KORE_WORKER_MAX, &err);
+	kore_kv_value_max = kore_strtonum(option, 10, 1, USHRT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("%s is not a valid worker number\n", option);
+		printf("bad value for kv_value_max: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1713,37 +2863,183 @@ configure_workers(char *option)
 }
 
 static int
-configure_pidfile(char *path)
+configure_graceful_upgrade(char *yesno)
 {
-	if (strcmp(kore_pidfile, KORE_PIDFILE_DEFAULT))
-		kore_free(kore_pidfile);
-	kore_pidfile = kore_strdup(path);
+	if (!strcmp(yesno, "no")) {
+		kore_graceful_upgrade = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_graceful_upgrade = 1;
+	} else {
+		printf("invalid '%s' for yes|no graceful_upgrade\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
 
 	return (KORE_RESULT_OK);
 }
 
+#if defined(KORE_USE_IOURING)
 static int
-configure_max_connections(char *option)
+configure_io_uring(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_io_uring = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_io_uring = 1;
+	} else {
+		printf("invalid '%s' for yes|no io_uring\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
+#if defined(KORE_USE_HTTP2)
+static int
+configure_http2_enable(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		http2_enable = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		http2_enable = 1;
+	} else {
+		printf("invalid '%s' for yes|no http2_enable\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http2_max_streams(char *option)
 {
 	int		err;
 
-	worker_max_connections = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	http2_max_streams = kore_strtonum(option, 10, 1, UINT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad value for worker_max_connections: %s\n", option);
+		printf("bad http2_max_streams value: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
 }
+#endif
 
+#if defined(KORE_USE_ZLIB)
 static int
-configure_rlimit_nofiles(char *option)
+configure_compress(char *route)
+{
+	int				len;
+	struct kore_module_handle	*hdlr;
+	char				regex[1024];
+
+	if (current_domain == NULL) {
+		printf("compress not used in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Filemaps are registered under their regex, allow either. */
+	len = snprintf(regex, sizeof(regex), "^%s.*$", route);
+	if (len == -1 || (size_t)len >= sizeof(regex)) {
+		printf("compress route '%s' too long\n", route);
+		return (KORE_RESULT_ERROR);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, route))
+			break;
+	}
+
+	if (hdlr == NULL) {
+		TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+			if (!strcmp(hdlr->path, regex))
+				break;
+		}
+	}
+
+	if (hdlr == NULL) {
+		printf("bad compress option handler '%s' not found\n", route);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdlr->compress = 1;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * websocket_deflate <route> [takeover [window bits] | no_takeover]
+ *
+ * With takeover every connection keeps its own zlib state, the window
+ * bits bound how large that gets. With no_takeover the connections on
+ * the route share the per worker zlib state instead.
+ */
+static int
+configure_websocket_deflate(char *options)
+{
+	int				err, argc;
+	struct kore_module_handle	*hdlr;
+	char				*argv[4];
+
+	if (current_domain == NULL) {
+		printf("websocket_deflate not used in domain context\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	argc = kore_split_string(options, " ", argv, 4);
+	if (argc < 1) {
+		printf("websocket_deflate requires a route\n");
+		return (KORE_RESULT_ERROR);
+	}
+
+	TAILQ_FOREACH(hdlr, &(current_domain->handlers), list) {
+		if (!strcmp(hdlr->path, argv[0]))
+			break;
+	}
+
+	if (hdlr == NULL) {
+		printf("bad websocket_deflate option handler '%s' not found\n",
+		    argv[0]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdlr->ws_deflate = WEBSOCKET_DEFLATE_TAKEOVER;
+	hdlr->ws_deflate_bits = 15;
+
+	if (argc == 1)
+		return (KORE_RESULT_OK);
+
+	if (!strcmp(argv[1], "no_takeover") && argc == 2) {
+		hdlr->ws_deflate = WEBSOCKET_DEFLATE_NO_TAKEOVER;
+		return (KORE_RESULT_OK);
+	}
+
+	if (strcmp(argv[1], "takeover")) {
+		printf("bad websocket_deflate mode for %s: %s\n",
+		    argv[0], argv[1]);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (argc == 3) {
+		hdlr->ws_deflate_bits = kore_strtonum(argv[2], 10, 9, 15, &err);
+		if (err != KORE_RESULT_OK) {
+			printf("bad websocket_deflate window bits for %s: %s\n",
+			    argv[0], argv[2]);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_http_compress_level(char *option)
 {
 	int		err;
 
-	worker_rlimit_nofiles = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	http_compress_level = kore_strtonum(option, 10, 1, 9, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad value for worker_rlimit_nofiles: %s\n", option);
+		printf("bad http_compress_level value: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1751,28 +3047,29 @@ configure_rlimit_nofiles(char *option)
 }
 
 static int
-configure_accept_threshold(char *option)
+configure_http_compress_min(char *option)
 {
 	int		err;
 
-	worker_accept_threshold = kore_strtonum(option, 0, 1, UINT_MAX, &err);
+	http_compress_min = kore_strtonum(option, 10, 0, LONG_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad value for worker_accept_threshold: %s\n", option);
+		printf("bad http_compress_min value: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
 }
+#endif
 
+#if defined(KORE_USE_PGSQL)
 static int
-configure_death_policy(char *option)
+configure_pgsql_conn_min(char *option)
 {
-	if (!strcmp(option, "restart")) {
-		worker_policy = KORE_WORKER_POLICY_RESTART;
-	} else if (!strcmp(option, "terminate")) {
-		worker_policy = KORE_WORKER_POLICY_TERMINATE;
-	} else {
-		printf("bad value for worker_death_policy: %s\n", option);
+	int		err;
+
+	pgsql_conn_min = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for pgsql_conn_min: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1780,13 +3077,13 @@ configure_death_policy(char *option)
 }
 
 static int
-configure_set_affinity(char *option)
+configure_pgsql_conn_check(char *option)
 {
 	int		err;
 
-	worker_set_affinity = kore_strtonum(option, 10, 0, 1, &err);
+	pgsql_conn_check = kore_strtonum(option, 10, 0, UINT_MAX / 1000, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad value for worker_set_affinity: %s\n", option);
+		printf("bad value for pgsql_conn_check: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
@@ -1794,20 +3091,19 @@ configure_set_affinity(char *option)
 }
 
 static int
-configure_socket_backlog(char *option)
+configure_pgsql_conn_lifetime(char *option)
 {
 	int		err;
 
-	kore_socket_backlog = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	pgsql_conn_lifetime = kore_strtonum(option, 10, 0, UINT_MAX, &err);
 	if (err != KORE_RESULT_OK) {
-		printf("bad socket_backlog value: %s\n", option);
+		printf("bad value for pgsql_conn_lifetime: %s\n", option);
 		return (KORE_RESULT_ERROR);
 	}
 
 	return (KORE_RESULT_OK);
 }
 
-#if defined(KORE_USE_PGSQL)
 static int
 configure_pgsql_conn_max(char *option)
 {
@@ -1835,6 +3131,48 @@ configure_pgsql_queue_limit(char *option)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_pgsql_queue_timeout(char *option)
+{
+	int		err;
+
+	pgsql_queue_timeout = kore_strtonum64(option, 0, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for pgsql_queue_timeout: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_pgsql_statement_max(char *option)
+{
+	int		err;
+
+	pgsql_statement_max = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for pgsql_statement_max: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_pgsql_replica_lag(char *option)
+{
+	int		err;
+
+	pgsql_replica_lag = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for pgsql_replica_lag: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(KORE_USE_TASKS)
@@ -1851,6 +3189,35 @@ configure_task_threads(char *option)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_task_spill_max(char *option)
+{
+	int		err;
+
+	kore_task_spill_max = kore_strtonum(option, 10,
+	    KORE_TASK_CHANNEL_SIZE, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for task_spill_max: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_keymgr_threads(char *option)
+{
+	int		err;
+
+	keymgr_threads = kore_strtonum(option, 10, 0, UCHAR_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad value for keymgr_threads: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(KORE_USE_PYTHON)
@@ -1897,6 +3264,49 @@ configure_python_import(char *module)
 	kore_module_load(argv[0], argv[1], KORE_MODULE_PYTHON);
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_python_coro_ms(char *option)
+{
+	int		err;
+
+	kore_python_coro_ms = kore_strtonum(option, 10, 1, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad python_coro_ms value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_python_coro_limit(char *option)
+{
+	int		err;
+
+	kore_python_coro_limit = kore_strtonum(option, 10, 0, UINT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad python_coro_limit value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_python_gc_freeze(char *yesno)
+{
+	if (!strcmp(yesno, "no")) {
+		kore_python_gc_freeze = 0;
+	} else if (!strcmp(yesno, "yes")) {
+		kore_python_gc_freeze = 1;
+	} else {
+		printf("invalid '%s' for yes|no python_gc_freeze\n", yesno);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(KORE_USE_PLATFORM_PLEDGE)
@@ -1937,6 +3347,34 @@ configure_curl_timeout(char *option)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_curl_handle_pool(char *option)
+{
+	int		err;
+
+	kore_curl_handle_pool = kore_strtonum(option, 10, 0, USHRT_MAX, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad curl_handle_pool value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+configure_curl_stream_hwm(char *option)
+{
+	int		err;
+
+	kore_curl_stream_hwm = kore_strtonum64(option, 1, &err);
+	if (err != KORE_RESULT_OK) {
+		printf("bad curl_stream_hwm value: %s\n", option);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
 
 #if defined(__linux__)
@@ -1955,4 +3393,19 @@ configure_seccomp_tracing(char *opt)
 
 	return (KORE_RESULT_OK);
 }
+
+static int
+configure_msg_shm(char *opt)
+{
+	if (!strcmp(opt, "yes")) {
+		kore_msg_shm = 1;
+	} else if (!strcmp(opt, "no")) {
+		kore_msg_shm = 0;
+	} else {
+		printf("bad msg_shm value: %s (expected yes|no)\n", opt);
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
 #endif
@@ -25,10 +25,38 @@
 #include "kore.h"
 #include "http.h"
 
+#if defined(KORE_USE_HTTP2)
+#include "http2.h"
+#endif
+
+/*
+ * Idle, header and body timeouts are tracked in a hashed wheel of
+ * CONN_EXPIRE_BUCKETS buckets, each covering CONN_EXPIRE_RES ms.
+ * A connection sits in the bucket for the first tick at or after its
+ * deadline so only connections whose bucket comes due are looked at.
+ * Deadlines further out than one revolution share a bucket with nearer
+ * ones and are skipped until their turn comes around.
+ */
+#define CONN_EXPIRE_RES		64
+#define CONN_EXPIRE_BUCKETS	1024
+#define CONN_EXPIRE_DUE		CONN_EXPIRE_BUCKETS
+#define CONN_EXPIRE_RECHECK	500
+
+static void	connection_expire(struct connection *, u_int64_t);
+static void	connection_timeout_place(struct connection *, u_int64_t);
+static void	connection_timeout_unlink(struct connection *);
+static u_int64_t	connection_timeout_deadline(struct connection *);
+
 struct kore_pool		connection_pool;
 struct connection_list		connections;
 struct connection_list		disconnected;
 
+static u_int64_t		expire_tick;
+static u_int32_t		expire_count;
+static u_int64_t		expire_map[CONN_EXPIRE_BUCKETS / 64];
+static struct connection_list	expire_due;
+static struct connection_list	expire_wheel[CONN_EXPIRE_BUCKETS];
+
 void
 kore_connection_init(void)
 {
@@ -37,11 +65,19 @@ kore_connection_init(void)
 	TAILQ_INIT(&connections);
 	TAILQ_INIT(&disconnected);
 
+	TAILQ_INIT(&expire_due);
+	for (elm = 0; elm < CONN_EXPIRE_BUCKETS; elm++)
+		TAILQ_INIT(&expire_wheel[elm]);
+
+	expire_count = 0;
+	memset(expire_map, 0, sizeof(expire_map));
+	expire_tick = kore_time_ms() / CONN_EXPIRE_RES;
+
 	/* Add some overhead so we don't rollover for internal items. */
 	elm = worker_max_connections + 10;
 
-	kore_pool_init(&connection_pool, "connection_pool",
-	    sizeof(struct connection), elm);
+	kore_pool_init_aligned(&connection_pool, "connection_pool",
+	    sizeof(struct connection), elm, CONNECTION_ALIGN);
 }
 
 void
@@ -70,11 +106,15 @@ kore_connection_new(void *owner)
 	c->handle = NULL;
 	c->tls_reneg = 0;
 	c->tls_sni = NULL;
+	c->tls_wlen = 0;
+	c->tls_wsent = 0;
+	c->tls_wlast = 0;
 	c->disconnect = NULL;
 	c->hdlr_extra = NULL;
 	c->proto = CONN_PROTO_UNKNOWN;
 	c->idle_timer.start = 0;
 	c->idle_timer.length = KORE_IDLE_TIMER_MAX;
+	c->expire.deadline = 0;
 
 	c->evt.type = KORE_TYPE_CONNECTION;
 	c->evt.handle = kore_connection_event;
@@ -85,6 +125,11 @@ kore_connection_new(void *owner)
 	c->ws_disconnect = NULL;
 	c->http_start = kore_time_ms();
 	c->http_timeout = http_header_timeout * 1000;
+	c->http_accept = 0;
+	c->http_first = 0;
+	c->http_scan = 0;
+	c->http_pipelined = NULL;
+	c->http_pipelined_len = 0;
 	TAILQ_INIT(&(c->http_requests));
 #endif
 
@@ -124,12 +169,29 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 		fatal("unknown family type %d", c->family);
 	}
 
-	if ((c->fd = accept(listener->fd, s, &len)) == -1) {
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	/* Saves the fcntl() round trips for every new connection. */
+	c->fd = accept4(listener->fd, s, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	c->fd = accept(listener->fd, s, &len);
+#endif
+
+	if (c->fd == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			worker->accept.errors++;
 		kore_pool_put(&connection_pool, c);
 		kore_debug("accept(): %s", errno_s);
 		return (KORE_RESULT_ERROR);
 	}
 
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+	if (listener->family != AF_UNIX) {
+		if (!kore_sockopt(c->fd, IPPROTO_TCP, TCP_NODELAY)) {
+			kore_log(LOG_NOTICE,
+			    "failed to set TCP_NODELAY on %d", c->fd);
+		}
+	}
+#else
 	if (!kore_connection_nonblock(c->fd, listener->family != AF_UNIX)) {
 		close(c->fd);
 		kore_pool_put(&connection_pool, c);
@@ -141,6 +203,7 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 		kore_pool_put(&connection_pool, c);
 		return (KORE_RESULT_ERROR);
 	}
+#endif
 
 	c->handle = kore_connection_handle;
 	TAILQ_INSERT_TAIL(&connections, c, list);
@@ -172,6 +235,11 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 	kore_connection_start_idletimer(c);
 	worker_active_connections++;
 
+	KORE_PROBE2(conn_accept, c, c->fd);
+#if !defined(KORE_NO_HTTP)
+	c->http_accept = kore_time_us();
+#endif
+
 	*out = c;
 	return (KORE_RESULT_OK);
 }
@@ -179,26 +247,96 @@ kore_connection_accept(struct listener *listener, struct connection **out)
 void
 kore_connection_check_timeout(u_int64_t now)
 {
-	struct connection	*c, *next;
+	struct connection_list	*bucket;
+	struct connection	*c;
+	u_int32_t		slot;
+	u_int64_t		deadline;
 
-	for (c = TAILQ_FIRST(&connections); c != NULL; c = next) {
-		next = TAILQ_NEXT(c, list);
-		if (c->proto == CONN_PROTO_MSG)
-			continue;
-#if !defined(KORE_NO_HTTP)
-		if (c->state == CONN_STATE_ESTABLISHED &&
-		    c->proto == CONN_PROTO_HTTP) {
-			if (!http_check_timeout(c, now))
+	while (expire_tick * CONN_EXPIRE_RES <= now) {
+		if (expire_count == 0) {
+			expire_tick = (now / CONN_EXPIRE_RES) + 1;
+			break;
+		}
+
+		slot = expire_tick % CONN_EXPIRE_BUCKETS;
+		bucket = &expire_wheel[slot];
+		expire_map[slot / 64] &= ~((u_int64_t)1 << (slot % 64));
+		expire_tick++;
+
+		/*
+		 * Move the bucket aside first, the expiry callbacks may
+		 * disconnect or reschedule any other connection.
+		 */
+		while ((c = TAILQ_FIRST(bucket)) != NULL) {
+			TAILQ_REMOVE(bucket, c, expire.list);
+			TAILQ_INSERT_TAIL(&expire_due, c, expire.list);
+			c->expire.slot = CONN_EXPIRE_DUE;
+		}
+
+		while ((c = TAILQ_FIRST(&expire_due)) != NULL) {
+			deadline = c->expire.deadline;
+			connection_timeout_unlink(c);
+
+			if (deadline > now) {
+				connection_timeout_place(c, deadline);
 				continue;
-			if (!TAILQ_EMPTY(&c->http_requests))
+			}
+
+			connection_expire(c, now);
+			if (c->state == CONN_STATE_DISCONNECTING)
 				continue;
+
+			/* Expired but busy, look at it again later. */
+			deadline = connection_timeout_deadline(c);
+			if (deadline != 0 && deadline <= now)
+				deadline = now + CONN_EXPIRE_RECHECK;
+
+			connection_timeout_place(c, deadline);
 		}
-#endif
-		if (c->flags & CONN_IDLE_TIMER_ACT)
-			kore_connection_check_idletimer(now, c);
 	}
 }
 
+u_int64_t
+kore_connection_timeout_next(u_int64_t now)
+{
+	u_int64_t	bits, tick;
+	u_int32_t	i, slot, word;
+
+	if (expire_count == 0)
+		return (KORE_WAIT_INFINITE);
+
+	slot = expire_tick % CONN_EXPIRE_BUCKETS;
+
+	/* Find the first occupied bucket from the current tick onwards. */
+	for (i = 0; i <= CONN_EXPIRE_BUCKETS / 64; i++) {
+		word = ((slot / 64) + i) % (CONN_EXPIRE_BUCKETS / 64);
+		bits = expire_map[word];
+		if (i == 0)
+			bits &= ~(u_int64_t)0 << (slot % 64);
+		if (bits != 0)
+			break;
+	}
+
+	if (bits == 0)
+		return (CONN_EXPIRE_RES);
+
+	word = (word * 64) + __builtin_ctzll(bits);
+	tick = expire_tick +
+	    ((word + CONN_EXPIRE_BUCKETS - slot) % CONN_EXPIRE_BUCKETS);
+
+	if (tick * CONN_EXPIRE_RES > now)
+		return ((tick * CONN_EXPIRE_RES) - now);
+
+	return (0);
+}
+
+void
+kore_connection_timeout_update(struct connection *c)
+{
+	connection_timeout_unlink(c);
+	connection_timeout_place(c, connection_timeout_deadline(c));
+}
+
 void
 kore_connection_prune(int all)
 {
@@ -225,6 +363,8 @@ kore_connection_disconnect(struct connection *c)
 	if (c->state != CONN_STATE_DISCONNECTING) {
 		kore_debug("preparing %p for disconnection", c);
 		c->state = CONN_STATE_DISCONNECTING;
+		connection_timeout_unlink(c);
+
 		if (c->disconnect)
 			c->disconnect(c);
 
@@ -252,13 +392,17 @@ kore_connection_handle(struct connection *c)
 {
 	int			r;
 	struct listener		*listener;
+#if defined(KORE_USE_HTTP2)
+	const unsigned char	*alpn;
+	unsigned int		alpnlen;
+#endif
 
 	kore_debug("kore_connection_handle(%p) -> %d", c, c->state);
 	kore_connection_stop_idletimer(c);
 
 	switch (c->state) {
 	case CONN_STATE_TLS_SHAKE:
-		if (primary_dom->ssl_ctx == NULL) {
+		if (!kore_domain_tls_ready(primary_dom)) {
 			kore_log(LOG_NOTICE,
 			    "TLS configuration for %s not yet complete",
 			    primary_dom->domain);
@@ -275,6 +419,16 @@ kore_connection_handle(struct connection *c)
 			SSL_set_fd(c->ssl, c->fd);
 			SSL_set_accept_state(c->ssl);
 
+#if defined(SSL_MODE_ASYNC)
+			/* Let the keymgr round trip park the handshake. */
+			SSL_set_mode(c->ssl, SSL_MODE_ASYNC);
+#endif
+
+#if defined(KORE_USE_PLATFORM_KTLS)
+			if (tls_ktls)
+				SSL_set_options(c->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+
 			if (!SSL_set_ex_data(c->ssl, 0, c)) {
 				kore_debug("SSL_set_ex_data(): %s",
 				    ssl_errno_s);
@@ -286,12 +440,18 @@ kore_connection_handle(struct connection *c)
 		}
 
 		ERR_clear_error();
+		tls_handshake_conn = c;
 		r = SSL_accept(c->ssl);
+		tls_handshake_conn = NULL;
+
 		if (r <= 0) {
 			r = SSL_get_error(c->ssl, r);
 			switch (r) {
 			case SSL_ERROR_WANT_READ:
 			case SSL_ERROR_WANT_WRITE:
+#if defined(SSL_MODE_ASYNC)
+			case SSL_ERROR_WANT_ASYNC:
+#endif
 				kore_connection_start_idletimer(c);
 				return (KORE_RESULT_OK);
 			default:
@@ -304,6 +464,12 @@ kore_connection_handle(struct connection *c)
 			}
 		}
 
+#if defined(SSL_MODE_ASYNC)
+		/* Only the handshake needs it, spare reads and writes. */
+		SSL_clear_mode(c->ssl, SSL_MODE_ASYNC);
+#endif
+		kore_domain_tls_handshake(c->ssl);
+
 #if defined(KORE_USE_ACME)
 		if (c->flags & CONN_ACME_CHALLENGE) {
 			kore_log(LOG_INFO, "disconnecting acme client");
@@ -312,6 +478,15 @@ kore_connection_handle(struct connection *c)
 		}
 #endif
 
+#if defined(KORE_USE_PLATFORM_KTLS)
+		/* The kernel may refuse the keys, we fall back to SSL_write. */
+		if (tls_ktls && BIO_get_ktls_send(SSL_get_wbio(c->ssl)))
+			c->flags |= CONN_TLS_KTLS_SEND;
+
+		kore_debug("kore_connection_handle(%p): ktls %s", c,
+		    (c->flags & CONN_TLS_KTLS_SEND) ? "active" : "inactive");
+#endif
+
 		if (SSL_get_verify_mode(c->ssl) & SSL_VERIFY_PEER) {
 			c->cert = SSL_get_peer_certificate(c->ssl);
 			if (c->cert == NULL) {
@@ -338,11 +513,25 @@ kore_connection_handle(struct connection *c)
 			    http_keepalive_time * 1000;
 		}
 
+#if defined(KORE_USE_HTTP2)
+		SSL_get0_alpn_selected(c->ssl, &alpn, &alpnlen);
+		if (alpnlen == 2 && !memcmp(alpn, "h2", 2)) {
+			if (!http2_connection_start(c))
+				return (KORE_RESULT_ERROR);
+		} else {
+			net_recv_queue(c, http_header_max,
+			    NETBUF_CALL_CB_ALWAYS, http_header_recv);
+		}
+#else
 		net_recv_queue(c, http_header_max,
 		    NETBUF_CALL_CB_ALWAYS, http_header_recv);
+#endif
 #endif
 
 		c->state = CONN_STATE_ESTABLISHED;
+
+		/* Move from the handshake deadline to the header one. */
+		kore_connection_timeout_update(c);
 		/* FALLTHROUGH */
 	case CONN_STATE_ESTABLISHED:
 		if (c->evt.flags & KORE_EVENT_READ) {
@@ -376,8 +565,16 @@ kore_connection_remove(struct connection *c)
 #endif
 
 	kore_debug("kore_connection_remove(%p)", c);
+	KORE_PROBE1(conn_remove, c);
 
 	if (c->ssl != NULL) {
+#if defined(SSL_MODE_ASYNC)
+		/* Let a handshake parked on the keymgr fail and finish. */
+		if (SSL_waiting_for_async(c->ssl)) {
+			kore_domain_keymgr_cancel(c);
+			(void)SSL_accept(c->ssl);
+		}
+#endif
 		SSL_shutdown(c->ssl);
 		SSL_free(c->ssl);
 	}
@@ -388,6 +585,14 @@ kore_connection_remove(struct connection *c)
 	if (c->tls_sni != NULL)
 		kore_free(c->tls_sni);
 
+	connection_timeout_unlink(c);
+
+#if defined(KORE_USE_IOURING)
+	/* Pending poll requests keep the socket open otherwise. */
+	if (kore_uring_active)
+		kore_uring_remove(c->fd);
+#endif
+
 	close(c->fd);
 
 	if (c->hdlr_extra != NULL)
@@ -406,6 +611,11 @@ kore_connection_remove(struct connection *c)
 	kore_free(c->ws_connect);
 	kore_free(c->ws_message);
 	kore_free(c->ws_disconnect);
+	kore_free(c->http_pipelined);
+
+#if defined(KORE_USE_HTTP2)
+	http2_connection_free(c);
+#endif
 #endif
 
 	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL; nb = next) {
@@ -415,7 +625,7 @@ kore_connection_remove(struct connection *c)
 	}
 
 	if (c->rnb != NULL) {
-		kore_free(c->rnb->buf);
+		net_recvbuf_put(c->rnb->buf);
 		kore_pool_put(&nb_pool, c->rnb);
 	}
 
@@ -446,6 +656,8 @@ kore_connection_start_idletimer(struct connection *c)
 
 	c->flags |= CONN_IDLE_TIMER_ACT;
 	c->idle_timer.start = kore_time_ms();
+
+	kore_connection_timeout_update(c);
 }
 
 void
@@ -453,10 +665,99 @@ kore_connection_stop_idletimer(struct connection *c)
 {
 	kore_debug("kore_connection_stop_idletimer(%p)", c);
 
+	/*
+	 * The connection stays in the expiry wheel, it is dropped from
+	 * it lazily if its bucket comes due before the timer restarts.
+	 */
 	c->flags &= ~CONN_IDLE_TIMER_ACT;
 	c->idle_timer.start = 0;
 }
 
+static void
+connection_expire(struct connection *c, u_int64_t now)
+{
+#if !defined(KORE_NO_HTTP)
+	if (c->state == CONN_STATE_ESTABLISHED &&
+	    (c->proto == CONN_PROTO_HTTP || c->proto == CONN_PROTO_HTTP2)) {
+		if (!http_check_timeout(c, now))
+			return;
+		if (!TAILQ_EMPTY(&c->http_requests))
+			return;
+	}
+#endif
+	if (c->flags & CONN_IDLE_TIMER_ACT)
+		kore_connection_check_idletimer(now, c);
+}
+
+static u_int64_t
+connection_timeout_deadline(struct connection *c)
+{
+	u_int64_t	deadline;
+
+	if (c->proto == CONN_PROTO_MSG ||
+	    c->state == CONN_STATE_DISCONNECTING)
+		return (0);
+
+	deadline = 0;
+
+	if (c->flags & CONN_IDLE_TIMER_ACT)
+		deadline = c->idle_timer.start + c->idle_timer.length;
+
+#if !defined(KORE_NO_HTTP)
+	if (c->state == CONN_STATE_ESTABLISHED &&
+	    c->proto == CONN_PROTO_HTTP && c->http_timeout != 0) {
+		if (deadline == 0 ||
+		    c->http_start + c->http_timeout < deadline)
+			deadline = c->http_start + c->http_timeout;
+	}
+#endif
+
+	return (deadline);
+}
+
+static void
+connection_timeout_place(struct connection *c, u_int64_t deadline)
+{
+	u_int64_t	tick;
+
+	if (deadline == 0)
+		return;
+
+	tick = (deadline + CONN_EXPIRE_RES - 1) / CONN_EXPIRE_RES;
+	if (tick < expire_tick)
+		tick = expire_tick;
+
+	c->expire.deadline = deadline;
+	c->expire.slot = tick % CONN_EXPIRE_BUCKETS;
+
+	TAILQ_INSERT_TAIL(&expire_wheel[c->expire.slot], c, expire.list);
+	expire_map[c->expire.slot / 64] |=
+	    ((u_int64_t)1 << (c->expire.slot % 64));
+	expire_count++;
+}
+
+static void
+connection_timeout_unlink(struct connection *c)
+{
+	u_int16_t	slot;
+
+	if (c->expire.deadline == 0)
+		return;
+
+	slot = c->expire.slot;
+
+	if (slot == CONN_EXPIRE_DUE) {
+		TAILQ_REMOVE(&expire_due, c, expire.list);
+	} else {
+		TAILQ_REMOVE(&expire_wheel[slot], c, expire.list);
+		if (TAILQ_EMPTY(&expire_wheel[slot]))
+			expire_map[slot / 64] &= ~((u_int64_t)1 << (slot % 64));
+	}
+
+	c->expire.deadline = 0;
+	expire_count--;
+}
+
 int
 kore_connection_nonblock(int fd, int nodelay)
 {
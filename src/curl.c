@@ -54,6 +54,7 @@ static struct sock_filter filter_curl[] = {
 #endif
 
 #define FD_CACHE_BUCKETS	2048
+#define FLIGHT_BUCKETS		256
 
 struct fd_cache {
 	struct kore_event	evt;
@@ -68,6 +69,41 @@ struct curl_run {
 	TAILQ_ENTRY(curl_run)	list;
 };
 
+#define CURL_PROXY_SENDING	0x0001
+#define CURL_PROXY_PAUSED	0x0002
+#define CURL_PROXY_DONE		0x0004
+#define CURL_PROXY_READY	0x0008
+
+/*
+ * State for kore_curl_stream_proxy(). Received data is gathered in
+ * pending while inflight is being sent downstream, the two swap places
+ * once inflight went out. This lives apart from the kore_curl so that
+ * inflight survives a kore_curl_cleanup() while still in a send queue.
+ */
+struct curl_proxy {
+	int			flags;
+	struct kore_curl	*client;
+	struct kore_buf		pending;
+	struct kore_buf		inflight;
+	TAILQ_ENTRY(curl_proxy)	list;
+};
+
+/*
+ * A transfer shared by identical KORE_CURL_COALESCE clients. It runs as
+ * its own kore_curl bound to curl_flight_done(), which hands the result
+ * to all members. The response body is shared between them and lives
+ * until the last member let go of the flight.
+ */
+struct kore_curl_flight {
+	struct kore_curl		client;
+	char				*key;
+	u_int32_t			hash;
+	u_int32_t			refs;
+	int				done;
+	LIST_HEAD(, kore_curl)		members;
+	LIST_ENTRY(kore_curl_flight)	list;
+};
+
 static void	curl_process(void);
 static void	curl_event_handle(void *, int);
 static void	curl_timeout(void *, u_int64_t);
@@ -75,21 +111,52 @@ static int	curl_timer(CURLM *, long, void *);
 static void	curl_run_handle(struct curl_run *);
 static void	curl_run_schedule(struct fd_cache *, int);
 static int	curl_socket(CURL *, curl_socket_t, int, void *, void *);
+static CURL	*curl_handle_get(void);
+static void	curl_handle_put(struct kore_curl *, int);
+static size_t	curl_stream_write(char *, size_t, size_t, void *);
+
+static int	curl_proxy_sent(struct netbuf *);
+static int	curl_proxy_write(struct kore_curl *,
+		    const void *, size_t, void *);
+static void	curl_proxy_run(struct curl_proxy *);
+static void	curl_proxy_done(struct curl_proxy *);
+static void	curl_proxy_flush(struct curl_proxy *);
+static void	curl_proxy_start(struct curl_proxy *);
+static void	curl_proxy_finish(struct curl_proxy *);
+static void	curl_proxy_detach(struct curl_proxy *);
+static void	curl_proxy_free(struct curl_proxy *);
+
+static int	curl_flight_join(struct kore_curl *);
+static void	curl_flight_done(struct kore_curl *, void *);
+static void	curl_flight_release(struct kore_curl_flight *);
+static u_int32_t	curl_flight_hash(const char *, size_t);
 
 static struct fd_cache	*fd_cache_get(int);
 
 static TAILQ_HEAD(, curl_run)	runlist;
+static TAILQ_HEAD(, curl_proxy)	proxies;
 static struct kore_pool		run_pool;
 static int			running = 0;
 static CURLM			*multi = NULL;
+static CURLSH			*share = NULL;
+static CURL			**handles = NULL;
+static u_int32_t		handles_idle = 0;
 static struct kore_timer	*timer = NULL;
 static struct kore_pool		fd_cache_pool;
+static struct kore_pool		header_pool;
 static char			user_agent[64];
 static int			timeout_immediate = 0;
 static LIST_HEAD(, fd_cache)	cache[FD_CACHE_BUCKETS];
+static LIST_HEAD(, kore_curl_flight)	flights[FLIGHT_BUCKETS];
 
 u_int16_t	kore_curl_timeout = KORE_CURL_TIMEOUT;
 u_int64_t	kore_curl_recv_max = KORE_CURL_RECV_MAX;
+u_int32_t	kore_curl_handle_pool = KORE_CURL_HANDLE_POOL;
+u_int64_t	kore_curl_stream_hwm = KORE_CURL_STREAM_HWM;
+u_int64_t	kore_curl_transfers = 0;
+u_int64_t	kore_curl_reused = 0;
+u_int64_t	kore_curl_connects = 0;
+u_int64_t	kore_curl_coalesced = 0;
 
 void
 kore_curl_sysinit(void)
@@ -105,6 +172,19 @@ kore_curl_sysinit(void)
 
 	/* XXX - make configurable? */
 	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, 500);
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	/*
+	 * DNS, TLS sessions and connections are shared by all transfers
+	 * of a worker, sync ones included. Workers are single threaded
+	 * so no locking callbacks are needed.
+	 */
+	if ((share = curl_share_init()) == NULL)
+		fatal("curl_share_init(): failed");
+
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
 
 	if ((res = curl_multi_setopt(multi,
 	    CURLMOPT_SOCKETFUNCTION, curl_socket)) != CURLM_OK)
@@ -117,12 +197,20 @@ kore_curl_sysinit(void)
 	for (i = 0; i < FD_CACHE_BUCKETS; i++)
 		LIST_INIT(&cache[i]);
 
+	for (i = 0; i < FLIGHT_BUCKETS; i++)
+		LIST_INIT(&flights[i]);
+
 	TAILQ_INIT(&runlist);
+	TAILQ_INIT(&proxies);
 
 	kore_pool_init(&fd_cache_pool, "fd_cache_pool", 100,
 	    sizeof(struct fd_cache));
 	kore_pool_init(&run_pool, "run_pool", 100, sizeof(struct curl_run));
 
+	/* Response headers, requests keep theirs in the request arena. */
+	kore_pool_init(&header_pool, "curl_header_pool",
+	    sizeof(struct http_header), HTTP_REQ_HEADER_MAX);
+
 	len = snprintf(user_agent, sizeof(user_agent), "kore/%s", kore_version);
 	if (len == -1 || (size_t)len >= sizeof(user_agent))
 		fatal("user-agent string too long");
@@ -150,12 +238,16 @@ kore_curl_init(struct kore_curl *client, const char *url, int flags)
 
 	TAILQ_INIT(&client->http.resp_hdrs);
 
-	if ((handle = curl_easy_init()) == NULL) {
+	if ((handle = curl_handle_get()) == NULL) {
 		(void)kore_strlcpy(client->errbuf, "failed to setup curl",
 		    sizeof(client->errbuf));
 		return (KORE_RESULT_ERROR);
 	}
 
+	curl_easy_setopt(handle, CURLOPT_SHARE, share);
+	curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA, &client->response);
 	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, kore_curl_tobuf);
 
@@ -184,9 +276,20 @@ kore_curl_cleanup(struct kore_curl *client)
 	if (client->flags & KORE_CURL_FLAG_BOUND)
 		LIST_REMOVE(client, list);
 
+	if (client->flags & KORE_CURL_FLAG_PROXY)
+		curl_proxy_detach(client->stream.arg);
+
+	if (client->flight != NULL) {
+		if (client->flags & KORE_CURL_FLAG_COALESCED)
+			LIST_REMOVE(client, member);
+		curl_flight_release(client->flight);
+		client->flight = NULL;
+		client->response = NULL;
+	}
+
 	if (client->handle != NULL) {
 		curl_multi_remove_handle(multi, client->handle);
-		curl_easy_cleanup(client->handle);
+		curl_handle_put(client, 0);
 	}
 
 	if (client->http.hdrlist != NULL)
@@ -205,10 +308,16 @@ kore_curl_cleanup(struct kore_curl *client)
 	    hdr != NULL; hdr = next) {
 		next = TAILQ_NEXT(hdr, list);
 		TAILQ_REMOVE(&client->http.resp_hdrs, hdr, list);
-		kore_pool_put(&http_header_pool, hdr);
+		kore_pool_put(&header_pool, hdr);
 	}
 }
 
+int
+kore_curl_running(void)
+{
+	return (running);
+}
+
 void
 kore_curl_do_timeout(void)
 {
@@ -223,6 +332,7 @@ void
 kore_curl_run_scheduled(void)
 {
 	struct curl_run		*run;
+	struct curl_proxy	*proxy;
 
 	while ((run = TAILQ_FIRST(&runlist))) {
 		TAILQ_REMOVE(&runlist, run, list);
@@ -230,6 +340,9 @@ kore_curl_run_scheduled(void)
 		kore_pool_put(&run_pool, run);
 	}
 
+	while ((proxy = TAILQ_FIRST(&proxies)) != NULL)
+		curl_proxy_run(proxy);
+
 	curl_process();
 }
 
@@ -319,10 +432,71 @@ kore_curl_bind_callback(struct kore_curl *client,
 	client->arg = arg;
 }
 
+/*
+ * Hand the response body to cb as it arrives instead of collecting it
+ * in client->response, kore_curl_recv_max does not apply. The callback
+ * returns KORE_RESULT_OK once it took the data, KORE_RESULT_ERROR to
+ * fail the transfer or KORE_RESULT_RETRY to pause it. A paused transfer
+ * gets the same data again after kore_curl_stream_resume().
+ */
+void
+kore_curl_stream(struct kore_curl *client,
+    int (*cb)(struct kore_curl *, const void *, size_t, void *), void *arg)
+{
+	if (client->handle == NULL)
+		fatal("%s: called without setup", __func__);
+
+	client->stream.cb = cb;
+	client->stream.arg = arg;
+
+	curl_easy_setopt(client->handle, CURLOPT_WRITEDATA, client);
+	curl_easy_setopt(client->handle, CURLOPT_WRITEFUNCTION,
+	    curl_stream_write);
+}
+
+void
+kore_curl_stream_resume(struct kore_curl *client)
+{
+	if (client->handle != NULL)
+		curl_easy_pause(client->handle, CURLPAUSE_CONT);
+}
+
+/*
+ * Stream the response body of an async client straight into a chunked
+ * response on req, with the upstream status and content-type. The
+ * transfer is paused while more than kore_curl_stream_hwm bytes wait
+ * for a slow client. The request is woken once the body was handed
+ * over completely. If kore_curl_success() is false at that point and
+ * KORE_CURL_FLAG_PROXY_STARTED is not set the handler still has to
+ * respond, otherwise the broken response was already torn down.
+ */
+void
+kore_curl_stream_proxy(struct kore_curl *client, struct http_request *req)
+{
+	struct curl_proxy	*proxy;
+
+	if (!(client->flags & KORE_CURL_ASYNC))
+		fatal("%s: client is not async", __func__);
+
+	proxy = kore_calloc(1, sizeof(*proxy));
+	proxy->client = client;
+
+	kore_buf_init(&proxy->pending, 4096);
+	kore_buf_init(&proxy->inflight, 4096);
+
+	kore_curl_bind_request(client, req);
+	kore_curl_stream(client, curl_proxy_write, proxy);
+
+	client->flags |= KORE_CURL_FLAG_PROXY;
+}
+
 void
 kore_curl_run(struct kore_curl *client)
 {
 	if (client->flags & KORE_CURL_ASYNC) {
+		if ((client->flags & KORE_CURL_COALESCE) &&
+		    curl_flight_join(client))
+			return;
 		curl_multi_add_handle(multi, client->handle);
 		return;
 	}
@@ -332,8 +506,7 @@ kore_curl_run(struct kore_curl *client)
 	curl_easy_getinfo(client->handle,
 	    CURLINFO_RESPONSE_CODE, &client->http.status);
 
-	curl_easy_cleanup(client->handle);
-	client->handle = NULL;
+	curl_handle_put(client, 1);
 }
 
 int
@@ -378,7 +551,9 @@ kore_curl_response_as_bytes(struct kore_curl *client, const u_int8_t **body,
 char *
 kore_curl_response_as_string(struct kore_curl *client)
 {
-	kore_buf_stringify(client->response, NULL);
+	/* A shared response was terminated once for all of its members. */
+	if (client->flight == NULL)
+		kore_buf_stringify(client->response, NULL);
 
 	return ((char *)client->response->data);
 }
@@ -397,6 +572,7 @@ kore_curl_http_setup(struct kore_curl *client, int method, const void *data,
 	has_body = 1;
 
 	client->type = KORE_CURL_TYPE_HTTP_CLIENT;
+	client->http.method = method;
 
 	curl_easy_setopt(client->handle, CURLOPT_HEADERDATA,
 	    &client->http.headers);
@@ -527,7 +703,7 @@ kore_curl_http_parse_headers(struct kore_curl *client)
 		if (*value == '\0')
 			continue;
 
-		hdr = kore_pool_get(&http_header_pool);
+		hdr = kore_pool_get(&header_pool);
 		hdr->header = headers[i];
 		hdr->value = value;
 		TAILQ_INSERT_TAIL(&(client->http.resp_hdrs), hdr, list);
@@ -623,18 +799,20 @@ curl_process(void)
 
 		client->result = msg->data.result;
 
-		if (client->type == KORE_CURL_TYPE_HTTP_CLIENT) {
+		if (client->type == KORE_CURL_TYPE_HTTP_CLIENT ||
+		    (client->flags & KORE_CURL_FLAG_PROXY)) {
 			curl_easy_getinfo(client->handle,
 			    CURLINFO_RESPONSE_CODE, &client->http.status);
 		}
 
 		curl_multi_remove_handle(multi, client->handle);
-		curl_easy_cleanup(client->handle);
-
-		client->handle = NULL;
+		curl_handle_put(client, 1);
 
-		if (client->req != NULL)
-			http_request_wakeup(client->req);
+		if (client->flags & KORE_CURL_FLAG_PROXY)
+			curl_proxy_done(client->stream.arg);
+		else if (client->req != NULL)
+			http_request_wakeup_from(client->req,
+			    HTTP_WAKEUP_CURL);
 		else if (client->cb != NULL)
 			client->cb(client, client->arg);
 	}
@@ -723,6 +901,418 @@ curl_run_handle(struct curl_run *run)
 		fatal("curl_multi_socket_action: %s", curl_multi_strerror(res));
 }
 
+static CURL *
+curl_handle_get(void)
+{
+	if (handles_idle > 0)
+		return (handles[--handles_idle]);
+
+	return (curl_easy_init());
+}
+
+/*
+ * Keep client->handle around for the next kore_curl_init(). It is reset
+ * so it no longer points at anything of client, the connections and
+ * caches it used live on in the share. If the transfer ran, count
+ * whether it needed a new connection.
+ */
+static void
+curl_handle_put(struct kore_curl *client, int done)
+{
+	long		connects;
+
+	if (done && curl_easy_getinfo(client->handle,
+	    CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) {
+		kore_curl_transfers++;
+		if (connects > 0)
+			kore_curl_connects += connects;
+		else if (client->result == CURLE_OK)
+			kore_curl_reused++;
+	}
+
+	if (handles == NULL && kore_curl_handle_pool > 0)
+		handles = kore_calloc(kore_curl_handle_pool, sizeof(CURL *));
+
+	if (handles_idle < kore_curl_handle_pool) {
+		curl_easy_reset(client->handle);
+		handles[handles_idle++] = client->handle;
+	} else {
+		curl_easy_cleanup(client->handle);
+	}
+
+	client->handle = NULL;
+}
+
+static size_t
+curl_stream_write(char *ptr, size_t size, size_t nmemb, void *udata)
+{
+	size_t			len;
+	struct kore_curl	*client;
+
+	if (SIZE_MAX / nmemb < size)
+		fatal("%s: %zu * %zu overflow", __func__, nmemb, size);
+
+	client = udata;
+	len = size * nmemb;
+
+	switch (client->stream.cb(client, ptr, len, client->stream.arg)) {
+	case KORE_RESULT_OK:
+		return (len);
+	case KORE_RESULT_RETRY:
+		return (CURL_WRITEFUNC_PAUSE);
+	default:
+		return (0);
+	}
+}
+
+static int
+curl_proxy_write(struct kore_curl *client, const void *data, size_t len,
+    void *arg)
+{
+	struct curl_proxy	*proxy = arg;
+	struct http_request	*req = client->req;
+
+	if (req->owner == NULL || (req->flags & HTTP_REQUEST_DELETE))
+		return (KORE_RESULT_ERROR);
+
+	if (!(client->flags & KORE_CURL_FLAG_PROXY_STARTED))
+		curl_proxy_start(proxy);
+
+	if (proxy->pending.offset > 0 &&
+	    proxy->pending.offset + len > kore_curl_stream_hwm) {
+		proxy->flags |= CURL_PROXY_PAUSED;
+		return (KORE_RESULT_RETRY);
+	}
+
+	kore_buf_append(&proxy->pending, data, len);
+	curl_proxy_flush(proxy);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+curl_proxy_start(struct curl_proxy *proxy)
+{
+	long			status;
+	const char		*type;
+	struct kore_curl	*client = proxy->client;
+
+	status = 0;
+	type = NULL;
+
+	curl_easy_getinfo(client->handle, CURLINFO_RESPONSE_CODE, &status);
+	curl_easy_getinfo(client->handle, CURLINFO_CONTENT_TYPE, &type);
+
+	if (status == 0)
+		status = HTTP_STATUS_OK;
+
+	if (type != NULL)
+		http_response_header(client->req, "content-type", type);
+
+	client->flags |= KORE_CURL_FLAG_PROXY_STARTED;
+	http_response_chunked(client->req, status);
+}
+
+/*
+ * Send whatever is pending unless a previous piece is still on its way,
+ * curl_proxy_sent() picks up from there.
+ */
+static void
+curl_proxy_flush(struct curl_proxy *proxy)
+{
+	struct kore_buf		swap;
+	struct http_request	*req = proxy->client->req;
+
+	if ((proxy->flags & CURL_PROXY_SENDING) || proxy->pending.offset == 0)
+		return;
+
+	if (req->owner == NULL) {
+		kore_buf_reset(&proxy->pending);
+		return;
+	}
+
+	swap = proxy->inflight;
+	proxy->inflight = proxy->pending;
+	proxy->pending = swap;
+
+	proxy->flags |= CURL_PROXY_SENDING;
+	http_response_chunk(req, proxy->inflight.data,
+	    proxy->inflight.offset, curl_proxy_sent, proxy);
+}
+
+/*
+ * Called from the send queue, which may not be touched from here.
+ * The proxy is queued and continued from kore_curl_run_scheduled().
+ */
+static int
+curl_proxy_sent(struct netbuf *nb)
+{
+	struct curl_proxy	*proxy = nb->extra;
+
+	proxy->flags &= ~CURL_PROXY_SENDING;
+
+	if (proxy->client == NULL) {
+		curl_proxy_free(proxy);
+		return (KORE_RESULT_OK);
+	}
+
+	kore_buf_reset(&proxy->inflight);
+
+	if (!(proxy->flags & CURL_PROXY_READY)) {
+		proxy->flags |= CURL_PROXY_READY;
+		TAILQ_INSERT_TAIL(&proxies, proxy, list);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+curl_proxy_run(struct curl_proxy *proxy)
+{
+	struct http_request	*req = proxy->client->req;
+
+	TAILQ_REMOVE(&proxies, proxy, list);
+	proxy->flags &= ~CURL_PROXY_READY;
+
+	if (req->owner == NULL || (req->flags & HTTP_REQUEST_DELETE))
+		return;
+
+	curl_proxy_flush(proxy);
+
+	if (proxy->flags & CURL_PROXY_PAUSED) {
+		proxy->flags &= ~CURL_PROXY_PAUSED;
+		if (!(proxy->flags & CURL_PROXY_DONE))
+			kore_curl_stream_resume(proxy->client);
+	}
+
+	if ((proxy->flags & CURL_PROXY_DONE) &&
+	    !(proxy->flags & CURL_PROXY_SENDING))
+		curl_proxy_finish(proxy);
+}
+
+static void
+curl_proxy_done(struct curl_proxy *proxy)
+{
+	proxy->flags |= CURL_PROXY_DONE;
+
+	if (!(proxy->flags & CURL_PROXY_SENDING))
+		curl_proxy_finish(proxy);
+}
+
+/*
+ * Everything was handed over. A body that broke off mid-way must not
+ * look complete downstream: HTTP/1.x drops the connection and HTTP/2
+ * resets the stream once the request is freed.
+ */
+static void
+curl_proxy_finish(struct curl_proxy *proxy)
+{
+	struct kore_curl	*client = proxy->client;
+	struct http_request	*req = client->req;
+
+	if (req->owner != NULL) {
+		if (kore_curl_success(client)) {
+			if (client->flags & KORE_CURL_FLAG_PROXY_STARTED)
+				http_response_chunk_end(req);
+			else
+				http_response(req, client->http.status, NULL, 0);
+		} else if ((client->flags & KORE_CURL_FLAG_PROXY_STARTED) &&
+		    req->owner->proto == CONN_PROTO_HTTP) {
+			kore_connection_disconnect(req->owner);
+		}
+	}
+
+	http_request_wakeup_from(req, HTTP_WAKEUP_CURL);
+}
+
+static void
+curl_proxy_detach(struct curl_proxy *proxy)
+{
+	if (proxy->flags & CURL_PROXY_READY)
+		TAILQ_REMOVE(&proxies, proxy, list);
+
+	proxy->flags &= ~CURL_PROXY_READY;
+
+	if (proxy->flags & CURL_PROXY_SENDING)
+		proxy->client = NULL;
+	else
+		curl_proxy_free(proxy);
+}
+
+static void
+curl_proxy_free(struct curl_proxy *proxy)
+{
+	kore_buf_cleanup(&proxy->pending);
+	kore_buf_cleanup(&proxy->inflight);
+	kore_free(proxy);
+}
+
+/*
+ * Attach an async KORE_CURL_COALESCE client to an identical transfer
+ * that is already in flight, or start one that others can attach to.
+ * Only GET and HEAD requests set up with kore_curl_http_setup() are
+ * coalesced, keyed on their method, URL and request headers.
+ */
+static int
+curl_flight_join(struct kore_curl *client)
+{
+	struct kore_buf			key;
+	struct curl_slist		*hdr;
+	struct kore_curl_flight		*flight;
+	struct kore_curl		*shared;
+	u_int32_t			hash;
+
+	if (client->type != KORE_CURL_TYPE_HTTP_CLIENT ||
+	    client->stream.cb != NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (client->http.method != HTTP_METHOD_GET &&
+	    client->http.method != HTTP_METHOD_HEAD)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_init(&key, 256);
+	kore_buf_appendf(&key, "%d %s", client->http.method, client->url);
+
+	for (hdr = client->http.hdrlist; hdr != NULL; hdr = hdr->next)
+		kore_buf_appendf(&key, "\n%s", hdr->data);
+
+	hash = curl_flight_hash((const char *)key.data, key.offset);
+	kore_buf_stringify(&key, NULL);
+
+	LIST_FOREACH(flight, &flights[hash % FLIGHT_BUCKETS], list) {
+		if (flight->hash == hash &&
+		    !strcmp(flight->key, (const char *)key.data))
+			break;
+	}
+
+	if (flight != NULL) {
+		kore_buf_cleanup(&key);
+		curl_handle_put(client, 0);
+		kore_curl_coalesced++;
+	} else {
+		flight = kore_calloc(1, sizeof(*flight));
+		flight->hash = hash;
+		flight->key = kore_strdup((const char *)key.data);
+		kore_buf_cleanup(&key);
+
+		LIST_INIT(&flight->members);
+		LIST_INSERT_HEAD(&flights[hash % FLIGHT_BUCKETS],
+		    flight, list);
+
+		/* The transfer moves over to the flight as it was set up. */
+		shared = &flight->client;
+		TAILQ_INIT(&shared->http.resp_hdrs);
+
+		shared->flags = KORE_CURL_ASYNC;
+		shared->type = KORE_CURL_TYPE_HTTP_CLIENT;
+		shared->url = kore_strdup(client->url);
+		shared->http.method = client->http.method;
+
+		shared->handle = client->handle;
+		shared->http.hdrlist = client->http.hdrlist;
+		client->handle = NULL;
+		client->http.hdrlist = NULL;
+
+		shared->cb = curl_flight_done;
+		shared->arg = flight;
+
+		curl_easy_setopt(shared->handle, CURLOPT_PRIVATE, shared);
+		curl_easy_setopt(shared->handle,
+		    CURLOPT_ERRORBUFFER, shared->errbuf);
+		curl_easy_setopt(shared->handle,
+		    CURLOPT_WRITEDATA, &shared->response);
+		curl_easy_setopt(shared->handle,
+		    CURLOPT_HEADERDATA, &shared->http.headers);
+
+		curl_multi_add_handle(multi, shared->handle);
+	}
+
+	flight->refs++;
+	client->flight = flight;
+	client->flags |= KORE_CURL_FLAG_COALESCED;
+	LIST_INSERT_HEAD(&flight->members, client, member);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+curl_flight_done(struct kore_curl *shared, void *arg)
+{
+	struct kore_curl		*client;
+	struct kore_curl_flight		*flight = arg;
+
+	flight->done = 1;
+	LIST_REMOVE(flight, list);
+
+	if (shared->response != NULL) {
+		kore_buf_stringify(shared->response, NULL);
+		shared->response->offset--;
+	}
+
+	/* Members may let go of the flight while being woken up. */
+	flight->refs++;
+
+	while ((client = LIST_FIRST(&flight->members)) != NULL) {
+		LIST_REMOVE(client, member);
+		client->flags &= ~KORE_CURL_FLAG_COALESCED;
+
+		client->result = shared->result;
+		client->response = shared->response;
+		client->http.status = shared->http.status;
+		memcpy(client->errbuf, shared->errbuf, sizeof(client->errbuf));
+
+		/* Headers are parsed in place, so each member gets its own. */
+		if (shared->http.headers != NULL) {
+			client->http.headers =
+			    kore_buf_alloc(shared->http.headers->offset);
+			kore_buf_append(client->http.headers,
+			    shared->http.headers->data,
+			    shared->http.headers->offset);
+		}
+
+		if (client->req != NULL)
+			http_request_wakeup_from(client->req,
+			    HTTP_WAKEUP_CURL);
+		else if (client->cb != NULL)
+			client->cb(client, client->arg);
+	}
+
+	curl_flight_release(flight);
+}
+
+/*
+ * Drop a reference to flight. A flight nobody waits for anymore is
+ * cancelled if it was still running.
+ */
+static void
+curl_flight_release(struct kore_curl_flight *flight)
+{
+	if (--flight->refs > 0)
+		return;
+
+	if (!flight->done)
+		LIST_REMOVE(flight, list);
+
+	kore_curl_cleanup(&flight->client);
+	kore_free(flight->key);
+	kore_free(flight);
+}
+
+static u_int32_t
+curl_flight_hash(const char *key, size_t len)
+{
+	size_t		i;
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)key[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
 static struct fd_cache *
 fd_cache_get(int fd)
 {
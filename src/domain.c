@@ -28,8 +28,14 @@
 #include <openssl/evp.h>
 #include <openssl/ec.h>
 #include <openssl/ecdsa.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if defined(KORE_OPENSSL_NEWER_API)
+#include <openssl/async.h>
+#endif
 #include <poll.h>
 
+#include <ctype.h>
 #include <fnmatch.h>
 
 #include "kore.h"
@@ -43,21 +49,121 @@
 #endif
 
 #define KORE_DOMAIN_CACHE	16
+#define DOMAIN_GLOB_CHARS	"*?[\\"
 #define SSL_SESSION_ID		"kore_ssl_sessionid"
 
+#define TLS_SESSION_KEY		"tls:"
+#define TLS_SESSION_MAX		4096
+
+#define KEYMGR_REQ_WAIT		1
+#define KEYMGR_REQ_DONE		2
+#define KEYMGR_REQ_CANCEL	3
+
+/*
+ * An outstanding signing request to the keymgr. If the handshake runs
+ * inside an OpenSSL async job the job is paused until the response
+ * arrives and the connection is handled again, otherwise we block
+ * in keymgr_await_data() as before.
+ */
+struct keymgr_req {
+	u_int32_t		id;
+	int			state;
+	struct connection	*c;
+	size_t			len;
+	u_int8_t		data[1024];
+	TAILQ_ENTRY(keymgr_req)	list;
+};
+
+/*
+ * Per server index for kore_domain_lookup(). Plain names go into the
+ * exact table, "*.suffix" patterns into the suffix table keyed on the
+ * ".suffix" part and everything else is matched with fnmatch() in
+ * configuration order. Every entry remembers its configuration order
+ * so the first configured domain that matches still wins.
+ */
+struct domain_entry {
+	u_int32_t		hash;
+	u_int32_t		order;
+	char			*name;
+	struct kore_domain	*dom;
+	struct domain_entry	*next;
+};
+
+struct domain_table {
+	u_int32_t		mask;
+	struct domain_entry	**buckets;
+};
+
+struct kore_domain_index {
+	struct domain_table	exact;
+	struct domain_table	suffix;
+	struct domain_entry	*globs;
+};
+
 struct kore_domain		*primary_dom = NULL;
 
 static u_int8_t			keymgr_buf[2048];
-static size_t			keymgr_buflen = 0;
-static int			keymgr_response = 0;
+static u_int32_t		keymgr_reqid = 0;
+static TAILQ_HEAD(, keymgr_req)	keymgr_reqs;
 DH				*tls_dhparam = NULL;
 int				tls_version = KORE_TLS_VERSION_BOTH;
+int				tls_ktls = 0;
+int				tls_session_cache = 0;
+u_int32_t			tls_ticket_rotate = 3600;
+int				tls_lazy = 0;
+struct connection		*tls_handshake_conn = NULL;
+
+/* Ticket keys pushed by the keymgr, the current one comes first. */
+static struct kore_ticket_key	tls_ticket_keys[KORE_TICKET_KEYS];
+static int			tls_ticket_nkeys = 0;
+
+static struct {
+	u_int64_t	handshakes;
+	u_int64_t	resumed;
+	u_int64_t	cache_hits;
+	u_int64_t	cache_misses;
+	u_int64_t	cache_stores;
+	u_int32_t	lazy_pending;
+	u_int32_t	lazy_built;
+	u_int64_t	lazy_ms;
+} tls_stats;
+
+/* Pending domains marked tls_prewarm get built this many per tick. */
+#define TLS_PREWARM_BATCH	8
+#define TLS_PREWARM_INTERVAL	10
+
+static struct kore_timer	*tls_prewarm_timer = NULL;
+static u_int32_t		tls_prewarm_built = 0;
+static u_int64_t		tls_prewarm_start = 0;
 
 static int	domain_x509_verify(int, X509_STORE_CTX *);
+static void	domain_tls_build(struct kore_domain *);
+static void	domain_tls_pending_free(struct kore_domain *);
+static void	domain_tls_prewarm(void *, u_int64_t);
+static void	domain_index_build(struct kore_server *);
+static u_int32_t	domain_hash(const char *);
+static void	domain_table_init(struct domain_table *, u_int32_t);
+static void	domain_table_free(struct domain_table *);
+static void	domain_table_add(struct domain_table *, const char *,
+		    struct kore_domain *, u_int32_t);
+static struct domain_entry	*domain_table_find(struct domain_table *,
+				    const char *);
+static int	domain_ticket_key_cb(SSL *, unsigned char *, unsigned char *,
+		    EVP_CIPHER_CTX *, HMAC_CTX *, int);
+static int	domain_session_key(const unsigned char *, unsigned int,
+		    char *, size_t);
+static int	domain_session_new(SSL *, SSL_SESSION *);
+static void	domain_session_remove(SSL_CTX *, SSL_SESSION *);
+static SSL_SESSION	*domain_session_get(SSL *, const unsigned char *,
+			    int, int *);
+static void	domain_ticket_keys(struct kore_msg *, const void *);
+static int	domain_ocsp_status_cb(SSL *, void *);
 static X509	*domain_load_certificate_chain(SSL_CTX *, const void *, size_t);
 
 static void	keymgr_init(void);
-static void	keymgr_await_data(void);
+static void	keymgr_await_data(struct keymgr_req *);
+static int	keymgr_request(struct kore_domain *, int,
+		    const void *, size_t, void *, size_t);
 static void	keymgr_msg_response(struct kore_msg *, const void *);
 
 static int	keymgr_rsa_init(RSA *);
@@ -124,6 +230,11 @@ void
 kore_domain_init(void)
 {
 	int		i;
+#if defined(KORE_OPENSSL_NEWER_API)
+	int		(*ec_sign)(int, const unsigned char *, int,
+			    unsigned char *, unsigned int *, const BIGNUM *,
+			    const BIGNUM *, EC_KEY *);
+#endif
 
 	for (i = 0; i < KORE_DOMAIN_CACHE; i++)
 		cached[i] = NULL;
@@ -140,11 +251,15 @@ kore_domain_init(void)
 	RSA_meth_set_priv_enc(keymgr_rsa_meth, keymgr_rsa_privenc);
 
 	if (keymgr_ec_meth == NULL) {
-		if ((keymgr_ec_meth = EC_KEY_METHOD_new(NULL)) == NULL)
+		if ((keymgr_ec_meth =
+		    EC_KEY_METHOD_new(EC_KEY_OpenSSL())) == NULL)
 			fatal("failed to allocate EC KEY method");
 	}
 
-	EC_KEY_METHOD_set_sign(keymgr_ec_meth, NULL, NULL, keymgr_ecdsa_sign);
+	/* Keep the stock ECDSA_sign(), it calls through to sign_sig. */
+	EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &ec_sign, NULL, NULL);
+	EC_KEY_METHOD_set_sign(keymgr_ec_meth, ec_sign, NULL,
+	    keymgr_ecdsa_sign);
 #endif
 
 #if !defined(TLS1_3_VERSION)
@@ -218,6 +333,7 @@ kore_domain_attach(struct kore_domain *dom, struct kore_server *server)
 
 	dom->server = server;
 	TAILQ_INSERT_TAIL(&server->domains, dom, list);
+	kore_domain_index_free(server);
 
 	/* The primary domain should be attached to a TLS context. */
 	if (server->tls == 0 && dom == primary_dom)
@@ -240,6 +356,7 @@ kore_domain_free(struct kore_domain *dom)
 		primary_dom = NULL;
 
 	TAILQ_REMOVE(&dom->server->domains, dom, list);
+	kore_domain_index_free(dom->server);
 
 	if (dom->domain != NULL)
 		kore_free(dom->domain);
@@ -254,9 +371,15 @@ kore_domain_free(struct kore_domain *dom)
 		kore_free(dom->certfile);
 	if (dom->crlfile != NULL)
 		kore_free(dom->crlfile);
+	if (dom->ocspfile != NULL)
+		kore_free(dom->ocspfile);
+
+	kore_free(dom->ocsp);
+	domain_tls_pending_free(dom);
 
 #if !defined(KORE_NO_HTTP)
 	/* Drop all handlers associated with this domain */
+	kore_module_routes_free(dom);
 	while ((hdlr = TAILQ_FIRST(&(dom->handlers))) != NULL) {
 		TAILQ_REMOVE(&(dom->handlers), hdlr, list);
 		kore_module_handler_free(hdlr);
@@ -384,6 +507,13 @@ kore_domain_tlsinit(struct kore_domain *dom, int type,
 		RSA_set_method(rsa, keymgr_rsa_meth);
 #else
 		RSA_set_method(rsa, &keymgr_rsa);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		/* OpenSSL 3 only uses our method on a legacy EVP_PKEY. */
+		EVP_PKEY_free(pkey);
+		if ((pkey = EVP_PKEY_new()) == NULL ||
+		    !EVP_PKEY_set1_RSA(pkey, rsa))
+			fatalx("EVP_PKEY_set1_RSA: %s", ssl_errno_s);
 #endif
 		break;
 	case EVP_PKEY_EC:
@@ -395,6 +525,12 @@ kore_domain_tlsinit(struct kore_domain *dom, int type,
 #else
 		ECDSA_set_ex_data(eckey, 0, dom);
 		ECDSA_set_method(eckey, &keymgr_ecdsa);
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+		EVP_PKEY_free(pkey);
+		if ((pkey = EVP_PKEY_new()) == NULL ||
+		    !EVP_PKEY_set1_EC_KEY(pkey, eckey))
+			fatalx("EVP_PKEY_set1_EC_KEY: %s", ssl_errno_s);
 #endif
 		break;
 	default:
@@ -446,6 +582,32 @@ kore_domain_tlsinit(struct kore_domain *dom, int type,
 	    (unsigned char *)SSL_SESSION_ID, strlen(SSL_SESSION_ID));
 	SSL_CTX_set_mode(dom->ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+	/*
+	 * Tickets are sealed with keys the keymgr hands to every worker,
+	 * so any worker can resume a session another one started.
+	 */
+	if (tls_ticket_rotate == 0) {
+		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_NO_TICKET);
+	} else {
+		SSL_CTX_set_tlsext_ticket_key_cb(dom->ssl_ctx,
+		    domain_ticket_key_cb);
+	}
+
+	if (dom->ocspfile != NULL) {
+		SSL_CTX_set_tlsext_status_cb(dom->ssl_ctx,
+		    domain_ocsp_status_cb);
+		SSL_CTX_set_tlsext_status_arg(dom->ssl_ctx, dom);
+	}
+
+	if (tls_session_cache) {
+		SSL_CTX_set_session_cache_mode(dom->ssl_ctx,
+		    SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+		SSL_CTX_sess_set_new_cb(dom->ssl_ctx, domain_session_new);
+		SSL_CTX_sess_set_get_cb(dom->ssl_ctx, domain_session_get);
+		SSL_CTX_sess_set_remove_cb(dom->ssl_ctx,
+		    domain_session_remove);
+	}
+
 	if (tls_version == KORE_TLS_VERSION_BOTH) {
 		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_NO_SSLv2);
 		SSL_CTX_set_options(dom->ssl_ctx, SSL_OP_NO_SSLv3);
@@ -459,13 +621,52 @@ kore_domain_tlsinit(struct kore_domain *dom, int type,
 	SSL_CTX_set_info_callback(dom->ssl_ctx, kore_tls_info_callback);
 	SSL_CTX_set_tlsext_servername_callback(dom->ssl_ctx, kore_tls_sni_cb);
 
-#if defined(KORE_USE_ACME)
-	SSL_CTX_set_alpn_select_cb(dom->ssl_ctx, kore_acme_tls_alpn, dom);
+#if defined(KORE_USE_HTTP2) || defined(KORE_USE_ACME)
+	SSL_CTX_set_alpn_select_cb(dom->ssl_ctx, kore_tls_alpn_cb, dom);
 #endif
 
 	X509_free(x509);
 }
 
+/*
+ * With tls_lazy the certificate chain is kept as is and the SSL_CTX
+ * is only built once a handshake asks for the domain (or it is
+ * pre-warmed). The primary domain is needed for every handshake and a
+ * domain that already has a context is in use, those are built now.
+ */
+void
+kore_domain_tls_certificate(struct kore_domain *dom, const void *pem,
+    size_t len)
+{
+	domain_tls_pending_free(dom);
+
+	if (!tls_lazy || dom == primary_dom || dom->ssl_ctx != NULL) {
+		kore_domain_tlsinit(dom, KORE_PEM_CERT_CHAIN, pem, len);
+		return;
+	}
+
+	dom->tls_pending = kore_malloc(len);
+	memcpy(dom->tls_pending, pem, len);
+	dom->tls_pending_len = len;
+	tls_stats.lazy_pending++;
+
+	if (dom->tls_prewarm && tls_prewarm_timer == NULL) {
+		tls_prewarm_built = 0;
+		tls_prewarm_start = kore_time_ms();
+		tls_prewarm_timer = kore_timer_add(domain_tls_prewarm,
+		    TLS_PREWARM_INTERVAL, NULL, 0);
+	}
+}
+
+int
+kore_domain_tls_ready(struct kore_domain *dom)
+{
+	if (dom->tls_pending != NULL)
+		domain_tls_build(dom);
+
+	return (dom->ssl_ctx != NULL);
+}
+
 void
 kore_domain_crl_add(struct kore_domain *dom, const void *pem, size_t pemlen)
 {
@@ -474,6 +675,17 @@ kore_domain_crl_add(struct kore_domain *dom, const void *pem, size_t pemlen)
 	X509_CRL		*crl;
 	X509_STORE		*store;
 
+	if (dom->tls_pending != NULL) {
+		kore_free(dom->tls_pending_crl);
+		dom->tls_pending_crl = kore_malloc(pemlen);
+		memcpy(dom->tls_pending_crl, pem, pemlen);
+		dom->tls_pending_crl_len = pemlen;
+		return;
+	}
+
+	if (dom->ssl_ctx == NULL)
+		return;
+
 	ERR_clear_error();
 	in = BIO_new_mem_buf(pem, pemlen);
 
@@ -517,6 +729,25 @@ kore_domain_crl_add(struct kore_domain *dom, const void *pem, size_t pemlen)
 	    X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
 }
 
+/*
+ * Replace the OCSP response we staple for dom with the one the keymgr
+ * pushed, an empty one means stop stapling.
+ */
+void
+kore_domain_ocsp_set(struct kore_domain *dom, const void *der, size_t len)
+{
+	kore_free(dom->ocsp);
+	dom->ocsp = NULL;
+	dom->ocsp_len = 0;
+
+	if (len == 0)
+		return;
+
+	dom->ocsp = kore_malloc(len);
+	memcpy(dom->ocsp, der, len);
+	dom->ocsp_len = len;
+}
+
 void
 kore_domain_callback(void (*cb)(struct kore_domain *))
 {
@@ -533,16 +764,92 @@ kore_domain_callback(void (*cb)(struct kore_domain *))
 struct kore_domain *
 kore_domain_lookup(struct kore_server *srv, const char *domain)
 {
+	size_t			i, len;
+	u_int32_t		order;
 	struct kore_domain	*dom;
+	struct domain_entry	*entry;
+	struct kore_domain_index *idx;
+	char			name[KORE_DOMAINNAME_LEN + 1];
 
-	TAILQ_FOREACH(dom, &srv->domains, list) {
-		if (!strcmp(dom->domain, domain))
-			return (dom);
-		if (!fnmatch(dom->domain, domain, FNM_CASEFOLD))
-			return (dom);
+	len = strlen(domain);
+	if (len >= sizeof(name)) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			if (!strcmp(dom->domain, domain))
+				return (dom);
+			if (!fnmatch(dom->domain, domain, FNM_CASEFOLD))
+				return (dom);
+		}
+
+		return (NULL);
 	}
 
-	return (NULL);
+	if (srv->dindex == NULL)
+		domain_index_build(srv);
+
+	idx = srv->dindex;
+
+	for (i = 0; i < len; i++)
+		name[i] = tolower((unsigned char)domain[i]);
+	name[len] = '\0';
+
+	dom = NULL;
+	order = UINT_MAX;
+
+	if ((entry = domain_table_find(&idx->exact, name)) != NULL) {
+		dom = entry->dom;
+		order = entry->order;
+	}
+
+	/* "*.suffix" matches anything ending in ".suffix". */
+	for (i = 0; i < len; i++) {
+		if (name[i] != '.')
+			continue;
+
+		entry = domain_table_find(&idx->suffix, &name[i]);
+		if (entry != NULL && entry->order < order) {
+			dom = entry->dom;
+			order = entry->order;
+		}
+	}
+
+	for (entry = idx->globs; entry != NULL; entry = entry->next) {
+		if (entry->order >= order)
+			break;
+
+		if (!strcmp(entry->name, domain) ||
+		    !fnmatch(entry->name, domain, FNM_CASEFOLD)) {
+			dom = entry->dom;
+			break;
+		}
+	}
+
+	return (dom);
+}
+
+/*
+ * Drop the lookup index of srv, it is rebuilt on the next lookup.
+ * Called whenever a domain is added to or removed from srv.
+ */
+void
+kore_domain_index_free(struct kore_server *srv)
+{
+	struct domain_entry		*entry;
+	struct kore_domain_index	*idx;
+
+	if ((idx = srv->dindex) == NULL)
+		return;
+
+	domain_table_free(&idx->exact);
+	domain_table_free(&idx->suffix);
+
+	while ((entry = idx->globs) != NULL) {
+		idx->globs = entry->next;
+		kore_free(entry->name);
+		kore_free(entry);
+	}
+
+	kore_free(idx);
+	srv->dindex = NULL;
 }
 
 struct kore_domain *
@@ -594,7 +901,59 @@ void
 kore_domain_keymgr_init(void)
 {
 	keymgr_init();
+	TAILQ_INIT(&keymgr_reqs);
 	kore_msg_register(KORE_MSG_KEYMGR_RESP, keymgr_msg_response);
+	kore_msg_register(KORE_MSG_TICKET_KEYS, domain_ticket_keys);
+}
+
+void
+kore_domain_tls_handshake(SSL *ssl)
+{
+	tls_stats.handshakes++;
+	if (SSL_session_reused(ssl))
+		tls_stats.resumed++;
+}
+
+void
+kore_domain_tls_stats_log(void)
+{
+	u_int64_t	pct;
+
+	pct = 0;
+	if (tls_stats.handshakes > 0)
+		pct = (tls_stats.resumed * 100) / tls_stats.handshakes;
+
+	kore_log(LOG_INFO, "tls: %" PRIu64 " handshakes, %" PRIu64
+	    " resumed (%" PRIu64 "%%), session cache %" PRIu64 " hits %"
+	    PRIu64 " misses %" PRIu64 " stores, %d ticket keys",
+	    tls_stats.handshakes, tls_stats.resumed, pct,
+	    tls_stats.cache_hits, tls_stats.cache_misses,
+	    tls_stats.cache_stores, tls_ticket_nkeys);
+
+	if (tls_lazy) {
+		kore_log(LOG_INFO, "tls: %u contexts built lazily in %"
+		    PRIu64 "ms, %u pending", tls_stats.lazy_built,
+		    tls_stats.lazy_ms, tls_stats.lazy_pending);
+	}
+}
+
+/*
+ * The connection is going away while its handshake waits on the keymgr,
+ * fail the request so the paused job can run to completion.
+ */
+void
+kore_domain_keymgr_cancel(struct connection *c)
+{
+	struct keymgr_req	*kr;
+
+	TAILQ_FOREACH(kr, &keymgr_reqs, list) {
+		if (kr->c != c)
+			continue;
+
+		kr->c = NULL;
+		if (kr->state == KEYMGR_REQ_WAIT)
+			kr->state = KEYMGR_REQ_CANCEL;
+	}
 }
 
 static void
@@ -637,44 +996,14 @@ keymgr_rsa_privenc(int flen, const unsigned char *from, unsigned char *to,
     RSA *rsa, int padding)
 {
 	int			ret;
-	size_t			len;
-	struct kore_keyreq	*req;
 	struct kore_domain	*dom;
 
-	len = sizeof(*req) + flen;
-	if (len > sizeof(keymgr_buf))
-		fatal("keymgr_buf too small");
-
 	if ((dom = RSA_get_app_data(rsa)) == NULL)
 		fatal("RSA key has no domain attached");
 
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
-
-	req = (struct kore_keyreq *)keymgr_buf;
-
-	if (kore_strlcpy(req->domain, dom->domain, sizeof(req->domain)) >=
-	    sizeof(req->domain))
-		fatal("%s: domain truncated", __func__);
-
-	req->data_len = flen;
-	req->padding = padding;
-	memcpy(&req->data[0], from, req->data_len);
-
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	keymgr_await_data();
-
-	ret = -1;
-	if (keymgr_response) {
-		if (keymgr_buflen < INT_MAX &&
-		    (int)keymgr_buflen == RSA_size(rsa)) {
-			ret = RSA_size(rsa);
-			memcpy(to, keymgr_buf, RSA_size(rsa));
-		}
-	}
-
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	ret = keymgr_request(dom, padding, from, flen, to, RSA_size(rsa));
+	if (ret != RSA_size(rsa))
+		return (-1);
 
 	return (ret);
 }
@@ -689,19 +1018,15 @@ static ECDSA_SIG *
 keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
     const BIGNUM *in_kinv, const BIGNUM *in_r, EC_KEY *eckey)
 {
-	size_t				len;
+	int				len;
 	ECDSA_SIG			*sig;
 	const u_int8_t			*ptr;
 	struct kore_domain		*dom;
-	struct kore_keyreq		*req;
+	u_int8_t			buf[1024];
 
 	if (in_kinv != NULL || in_r != NULL)
 		return (NULL);
 
-	len = sizeof(*req) + dgst_len;
-	if (len > sizeof(keymgr_buf))
-		fatal("keymgr_buf too small");
-
 #if defined(KORE_OPENSSL_NEWER_API)
 	if ((dom = EC_KEY_get_ex_data(eckey, 0)) == NULL)
 		fatal("EC_KEY has no domain");
@@ -710,6 +1035,31 @@ keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
 		fatal("EC_KEY has no domain");
 #endif
 
+	len = keymgr_request(dom, 0, dgst, dgst_len, buf, sizeof(buf));
+	if (len <= 0)
+		return (NULL);
+
+	ptr = buf;
+	sig = d2i_ECDSA_SIG(NULL, &ptr, len);
+
+	return (sig);
+}
+
+/*
+ * Send the data to be signed to the keymgr and wait for its answer.
+ * Returns the length of the signature copied into out or -1.
+ */
+static int
+keymgr_request(struct kore_domain *dom, int padding, const void *data,
+    size_t len, void *out, size_t outlen)
+{
+	int			ret;
+	struct kore_keyreq	*req;
+	struct keymgr_req	*kr;
+
+	if (sizeof(*req) + len > sizeof(keymgr_buf))
+		fatal("keymgr_buf too small");
+
 	memset(keymgr_buf, 0, sizeof(keymgr_buf));
 	req = (struct kore_keyreq *)keymgr_buf;
 
@@ -717,28 +1067,56 @@ keymgr_ecdsa_sign(const unsigned char *dgst, int dgst_len,
 	    sizeof(req->domain))
 		fatal("%s: domain truncated", __func__);
 
-	req->data_len = dgst_len;
-	memcpy(&req->data[0], dgst, req->data_len);
-
-	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ, keymgr_buf, len);
-	keymgr_await_data();
+	if (++keymgr_reqid == 0)
+		keymgr_reqid = 1;
 
-	if (keymgr_response) {
-		ptr = keymgr_buf;
-		sig = d2i_ECDSA_SIG(NULL, &ptr, keymgr_buflen);
+	req->id = keymgr_reqid;
+	req->padding = padding;
+	req->data_len = len;
+	memcpy(&req->data[0], data, req->data_len);
+
+	kr = kore_calloc(1, sizeof(*kr));
+	kr->id = req->id;
+	kr->c = tls_handshake_conn;
+	kr->state = KEYMGR_REQ_WAIT;
+	TAILQ_INSERT_TAIL(&keymgr_reqs, kr, list);
+
+	kore_msg_send(KORE_WORKER_KEYMGR, KORE_MSG_KEYMGR_REQ,
+	    keymgr_buf, sizeof(*req) + len);
+
+#if defined(SSL_MODE_ASYNC)
+	if (kr->c != NULL && ASYNC_get_current_job() != NULL) {
+		/*
+		 * Hand control back to the event loop. We can be resumed
+		 * by any event on the connection so check if our answer
+		 * is actually in before continuing.
+		 */
+		while (kr->state == KEYMGR_REQ_WAIT) {
+			if (!ASYNC_pause_job())
+				break;
+		}
 	} else {
-		sig = NULL;
+		keymgr_await_data(kr);
 	}
+#else
+	keymgr_await_data(kr);
+#endif
 
-	keymgr_buflen = 0;
-	keymgr_response = 0;
-	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	ret = -1;
+	if (kr->state == KEYMGR_REQ_DONE && kr->len > 0 &&
+	    kr->len <= outlen && kr->len < INT_MAX) {
+		ret = kr->len;
+		memcpy(out, kr->data, kr->len);
+	}
 
-	return (sig);
+	TAILQ_REMOVE(&keymgr_reqs, kr, list);
+	kore_free(kr);
+
+	return (ret);
 }
 
 static void
-keymgr_await_data(void)
+keymgr_await_data(struct keymgr_req *kr)
 {
 	int			ret;
 	struct pollfd		pfd[1];
@@ -764,13 +1142,12 @@ keymgr_await_data(void)
 	 * This means that all incoming data will stop being processed
 	 * while existing requests will get processed until we return
 	 * from this call.
+	 *
+	 * Only used when the handshake is not running inside an async job.
 	 */
 	start = kore_time_ms();
 	kore_platform_disable_read(worker->msg[1]->fd);
 
-	keymgr_response = 0;
-	memset(keymgr_buf, 0, sizeof(keymgr_buf));
-
 #if !defined(KORE_NO_HTTP)
 	process_requests = 0;
 #endif
@@ -814,7 +1191,7 @@ keymgr_await_data(void)
 		if (!net_recv_flush(worker->msg[1]))
 			break;
 
-		if (keymgr_response)
+		if (kr->state != KEYMGR_REQ_WAIT)
 			break;
 
 #if !defined(KORE_NO_HTTP)
@@ -824,18 +1201,358 @@ keymgr_await_data(void)
 		}
 #endif
 	}
+
+	kore_platform_event_all(worker->msg[1]->fd, worker->msg[1]);
+	kore_worker_loop_note("keymgr", "wait", kore_time_ms() - start);
 }
 
 static void
 keymgr_msg_response(struct kore_msg *msg, const void *data)
 {
-	keymgr_response = 1;
-	keymgr_buflen = msg->length;
+	u_int32_t		id;
+	size_t			len;
+	struct connection	*c;
+	struct keymgr_req	*kr;
+
+	if (msg->length < sizeof(id))
+		return;
+
+	memcpy(&id, data, sizeof(id));
+
+	TAILQ_FOREACH(kr, &keymgr_reqs, list) {
+		if (kr->id == id)
+			break;
+	}
+
+	if (kr == NULL || kr->state != KEYMGR_REQ_WAIT)
+		return;
+
+	len = msg->length - sizeof(id);
+	if (len > sizeof(kr->data))
+		len = 0;
+
+	kr->len = len;
+	memcpy(kr->data, (const u_int8_t *)data + sizeof(id), len);
+	kr->state = KEYMGR_REQ_DONE;
+
+	/* Resume the handshake that was parked on this request. */
+	if ((c = kr->c) != NULL && c->state == CONN_STATE_TLS_SHAKE) {
+		if (!c->handle(c))
+			kore_connection_disconnect(c);
+	}
+}
+
+static void
+domain_ticket_keys(struct kore_msg *msg, const void *data)
+{
+	if (msg->length == 0 || msg->length > sizeof(tls_ticket_keys) ||
+	    (msg->length % sizeof(struct kore_ticket_key)) != 0) {
+		kore_log(LOG_WARNING, "invalid ticket keys (%zu)",
+		    msg->length);
+		return;
+	}
+
+	OPENSSL_cleanse(tls_ticket_keys, sizeof(tls_ticket_keys));
+	memcpy(tls_ticket_keys, data, msg->length);
+	tls_ticket_nkeys = msg->length / sizeof(struct kore_ticket_key);
+}
+
+static int
+domain_ocsp_status_cb(SSL *ssl, void *arg)
+{
+	u_int8_t		*resp;
+	struct kore_domain	*dom = arg;
+
+	if (dom->ocsp == NULL)
+		return (SSL_TLSEXT_ERR_NOACK);
+
+	/* OpenSSL takes ownership of the copy. */
+	if ((resp = OPENSSL_malloc(dom->ocsp_len)) == NULL)
+		return (SSL_TLSEXT_ERR_NOACK);
+
+	memcpy(resp, dom->ocsp, dom->ocsp_len);
+
+	if (!SSL_set_tlsext_status_ocsp_resp(ssl, resp, dom->ocsp_len)) {
+		OPENSSL_free(resp);
+		return (SSL_TLSEXT_ERR_NOACK);
+	}
+
+	return (SSL_TLSEXT_ERR_OK);
+}
+
+static int
+domain_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+    EVP_CIPHER_CTX *ctx, HMAC_CTX *hctx, int enc)
+{
+	int				i;
+	struct kore_ticket_key		*key;
+
+	/* No keys from the keymgr yet, issue no tickets. */
+	if (tls_ticket_nkeys == 0)
+		return (0);
+
+	if (enc) {
+		key = &tls_ticket_keys[0];
+		memcpy(name, key->name, sizeof(key->name));
+
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+			return (-1);
+		if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
+		    key->aes, iv))
+			return (-1);
+		if (!HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac),
+		    EVP_sha256(), NULL))
+			return (-1);
+
+		return (1);
+	}
+
+	key = NULL;
+	for (i = 0; i < tls_ticket_nkeys; i++) {
+		if (!memcmp(name, tls_ticket_keys[i].name, sizeof(key->name))) {
+			key = &tls_ticket_keys[i];
+			break;
+		}
+	}
+
+	/* Unknown or rotated out, do a full handshake. */
+	if (key == NULL)
+		return (0);
+
+	if (!HMAC_Init_ex(hctx, key->hmac, sizeof(key->hmac),
+	    EVP_sha256(), NULL))
+		return (-1);
+	if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes, iv))
+		return (-1);
+
+	/* Sealed with an older key, hand out a fresh ticket. */
+	return (i == 0 ? 1 : 2);
+}
+
+static int
+domain_session_key(const unsigned char *id, unsigned int len,
+    char *key, size_t keylen)
+{
+	char		*b64;
+	int		ret;
+
+	if (!kore_base64url_encode(id, len, &b64, KORE_BASE64_RAW))
+		return (KORE_RESULT_ERROR);
+
+	ret = KORE_RESULT_OK;
+	if (!kore_snprintf(key, keylen, NULL, "%s%s", TLS_SESSION_KEY, b64))
+		ret = KORE_RESULT_ERROR;
+
+	kore_free(b64);
+
+	return (ret);
+}
+
+/*
+ * The shared session cache lives in the kv store so every worker can
+ * resume a session regardless of which one did the full handshake.
+ */
+static int
+domain_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+	int			len;
+	unsigned int		idlen;
+	const unsigned char	*id;
+	u_int8_t		*p, buf[TLS_SESSION_MAX];
+	char			key[KORE_KV_KEY_MAX];
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (!domain_session_key(id, idlen, key, sizeof(key)))
+		return (0);
+
+	if ((len = i2d_SSL_SESSION(sess, NULL)) <= 0 ||
+	    (size_t)len > sizeof(buf))
+		return (0);
+
+	p = buf;
+	if (i2d_SSL_SESSION(sess, &p) != len)
+		return (0);
+
+	if (kore_kv_put(key, buf, len, SSL_SESSION_get_timeout(sess) * 1000))
+		tls_stats.cache_stores++;
+
+	/* We did not keep a reference. */
+	return (0);
+}
+
+static SSL_SESSION *
+domain_session_get(SSL *ssl, const unsigned char *id, int idlen, int *copy)
+{
+	size_t			len;
+	SSL_SESSION		*sess;
+	const u_int8_t		*p;
+	u_int8_t		buf[TLS_SESSION_MAX];
+	char			key[KORE_KV_KEY_MAX];
+
+	*copy = 0;
+
+	if (idlen <= 0 || !domain_session_key(id, idlen, key, sizeof(key)))
+		return (NULL);
+
+	len = sizeof(buf);
+	if (!kore_kv_get(key, buf, &len) || len > sizeof(buf)) {
+		tls_stats.cache_misses++;
+		return (NULL);
+	}
+
+	p = buf;
+	if ((sess = d2i_SSL_SESSION(NULL, &p, len)) == NULL) {
+		tls_stats.cache_misses++;
+		return (NULL);
+	}
+
+	tls_stats.cache_hits++;
+
+	return (sess);
+}
+
+static void
+domain_session_remove(SSL_CTX *ctx, SSL_SESSION *sess)
+{
+	unsigned int		idlen;
+	const unsigned char	*id;
+	char			key[KORE_KV_KEY_MAX];
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+	if (domain_session_key(id, idlen, key, sizeof(key)))
+		(void)kore_kv_del(key);
+}
+
+static void
+domain_index_build(struct kore_server *srv)
+{
+	size_t				i;
+	int				fits;
+	u_int32_t			order;
+	struct kore_domain		*dom;
+	struct kore_domain_index	*idx;
+	struct domain_entry		*entry, **glob;
+	char				name[KORE_DOMAINNAME_LEN + 1];
+
+	order = 0;
+	TAILQ_FOREACH(dom, &srv->domains, list)
+		order++;
+
+	idx = kore_calloc(1, sizeof(*idx));
+	domain_table_init(&idx->exact, order);
+	domain_table_init(&idx->suffix, order);
+
+	order = 0;
+	glob = &idx->globs;
+
+	TAILQ_FOREACH(dom, &srv->domains, list) {
+		order++;
+
+		fits = kore_strlcpy(name, dom->domain, sizeof(name)) <
+		    sizeof(name);
+
+		for (i = 0; name[i] != '\0'; i++)
+			name[i] = tolower((unsigned char)name[i]);
+
+		/* Anything we cannot index is left to fnmatch(). */
+		if (fits && strpbrk(name, DOMAIN_GLOB_CHARS) == NULL) {
+			domain_table_add(&idx->exact, name, dom, order);
+		} else if (fits && name[0] == '*' && name[1] == '.' &&
+		    strpbrk(&name[1], DOMAIN_GLOB_CHARS) == NULL) {
+			domain_table_add(&idx->suffix, &name[1], dom, order);
+		} else {
+			entry = kore_calloc(1, sizeof(*entry));
+			entry->name = kore_strdup(dom->domain);
+			entry->order = order;
+			entry->dom = dom;
+
+			*glob = entry;
+			glob = &entry->next;
+		}
+	}
+
+	srv->dindex = idx;
+}
+
+static u_int32_t
+domain_hash(const char *name)
+{
+	u_int32_t	hash;
 
-	if (keymgr_buflen > sizeof(keymgr_buf))
+	hash = 2166136261U;
+	while (*name != '\0') {
+		hash ^= (u_int8_t)*name++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static void
+domain_table_init(struct domain_table *tbl, u_int32_t entries)
+{
+	u_int32_t	size;
+
+	size = 16;
+	while (size < entries * 2)
+		size <<= 1;
+
+	tbl->mask = size - 1;
+	tbl->buckets = kore_calloc(size, sizeof(*tbl->buckets));
+}
+
+static void
+domain_table_free(struct domain_table *tbl)
+{
+	u_int32_t		i;
+	struct domain_entry	*entry;
+
+	for (i = 0; i <= tbl->mask; i++) {
+		while ((entry = tbl->buckets[i]) != NULL) {
+			tbl->buckets[i] = entry->next;
+			kore_free(entry->name);
+			kore_free(entry);
+		}
+	}
+
+	kore_free(tbl->buckets);
+}
+
+static void
+domain_table_add(struct domain_table *tbl, const char *name,
+    struct kore_domain *dom, u_int32_t order)
+{
+	struct domain_entry	*entry;
+
+	/* The first configured domain for a name wins, as before. */
+	if (domain_table_find(tbl, name) != NULL)
 		return;
 
-	memcpy(keymgr_buf, data, keymgr_buflen);
+	entry = kore_calloc(1, sizeof(*entry));
+	entry->name = kore_strdup(name);
+	entry->hash = domain_hash(name);
+	entry->order = order;
+	entry->dom = dom;
+
+	entry->next = tbl->buckets[entry->hash & tbl->mask];
+	tbl->buckets[entry->hash & tbl->mask] = entry;
+}
+
+static struct domain_entry *
+domain_table_find(struct domain_table *tbl, const char *name)
+{
+	u_int32_t		hash;
+	struct domain_entry	*entry;
+
+	hash = domain_hash(name);
+
+	for (entry = tbl->buckets[hash & tbl->mask];
+	    entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && !strcmp(entry->name, name))
+			return (entry);
+	}
+
+	return (NULL);
 }
 
 static int
@@ -868,6 +1585,83 @@ domain_x509_verify(int ok, X509_STORE_CTX *ctx)
 	return (ok);
 }
 
+static void
+domain_tls_build(struct kore_domain *dom)
+{
+	u_int64_t	start;
+	void		*pem, *crl;
+	size_t		len, crl_len;
+
+	pem = dom->tls_pending;
+	len = dom->tls_pending_len;
+	crl = dom->tls_pending_crl;
+	crl_len = dom->tls_pending_crl_len;
+
+	dom->tls_pending = NULL;
+	dom->tls_pending_len = 0;
+	dom->tls_pending_crl = NULL;
+	dom->tls_pending_crl_len = 0;
+
+	start = kore_time_ms();
+	kore_domain_tlsinit(dom, KORE_PEM_CERT_CHAIN, pem, len);
+
+	if (crl != NULL)
+		kore_domain_crl_add(dom, crl, crl_len);
+
+	tls_stats.lazy_pending--;
+	tls_stats.lazy_built++;
+	tls_stats.lazy_ms += kore_time_ms() - start;
+
+	kore_debug("built TLS context for %s", dom->domain);
+
+	kore_free(pem);
+	kore_free(crl);
+}
+
+static void
+domain_tls_pending_free(struct kore_domain *dom)
+{
+	if (dom->tls_pending == NULL)
+		return;
+
+	kore_free(dom->tls_pending);
+	kore_free(dom->tls_pending_crl);
+
+	dom->tls_pending = NULL;
+	dom->tls_pending_len = 0;
+	dom->tls_pending_crl = NULL;
+	dom->tls_pending_crl_len = 0;
+
+	tls_stats.lazy_pending--;
+}
+
+static void
+domain_tls_prewarm(void *unused, u_int64_t now)
+{
+	int			n;
+	struct kore_server	*srv;
+	struct kore_domain	*dom;
+
+	n = 0;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			if (dom->tls_pending == NULL || !dom->tls_prewarm)
+				continue;
+			if (n++ == TLS_PREWARM_BATCH)
+				return;
+			domain_tls_build(dom);
+			tls_prewarm_built++;
+		}
+	}
+
+	kore_timer_remove(tls_prewarm_timer);
+	tls_prewarm_timer = NULL;
+
+	kore_log(LOG_INFO, "tls: pre-warmed %u contexts in %" PRIu64 "ms",
+	    tls_prewarm_built, kore_time_ms() - tls_prewarm_start);
+}
+
 /*
  * What follows is basically a reimplementation of
  * SSL_CTX_use_certificate_chain_file() from OpenSSL but with our
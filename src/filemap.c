@@ -20,6 +20,7 @@
 
 #include <fcntl.h>
 #include <dirent.h>
+#include <inttypes.h>
 #include <unistd.h>
 
 #include "kore.h"
@@ -37,19 +38,69 @@ struct filemap_entry {
 	TAILQ_ENTRY(filemap_entry)	list;
 };
 
+#define FILEMAP_CACHE_BUCKETS		1024
+#define FILEMAP_CACHE_MAX		8192
+
+/*
+ * A request path that was resolved to a file on disk before, lets
+ * hot paths skip the map lookup and realpath() until it expires.
+ * The missing mask remembers which precompressed siblings are absent.
+ */
+struct filemap_cached {
+	u_int32_t			hash;
+	struct kore_domain		*domain;
+	char				*path;
+	char				*rpath;
+	int				missing;
+	u_int64_t			expires;
+	LIST_ENTRY(filemap_cached)	hlist;
+	TAILQ_ENTRY(filemap_cached)	list;
+};
+
 int	filemap_resolve(struct http_request *);
 
 static void	filemap_serve(struct http_request *, struct filemap_entry *);
+static struct kore_fileref	*filemap_precompressed(struct http_request *,
+				    struct kore_server *, const char *,
+				    struct kore_fileref *, int *);
+
+static void			filemap_preload_dir(struct filemap_entry *,
+				    const char *);
+static u_int32_t		filemap_cache_hash(const char *);
+static int			filemap_cache_serve(struct http_request *);
+static void			filemap_cache_drop(struct filemap_cached *);
+static struct filemap_cached	*filemap_cache_insert(struct http_request *,
+				    const char *);
 
 static TAILQ_HEAD(, filemap_entry)	maps;
+static TAILQ_HEAD(filemap_cached_lru, filemap_cached) cache_lru;
+static LIST_HEAD(, filemap_cached)	cache[FILEMAP_CACHE_BUCKETS];
+static u_int32_t			cache_count = 0;
 
 char	*kore_filemap_ext = NULL;
 char	*kore_filemap_index = NULL;
+int	kore_filemap_precompressed = 0;
+int	kore_filemap_preload = 0;
+
+static const struct {
+	const char	*coding;
+	const char	*ext;
+} filemap_codings[] = {
+	{ "br",		".br" },
+	{ "gzip",	".gz" },
+	{ NULL,		NULL },
+};
 
 void
 kore_filemap_init(void)
 {
+	int		i;
+
 	TAILQ_INIT(&maps);
+	TAILQ_INIT(&cache_lru);
+
+	for (i = 0; i < FILEMAP_CACHE_BUCKETS; i++)
+		LIST_INIT(&cache[i]);
 }
 
 int
@@ -59,7 +110,7 @@ kore_filemap_create(struct kore_domain *dom, const char *path, const char *root)
 	struct stat			st;
 	int				len;
 	struct kore_module_handle	*hdlr;
-	struct filemap_entry		*entry;
+	struct filemap_entry		*entry, *pos;
 	char				regex[1024], fpath[PATH_MAX];
 
 	sz = strlen(root);
@@ -113,7 +164,16 @@ kore_filemap_create(struct kore_domain *dom, const char *path, const char *root)
 	entry->ondisk_len = strlen(path);
 	entry->ondisk = kore_strdup(path);
 
-	TAILQ_INSERT_TAIL(&maps, entry, list);
+	/* Longest root first so filemap_resolve() can stop at a match. */
+	TAILQ_FOREACH(pos, &maps, list) {
+		if (pos->root_len < entry->root_len)
+			break;
+	}
+
+	if (pos != NULL)
+		TAILQ_INSERT_BEFORE(pos, entry, list);
+	else
+		TAILQ_INSERT_TAIL(&maps, entry, list);
 
 	return (KORE_RESULT_OK);
 }
@@ -134,11 +194,34 @@ kore_filemap_resolve_paths(void)
 	}
 }
 
+/*
+ * Read the files under each filemap into the in memory fileref cache
+ * as long as they fit, only for servers that would use it.
+ */
+void
+kore_filemap_preload_paths(void)
+{
+	struct filemap_entry	*entry;
+
+	if (!kore_filemap_preload || kore_fileref_memory_max == 0)
+		return;
+
+	TAILQ_FOREACH(entry, &maps, list) {
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+		if (entry->domain->server->tls == 0)
+			continue;
+#endif
+		filemap_preload_dir(entry, entry->ondisk);
+	}
+
+	kore_log(LOG_INFO, "preloaded %" PRIu64 " bytes of files",
+	    kore_fileref_memory_used);
+}
+
 int
 filemap_resolve(struct http_request *req)
 {
-	size_t			best_len;
-	struct filemap_entry	*entry, *best;
+	struct filemap_entry	*entry;
 
 	if (req->method != HTTP_METHOD_GET &&
 	    req->method != HTTP_METHOD_HEAD) {
@@ -147,28 +230,23 @@ filemap_resolve(struct http_request *req)
 		return (KORE_RESULT_OK);
 	}
 
-	best = NULL;
-	best_len = 0;
+	if (kore_fileref_revalidate != 0 && filemap_cache_serve(req))
+		return (KORE_RESULT_OK);
 
 	TAILQ_FOREACH(entry, &maps, list) {
 		if (entry->domain != req->hdlr->dom)
 			continue;
 
-		if (!strncmp(entry->root, req->path, entry->root_len)) {
-			if (best == NULL || entry->root_len > best_len) {
-				best = entry;
-				best_len = entry->root_len;
-				continue;
-			}
-		}
+		if (!strncmp(entry->root, req->path, entry->root_len))
+			break;
 	}
 
-	if (best == NULL) {
+	if (entry == NULL) {
 		http_response(req, HTTP_STATUS_NOT_FOUND, NULL, 0);
 		return (KORE_RESULT_OK);
 	}
 
-	filemap_serve(req, best);
+	filemap_serve(req, entry);
 
 	return (KORE_RESULT_OK);
 }
@@ -180,8 +258,9 @@ filemap_serve(struct http_request *req, struct filemap_entry *map)
 	struct connection	*c;
 	struct kore_fileref	*ref;
 	struct kore_server	*srv;
+	struct filemap_cached	*fc;
 	const char		*path;
-	int			len, fd, index;
+	int			len, fd, index, missing;
 	char			fpath[PATH_MAX], rpath[PATH_MAX];
 
 	path = req->path + map->root_len;
@@ -275,8 +354,11 @@ lookup:
 				goto cleanup;
 			}
 
-			/* kore_fileref_create() takes ownership of the fd. */
-			ref = kore_fileref_create(srv, fpath, fd,
+			/*
+			 * kore_fileref_create() takes ownership of the fd.
+			 * Key it by rpath, that is what the lookup uses.
+			 */
+			ref = kore_fileref_create(srv, rpath, fd,
 			    st.st_size, &st.st_mtim);
 			if (ref == NULL) {
 				http_response(req,
@@ -311,6 +393,17 @@ lookup:
 	}
 
 	if (ref != NULL) {
+		missing = 0;
+		fc = NULL;
+
+		if (kore_fileref_revalidate != 0)
+			fc = filemap_cache_insert(req, rpath);
+
+		if (kore_filemap_precompressed) {
+			ref = filemap_precompressed(req, srv, rpath, ref,
+			    fc != NULL ? &fc->missing : &missing);
+		}
+
 		http_response_fileref(req, HTTP_STATUS_OK, ref);
 		fd = -1;
 	}
@@ -320,4 +413,235 @@ cleanup:
 		close(fd);
 }
 
+/*
+ * Look for a precompressed sibling (file.br, file.gz) of the file that
+ * is about to be served and swap it in if the client accepts it and it
+ * is not older than the original. Returns the fileref to serve.
+ * Siblings that do not exist are flagged in missing and skipped later.
+ */
+static struct kore_fileref *
+filemap_precompressed(struct http_request *req, struct kore_server *srv,
+    const char *rpath, struct kore_fileref *ref, int *missing)
+{
+	struct stat		st;
+	int			i, len, fd;
+	struct kore_fileref	*sib;
+	const char		*type;
+	char			spath[PATH_MAX];
+
+	for (i = 0; filemap_codings[i].coding != NULL; i++) {
+		if (*missing & (1 << i))
+			continue;
+
+		if (!http_request_accepts_encoding(req,
+		    filemap_codings[i].coding))
+			continue;
+
+		len = snprintf(spath, sizeof(spath), "%s%s",
+		    rpath, filemap_codings[i].ext);
+		if (len == -1 || (size_t)len >= sizeof(spath))
+			continue;
+
+		if ((sib = kore_fileref_get(spath, srv->tls)) == NULL) {
+			if ((fd = open(spath, O_RDONLY | O_NOFOLLOW)) == -1) {
+				if (errno == ENOENT)
+					*missing |= (1 << i);
+				continue;
+			}
+
+			if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+			    st.st_size <= 0) {
+				*missing |= (1 << i);
+				close(fd);
+				continue;
+			}
+
+			sib = kore_fileref_create(srv, spath, fd,
+			    st.st_size, &st.st_mtim);
+			if (sib == NULL) {
+				close(fd);
+				continue;
+			}
+		}
+
+		if (sib->mtime < ref->mtime) {
+			kore_fileref_release(sib);
+			continue;
+		}
+
+		if ((type = http_media_type(rpath)) != NULL)
+			http_response_header(req, "content-type", type);
+		http_response_header(req, "content-encoding",
+		    filemap_codings[i].coding);
+		http_response_header(req, "vary", "accept-encoding");
+
+		kore_fileref_release(ref);
+		return (sib);
+	}
+
+	return (ref);
+}
+
+static void
+filemap_preload_dir(struct filemap_entry *map, const char *dir)
+{
+	DIR			*d;
+	struct stat		st;
+	struct dirent		*dp;
+	int			len, fd;
+	struct kore_fileref	*ref;
+	struct kore_server	*srv;
+	char			path[PATH_MAX];
+
+	if ((d = opendir(dir)) == NULL) {
+		kore_log(LOG_NOTICE, "opendir(%s): %s", dir, errno_s);
+		return;
+	}
+
+	srv = map->domain->server;
+
+	while ((dp = readdir(d)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+
+		len = snprintf(path, sizeof(path), "%s/%s", dir, dp->d_name);
+		if (len == -1 || (size_t)len >= sizeof(path))
+			continue;
+
+		/* Symlinks are skipped, the served path is the realpath. */
+		if (lstat(path, &st) == -1)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			filemap_preload_dir(map, path);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode) || st.st_size <= 0 ||
+		    (u_int64_t)st.st_size > kore_fileref_memory_file_max)
+			continue;
+
+		/* Do not push out what was preloaded already. */
+		if (kore_fileref_memory_used + st.st_size >
+		    kore_fileref_memory_max)
+			continue;
+
+		if ((ref = kore_fileref_get(path, srv->tls)) != NULL) {
+			kore_fileref_release(ref);
+			continue;
+		}
+
+		if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1)
+			continue;
+
+		ref = kore_fileref_create(srv, path, fd, st.st_size,
+		    &st.st_mtim);
+		if (ref == NULL) {
+			close(fd);
+			continue;
+		}
+
+		kore_fileref_release(ref);
+	}
+
+	closedir(d);
+}
+
+/*
+ * Serve the request from a previously resolved path if there is one,
+ * returns 0 if the request has to go through the full lookup.
+ */
+static int
+filemap_cache_serve(struct http_request *req)
+{
+	u_int32_t		hash;
+	struct filemap_cached	*fc;
+	struct kore_fileref	*ref;
+	struct kore_server	*srv;
+
+	hash = filemap_cache_hash(req->path);
+
+	LIST_FOREACH(fc, &cache[hash % FILEMAP_CACHE_BUCKETS], hlist) {
+		if (fc->hash == hash && fc->domain == req->hdlr->dom &&
+		    !strcmp(fc->path, req->path))
+			break;
+	}
+
+	if (fc == NULL)
+		return (0);
+
+	if (fc->expires <= kore_time_ms()) {
+		filemap_cache_drop(fc);
+		return (0);
+	}
+
+	srv = req->owner->owner->server;
+
+	if ((ref = kore_fileref_get(fc->rpath, srv->tls)) == NULL) {
+		filemap_cache_drop(fc);
+		return (0);
+	}
+
+	TAILQ_REMOVE(&cache_lru, fc, list);
+	TAILQ_INSERT_HEAD(&cache_lru, fc, list);
+
+	if (kore_filemap_precompressed)
+		ref = filemap_precompressed(req, srv, fc->rpath, ref,
+		    &fc->missing);
+
+	http_response_fileref(req, HTTP_STATUS_OK, ref);
+
+	return (1);
+}
+
+static struct filemap_cached *
+filemap_cache_insert(struct http_request *req, const char *rpath)
+{
+	struct filemap_cached	*fc;
+
+	if (cache_count >= FILEMAP_CACHE_MAX)
+		filemap_cache_drop(TAILQ_LAST(&cache_lru, filemap_cached_lru));
+
+	fc = kore_malloc(sizeof(*fc));
+	fc->missing = 0;
+	fc->domain = req->hdlr->dom;
+	fc->path = kore_strdup(req->path);
+	fc->rpath = kore_strdup(rpath);
+	fc->hash = filemap_cache_hash(req->path);
+	fc->expires = kore_time_ms() + kore_fileref_revalidate;
+
+	LIST_INSERT_HEAD(&cache[fc->hash % FILEMAP_CACHE_BUCKETS], fc, hlist);
+	TAILQ_INSERT_HEAD(&cache_lru, fc, list);
+	cache_count++;
+
+	return (fc);
+}
+
+static void
+filemap_cache_drop(struct filemap_cached *fc)
+{
+	LIST_REMOVE(fc, hlist);
+	TAILQ_REMOVE(&cache_lru, fc, list);
+	cache_count--;
+
+	kore_free(fc->path);
+	kore_free(fc->rpath);
+	kore_free(fc);
+}
+
+/* FNV-1a */
+static u_int32_t
+filemap_cache_hash(const char *path)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+	while (*path != '\0') {
+		hash ^= (u_int8_t)*path++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
 #endif
@@ -20,25 +20,103 @@
 #include <sys/mman.h>
 
 #include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "kore.h"
 
+#if defined(__linux__)
+#include "seccomp.h"
+
+/* Memory refs are read with pread(). */
+static struct sock_filter filter_fileref[] = {
+	KORE_SYSCALL_ALLOW(pread64),
+};
+
+#if !defined(KORE_NO_HTTP)
+/* The filemap_preload walk over the filemap roots. */
+static struct sock_filter filter_preload[] = {
+	KORE_SYSCALL_ALLOW(getdents64),
+#if defined(SYS_newfstatat)
+	KORE_SYSCALL_ALLOW(newfstatat),
+#endif
+};
+#endif
+#endif
+
 /* cached filerefs expire after 30 seconds of inactivity. */
 #define FILEREF_EXPIRATION		(1000 * 30)
 
+#define FILEREF_BUCKETS			1024
+
+static u_int32_t	fileref_hash(const char *, int);
 static void	fileref_timer_prime(void);
 static void	fileref_drop(struct kore_fileref *);
 static void	fileref_soft_remove(struct kore_fileref *);
 static void	fileref_expiration_check(void *, u_int64_t);
+static int	fileref_map(struct kore_server *, struct kore_fileref *, int);
+static int	fileref_memory_load(struct kore_server *,
+		    struct kore_fileref *, int);
+static int	fileref_memory_reserve(off_t);
 
-static TAILQ_HEAD(, kore_fileref)	refs;
+static TAILQ_HEAD(fileref_list, kore_fileref)	refs;
+static LIST_HEAD(, kore_fileref)	buckets[FILEREF_BUCKETS];
 static struct kore_pool			ref_pool;
 static struct kore_timer		*ref_timer = NULL;
 
+/*
+ * How long (in ms) a fileref is trusted before its mtime is checked
+ * against the disk again. 0 means on every lookup.
+ */
+u_int64_t	kore_fileref_revalidate = 0;
+
+/*
+ * Files that would otherwise be mmap()d (tls, no sendfile) and are at
+ * most kore_fileref_memory_file_max bytes are read into memory instead,
+ * up to kore_fileref_memory_max bytes in total. These stay around until
+ * they go stale or the least recently used idle ones make room for new
+ * files. Disabled when kore_fileref_memory_max is 0.
+ */
+u_int64_t	kore_fileref_memory_max = 0;
+u_int64_t	kore_fileref_memory_file_max = 262144;
+
+u_int64_t	kore_fileref_memory_used = 0;
+u_int64_t	kore_fileref_memory_hits = 0;
+u_int64_t	kore_fileref_memory_misses = 0;
+u_int64_t	kore_fileref_memory_evictions = 0;
+
+/*
+ * Called by the parent once the configuration is known, allows what
+ * memory refs need in the worker sandbox if they are turned on.
+ */
+void
+kore_fileref_sysinit(void)
+{
+	if (kore_fileref_memory_max == 0)
+		return;
+
+#if defined(__linux__)
+	kore_seccomp_filter("fileref", filter_fileref,
+	    KORE_FILTER_LEN(filter_fileref));
+#if !defined(KORE_NO_HTTP)
+	if (kore_filemap_preload) {
+		kore_seccomp_filter("preload", filter_preload,
+		    KORE_FILTER_LEN(filter_preload));
+	}
+#endif
+#endif
+}
+
 void
 kore_fileref_init(void)
 {
+	int		i;
+
 	TAILQ_INIT(&refs);
+	for (i = 0; i < FILEREF_BUCKETS; i++)
+		LIST_INIT(&buckets[i]);
+
 	kore_pool_init(&ref_pool, "ref_pool", sizeof(struct kore_fileref), 100);
 }
 
@@ -46,6 +124,8 @@ struct kore_fileref *
 kore_fileref_create(struct kore_server *srv, const char *path, int fd,
     off_t size, struct timespec *ts)
 {
+	struct stat		st;
+	struct tm		*tm;
 	struct kore_fileref	*ref;
 
 	fileref_timer_prime();
@@ -60,45 +140,49 @@ kore_fileref_create(struct kore_server *srv, const char *path, int fd,
 	ref->size = size;
 	ref->ontls = srv->tls;
 	ref->path = kore_strdup(path);
+	ref->hash = fileref_hash(path, srv->tls);
+	ref->checked = kore_time_ms();
 	ref->mtime_sec = ts->tv_sec;
 	ref->mtime = ((u_int64_t)(ts->tv_sec * 1000 + (ts->tv_nsec / 1000000)));
 
-#if !defined(KORE_USE_PLATFORM_SENDFILE)
-	if ((uintmax_t)size> SIZE_MAX) {
-		kore_pool_put(&ref_pool, ref);
-		return (NULL);
+	/*
+	 * The validators are fixed for the lifetime of the fileref, build
+	 * them once here instead of for every conditional request.
+	 */
+	if (fstat(fd, &st) == -1)
+		st.st_ino = 0;
+
+	(void)snprintf(ref->etag, sizeof(ref->etag), "W/\"%llx-%llx-%llx\"",
+	    (unsigned long long)st.st_ino, (unsigned long long)size,
+	    (unsigned long long)ref->mtime);
+
+	ref->modified[0] = '\0';
+	if ((tm = gmtime(&ref->mtime_sec)) != NULL) {
+		if (strftime(ref->modified, sizeof(ref->modified),
+		    "%a, %d %b %Y %H:%M:%S GMT", tm) == 0)
+			ref->modified[0] = '\0';
 	}
 
-	ref->base = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (ref->base == MAP_FAILED)
-		fatal("net_send_file: mmap failed: %s", errno_s);
-	if (madvise(ref->base, (size_t)size, MADV_SEQUENTIAL) == -1)
-		fatal("net_send_file: madvise: %s", errno_s);
-	close(fd);
-#else
-	if (srv->tls == 0) {
-		ref->fd = fd;
-	} else {
-		if ((uintmax_t)size> SIZE_MAX) {
-			kore_pool_put(&ref_pool, ref);
-			return (NULL);
-		}
+#if defined(KORE_USE_ZLIB)
+	ref->gzip = NULL;
+	ref->gzip_len = 0;
+#endif
 
-		ref->base = mmap(NULL,
-		    (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
-		if (ref->base == MAP_FAILED)
-			fatal("net_send_file: mmap failed: %s", errno_s);
-		if (madvise(ref->base, (size_t)size, MADV_SEQUENTIAL) == -1)
-			fatal("net_send_file: madvise: %s", errno_s);
-		close(fd);
+	ref->fd = -1;
+	ref->base = NULL;
+
+	if (!fileref_memory_load(srv, ref, fd) && !fileref_map(srv, ref, fd)) {
+		kore_free(ref->path);
+		kore_pool_put(&ref_pool, ref);
+		return (NULL);
 	}
-#endif
 
 #if defined(FILEREF_DEBUG)
 	kore_log(LOG_DEBUG, "ref:%p created", (void *)ref);
 #endif
 
 	TAILQ_INSERT_TAIL(&refs, ref, list);
+	LIST_INSERT_HEAD(&buckets[ref->hash % FILEREF_BUCKETS], ref, hlist);
 
 	return (ref);
 }
@@ -112,10 +196,20 @@ kore_fileref_get(const char *path, int ontls)
 {
 	struct stat		st;
 	struct kore_fileref	*ref;
-	u_int64_t		mtime;
+	u_int32_t		hash;
+	u_int64_t		now, mtime;
+
+	hash = fileref_hash(path, ontls);
+
+	LIST_FOREACH(ref, &buckets[hash % FILEREF_BUCKETS], hlist) {
+		if (ref->hash != hash || ref->ontls != ontls ||
+		    strcmp(ref->path, path))
+			continue;
 
-	TAILQ_FOREACH(ref, &refs, list) {
-		if (!strcmp(ref->path, path) && ref->ontls == ontls) {
+		/* Only go to the disk if the last check is old enough. */
+		now = kore_time_ms();
+		if (kore_fileref_revalidate == 0 ||
+		    now - ref->checked >= kore_fileref_revalidate) {
 			if (stat(ref->path, &st) == -1) {
 				if (errno != ENOENT) {
 					kore_log(LOG_ERR, "stat(%s): %s",
@@ -133,15 +227,18 @@ kore_fileref_get(const char *path, int ontls)
 				return (NULL);
 			}
 
-			ref->cnt++;
+			ref->checked = now;
+		}
+
+		ref->cnt++;
+		if (ref->flags & KORE_FILEREF_MEMORY)
+			kore_fileref_memory_hits++;
 #if defined(FILEREF_DEBUG)
-			kore_log(LOG_DEBUG, "ref:%p cnt:%d",
-			    (void *)ref, ref->cnt);
+		kore_log(LOG_DEBUG, "ref:%p cnt:%d", (void *)ref, ref->cnt);
 #endif
-			TAILQ_REMOVE(&refs, ref, list);
-			TAILQ_INSERT_HEAD(&refs, ref, list);
-			return (ref);
-		}
+		TAILQ_REMOVE(&refs, ref, list);
+		TAILQ_INSERT_HEAD(&refs, ref, list);
+		return (ref);
 	}
 
 	return (NULL);
@@ -189,6 +286,7 @@ fileref_soft_remove(struct kore_fileref *ref)
 #endif
 
 	TAILQ_REMOVE(&refs, ref, list);
+	LIST_REMOVE(ref, hlist);
 	ref->flags |= KORE_FILEREF_SOFT_REMOVED;
 
 	if (ref->cnt == 0)
@@ -206,6 +304,10 @@ fileref_expiration_check(void *arg, u_int64_t now)
 		if (ref->cnt != 0)
 			continue;
 
+		/* In memory refs are only pushed out by newer ones. */
+		if (ref->flags & KORE_FILEREF_MEMORY)
+			continue;
+
 		if (ref->expiration > now)
 			continue;
 
@@ -230,15 +332,160 @@ fileref_drop(struct kore_fileref *ref)
 	kore_log(LOG_DEBUG, "ref:%p dropped", (void *)ref);
 #endif
 
-	if (!(ref->flags & KORE_FILEREF_SOFT_REMOVED))
+	if (!(ref->flags & KORE_FILEREF_SOFT_REMOVED)) {
 		TAILQ_REMOVE(&refs, ref, list);
+		LIST_REMOVE(ref, hlist);
+	}
 
 	kore_free(ref->path);
 
-#if !defined(KORE_USE_PLATFORM_SENDFILE)
-	(void)munmap(ref->base, ref->size);
-#else
-	close(ref->fd);
+#if defined(KORE_USE_ZLIB)
+	kore_free(ref->gzip);
 #endif
+
+	if (ref->flags & KORE_FILEREF_MEMORY) {
+		kore_fileref_memory_used -= ref->size;
+		kore_free(ref->base);
+	} else if (ref->base != NULL) {
+		(void)munmap(ref->base, ref->size);
+	}
+
+	if (ref->fd != -1)
+		close(ref->fd);
+
 	kore_pool_put(&ref_pool, ref);
 }
+
+/*
+ * Back the fileref by the file itself, handing it to sendfile() if the
+ * platform can or mapping it otherwise.
+ */
+static int
+fileref_map(struct kore_server *srv, struct kore_fileref *ref, int fd)
+{
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+	if (srv->tls == 0) {
+		ref->fd = fd;
+		return (KORE_RESULT_OK);
+	}
+#endif
+
+	if ((uintmax_t)ref->size > SIZE_MAX)
+		return (KORE_RESULT_ERROR);
+
+	ref->base = mmap(NULL,
+	    (size_t)ref->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ref->base == MAP_FAILED)
+		fatal("net_send_file: mmap failed: %s", errno_s);
+	if (madvise(ref->base, (size_t)ref->size, MADV_SEQUENTIAL) == -1)
+		fatal("net_send_file: madvise: %s", errno_s);
+	close(fd);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Read a small file into memory if it would otherwise be mapped, this
+ * keeps the hot set of tls served files resident instead of faulting
+ * it back in every time its mapping expired.
+ */
+static int
+fileref_memory_load(struct kore_server *srv, struct kore_fileref *ref, int fd)
+{
+	ssize_t		ret;
+	size_t		off, len;
+
+	if (kore_fileref_memory_max == 0 || ref->size <= 0 ||
+	    (u_int64_t)ref->size > kore_fileref_memory_file_max)
+		return (KORE_RESULT_ERROR);
+
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+	if (srv->tls == 0)
+		return (KORE_RESULT_ERROR);
+#endif
+
+	kore_fileref_memory_misses++;
+
+	if (!fileref_memory_reserve(ref->size))
+		return (KORE_RESULT_ERROR);
+
+	len = (size_t)ref->size;
+	ref->base = kore_malloc(len);
+
+	for (off = 0; off < len; off += (size_t)ret) {
+		ret = pread(fd, (u_int8_t *)ref->base + off, len - off, off);
+		if (ret == -1 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+
+		if (ret <= 0) {
+			kore_free(ref->base);
+			ref->base = NULL;
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	close(fd);
+
+	ref->flags |= KORE_FILEREF_MEMORY;
+	kore_fileref_memory_used += len;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Evict idle in memory refs, least recently used first, to fit len.
+ * Nothing is evicted if that would not free up enough room.
+ */
+static int
+fileref_memory_reserve(off_t len)
+{
+	u_int64_t		avail;
+	struct kore_fileref	*ref, *prev;
+
+	if ((u_int64_t)len > kore_fileref_memory_max)
+		return (KORE_RESULT_ERROR);
+
+	avail = kore_fileref_memory_max - kore_fileref_memory_used;
+
+	TAILQ_FOREACH_REVERSE(ref, &refs, fileref_list, list) {
+		if (avail >= (u_int64_t)len)
+			break;
+		if ((ref->flags & KORE_FILEREF_MEMORY) && ref->cnt == 0)
+			avail += ref->size;
+	}
+
+	if (avail < (u_int64_t)len)
+		return (KORE_RESULT_ERROR);
+
+	for (ref = TAILQ_LAST(&refs, fileref_list); ref != NULL; ref = prev) {
+		if (kore_fileref_memory_used + len <= kore_fileref_memory_max)
+			break;
+
+		prev = TAILQ_PREV(ref, fileref_list, list);
+
+		if (!(ref->flags & KORE_FILEREF_MEMORY) || ref->cnt != 0)
+			continue;
+
+		kore_fileref_memory_evictions++;
+		fileref_drop(ref);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/* FNV-1a over the path, tls and plain refs are kept apart. */
+static u_int32_t
+fileref_hash(const char *path, int ontls)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U ^ (u_int32_t)ontls;
+	while (*path != '\0') {
+		hash ^= (u_int8_t)*path++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
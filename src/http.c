@@ -47,6 +47,10 @@
 #include "curl.h"
 #endif
 
+#if defined(KORE_USE_HTTP2)
+#include "http2.h"
+#endif
+
 static struct {
 	const char	*ext;
 	const char	*type;
@@ -128,43 +132,266 @@ static const char *pretty_error_fmt =
 	"</body>\n</html>\n";
 
 static int	http_body_recv(struct netbuf *);
-static void	http_error_response(struct connection *, int);
+static void	http_body_stream_done(struct http_request *);
+static void	http_body_stream_fail(struct http_request *);
+static u_int8_t	*http_header_end(u_int8_t *, size_t, size_t *, int *);
+static void	http_pipelined_keep(struct connection *,
+		    const u_int8_t *, size_t);
+static int	http_header_split(char *, char **, int, int *);
+static u_int32_t	http_header_hash(const char *, u_int32_t);
+static int	http_header_known(const char *, u_int32_t);
+static void	http_header_perfect_init(void);
+static void	http_append_status(struct kore_buf *, int, int,
+		    const char *);
+static void	http_append_block(struct kore_buf *, int);
+static void	http_append_date(struct kore_buf *);
+static void	http_date_update(void);
+static void	http_append_length(struct kore_buf *, size_t);
+static void	http_prerender_cleanup(void);
 static void	http_write_response_cookie(struct http_cookie *);
+static const char	*http_render_cookie(struct http_cookie *);
 static void	http_argument_add(struct http_request *, char *, char *,
 		    int, int);
+static int	http_etag_match(const char *, const char *);
+static int	http_fileref_fresh(struct http_request *,
+		    struct kore_fileref *);
+static int	http_range_parse(struct http_request *,
+		    struct kore_fileref *, struct http_range *);
+static int	http_range_number(const char **, off_t *);
+static int	http_range_valid(struct http_request *,
+		    struct kore_fileref *);
+static void	http_response_byteranges(struct http_request *,
+		    struct kore_fileref *, struct http_range *, int,
+		    const char *);
 static int	http_check_redirect(struct http_request *,
 		    struct kore_domain *);
 static void	http_response_normal(struct http_request *,
 		    struct connection *, int, const void *, size_t);
-static void	multipart_add_field(struct http_request *, struct kore_buf *,
-		    char *, const char *, const int);
-static void	multipart_file_add(struct http_request *, struct kore_buf *,
-		    const char *, const char *, const char *, const int);
-static int	multipart_find_data(struct kore_buf *, struct kore_buf *,
-		    size_t *, struct http_request *, const void *, size_t);
-static int	multipart_parse_headers(struct http_request *,
-		    struct kore_buf *, struct kore_buf *,
-		    const char *, const int);
-
-static struct http_request	*http_request_new(struct connection *,
-				    const char *, const char *, char *,
-				    const char *);
+static void	http_response_send(struct http_request *, int,
+		    const void *, size_t);
+static void	http_response_owned(struct http_request *, int, void *,
+		    size_t, int (*)(struct netbuf *), void *);
+static void	http_response_owned_done(int (*)(struct netbuf *), void *);
+static int	http_response_buf_sent(struct netbuf *);
+static int	http_body_ref_sent(struct netbuf *);
+static void	http_json_stream_flush(struct http_json_stream *);
+static int	http_json_stream_sent(struct netbuf *);
+static void	http_json_stream_free(struct http_json_stream *);
+#if defined(KORE_USE_HTTP2)
+static void	http_response_h2(struct http_request *,
+		    struct connection *, int, const void *, size_t, int);
+#endif
+static struct http_multipart	*multipart_create(struct http_request *, int,
+				    int (*)(struct http_request *,
+				    struct http_file *, const void *, size_t));
+static void	multipart_free(struct http_multipart *);
+static void	http_arena_reset(struct http_request *);
+static int	http_request_shed(struct http_request *);
+static int	http_timing_render(struct http_request *, char *, size_t);
+static void	http_wakeups_deliver(void);
+static int	multipart_feed(struct http_multipart *,
+		    const u_int8_t *, size_t);
+static int	multipart_error(struct http_multipart *);
+static int	multipart_emit(struct http_multipart *,
+		    const u_int8_t *, size_t, size_t);
+static int	multipart_part_begin(struct http_multipart *);
+static int	multipart_part_end(struct http_multipart *);
+static void	multipart_file_free(struct http_file *);
+static const u_int8_t	*multipart_find(const u_int8_t *, size_t,
+			    const void *, size_t);
+
+/*
+ * A page of the per request arena. Pages come from http_arena_pool,
+ * allocations that do not fit in one are malloc'd on their own.
+ */
+struct http_arena {
+	struct http_arena	*next;
+	size_t			size;
+	size_t			offset;
+};
+
+/*
+ * A JSON response written while it goes out, see http_response_json().
+ * The writer fills pending while inflight is on its way.
+ */
+struct http_json_stream {
+	int			flags;
+	struct http_request	*req;
+	struct kore_buf		pending;
+	struct kore_buf		inflight;
+	struct kore_json_writer	writer;
+};
+
+#define HTTP_JSON_STREAM_SENDING	0x0001
+#define HTTP_JSON_STREAM_FINISHED	0x0002
+
+#define HTTP_JSON_STREAM_CHUNK		(64 * 1024)
+
+#define HTTP_ARENA_ALIGN	16
+#define HTTP_ARENA_HDR		\
+    ((sizeof(struct http_arena) + HTTP_ARENA_ALIGN - 1) & \
+    ~(size_t)(HTTP_ARENA_ALIGN - 1))
+
+#define MULTIPART_STATE_DATA		1
+#define MULTIPART_STATE_BOUNDARY	2
+#define MULTIPART_STATE_HEADERS		3
+#define MULTIPART_STATE_DONE		4
+#define MULTIPART_STATE_ERROR		5
+
+#define MULTIPART_MODE_OFFSETS		1
+#define MULTIPART_MODE_SPOOL		2
+#define MULTIPART_MODE_CALLBACK		3
+
+/*
+ * Incremental multipart/form-data parser. Part data is only ever
+ * looked at once, carry holds the few bytes at the end of a chunk
+ * that may turn out to be the start of the next delimiter.
+ */
+struct http_multipart {
+	int			mode;
+	int			state;
+	struct http_request	*req;
+	int			(*cb)(struct http_request *,
+				    struct http_file *, const void *, size_t);
+
+	size_t			offset;
+	size_t			dlen;
+	char			delim[HTTP_BOUNDARY_MAX + 2];
+
+	size_t			clen;
+	size_t			coff;
+	u_int8_t		carry[HTTP_BOUNDARY_MAX + 2];
+
+	struct kore_buf		hdrs;
+	struct kore_buf		field;
+	char			*name;
+	struct http_file	*file;
+};
+
+/*
+ * Names for enum http_header_id, in the same order.
+ */
+static const char *http_header_names[HTTP_HEADER_ID_MAX] = {
+	"accept",
+	"accept-encoding",
+	"accept-language",
+	"authorization",
+	"cache-control",
+	"connection",
+	"content-encoding",
+	"content-length",
+	"content-type",
+	"cookie",
+	"expect",
+	"host",
+	"if-match",
+	"if-modified-since",
+	"if-none-match",
+	"if-range",
+	"if-unmodified-since",
+	"origin",
+	"pragma",
+	"range",
+	"referer",
+	"sec-websocket-extensions",
+	"sec-websocket-key",
+	"sec-websocket-protocol",
+	"sec-websocket-version",
+	"te",
+	"transfer-encoding",
+	"upgrade",
+	"user-agent",
+	"x-forwarded-for",
+	"x-forwarded-proto",
+	"x-real-ip",
+	"x-requested-with",
+};
+
+/*
+ * Perfect hash table for the well-known header names, the seed is picked
+ * in http_header_perfect_init() so that none of them collide. A slot holds
+ * the header id + 1, or 0 when empty.
+ */
+#define HTTP_HEADER_PERFECT	256
+
+static u_int32_t		http_header_seed = 0;
+static u_int8_t			http_header_perfect[HTTP_HEADER_PERFECT];
+
+/*
+ * Response header pieces that rarely change are rendered once and copied
+ * into the response: the status lines per version, the block holding the
+ * server, connection and hsts headers per connection mode and the date
+ * header, which is refreshed once per second.
+ */
+#define HTTP_STATUS_CACHE_MIN	100
+#define HTTP_STATUS_CACHE_MAX	599
+#define HTTP_STATUS_CACHE_LEN	\
+	(HTTP_STATUS_CACHE_MAX - HTTP_STATUS_CACHE_MIN + 1)
+
+#define HTTP_BLOCK_KEEPALIVE	0
+#define HTTP_BLOCK_CLOSE	1
+#define HTTP_BLOCK_NOCONN	2
+#define HTTP_BLOCK_MAX		3
+
+struct http_prerender {
+	char		*data;
+	size_t		len;
+};
+
+static struct http_prerender	http_status_lines[2][HTTP_STATUS_CACHE_LEN];
+static struct http_prerender	http_blocks[HTTP_BLOCK_MAX];
+static time_t			http_date_time = 0;
+static size_t			http_date_len = 0;
+static char			http_date[HTTP_DATE_MAXSIZE];
 
 static struct kore_buf			*header_buf;
 static struct kore_buf			*ckhdr_buf;
 static char				http_version[64];
 static u_int16_t			http_version_len;
-static TAILQ_HEAD(, http_request)	http_requests;
+static TAILQ_HEAD(, http_request)	http_requests[HTTP_PRIO_MAX];
 static TAILQ_HEAD(, http_request)	http_requests_sleeping;
 static LIST_HEAD(, http_media_type)	http_media_types;
 static struct kore_pool			http_request_pool;
-static struct kore_pool			http_cookie_pool;
+static struct http_prio_stats		http_prio[HTTP_PRIO_MAX];
+
+/*
+ * Wakeups are collected here while the worker handles its events and
+ * delivered in one go by http_process(). A request sits in the queue
+ * at most once, req->wakeup holds its slot + 1.
+ */
+static struct http_request		**http_wakeups = NULL;
+static u_int32_t			http_wakeups_len = 0;
+static u_int32_t			http_wakeups_size = 0;
+static u_int64_t			http_wakeup_batches = 0;
+static u_int64_t			http_wakeup_cancelled = 0;
+static u_int32_t			http_wakeup_batch_max = 0;
+
+/* Set when a pipelined request was parsed outside of the event loop. */
+static int				http_pipelined_ready = 0;
+static struct http_wakeup_stats		http_wakeup_src[HTTP_WAKEUP_MAX];
+
+static const char	*http_wakeup_names[HTTP_WAKEUP_MAX] = {
+	"other",
+	"task",
+	"pgsql",
+	"curl"
+};
+
+/* Share of http_request_ms each class with queued requests gets. */
+static const u_int64_t	http_prio_weight[HTTP_PRIO_MAX] = { 4, 2, 1 };
+
+static const char	*http_prio_names[HTTP_PRIO_MAX] = {
+	"high",
+	"normal",
+	"low"
+};
+static struct kore_pool			http_arena_pool;
 static struct kore_pool			http_body_path;
 static struct kore_pool			http_rlq_pool;
 
-struct kore_pool			http_header_pool;
 
 int		http_pretty_error = 0;
+int		http_server_timing = 0;
 u_int32_t	http_request_count = 0;
 u_int32_t	http_request_ms = HTTP_REQUEST_MS;
 u_int16_t	http_body_timeout = HTTP_BODY_TIMEOUT;
@@ -189,7 +416,8 @@ http_init(void)
 {
 	int		prealloc, l, i;
 
-	TAILQ_INIT(&http_requests);
+	for (i = 0; i < HTTP_PRIO_MAX; i++)
+		TAILQ_INIT(&http_requests[i]);
 	TAILQ_INIT(&http_requests_sleeping);
 
 	header_buf = kore_buf_alloc(HTTP_HEADER_BUFSIZE);
@@ -207,16 +435,21 @@ http_init(void)
 	prealloc = MIN((worker_max_connections / 10), 1000);
 	kore_pool_init(&http_request_pool, "http_request_pool",
 	    sizeof(struct http_request), http_request_limit);
-	kore_pool_init(&http_header_pool, "http_header_pool",
-	    sizeof(struct http_header), prealloc * HTTP_REQ_HEADER_MAX);
-	kore_pool_init(&http_cookie_pool, "http_cookie_pool",
-		sizeof(struct http_cookie), prealloc * HTTP_MAX_COOKIES);
+	kore_pool_init(&http_arena_pool, "http_arena_pool",
+	    HTTP_ARENA_PAGE, prealloc);
 	kore_pool_init(&http_rlq_pool, "http_rlq_pool",
 		sizeof(struct http_runlock_queue), http_request_limit);
 
 	kore_pool_init(&http_body_path,
 	    "http_body_path", HTTP_BODY_PATH_MAX, prealloc);
 
+	http_header_perfect_init();
+	kore_websocket_init();
+
+#if defined(KORE_USE_HTTP2)
+	http2_init();
+#endif
+
 	for (i = 0; builtin_media[i].ext != NULL; i++) {
 		if (!http_media_register(builtin_media[i].ext,
 		    builtin_media[i].type)) {
@@ -239,9 +472,27 @@ http_cleanup(void)
 		ckhdr_buf = NULL;
 	}
 
+	if (http_wakeups != NULL) {
+		kore_free(http_wakeups);
+		http_wakeups = NULL;
+		http_wakeups_len = 0;
+		http_wakeups_size = 0;
+	}
+
 	kore_pool_cleanup(&http_request_pool);
-	kore_pool_cleanup(&http_header_pool);
+	kore_pool_cleanup(&http_arena_pool);
 	kore_pool_cleanup(&http_body_path);
+
+#if defined(KORE_USE_HTTP2)
+	http2_cleanup();
+#endif
+
+#if defined(KORE_USE_ZLIB)
+	http_compress_cleanup();
+#endif
+
+	kore_websocket_cleanup();
+	http_prerender_cleanup();
 }
 
 void
@@ -255,6 +506,7 @@ http_server_version(const char *version)
 		fatal("http_server_version(): http_version buffer too small");
 
 	http_version_len = l;
+	http_prerender_cleanup();
 }
 
 int
@@ -282,57 +534,163 @@ http_check_timeout(struct connection *c, u_int64_t now)
 void
 http_request_sleep(struct http_request *req)
 {
+	KORE_PROBE1(http_request_sleep, req);
+
 	if (!(req->flags & HTTP_REQUEST_SLEEPING)) {
 		kore_debug("http_request_sleep: %p napping", req);
 
 		req->flags |= HTTP_REQUEST_SLEEPING;
-		TAILQ_REMOVE(&http_requests, req, list);
+		TAILQ_REMOVE(&http_requests[req->prio], req, list);
 		TAILQ_INSERT_TAIL(&http_requests_sleeping, req, list);
+
+		if (req->flags & HTTP_REQUEST_STARTED) {
+			req->timing.sleep_start = kore_time_us();
+			req->timing.sleeps++;
+		}
+	} else if (req->wakeup != 0) {
+		/* Going back to sleep before the wakeup was delivered. */
+		http_wakeups[req->wakeup - 1] = NULL;
+		req->wakeup = 0;
+		http_wakeup_cancelled++;
 	}
 }
 
+/*
+ * The request has everything it needs to run, its deadline for
+ * shedding starts now.
+ */
+void
+http_request_ready(struct http_request *req)
+{
+	req->flags |= HTTP_REQUEST_COMPLETE;
+	req->ready = kore_time_ms();
+}
+
 void
 http_request_wakeup(struct http_request *req)
 {
-	if (req->flags & HTTP_REQUEST_SLEEPING) {
-		kore_debug("http_request_wakeup: %p woke up", req);
+	http_request_wakeup_from(req, HTTP_WAKEUP_OTHER);
+}
 
-		req->flags &= ~HTTP_REQUEST_SLEEPING;
-		TAILQ_REMOVE(&http_requests_sleeping, req, list);
-		TAILQ_INSERT_TAIL(&http_requests, req, list);
+/*
+ * Queue a sleeping request to be woken up by the next http_process().
+ * Any further wakeups before then are folded into the first one.
+ */
+void
+http_request_wakeup_from(struct http_request *req, int source)
+{
+	if (source < 0 || source >= HTTP_WAKEUP_MAX)
+		fatal("http_request_wakeup_from: bad source %d", source);
+
+	if (!(req->flags & HTTP_REQUEST_SLEEPING))
+		return;
+
+	KORE_PROBE2(http_request_wakeup, req, source);
+	http_wakeup_src[source].posted++;
+
+	if (req->wakeup != 0) {
+		http_wakeup_src[source].coalesced++;
+		return;
+	}
+
+	if (http_wakeups_len == http_wakeups_size) {
+		http_wakeups_size = MAX(64, http_wakeups_size * 2);
+		http_wakeups = kore_realloc(http_wakeups,
+		    http_wakeups_size * sizeof(*http_wakeups));
+	}
+
+	http_wakeups[http_wakeups_len++] = req;
+	req->wakeup = http_wakeups_len;
+}
+
+int
+http_wakeup_pending(void)
+{
+	return (http_wakeups_len > 0 || http_pipelined_ready);
+}
+
+const struct http_wakeup_stats *
+http_wakeup_stats_get(int source)
+{
+	if (source < 0 || source >= HTTP_WAKEUP_MAX)
+		return (NULL);
+
+	return (&http_wakeup_src[source]);
+}
+
+void
+http_wakeup_log(void)
+{
+	int				i;
+	const struct http_wakeup_stats	*st;
+
+	for (i = 0; i < HTTP_WAKEUP_MAX; i++) {
+		st = &http_wakeup_src[i];
+		if (st->posted == 0)
+			continue;
+
+		kore_log(LOG_INFO, "wakeups from %s: %" PRIu64 " posted, %"
+		    PRIu64 " coalesced", http_wakeup_names[i], st->posted,
+		    st->coalesced);
 	}
+
+	kore_log(LOG_INFO, "wakeups: %" PRIu64 " batches, largest %u, %"
+	    PRIu64 " cancelled", http_wakeup_batches, http_wakeup_batch_max,
+	    http_wakeup_cancelled);
 }
 
+/*
+ * Run the queued requests, class by class. Every class that has
+ * requests gets its weighted share of http_request_ms.
+ */
 void
 http_process(void)
 {
-	u_int64_t			total;
+	int				prio;
 	struct http_request		*req, *next;
+	u_int64_t			total, budget, weights;
 
-	total = 0;
+	http_wakeups_deliver();
+	http_pipelined_ready = 0;
 
-	for (req = TAILQ_FIRST(&http_requests); req != NULL; req = next) {
-		if (total >= http_request_ms)
-			break;
+	weights = 0;
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!TAILQ_EMPTY(&http_requests[prio]))
+			weights += http_prio_weight[prio];
+	}
 
-		next = TAILQ_NEXT(req, list);
-		if (req->flags & HTTP_REQUEST_DELETE) {
-			http_request_free(req);
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (TAILQ_EMPTY(&http_requests[prio]))
 			continue;
-		}
 
-		/* Sleeping requests should be in http_requests_sleeping. */
-		if (req->flags & HTTP_REQUEST_SLEEPING)
-			fatal("http_process: sleeping request on list");
+		budget = (http_request_ms * http_prio_weight[prio]) / weights;
+		budget = MAX(budget, 1);
+		total = 0;
 
-		if (!(req->flags & HTTP_REQUEST_COMPLETE))
-			continue;
+		for (req = TAILQ_FIRST(&http_requests[prio]);
+		    req != NULL; req = next) {
+			if (total >= budget)
+				break;
+
+			next = TAILQ_NEXT(req, list);
+			if (req->flags & HTTP_REQUEST_DELETE) {
+				http_request_free(req);
+				continue;
+			}
+
+			/* Sleeping requests should be in http_requests_sleeping. */
+			if (req->flags & HTTP_REQUEST_SLEEPING)
+				fatal("http_process: sleeping request on list");
+
+			if (!(req->flags & HTTP_REQUEST_COMPLETE))
+				continue;
 
-		http_process_request(req);
-		total += req->ms;
+			http_process_request(req);
+			total += req->ms;
 
-		if (req->flags & HTTP_REQUEST_DELETE)
-			http_request_free(req);
+			if (req->flags & HTTP_REQUEST_DELETE)
+				http_request_free(req);
+		}
 	}
 }
 
@@ -348,38 +706,65 @@ http_process_request(struct http_request *req)
 		return;
 
 	req->start = kore_time_ms();
-	if (req->hdlr->auth != NULL && !(req->flags & HTTP_REQUEST_AUTHED))
-		r = kore_auth_run(req, req->hdlr->auth);
-	else
-		r = KORE_RESULT_OK;
+	KORE_PROBE1(http_process_start, req);
 
-	switch (r) {
-	case KORE_RESULT_OK:
-		r = kore_runtime_http_request(req->hdlr->rcall, req);
-		break;
-	case KORE_RESULT_RETRY:
-		break;
-	case KORE_RESULT_ERROR:
-		/*
-		 * Set r to KORE_RESULT_OK so we can properly
-		 * flush the result from kore_auth_run().
-		 */
+	if (!(req->flags & HTTP_REQUEST_STARTED) && http_request_shed(req)) {
+		http_response(req, HTTP_STATUS_SERVICE_UNAVAILABLE, NULL, 0);
 		r = KORE_RESULT_OK;
-		break;
-	default:
-		fatal("kore_auth() returned unknown %d", r);
+	} else {
+		if (req->hdlr->auth != NULL &&
+		    !(req->flags & HTTP_REQUEST_AUTHED))
+			r = kore_auth_run(req, req->hdlr->auth);
+		else
+			r = KORE_RESULT_OK;
+
+		switch (r) {
+		case KORE_RESULT_OK:
+			if (req->hdlr->cache != NULL &&
+			    !(req->flags & HTTP_REQUEST_CACHE_CHECKED)) {
+				req->flags |= HTTP_REQUEST_CACHE_CHECKED;
+				if (http_cache_lookup(req))
+					break;
+			}
+			r = kore_runtime_http_request(req->hdlr->rcall, req);
+			break;
+		case KORE_RESULT_RETRY:
+			break;
+		case KORE_RESULT_ERROR:
+			/*
+			 * Set r to KORE_RESULT_OK so we can properly
+			 * flush the result from kore_auth_run().
+			 */
+			r = KORE_RESULT_OK;
+			break;
+		default:
+			fatal("kore_auth() returned unknown %d", r);
+		}
 	}
 	req->end = kore_time_ms();
 	req->ms = req->end - req->start;
 	req->total += req->ms;
 
+	KORE_PROBE3(http_process_end, req, r, req->status);
+	kore_worker_loop_note(req->hdlr->func, req->path, req->ms);
+
 	switch (r) {
 	case KORE_RESULT_OK:
 		r = net_send_flush(req->owner);
 		if (r == KORE_RESULT_ERROR)
 			kore_connection_disconnect(req->owner);
+		else if (TAILQ_EMPTY(&req->owner->send_queue))
+			req->timing.flushed = kore_time_us();
 		break;
 	case KORE_RESULT_ERROR:
+#if defined(KORE_USE_HTTP2)
+		/* Only the stream goes, not the other requests on it. */
+		if (req->owner->proto == CONN_PROTO_HTTP2) {
+			if (!http2_request_reset(req))
+				kore_connection_disconnect(req->owner);
+			break;
+		}
+#endif
 		kore_connection_disconnect(req->owner);
 		break;
 	case KORE_RESULT_RETRY:
@@ -388,12 +773,51 @@ http_process_request(struct http_request *req)
 		fatal("A page handler returned an unknown result: %d", r);
 	}
 
+	kore_metrics_request(req);
+
 	if (req->hdlr->dom->accesslog)
 		kore_accesslog(req);
 
 	req->flags |= HTTP_REQUEST_DELETE;
 }
 
+const char *
+http_prio_name(int prio)
+{
+	if (prio < 0 || prio >= HTTP_PRIO_MAX)
+		return (NULL);
+
+	return (http_prio_names[prio]);
+}
+
+const struct http_prio_stats *
+http_prio_stats_get(int prio)
+{
+	if (prio < 0 || prio >= HTTP_PRIO_MAX)
+		return (NULL);
+
+	return (&http_prio[prio]);
+}
+
+void
+http_prio_log(void)
+{
+	int				prio;
+	const struct http_prio_stats	*st;
+
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		st = &http_prio[prio];
+		if (st->started == 0 && st->queued == 0)
+			continue;
+
+		kore_log(LOG_INFO, "class %s: %u queued, %" PRIu64 " started, %"
+		    PRIu64 " shed, wait avg %" PRIu64 "ms max %" PRIu64 "ms",
+		    http_prio_names[prio], st->queued, st->started, st->shed,
+		    st->started ? st->wait_total / st->started : 0,
+		    st->wait_max);
+	}
+}
+
 void
 http_response_header(struct http_request *req,
     const char *header, const char *value)
@@ -402,12 +826,85 @@ http_response_header(struct http_request *req,
 
 	kore_debug("http_response_header(%p, %s, %s)", req, header, value);
 
-	hdr = kore_pool_get(&http_header_pool);
-	hdr->header = kore_strdup(header);
-	hdr->value = kore_strdup(value);
+	hdr = http_request_alloc(req, sizeof(*hdr));
+	hdr->header = http_request_strdup(req, header);
+	hdr->value = http_request_strdup(req, value);
 	TAILQ_INSERT_TAIL(&(req->resp_headers), hdr, list);
 }
 
+const char *
+http_response_header_get(struct http_request *req, const char *header)
+{
+	struct http_header	*hdr;
+
+	TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+		if (!strcasecmp(hdr->header, header))
+			return (hdr->value);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Check if the client listed the given content-coding (or "*") in its
+ * accept-encoding header without giving it a quality of zero.
+ */
+int
+http_request_accepts_encoding(struct http_request *req, const char *coding)
+{
+	size_t		len, clen;
+	int		match, wildcard;
+	const char	*p, *end, *param;
+
+	if (!http_request_header_id(req, HTTP_HEADER_ACCEPT_ENCODING, &p))
+		return (KORE_RESULT_ERROR);
+
+	wildcard = -1;
+	clen = strlen(coding);
+
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		if ((end = strchr(p, ',')) == NULL)
+			end = p + strlen(p);
+
+		for (len = 0; p + len < end; len++) {
+			if (p[len] == ';' || p[len] == ' ' || p[len] == '\t')
+				break;
+		}
+
+		match = 1;
+		if ((param = memchr(p, ';', end - p)) != NULL) {
+			param++;
+			while (*param == ' ' || *param == '\t')
+				param++;
+			if ((*param == 'q' || *param == 'Q') && param[1] == '=') {
+				param += 2;
+				if (*param == '0') {
+					match = 0;
+					for (param++; param < end &&
+					    (*param == '.' || *param == '0'); param++)
+						;
+					if (param < end && *param >= '1' &&
+					    *param <= '9')
+						match = 1;
+				}
+			}
+		}
+
+		if (len == clen && !strncasecmp(p, coding, len))
+			return (match);
+
+		if (len == 1 && *p == '*')
+			wildcard = match;
+
+		p = end;
+	}
+
+	return (wildcard == 1);
+}
+
 void
 http_request_free(struct http_request *req)
 {
@@ -422,9 +919,8 @@ http_request_free(struct http_request *req)
 	struct kore_curl	*client;
 #endif
 	struct http_file	*f, *fnext;
-	struct http_arg		*q, *qnext;
-	struct http_header	*hdr, *next;
-	struct http_cookie	*ck, *cknext;
+
+	KORE_PROBE1(http_request_free, req);
 
 	if (req->onfree != NULL)
 		req->onfree(req);
@@ -460,6 +956,8 @@ http_request_free(struct http_request *req)
 		kore_python_coro_delete(req->py_validator);
 		req->py_validator = NULL;
 	}
+	if (req->py_body != NULL)
+		kore_python_body_detach(req);
 	Py_XDECREF(req->py_req);
 #endif
 #if defined(KORE_USE_PGSQL)
@@ -475,67 +973,65 @@ http_request_free(struct http_request *req)
 	}
 #endif
 	kore_debug("http_request_free: %p->%p", req->owner, req);
-	kore_free(req->headers);
+	net_recvbuf_put(req->headers);
+
+#if defined(KORE_USE_HTTP2)
+	if (req->h2_stream != NULL)
+		http2_request_free(req);
+#endif
 
 	req->host = NULL;
 	req->path = NULL;
 	req->headers = NULL;
 
-	TAILQ_REMOVE(&http_requests, req, list);
-	if (req->owner != NULL)
-		TAILQ_REMOVE(&(req->owner->http_requests), req, olist);
-
-	for (hdr = TAILQ_FIRST(&(req->resp_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-		TAILQ_REMOVE(&(req->resp_headers), hdr, list);
-		kore_free(hdr->header);
-		kore_free(hdr->value);
-		kore_pool_put(&http_header_pool, hdr);
-	}
-
-	for (hdr = TAILQ_FIRST(&(req->req_headers)); hdr != NULL; hdr = next) {
-		next = TAILQ_NEXT(hdr, list);
-		TAILQ_REMOVE(&(req->req_headers), hdr, list);
-		kore_pool_put(&http_header_pool, hdr);
+	if (req->wakeup != 0) {
+		http_wakeups[req->wakeup - 1] = NULL;
+		req->wakeup = 0;
 	}
 
-	for (ck = TAILQ_FIRST(&(req->resp_cookies)); ck != NULL; ck = cknext) {
-		cknext = TAILQ_NEXT(ck, list);
-		TAILQ_REMOVE(&(req->resp_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
-		kore_free(ck->path);
-		kore_free(ck->domain);
-		kore_pool_put(&http_cookie_pool, ck);
-	}
+	if (req->flags & HTTP_REQUEST_SLEEPING)
+		TAILQ_REMOVE(&http_requests_sleeping, req, list);
+	else
+		TAILQ_REMOVE(&http_requests[req->prio], req, list);
 
-	for (ck = TAILQ_FIRST(&(req->req_cookies)); ck != NULL; ck = cknext) {
-		cknext = TAILQ_NEXT(ck, list);
-		TAILQ_REMOVE(&(req->req_cookies), ck, list);
-		kore_free(ck->name);
-		kore_free(ck->value);
-		kore_pool_put(&http_cookie_pool, ck);
-	}
+	if (!(req->flags & HTTP_REQUEST_STARTED))
+		http_prio[req->prio].queued--;
 
-	for (q = TAILQ_FIRST(&(req->arguments)); q != NULL; q = qnext) {
-		qnext = TAILQ_NEXT(q, list);
-		TAILQ_REMOVE(&(req->arguments), q, list);
-		kore_free(q->name);
-		kore_free(q->s_value);
-		kore_free(q);
-	}
+	if (req->owner != NULL)
+		TAILQ_REMOVE(&(req->owner->http_requests), req, olist);
 
 	for (f = TAILQ_FIRST(&(req->files)); f != NULL; f = fnext) {
 		fnext = TAILQ_NEXT(f, list);
 		TAILQ_REMOVE(&(req->files), f, list);
-		kore_free(f->filename);
-		kore_free(f->name);
-		kore_free(f);
+		multipart_file_free(f);
+	}
+
+	if (req->multipart != NULL) {
+		multipart_free(req->multipart);
+		req->multipart = NULL;
 	}
 
+	/* A piece still in flight releases the stream once it is sent. */
+	if (req->json_stream != NULL) {
+		req->json_stream->req = NULL;
+		if (!(req->json_stream->flags & HTTP_JSON_STREAM_SENDING))
+			http_json_stream_free(req->json_stream);
+		req->json_stream = NULL;
+	}
+
+	http_cache_release(req);
+
 	if (req->http_body != NULL)
 		kore_buf_free(req->http_body);
 
+	if (req->body_pending != NULL)
+		kore_buf_free(req->body_pending);
+
+	/* A streamed body may still be coming in for this request. */
+	if (req->owner != NULL && req->owner->proto == CONN_PROTO_HTTP &&
+	    req->owner->rnb != NULL && req->owner->rnb->extra == req)
+		req->owner->rnb->extra = NULL;
+
 	if (req->http_body_fd != -1)
 		(void)close(req->http_body_fd);
 
@@ -551,10 +1047,73 @@ http_request_free(struct http_request *req)
 	    !(req->flags & HTTP_REQUEST_RETAIN_EXTRA))
 		kore_free(req->hdlr_extra);
 
+	/* Headers, cookies and arguments all live in the arena. */
+	http_arena_reset(req);
+
 	kore_pool_put(&http_request_pool, req);
 	http_request_count--;
 }
 
+/*
+ * Memory that is released together with the request, for anything
+ * that is needed up until the request is freed.
+ */
+void *
+http_request_alloc(struct http_request *req, size_t len)
+{
+	u_int8_t		*ptr;
+	struct http_arena	*page;
+
+	if (len > SIZE_MAX - (HTTP_ARENA_ALIGN - 1) - HTTP_ARENA_HDR)
+		fatal("http_request_alloc: %zu bytes", len);
+
+	len = (len + (HTTP_ARENA_ALIGN - 1)) & ~(size_t)(HTTP_ARENA_ALIGN - 1);
+
+	/* Too large for a page, it gets a chunk of its own. */
+	if (len > HTTP_ARENA_PAGE - HTTP_ARENA_HDR) {
+		page = kore_malloc(HTTP_ARENA_HDR + len);
+		page->size = HTTP_ARENA_HDR + len;
+		page->offset = page->size;
+
+		if (req->arena != NULL) {
+			page->next = req->arena->next;
+			req->arena->next = page;
+		} else {
+			page->next = NULL;
+			req->arena = page;
+		}
+
+		return ((u_int8_t *)page + HTTP_ARENA_HDR);
+	}
+
+	page = req->arena;
+	if (page == NULL || page->size - page->offset < len) {
+		page = kore_pool_get(&http_arena_pool);
+		page->size = HTTP_ARENA_PAGE;
+		page->offset = HTTP_ARENA_HDR;
+		page->next = req->arena;
+		req->arena = page;
+	}
+
+	ptr = (u_int8_t *)page + page->offset;
+	page->offset += len;
+
+	return (ptr);
+}
+
+char *
+http_request_strdup(struct http_request *req, const char *str)
+{
+	size_t		len;
+	char		*nstr;
+
+	len = strlen(str) + 1;
+	nstr = http_request_alloc(req, len);
+	memcpy(nstr, str, len);
+
+	return (nstr);
+}
+
 void
 http_serveable(struct http_request *req, const void *data, size_t len,
     const char *etag, const char *type)
@@ -567,7 +1126,7 @@ http_serveable(struct http_request *req, const void *data, size_t len,
 		return;
 	}
 
-	if (http_request_header(req, "if-none-match", &match)) {
+	if (http_request_header_id(req, HTTP_HEADER_IF_NONE_MATCH, &match)) {
 		if (!strcmp(match, etag)) {
 			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
 			return;
@@ -582,24 +1141,87 @@ http_serveable(struct http_request *req, const void *data, size_t len,
 void
 http_response(struct http_request *req, int status, const void *d, size_t l)
 {
+#if defined(KORE_USE_ZLIB)
+	struct kore_buf		gz;
+#endif
+
 	if (req->owner == NULL)
 		return;
 
 	kore_debug("http_response(%p, %d, %p, %zu)", req, status, d, l);
 
-	req->status = status;
-	switch (req->owner->proto) {
-	case CONN_PROTO_HTTP:
-	case CONN_PROTO_WEBSOCKET:
-		http_response_normal(req, req->owner, status, d, l);
-		break;
-	default:
-		fatal("http_response() bad proto %d", req->owner->proto);
-		/* NOTREACHED. */
+	if (req->cache_state == HTTP_CACHE_FILLING)
+		http_cache_store(req, status, d, l);
+
+#if defined(KORE_USE_ZLIB)
+	kore_buf_init(&gz, 0);
+	if (http_compress_response(req, status, d, l, &gz)) {
+		d = gz.data;
+		l = gz.offset;
 	}
+#endif
+
+	http_response_send(req, status, d, l);
+
+#if defined(KORE_USE_ZLIB)
+	kore_buf_cleanup(&gz);
+#endif
 }
 
-void
+/*
+ * Respond with the contents of buf without copying them, buf is taken
+ * over and its data is freed once it has been sent.
+ */
+void
+http_response_buf(struct http_request *req, int status, struct kore_buf *buf)
+{
+	size_t		len;
+	u_int8_t	*data;
+
+	data = kore_buf_release(buf, &len);
+	http_response_owned(req, status, data, len,
+	    http_response_buf_sent, data);
+}
+
+/*
+ * Bodies shared between responses, each response holds a reference
+ * until its copy of the body is out. The creator holds the first one.
+ */
+struct http_body_ref *
+http_body_ref_create(struct kore_buf *buf)
+{
+	struct http_body_ref	*ref;
+
+	ref = kore_malloc(sizeof(*ref));
+	ref->data = kore_buf_release(buf, &ref->length);
+	ref->refs = 1;
+
+	return (ref);
+}
+
+void
+http_body_ref_release(struct http_body_ref *ref)
+{
+	if (ref->refs == 0)
+		fatal("http_body_ref_release: refs == 0");
+
+	if (--ref->refs > 0)
+		return;
+
+	kore_free(ref->data);
+	kore_free(ref);
+}
+
+void
+http_response_body_ref(struct http_request *req, int status,
+    struct http_body_ref *ref)
+{
+	ref->refs++;
+	http_response_owned(req, status, ref->data, ref->length,
+	    http_body_ref_sent, ref);
+}
+
+void
 http_response_stream(struct http_request *req, int status, void *base,
     size_t len, int (*cb)(struct netbuf *), void *arg)
 {
@@ -614,6 +1236,14 @@ http_response_stream(struct http_request *req, int status, void *base,
 	case CONN_PROTO_HTTP:
 		http_response_normal(req, req->owner, status, NULL, len);
 		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http_response_h2(req, req->owner, status, NULL, len,
+		    req->method != HTTP_METHOD_HEAD);
+		if (req->method != HTTP_METHOD_HEAD)
+			http2_response_stream(req, base, len, cb, arg);
+		return;
+#endif
 	default:
 		fatal("http_response_stream() bad proto %d", req->owner->proto);
 		/* NOTREACHED. */
@@ -625,73 +1255,662 @@ http_response_stream(struct http_request *req, int status, void *base,
 	}
 }
 
+/*
+ * Start a response whose body is handed over in pieces through
+ * http_response_chunk() and finished with http_response_chunk_end().
+ * HTTP/1.1 uses chunked transfer encoding, HTTP/1.0 ends the body by
+ * closing the connection and HTTP/2 sends every piece as DATA frames.
+ */
+void
+http_response_chunked(struct http_request *req, int status)
+{
+	struct connection	*c;
+
+	if ((c = req->owner) == NULL)
+		return;
+
+	req->status = status;
+	req->content_length = 0;
+	req->flags |= HTTP_REQUEST_NO_CONTENT_LENGTH;
+
+	switch (c->proto) {
+	case CONN_PROTO_HTTP:
+		if (!(req->flags & HTTP_VERSION_1_0)) {
+			http_response_header(req,
+			    "transfer-encoding", "chunked");
+		}
+
+		c->flags |= CONN_IS_BUSY | CONN_CHUNKED;
+		http_response_normal(req, c, status, NULL, 0);
+
+		/* An empty send queue is no reason to close mid body. */
+		if (c->flags & CONN_CLOSE_EMPTY) {
+			c->flags &= ~CONN_CLOSE_EMPTY;
+			c->flags |= CONN_CLOSE_CHUNKED;
+		}
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http_response_h2(req, c, status, NULL, 0,
+		    req->method != HTTP_METHOD_HEAD);
+		http2_response_chunked(req);
+		break;
+#endif
+	default:
+		fatal("http_response_chunked() bad proto %d", c->proto);
+		/* NOTREACHED. */
+	}
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+/*
+ * Send the next piece of a chunked response. The data is sent in place
+ * and cb is called with arg once it went out, only one piece can be in
+ * flight so the next one should be handed over from there.
+ */
+void
+http_response_chunk(struct http_request *req, void *data, size_t len,
+    int (*cb)(struct netbuf *), void *arg)
+{
+	struct netbuf		*nb;
+	struct connection	*c;
+
+	if ((c = req->owner) == NULL)
+		return;
+
+	req->content_length += len;
+
+	switch (c->proto) {
+	case CONN_PROTO_HTTP:
+		if (!(c->flags & CONN_CHUNKED))
+			fatal("%s: response is not chunked", __func__);
+
+		if (len == 0 || req->method == HTTP_METHOD_HEAD) {
+			if (cb != NULL) {
+				net_send_stream(c, NULL, 0, cb, &nb);
+				nb->extra = arg;
+			}
+			break;
+		}
+
+		if (req->flags & HTTP_VERSION_1_0) {
+			net_send_stream(c, data, len, cb, &nb);
+			nb->extra = arg;
+			break;
+		}
+
+		kore_buf_reset(header_buf);
+		kore_buf_append_hex(header_buf, len);
+		kore_buf_append(header_buf, "\r\n", 2);
+
+		net_send_queue(c, header_buf->data, header_buf->offset);
+		net_send_stream(c, data, len, cb, &nb);
+		nb->extra = arg;
+		net_send_queue(c, "\r\n", 2);
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		if (len == 0) {
+			if (cb != NULL) {
+				net_send_stream(c, NULL, 0, cb, &nb);
+				nb->extra = arg;
+			}
+			break;
+		}
+		http2_response_stream(req, data, len, cb, arg);
+		break;
+#endif
+	default:
+		fatal("http_response_chunk() bad proto %d", c->proto);
+		/* NOTREACHED. */
+	}
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+void
+http_response_chunk_end(struct http_request *req)
+{
+	struct connection	*c;
+
+	if ((c = req->owner) == NULL)
+		return;
+
+	switch (c->proto) {
+	case CONN_PROTO_HTTP:
+		if (!(c->flags & CONN_CHUNKED))
+			fatal("%s: response is not chunked", __func__);
+
+		if (!(req->flags & HTTP_VERSION_1_0) &&
+		    req->method != HTTP_METHOD_HEAD)
+			net_send_queue(c, "0\r\n\r\n", 5);
+
+		c->flags &= ~(CONN_IS_BUSY | CONN_CHUNKED);
+
+		if (c->flags & CONN_CLOSE_CHUNKED) {
+			c->flags &= ~CONN_CLOSE_CHUNKED;
+			c->flags |= CONN_CLOSE_EMPTY;
+		} else {
+			http_start_recv(c);
+		}
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http2_response_chunk_end(req);
+		break;
+#endif
+	default:
+		fatal("http_response_chunk_end() bad proto %d", c->proto);
+		/* NOTREACHED. */
+	}
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+/*
+ * Start a chunked JSON response and return the writer for its body.
+ * Output is sent in pieces of about HTTP_JSON_STREAM_CHUNK bytes so the
+ * document never has to be in memory as a whole.
+ *
+ * Between writes the handler checks http_response_json_ready(), which
+ * returns KORE_RESULT_RETRY when the handler has to return that and
+ * continue writing once woken up. The document is completed with
+ * http_response_json_end(), called until it no longer returns
+ * KORE_RESULT_RETRY.
+ */
+struct kore_json_writer *
+http_response_json(struct http_request *req, int status, int flags)
+{
+	struct http_json_stream		*js;
+
+	if (req->json_stream != NULL)
+		fatal("%s: JSON response already started", __func__);
+
+	js = kore_calloc(1, sizeof(*js));
+	js->req = req;
+
+	kore_buf_init(&js->pending, HTTP_JSON_STREAM_CHUNK);
+	kore_buf_init(&js->inflight, HTTP_JSON_STREAM_CHUNK);
+	kore_json_writer_init(&js->writer, &js->pending, flags);
+
+	req->json_stream = js;
+
+	http_response_header(req, "content-type", "application/json");
+	http_response_chunked(req, status);
+
+	return (&js->writer);
+}
+
+int
+http_response_json_ready(struct http_request *req)
+{
+	struct http_json_stream		*js = req->json_stream;
+
+	if (js == NULL)
+		fatal("%s: no JSON response started", __func__);
+
+	if (req->owner == NULL) {
+		kore_buf_reset(&js->pending);
+		return (KORE_RESULT_RETRY);
+	}
+
+	if (js->pending.offset < HTTP_JSON_STREAM_CHUNK)
+		return (KORE_RESULT_OK);
+
+	if (js->flags & HTTP_JSON_STREAM_SENDING) {
+		http_request_sleep(req);
+		return (KORE_RESULT_RETRY);
+	}
+
+	http_json_stream_flush(js);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * An incomplete document must not look complete downstream: HTTP/1.x
+ * drops the connection and HTTP/2 resets the stream once the request
+ * is freed.
+ */
+int
+http_response_json_end(struct http_request *req)
+{
+	struct http_json_stream		*js = req->json_stream;
+
+	if (js == NULL)
+		fatal("%s: no JSON response started", __func__);
+
+	if (req->owner == NULL)
+		return (KORE_RESULT_OK);
+
+	if (js->flags & HTTP_JSON_STREAM_SENDING) {
+		http_request_sleep(req);
+		return (KORE_RESULT_RETRY);
+	}
+
+	if (!(js->flags & HTTP_JSON_STREAM_FINISHED)) {
+		js->flags |= HTTP_JSON_STREAM_FINISHED;
+
+		if (!kore_json_writer_finish(&js->writer)) {
+			kore_log(LOG_NOTICE, "JSON response for %s: %s",
+			    req->path, kore_json_writer_strerror(&js->writer));
+			if (req->owner->proto == CONN_PROTO_HTTP)
+				kore_connection_disconnect(req->owner);
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	/* The piece may have gone out right away, without a wakeup. */
+	if (js->pending.offset > 0) {
+		http_json_stream_flush(js);
+		if (js->flags & HTTP_JSON_STREAM_SENDING) {
+			http_request_sleep(req);
+			return (KORE_RESULT_RETRY);
+		}
+	}
+
+	http_response_chunk_end(req);
+
+	return (KORE_RESULT_OK);
+}
+
 void
 http_response_fileref(struct http_request *req, int status,
     struct kore_fileref *ref)
 {
-	struct tm	*tm;
-	time_t		mtime;
-	char		tbuf[128];
-	const char	*media_type, *modified;
+	int			i, cnt, preset;
+	off_t			off, len, end;
+	const char		*media_type;
+	struct http_range	ranges[HTTP_RANGE_MAX];
+	char			crange[128];
 
 	if (req->owner == NULL)
 		return;
 
-	media_type = http_media_type(ref->path);
-	if (media_type != NULL)
-		http_response_header(req, "content-type", media_type);
+	/* Precompressed filemap siblings already set the original type. */
+	if ((media_type = http_response_header_get(req,
+	    "content-type")) != NULL) {
+		preset = 1;
+	} else {
+		preset = 0;
+		media_type = http_media_type(ref->path);
+	}
 
-	if (http_request_header(req, "if-modified-since", &modified)) {
-		mtime = kore_date_to_time(modified);
-		if (mtime == ref->mtime_sec) {
-			kore_fileref_release(ref);
-			http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
-			return;
-		}
+	http_response_header(req, "etag", ref->etag);
+	if (ref->modified[0] != '\0')
+		http_response_header(req, "last-modified", ref->modified);
+
+	if (status == HTTP_STATUS_OK && http_fileref_fresh(req, ref)) {
+		kore_fileref_release(ref);
+		http_response(req, HTTP_STATUS_NOT_MODIFIED, NULL, 0);
+		return;
+	}
+
+	cnt = 0;
+	if (status == HTTP_STATUS_OK) {
+		http_response_header(req, "accept-ranges", "bytes");
+		cnt = http_range_parse(req, ref, ranges);
+	}
+
+	if (cnt == -1) {
+		(void)snprintf(crange, sizeof(crange), "bytes */%lld",
+		    (long long)ref->size);
+		http_response_header(req, "content-range", crange);
+		kore_fileref_release(ref);
+		http_response(req, HTTP_STATUS_REQUEST_RANGE_INVALID, NULL, 0);
+		return;
+	}
+
+	if (cnt > 1 && req->owner->proto == CONN_PROTO_HTTP && !preset) {
+		http_response_byteranges(req, ref, ranges, cnt, media_type);
+		return;
 	}
 
-	if ((tm = gmtime(&ref->mtime_sec)) != NULL) {
-		if (strftime(tbuf, sizeof(tbuf),
-		    "%a, %d %b %Y %H:%M:%S GMT", tm) > 0) {
-			http_response_header(req, "last-modified", tbuf);
+	if (!preset && media_type != NULL)
+		http_response_header(req, "content-type", media_type);
+
+	if (cnt > 0) {
+		/*
+		 * Where multipart/byteranges is not an option we coalesce
+		 * the ranges into one, which RFC 7233 allows.
+		 */
+		off = ranges[0].start;
+		end = ranges[0].start + ranges[0].len;
+		for (i = 1; i < cnt; i++) {
+			off = MIN(off, ranges[i].start);
+			end = MAX(end, ranges[i].start + ranges[i].len);
 		}
+		len = end - off;
+
+		(void)snprintf(crange, sizeof(crange), "bytes %lld-%lld/%lld",
+		    (long long)off, (long long)(end - 1), (long long)ref->size);
+		http_response_header(req, "content-range", crange);
+		status = HTTP_STATUS_PARTIAL_CONTENT;
+	} else {
+		off = 0;
+		len = ref->size;
+#if defined(KORE_USE_ZLIB)
+		if (http_compress_fileref(req, status, ref, media_type))
+			return;
+#endif
 	}
 
 	req->status = status;
 	switch (req->owner->proto) {
 	case CONN_PROTO_HTTP:
-		http_response_normal(req, req->owner, status, NULL, ref->size);
+		http_response_normal(req, req->owner, status, NULL, len);
 		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http_response_h2(req, req->owner, status, NULL, len,
+		    req->method != HTTP_METHOD_HEAD);
+		if (req->method != HTTP_METHOD_HEAD)
+			http2_response_fileref(req, ref, off, len);
+		else
+			kore_fileref_release(ref);
+		return;
+#endif
 	default:
 		fatal("http_response_fd() bad proto %d", req->owner->proto);
 		/* NOTREACHED. */
 	}
 
-	if (req->method != HTTP_METHOD_HEAD)
-		net_send_fileref(req->owner, ref);
-	else
-		kore_fileref_release(ref);
+	if (req->method != HTTP_METHOD_HEAD)
+		net_send_fileref_range(req->owner, ref, off, len);
+	else
+		kore_fileref_release(ref);
+}
+
+/*
+ * Parse the Range header against the fileref. Returns the number of
+ * ranges to send, 0 to send the whole file or -1 if none of the ranges
+ * can be satisfied.
+ */
+static int
+http_range_parse(struct http_request *req, struct kore_fileref *ref,
+    struct http_range *ranges)
+{
+	int		cnt, skip;
+	off_t		start, end;
+	const char	*hdr, *p;
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (0);
+
+	if (ref->size <= 0)
+		return (0);
+
+	if (!http_request_header_id(req, HTTP_HEADER_RANGE, &hdr))
+		return (0);
+
+	if (strncasecmp(hdr, "bytes=", 6) || !http_range_valid(req, ref))
+		return (0);
+
+	cnt = 0;
+	p = hdr + 6;
+
+	for (;;) {
+		skip = 0;
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '-') {
+			p++;
+			if (!http_range_number(&p, &end))
+				return (0);
+			if (end == 0) {
+				skip = 1;
+			} else {
+				start = ref->size - MIN(end, ref->size);
+				end = ref->size - 1;
+			}
+		} else {
+			if (!http_range_number(&p, &start) || *p++ != '-')
+				return (0);
+			if (*p >= '0' && *p <= '9') {
+				if (!http_range_number(&p, &end))
+					return (0);
+				if (end < start)
+					return (0);
+				end = MIN(end, ref->size - 1);
+			} else {
+				end = ref->size - 1;
+			}
+			if (start >= ref->size)
+				skip = 1;
+		}
+
+		/* Unsatisfiable ranges are dropped, the others still go. */
+		if (!skip) {
+			if (cnt == HTTP_RANGE_MAX)
+				return (0);
+			ranges[cnt].start = start;
+			ranges[cnt].len = end - start + 1;
+			cnt++;
+		}
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (*p == '\0')
+			break;
+		if (*p++ != ',')
+			return (0);
+	}
+
+	return (cnt == 0 ? -1 : cnt);
+}
+
+static int
+http_range_number(const char **p, off_t *out)
+{
+	off_t		v;
+	const char	*s;
+
+	v = 0;
+	for (s = *p; *s >= '0' && *s <= '9'; s++) {
+		if (v > (INT64_MAX - (*s - '0')) / 10)
+			return (KORE_RESULT_ERROR);
+		v = (v * 10) + (*s - '0');
+	}
+
+	if (s == *p)
+		return (KORE_RESULT_ERROR);
+
+	*p = s;
+	*out = v;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * If-Range needs a strong validator, our etags are weak so only the
+ * date form can ever match.
+ */
+static int
+http_range_valid(struct http_request *req, struct kore_fileref *ref)
+{
+	const char	*hdr;
+
+	if (!http_request_header_id(req, HTTP_HEADER_IF_RANGE, &hdr))
+		return (KORE_RESULT_OK);
+
+	if (hdr[0] == '"' || !strncmp(hdr, "W/", 2))
+		return (KORE_RESULT_ERROR);
+
+	if (kore_date_to_time(hdr) != ref->mtime_sec)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+http_response_byteranges(struct http_request *req, struct kore_fileref *ref,
+    struct http_range *ranges, int cnt, const char *type)
+{
+	int			i;
+	struct kore_buf		buf;
+	size_t			total, hoff[HTTP_RANGE_MAX + 1];
+	char			boundary[32], ctype[96];
+
+	(void)snprintf(boundary, sizeof(boundary), "%016llx%08x",
+	    (unsigned long long)kore_time_ms(), (u_int32_t)(uintptr_t)req);
+	(void)snprintf(ctype, sizeof(ctype),
+	    "multipart/byteranges; boundary=%s", boundary);
+	http_response_header(req, "content-type", ctype);
+
+	/* All part headers go in one buffer, hoff[] marks where each ends. */
+	total = 0;
+	kore_buf_init(&buf, 512);
+
+	for (i = 0; i < cnt; i++) {
+		hoff[i] = buf.offset;
+		kore_buf_appendf(&buf, "\r\n--%s\r\n", boundary);
+		if (type != NULL)
+			kore_buf_appendf(&buf, "content-type: %s\r\n", type);
+		kore_buf_appendf(&buf,
+		    "content-range: bytes %lld-%lld/%lld\r\n\r\n",
+		    (long long)ranges[i].start,
+		    (long long)(ranges[i].start + ranges[i].len - 1),
+		    (long long)ref->size);
+		total += ranges[i].len;
+	}
+
+	hoff[cnt] = buf.offset;
+	kore_buf_appendf(&buf, "\r\n--%s--\r\n", boundary);
+	total += buf.offset;
+
+	req->status = HTTP_STATUS_PARTIAL_CONTENT;
+	http_response_normal(req, req->owner,
+	    HTTP_STATUS_PARTIAL_CONTENT, NULL, total);
+
+	if (req->method != HTTP_METHOD_HEAD) {
+		for (i = 0; i < cnt; i++) {
+			net_send_queue(req->owner, buf.data + hoff[i],
+			    hoff[i + 1] - hoff[i]);
+
+			/* Every part holds a reference of its own. */
+			ref->cnt++;
+			net_send_fileref_range(req->owner, ref,
+			    ranges[i].start, ranges[i].len);
+		}
+
+		net_send_queue(req->owner, buf.data + hoff[cnt],
+		    buf.offset - hoff[cnt]);
+	}
+
+	kore_fileref_release(ref);
+	kore_buf_cleanup(&buf);
+}
+
+/*
+ * If-None-Match takes precedence over If-Modified-Since (RFC 7232 6).
+ */
+static int
+http_fileref_fresh(struct http_request *req, struct kore_fileref *ref)
+{
+	time_t		since;
+	const char	*hdr;
+
+	if (req->method != HTTP_METHOD_GET && req->method != HTTP_METHOD_HEAD)
+		return (KORE_RESULT_ERROR);
+
+	if (http_request_header_id(req, HTTP_HEADER_IF_NONE_MATCH, &hdr))
+		return (http_etag_match(hdr, ref->etag));
+
+	if (http_request_header_id(req, HTTP_HEADER_IF_MODIFIED_SINCE, &hdr)) {
+		since = kore_date_to_time(hdr);
+		if (since > 0 && ref->mtime_sec <= since)
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Weak comparison of etag against a comma separated If-None-Match list,
+ * the W/ prefix is ignored on both sides.
+ */
+static int
+http_etag_match(const char *list, const char *etag)
+{
+	size_t		len;
+	const char	*p, *end, *tail;
+
+	if (!strncmp(etag, "W/", 2))
+		etag += 2;
+	len = strlen(etag);
+
+	for (p = list; *p != '\0'; p = end) {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '\0')
+			break;
+
+		for (end = p; *end != '\0' && *end != ','; end++)
+			;
+		for (tail = end; tail > p &&
+		    (tail[-1] == ' ' || tail[-1] == '\t'); tail--)
+			;
+
+		if (tail - p == 1 && *p == '*')
+			return (KORE_RESULT_OK);
+
+		if (tail - p > 2 && !strncmp(p, "W/", 2))
+			p += 2;
+
+		if ((size_t)(tail - p) == len && !memcmp(p, etag, len))
+			return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
 }
 
 int
 http_request_header(struct http_request *req, const char *header,
     const char **out)
 {
+	int			id;
+	u_int32_t		hash;
 	struct http_header	*hdr;
 
-	TAILQ_FOREACH(hdr, &(req->req_headers), list) {
-		if (!strcasecmp(hdr->header, header)) {
+	hash = http_header_hash(header, http_header_seed);
+	if ((id = http_header_known(header, hash)) != -1)
+		return (http_request_header_id(req, id, out));
+
+	hdr = req->hdr_slots[hash & (HTTP_REQ_HEADER_SLOTS - 1)];
+	for (; hdr != NULL; hdr = hdr->next) {
+		if (hdr->hash == hash && !strcasecmp(hdr->header, header)) {
 			*out = hdr->value;
 			return (KORE_RESULT_OK);
 		}
 	}
 
-	if (!strcasecmp(header, "host")) {
+	return (KORE_RESULT_ERROR);
+}
+
+int
+http_request_header_id(struct http_request *req, enum http_header_id id,
+    const char **out)
+{
+	if (id >= HTTP_HEADER_ID_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if (id == HTTP_HEADER_HOST) {
 		*out = req->host;
 		return (KORE_RESULT_OK);
 	}
 
-	return (KORE_RESULT_ERROR);
+	if (req->hdr_known[id] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	*out = req->hdr_known[id]->value;
+
+	return (KORE_RESULT_OK);
 }
 
 int
@@ -709,6 +1928,82 @@ http_request_cookie(struct http_request *req, const char *cookie, char **out)
 	return (KORE_RESULT_ERROR);
 }
 
+/*
+ * Locate the blank line terminating the request headers. The scan resumes
+ * at *scan so each partial read only looks at the newly arrived bytes.
+ * Both memchr() and strcspn() below are vectorized by the libc on the
+ * platforms we care about, which beats the byte-wise kore_mem_find().
+ */
+static u_int8_t *
+http_header_end(u_int8_t *buf, size_t len, size_t *scan, int *skip)
+{
+	u_int8_t	*p, *end;
+
+	p = buf + *scan;
+	end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		if (p + 1 == end)
+			break;
+
+		if (p[1] == '\n') {
+			*skip = 2;
+			return (p);
+		}
+
+		if (p[1] == '\r') {
+			if (p + 2 == end)
+				break;
+			if (p[2] == '\n' && p > buf && p[-1] == '\r') {
+				*skip = 4;
+				return (p - 1);
+			}
+		}
+
+		p++;
+	}
+
+	/* Resume at the last newline if we could not decide on it yet. */
+	*scan = (p != NULL) ? (size_t)(p - buf) : len;
+
+	return (NULL);
+}
+
+/*
+ * Split the header block into lines in place, skipping empty ones, and
+ * remember the index of the host header while we are at it.
+ */
+static int
+http_header_split(char *buf, char **out, int ele, int *host)
+{
+	size_t		n;
+	int		count;
+
+	count = 0;
+	*host = -1;
+
+	while (*buf != '\0' && count < ele - 1) {
+		if ((n = strcspn(buf, "\r\n")) == 0) {
+			buf++;
+			continue;
+		}
+
+		if (count > 0 && *host == -1 && n >= 5 &&
+		    !strncasecmp(buf, "host:", 5))
+			*host = count;
+
+		out[count++] = buf;
+
+		buf += n;
+		if (*buf != '\0')
+			*buf++ = '\0';
+	}
+
+	out[count] = NULL;
+
+	return (count);
+}
+
 int
 http_header_recv(struct netbuf *nb)
 {
@@ -719,6 +2014,7 @@ http_header_recv(struct netbuf *nb)
 	struct http_request	*req;
 	const char		*clp;
 	u_int64_t		bytes_left;
+	size_t			avail;
 	u_int8_t		*end_headers;
 	int			h, i, v, skip, l;
 	char			*headers[HTTP_REQ_HEADER_MAX];
@@ -726,26 +2022,39 @@ http_header_recv(struct netbuf *nb)
 
 	c = nb->owner;
 	kore_debug("http_header_recv(%p)", nb);
+	KORE_PROBE2(http_header_recv, c, nb->s_off);
+
+	if (c->http_first == 0)
+		c->http_first = kore_time_us();
 
 	if (nb->b_len < 4)
 		return (KORE_RESULT_OK);
 
-	skip = 4;
-	end_headers = kore_mem_find(nb->buf, nb->s_off, "\r\n\r\n", 4);
-	if (end_headers == NULL) {
-		end_headers = kore_mem_find(nb->buf, nb->s_off, "\n\n", 2);
-		if (end_headers == NULL)
-			return (KORE_RESULT_OK);
-		skip = 2;
+#if defined(KORE_USE_HTTP2)
+	/* Plaintext HTTP/2 is only spoken by clients with prior knowledge. */
+	if (http2_enable && !c->owner->server->tls &&
+	    nb->s_off > 0 && nb->buf[0] == 'P') {
+		len = MIN(nb->s_off, HTTP2_PREFACE_LEN);
+		if (!memcmp(nb->buf, HTTP2_PREFACE, len)) {
+			if (len < HTTP2_PREFACE_LEN)
+				return (KORE_RESULT_OK);
+			return (http2_connection_start(c));
+		}
 	}
+#endif
 
+	end_headers = http_header_end(nb->buf, nb->s_off, &c->http_scan, &skip);
+	if (end_headers == NULL)
+		return (KORE_RESULT_OK);
+
+	c->http_scan = 0;
 	*end_headers = '\0';
 	end_headers += skip;
 	len = end_headers - nb->buf;
 	hbuf = (char *)nb->buf;
 
-	h = kore_split_string(hbuf, "\r\n", headers, HTTP_REQ_HEADER_MAX);
-	if (h < 2) {
+	h = http_header_split(hbuf, headers, HTTP_REQ_HEADER_MAX, &skip);
+	if (h < 2 || skip == -1) {
 		http_error_response(c, 400);
 		return (KORE_RESULT_OK);
 	}
@@ -756,27 +2065,8 @@ http_header_recv(struct netbuf *nb)
 		return (KORE_RESULT_OK);
 	}
 
-	skip = 0;
-	host = NULL;
-	for (i = 0; i < h; i++) {
-		if (strncasecmp(headers[i], "host", 4))
-			continue;
-
-		if ((host = http_validate_header(headers[i])) == NULL) {
-			http_error_response(c, 400);
-			return (KORE_RESULT_OK);
-		}
-
-		if (*host == '\0') {
-			http_error_response(c, 400);
-			return (KORE_RESULT_OK);
-		}
-
-		skip = i;
-		break;
-	}
-
-	if (host == NULL) {
+	if ((host = http_validate_header(headers[skip])) == NULL ||
+	    *host == '\0') {
 		http_error_response(c, 400);
 		return (KORE_RESULT_OK);
 	}
@@ -806,19 +2096,18 @@ http_header_recv(struct netbuf *nb)
 			return (KORE_RESULT_OK);
 		}
 
-		hdr = kore_pool_get(&http_header_pool);
+		hdr = http_request_alloc(req, sizeof(*hdr));
 		hdr->header = headers[i];
 		hdr->value = value;
 		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
+		http_header_index(req, hdr);
+	}
 
-		if (req->agent == NULL &&
-		    !strcasecmp(hdr->header, "user-agent"))
-			req->agent = hdr->value;
+	if (req->hdr_known[HTTP_HEADER_USER_AGENT] != NULL)
+		req->agent = req->hdr_known[HTTP_HEADER_USER_AGENT]->value;
 
-		if (req->referer == NULL &&
-		    !strcasecmp(hdr->header, "referer"))
-			req->referer = hdr->value;
-	}
+	if (req->hdr_known[HTTP_HEADER_REFERER] != NULL)
+		req->referer = req->hdr_known[HTTP_HEADER_REFERER]->value;
 
 	if (req->flags & HTTP_REQUEST_EXPECT_BODY) {
 		if (http_body_max == 0) {
@@ -827,7 +2116,8 @@ http_header_recv(struct netbuf *nb)
 			return (KORE_RESULT_OK);
 		}
 
-		if (!http_request_header(req, "content-length", &clp)) {
+		if (!http_request_header_id(req,
+		    HTTP_HEADER_CONTENT_LENGTH, &clp)) {
 			kore_debug("expected body but no content-length");
 			req->flags |= HTTP_REQUEST_DELETE;
 			http_error_response(req->owner, 411);
@@ -842,8 +2132,16 @@ http_header_recv(struct netbuf *nb)
 			return (KORE_RESULT_OK);
 		}
 
+		/* Anything past the body is the next pipelined request. */
+		avail = nb->s_off - len;
+		if (avail > req->content_length) {
+			http_pipelined_keep(c, end_headers + req->content_length,
+			    avail - req->content_length);
+			avail = req->content_length;
+		}
+
 		if (req->content_length == 0) {
-			req->flags |= HTTP_REQUEST_COMPLETE;
+			http_request_ready(req);
 			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 			return (KORE_RESULT_OK);
 		}
@@ -858,6 +2156,27 @@ http_header_recv(struct netbuf *nb)
 
 		req->http_body_length = req->content_length;
 
+		/*
+		 * Streamed bodies are read once the handler asked for them
+		 * through http_body_stream(), until then the socket is left
+		 * alone. Whatever came in with the headers is kept aside.
+		 */
+		if (req->hdlr != NULL && req->hdlr->stream) {
+			req->flags |= HTTP_REQUEST_BODY_STREAM |
+			    HTTP_REQUEST_BODY_PAUSED | HTTP_REQUEST_COMPLETE;
+			req->body_pending = kore_buf_alloc(NETBUF_SEND_PAYLOAD_MAX);
+			kore_buf_append(req->body_pending, end_headers, avail);
+
+			req->content_length -= avail;
+			if (req->content_length == 0) {
+				req->flags |= HTTP_REQUEST_BODY_RECEIVED;
+				req->timing.body = kore_time_us();
+			}
+
+			c->http_timeout = 0;
+			return (KORE_RESULT_OK);
+		}
+
 		if (http_body_disk_offload > 0 &&
 		    req->content_length > http_body_disk_offload) {
 			req->http_body_path = kore_pool_get(&http_body_path);
@@ -877,9 +2196,8 @@ http_header_recv(struct netbuf *nb)
 				return (KORE_RESULT_OK);
 			}
 
-			ret = write(req->http_body_fd,
-			    end_headers, (nb->s_off - len));
-			if (ret == -1 || (size_t)ret != (nb->s_off - len)) {
+			ret = write(req->http_body_fd, end_headers, avail);
+			if (ret == -1 || (size_t)ret != avail) {
 				req->flags |= HTTP_REQUEST_DELETE;
 				http_error_response(req->owner, 500);
 				return (KORE_RESULT_OK);
@@ -887,17 +2205,16 @@ http_header_recv(struct netbuf *nb)
 		} else {
 			req->http_body_fd = -1;
 			req->http_body = kore_buf_alloc(req->content_length);
-			kore_buf_append(req->http_body, end_headers,
-			    (nb->s_off - len));
+			kore_buf_append(req->http_body, end_headers, avail);
 		}
 
 		SHA256_Init(&req->hashctx);
-		SHA256_Update(&req->hashctx, end_headers, (nb->s_off - len));
+		SHA256_Update(&req->hashctx, end_headers, avail);
 
-		bytes_left = req->content_length - (nb->s_off - len);
+		bytes_left = req->content_length - avail;
 		if (bytes_left > 0) {
-			kore_debug("%ld/%ld (%ld - %ld) more bytes for body",
-			    bytes_left, req->content_length, nb->s_off, len);
+			kore_debug("%ld/%ld (%ld) more bytes for body",
+			    bytes_left, req->content_length, avail);
 			net_recv_reset(c,
 			    MIN(bytes_left, NETBUF_SEND_PAYLOAD_MAX),
 			    http_body_recv);
@@ -905,9 +2222,12 @@ http_header_recv(struct netbuf *nb)
 			http_request_sleep(req);
 			req->content_length = bytes_left;
 			c->http_timeout = http_body_timeout * 1000;
+			kore_connection_timeout_update(c);
 		} else {
 			c->http_timeout = 0;
-			req->flags |= HTTP_REQUEST_COMPLETE;
+			KORE_PROBE2(http_body_done, req, req->http_body_length);
+			req->timing.body = kore_time_us();
+			http_request_ready(req);
 			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 			SHA256_Final(req->http_body_digest, &req->hashctx);
 			if (!http_body_rewind(req)) {
@@ -918,6 +2238,13 @@ http_header_recv(struct netbuf *nb)
 		}
 	} else {
 		c->http_timeout = 0;
+
+		/*
+		 * Pipelined requests that came in with this one are kept
+		 * aside until it has been answered, see http_start_recv().
+		 */
+		if (nb->s_off > len)
+			http_pipelined_keep(c, end_headers, nb->s_off - len);
 	}
 
 	return (KORE_RESULT_OK);
@@ -927,51 +2254,55 @@ int
 http_argument_get(struct http_request *req, const char *name,
     void **out, void *nout, int type)
 {
-	struct http_arg		*q;
+	struct http_arg			*q;
+	struct kore_handler_params	*p;
 
-	TAILQ_FOREACH(q, &(req->arguments), list) {
-		if (strcmp(q->name, name))
-			continue;
+	/* Only arguments named in the params of the route are kept. */
+	if (req->arg_slots == NULL || req->hdlr == NULL)
+		return (KORE_RESULT_ERROR);
 
-		switch (type) {
-		case HTTP_ARG_TYPE_RAW:
-			*out = q->s_value;
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_BYTE:
-			COPY_ARG_TYPE(*(u_int8_t *)q->s_value, u_int8_t);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_INT16:
-			COPY_AS_INTTYPE(SHRT_MIN, SHRT_MAX, int16_t);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_UINT16:
-			COPY_AS_INTTYPE(0, USHRT_MAX, u_int16_t);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_INT32:
-			COPY_AS_INTTYPE(INT_MIN, INT_MAX, int32_t);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_UINT32:
-			COPY_AS_INTTYPE(0, UINT_MAX, u_int32_t);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_INT64:
-			COPY_AS_INTTYPE_64(int64_t, 1);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_UINT64:
-			COPY_AS_INTTYPE_64(u_int64_t, 0);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_FLOAT:
-			COPY_ARG_DOUBLE(-FLT_MAX, FLT_MAX, float);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_DOUBLE:
-			COPY_ARG_DOUBLE(-DBL_MAX, DBL_MAX, double);
-			return (KORE_RESULT_OK);
-		case HTTP_ARG_TYPE_STRING:
-			*out = q->s_value;
-			return (KORE_RESULT_OK);
-		default:
-			break;
-		}
+	if ((p = kore_module_params_find(req->hdlr, name)) == NULL)
+		return (KORE_RESULT_ERROR);
 
+	if ((q = req->arg_slots[p->slot]) == NULL)
 		return (KORE_RESULT_ERROR);
+
+	switch (type) {
+	case HTTP_ARG_TYPE_RAW:
+		*out = q->s_value;
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_BYTE:
+		COPY_ARG_TYPE(*(u_int8_t *)q->s_value, u_int8_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT16:
+		COPY_AS_INTTYPE(SHRT_MIN, SHRT_MAX, int16_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT16:
+		COPY_AS_INTTYPE(0, USHRT_MAX, u_int16_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT32:
+		COPY_AS_INTTYPE(INT_MIN, INT_MAX, int32_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT32:
+		COPY_AS_INTTYPE(0, UINT_MAX, u_int32_t);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_INT64:
+		COPY_AS_INTTYPE_64(int64_t, 1);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_UINT64:
+		COPY_AS_INTTYPE_64(u_int64_t, 0);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_FLOAT:
+		COPY_ARG_DOUBLE(-FLT_MAX, FLT_MAX, float);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_DOUBLE:
+		COPY_ARG_DOUBLE(-DBL_MAX, DBL_MAX, double);
+		return (KORE_RESULT_OK);
+	case HTTP_ARG_TYPE_STRING:
+		*out = q->s_value;
+		return (KORE_RESULT_OK);
+	default:
+		break;
 	}
 
 	return (KORE_RESULT_ERROR);
@@ -1045,6 +2376,7 @@ http_file_lookup(struct http_request *req, const char *name)
 ssize_t
 http_file_read(struct http_file *file, void *buf, size_t len)
 {
+	int		fd;
 	ssize_t		ret;
 	size_t		toread, off;
 
@@ -1060,20 +2392,22 @@ http_file_read(struct http_file *file, void *buf, size_t len)
 	if (toread == 0)
 		return (0);
 
-	if (file->req->http_body_fd != -1) {
-		if (lseek(file->req->http_body_fd, off, SEEK_SET) == -1) {
+	if (file->fd != -1 || file->req->http_body_fd != -1) {
+		/* Spooled parts have a file of their own. */
+		fd = (file->fd != -1) ? file->fd : file->req->http_body_fd;
+		if (lseek(fd, off, SEEK_SET) == -1) {
 			kore_log(LOG_ERR, "http_file_read: lseek(%s): %s",
-			    file->req->http_body_path, errno_s);
+			    file->filename, errno_s);
 			return (-1);
 		}
 
 		for (;;) {
-			ret = read(file->req->http_body_fd, buf, toread);
+			ret = read(fd, buf, toread);
 			if (ret == -1) {
 				if (errno == EINTR)
 					continue;
 				kore_log(LOG_ERR, "failed to read %s: %s",
-				    file->req->http_body_path, errno_s);
+				    file->filename, errno_s);
 				return (-1);
 			}
 			if (ret == 0)
@@ -1111,20 +2445,20 @@ http_response_cookie(struct http_request *req, const char *name,
 	if (name == NULL || val == NULL)
 		fatal("http_response_cookie: invalid parameters");
 
-	ck = kore_pool_get(&http_cookie_pool);
+	ck = http_request_alloc(req, sizeof(*ck));
 
 	ck->maxage = maxage;
 	ck->expires = expires;
-	ck->name = kore_strdup(name);
-	ck->value = kore_strdup(val);
-	ck->domain = kore_strdup(req->host);
+	ck->name = http_request_strdup(req, name);
+	ck->value = http_request_strdup(req, val);
+	ck->domain = http_request_strdup(req, req->host);
 	ck->flags = HTTP_COOKIE_HTTPONLY | HTTP_COOKIE_SECURE;
 
 	if ((p = strrchr(ck->domain, ':')) != NULL)
 		*p = '\0';
 
 	if (path != NULL)
-		ck->path = kore_strdup(path);
+		ck->path = http_request_strdup(req, path);
 	else
 		ck->path = NULL;
 
@@ -1143,10 +2477,11 @@ http_populate_cookies(struct http_request *req)
 	char			*c, *header, *pair[3];
 	char			*cookies[HTTP_MAX_COOKIES];
 
-	if (!http_request_header(req, "cookie", &hdr))
+	if (!http_request_header_id(req, HTTP_HEADER_COOKIE, &hdr))
 		return;
 
-	header = kore_strdup(hdr);
+	/* The cookies point into this copy, it lives as long as req. */
+	header = http_request_strdup(req, hdr);
 	v = kore_split_string(header, ";", cookies, HTTP_MAX_COOKIES);
 	for (i = 0; i < v; i++) {
 		for (c = cookies[i]; isspace(*(unsigned char *)c); c++)
@@ -1156,13 +2491,11 @@ http_populate_cookies(struct http_request *req)
 		if (n != 2)
 			continue;
 
-		ck = kore_pool_get(&http_cookie_pool);
-		ck->name = kore_strdup(pair[0]);
-		ck->value = kore_strdup(pair[1]);
+		ck = http_request_alloc(req, sizeof(*ck));
+		ck->name = pair[0];
+		ck->value = pair[1];
 		TAILQ_INSERT_TAIL(&(req->req_cookies), ck, list);
 	}
-
-	kore_free(header);
 }
 
 void
@@ -1174,133 +2507,365 @@ http_populate_post(struct http_request *req)
 	char			data[BUFSIZ];
 	char			*args[HTTP_MAX_QUERY_ARGS], *val[3], *string;
 
-	if (req->method != HTTP_METHOD_POST)
+	if (req->method != HTTP_METHOD_POST)
+		return;
+
+	if (req->http_body != NULL) {
+		body = NULL;
+		req->http_body->offset = req->content_length;
+		string = kore_buf_stringify(req->http_body, NULL);
+		req->http_body_length = 0;
+		req->http_body_offset = 0;
+	} else {
+		body = kore_buf_alloc(128);
+		for (;;) {
+			ret = http_body_read(req, data, sizeof(data));
+			if (ret == -1)
+				goto out;
+			if (ret == 0)
+				break;
+			kore_buf_append(body, data, ret);
+		}
+		string = kore_buf_stringify(body, NULL);
+	}
+
+	v = kore_split_string(string, "&", args, HTTP_MAX_QUERY_ARGS);
+	for (i = 0; i < v; i++) {
+		kore_split_string(args[i], "=", val, 3);
+		if (val[0] != NULL && val[1] != NULL)
+			http_argument_add(req, val[0], val[1], 0, 1);
+	}
+
+out:
+	if (body != NULL)
+		kore_buf_free(body);
+}
+
+void
+http_populate_qs(struct http_request *req)
+{
+	int		i, v;
+	char		*query, *args[HTTP_MAX_QUERY_ARGS], *val[3];
+
+	if (req->query_string == NULL)
+		return;
+
+	query = kore_strdup(req->query_string);
+	v = kore_split_string(query, "&", args, HTTP_MAX_QUERY_ARGS);
+	for (i = 0; i < v; i++) {
+		kore_split_string(args[i], "=", val, 3);
+		if (val[0] != NULL && val[1] != NULL)
+			http_argument_add(req, val[0], val[1], 1, 1);
+	}
+
+	kore_free(query);
+}
+
+void
+http_populate_multipart_form(struct http_request *req)
+{
+	ssize_t			ret;
+	struct http_multipart	*mp;
+	u_int8_t		data[4096];
+
+	if (req->multipart != NULL)
+		return;
+
+	if ((mp = multipart_create(req, MULTIPART_MODE_OFFSETS, NULL)) == NULL)
+		return;
+
+	/* Parts in an in-memory body are parsed in place. */
+	if (req->http_body_fd == -1 && req->http_body != NULL) {
+		(void)multipart_feed(mp, req->http_body->data +
+		    req->http_body->offset, req->http_body_length);
+		req->http_body->offset += req->http_body_length;
+		req->http_body_offset += req->http_body_length;
+		req->http_body_length = 0;
+	} else {
+		while ((ret = http_body_read(req, data, sizeof(data))) > 0) {
+			if (!multipart_feed(mp, data, ret))
+				break;
+		}
+	}
+
+	multipart_free(mp);
+}
+
+/*
+ * Parse a multipart/form-data body while it arrives, see
+ * http_multipart_body(). Fields end up as arguments. File parts are
+ * handed to cb as their data comes in, with a final call without data
+ * once a part is complete. Without a cb each file part is written to
+ * its own file under http_body_disk_path and read with http_file_read().
+ */
+int
+http_multipart_stream(struct http_request *req,
+    int (*cb)(struct http_request *, struct http_file *, const void *, size_t))
+{
+	int		mode;
+
+	if (req->multipart != NULL)
+		return (KORE_RESULT_OK);
+
+	mode = (cb == NULL) ? MULTIPART_MODE_SPOOL : MULTIPART_MODE_CALLBACK;
+	if ((req->multipart = multipart_create(req, mode, cb)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Body callback for http_body_stream() that runs the parser set up
+ * by http_multipart_stream() over each chunk of the body.
+ */
+int
+http_multipart_body(struct http_request *req, const void *d, size_t len)
+{
+	if (req->multipart == NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (multipart_feed(req->multipart, d, len));
+}
+
+int
+http_body_rewind(struct http_request *req)
+{
+	if (req->http_body_fd != -1) {
+		if (lseek(req->http_body_fd, 0, SEEK_SET) == -1) {
+			kore_log(LOG_ERR, "lseek(%s) failed: %s",
+			    req->http_body_path, errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	} else if (req->http_body != NULL) {
+		kore_buf_reset(req->http_body);
+	}
+
+	req->http_body_offset = 0;
+	req->http_body_length = req->content_length;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Hand the body of a request on a "stream" route to cb as it comes in
+ * instead of buffering it. Returns KORE_RESULT_RETRY while the body is
+ * still arriving, the handler returns that and is called again when cb
+ * has seen all of it. KORE_RESULT_ERROR means the request failed.
+ *
+ * cb returns KORE_RESULT_OK when it consumed the data. KORE_RESULT_RETRY
+ * keeps the data and stops reading for this request until
+ * http_body_stream_resume() is called, KORE_RESULT_ERROR fails it.
+ */
+int
+http_body_stream(struct http_request *req,
+    int (*cb)(struct http_request *, const void *, size_t))
+{
+	if (!(req->flags & HTTP_REQUEST_BODY_STREAM) ||
+	    !(req->flags & HTTP_REQUEST_EXPECT_BODY))
+		return (KORE_RESULT_OK);
+
+	if (req->body_cb == NULL) {
+		req->body_cb = cb;
+		http_request_sleep(req);
+		http_body_stream_resume(req);
+	}
+
+	if (req->flags & HTTP_REQUEST_DELETE)
+		return (KORE_RESULT_ERROR);
+
+	if (!(req->flags & HTTP_REQUEST_EXPECT_BODY))
+		return (KORE_RESULT_OK);
+
+	return (KORE_RESULT_RETRY);
+}
+
+/*
+ * Offer the held back data to the callback again and start reading
+ * the rest of the body. Must not be called from the callback itself.
+ */
+void
+http_body_stream_resume(struct http_request *req)
+{
+	int			r;
+	struct connection	*c;
+
+	if (!(req->flags & HTTP_REQUEST_BODY_PAUSED) || req->body_cb == NULL)
 		return;
 
-	if (req->http_body != NULL) {
-		body = NULL;
-		req->http_body->offset = req->content_length;
-		string = kore_buf_stringify(req->http_body, NULL);
-		req->http_body_length = 0;
-		req->http_body_offset = 0;
-	} else {
-		body = kore_buf_alloc(128);
-		for (;;) {
-			ret = http_body_read(req, data, sizeof(data));
-			if (ret == -1)
-				goto out;
-			if (ret == 0)
-				break;
-			kore_buf_append(body, data, ret);
+	if (req->flags & HTTP_REQUEST_DELETE)
+		return;
+
+	if (req->body_pending->offset > 0) {
+		r = req->body_cb(req,
+		    req->body_pending->data, req->body_pending->offset);
+		if (r == KORE_RESULT_RETRY)
+			return;
+		if (r != KORE_RESULT_OK) {
+			http_body_stream_fail(req);
+			return;
 		}
-		string = kore_buf_stringify(body, NULL);
+		kore_buf_reset(req->body_pending);
 	}
 
-	v = kore_split_string(string, "&", args, HTTP_MAX_QUERY_ARGS);
-	for (i = 0; i < v; i++) {
-		kore_split_string(args[i], "=", val, 3);
-		if (val[0] != NULL && val[1] != NULL)
-			http_argument_add(req, val[0], val[1], 0, 1);
+	req->flags &= ~HTTP_REQUEST_BODY_PAUSED;
+
+	if (req->flags & HTTP_REQUEST_BODY_RECEIVED) {
+		http_body_stream_done(req);
+		return;
 	}
 
-out:
-	if (body != NULL)
-		kore_buf_free(body);
+	c = req->owner;
+
+	switch (c->proto) {
+	case CONN_PROTO_HTTP:
+		net_recv_reset(c, MIN(req->content_length,
+		    NETBUF_SEND_PAYLOAD_MAX), http_body_recv);
+		c->rnb->extra = req;
+		c->http_start = kore_time_ms();
+		c->http_timeout = http_body_timeout * 1000;
+		kore_connection_timeout_update(c);
+		if ((c->evt.flags & KORE_EVENT_READ) && !net_recv_flush(c))
+			kore_connection_disconnect(c);
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http2_request_body_resume(req);
+		break;
+#endif
+	default:
+		fatal("http_body_stream_resume: bad proto %d", c->proto);
+	}
 }
 
-void
-http_populate_qs(struct http_request *req)
+/*
+ * Called by the protocol side for every piece of a streamed body.
+ * Returns KORE_RESULT_RETRY if the data was held back, the caller
+ * then stops reading until http_body_stream_resume().
+ */
+int
+http_body_stream_data(struct http_request *req, const void *d, size_t len)
 {
-	int		i, v;
-	char		*query, *args[HTTP_MAX_QUERY_ARGS], *val[3];
+	int		r;
 
-	if (req->query_string == NULL)
-		return;
+	if (req->flags & HTTP_REQUEST_DELETE)
+		return (KORE_RESULT_ERROR);
 
-	query = kore_strdup(req->query_string);
-	v = kore_split_string(query, "&", args, HTTP_MAX_QUERY_ARGS);
-	for (i = 0; i < v; i++) {
-		kore_split_string(args[i], "=", val, 3);
-		if (val[0] != NULL && val[1] != NULL)
-			http_argument_add(req, val[0], val[1], 1, 1);
+	if (req->body_cb == NULL || (req->flags & HTTP_REQUEST_BODY_PAUSED)) {
+		kore_buf_append(req->body_pending, d, len);
+		req->flags |= HTTP_REQUEST_BODY_PAUSED;
+		return (KORE_RESULT_RETRY);
 	}
 
-	kore_free(query);
+	r = req->body_cb(req, d, len);
+
+	switch (r) {
+	case KORE_RESULT_OK:
+		if (req->flags & HTTP_REQUEST_BODY_RECEIVED)
+			http_body_stream_done(req);
+		break;
+	case KORE_RESULT_RETRY:
+		kore_buf_append(req->body_pending, d, len);
+		req->flags |= HTTP_REQUEST_BODY_PAUSED;
+		break;
+	default:
+		http_body_stream_fail(req);
+		r = KORE_RESULT_ERROR;
+		break;
+	}
+
+	return (r);
 }
 
 void
-http_populate_multipart_form(struct http_request *req)
+http_body_stream_end(struct http_request *req)
 {
-	const char		*hdr;
-	int			h, blen;
-	struct kore_buf		in, out;
-	char			*type, *val, *args[3];
-	char			boundary[HTTP_BOUNDARY_MAX];
+	req->flags |= HTTP_REQUEST_BODY_RECEIVED;
+	req->timing.body = kore_time_us();
 
-	if (req->method != HTTP_METHOD_POST)
-		return;
-
-	if (!http_request_header(req, "content-type", &hdr))
-		return;
-
-	kore_buf_init(&in, 128);
-	kore_buf_init(&out, 128);
-
-	type = kore_strdup(hdr);
-	h = kore_split_string(type, ";", args, 3);
-	if (h != 2)
-		goto cleanup;
+	if (req->body_cb != NULL && !(req->flags & HTTP_REQUEST_BODY_PAUSED))
+		http_body_stream_done(req);
+}
 
-	if (strcasecmp(args[0], "multipart/form-data"))
-		goto cleanup;
+static void
+http_body_stream_done(struct http_request *req)
+{
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+	http_request_wakeup(req);
+}
 
-	if ((val = strchr(args[1], '=')) == NULL)
-		goto cleanup;
+static void
+http_body_stream_fail(struct http_request *req)
+{
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+	req->flags |= HTTP_REQUEST_DELETE;
+	http_request_wakeup(req);
 
-	val++;
-	blen = snprintf(boundary, sizeof(boundary), "--%s", val);
-	if (blen == -1 || (size_t)blen >= sizeof(boundary))
-		goto cleanup;
+	if (req->owner->proto == CONN_PROTO_HTTP)
+		http_error_response(req->owner, HTTP_STATUS_INTERNAL_ERROR);
+}
 
-	if (!multipart_find_data(&in, NULL, NULL, req, boundary, blen))
-		goto cleanup;
+/*
+ * Returns how many microseconds the request spent in the given phase,
+ * 0 if it has not been through it (yet).
+ */
+u_int64_t
+http_request_timing(struct http_request *req, int phase)
+{
+	u_int64_t		from, to;
+	struct http_timing	*t;
 
-	for (;;) {
-		if (!multipart_find_data(&in, NULL, NULL, req, "\r\n", 2))
-			break;
-		if (in.offset < 4 && req->http_body_length == 0)
-			break;
-		if (!multipart_find_data(&in, &out, NULL, req, "\r\n\r\n", 4))
-			break;
-		if (!multipart_parse_headers(req, &in, &out, boundary, blen))
-			break;
+	t = &req->timing;
 
-		kore_buf_reset(&out);
+	switch (phase) {
+	case HTTP_TIMING_RECV:
+		from = t->first_byte;
+		to = t->headers;
+		break;
+	case HTTP_TIMING_BODY:
+		from = t->headers;
+		to = t->body;
+		break;
+	case HTTP_TIMING_QUEUE:
+		/* Streamed bodies complete while the handler runs. */
+		if (t->body != 0 && t->body < t->handler)
+			from = t->body;
+		else
+			from = t->headers;
+		to = t->handler;
+		break;
+	case HTTP_TIMING_APP:
+		from = t->handler;
+		to = t->response;
+		if (to >= from + t->slept)
+			to -= t->slept;
+		break;
+	case HTTP_TIMING_SLEEP:
+		return (t->slept);
+	case HTTP_TIMING_SEND:
+		from = t->response;
+		to = t->flushed;
+		break;
+	default:
+		fatal("http_request_timing: bad phase %d", phase);
 	}
 
-cleanup:
-	kore_free(type);
-	kore_buf_cleanup(&in);
-	kore_buf_cleanup(&out);
+	if (from == 0 || to < from)
+		return (0);
+
+	return (to - from);
 }
 
-int
-http_body_rewind(struct http_request *req)
+const char *
+http_timing_name(int phase)
 {
-	if (req->http_body_fd != -1) {
-		if (lseek(req->http_body_fd, 0, SEEK_SET) == -1) {
-			kore_log(LOG_ERR, "lseek(%s) failed: %s",
-			    req->http_body_path, errno_s);
-			return (KORE_RESULT_ERROR);
-		}
-	} else if (req->http_body != NULL) {
-		kore_buf_reset(req->http_body);
-	}
+	static const char *names[HTTP_TIMING_MAX] = {
+		"recv", "body", "queue", "app", "sleep", "send"
+	};
 
-	req->http_body_offset = 0;
-	req->http_body_length = req->content_length;
+	if (phase < 0 || phase >= HTTP_TIMING_MAX)
+		fatal("http_timing_name: bad phase %d", phase);
 
-	return (KORE_RESULT_OK);
+	return (names[phase]);
 }
 
 int
@@ -1442,10 +3007,59 @@ http_state_cleanup(struct http_request *req)
 void
 http_start_recv(struct connection *c)
 {
+	size_t		len;
+
 	c->http_start = kore_time_ms();
 	c->http_timeout = http_header_timeout * 1000;
+	kore_connection_timeout_update(c);
+
 	net_recv_reset(c, http_header_max, http_header_recv);
-	(void)net_recv_flush(c);
+
+	if (c->http_pipelined != NULL) {
+		len = MIN(c->http_pipelined_len, c->rnb->b_len);
+		memcpy(c->rnb->buf, c->http_pipelined, len);
+		c->rnb->s_off = len;
+
+		/* Whatever did not fit stays for the request after it. */
+		c->http_pipelined_len -= len;
+		if (c->http_pipelined_len > 0) {
+			memmove(c->http_pipelined, c->http_pipelined + len,
+			    c->http_pipelined_len);
+		} else {
+			kore_free(c->http_pipelined);
+			c->http_pipelined = NULL;
+		}
+
+		http_pipelined_ready = 1;
+		if (c->rnb->cb(c->rnb) != KORE_RESULT_OK) {
+			kore_connection_disconnect(c);
+			return;
+		}
+	}
+
+	if (!net_recv_flush(c))
+		kore_connection_disconnect(c);
+}
+
+/*
+ * Keeps bytes that came in after the current request until it has been
+ * answered, in front of anything that was already kept.
+ */
+static void
+http_pipelined_keep(struct connection *c, const u_int8_t *data, size_t len)
+{
+	u_int8_t	*p;
+
+	p = kore_malloc(c->http_pipelined_len + len);
+	memcpy(p, data, len);
+
+	if (c->http_pipelined != NULL) {
+		memcpy(p + len, c->http_pipelined, c->http_pipelined_len);
+		kore_free(c->http_pipelined);
+	}
+
+	c->http_pipelined = p;
+	c->http_pipelined_len += len;
 }
 
 void
@@ -1579,7 +3193,7 @@ http_check_redirect(struct http_request *req, struct kore_domain *dom)
 	return (KORE_RESULT_OK);
 }
 
-static struct http_request *
+struct http_request *
 http_request_new(struct connection *c, const char *host,
     const char *method, char *path, const char *version)
 {
@@ -1607,15 +3221,17 @@ http_request_new(struct connection *c, const char *host,
 		return (NULL);
 	}
 
-	if (strcasecmp(version, "http/1.1")) {
-		if (strcasecmp(version, "http/1.0")) {
-			http_error_response(c, 505);
-			return (NULL);
-		}
-
+	if (!strcasecmp(version, "http/1.1")) {
+		flags = HTTP_VERSION_1_1;
+	} else if (!strcasecmp(version, "http/1.0")) {
 		flags = HTTP_VERSION_1_0;
+#if defined(KORE_USE_HTTP2)
+	} else if (c->proto == CONN_PROTO_HTTP2 && !strcmp(version, "HTTP/2")) {
+		flags = HTTP_VERSION_2;
+#endif
 	} else {
-		flags = HTTP_VERSION_1_1;
+		http_error_response(c, 505);
+		return (NULL);
 	}
 
 	if ((p = strchr(path, '?')) != NULL) {
@@ -1710,156 +3326,411 @@ http_request_new(struct connection *c, const char *host,
 	req->method = m;
 	req->agent = NULL;
 	req->onfree = NULL;
+	req->body_cb = NULL;
 	req->referer = NULL;
 	req->runlock = NULL;
+	req->wakeup = 0;
 	req->flags = flags;
 	req->fsm_state = 0;
 	req->http_body = NULL;
 	req->http_body_fd = -1;
 	req->hdlr_extra = NULL;
+	req->body_pending = NULL;
+	req->arena = NULL;
+	req->multipart = NULL;
+	req->json_stream = NULL;
+	req->cache_slot = NULL;
+	req->cache_state = HTTP_CACHE_NONE;
 	req->query_string = NULL;
 	req->http_body_length = 0;
 	req->http_body_offset = 0;
 	req->http_body_path = NULL;
 
-	req->host = host;
-	req->path = path;
+	req->host = host;
+	req->path = path;
+
+#if defined(KORE_USE_PYTHON)
+	req->py_req = NULL;
+	req->py_body = NULL;
+	req->py_coro = NULL;
+	req->py_rqnext = NULL;
+	req->py_validator = NULL;
+#endif
+
+#if defined(KORE_USE_HTTP2)
+	req->h2_stream = NULL;
+#endif
+
+	if (qsoff > 0) {
+		req->query_string = path + qsoff;
+		*(req->query_string)++ = '\0';
+	} else {
+		req->query_string = NULL;
+	}
+
+	/* Checked further down below if we need to 404. */
+	req->hdlr = kore_module_handler_find(req, dom);
+
+	TAILQ_INIT(&(req->resp_headers));
+	TAILQ_INIT(&(req->req_headers));
+	TAILQ_INIT(&(req->resp_cookies));
+	memset(req->hdr_known, 0, sizeof(req->hdr_known));
+	memset(req->hdr_slots, 0, sizeof(req->hdr_slots));
+	TAILQ_INIT(&(req->req_cookies));
+	TAILQ_INIT(&(req->arguments));
+	TAILQ_INIT(&(req->files));
+	req->arg_slots = NULL;
+
+#if defined(KORE_USE_TASKS)
+	LIST_INIT(&(req->tasks));
+#endif
+
+#if defined(KORE_USE_PGSQL)
+	LIST_INIT(&(req->pgsqls));
+#endif
+
+	req->ready = kore_time_ms();
+	req->queued_us = kore_time_us();
+	KORE_PROBE3(http_request_new, req, c, req->path);
+
+	memset(&req->timing, 0, sizeof(req->timing));
+	req->timing.accept = c->http_accept;
+	req->timing.headers = req->queued_us;
+
+	if (c->proto == CONN_PROTO_HTTP && c->http_first != 0)
+		req->timing.first_byte = c->http_first;
+	else
+		req->timing.first_byte = req->queued_us;
+	c->http_first = 0;
+	req->prio = (req->hdlr != NULL) ? req->hdlr->priority : HTTP_PRIO_NORMAL;
+
+	http_request_count++;
+	http_prio[req->prio].queued++;
+	TAILQ_INSERT_HEAD(&http_requests[req->prio], req, list);
+	TAILQ_INSERT_TAIL(&(c->http_requests), req, olist);
+
+	if (http_check_redirect(req, dom)) {
+		http_request_free(req);
+		return (NULL);
+	}
+
+	if (req->hdlr == NULL) {
+		http_request_free(req);
+		http_error_response(c, HTTP_STATUS_NOT_FOUND);
+		return (NULL);
+	}
+
+	if (!(req->hdlr->methods & m)) {
+		http_request_free(req);
+		http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
+		return (NULL);
+	}
+
+	return (req);
+}
+
+static struct http_multipart *
+multipart_create(struct http_request *req, int mode,
+    int (*cb)(struct http_request *, struct http_file *, const void *, size_t))
+{
+	int			h, len;
+	const char		*hdr;
+	struct http_multipart	*mp;
+	char			*type, *val, *args[3];
+
+	if (req->method != HTTP_METHOD_POST)
+		return (NULL);
+
+	if (!http_request_header_id(req, HTTP_HEADER_CONTENT_TYPE, &hdr))
+		return (NULL);
+
+	mp = NULL;
+	type = kore_strdup(hdr);
+
+	h = kore_split_string(type, ";", args, 3);
+	if (h != 2 || strcasecmp(args[0], "multipart/form-data"))
+		goto cleanup;
+
+	if ((val = strchr(args[1], '=')) == NULL)
+		goto cleanup;
+
+	val++;
+	mp = kore_calloc(1, sizeof(*mp));
+
+	len = snprintf(mp->delim, sizeof(mp->delim), "\r\n--%s", val);
+	if (len == -1 || (size_t)len >= sizeof(mp->delim)) {
+		kore_free(mp);
+		mp = NULL;
+		goto cleanup;
+	}
+
+	mp->cb = cb;
+	mp->req = req;
+	mp->mode = mode;
+	mp->dlen = len;
+	mp->file = NULL;
+	mp->name = NULL;
+	mp->offset = req->http_body_offset;
+	mp->state = MULTIPART_STATE_DATA;
+
+	/* The first delimiter does not follow a line break, pretend it does. */
+	mp->carry[0] = '\r';
+	mp->carry[1] = '\n';
+	mp->clen = 2;
+
+	kore_buf_init(&mp->hdrs, 128);
+	kore_buf_init(&mp->field, 128);
+
+cleanup:
+	kore_free(type);
+
+	return (mp);
+}
+
+static void
+multipart_free(struct http_multipart *mp)
+{
+	if (mp->file != NULL)
+		multipart_file_free(mp->file);
+
+	kore_free(mp->name);
+	kore_buf_cleanup(&mp->hdrs);
+	kore_buf_cleanup(&mp->field);
+	kore_free(mp);
+}
 
-#if defined(KORE_USE_PYTHON)
-	req->py_req = NULL;
-	req->py_coro = NULL;
-	req->py_rqnext = NULL;
-	req->py_validator = NULL;
-#endif
+/*
+ * Run the parser over the next len bytes of body. Only a possible
+ * start of a delimiter at the end of d is held on to, everything
+ * else is handed off or skipped right away.
+ */
+static int
+multipart_feed(struct http_multipart *mp, const u_int8_t *d, size_t len)
+{
+	int			found;
+	const u_int8_t		*p;
+	size_t			i, n, need, start, old;
+
+	while (len > 0) {
+		switch (mp->state) {
+		case MULTIPART_STATE_DATA:
+			/* A delimiter split over two chunks starts in carry. */
+			need = 0;
+			found = 0;
+			for (i = 0; i < mp->clen; i++) {
+				n = mp->clen - i;
+				if (memcmp(mp->carry + i, mp->delim, n))
+					continue;
+				need = mp->dlen - n;
+				if (memcmp(d, mp->delim + n, MIN(len, need)))
+					continue;
+				found = 1;
+				break;
+			}
 
-	if (qsoff > 0) {
-		req->query_string = path + qsoff;
-		*(req->query_string)++ = '\0';
-	} else {
-		req->query_string = NULL;
-	}
+			if (!multipart_emit(mp, mp->carry, i, mp->coff))
+				return (multipart_error(mp));
 
-	/* Checked further down below if we need to 404. */
-	req->hdlr = kore_module_handler_find(req, dom);
+			if (found && len < need) {
+				memmove(mp->carry, mp->carry + i, n);
+				memcpy(mp->carry + n, d, len);
+				mp->coff += i;
+				mp->clen = n + len;
+				mp->offset += len;
+				return (KORE_RESULT_OK);
+			}
 
-	TAILQ_INIT(&(req->resp_headers));
-	TAILQ_INIT(&(req->req_headers));
-	TAILQ_INIT(&(req->resp_cookies));
-	TAILQ_INIT(&(req->req_cookies));
-	TAILQ_INIT(&(req->arguments));
-	TAILQ_INIT(&(req->files));
+			mp->clen = 0;
+
+			if (found) {
+				n = need;
+			} else if ((p = multipart_find(d, len,
+			    mp->delim, mp->dlen)) != NULL) {
+				n = p - d;
+				if (!multipart_emit(mp, d, n, mp->offset))
+					return (multipart_error(mp));
+				n += mp->dlen;
+			} else {
+				/* Hold back what may be the start of one. */
+				n = MIN(len, mp->dlen - 1);
+				p = memchr(d + len - n, '\r', n);
+				n = (p == NULL) ? 0 : (size_t)((d + len) - p);
+
+				if (!multipart_emit(mp, d, len - n, mp->offset))
+					return (multipart_error(mp));
+
+				memcpy(mp->carry, d + len - n, n);
+				mp->clen = n;
+				mp->coff = mp->offset + len - n;
+				mp->offset += len;
+				return (KORE_RESULT_OK);
+			}
 
-#if defined(KORE_USE_TASKS)
-	LIST_INIT(&(req->tasks));
-#endif
+			d += n;
+			len -= n;
+			mp->offset += n;
 
-#if defined(KORE_USE_PGSQL)
-	LIST_INIT(&(req->pgsqls));
-#endif
+			if (!multipart_part_end(mp))
+				return (multipart_error(mp));
 
-	http_request_count++;
-	TAILQ_INSERT_HEAD(&http_requests, req, list);
-	TAILQ_INSERT_TAIL(&(c->http_requests), req, olist);
+			mp->state = MULTIPART_STATE_BOUNDARY;
+			break;
+		case MULTIPART_STATE_BOUNDARY:
+			n = MIN(len, 2 - mp->hdrs.offset);
+			kore_buf_append(&mp->hdrs, d, n);
 
-	if (http_check_redirect(req, dom)) {
-		http_request_free(req);
-		return (NULL);
-	}
+			d += n;
+			len -= n;
+			mp->offset += n;
 
-	if (req->hdlr == NULL) {
-		http_request_free(req);
-		http_error_response(c, HTTP_STATUS_NOT_FOUND);
-		return (NULL);
-	}
+			if (mp->hdrs.offset < 2)
+				break;
 
-	if (!(req->hdlr->methods & m)) {
-		http_request_free(req);
-		http_error_response(c, HTTP_STATUS_METHOD_NOT_ALLOWED);
-		return (NULL);
+			/*
+			 * The line break stays in hdrs so that a part without
+			 * any headers also ends at the first "\r\n\r\n".
+			 */
+			if (!memcmp(mp->hdrs.data, "--", 2)) {
+				mp->state = MULTIPART_STATE_DONE;
+			} else if (!memcmp(mp->hdrs.data, "\r\n", 2)) {
+				mp->state = MULTIPART_STATE_HEADERS;
+			} else {
+				return (multipart_error(mp));
+			}
+			break;
+		case MULTIPART_STATE_HEADERS:
+			old = mp->hdrs.offset;
+			n = MIN(len, HTTP_MULTIPART_HEADER_MAX - old);
+			if (n == 0)
+				return (multipart_error(mp));
+
+			kore_buf_append(&mp->hdrs, d, n);
+
+			start = (old > 3) ? old - 3 : 0;
+			p = multipart_find(mp->hdrs.data + start,
+			    mp->hdrs.offset - start, "\r\n\r\n", 4);
+			if (p != NULL) {
+				mp->hdrs.offset = p - mp->hdrs.data;
+				n = (mp->hdrs.offset + 4) - old;
+			}
+
+			d += n;
+			len -= n;
+			mp->offset += n;
+
+			if (p == NULL)
+				break;
+
+			if (!multipart_part_begin(mp))
+				return (multipart_error(mp));
+
+			mp->state = MULTIPART_STATE_DATA;
+			break;
+		case MULTIPART_STATE_DONE:
+			mp->offset += len;
+			return (KORE_RESULT_OK);
+		default:
+			return (KORE_RESULT_ERROR);
+		}
 	}
 
-	return (req);
+	return (KORE_RESULT_OK);
 }
 
 static int
-multipart_find_data(struct kore_buf *in, struct kore_buf *out,
-    size_t *olen, struct http_request *req, const void *needle, size_t len)
+multipart_error(struct http_multipart *mp)
 {
-	ssize_t			ret;
+	mp->state = MULTIPART_STATE_ERROR;
+	return (KORE_RESULT_ERROR);
+}
+
+static const u_int8_t *
+multipart_find(const u_int8_t *d, size_t len, const void *needle, size_t nlen)
+{
+	const u_int8_t		*p;
 	size_t			left;
-	u_int8_t		*p, first, data[4096];
 
-	if (olen != NULL)
-		*olen = 0;
+	while ((p = memchr(d, *(const u_int8_t *)needle, len)) != NULL) {
+		left = len - (p - d);
+		if (left < nlen)
+			return (NULL);
 
-	first = *(const u_int8_t *)needle;
-	for (;;) {
-		if (in->offset < len) {
-			ret = http_body_read(req, data, sizeof(data));
-			if (ret == -1)
-				return (KORE_RESULT_ERROR);
-			if (ret == 0)
-				return (KORE_RESULT_ERROR);
+		if (!memcmp(p, needle, nlen))
+			return (p);
 
-			kore_buf_append(in, data, ret);
-			continue;
-		}
+		d = p + 1;
+		len = left - 1;
+	}
 
-		p = kore_mem_find(in->data, in->offset, &first, 1);
-		if (p == NULL) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, in->offset);
-			if (olen != NULL)
-				*olen += in->offset;
-			kore_buf_reset(in);
-			continue;
-		}
+	return (NULL);
+}
 
-		left = in->offset - (p - in->data);
-		if (left < len) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, (p - in->data));
-			if (olen != NULL)
-				*olen += (p - in->data);
-			memmove(in->data, p, left);
-			in->offset = left;
-			continue;
-		}
+/*
+ * Data for the current part, off is where it sits in the body.
+ */
+static int
+multipart_emit(struct http_multipart *mp, const u_int8_t *d, size_t len,
+    size_t off)
+{
+	ssize_t			ret;
+	size_t			done;
+	struct http_file	*f;
 
-		if (!memcmp(p, needle, len)) {
-			if (out != NULL)
-				kore_buf_append(out, in->data, p - in->data);
-			if (olen != NULL)
-				*olen += (p - in->data);
+	if (len == 0)
+		return (KORE_RESULT_OK);
 
-			in->offset = left - len;
-			if (in->offset > 0)
-				memmove(in->data, p + len, in->offset);
+	if ((f = mp->file) == NULL) {
+		if (mp->name == NULL)
 			return (KORE_RESULT_OK);
-		}
-
-		if (out != NULL)
-			kore_buf_append(out, in->data, (p - in->data) + 1);
-		if (olen != NULL)
-			*olen += (p - in->data) + 1;
+		if (mp->field.offset + len > HTTP_MULTIPART_FIELD_MAX)
+			return (KORE_RESULT_ERROR);
+		kore_buf_append(&mp->field, d, len);
+		return (KORE_RESULT_OK);
+	}
 
-		in->offset = left - 1;
-		if (in->offset > 0)
-			memmove(in->data, p + 1, in->offset);
+	switch (mp->mode) {
+	case MULTIPART_MODE_OFFSETS:
+		if (f->length == 0)
+			f->position = off;
+		break;
+	case MULTIPART_MODE_SPOOL:
+		for (done = 0; done < len; done += ret) {
+			ret = write(f->fd, d + done, len - done);
+			if (ret == -1 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret <= 0) {
+				kore_log(LOG_ERR, "multipart write: %s",
+				    ret == 0 ? "short write" : errno_s);
+				return (KORE_RESULT_ERROR);
+			}
+		}
+		break;
+	case MULTIPART_MODE_CALLBACK:
+		if (mp->cb(mp->req, f, d, len) != KORE_RESULT_OK)
+			return (KORE_RESULT_ERROR);
+		break;
 	}
 
-	return (KORE_RESULT_ERROR);
+	f->length += len;
+
+	return (KORE_RESULT_OK);
 }
 
 static int
-multipart_parse_headers(struct http_request *req, struct kore_buf *in,
-    struct kore_buf *hbuf, const char *boundary, const int blen)
+multipart_part_begin(struct http_multipart *mp)
 {
-	int		h, c, i;
-	char		*headers[5], *args[5], *opt[5];
-	char		*d, *val, *name, *fname, *string;
+	int			h, c, i, len;
+	struct http_file	*f;
+	char			*headers[5], *args[5], *opt[5];
+	char			*d, *val, *name, *fname, *string;
+	char			path[HTTP_BODY_PATH_MAX];
+
+	name = NULL;
+	fname = NULL;
 
-	string = kore_buf_stringify(hbuf, NULL);
+	string = kore_buf_stringify(&mp->hdrs, NULL);
 	h = kore_split_string(string, "\r\n", headers, 5);
 	for (i = 0; i < h; i++) {
 		c = kore_split_string(headers[i], ":", args, 5);
@@ -1888,87 +3759,113 @@ multipart_parse_headers(struct http_request *req, struct kore_buf *in,
 		val++;
 		kore_strip_chars(val, '"', &name);
 
-		if (opt[2] == NULL) {
-			multipart_add_field(req, in, name, boundary, blen);
-			kore_free(name);
-			continue;
-		}
-
-		for (d = opt[2]; isspace(*(unsigned char *)d); d++)
-			;
+		if (opt[2] != NULL) {
+			for (d = opt[2]; isspace(*(unsigned char *)d); d++)
+				;
 
-		if (!strncasecmp(d, "filename=", 9)) {
-			if ((val = strchr(d, '=')) == NULL) {
+			if (!strncasecmp(d, "filename=", 9)) {
+				kore_strip_chars(d + 9, '"', &fname);
+			} else {
+				kore_debug("got unknown: %s", opt[2]);
 				kore_free(name);
-				continue;
-			}
-
-			val++;
-			kore_strip_chars(val, '"', &fname);
-			if (strlen(fname) > 0) {
-				multipart_file_add(req,
-				    in, name, fname, boundary, blen);
+				name = NULL;
 			}
-			kore_free(fname);
-		} else {
-			kore_debug("got unknown: %s", opt[2]);
 		}
 
+		break;
+	}
+
+	kore_buf_reset(&mp->hdrs);
+
+	if (name == NULL)
+		return (KORE_RESULT_OK);
+
+	if (fname == NULL) {
+		mp->name = name;
+		return (KORE_RESULT_OK);
+	}
+
+	if (*fname == '\0') {
+		kore_free(fname);
 		kore_free(name);
+		return (KORE_RESULT_OK);
+	}
+
+	f = kore_calloc(1, sizeof(*f));
+	f->fd = -1;
+	f->req = mp->req;
+	f->name = name;
+	f->filename = fname;
+
+	if (mp->mode == MULTIPART_MODE_SPOOL) {
+		len = snprintf(path, sizeof(path),
+		    "%s/http_part.XXXXXX", http_body_disk_path);
+		if (len == -1 || (size_t)len >= sizeof(path)) {
+			multipart_file_free(f);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if ((f->fd = mkstemp(path)) == -1) {
+			kore_log(LOG_ERR, "mkstemp(%s): %s", path, errno_s);
+			multipart_file_free(f);
+			return (KORE_RESULT_ERROR);
+		}
+
+		/* Nobody gets to it by name, it goes away with the fd. */
+		(void)unlink(path);
 	}
 
+	mp->file = f;
+
 	return (KORE_RESULT_OK);
 }
 
-static void
-multipart_add_field(struct http_request *req, struct kore_buf *in,
-    char *name, const char *boundary, const int blen)
+static int
+multipart_part_end(struct http_multipart *mp)
 {
-	struct kore_buf		*data;
+	struct http_file	*f;
 	char			*string;
 
-	data = kore_buf_alloc(128);
+	kore_buf_reset(&mp->hdrs);
 
-	if (!multipart_find_data(in, data, NULL, req, boundary, blen)) {
-		kore_buf_free(data);
-		return;
-	}
+	if ((f = mp->file) != NULL) {
+		mp->file = NULL;
 
-	if (data->offset < 3) {
-		kore_buf_free(data);
-		return;
+		if (mp->mode == MULTIPART_MODE_CALLBACK &&
+		    mp->cb(mp->req, f, NULL, 0) != KORE_RESULT_OK) {
+			multipart_file_free(f);
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (f->length == 0 && mp->mode != MULTIPART_MODE_CALLBACK) {
+			multipart_file_free(f);
+			return (KORE_RESULT_OK);
+		}
+
+		TAILQ_INSERT_TAIL(&(mp->req->files), f, list);
+	} else if (mp->name != NULL) {
+		if (mp->field.offset > 0) {
+			string = kore_buf_stringify(&mp->field, NULL);
+			http_argument_add(mp->req, mp->name, string, 0, 0);
+		}
+
+		kore_free(mp->name);
+		mp->name = NULL;
+		kore_buf_reset(&mp->field);
 	}
 
-	data->offset -= 2;
-	string = kore_buf_stringify(data, NULL);
-	http_argument_add(req, name, string, 0, 0);
-	kore_buf_free(data);
+	return (KORE_RESULT_OK);
 }
 
 static void
-multipart_file_add(struct http_request *req, struct kore_buf *in,
-    const char *name, const char *fname, const char *boundary, const int blen)
+multipart_file_free(struct http_file *f)
 {
-	struct http_file	*f;
-	size_t			position, len;
-
-	position = req->http_body_offset - in->offset;
-	if (!multipart_find_data(in, NULL, &len, req, boundary, blen))
-		return;
-
-	if (len < 3)
-		return;
-	len -= 2;
-
-	f = kore_malloc(sizeof(struct http_file));
-	f->req = req;
-	f->offset = 0;
-	f->length = len;
-	f->position = position;
-	f->name = kore_strdup(name);
-	f->filename = kore_strdup(fname);
+	if (f->fd != -1)
+		(void)close(f->fd);
 
-	TAILQ_INSERT_TAIL(&(req->files), f, list);
+	kore_free(f->filename);
+	kore_free(f->name);
+	kore_free(f);
 }
 
 static void
@@ -1983,7 +3880,8 @@ http_argument_add(struct http_request *req, char *name, char *value, int qs,
 			return;
 	}
 
-	TAILQ_FOREACH(p, &(req->hdlr->params), list) {
+	for (p = kore_module_params_find(req->hdlr, name);
+	    p != NULL; p = p->next) {
 		if (qs == 1 && !(p->flags & KORE_PARAMS_QUERY_STRING))
 			continue;
 		if (qs == 0 && (p->flags & KORE_PARAMS_QUERY_STRING))
@@ -1992,9 +3890,6 @@ http_argument_add(struct http_request *req, char *name, char *value, int qs,
 		if (p->method != req->method)
 			continue;
 
-		if (strcmp(p->name, name))
-			continue;
-
 		if (decode) {
 			if (!http_argument_urldecode(value))
 				return;
@@ -2003,10 +3898,21 @@ http_argument_add(struct http_request *req, char *name, char *value, int qs,
 		if (!kore_validator_check(req, p->validator, value))
 			break;
 
-		q = kore_malloc(sizeof(struct http_arg));
-		q->name = kore_strdup(name);
-		q->s_value = kore_strdup(value);
+		q = http_request_alloc(req, sizeof(struct http_arg));
+		q->name = http_request_strdup(req, name);
+		q->s_value = http_request_strdup(req, value);
 		TAILQ_INSERT_TAIL(&(req->arguments), q, list);
+
+		if (req->arg_slots == NULL) {
+			req->arg_slots = http_request_alloc(req,
+			    req->hdlr->nparams * sizeof(*req->arg_slots));
+			memset(req->arg_slots, 0,
+			    req->hdlr->nparams * sizeof(*req->arg_slots));
+		}
+
+		/* Lookups return the first occurrence of an argument. */
+		if (req->arg_slots[p->slot] == NULL)
+			req->arg_slots[p->slot] = q;
 		break;
 	}
 }
@@ -2018,6 +3924,47 @@ http_body_recv(struct netbuf *nb)
 	u_int64_t		bytes_left;
 	struct http_request	*req = (struct http_request *)nb->extra;
 
+	/* The handler answered before its streamed body was done. */
+	if (req == NULL) {
+		net_recv_reset(nb->owner, NETBUF_SEND_PAYLOAD_MAX,
+		    http_body_recv);
+		return (KORE_RESULT_OK);
+	}
+
+	if (req->flags & HTTP_REQUEST_BODY_STREAM) {
+		req->content_length -= nb->s_off;
+		if (req->content_length == 0) {
+			nb->extra = NULL;
+			req->flags |= HTTP_REQUEST_BODY_RECEIVED;
+			req->timing.body = kore_time_us();
+		}
+
+		switch (http_body_stream_data(req, nb->buf, nb->s_off)) {
+		case KORE_RESULT_OK:
+			if (!(req->flags & HTTP_REQUEST_BODY_RECEIVED)) {
+				net_recv_reset(nb->owner,
+				    MIN(req->content_length,
+				    NETBUF_SEND_PAYLOAD_MAX), http_body_recv);
+				break;
+			}
+			/* FALLTHROUGH */
+		case KORE_RESULT_RETRY:
+			/*
+			 * Stop reading until http_body_stream_resume(), or
+			 * until the response restarts the connection.
+			 */
+			net_recvbuf_put(nb->buf);
+			nb->buf = NULL;
+			nb->m_len = 0;
+			nb->owner->http_timeout = 0;
+			break;
+		default:
+			return (KORE_RESULT_ERROR);
+		}
+
+		return (KORE_RESULT_OK);
+	}
+
 	SHA256_Update(&req->hashctx, nb->buf, nb->s_off);
 
 	if (req->http_body_fd != -1) {
@@ -2038,9 +3985,11 @@ http_body_recv(struct netbuf *nb)
 	req->content_length -= nb->s_off;
 
 	if (req->content_length == 0) {
+		KORE_PROBE2(http_body_done, req, req->http_body_length);
+		req->timing.body = kore_time_us();
 		nb->extra = NULL;
 		http_request_wakeup(req);
-		req->flags |= HTTP_REQUEST_COMPLETE;
+		http_request_ready(req);
 		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
 		req->content_length = req->http_body_length;
 		if (!http_body_rewind(req)) {
@@ -2049,7 +3998,11 @@ http_body_recv(struct netbuf *nb)
 			return (KORE_RESULT_ERROR);
 		}
 		SHA256_Final(req->http_body_digest, &req->hashctx);
-		net_recv_reset(nb->owner, http_header_max, http_header_recv);
+
+		/* A pipelined request is read once this one was answered. */
+		net_recvbuf_put(nb->buf);
+		nb->buf = NULL;
+		nb->m_len = 0;
 	} else {
 		bytes_left = req->content_length;
 		net_recv_reset(nb->owner,
@@ -2060,16 +4013,22 @@ http_body_recv(struct netbuf *nb)
 	return (KORE_RESULT_OK);
 }
 
-static void
+void
 http_error_response(struct connection *c, int status)
 {
 	kore_debug("http_error_response(%p, %d)", c, status);
-	c->flags |= CONN_CLOSE_EMPTY;
 
 	switch (c->proto) {
 	case CONN_PROTO_HTTP:
+		c->flags |= CONN_CLOSE_EMPTY;
 		http_response_normal(NULL, c, status, NULL, 0);
 		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		/* Goes out on the stream being parsed, see http2.c. */
+		http_response_h2(NULL, c, status, NULL, 0, 0);
+		break;
+#endif
 	default:
 		fatal("http_error_response() bad proto %d", c->proto);
 		/* NOTREACHED. */
@@ -2079,6 +4038,115 @@ http_error_response(struct connection *c, int status)
 		kore_connection_disconnect(c);
 }
 
+static void
+http_response_send(struct http_request *req, int status,
+    const void *d, size_t l)
+{
+	req->status = status;
+	switch (req->owner->proto) {
+	case CONN_PROTO_HTTP:
+	case CONN_PROTO_WEBSOCKET:
+		http_response_normal(req, req->owner, status, d, l);
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http_response_h2(req, req->owner, status, d, l, 0);
+		break;
+#endif
+	default:
+		fatal("http_response() bad proto %d", req->owner->proto);
+		/* NOTREACHED. */
+	}
+}
+
+/*
+ * Send a body the caller handed over, cb is called with arg as the
+ * netbuf its extra once the body is no longer needed. This happens
+ * right away if the body ends up being copied or is not sent at all.
+ */
+static void
+http_response_owned(struct http_request *req, int status, void *d,
+    size_t len, int (*cb)(struct netbuf *), void *arg)
+{
+	struct netbuf		*nb;
+	int			send_body;
+#if defined(KORE_USE_ZLIB)
+	struct kore_buf		gz;
+#endif
+
+	if (req->owner == NULL || len == 0) {
+		http_response(req, status, d, len);
+		http_response_owned_done(cb, arg);
+		return;
+	}
+
+	if (req->cache_state == HTTP_CACHE_FILLING)
+		http_cache_store(req, status, d, len);
+
+#if defined(KORE_USE_ZLIB)
+	kore_buf_init(&gz, 0);
+	if (http_compress_response(req, status, d, len, &gz)) {
+		http_response_send(req, status, gz.data, gz.offset);
+		kore_buf_cleanup(&gz);
+		http_response_owned_done(cb, arg);
+		return;
+	}
+	kore_buf_cleanup(&gz);
+#endif
+
+	req->status = status;
+	send_body = (req->method != HTTP_METHOD_HEAD);
+
+	switch (req->owner->proto) {
+	case CONN_PROTO_HTTP:
+	case CONN_PROTO_WEBSOCKET:
+		http_response_normal(req, req->owner, status, NULL, len);
+		if (send_body) {
+			net_send_stream(req->owner, d, len, cb, &nb);
+			nb->extra = arg;
+		}
+		break;
+#if defined(KORE_USE_HTTP2)
+	case CONN_PROTO_HTTP2:
+		http_response_h2(req, req->owner, status, NULL, len, send_body);
+		if (send_body)
+			http2_response_stream(req, d, len, cb, arg);
+		break;
+#endif
+	default:
+		fatal("http_response_owned() bad proto %d", req->owner->proto);
+		/* NOTREACHED. */
+	}
+
+	if (!send_body)
+		http_response_owned_done(cb, arg);
+}
+
+static void
+http_response_owned_done(int (*cb)(struct netbuf *), void *arg)
+{
+	struct netbuf		nb;
+
+	memset(&nb, 0, sizeof(nb));
+	nb.extra = arg;
+
+	(void)cb(&nb);
+}
+
+static int
+http_response_buf_sent(struct netbuf *nb)
+{
+	kore_free(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+static int
+http_body_ref_sent(struct netbuf *nb)
+{
+	http_body_ref_release(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
 static void
 http_response_normal(struct http_request *req, struct connection *c,
     int status, const void *d, size_t len)
@@ -2089,6 +4157,7 @@ http_response_normal(struct http_request *req, struct connection *c,
 	char			version;
 	const char		*conn, *text;
 	int			connection_close, send_body;
+	char			timing[128];
 
 	send_body = 1;
 	text = http_status_text(status);
@@ -2105,19 +4174,22 @@ http_response_normal(struct http_request *req, struct connection *c,
 		version = '1';
 	}
 
-	kore_buf_appendf(header_buf, "HTTP/1.%c %d %s\r\n",
-	    version, status, text);
-	kore_buf_append(header_buf, http_version, http_version_len);
+	http_append_status(header_buf, version, status, text);
 
 	if ((c->flags & CONN_CLOSE_EMPTY) ||
 	    (req != NULL && (req->flags & HTTP_VERSION_1_0))) {
 		connection_close = 1;
+	} else if (req != NULL && (req->flags & HTTP_REQUEST_BODY_STREAM) &&
+	    (req->flags & HTTP_REQUEST_EXPECT_BODY)) {
+		/* The rest of the body is still on the wire. */
+		connection_close = 1;
 	} else {
 		connection_close = 0;
 	}
 
 	if (connection_close == 0 && req != NULL) {
-		if (http_request_header(req, "connection", &conn)) {
+		if (http_request_header_id(req,
+		    HTTP_HEADER_CONNECTION, &conn)) {
 			if ((*conn == 'c' || *conn == 'C') &&
 			    !strcasecmp(conn, "close")) {
 				connection_close = 1;
@@ -2126,26 +4198,19 @@ http_response_normal(struct http_request *req, struct connection *c,
 	}
 
 	/* Note that req CAN be NULL. */
-	if (req == NULL || req->owner->proto != CONN_PROTO_WEBSOCKET) {
-		if (http_keepalive_time && connection_close == 0) {
-			kore_buf_appendf(header_buf,
-			    "connection: keep-alive\r\n");
-			kore_buf_appendf(header_buf,
-			    "keep-alive: timeout=%d\r\n", http_keepalive_time);
-		} else {
-			c->flags |= CONN_CLOSE_EMPTY;
-			kore_buf_appendf(header_buf, "connection: close\r\n");
-		}
+	if (req != NULL && req->owner->proto == CONN_PROTO_WEBSOCKET) {
+		http_append_block(header_buf, HTTP_BLOCK_NOCONN);
+	} else if (http_keepalive_time && connection_close == 0) {
+		http_append_block(header_buf, HTTP_BLOCK_KEEPALIVE);
+	} else {
+		c->flags |= CONN_CLOSE_EMPTY;
+		http_append_block(header_buf, HTTP_BLOCK_CLOSE);
 	}
 
-	if (http_hsts_enable) {
-		kore_buf_appendf(header_buf, "strict-transport-security: ");
-		kore_buf_appendf(header_buf,
-		    "max-age=%" PRIu64 "; includeSubDomains\r\n",
-		    http_hsts_enable);
-	}
+	http_append_date(header_buf);
 
-	if (http_pretty_error && d == NULL && status >= 400) {
+	if (http_pretty_error && d == NULL && len == 0 && status >= 400 &&
+	    !(c->flags & CONN_CHUNKED)) {
 		kore_buf_appendf(&buf, pretty_error_fmt,
 		    status, text, status, text);
 
@@ -2158,20 +4223,21 @@ http_response_normal(struct http_request *req, struct connection *c,
 			http_write_response_cookie(ck);
 
 		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
-			kore_buf_appendf(header_buf, "%s: %s\r\n",
+			kore_buf_append_header(header_buf,
 			    hdr->header, hdr->value);
 		}
 
-		if (status != 204 && status >= 200 &&
-		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH)) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %zu\r\n", len);
+		if (http_timing_render(req, timing, sizeof(timing))) {
+			kore_buf_append_header(header_buf,
+			    "server-timing", timing);
 		}
+
+		if (status != 204 && status >= 200 &&
+		    !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH))
+			http_append_length(header_buf, len);
 	} else {
-		if (status != 204 && status >= 200) {
-			kore_buf_appendf(header_buf,
-			    "content-length: %zu\r\n", len);
-		}
+		if (status != 204 && status >= 200)
+			http_append_length(header_buf, len);
 	}
 
 	kore_buf_append(header_buf, "\r\n", 2);
@@ -2192,8 +4258,244 @@ http_response_normal(struct http_request *req, struct connection *c,
 	kore_buf_cleanup(&buf);
 }
 
+#if defined(KORE_USE_HTTP2)
+/*
+ * The HTTP/2 counterpart of http_response_normal(), the same headers
+ * minus the connection specific ones are handed to the HPACK encoder.
+ * If more is set the body follows via http2_response_stream() or
+ * http2_response_fileref().
+ */
+static void
+http_response_h2(struct http_request *req, struct connection *c,
+    int status, const void *d, size_t len, int more)
+{
+	struct kore_buf		buf;
+	struct http_cookie	*ck;
+	struct http_header	*hdr;
+	const char		*text, *cookie;
+	int			l, send_body;
+	char			tmp[128];
+
+	if (!http2_response_begin(c, req, status))
+		return;
+
+	send_body = 1;
+	text = http_status_text(status);
+	kore_buf_init(&buf, 1024);
+
+	http2_response_header(c, "server", 6,
+	    http_version + 8, http_version_len - 10);
+
+	http_date_update();
+	if (http_date_len > 0) {
+		http2_response_header(c, "date", 4,
+		    http_date + 6, http_date_len - 8);
+	}
+
+	if (http_hsts_enable) {
+		l = snprintf(tmp, sizeof(tmp),
+		    "max-age=%" PRIu64 "; includeSubDomains", http_hsts_enable);
+		if (l != -1 && (size_t)l < sizeof(tmp)) {
+			http2_response_header(c,
+			    "strict-transport-security", 25, tmp, l);
+		}
+	}
+
+	if (http_pretty_error && d == NULL && !more && status >= 400) {
+		kore_buf_appendf(&buf, pretty_error_fmt,
+		    status, text, status, text);
+
+		d = buf.data;
+		len = buf.offset;
+	}
+
+	if (req != NULL) {
+		TAILQ_FOREACH(ck, &(req->resp_cookies), list) {
+			if ((cookie = http_render_cookie(ck)) != NULL) {
+				http2_response_header(c, "set-cookie", 10,
+				    cookie, strlen(cookie));
+			}
+		}
+
+		TAILQ_FOREACH(hdr, &(req->resp_headers), list) {
+			http2_response_header(c, hdr->header,
+			    strlen(hdr->header), hdr->value,
+			    strlen(hdr->value));
+		}
+
+		if (http_timing_render(req, tmp, sizeof(tmp))) {
+			http2_response_header(c, "server-timing", 13,
+			    tmp, strlen(tmp));
+		}
+	}
+
+	if (status != 204 && status >= 200 &&
+	    (req == NULL || !(req->flags & HTTP_REQUEST_NO_CONTENT_LENGTH))) {
+		l = snprintf(tmp, sizeof(tmp), "%zu", len);
+		if (l != -1 && (size_t)l < sizeof(tmp))
+			http2_response_header(c, "content-length", 14, tmp, l);
+	}
+
+	if (req != NULL && req->method == HTTP_METHOD_HEAD)
+		send_body = 0;
+
+	http2_response_end(c, req, send_body ? d : NULL, len, more);
+
+	if (req != NULL)
+		req->content_length = len;
+
+	kore_buf_cleanup(&buf);
+}
+#endif
+
+static void
+http_append_status(struct kore_buf *buf, int version, int status,
+    const char *text)
+{
+	int			l, idx;
+	struct http_prerender	*line;
+	char			tmp[128];
+
+	if (status < HTTP_STATUS_CACHE_MIN || status > HTTP_STATUS_CACHE_MAX) {
+		kore_buf_appendf(buf, "HTTP/1.%c %d %s\r\n",
+		    version, status, text);
+		return;
+	}
+
+	idx = (version == '0') ? 0 : 1;
+	line = &http_status_lines[idx][status - HTTP_STATUS_CACHE_MIN];
+
+	if (line->data == NULL) {
+		l = snprintf(tmp, sizeof(tmp), "HTTP/1.%c %d %s\r\n",
+		    version, status, text);
+		if (l == -1 || (size_t)l >= sizeof(tmp))
+			fatal("http_append_status: status line too long");
+
+		line->data = kore_strdup(tmp);
+		line->len = l;
+	}
+
+	kore_buf_append(buf, line->data, line->len);
+}
+
+static void
+http_append_block(struct kore_buf *buf, int which)
+{
+	struct kore_buf		tmp;
+	struct http_prerender	*block;
+
+	block = &http_blocks[which];
+
+	if (block->data == NULL) {
+		kore_buf_init(&tmp, 256);
+		kore_buf_append(&tmp, http_version, http_version_len);
+
+		switch (which) {
+		case HTTP_BLOCK_KEEPALIVE:
+			kore_buf_appendf(&tmp, "connection: keep-alive\r\n");
+			kore_buf_appendf(&tmp, "keep-alive: timeout=%d\r\n",
+			    http_keepalive_time);
+			break;
+		case HTTP_BLOCK_CLOSE:
+			kore_buf_appendf(&tmp, "connection: close\r\n");
+			break;
+		default:
+			break;
+		}
+
+		if (http_hsts_enable) {
+			kore_buf_appendf(&tmp, "strict-transport-security: ");
+			kore_buf_appendf(&tmp,
+			    "max-age=%" PRIu64 "; includeSubDomains\r\n",
+			    http_hsts_enable);
+		}
+
+		block->data = kore_buf_stringify(&tmp, &block->len);
+		block->data = kore_strdup(block->data);
+		kore_buf_cleanup(&tmp);
+	}
+
+	kore_buf_append(buf, block->data, block->len);
+}
+
+static void
+http_append_date(struct kore_buf *buf)
+{
+	http_date_update();
+
+	if (http_date_len > 0)
+		kore_buf_append(buf, http_date, http_date_len);
+}
+
+static void
+http_date_update(void)
+{
+	struct tm	tm;
+	time_t		now;
+
+	time(&now);
+
+	if (now != http_date_time || http_date_len == 0) {
+		if (gmtime_r(&now, &tm) == NULL) {
+			http_date_len = 0;
+			return;
+		}
+
+		http_date_len = strftime(http_date, sizeof(http_date),
+		    "date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		http_date_time = now;
+	}
+}
+
+static void
+http_append_length(struct kore_buf *buf, size_t len)
+{
+	char		*p, tmp[48];
+
+	p = tmp + sizeof(tmp);
+	*--p = '\n';
+	*--p = '\r';
+
+	do {
+		*--p = '0' + (len % 10);
+		len /= 10;
+	} while (len > 0);
+
+	p -= 16;
+	memcpy(p, "content-length: ", 16);
+
+	kore_buf_append(buf, p, (tmp + sizeof(tmp)) - p);
+}
+
+static void
+http_prerender_cleanup(void)
+{
+	int		i, v;
+
+	for (v = 0; v < 2; v++) {
+		for (i = 0; i < HTTP_STATUS_CACHE_LEN; i++) {
+			kore_free(http_status_lines[v][i].data);
+			http_status_lines[v][i].data = NULL;
+		}
+	}
+
+	for (i = 0; i < HTTP_BLOCK_MAX; i++) {
+		kore_free(http_blocks[i].data);
+		http_blocks[i].data = NULL;
+	}
+}
+
 static void
 http_write_response_cookie(struct http_cookie *ck)
+{
+	const char	*cookie;
+
+	if ((cookie = http_render_cookie(ck)) != NULL)
+		kore_buf_append_header(header_buf, "set-cookie", cookie);
+}
+
+static const char *
+http_render_cookie(struct http_cookie *ck)
 {
 	struct tm		tm;
 	char			expires[HTTP_DATE_MAXSIZE];
@@ -2209,28 +4511,29 @@ http_write_response_cookie(struct http_cookie *ck)
 	if (ck->expires > 0) {
 		if (gmtime_r(&ck->expires, &tm) == NULL) {
 			kore_log(LOG_ERR, "gmtime_r(): %s", errno_s);
-			return;
+			return (NULL);
 		}
 
 		if (strftime(expires, sizeof(expires),
 		    "%a, %d %b %y %H:%M:%S GMT", &tm) == 0) {
 			kore_log(LOG_ERR, "strftime(): %s", errno_s);
-			return;
+			return (NULL);
 		}
 
 		kore_buf_appendf(ckhdr_buf, "; Expires=%s", expires);
 	}
 
-	if (ck->maxage > 0)
-		kore_buf_appendf(ckhdr_buf, "; Max-Age=%u", ck->maxage);
+	if (ck->maxage > 0) {
+		kore_buf_append(ckhdr_buf, "; Max-Age=", 10);
+		kore_buf_append_uint(ckhdr_buf, ck->maxage);
+	}
 
 	if (ck->flags & HTTP_COOKIE_HTTPONLY)
-		kore_buf_appendf(ckhdr_buf, "; HttpOnly");
+		kore_buf_append(ckhdr_buf, "; HttpOnly", 10);
 	if (ck->flags & HTTP_COOKIE_SECURE)
-		kore_buf_appendf(ckhdr_buf, "; Secure");
+		kore_buf_append(ckhdr_buf, "; Secure", 8);
 
-	kore_buf_appendf(header_buf, "set-cookie: %s\r\n",
-	    kore_buf_stringify(ckhdr_buf, NULL));
+	return (kore_buf_stringify(ckhdr_buf, NULL));
 }
 
 const char *
@@ -2472,6 +4775,92 @@ http_media_type(const char *path)
 	return (NULL);
 }
 
+/*
+ * FNV-1a over the lowercased header name.
+ */
+static u_int32_t
+http_header_hash(const char *name, u_int32_t seed)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U ^ seed;
+
+	while (*name != '\0') {
+		hash ^= (u_int8_t)tolower(*(const unsigned char *)name++);
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static int
+http_header_known(const char *name, u_int32_t hash)
+{
+	int		id;
+
+	if ((id = http_header_perfect[hash & (HTTP_HEADER_PERFECT - 1)]) == 0)
+		return (-1);
+
+	id--;
+	if (strcasecmp(name, http_header_names[id]))
+		return (-1);
+
+	return (id);
+}
+
+void
+http_header_index(struct http_request *req, struct http_header *hdr)
+{
+	int			id;
+	struct http_header	*p;
+	u_int32_t		slot;
+
+	hdr->next = NULL;
+	hdr->hash = http_header_hash(hdr->header, http_header_seed);
+
+	if ((id = http_header_known(hdr->header, hdr->hash)) != -1) {
+		if (req->hdr_known[id] == NULL)
+			req->hdr_known[id] = hdr;
+		return;
+	}
+
+	/* Only the first occurrence of a header is returned by lookups. */
+	slot = hdr->hash & (HTTP_REQ_HEADER_SLOTS - 1);
+	for (p = req->hdr_slots[slot]; p != NULL; p = p->next) {
+		if (p->hash == hdr->hash && !strcasecmp(p->header, hdr->header))
+			return;
+	}
+
+	hdr->next = req->hdr_slots[slot];
+	req->hdr_slots[slot] = hdr;
+}
+
+static void
+http_header_perfect_init(void)
+{
+	u_int32_t	seed, slot;
+	int		id;
+
+	for (seed = 0; seed < 4096; seed++) {
+		memset(http_header_perfect, 0, sizeof(http_header_perfect));
+
+		for (id = 0; id < HTTP_HEADER_ID_MAX; id++) {
+			slot = http_header_hash(http_header_names[id], seed) &
+			    (HTTP_HEADER_PERFECT - 1);
+			if (http_header_perfect[slot] != 0)
+				break;
+			http_header_perfect[slot] = id + 1;
+		}
+
+		if (id == HTTP_HEADER_ID_MAX) {
+			http_header_seed = seed;
+			return;
+		}
+	}
+
+	fatal("http_header_perfect_init: no perfect seed found");
+}
+
 char *
 http_validate_header(char *header)
 {
@@ -2510,3 +4899,159 @@ http_validate_header(char *header)
 
 	return (value);
 }
+
+static void
+http_json_stream_flush(struct http_json_stream *js)
+{
+	struct kore_buf		swap;
+
+	swap = js->inflight;
+	js->inflight = js->pending;
+	js->pending = swap;
+
+	js->flags |= HTTP_JSON_STREAM_SENDING;
+	http_response_chunk(js->req, js->inflight.data, js->inflight.offset,
+	    http_json_stream_sent, js);
+}
+
+static int
+http_json_stream_sent(struct netbuf *nb)
+{
+	struct http_json_stream		*js = nb->extra;
+
+	js->flags &= ~HTTP_JSON_STREAM_SENDING;
+	kore_buf_reset(&js->inflight);
+
+	if (js->req == NULL)
+		http_json_stream_free(js);
+	else
+		http_request_wakeup(js->req);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+http_json_stream_free(struct http_json_stream *js)
+{
+	kore_buf_cleanup(&js->pending);
+	kore_buf_cleanup(&js->inflight);
+	kore_free(js);
+}
+
+static void
+http_arena_reset(struct http_request *req)
+{
+	struct http_arena	*page, *next;
+
+	for (page = req->arena; page != NULL; page = next) {
+		next = page->next;
+		if (page->size == HTTP_ARENA_PAGE)
+			kore_pool_put(&http_arena_pool, page);
+		else
+			kore_free(page);
+	}
+
+	req->arena = NULL;
+}
+
+/*
+ * Moves the requests woken up since the last pass back onto the run
+ * queue for their priority.
+ */
+static void
+http_wakeups_deliver(void)
+{
+	u_int32_t		i;
+	struct http_request	*req;
+
+	if (http_wakeups_len == 0)
+		return;
+
+	http_wakeup_batches++;
+	http_wakeup_batch_max = MAX(http_wakeup_batch_max, http_wakeups_len);
+
+	for (i = 0; i < http_wakeups_len; i++) {
+		if ((req = http_wakeups[i]) == NULL)
+			continue;
+
+		kore_debug("http_wakeups_deliver: %p woke up", req);
+
+		req->wakeup = 0;
+		req->flags &= ~HTTP_REQUEST_SLEEPING;
+		TAILQ_REMOVE(&http_requests_sleeping, req, list);
+
+		if (req->timing.sleep_start != 0) {
+			req->timing.slept +=
+			    kore_time_us() - req->timing.sleep_start;
+			req->timing.sleep_start = 0;
+		}
+		TAILQ_INSERT_TAIL(&http_requests[req->prio], req, list);
+	}
+
+	http_wakeups_len = 0;
+}
+
+/*
+ * Notes when the response for req was built and, if http_server_timing
+ * is on, renders the phases so far as a Server-Timing value in ms.
+ */
+static int
+http_timing_render(struct http_request *req, char *out, size_t len)
+{
+	int		i, l;
+	size_t		off;
+	u_int64_t	us;
+
+	if (req->timing.response == 0)
+		req->timing.response = kore_time_us();
+
+	if (!http_server_timing)
+		return (0);
+
+	off = 0;
+	for (i = 0; i < HTTP_TIMING_SEND; i++) {
+		if ((us = http_request_timing(req, i)) == 0)
+			continue;
+
+		l = snprintf(out + off, len - off, "%s%s;dur=%.3f",
+		    off ? ", " : "", http_timing_name(i), (double)us / 1000);
+		if (l == -1 || (size_t)l >= len - off)
+			break;
+		off += l;
+	}
+
+	out[off] = '\0';
+
+	return (off > 0);
+}
+
+/*
+ * First time the request gets to run, account for the time it waited.
+ * Returns KORE_RESULT_OK if that is longer than its route allows and
+ * the request should be answered with a 503 instead.
+ */
+static int
+http_request_shed(struct http_request *req)
+{
+	u_int64_t		wait;
+	struct http_prio_stats	*st;
+
+	req->flags |= HTTP_REQUEST_STARTED;
+	req->timing.handler = kore_time_us();
+
+	st = &http_prio[req->prio];
+	wait = req->start - req->ready;
+
+	st->queued--;
+	st->started++;
+	st->wait_total += wait;
+	st->wait_max = MAX(st->wait_max, wait);
+
+	if (req->hdlr->deadline == 0 || wait <= req->hdlr->deadline)
+		return (KORE_RESULT_ERROR);
+
+	st->shed++;
+	kore_debug("shedding %s after %" PRIu64 "ms", req->path, wait);
+
+	return (KORE_RESULT_OK);
+}
@@ -0,0 +1,2374 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * HTTP/2 (RFC 7540) with HPACK (RFC 7541) header compression.
+ *
+ * Each stream is turned into a normal struct http_request so the
+ * handlers, the response functions and the runtimes do not need to
+ * know which protocol the client speaks. The response functions in
+ * http.c call into here to frame headers and bodies for a stream.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "kore.h"
+#include "http.h"
+#include "http2.h"
+
+#define HPACK_STATIC_ENTRIES	61
+#define HPACK_HUFFMAN_MAXBITS	30
+
+#define HTTP2_FIELDS_MAX	(HTTP_REQ_HEADER_MAX + 5)
+#define HTTP2_HEADER_LIST_MAX	(64 * 1024)
+
+struct http2_field {
+	size_t		name;
+	size_t		nlen;
+	size_t		value;
+	size_t		vlen;
+};
+
+static int	http2_frame(struct http2_conn *, u_int8_t, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_data(struct http2_conn *, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_headers(struct http2_conn *, u_int8_t,
+		    u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_continuation(struct http2_conn *, u_int8_t,
+		    u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_rst_stream(struct http2_conn *, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_settings(struct http2_conn *, u_int8_t,
+		    u_int32_t, u_int8_t *, size_t);
+static int	http2_frame_ping(struct http2_conn *, u_int8_t, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_frame_window_update(struct http2_conn *, u_int32_t,
+		    u_int8_t *, size_t);
+static int	http2_headers_done(struct http2_conn *);
+static int	http2_error(struct http2_conn *, u_int32_t);
+static int	http2_ctrl_queue(struct http2_conn *);
+
+static void	http2_send_frame(struct http2_conn *, u_int8_t, u_int8_t,
+		    u_int32_t, const void *, size_t);
+static void	http2_send_rst(struct http2_conn *, u_int32_t, u_int32_t);
+static void	http2_send_window(struct http2_conn *, u_int32_t, u_int32_t);
+static void	http2_send_pending(struct http2_conn *);
+static int	http2_send_data(struct http2_conn *, struct http2_stream *,
+		    size_t, int);
+static int	http2_drained(struct netbuf *);
+static int	http2_buf_sent(struct netbuf *);
+static int	http2_fileref_sent(struct netbuf *);
+
+static struct http2_stream	*http2_stream_new(struct http2_conn *,
+				    u_int32_t);
+static struct http2_stream	*http2_stream_find(struct http2_conn *,
+				    u_int32_t);
+static struct http2_stream	*http2_stream_for(struct connection *,
+				    struct http_request *);
+static void	http2_stream_free(struct http2_stream *);
+static void	http2_stream_check(struct http2_stream *);
+static void	http2_stream_schedule(struct http2_stream *);
+static void	http2_stream_close(struct http2_stream *);
+static void	http2_stream_reset(struct http2_stream *, u_int32_t);
+static void	http2_stream_release(struct http2_stream *);
+static void	http2_stream_error(struct http2_stream *, int);
+
+static void	http2_request_create(struct http2_conn *,
+		    struct http2_stream *, struct http2_field *, int, int);
+static void	http2_request_body(struct http2_stream *,
+		    const u_int8_t *, size_t);
+static void	http2_request_complete(struct http2_stream *);
+
+static void	hpack_init(struct http2_hpack *, size_t);
+static void	hpack_cleanup(struct http2_hpack *);
+static void	hpack_evict(struct http2_hpack *, size_t);
+static void	hpack_insert(struct http2_hpack *, const char *, size_t,
+		    const char *, size_t);
+static int	hpack_lookup(struct http2_hpack *, u_int32_t,
+		    const char **, size_t *, const char **, size_t *);
+static int	hpack_decode(struct http2_conn *, struct http2_field *,
+		    int *, int *);
+static int	hpack_integer(const u_int8_t **, const u_int8_t *,
+		    int, u_int32_t *);
+static int	hpack_string(struct kore_buf *, const u_int8_t **,
+		    const u_int8_t *, size_t *);
+static int	hpack_huffman_decode(struct kore_buf *,
+		    const u_int8_t *, size_t);
+static void	hpack_append_int(struct kore_buf *, u_int8_t, int, size_t);
+static void	hpack_append_string(struct kore_buf *,
+		    const char *, size_t, int);
+static int	hpack_static_name(const char *, size_t);
+
+int		http2_enable = 1;
+u_int32_t	http2_max_streams = HTTP2_MAX_STREAMS;
+
+static struct kore_pool		http2_conn_pool;
+static struct kore_pool		http2_stream_pool;
+
+static u_int8_t		http2_file_buf[HTTP2_FRAME_SIZE_MIN];
+
+static const struct {
+	const char	*name;
+	const char	*value;
+} hpack_static[HPACK_STATIC_ENTRIES] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/* RFC 7541 Appendix B, the code is canonical so we decode from it. */
+static const struct {
+	u_int32_t	code;
+	u_int8_t	bits;
+} hpack_huffman[256] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 },
+	{ 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+	{ 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 },
+	{ 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 },
+	{ 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+	{ 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 },
+	{ 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 },
+	{ 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+	{ 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 },
+	{ 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 }, { 0x1ff9, 13 },
+	{ 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 },
+	{ 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 },
+	{ 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 }, { 0x0, 5 }, { 0x1, 5 },
+	{ 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 },
+	{ 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 },
+	{ 0xfb, 8 }, { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 },
+	{ 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 },
+	{ 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 },
+	{ 0x62, 7 }, { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 },
+	{ 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 },
+	{ 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 },
+	{ 0x6e, 7 }, { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 },
+	{ 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 },
+	{ 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 },
+	{ 0x3ffc, 14 }, { 0x22, 6 }, { 0x7ffd, 15 }, { 0x3, 5 },
+	{ 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 },
+	{ 0x26, 6 }, { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 },
+	{ 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 },
+	{ 0x77, 7 }, { 0x78, 7 }, { 0x79, 7 }, { 0x7a, 7 },
+	{ 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 },
+	{ 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 },
+	{ 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 },
+	{ 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 },
+	{ 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 },
+	{ 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 },
+	{ 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 },
+	{ 0x7fffe2, 23 }, { 0x7fffe3, 23 }, { 0x7fffe4, 23 },
+	{ 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 },
+	{ 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 },
+	{ 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 },
+	{ 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 },
+	{ 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 },
+	{ 0x7fffeb, 23 }, { 0x7fffec, 23 }, { 0x1fffe0, 21 },
+	{ 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 },
+	{ 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 },
+	{ 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 },
+	{ 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 },
+	{ 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 },
+	{ 0x3fffe8, 22 }, { 0x1ffffec, 25 }, { 0x3ffffe2, 26 },
+	{ 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 },
+	{ 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 },
+	{ 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 },
+	{ 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 },
+	{ 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 },
+	{ 0x7ffffe4, 27 }, { 0x7ffffe5, 27 }, { 0xfffec, 20 },
+	{ 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 },
+	{ 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 },
+	{ 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 },
+	{ 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 },
+	{ 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 },
+	{ 0x7ffffe9, 27 }, { 0x7ffffea, 27 }, { 0x7ffffeb, 27 },
+	{ 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 },
+	{ 0x3ffffee, 26 },
+};
+
+static u_int8_t		hpack_huffman_syms[256];
+static u_int32_t	hpack_huffman_first[HPACK_HUFFMAN_MAXBITS + 1];
+static u_int16_t	hpack_huffman_count[HPACK_HUFFMAN_MAXBITS + 1];
+static u_int16_t	hpack_huffman_offset[HPACK_HUFFMAN_MAXBITS + 1];
+
+/* Headers that have no meaning in HTTP/2 (RFC 7540 section 8.1.2.2). */
+static const char *http2_conn_headers[] = {
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"transfer-encoding",
+	"upgrade",
+	NULL
+};
+
+void
+http2_init(void)
+{
+	int		i, len, sym;
+	u_int16_t	off;
+	u_int32_t	code;
+
+	kore_pool_init(&http2_conn_pool, "http2_conn_pool",
+	    sizeof(struct http2_conn), 100);
+	kore_pool_init(&http2_stream_pool, "http2_stream_pool",
+	    sizeof(struct http2_stream), 100);
+
+	off = 0;
+	code = 0;
+
+	for (len = 1; len <= HPACK_HUFFMAN_MAXBITS; len++) {
+		hpack_huffman_first[len] = code;
+		hpack_huffman_offset[len] = off;
+		hpack_huffman_count[len] = 0;
+
+		for (sym = 0; sym < 256; sym++) {
+			if (hpack_huffman[sym].bits != len)
+				continue;
+
+			if (hpack_huffman[sym].code != code +
+			    hpack_huffman_count[len])
+				fatal("http2_init: huffman table not canonical");
+
+			hpack_huffman_syms[off++] = sym;
+			hpack_huffman_count[len]++;
+		}
+
+		code = (code + hpack_huffman_count[len]) << 1;
+	}
+
+	for (i = 0; i < 256; i++) {
+		if (hpack_huffman[i].bits == 0)
+			fatal("http2_init: huffman table incomplete");
+	}
+}
+
+void
+http2_cleanup(void)
+{
+	kore_pool_cleanup(&http2_conn_pool);
+	kore_pool_cleanup(&http2_stream_pool);
+}
+
+int
+http2_connection_start(struct connection *c)
+{
+	struct http2_conn	*h2;
+	u_int8_t		settings[18];
+
+	kore_debug("http2_connection_start(%p)", c);
+
+	h2 = kore_pool_get(&http2_conn_pool);
+
+	h2->c = c;
+	h2->flags = 0;
+	h2->nstreams = 0;
+	h2->current = NULL;
+	h2->last_stream = 0;
+	h2->cont_stream = 0;
+	h2->cont_flags = 0;
+	h2->peer_frame_max = HTTP2_FRAME_SIZE_MIN;
+	h2->peer_window = HTTP2_WINDOW_DEFAULT;
+	h2->send_window = HTTP2_WINDOW_DEFAULT;
+	h2->recv_window = HTTP2_RECV_WINDOW;
+	h2->ctrl_queued = 0;
+	h2->rst_count = 0;
+	h2->rst_start = 0;
+
+	kore_buf_init(&h2->hblock, 1024);
+	kore_buf_init(&h2->hlist, 4096);
+	kore_buf_init(&h2->hdrs, 512);
+	hpack_init(&h2->decoder, HTTP2_HPACK_TABLE_SIZE);
+
+	TAILQ_INIT(&h2->streams);
+	TAILQ_INIT(&h2->pending);
+
+	c->h2 = h2;
+	c->proto = CONN_PROTO_HTTP2;
+	c->http_scan = 0;
+	c->http_timeout = 0;
+
+	settings[0] = 0;
+	settings[1] = HTTP2_SETTING_MAX_CONCURRENT_STREAMS;
+	net_write32(&settings[2], http2_max_streams);
+	settings[6] = 0;
+	settings[7] = HTTP2_SETTING_INITIAL_WINDOW_SIZE;
+	net_write32(&settings[8], HTTP2_RECV_WINDOW);
+	settings[12] = 0;
+	settings[13] = HTTP2_SETTING_MAX_HEADER_LIST_SIZE;
+	net_write32(&settings[14], HTTP2_HEADER_LIST_MAX);
+
+	http2_send_frame(h2, HTTP2_FRAME_SETTINGS, 0, 0,
+	    settings, sizeof(settings));
+	http2_send_window(h2, 0, HTTP2_RECV_WINDOW - HTTP2_WINDOW_DEFAULT);
+
+	/* A prior-knowledge client already sent (part of) its preface. */
+	if (c->rnb != NULL) {
+		if (c->rnb->b_len < HTTP2_RECV_BUFSIZE) {
+			net_recv_expand(c,
+			    HTTP2_RECV_BUFSIZE - c->rnb->b_len, http2_recv);
+		}
+		c->rnb->cb = http2_recv;
+		return (http2_recv(c->rnb));
+	}
+
+	net_recv_queue(c, HTTP2_RECV_BUFSIZE,
+	    NETBUF_CALL_CB_ALWAYS, http2_recv);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Tell the peer we are going away so it won't open new streams on an
+ * idle connection, it is closed once the frame went out.
+ */
+void
+http2_goaway(struct connection *c)
+{
+	if (c->h2 == NULL)
+		return;
+
+	(void)http2_error(c->h2, HTTP2_ERROR_NO_ERROR);
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+void
+http2_connection_free(struct connection *c)
+{
+	struct http2_conn	*h2;
+	struct http2_stream	*s;
+
+	if ((h2 = c->h2) == NULL)
+		return;
+
+	kore_debug("http2_connection_free(%p)", c);
+
+	while ((s = TAILQ_FIRST(&h2->streams)) != NULL) {
+		if (s->req != NULL) {
+			s->req->h2_stream = NULL;
+			s->req = NULL;
+		}
+		http2_stream_release(s);
+		http2_stream_free(s);
+	}
+
+	kore_buf_cleanup(&h2->hblock);
+	kore_buf_cleanup(&h2->hlist);
+	kore_buf_cleanup(&h2->hdrs);
+	hpack_cleanup(&h2->decoder);
+
+	kore_pool_put(&http2_conn_pool, h2);
+	c->h2 = NULL;
+}
+
+int
+http2_recv(struct netbuf *nb)
+{
+	struct connection	*c;
+	struct http2_conn	*h2;
+	size_t			off, len;
+	u_int32_t		id;
+	u_int8_t		*p, type, flags;
+
+	c = nb->owner;
+	h2 = c->h2;
+	off = 0;
+
+	if (h2->flags & HTTP2_CONN_GOAWAY) {
+		nb->s_off = 0;
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(h2->flags & HTTP2_CONN_PREFACE)) {
+		len = MIN(nb->s_off, HTTP2_PREFACE_LEN);
+		if (memcmp(nb->buf, HTTP2_PREFACE, len))
+			return (KORE_RESULT_ERROR);
+		if (len < HTTP2_PREFACE_LEN)
+			return (KORE_RESULT_OK);
+
+		off = HTTP2_PREFACE_LEN;
+		h2->flags |= HTTP2_CONN_PREFACE;
+	}
+
+	/* Our earlier acks went out, the peer is reading. */
+	if (TAILQ_EMPTY(&c->send_queue))
+		h2->ctrl_queued = 0;
+
+	while (nb->s_off - off >= HTTP2_FRAME_HDR_LEN) {
+		p = nb->buf + off;
+
+		len = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+		type = p[3];
+		flags = p[4];
+		id = net_read32(&p[5]) & HTTP2_WINDOW_MAX;
+
+		if (len > HTTP2_FRAME_SIZE_MIN) {
+			(void)http2_error(h2, HTTP2_ERROR_FRAME_SIZE);
+			break;
+		}
+
+		if (nb->s_off - off < HTTP2_FRAME_HDR_LEN + len)
+			break;
+
+		off += HTTP2_FRAME_HDR_LEN + len;
+
+		if (!http2_frame(h2, type, flags, id,
+		    p + HTTP2_FRAME_HDR_LEN, len))
+			break;
+	}
+
+	if (h2->flags & HTTP2_CONN_GOAWAY) {
+		nb->s_off = 0;
+	} else {
+		if (off > 0 && off < nb->s_off)
+			memmove(nb->buf, nb->buf + off, nb->s_off - off);
+		nb->s_off -= off;
+	}
+
+	http2_send_pending(h2);
+
+	return (net_send_flush(c));
+}
+
+void
+http2_request_free(struct http_request *req)
+{
+	struct http2_stream	*s;
+	struct connection	*c;
+
+	if ((s = req->h2_stream) == NULL)
+		return;
+
+	c = s->h2->c;
+	req->h2_stream = NULL;
+	s->req = NULL;
+
+	/* Handler never finished its response, the client wants to know. */
+	if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED) &&
+	    (s->out.type == HTTP2_DATA_NONE || (s->flags & HTTP2_STREAM_MORE)))
+		http2_stream_reset(s, HTTP2_ERROR_INTERNAL);
+	else
+		http2_stream_check(s);
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+}
+
+/*
+ * The handler caught up with its streamed body, give the stream its
+ * window back so the client can send the rest.
+ */
+void
+http2_request_body_resume(struct http_request *req)
+{
+	struct http2_stream	*s;
+
+	if ((s = req->h2_stream) == NULL)
+		return;
+
+	if (s->flags & (HTTP2_STREAM_LOCAL_CLOSED | HTTP2_STREAM_REMOTE_CLOSED))
+		return;
+
+	if (s->recv_window < HTTP2_RECV_WINDOW / 2) {
+		http2_send_window(s->h2, s->id,
+		    HTTP2_RECV_WINDOW - s->recv_window);
+		s->recv_window = HTTP2_RECV_WINDOW;
+	}
+
+	if (!net_send_flush(s->h2->c))
+		kore_connection_disconnect(s->h2->c);
+}
+
+int
+http2_request_reset(struct http_request *req)
+{
+	struct http2_stream	*s;
+
+	if ((s = req->h2_stream) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		http2_stream_reset(s, HTTP2_ERROR_INTERNAL);
+
+	return (net_send_flush(s->h2->c));
+}
+
+int
+http2_response_begin(struct connection *c, struct http_request *req,
+    int status)
+{
+	int			idx;
+	struct http2_stream	*s;
+	char			tmp[4];
+
+	if ((s = http2_stream_for(c, req)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (s->flags & (HTTP2_STREAM_HEADERS_SENT | HTTP2_STREAM_LOCAL_CLOSED))
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_reset(&c->h2->hdrs);
+
+	switch (status) {
+	case 200:
+		idx = 8;
+		break;
+	case 204:
+		idx = 9;
+		break;
+	case 206:
+		idx = 10;
+		break;
+	case 304:
+		idx = 11;
+		break;
+	case 400:
+		idx = 12;
+		break;
+	case 404:
+		idx = 13;
+		break;
+	case 500:
+		idx = 14;
+		break;
+	default:
+		idx = 0;
+		break;
+	}
+
+	if (idx != 0) {
+		hpack_append_int(&c->h2->hdrs, 0x80, 7, idx);
+	} else {
+		if (status < 100 || status > 999)
+			status = 500;
+
+		tmp[0] = '0' + (status / 100);
+		tmp[1] = '0' + ((status / 10) % 10);
+		tmp[2] = '0' + (status % 10);
+
+		hpack_append_int(&c->h2->hdrs, 0x00, 4, 8);
+		hpack_append_string(&c->h2->hdrs, tmp, 3, 0);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+void
+http2_response_header(struct connection *c, const char *name, size_t nlen,
+    const char *value, size_t vlen)
+{
+	int		i, idx;
+
+	for (i = 0; http2_conn_headers[i] != NULL; i++) {
+		if (strlen(http2_conn_headers[i]) == nlen &&
+		    !strncasecmp(http2_conn_headers[i], name, nlen))
+			return;
+	}
+
+	/* We never index, the response headers vary too much per request. */
+	if ((idx = hpack_static_name(name, nlen)) != 0) {
+		hpack_append_int(&c->h2->hdrs, 0x00, 4, idx);
+	} else {
+		hpack_append_int(&c->h2->hdrs, 0x00, 4, 0);
+		hpack_append_string(&c->h2->hdrs, name, nlen, 1);
+	}
+
+	hpack_append_string(&c->h2->hdrs, value, vlen, 0);
+}
+
+void
+http2_response_end(struct connection *c, struct http_request *req,
+    const void *d, size_t len, int more)
+{
+	struct http2_conn	*h2;
+	struct http2_stream	*s;
+	u_int8_t		type, flags;
+	size_t			off, chunk, left;
+
+	h2 = c->h2;
+	if ((s = http2_stream_for(c, req)) == NULL)
+		return;
+
+	if (d == NULL || len == 0) {
+		d = NULL;
+		len = 0;
+	}
+
+	type = HTTP2_FRAME_HEADERS;
+	flags = (d == NULL && !more) ? HTTP2_FLAG_END_STREAM : 0;
+
+	off = 0;
+	left = h2->hdrs.offset;
+
+	do {
+		chunk = MIN(left, h2->peer_frame_max);
+		if (chunk == left)
+			flags |= HTTP2_FLAG_END_HEADERS;
+
+		http2_send_frame(h2, type, flags, s->id,
+		    h2->hdrs.data + off, chunk);
+
+		off += chunk;
+		left -= chunk;
+		type = HTTP2_FRAME_CONTINUATION;
+		flags = 0;
+	} while (left > 0);
+
+	s->flags |= HTTP2_STREAM_HEADERS_SENT;
+
+	if (d == NULL && !more) {
+		http2_stream_close(s);
+		return;
+	}
+
+	if (d != NULL) {
+		s->out.type = HTTP2_DATA_BUF;
+		s->out.buf = kore_malloc(len);
+		s->out.len = len;
+		s->out.off = 0;
+		memcpy(s->out.buf, d, len);
+		http2_stream_schedule(s);
+		http2_send_pending(h2);
+	}
+}
+
+void
+http2_response_stream(struct http_request *req, void *base, size_t len,
+    int (*cb)(struct netbuf *), void *arg)
+{
+	struct http2_stream	*s;
+	struct netbuf		*nb;
+
+	s = req->h2_stream;
+
+	if (s == NULL || (s->flags & HTTP2_STREAM_LOCAL_CLOSED) ||
+	    s->out.type != HTTP2_DATA_NONE) {
+		if (cb != NULL) {
+			net_send_stream(req->owner, NULL, 0, cb, &nb);
+			nb->extra = arg;
+		}
+		return;
+	}
+
+	s->out.type = HTTP2_DATA_STREAM;
+	s->out.buf = base;
+	s->out.len = len;
+	s->out.off = 0;
+	s->out.cb = cb;
+	s->out.arg = arg;
+
+	http2_stream_schedule(s);
+	http2_send_pending(s->h2);
+}
+
+/*
+ * Keep the stream open after the data handed to http2_response_stream(),
+ * more of it follows until http2_response_chunk_end() is called.
+ */
+void
+http2_response_chunked(struct http_request *req)
+{
+	struct http2_stream	*s;
+
+	if ((s = req->h2_stream) == NULL ||
+	    (s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		return;
+
+	s->flags |= HTTP2_STREAM_MORE;
+}
+
+void
+http2_response_chunk_end(struct http_request *req)
+{
+	struct http2_stream	*s;
+
+	if ((s = req->h2_stream) == NULL ||
+	    (s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		return;
+
+	s->flags &= ~HTTP2_STREAM_MORE;
+
+	/* Data still queued ends the stream by itself once it is sent. */
+	if (s->out.type != HTTP2_DATA_NONE)
+		return;
+
+	http2_send_frame(s->h2, HTTP2_FRAME_DATA, HTTP2_FLAG_END_STREAM,
+	    s->id, NULL, 0);
+	http2_stream_close(s);
+}
+
+void
+http2_response_fileref(struct http_request *req, struct kore_fileref *ref,
+    off_t off, off_t len)
+{
+	struct http2_stream	*s;
+
+	s = req->h2_stream;
+
+	if (s == NULL || (s->flags & HTTP2_STREAM_LOCAL_CLOSED) ||
+	    s->out.type != HTTP2_DATA_NONE) {
+		kore_fileref_release(ref);
+		return;
+	}
+
+	s->out.type = HTTP2_DATA_FILEREF;
+	s->out.ref = ref;
+	s->out.off = off;
+	s->out.len = off + len;
+
+	http2_stream_schedule(s);
+	http2_send_pending(s->h2);
+}
+
+static int
+http2_frame(struct http2_conn *h2, u_int8_t type, u_int8_t flags,
+    u_int32_t id, u_int8_t *data, size_t len)
+{
+	kore_debug("http2_frame(%p): type %u flags 0x%x stream %u len %zu",
+	    h2->c, type, flags, id, len);
+
+	if (h2->cont_stream != 0 && type != HTTP2_FRAME_CONTINUATION)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	switch (type) {
+	case HTTP2_FRAME_DATA:
+		return (http2_frame_data(h2, flags, id, data, len));
+	case HTTP2_FRAME_HEADERS:
+		return (http2_frame_headers(h2, flags, id, data, len));
+	case HTTP2_FRAME_PRIORITY:
+		if (id == 0)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		if (len != 5)
+			http2_send_rst(h2, id, HTTP2_ERROR_FRAME_SIZE);
+		return (KORE_RESULT_OK);
+	case HTTP2_FRAME_RST_STREAM:
+		return (http2_frame_rst_stream(h2, id, data, len));
+	case HTTP2_FRAME_SETTINGS:
+		return (http2_frame_settings(h2, flags, id, data, len));
+	case HTTP2_FRAME_PUSH_PROMISE:
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+	case HTTP2_FRAME_PING:
+		return (http2_frame_ping(h2, flags, id, data, len));
+	case HTTP2_FRAME_GOAWAY:
+		if (id != 0)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		return (KORE_RESULT_OK);
+	case HTTP2_FRAME_WINDOW_UPDATE:
+		return (http2_frame_window_update(h2, id, data, len));
+	case HTTP2_FRAME_CONTINUATION:
+		return (http2_frame_continuation(h2, flags, id, data, len));
+	default:
+		/* Unknown frame types must be ignored. */
+		return (KORE_RESULT_OK);
+	}
+}
+
+static int
+http2_frame_data(struct http2_conn *h2, u_int8_t flags, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	size_t			pad;
+	struct http2_stream	*s;
+
+	if (id == 0)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	if ((int64_t)len > h2->recv_window)
+		return (http2_error(h2, HTTP2_ERROR_FLOW_CONTROL));
+
+	h2->recv_window -= len;
+	if (h2->recv_window < HTTP2_RECV_WINDOW / 2) {
+		http2_send_window(h2, 0, HTTP2_RECV_WINDOW - h2->recv_window);
+		h2->recv_window = HTTP2_RECV_WINDOW;
+	}
+
+	if ((s = http2_stream_find(h2, id)) == NULL) {
+		if (id > h2->last_stream)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		return (KORE_RESULT_OK);
+	}
+
+	if (s->flags & HTTP2_STREAM_REMOTE_CLOSED) {
+		if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+			http2_stream_reset(s, HTTP2_ERROR_STREAM_CLOSED);
+		return (KORE_RESULT_OK);
+	}
+
+	if ((int64_t)len > s->recv_window)
+		return (http2_error(h2, HTTP2_ERROR_FLOW_CONTROL));
+
+	s->recv_window -= len;
+
+	if (flags & HTTP2_FLAG_PADDED) {
+		if (len < 1 || (pad = data[0]) >= len) {
+			http2_stream_reset(s, HTTP2_ERROR_PROTOCOL);
+			return (KORE_RESULT_OK);
+		}
+
+		data++;
+		len -= pad + 1;
+	}
+
+	http2_request_body(s, data, len);
+
+	if (flags & HTTP2_FLAG_END_STREAM) {
+		s->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+		http2_request_complete(s);
+	} else if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED) &&
+	    s->recv_window < HTTP2_RECV_WINDOW / 2) {
+		/* A paused streamed body holds the window of its stream. */
+		if (s->req == NULL ||
+		    !(s->req->flags & HTTP_REQUEST_BODY_PAUSED)) {
+			http2_send_window(h2, s->id,
+			    HTTP2_RECV_WINDOW - s->recv_window);
+			s->recv_window = HTTP2_RECV_WINDOW;
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_headers(struct http2_conn *h2, u_int8_t flags, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	size_t		pad;
+
+	if (id == 0)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	pad = 0;
+	if (flags & HTTP2_FLAG_PADDED) {
+		if (len < 1)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		pad = data[0];
+		data++;
+		len--;
+	}
+
+	if (flags & HTTP2_FLAG_PRIORITY) {
+		if (len < 5)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		data += 5;
+		len -= 5;
+	}
+
+	if (pad > len)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	len -= pad;
+
+	kore_buf_reset(&h2->hblock);
+	kore_buf_append(&h2->hblock, data, len);
+
+	h2->cont_stream = id;
+	h2->cont_flags = flags;
+
+	if (flags & HTTP2_FLAG_END_HEADERS)
+		return (http2_headers_done(h2));
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_continuation(struct http2_conn *h2, u_int8_t flags,
+    u_int32_t id, u_int8_t *data, size_t len)
+{
+	if (h2->cont_stream == 0 || id != h2->cont_stream)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	if (h2->hblock.offset + len > HTTP2_HEADER_LIST_MAX)
+		return (http2_error(h2, HTTP2_ERROR_ENHANCE_YOUR_CALM));
+
+	kore_buf_append(&h2->hblock, data, len);
+
+	if (flags & HTTP2_FLAG_END_HEADERS)
+		return (http2_headers_done(h2));
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_rst_stream(struct http2_conn *h2, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	u_int64_t		now;
+	struct http2_stream	*s;
+
+	if (id == 0 || id > h2->last_stream)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	if (len != 4)
+		return (http2_error(h2, HTTP2_ERROR_FRAME_SIZE));
+
+	/* Opening and resetting streams in a loop costs us, not them. */
+	now = kore_time_ms();
+	if (now - h2->rst_start >= HTTP2_RST_INTERVAL) {
+		h2->rst_start = now;
+		h2->rst_count = 0;
+	}
+
+	if (++h2->rst_count > HTTP2_RST_MAX)
+		return (http2_error(h2, HTTP2_ERROR_ENHANCE_YOUR_CALM));
+
+	if ((s = http2_stream_find(h2, id)) == NULL)
+		return (KORE_RESULT_OK);
+
+	kore_debug("stream %u reset by peer (%u)", id, net_read32(data));
+
+	s->flags |= HTTP2_STREAM_REMOTE_CLOSED | HTTP2_STREAM_LOCAL_CLOSED;
+	http2_stream_release(s);
+
+	/* Let the request go the same way as on a dropped connection. */
+	if (s->req != NULL) {
+		s->req->flags |= HTTP_REQUEST_DELETE;
+		http_request_wakeup(s->req);
+	}
+
+	http2_stream_check(s);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_settings(struct http2_conn *h2, u_int8_t flags, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	size_t			off;
+	int64_t			delta;
+	u_int16_t		setting;
+	u_int32_t		value;
+	struct http2_stream	*s;
+
+	if (id != 0)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	if (flags & HTTP2_FLAG_ACK) {
+		if (len != 0)
+			return (http2_error(h2, HTTP2_ERROR_FRAME_SIZE));
+		return (KORE_RESULT_OK);
+	}
+
+	if (len % 6)
+		return (http2_error(h2, HTTP2_ERROR_FRAME_SIZE));
+
+	for (off = 0; off < len; off += 6) {
+		setting = net_read16(data + off);
+		value = net_read32(data + off + 2);
+
+		switch (setting) {
+		case HTTP2_SETTING_ENABLE_PUSH:
+			if (value > 1)
+				return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+			break;
+		case HTTP2_SETTING_INITIAL_WINDOW_SIZE:
+			if (value > HTTP2_WINDOW_MAX) {
+				return (http2_error(h2,
+				    HTTP2_ERROR_FLOW_CONTROL));
+			}
+
+			delta = (int64_t)value - h2->peer_window;
+			h2->peer_window = value;
+
+			TAILQ_FOREACH(s, &h2->streams, list) {
+				s->send_window += delta;
+				if (s->send_window > HTTP2_WINDOW_MAX) {
+					return (http2_error(h2,
+					    HTTP2_ERROR_FLOW_CONTROL));
+				}
+				http2_stream_schedule(s);
+			}
+			break;
+		case HTTP2_SETTING_MAX_FRAME_SIZE:
+			if (value < HTTP2_FRAME_SIZE_MIN ||
+			    value > HTTP2_FRAME_SIZE_MAX)
+				return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+			h2->peer_frame_max = value;
+			break;
+		default:
+			/*
+			 * We never index our own headers so the peer its
+			 * table size does not matter, we push nothing and
+			 * their stream and header list limits only apply
+			 * to what they would send to us.
+			 */
+			break;
+		}
+	}
+
+	if (!http2_ctrl_queue(h2))
+		return (http2_error(h2, HTTP2_ERROR_ENHANCE_YOUR_CALM));
+
+	http2_send_frame(h2, HTTP2_FRAME_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_ping(struct http2_conn *h2, u_int8_t flags, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	if (id != 0)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	if (len != 8)
+		return (http2_error(h2, HTTP2_ERROR_FRAME_SIZE));
+
+	if (!(flags & HTTP2_FLAG_ACK)) {
+		if (!http2_ctrl_queue(h2))
+			return (http2_error(h2, HTTP2_ERROR_ENHANCE_YOUR_CALM));
+		http2_send_frame(h2, HTTP2_FRAME_PING,
+		    HTTP2_FLAG_ACK, 0, data, len);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_frame_window_update(struct http2_conn *h2, u_int32_t id,
+    u_int8_t *data, size_t len)
+{
+	u_int32_t		inc;
+	struct http2_stream	*s;
+
+	if (len != 4)
+		return (http2_error(h2, HTTP2_ERROR_FRAME_SIZE));
+
+	inc = net_read32(data) & HTTP2_WINDOW_MAX;
+
+	if (id == 0) {
+		if (inc == 0)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+		h2->send_window += inc;
+		if (h2->send_window > HTTP2_WINDOW_MAX)
+			return (http2_error(h2, HTTP2_ERROR_FLOW_CONTROL));
+
+		return (KORE_RESULT_OK);
+	}
+
+	if ((s = http2_stream_find(h2, id)) == NULL) {
+		if (id > h2->last_stream)
+			return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+		return (KORE_RESULT_OK);
+	}
+
+	if (inc == 0) {
+		http2_stream_reset(s, HTTP2_ERROR_PROTOCOL);
+		return (KORE_RESULT_OK);
+	}
+
+	s->send_window += inc;
+	if (s->send_window > HTTP2_WINDOW_MAX) {
+		http2_stream_reset(s, HTTP2_ERROR_FLOW_CONTROL);
+		return (KORE_RESULT_OK);
+	}
+
+	http2_stream_schedule(s);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_headers_done(struct http2_conn *h2)
+{
+	u_int32_t		id;
+	int			nfields, overflow, end;
+	struct http2_stream	*s;
+	struct http2_field	fields[HTTP2_FIELDS_MAX];
+
+	id = h2->cont_stream;
+	end = h2->cont_flags & HTTP2_FLAG_END_STREAM;
+	h2->cont_stream = 0;
+
+	/* Always decode, the table must stay in sync with the peer. */
+	if (!hpack_decode(h2, fields, &nfields, &overflow))
+		return (http2_error(h2, HTTP2_ERROR_COMPRESSION));
+
+	if ((s = http2_stream_find(h2, id)) != NULL) {
+		/* Trailers, we have no use for them. */
+		if (s->flags & HTTP2_STREAM_REMOTE_CLOSED) {
+			if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+				http2_stream_reset(s,
+				    HTTP2_ERROR_STREAM_CLOSED);
+			return (KORE_RESULT_OK);
+		}
+
+		if (!end) {
+			http2_stream_reset(s, HTTP2_ERROR_PROTOCOL);
+			return (KORE_RESULT_OK);
+		}
+
+		s->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+		http2_request_complete(s);
+		return (KORE_RESULT_OK);
+	}
+
+	if (id <= h2->last_stream) {
+		/* A stream we already closed, nothing to do. */
+		return (KORE_RESULT_OK);
+	}
+
+	if ((id & 0x1) == 0)
+		return (http2_error(h2, HTTP2_ERROR_PROTOCOL));
+
+	h2->last_stream = id;
+
+	if (h2->nstreams >= http2_max_streams) {
+		http2_send_rst(h2, id, HTTP2_ERROR_REFUSED_STREAM);
+		return (KORE_RESULT_OK);
+	}
+
+	s = http2_stream_new(h2, id);
+	if (end)
+		s->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+
+	if (overflow) {
+		http2_stream_error(s, HTTP_STATUS_BAD_REQUEST);
+		return (KORE_RESULT_OK);
+	}
+
+	http2_request_create(h2, s, fields, nfields, end);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_error(struct http2_conn *h2, u_int32_t code)
+{
+	u_int8_t		payload[8];
+
+	kore_debug("http2_error(%p): %u", h2->c, code);
+
+	if (h2->flags & HTTP2_CONN_GOAWAY)
+		return (KORE_RESULT_ERROR);
+
+	net_write32(&payload[0], h2->last_stream);
+	net_write32(&payload[4], code);
+
+	http2_send_frame(h2, HTTP2_FRAME_GOAWAY, 0, 0,
+	    payload, sizeof(payload));
+
+	h2->flags |= HTTP2_CONN_GOAWAY;
+	h2->c->flags |= CONN_CLOSE_EMPTY;
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Account for an ack we are about to queue, a peer that keeps sending
+ * PING or SETTINGS without reading our answers would grow the send
+ * queue without bounds.
+ */
+static int
+http2_ctrl_queue(struct http2_conn *h2)
+{
+	if (h2->ctrl_queued >= HTTP2_CTRL_QUEUED_MAX)
+		return (KORE_RESULT_ERROR);
+
+	h2->ctrl_queued++;
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+http2_send_frame(struct http2_conn *h2, u_int8_t type, u_int8_t flags,
+    u_int32_t id, const void *payload, size_t len)
+{
+	u_int8_t	hdr[HTTP2_FRAME_HDR_LEN];
+
+	hdr[0] = (len >> 16) & 0xff;
+	hdr[1] = (len >> 8) & 0xff;
+	hdr[2] = len & 0xff;
+	hdr[3] = type;
+	hdr[4] = flags;
+	net_write32(&hdr[5], id & HTTP2_WINDOW_MAX);
+
+	net_send_queue(h2->c, hdr, sizeof(hdr));
+
+	/* DATA frames pass a NULL payload and queue it themselves. */
+	if (payload != NULL && len > 0)
+		net_send_queue(h2->c, payload, len);
+}
+
+static void
+http2_send_rst(struct http2_conn *h2, u_int32_t id, u_int32_t code)
+{
+	u_int8_t	payload[4];
+
+	net_write32(payload, code);
+	http2_send_frame(h2, HTTP2_FRAME_RST_STREAM, 0, id,
+	    payload, sizeof(payload));
+}
+
+static void
+http2_send_window(struct http2_conn *h2, u_int32_t id, u_int32_t inc)
+{
+	u_int8_t	payload[4];
+
+	net_write32(payload, inc);
+	http2_send_frame(h2, HTTP2_FRAME_WINDOW_UPDATE, 0, id,
+	    payload, sizeof(payload));
+}
+
+/*
+ * Round-robin the streams that have data to send over the window the
+ * peer gave us. We only queue HTTP2_SEND_BATCH bytes at a time and
+ * continue once those went out so a large file does not end up being
+ * copied into the send queue as a whole.
+ */
+static void
+http2_send_pending(struct http2_conn *h2)
+{
+	struct netbuf		*nb;
+	struct http2_stream	*s;
+	size_t			n, batch;
+	int			last;
+
+	if (h2->flags & (HTTP2_CONN_DRAIN_WAIT | HTTP2_CONN_GOAWAY))
+		return;
+
+	if (h2->c->state == CONN_STATE_DISCONNECTING)
+		return;
+
+	batch = 0;
+
+	while ((s = TAILQ_FIRST(&h2->pending)) != NULL) {
+		if (batch >= HTTP2_SEND_BATCH) {
+			net_send_stream(h2->c, NULL, 0, http2_drained, &nb);
+			h2->flags |= HTTP2_CONN_DRAIN_WAIT;
+			break;
+		}
+
+		n = MIN(s->out.len - s->out.off, h2->peer_frame_max);
+
+		if (n > 0) {
+			if (h2->send_window <= 0)
+				break;
+
+			if (s->send_window <= 0) {
+				TAILQ_REMOVE(&h2->pending, s, plist);
+				s->flags &= ~HTTP2_STREAM_PENDING;
+				continue;
+			}
+
+			n = MIN(n, (size_t)h2->send_window);
+			n = MIN(n, (size_t)s->send_window);
+		}
+
+		TAILQ_REMOVE(&h2->pending, s, plist);
+		s->flags &= ~HTTP2_STREAM_PENDING;
+
+		last = (s->out.off + n == s->out.len) &&
+		    !(s->flags & HTTP2_STREAM_MORE);
+
+		if (!http2_send_data(h2, s, n, last)) {
+			http2_stream_reset(s, HTTP2_ERROR_INTERNAL);
+			continue;
+		}
+
+		batch += n + HTTP2_FRAME_HDR_LEN;
+
+		if (s->out.off == s->out.len) {
+			http2_stream_release(s);
+			if (!(s->flags & HTTP2_STREAM_MORE))
+				http2_stream_close(s);
+		} else {
+			http2_stream_schedule(s);
+		}
+	}
+}
+
+static int
+http2_send_data(struct http2_conn *h2, struct http2_stream *s, size_t n,
+    int last)
+{
+	u_int8_t	*ptr;
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+	ssize_t		ret;
+#endif
+
+	switch (s->out.type) {
+	case HTTP2_DATA_BUF:
+	case HTTP2_DATA_STREAM:
+		ptr = s->out.buf + s->out.off;
+		break;
+	case HTTP2_DATA_FILEREF:
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+		if (!s->out.ref->ontls) {
+			n = MIN(n, sizeof(http2_file_buf));
+			last = (s->out.off + n == s->out.len);
+
+			ret = pread(s->out.ref->fd, http2_file_buf, n,
+			    s->out.off);
+			if (ret == -1 || (size_t)ret != n) {
+				kore_log(LOG_NOTICE, "pread(%s): %s",
+				    s->out.ref->path, errno_s);
+				return (KORE_RESULT_ERROR);
+			}
+
+			ptr = http2_file_buf;
+			break;
+		}
+#endif
+		ptr = (u_int8_t *)s->out.ref->base + s->out.off;
+		break;
+	default:
+		fatal("http2_send_data: bad data type %d", s->out.type);
+	}
+
+	http2_send_frame(h2, HTTP2_FRAME_DATA,
+	    last ? HTTP2_FLAG_END_STREAM : 0, s->id, NULL, n);
+
+	/*
+	 * On plaintext connections writev() picks up the payload in place,
+	 * over TLS we copy it so the frame goes out in as few records.
+	 */
+	if (n > 0) {
+		if (h2->c->write == net_write && ptr != http2_file_buf)
+			net_send_stream(h2->c, ptr, n, NULL, NULL);
+		else
+			net_send_queue(h2->c, ptr, n);
+	}
+
+	s->out.off += n;
+	s->send_window -= n;
+	h2->send_window -= n;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_drained(struct netbuf *nb)
+{
+	struct connection	*c = nb->owner;
+
+	if (c->h2 == NULL || c->state == CONN_STATE_DISCONNECTING)
+		return (KORE_RESULT_OK);
+
+	c->h2->ctrl_queued = 0;
+	c->h2->flags &= ~HTTP2_CONN_DRAIN_WAIT;
+	http2_send_pending(c->h2);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_buf_sent(struct netbuf *nb)
+{
+	kore_free(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+static int
+http2_fileref_sent(struct netbuf *nb)
+{
+	kore_fileref_release(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+static struct http2_stream *
+http2_stream_new(struct http2_conn *h2, u_int32_t id)
+{
+	struct http2_stream	*s;
+
+	s = kore_pool_get(&http2_stream_pool);
+
+	s->h2 = h2;
+	s->id = id;
+	s->flags = 0;
+	s->req = NULL;
+	s->send_window = h2->peer_window;
+	s->recv_window = HTTP2_RECV_WINDOW;
+
+	memset(&s->out, 0, sizeof(s->out));
+	s->out.type = HTTP2_DATA_NONE;
+
+	TAILQ_INSERT_TAIL(&h2->streams, s, list);
+	h2->nstreams++;
+
+	return (s);
+}
+
+static struct http2_stream *
+http2_stream_find(struct http2_conn *h2, u_int32_t id)
+{
+	struct http2_stream	*s;
+
+	TAILQ_FOREACH(s, &h2->streams, list) {
+		if (s->id == id)
+			return (s);
+	}
+
+	return (NULL);
+}
+
+static struct http2_stream *
+http2_stream_for(struct connection *c, struct http_request *req)
+{
+	if (c->h2 == NULL)
+		return (NULL);
+
+	/* Requests get their stream attached once http_request_new() ran. */
+	if (req != NULL && req->h2_stream != NULL)
+		return (req->h2_stream);
+
+	return (c->h2->current);
+}
+
+static void
+http2_stream_free(struct http2_stream *s)
+{
+	struct http2_conn	*h2 = s->h2;
+
+	if (s->flags & HTTP2_STREAM_PENDING)
+		TAILQ_REMOVE(&h2->pending, s, plist);
+
+	if (h2->current == s)
+		h2->current = NULL;
+
+	TAILQ_REMOVE(&h2->streams, s, list);
+	h2->nstreams--;
+
+	kore_pool_put(&http2_stream_pool, s);
+}
+
+static void
+http2_stream_check(struct http2_stream *s)
+{
+	if (s->flags & HTTP2_STREAM_HOLD)
+		return;
+
+	if (s->req == NULL && (s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		http2_stream_free(s);
+}
+
+static void
+http2_stream_schedule(struct http2_stream *s)
+{
+	if (s->out.type == HTTP2_DATA_NONE || (s->flags & HTTP2_STREAM_PENDING))
+		return;
+
+	if (s->send_window <= 0 && s->out.off != s->out.len)
+		return;
+
+	s->flags |= HTTP2_STREAM_PENDING;
+	TAILQ_INSERT_TAIL(&s->h2->pending, s, plist);
+}
+
+/*
+ * Our side of the stream is done. If the client is still sending
+ * (a body we answered early) tell it to stop, as RFC 7540 8.1 allows.
+ */
+static void
+http2_stream_close(struct http2_stream *s)
+{
+	s->flags |= HTTP2_STREAM_LOCAL_CLOSED;
+
+	if (!(s->flags & HTTP2_STREAM_REMOTE_CLOSED)) {
+		http2_send_rst(s->h2, s->id, HTTP2_ERROR_NO_ERROR);
+		s->flags |= HTTP2_STREAM_REMOTE_CLOSED;
+	}
+
+	http2_stream_check(s);
+}
+
+static void
+http2_stream_reset(struct http2_stream *s, u_int32_t code)
+{
+	kore_debug("http2_stream_reset(%u): %u", s->id, code);
+
+	http2_send_rst(s->h2, s->id, code);
+	s->flags |= HTTP2_STREAM_LOCAL_CLOSED | HTTP2_STREAM_REMOTE_CLOSED;
+
+	http2_stream_release(s);
+	http2_stream_check(s);
+}
+
+/*
+ * Drop whatever the stream still had to send. The netbufs already in
+ * the send queue may point into the data so the owner is told through
+ * a marker queued behind them instead of right away.
+ */
+static void
+http2_stream_release(struct http2_stream *s)
+{
+	struct netbuf		*nb;
+	struct connection	*c = s->h2->c;
+
+	switch (s->out.type) {
+	case HTTP2_DATA_NONE:
+		return;
+	case HTTP2_DATA_BUF:
+		net_send_stream(c, NULL, 0, http2_buf_sent, &nb);
+		nb->extra = s->out.buf;
+		break;
+	case HTTP2_DATA_STREAM:
+		if (s->out.cb != NULL) {
+			net_send_stream(c, NULL, 0, s->out.cb, &nb);
+			nb->extra = s->out.arg;
+		}
+		break;
+	case HTTP2_DATA_FILEREF:
+		net_send_stream(c, NULL, 0, http2_fileref_sent, &nb);
+		nb->extra = s->out.ref;
+		break;
+	}
+
+	if (s->flags & HTTP2_STREAM_PENDING) {
+		TAILQ_REMOVE(&s->h2->pending, s, plist);
+		s->flags &= ~HTTP2_STREAM_PENDING;
+	}
+
+	memset(&s->out, 0, sizeof(s->out));
+	s->out.type = HTTP2_DATA_NONE;
+}
+
+static void
+http2_stream_error(struct http2_stream *s, int status)
+{
+	struct http2_conn	*h2 = s->h2;
+
+	/* The response closes the stream, keep it around until we are done. */
+	h2->current = s;
+	s->flags |= HTTP2_STREAM_HOLD;
+
+	http_error_response(h2->c, status);
+
+	h2->current = NULL;
+	s->flags &= ~HTTP2_STREAM_HOLD;
+
+	if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+		http2_stream_reset(s, HTTP2_ERROR_INTERNAL);
+	else
+		http2_stream_check(s);
+}
+
+static void
+http2_request_create(struct http2_conn *h2, struct http2_stream *s,
+    struct http2_field *fields, int nfields, int end)
+{
+	struct http_header	*hdr;
+	struct http_request	*req;
+	u_int8_t		*buf;
+	const char		*clp;
+	size_t			mlen, len, cklen, ckoff;
+	int			i, j, v, regular, ncookies;
+	char			*name, *value, *cookie;
+	char			*method, *scheme, *authority, *path, *host;
+
+	method = NULL;
+	scheme = NULL;
+	authority = NULL;
+	path = NULL;
+	host = NULL;
+	regular = 0;
+	ncookies = 0;
+	cklen = 0;
+
+	buf = (u_int8_t *)h2->hlist.data;
+
+	for (i = 0; i < nfields; i++) {
+		name = (char *)buf + fields[i].name;
+		value = (char *)buf + fields[i].value;
+
+		if (strlen(value) != fields[i].vlen ||
+		    memchr(value, '\r', fields[i].vlen) != NULL ||
+		    memchr(value, '\n', fields[i].vlen) != NULL)
+			goto malformed;
+
+		if (name[0] == ':') {
+			if (regular)
+				goto malformed;
+
+			if (!strcmp(name, ":method") && method == NULL)
+				method = value;
+			else if (!strcmp(name, ":scheme") && scheme == NULL)
+				scheme = value;
+			else if (!strcmp(name, ":path") && path == NULL)
+				path = value;
+			else if (!strcmp(name, ":authority") &&
+			    authority == NULL)
+				authority = value;
+			else
+				goto malformed;
+			continue;
+		}
+
+		regular = 1;
+
+		if (fields[i].nlen == 0 || strlen(name) != fields[i].nlen)
+			goto malformed;
+
+		for (j = 0; name[j] != '\0'; j++) {
+			if (isupper((unsigned char)name[j]))
+				goto malformed;
+		}
+
+		for (j = 0; http2_conn_headers[j] != NULL; j++) {
+			if (!strcmp(name, http2_conn_headers[j]))
+				goto malformed;
+		}
+
+		if (!strcmp(name, "te") && strcmp(value, "trailers"))
+			goto malformed;
+
+		if (!strcmp(name, "host") && host == NULL)
+			host = value;
+
+		if (!strcmp(name, "cookie")) {
+			ncookies++;
+			cklen += fields[i].vlen + 2;
+		}
+	}
+
+	if (method == NULL || scheme == NULL || path == NULL || *path == '\0')
+		goto malformed;
+
+	if (authority != NULL && *authority != '\0')
+		host = authority;
+
+	if (host == NULL || *host == '\0') {
+		http2_stream_error(s, HTTP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	/*
+	 * The request keeps pointers into its headers buffer, so give it
+	 * its own copy of the decoded list with room for the cookies that
+	 * HTTP/2 allows to be split over several fields (8.1.2.5).
+	 */
+	len = h2->hlist.offset;
+	buf = net_recvbuf_get(len + cklen + 1, &mlen);
+	memcpy(buf, h2->hlist.data, len);
+
+	method = (char *)buf + (method - (char *)h2->hlist.data);
+	path = (char *)buf + (path - (char *)h2->hlist.data);
+	host = (char *)buf + (host - (char *)h2->hlist.data);
+
+	/* Errors and redirects are answered on this stream. */
+	h2->current = s;
+	s->flags |= HTTP2_STREAM_HOLD;
+
+	req = http_request_new(h2->c, host, method, path, "HTTP/2");
+
+	h2->current = NULL;
+	s->flags &= ~HTTP2_STREAM_HOLD;
+
+	if (req == NULL) {
+		net_recvbuf_put(buf);
+		if (!(s->flags & HTTP2_STREAM_LOCAL_CLOSED))
+			http2_stream_reset(s, HTTP2_ERROR_REFUSED_STREAM);
+		else
+			http2_stream_check(s);
+		return;
+	}
+
+	req->headers = buf;
+	req->h2_stream = s;
+	s->req = req;
+
+	cookie = NULL;
+	ckoff = 0;
+	if (ncookies > 1)
+		cookie = (char *)buf + len;
+
+	for (i = 0; i < nfields; i++) {
+		name = (char *)buf + fields[i].name;
+		value = (char *)buf + fields[i].value;
+
+		if (name[0] == ':' || !strcmp(name, "host"))
+			continue;
+
+		if (cookie != NULL && !strcmp(name, "cookie")) {
+			if (ckoff > 0) {
+				memcpy(cookie + ckoff, "; ", 2);
+				ckoff += 2;
+			}
+			memcpy(cookie + ckoff, value, fields[i].vlen);
+			ckoff += fields[i].vlen;
+			cookie[ckoff] = '\0';
+			if (--ncookies > 0)
+				continue;
+			value = cookie;
+		}
+
+		hdr = http_request_alloc(req, sizeof(*hdr));
+		hdr->header = name;
+		hdr->value = value;
+		TAILQ_INSERT_TAIL(&(req->req_headers), hdr, list);
+		http_header_index(req, hdr);
+	}
+
+	if (req->hdr_known[HTTP_HEADER_USER_AGENT] != NULL)
+		req->agent = req->hdr_known[HTTP_HEADER_USER_AGENT]->value;
+
+	if (req->hdr_known[HTTP_HEADER_REFERER] != NULL)
+		req->referer = req->hdr_known[HTTP_HEADER_REFERER]->value;
+
+	if (!(req->flags & HTTP_REQUEST_EXPECT_BODY))
+		return;
+
+	if (end) {
+		http_request_ready(req);
+		req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+		return;
+	}
+
+	if (http_body_max == 0) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http2_stream_error(s, HTTP_STATUS_METHOD_NOT_ALLOWED);
+		return;
+	}
+
+	/* A content-length is optional, the stream end delimits the body. */
+	req->content_length = 0;
+	if (http_request_header_id(req, HTTP_HEADER_CONTENT_LENGTH, &clp)) {
+		req->content_length = kore_strtonum(clp, 10, 0, LONG_MAX, &v);
+		if (v == KORE_RESULT_ERROR) {
+			req->flags |= HTTP_REQUEST_DELETE;
+			http2_stream_error(s, HTTP_STATUS_BAD_REQUEST);
+			return;
+		}
+
+		if (req->content_length > http_body_max) {
+			kore_log(LOG_NOTICE, "body too large (%zu > %zu)",
+			    req->content_length, http_body_max);
+			req->flags |= HTTP_REQUEST_DELETE;
+			http2_stream_error(s,
+			    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+			return;
+		}
+	}
+
+	req->http_body_fd = -1;
+	req->http_body_length = req->content_length;
+
+	/* See http_header_recv(), http_body_offset counts what came in. */
+	if (req->hdlr != NULL && req->hdlr->stream) {
+		req->flags |= HTTP_REQUEST_BODY_STREAM |
+		    HTTP_REQUEST_BODY_PAUSED | HTTP_REQUEST_COMPLETE;
+		req->body_pending = kore_buf_alloc(HTTP2_FRAME_SIZE_MIN);
+		return;
+	}
+
+	req->http_body = kore_buf_alloc(req->content_length > 0 ?
+	    req->content_length : HTTP2_FRAME_SIZE_MIN);
+
+	SHA256_Init(&req->hashctx);
+	return;
+
+malformed:
+	http2_stream_reset(s, HTTP2_ERROR_PROTOCOL);
+}
+
+static void
+http2_request_body(struct http2_stream *s, const u_int8_t *data, size_t len)
+{
+	struct http_request	*req = s->req;
+
+	if (req == NULL || (req->flags & HTTP_REQUEST_DELETE) ||
+	    !(req->flags & HTTP_REQUEST_EXPECT_BODY))
+		return;
+
+	if (req->flags & HTTP_REQUEST_BODY_STREAM) {
+		if (req->http_body_offset + len > http_body_max ||
+		    (req->http_body_length > 0 &&
+		    req->http_body_offset + len > req->http_body_length)) {
+			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_request_wakeup(req);
+			http2_stream_error(s,
+			    HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+			return;
+		}
+
+		req->http_body_offset += len;
+		if (len > 0)
+			(void)http_body_stream_data(req, data, len);
+		return;
+	}
+
+	if (req->http_body == NULL)
+		return;
+
+	if (req->http_body->offset + len > http_body_max ||
+	    (req->http_body_length > 0 &&
+	    req->http_body->offset + len > req->http_body_length)) {
+		kore_log(LOG_NOTICE, "body too large (> %zu)",
+		    req->http_body_length > 0 ? req->http_body_length :
+		    http_body_max);
+		req->flags |= HTTP_REQUEST_DELETE;
+		http2_stream_error(s, HTTP_STATUS_REQUEST_ENTITY_TOO_LARGE);
+		return;
+	}
+
+	kore_buf_append(req->http_body, data, len);
+	SHA256_Update(&req->hashctx, data, len);
+}
+
+static void
+http2_request_complete(struct http2_stream *s)
+{
+	struct http_request	*req = s->req;
+
+	if (req == NULL || (req->flags & HTTP_REQUEST_DELETE) ||
+	    !(req->flags & HTTP_REQUEST_EXPECT_BODY))
+		return;
+
+	if (req->flags & HTTP_REQUEST_BODY_STREAM) {
+		if (req->http_body_length > 0 &&
+		    req->http_body_offset != req->http_body_length) {
+			req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+			req->flags |= HTTP_REQUEST_DELETE;
+			http_request_wakeup(req);
+			http2_stream_error(s, HTTP_STATUS_BAD_REQUEST);
+			return;
+		}
+
+		http_body_stream_end(req);
+		return;
+	}
+
+	req->flags &= ~HTTP_REQUEST_EXPECT_BODY;
+
+	if (req->http_body == NULL) {
+		http_request_ready(req);
+		return;
+	}
+
+	if (req->http_body_length > 0 &&
+	    req->http_body->offset != req->http_body_length) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http2_stream_error(s, HTTP_STATUS_BAD_REQUEST);
+		return;
+	}
+
+	req->content_length = req->http_body->offset;
+	req->http_body_length = req->http_body->offset;
+
+	SHA256_Final(req->http_body_digest, &req->hashctx);
+	if (!http_body_rewind(req)) {
+		req->flags |= HTTP_REQUEST_DELETE;
+		http2_stream_error(s, HTTP_STATUS_INTERNAL_ERROR);
+		return;
+	}
+
+	req->timing.body = kore_time_us();
+	http_request_ready(req);
+}
+
+static void
+hpack_init(struct http2_hpack *tbl, size_t max)
+{
+	tbl->max = max;
+	tbl->size = 0;
+	tbl->head = 0;
+	tbl->count = 0;
+	tbl->cap = (max / 32) + 1;
+	tbl->entries = kore_calloc(tbl->cap, sizeof(*tbl->entries));
+}
+
+static void
+hpack_cleanup(struct http2_hpack *tbl)
+{
+	hpack_evict(tbl, 0);
+	kore_free(tbl->entries);
+	tbl->entries = NULL;
+}
+
+static void
+hpack_evict(struct http2_hpack *tbl, size_t max)
+{
+	struct http2_hpack_entry	*e;
+
+	while (tbl->count > 0 && tbl->size > max) {
+		e = &tbl->entries[(tbl->head + tbl->count - 1) % tbl->cap];
+		tbl->size -= e->nlen + e->vlen + 32;
+		tbl->count--;
+
+		kore_free(e->name);
+		e->name = NULL;
+		e->value = NULL;
+	}
+}
+
+static void
+hpack_insert(struct http2_hpack *tbl, const char *name, size_t nlen,
+    const char *value, size_t vlen)
+{
+	size_t				esize;
+	struct http2_hpack_entry	*e;
+
+	esize = nlen + vlen + 32;
+
+	if (esize > tbl->max) {
+		hpack_evict(tbl, 0);
+		return;
+	}
+
+	hpack_evict(tbl, tbl->max - esize);
+
+	tbl->head = (tbl->head + tbl->cap - 1) % tbl->cap;
+	e = &tbl->entries[tbl->head];
+
+	e->name = kore_malloc(nlen + vlen + 2);
+	memcpy(e->name, name, nlen);
+	e->name[nlen] = '\0';
+
+	e->value = e->name + nlen + 1;
+	memcpy(e->value, value, vlen);
+	e->value[vlen] = '\0';
+
+	e->nlen = nlen;
+	e->vlen = vlen;
+
+	tbl->count++;
+	tbl->size += esize;
+}
+
+static int
+hpack_lookup(struct http2_hpack *tbl, u_int32_t idx, const char **name,
+    size_t *nlen, const char **value, size_t *vlen)
+{
+	struct http2_hpack_entry	*e;
+
+	if (idx == 0)
+		return (KORE_RESULT_ERROR);
+
+	if (idx <= HPACK_STATIC_ENTRIES) {
+		*name = hpack_static[idx - 1].name;
+		*value = hpack_static[idx - 1].value;
+		*nlen = strlen(*name);
+		*vlen = strlen(*value);
+		return (KORE_RESULT_OK);
+	}
+
+	idx -= HPACK_STATIC_ENTRIES + 1;
+	if (idx >= tbl->count)
+		return (KORE_RESULT_ERROR);
+
+	e = &tbl->entries[(tbl->head + idx) % tbl->cap];
+	*name = e->name;
+	*value = e->value;
+	*nlen = e->nlen;
+	*vlen = e->vlen;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Decode the header block in h2->hblock into h2->hlist as a set of
+ * NUL terminated name and value strings, fields[] gets their offsets.
+ */
+static int
+hpack_decode(struct http2_conn *h2, struct http2_field *fields,
+    int *nfields, int *overflow)
+{
+	u_int32_t		idx;
+	struct http2_field	f;
+	int			incr, first;
+	const char		*name, *value;
+	const u_int8_t		*p, *end;
+	size_t			nlen, vlen;
+
+	*nfields = 0;
+	*overflow = 0;
+	first = 1;
+
+	kore_buf_reset(&h2->hlist);
+
+	p = h2->hblock.data;
+	end = p + h2->hblock.offset;
+
+	while (p < end) {
+		if (*p & 0x80) {
+			if (!hpack_integer(&p, end, 7, &idx))
+				return (KORE_RESULT_ERROR);
+			if (!hpack_lookup(&h2->decoder, idx,
+			    &name, &nlen, &value, &vlen))
+				return (KORE_RESULT_ERROR);
+
+			f.name = h2->hlist.offset;
+			f.nlen = nlen;
+			kore_buf_append(&h2->hlist, name, nlen + 1);
+			f.value = h2->hlist.offset;
+			f.vlen = vlen;
+			kore_buf_append(&h2->hlist, value, vlen + 1);
+		} else if ((*p & 0xe0) == 0x20) {
+			if (!first)
+				return (KORE_RESULT_ERROR);
+			if (!hpack_integer(&p, end, 5, &idx))
+				return (KORE_RESULT_ERROR);
+			if (idx > HTTP2_HPACK_TABLE_SIZE)
+				return (KORE_RESULT_ERROR);
+
+			h2->decoder.max = idx;
+			hpack_evict(&h2->decoder, idx);
+			continue;
+		} else {
+			if (*p & 0x40) {
+				incr = 1;
+				if (!hpack_integer(&p, end, 6, &idx))
+					return (KORE_RESULT_ERROR);
+			} else {
+				incr = 0;
+				if (!hpack_integer(&p, end, 4, &idx))
+					return (KORE_RESULT_ERROR);
+			}
+
+			f.name = h2->hlist.offset;
+			if (idx != 0) {
+				if (!hpack_lookup(&h2->decoder, idx,
+				    &name, &nlen, &value, &vlen))
+					return (KORE_RESULT_ERROR);
+				kore_buf_append(&h2->hlist, name, nlen + 1);
+				f.nlen = nlen;
+			} else {
+				if (!hpack_string(&h2->hlist, &p, end, &f.nlen))
+					return (KORE_RESULT_ERROR);
+			}
+
+			f.value = h2->hlist.offset;
+			if (!hpack_string(&h2->hlist, &p, end, &f.vlen))
+				return (KORE_RESULT_ERROR);
+
+			if (incr) {
+				hpack_insert(&h2->decoder,
+				    (const char *)h2->hlist.data + f.name,
+				    f.nlen,
+				    (const char *)h2->hlist.data + f.value,
+				    f.vlen);
+			}
+		}
+
+		first = 0;
+
+		if (h2->hlist.offset > HTTP2_HEADER_LIST_MAX)
+			return (KORE_RESULT_ERROR);
+
+		if (*nfields == HTTP2_FIELDS_MAX) {
+			*overflow = 1;
+			continue;
+		}
+
+		fields[(*nfields)++] = f;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_integer(const u_int8_t **p, const u_int8_t *end, int prefix,
+    u_int32_t *out)
+{
+	u_int8_t	b;
+	int		shift;
+	u_int32_t	mask;
+	u_int64_t	value;
+
+	if (*p >= end)
+		return (KORE_RESULT_ERROR);
+
+	mask = (1 << prefix) - 1;
+	value = *(*p)++ & mask;
+
+	if (value < mask) {
+		*out = value;
+		return (KORE_RESULT_OK);
+	}
+
+	for (shift = 0; shift <= 28; shift += 7) {
+		if (*p >= end)
+			return (KORE_RESULT_ERROR);
+
+		b = *(*p)++;
+		value += (u_int64_t)(b & 0x7f) << shift;
+
+		if (value > UINT32_MAX)
+			return (KORE_RESULT_ERROR);
+
+		if (!(b & 0x80)) {
+			*out = value;
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+static int
+hpack_string(struct kore_buf *out, const u_int8_t **p, const u_int8_t *end,
+    size_t *len)
+{
+	int		huff;
+	size_t		start;
+	u_int32_t	slen;
+
+	if (*p >= end)
+		return (KORE_RESULT_ERROR);
+
+	huff = **p & 0x80;
+	if (!hpack_integer(p, end, 7, &slen))
+		return (KORE_RESULT_ERROR);
+
+	if (slen > (size_t)(end - *p))
+		return (KORE_RESULT_ERROR);
+
+	start = out->offset;
+
+	if (huff) {
+		if (!hpack_huffman_decode(out, *p, slen))
+			return (KORE_RESULT_ERROR);
+	} else {
+		kore_buf_append(out, *p, slen);
+	}
+
+	*p += slen;
+	*len = out->offset - start;
+	kore_buf_append(out, "", 1);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+hpack_huffman_decode(struct kore_buf *out, const u_int8_t *in, size_t len)
+{
+	size_t		i, n;
+	int		bit, bits;
+	u_int32_t	code;
+	u_int8_t	tmp[128];
+
+	n = 0;
+	code = 0;
+	bits = 0;
+
+	for (i = 0; i < len; i++) {
+		for (bit = 7; bit >= 0; bit--) {
+			code = (code << 1) | ((in[i] >> bit) & 0x1);
+			bits++;
+
+			if (bits > HPACK_HUFFMAN_MAXBITS)
+				return (KORE_RESULT_ERROR);
+
+			if (code - hpack_huffman_first[bits] >=
+			    hpack_huffman_count[bits])
+				continue;
+
+			tmp[n++] = hpack_huffman_syms[
+			    hpack_huffman_offset[bits] +
+			    code - hpack_huffman_first[bits]];
+
+			if (n == sizeof(tmp)) {
+				kore_buf_append(out, tmp, n);
+				n = 0;
+			}
+
+			code = 0;
+			bits = 0;
+		}
+	}
+
+	/* Padding is at most 7 bits and the most significant bits of EOS. */
+	if (bits > 7 || code != (u_int32_t)((1 << bits) - 1))
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_append(out, tmp, n);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+hpack_append_int(struct kore_buf *buf, u_int8_t first, int prefix, size_t v)
+{
+	size_t		n, max;
+	u_int8_t	tmp[16];
+
+	n = 0;
+	max = (1 << prefix) - 1;
+
+	if (v < max) {
+		tmp[n++] = first | v;
+	} else {
+		tmp[n++] = first | max;
+		v -= max;
+		while (v >= 0x80) {
+			tmp[n++] = (v & 0x7f) | 0x80;
+			v >>= 7;
+		}
+		tmp[n++] = v;
+	}
+
+	kore_buf_append(buf, tmp, n);
+}
+
+static void
+hpack_append_string(struct kore_buf *buf, const char *str, size_t len,
+    int lower)
+{
+	size_t		i, n, bits;
+	u_int64_t	acc;
+	int		nbits;
+	u_int8_t	c, tmp[128];
+
+	bits = 0;
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if (lower)
+			c = tolower(c);
+		bits += hpack_huffman[c].bits;
+	}
+
+	n = 0;
+
+	if ((bits + 7) / 8 >= len) {
+		hpack_append_int(buf, 0x00, 7, len);
+		for (i = 0; i < len; i++) {
+			tmp[n++] = lower ? tolower((u_int8_t)str[i]) : str[i];
+			if (n == sizeof(tmp)) {
+				kore_buf_append(buf, tmp, n);
+				n = 0;
+			}
+		}
+		kore_buf_append(buf, tmp, n);
+		return;
+	}
+
+	hpack_append_int(buf, 0x80, 7, (bits + 7) / 8);
+
+	acc = 0;
+	nbits = 0;
+
+	for (i = 0; i < len; i++) {
+		c = str[i];
+		if (lower)
+			c = tolower(c);
+
+		acc = (acc << hpack_huffman[c].bits) | hpack_huffman[c].code;
+		nbits += hpack_huffman[c].bits;
+
+		while (nbits >= 8) {
+			nbits -= 8;
+			tmp[n++] = (acc >> nbits) & 0xff;
+			if (n == sizeof(tmp)) {
+				kore_buf_append(buf, tmp, n);
+				n = 0;
+			}
+		}
+
+		acc &= ((u_int64_t)1 << nbits) - 1;
+	}
+
+	if (nbits > 0)
+		tmp[n++] = (acc << (8 - nbits)) | (0xff >> nbits);
+
+	kore_buf_append(buf, tmp, n);
+}
+
+static int
+hpack_static_name(const char *name, size_t len)
+{
+	int		i;
+
+	/* Skip the pseudo-headers, handlers cannot set those. */
+	for (i = 14; i < HPACK_STATIC_ENTRIES; i++) {
+		if (strlen(hpack_static[i].name) == len &&
+		    !strncasecmp(hpack_static[i].name, name, len))
+			return (i + 1);
+	}
+
+	return (0);
+}
@@ -17,13 +17,67 @@
 #include <sys/types.h>
 
 #include <float.h>
+#include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "kore.h"
 
+#define JSON_ARENA_CHUNK	(64 * 1024)
+#define JSON_ARENA_ALIGN	16
+#define JSON_NUMBER_MAX		64
+#define JSON_INDEX_MIN		16
+
+#define JSON_WRITER_OBJECT	0x01
+#define JSON_WRITER_MEMBERS	0x02
+#define JSON_WRITER_KEYED	0x04
+#define JSON_WRITER_INDENT	"    "
+
+/* Doubles up to this are integers that print without snprintf(). */
+#define JSON_WRITER_EXACT	9007199254740992.0
+
+/*
+ * Memory that the items of a tree parsed by kore_json_init_arena()
+ * are carved out of, released all at once by kore_json_cleanup().
+ */
+struct kore_json_arena {
+	u_int8_t		*base;
+	size_t			length;
+	size_t			offset;
+	struct kore_json_arena	*next;
+};
+
+/*
+ * Hash index on the members of an object with at least JSON_INDEX_MIN
+ * of them, built when it is parsed. Duplicate names keep the first.
+ */
+struct kore_json_index {
+	u_int32_t		mask;
+	struct {
+		u_int32_t		hash;
+		struct kore_json_item	*item;
+	} slots[];
+};
+
+struct json_path_token {
+	char			*name;
+	u_int32_t		hash;
+	int			spot;
+};
+
+/* A path split up into its names, with their hashes and array spots. */
+struct kore_json_path {
+	char			*copy;
+	int			count;
+	struct json_path_token	tokens[KORE_JSON_DEPTH_MAX];
+};
+
 static int	json_guess_type(u_int8_t, int *);
 static int	json_next(struct kore_json *, u_int8_t *);
 static int	json_peek(struct kore_json *, u_int8_t *);
@@ -31,6 +85,10 @@ static int	json_peek(struct kore_json *, u_int8_t *);
 static int	json_consume_whitespace(struct kore_json *);
 static int	json_next_byte(struct kore_json *, u_int8_t *, int);
 
+static size_t	json_scan_whitespace(const u_int8_t *, size_t);
+static size_t	json_scan_string(const u_int8_t *, size_t);
+static size_t	json_scan_number(const u_int8_t *, size_t);
+
 static char	*json_get_string(struct kore_json *);
 
 static int	json_parse_array(struct kore_json *, struct kore_json_item *);
@@ -39,10 +97,25 @@ static int	json_parse_string(struct kore_json *, struct kore_json_item *);
 static int	json_parse_number(struct kore_json *, struct kore_json_item *);
 static int	json_parse_literal(struct kore_json *, struct kore_json_item *);
 
-static struct kore_json_item	*json_item_alloc(int, const char *,
-				    struct kore_json_item *);
-static struct kore_json_item	*json_find_item(struct kore_json_item *,
-				    char **, int, int);
+static void	*json_arena_alloc(struct kore_json *, size_t);
+static void	json_arena_free(struct kore_json *);
+
+static struct kore_json_item	*json_item_alloc(struct kore_json *, int,
+				    char *, struct kore_json_item *);
+static int	json_path_parse(struct kore_json_path *, const char *);
+static void	json_index_build(struct kore_json *, struct kore_json_item *,
+		    u_int32_t);
+static u_int32_t	json_hash(const char *);
+
+static int	json_writer_value(struct kore_json_writer *);
+static int	json_writer_begin(struct kore_json_writer *, int);
+static int	json_writer_end(struct kore_json_writer *, int);
+static int	json_writer_error(struct kore_json_writer *, int);
+static void	json_writer_newline(struct kore_json_writer *);
+static void	json_writer_escape(struct kore_buf *, const char *);
+
+static struct kore_json_item	*json_find_member(struct kore_json_item *,
+				    struct json_path_token *);
 
 static u_int8_t		json_null_literal[] = { 'n', 'u', 'l', 'l' };
 static u_int8_t		json_true_literal[] = { 't', 'r', 'u', 'e' };
@@ -60,7 +133,8 @@ static const char *json_errtab[] = {
 	"invalid JSON",
 	"invalid search query specified",
 	"item not found",
-	"item found, but not expected value"
+	"item found, but not expected value",
+	"JSON written out of order"
 };
 
 void
@@ -74,6 +148,22 @@ kore_json_init(struct kore_json *json, const u_int8_t *data, size_t len)
 	kore_buf_init(&json->tmpbuf, 1024);
 }
 
+/*
+ * Like kore_json_init() but the tree is parsed in place: names and
+ * strings of its items point into data, which is modified and must
+ * outlive the tree, and the items themselves come from an arena that
+ * kore_json_cleanup() releases in one go.
+ *
+ * Items of such a tree must not be freed with kore_json_item_free()
+ * nor have items created with kore_json_create_item() added to them.
+ */
+void
+kore_json_init_arena(struct kore_json *json, u_int8_t *data, size_t len)
+{
+	kore_json_init(json, data, len);
+	json->insitu = data;
+}
+
 int
 kore_json_parse(struct kore_json *json)
 {
@@ -91,7 +181,7 @@ kore_json_parse(struct kore_json *json)
 		return (KORE_RESULT_ERROR);
 	}
 
-	json->root = json_item_alloc(type, NULL, NULL);
+	json->root = json_item_alloc(json, type, NULL, NULL);
 
 	if (!json->root->parse(json, json->root)) {
 		if (json->error == 0)
@@ -106,18 +196,87 @@ struct kore_json_item *
 kore_json_find(struct kore_json_item *root, const char *path, int type)
 {
 	struct kore_json_item	*item;
-	char			*copy;
-	char			*tokens[KORE_JSON_DEPTH_MAX + 1];
+	struct kore_json_path	compiled;
+
+	if (!json_path_parse(&compiled, path)) {
+		kore_free(compiled.copy);
+		return (NULL);
+	}
+
+	item = kore_json_find_path(root, &compiled, type);
+	kore_free(compiled.copy);
+
+	return (item);
+}
 
-	copy = kore_strdup(path);
+/*
+ * Split up a path as taken by kore_json_find() once, for handlers that
+ * look up the same paths in every request.
+ */
+struct kore_json_path *
+kore_json_path_compile(const char *path)
+{
+	struct kore_json_path	*compiled;
+
+	compiled = kore_malloc(sizeof(*compiled));
 
-	if (!kore_split_string(copy, "/", tokens, KORE_JSON_DEPTH_MAX)) {
-		kore_free(copy);
+	if (!json_path_parse(compiled, path)) {
+		kore_json_path_free(compiled);
 		return (NULL);
 	}
 
-	item = json_find_item(root, tokens, type, 0);
-	kore_free(copy);
+	return (compiled);
+}
+
+void
+kore_json_path_free(struct kore_json_path *compiled)
+{
+	if (compiled == NULL)
+		return;
+
+	kore_free(compiled->copy);
+	kore_free(compiled);
+}
+
+struct kore_json_item *
+kore_json_find_path(struct kore_json_item *object,
+    struct kore_json_path *compiled, int type)
+{
+	int			idx, pos;
+	struct json_path_token	*token;
+	struct kore_json_item	*item, *nitem;
+
+	item = NULL;
+
+	for (pos = 0; pos < compiled->count; pos++) {
+		if (object->type != KORE_JSON_TYPE_OBJECT &&
+		    object->type != KORE_JSON_TYPE_ARRAY)
+			return (NULL);
+
+		token = &compiled->tokens[pos];
+
+		if ((item = json_find_member(object, token)) == NULL)
+			return (NULL);
+
+		if (item->type == KORE_JSON_TYPE_ARRAY && token->spot != -1) {
+			idx = 0;
+			nitem = NULL;
+			TAILQ_FOREACH(nitem, &item->data.items, list) {
+				if (idx++ == token->spot)
+					break;
+			}
+
+			if (nitem == NULL)
+				return (NULL);
+
+			item = nitem;
+		}
+
+		object = item;
+	}
+
+	if (item == NULL || item->type != type)
+		return (NULL);
 
 	return (item);
 }
@@ -129,7 +288,13 @@ kore_json_cleanup(struct kore_json *json)
 		return;
 
 	kore_buf_cleanup(&json->tmpbuf);
-	kore_json_item_free(json->root);
+
+	if (json->insitu != NULL)
+		json_arena_free(json);
+	else
+		kore_json_item_free(json->root);
+
+	json->root = NULL;
 }
 
 const char *
@@ -141,6 +306,15 @@ kore_json_strerror(struct kore_json *json)
 	return ("unknown JSON error");
 }
 
+const char *
+kore_json_writer_strerror(struct kore_json_writer *writer)
+{
+	if (writer->error >= 0 && writer->error <= KORE_JSON_ERR_LAST)
+		return (json_errtab[writer->error]);
+
+	return ("unknown JSON error");
+}
+
 struct kore_json_item *
 kore_json_create_item(struct kore_json_item *parent, const char *name,
     int type, ...)
@@ -186,6 +360,10 @@ kore_json_create_item(struct kore_json_item *parent, const char *name,
 		}
 
 		TAILQ_INSERT_TAIL(&parent->data.items, item, list);
+
+		/* The index would not know about the new member. */
+		kore_free(parent->index);
+		parent->index = NULL;
 	}
 
 	va_end(args);
@@ -252,72 +430,349 @@ kore_json_item_tobuf(struct kore_json_item *item, struct kore_buf *buf)
 	}
 }
 
-static struct kore_json_item *
-json_find_item(struct kore_json_item *object, char **tokens, int type, int pos)
+static int
+json_path_parse(struct kore_json_path *compiled, const char *path)
 {
+	int			err, i;
 	char			*p, *str;
-	struct kore_json_item	*item, *nitem;
-	int			err, idx, spot;
+	char			*tokens[KORE_JSON_DEPTH_MAX + 1];
 
-	if (tokens[pos] == NULL)
-		return (NULL);
+	compiled->copy = kore_strdup(path);
+	compiled->count = kore_split_string(compiled->copy, "/",
+	    tokens, KORE_JSON_DEPTH_MAX);
 
-	if (object->type != KORE_JSON_TYPE_OBJECT &&
-	    object->type != KORE_JSON_TYPE_ARRAY)
-		return (NULL);
+	if (compiled->count == 0)
+		return (KORE_RESULT_ERROR);
 
-	if ((str = strchr(tokens[pos], '[')) != NULL) {
-		*(str)++ = '\0';
+	for (i = 0; i < compiled->count; i++) {
+		if ((str = strchr(tokens[i], '[')) != NULL) {
+			*(str)++ = '\0';
 
-		if ((p = strchr(str, ']')) == NULL)
-			return (NULL);
+			if ((p = strchr(str, ']')) == NULL)
+				return (KORE_RESULT_ERROR);
 
-		*p = '\0';
+			*p = '\0';
 
-		spot = kore_strtonum(str, 10, 0, USHRT_MAX, &err);
-		if (err != KORE_RESULT_OK)
-			return (NULL);
-	} else {
-		spot = -1;
+			compiled->tokens[i].spot =
+			    kore_strtonum(str, 10, 0, USHRT_MAX, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+		} else {
+			compiled->tokens[i].spot = -1;
+		}
+
+		compiled->tokens[i].name = tokens[i];
+		compiled->tokens[i].hash = json_hash(tokens[i]);
 	}
 
-	item = NULL;
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * The member of object that token names. Array elements have no name
+ * and always match, the first one is taken.
+ */
+static struct kore_json_item *
+json_find_member(struct kore_json_item *object, struct json_path_token *token)
+{
+	u_int32_t		slot;
+	struct kore_json_item	*item;
+	struct kore_json_index	*index;
+
+	if ((index = object->index) != NULL) {
+		slot = token->hash & index->mask;
+
+		while ((item = index->slots[slot].item) != NULL) {
+			if (index->slots[slot].hash == token->hash &&
+			    !strcmp(item->name, token->name))
+				return (item);
+			slot = (slot + 1) & index->mask;
+		}
+
+		return (NULL);
+	}
 
 	TAILQ_FOREACH(item, &object->data.items, list) {
-		if (item->name && strcmp(item->name, tokens[pos]))
+		if (item->name && strcmp(item->name, token->name))
 			continue;
+		return (item);
+	}
 
-		if (item->type == KORE_JSON_TYPE_ARRAY && spot != -1) {
-			idx = 0;
-			nitem = NULL;
-			TAILQ_FOREACH(nitem, &item->data.items, list) {
-				if (idx++ == spot)
-					break;
-			}
+	return (NULL);
+}
 
-			if (nitem == NULL)
-				return (NULL);
+static void
+json_index_build(struct kore_json *json, struct kore_json_item *object,
+    u_int32_t count)
+{
+	size_t			len;
+	u_int32_t		hash, size, slot;
+	struct kore_json_item	*item, *other;
+	struct kore_json_index	*index;
 
-			item = nitem;
+	size = JSON_INDEX_MIN;
+	while (size < count * 2)
+		size <<= 1;
+
+	len = sizeof(*index) + size * sizeof(index->slots[0]);
+
+	if (json->insitu != NULL)
+		index = json_arena_alloc(json, len);
+	else
+		index = kore_malloc(len);
+
+	memset(index, 0, len);
+	index->mask = size - 1;
+
+	TAILQ_FOREACH(item, &object->data.items, list) {
+		hash = json_hash(item->name);
+		slot = hash & index->mask;
+
+		while ((other = index->slots[slot].item) != NULL) {
+			if (index->slots[slot].hash == hash &&
+			    !strcmp(other->name, item->name))
+				break;
+			slot = (slot + 1) & index->mask;
 		}
 
-		if (tokens[pos + 1] == NULL) {
-			if (item->type == type)
-				return (item);
-			return (NULL);
+		if (other == NULL) {
+			index->slots[slot].hash = hash;
+			index->slots[slot].item = item;
 		}
+	}
+
+	object->index = index;
+}
+
+/* FNV-1a */
+static u_int32_t
+json_hash(const char *name)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+
+	while (*name != '\0') {
+		hash ^= (u_int8_t)*(name)++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+/*
+ * Write a JSON document straight into buf as it is described by calls
+ * to the kore_json_writer_*() functions, without building a tree.
+ *
+ * Each returns KORE_RESULT_ERROR when the call does not fit where the
+ * writer is in the document or nests deeper than KORE_JSON_DEPTH_MAX,
+ * the writer then refuses all further calls. The caller may reset or
+ * drain buf in between calls.
+ */
+void
+kore_json_writer_init(struct kore_json_writer *writer, struct kore_buf *buf,
+    int flags)
+{
+	memset(writer, 0, sizeof(*writer));
+
+	writer->buf = buf;
+	writer->flags = flags;
+}
+
+int
+kore_json_writer_object_begin(struct kore_json_writer *writer)
+{
+	return (json_writer_begin(writer, JSON_WRITER_OBJECT));
+}
+
+int
+kore_json_writer_object_end(struct kore_json_writer *writer)
+{
+	return (json_writer_end(writer, JSON_WRITER_OBJECT));
+}
+
+int
+kore_json_writer_array_begin(struct kore_json_writer *writer)
+{
+	return (json_writer_begin(writer, 0));
+}
+
+int
+kore_json_writer_array_end(struct kore_json_writer *writer)
+{
+	return (json_writer_end(writer, 0));
+}
+
+int
+kore_json_writer_key(struct kore_json_writer *writer, const char *name)
+{
+	u_int8_t	*level;
+
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	level = &writer->levels[writer->depth];
+
+	if (writer->depth == 0 || !(*level & JSON_WRITER_OBJECT) ||
+	    (*level & JSON_WRITER_KEYED))
+		return (json_writer_error(writer, KORE_JSON_ERR_INVALID_WRITE));
+
+	if (*level & JSON_WRITER_MEMBERS)
+		kore_buf_append(writer->buf, ",", 1);
+
+	*level |= JSON_WRITER_MEMBERS | JSON_WRITER_KEYED;
+
+	json_writer_newline(writer);
+	json_writer_escape(writer->buf, name);
+
+	if (writer->flags & KORE_JSON_WRITER_PRETTY)
+		kore_buf_append(writer->buf, ": ", 2);
+	else
+		kore_buf_append(writer->buf, ":", 1);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_json_writer_string(struct kore_json_writer *writer, const char *value)
+{
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	json_writer_escape(writer->buf, value);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_json_writer_integer(struct kore_json_writer *writer, int64_t value)
+{
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	if (value < 0) {
+		kore_buf_append(writer->buf, "-", 1);
+		kore_buf_append_uint(writer->buf, -(u_int64_t)value);
+	} else {
+		kore_buf_append_uint(writer->buf, value);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_json_writer_unsigned(struct kore_json_writer *writer, u_int64_t value)
+{
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_append_uint(writer->buf, value);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Integral values print as integers, anything else with the fewest
+ * digits that read back the same double. JSON has no NaN or infinity.
+ */
+int
+kore_json_writer_number(struct kore_json_writer *writer, double value)
+{
+	int		len, prec;
+	char		tmp[32];
+
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	if (!isfinite(value))
+		return (json_writer_error(writer, KORE_JSON_ERR_INVALID_NUMBER));
+
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
 
-		if (item->type == KORE_JSON_TYPE_OBJECT ||
-		    item->type == KORE_JSON_TYPE_ARRAY) {
-			item = json_find_item(item, tokens, type, pos + 1);
+	if (value > -JSON_WRITER_EXACT && value < JSON_WRITER_EXACT &&
+	    value == (double)(int64_t)value) {
+		if (value < 0) {
+			kore_buf_append(writer->buf, "-", 1);
+			kore_buf_append_uint(writer->buf, (u_int64_t)-value);
 		} else {
-			item = NULL;
+			kore_buf_append_uint(writer->buf, (u_int64_t)value);
 		}
+		return (KORE_RESULT_OK);
+	}
+
+	for (prec = 15; prec <= 17; prec++) {
+		len = snprintf(tmp, sizeof(tmp), "%.*g", prec, value);
+		if (len == -1 || (size_t)len >= sizeof(tmp))
+			fatal("%s: failed to format %f", __func__, value);
+
+		if (strtod(tmp, NULL) == value)
+			break;
+	}
+
+	kore_buf_append(writer->buf, tmp, len);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_json_writer_literal(struct kore_json_writer *writer, int value)
+{
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
 
+	if (value != KORE_JSON_TRUE && value != KORE_JSON_FALSE &&
+	    value != KORE_JSON_NULL)
+		return (json_writer_error(writer, KORE_JSON_ERR_INVALID_LITERAL));
+
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	switch (value) {
+	case KORE_JSON_TRUE:
+		kore_buf_append(writer->buf,
+		    json_true_literal, sizeof(json_true_literal));
+		break;
+	case KORE_JSON_FALSE:
+		kore_buf_append(writer->buf,
+		    json_false_literal, sizeof(json_false_literal));
+		break;
+	case KORE_JSON_NULL:
+		kore_buf_append(writer->buf,
+		    json_null_literal, sizeof(json_null_literal));
 		break;
 	}
 
-	return (item);
+	return (KORE_RESULT_OK);
+}
+
+/* Write value as is, it must be a complete JSON encoded value. */
+int
+kore_json_writer_raw(struct kore_json_writer *writer, const void *value,
+    size_t len)
+{
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_append(writer->buf, value, len);
+
+	return (KORE_RESULT_OK);
+}
+
+/* Returns KORE_RESULT_OK once exactly one complete value was written. */
+int
+kore_json_writer_finish(struct kore_json_writer *writer)
+{
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	if (writer->depth != 0 || !(writer->levels[0] & JSON_WRITER_MEMBERS))
+		return (json_writer_error(writer, KORE_JSON_ERR_INVALID_WRITE));
+
+	if (writer->flags & KORE_JSON_WRITER_PRETTY)
+		kore_buf_append(writer->buf, "\n", 1);
+
+	return (KORE_RESULT_OK);
 }
 
 void
@@ -346,16 +801,30 @@ kore_json_item_free(struct kore_json_item *item)
 		fatal("%s: unknown type %d", __func__, item->type);
 	}
 
+	/* Members may only be removed from an object without its index. */
+	if (item->parent != NULL && item->parent->index != NULL) {
+		kore_free(item->parent->index);
+		item->parent->index = NULL;
+	}
+
+	kore_free(item->index);
 	kore_free(item->name);
 	kore_free(item);
 }
 
 static struct kore_json_item *
-json_item_alloc(int type, const char *name, struct kore_json_item *parent)
+json_item_alloc(struct kore_json *json, int type, char *name,
+    struct kore_json_item *parent)
 {
 	struct kore_json_item	*item;
 
-	item = kore_calloc(1, sizeof(*item));
+	if (json->insitu != NULL) {
+		item = json_arena_alloc(json, sizeof(*item));
+		memset(item, 0, sizeof(*item));
+	} else {
+		item = kore_calloc(1, sizeof(*item));
+	}
+
 	item->type = type;
 	item->parent = parent;
 
@@ -381,7 +850,9 @@ json_item_alloc(int type, const char *name, struct kore_json_item *parent)
 		fatal("%s: unknown type %d", __func__, item->type);
 	}
 
-	if (name)
+	if (name != NULL && json->insitu != NULL)
+		item->name = name;
+	else if (name != NULL)
 		item->name = kore_strdup(name);
 
 	if (parent) {
@@ -397,6 +868,43 @@ json_item_alloc(int type, const char *name, struct kore_json_item *parent)
 	return (item);
 }
 
+static void *
+json_arena_alloc(struct kore_json *json, size_t len)
+{
+	size_t			size;
+	void			*ptr;
+	struct kore_json_arena	*arena;
+
+	len = (len + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+	arena = json->arena;
+
+	if (arena == NULL || arena->length - arena->offset < len) {
+		size = MAX(len, JSON_ARENA_CHUNK);
+		arena = kore_malloc(sizeof(*arena) + size);
+		arena->base = (u_int8_t *)(arena + 1);
+		arena->length = size;
+		arena->offset = 0;
+		arena->next = json->arena;
+		json->arena = arena;
+	}
+
+	ptr = arena->base + arena->offset;
+	arena->offset += len;
+
+	return (ptr);
+}
+
+static void
+json_arena_free(struct kore_json *json)
+{
+	struct kore_json_arena	*arena;
+
+	while ((arena = json->arena) != NULL) {
+		json->arena = arena->next;
+		kore_free(arena);
+	}
+}
+
 static int
 json_peek(struct kore_json *json, u_int8_t *ch)
 {
@@ -428,19 +936,140 @@ json_next_byte(struct kore_json *json, u_int8_t *ch, int peek)
 static int
 json_consume_whitespace(struct kore_json *json)
 {
-	u_int8_t	ch;
+	json->offset += json_scan_whitespace(json->data + json->offset,
+	    json->length - json->offset);
 
-	for (;;) {
-		if (!json_peek(json, &ch))
-			return (KORE_RESULT_ERROR);
+	if (json->offset >= json->length) {
+		json->error = KORE_JSON_ERR_EOF;
+		return (KORE_RESULT_ERROR);
+	}
 
-		if (ch != ' ' && ch != '\n' && ch != '\r' && ch != '\t')
-			break;
+	return (KORE_RESULT_OK);
+}
 
-		json->offset++;
+/*
+ * The scanners below return the length of the run at the start of p
+ * that consists of whitespace, plain string bytes or number bytes.
+ * With SSE2 they look at 16 bytes at a time, the rest byte by byte.
+ */
+#define JSON_IS_WHITESPACE(c)	\
+    ((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+#define JSON_IS_NUMBER(c)	\
+    (((c) >= '0' && (c) <= '9') || (c) == '-' || (c) == '+' || \
+    (c) == '.' || (c) == 'e' || (c) == 'E')
+
+static size_t
+json_scan_whitespace(const u_int8_t *p, size_t len)
+{
+	size_t		idx;
+#if defined(__SSE2__)
+	__m128i		v, m;
+	int		mask;
+#endif
+
+	/* Most values are not preceded by any whitespace at all. */
+	if (len == 0 || !JSON_IS_WHITESPACE(p[0]))
+		return (0);
+
+	idx = 0;
+
+#if defined(__SSE2__)
+	while (len - idx >= 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + idx));
+		m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))));
+
+		mask = ~_mm_movemask_epi8(m) & 0xffff;
+		if (mask != 0)
+			return (idx + __builtin_ctz(mask));
+
+		idx += 16;
 	}
+#endif
 
-	return (KORE_RESULT_OK);
+	while (idx < len && JSON_IS_WHITESPACE(p[idx]))
+		idx++;
+
+	return (idx);
+}
+
+static size_t
+json_scan_string(const u_int8_t *p, size_t len)
+{
+	size_t		idx;
+#if defined(__SSE2__)
+	__m128i		v, m, ctl;
+	int		mask;
+#endif
+
+	idx = 0;
+
+#if defined(__SSE2__)
+	ctl = _mm_set1_epi8(0x1f);
+
+	while (len - idx >= 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + idx));
+		m = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+		    _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl));
+
+		mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return (idx + __builtin_ctz(mask));
+
+		idx += 16;
+	}
+#endif
+
+	while (idx < len && p[idx] != '"' && p[idx] != '\\' && p[idx] > 0x1f)
+		idx++;
+
+	return (idx);
+}
+
+static size_t
+json_scan_number(const u_int8_t *p, size_t len)
+{
+	size_t		idx;
+#if defined(__SSE2__)
+	__m128i		v, d, m, nine;
+	int		mask;
+#endif
+
+	idx = 0;
+
+#if defined(__SSE2__)
+	nine = _mm_set1_epi8(9);
+
+	while (len - idx >= 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + idx));
+		d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+		m = _mm_cmpeq_epi8(_mm_min_epu8(d, nine), d);
+		m = _mm_or_si128(m,
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('+'))));
+		m = _mm_or_si128(m,
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('e')),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8('E')))));
+
+		mask = ~_mm_movemask_epi8(m) & 0xffff;
+		if (mask != 0)
+			return (idx + __builtin_ctz(mask));
+
+		idx += 16;
+	}
+#endif
+
+	while (idx < len && JSON_IS_NUMBER(p[idx]))
+		idx++;
+
+	return (idx);
 }
 
 static int
@@ -478,6 +1107,7 @@ json_parse_object(struct kore_json *json, struct kore_json_item *object)
 {
 	u_int8_t		ch;
 	char			*key;
+	u_int32_t		count;
 	struct kore_json_item	*item;
 	int			ret, type;
 
@@ -487,6 +1117,7 @@ json_parse_object(struct kore_json *json, struct kore_json_item *object)
 	}
 
 	key = NULL;
+	count = 0;
 	ret = KORE_RESULT_ERROR;
 
 	if (!json_next(json, &ch))
@@ -533,7 +1164,8 @@ json_parse_object(struct kore_json *json, struct kore_json_item *object)
 		if (!json_guess_type(ch, &type))
 			goto cleanup;
 
-		item = json_item_alloc(type, key, object);
+		item = json_item_alloc(json, type, key, object);
+		count++;
 
 		if (!item->parse(json, item))
 			goto cleanup;
@@ -558,6 +1190,9 @@ json_parse_object(struct kore_json *json, struct kore_json_item *object)
 	}
 
 cleanup:
+	if (ret == KORE_RESULT_OK && count >= JSON_INDEX_MIN)
+		json_index_build(json, object, count);
+
 	if (ret == KORE_RESULT_ERROR && json->error == 0)
 		json->error = KORE_JSON_ERR_INVALID_OBJECT;
 
@@ -604,7 +1239,7 @@ json_parse_array(struct kore_json *json, struct kore_json_item *array)
 		if (!json_guess_type(ch, &type))
 			goto cleanup;
 
-		item = json_item_alloc(type, key, array);
+		item = json_item_alloc(json, type, key, array);
 
 		if (!item->parse(json, item))
 			goto cleanup;
@@ -646,7 +1281,11 @@ json_parse_string(struct kore_json *json, struct kore_json_item *string)
 		return (KORE_RESULT_ERROR);
 
 	string->type = KORE_JSON_TYPE_STRING;
-	string->data.string = kore_strdup(value);
+
+	if (json->insitu != NULL)
+		string->data.string = value;
+	else
+		string->data.string = kore_strdup(value);
 
 	return (KORE_RESULT_OK);
 }
@@ -654,43 +1293,26 @@ json_parse_string(struct kore_json *json, struct kore_json_item *string)
 static int
 json_parse_number(struct kore_json *json, struct kore_json_item *number)
 {
-	u_int8_t	ch;
+	size_t		len;
 	int		ret;
-	char		*str;
+	char		*str, tmp[JSON_NUMBER_MAX];
 
-	str = NULL;
 	ret = KORE_RESULT_ERROR;
-	kore_buf_reset(&json->tmpbuf);
 
-	for (;;) {
-		if (!json_peek(json, &ch))
-			goto cleanup;
+	len = json_scan_number(json->data + json->offset,
+	    json->length - json->offset);
 
-		switch (ch) {
-		case '0':
-		case '1':
-		case '2':
-		case '3':
-		case '4':
-		case '5':
-		case '6':
-		case '7':
-		case '8':
-		case '9':
-		case '+':
-		case '-':
-		case 'e':
-		case 'E':
-		case '.':
-			kore_buf_append(&json->tmpbuf, &ch, sizeof(ch));
-			json->offset++;
-			continue;
-		}
-
-		break;
+	if (len < sizeof(tmp)) {
+		memcpy(tmp, json->data + json->offset, len);
+		tmp[len] = '\0';
+		str = tmp;
+	} else {
+		kore_buf_reset(&json->tmpbuf);
+		kore_buf_append(&json->tmpbuf, json->data + json->offset, len);
+		str = kore_buf_stringify(&json->tmpbuf, NULL);
 	}
 
-	str = kore_buf_stringify(&json->tmpbuf, NULL);
+	json->offset += len;
 
 	number->data.number = kore_strtodouble(str, -DBL_MAX, DBL_MAX, &ret);
 	if (ret != KORE_RESULT_OK)
@@ -757,13 +1379,21 @@ cleanup:
 	return (ret);
 }
 
+/*
+ * Returns the string at the current offset. In place its unescaped
+ * form is written over the input, a string without escapes is only
+ * terminated where its closing quote was.
+ */
 static char *
 json_get_string(struct kore_json *json)
 {
 	u_int8_t	ch;
+	size_t		len;
 	char		*res;
+	u_int8_t	*start, *out;
 
 	res = NULL;
+	start = out = NULL;
 
 	if (!json_next(json, &ch))
 		goto cleanup;
@@ -771,9 +1401,26 @@ json_get_string(struct kore_json *json)
 	if (ch != '"')
 		goto cleanup;
 
-	kore_buf_reset(&json->tmpbuf);
+	if (json->insitu != NULL)
+		start = out = json->insitu + json->offset;
+	else
+		kore_buf_reset(&json->tmpbuf);
 
 	for (;;) {
+		len = json_scan_string(json->data + json->offset,
+		    json->length - json->offset);
+
+		if (out != NULL) {
+			if (out != json->insitu + json->offset)
+				memmove(out, json->insitu + json->offset, len);
+			out += len;
+		} else {
+			kore_buf_append(&json->tmpbuf,
+			    json->data + json->offset, len);
+		}
+
+		json->offset += len;
+
 		if (!json_next(json, &ch))
 			goto cleanup;
 
@@ -783,37 +1430,46 @@ json_get_string(struct kore_json *json)
 		if (ch <= 0x1f)
 			goto cleanup;
 
-		if (ch == '\\') {
-			if (!json_next(json, &ch))
-				goto cleanup;
+		if (!json_next(json, &ch))
+			goto cleanup;
 
-			switch (ch) {
-			case '\"':
-			case '\\':
-			case '/':
-				break;
-			case 'b':
-				ch = '\b';
-				break;
-			case 'f':
-				ch = '\f';
-				break;
-			case 'n':
-				ch = '\n';
-				break;
-			case 'r':
-				ch = '\r';
-				break;
-			case 'u':
-				/* XXX - not supported. */
-				goto cleanup;
-			}
+		switch (ch) {
+		case '\"':
+		case '\\':
+		case '/':
+			break;
+		case 'b':
+			ch = '\b';
+			break;
+		case 'f':
+			ch = '\f';
+			break;
+		case 'n':
+			ch = '\n';
+			break;
+		case 'r':
+			ch = '\r';
+			break;
+		case 't':
+			ch = '\t';
+			break;
+		case 'u':
+			/* XXX - not supported. */
+			goto cleanup;
 		}
 
-		kore_buf_append(&json->tmpbuf, &ch, sizeof(ch));
+		if (out != NULL)
+			*(out)++ = ch;
+		else
+			kore_buf_append(&json->tmpbuf, &ch, sizeof(ch));
 	}
 
-	res = kore_buf_stringify(&json->tmpbuf, NULL);
+	if (out != NULL) {
+		*out = '\0';
+		res = (char *)start;
+	} else {
+		res = kore_buf_stringify(&json->tmpbuf, NULL);
+	}
 
 cleanup:
 	if (res == NULL && json->error == 0)
@@ -821,3 +1477,177 @@ cleanup:
 
 	return (res);
 }
+
+/*
+ * Account for a value about to be written: it needs a key first inside
+ * of an object, a separator inside of an array and there can only be
+ * one at the top.
+ */
+static int
+json_writer_value(struct kore_json_writer *writer)
+{
+	u_int8_t	*level;
+
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	level = &writer->levels[writer->depth];
+
+	if (writer->depth == 0) {
+		if (*level & JSON_WRITER_MEMBERS)
+			goto invalid;
+		*level |= JSON_WRITER_MEMBERS;
+		return (KORE_RESULT_OK);
+	}
+
+	if (*level & JSON_WRITER_OBJECT) {
+		if (!(*level & JSON_WRITER_KEYED))
+			goto invalid;
+		*level &= ~JSON_WRITER_KEYED;
+		return (KORE_RESULT_OK);
+	}
+
+	if (*level & JSON_WRITER_MEMBERS)
+		kore_buf_append(writer->buf, ",", 1);
+
+	*level |= JSON_WRITER_MEMBERS;
+	json_writer_newline(writer);
+
+	return (KORE_RESULT_OK);
+
+invalid:
+	return (json_writer_error(writer, KORE_JSON_ERR_INVALID_WRITE));
+}
+
+static int
+json_writer_begin(struct kore_json_writer *writer, int object)
+{
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	if (writer->depth >= KORE_JSON_DEPTH_MAX)
+		return (json_writer_error(writer, KORE_JSON_ERR_DEPTH));
+
+	if (!json_writer_value(writer))
+		return (KORE_RESULT_ERROR);
+
+	if (object)
+		kore_buf_append(writer->buf, "{", 1);
+	else
+		kore_buf_append(writer->buf, "[", 1);
+
+	writer->levels[++writer->depth] = object;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+json_writer_end(struct kore_json_writer *writer, int object)
+{
+	u_int8_t	level;
+
+	if (writer->error != KORE_JSON_ERR_NONE)
+		return (KORE_RESULT_ERROR);
+
+	level = writer->levels[writer->depth];
+
+	if (writer->depth == 0 || (level & JSON_WRITER_OBJECT) != object ||
+	    (level & JSON_WRITER_KEYED))
+		return (json_writer_error(writer, KORE_JSON_ERR_INVALID_WRITE));
+
+	writer->depth--;
+
+	if (level & JSON_WRITER_MEMBERS)
+		json_writer_newline(writer);
+
+	if (object)
+		kore_buf_append(writer->buf, "}", 1);
+	else
+		kore_buf_append(writer->buf, "]", 1);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+json_writer_error(struct kore_json_writer *writer, int error)
+{
+	writer->error = error;
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+json_writer_newline(struct kore_json_writer *writer)
+{
+	int		i;
+
+	if (!(writer->flags & KORE_JSON_WRITER_PRETTY))
+		return;
+
+	kore_buf_append(writer->buf, "\n", 1);
+
+	for (i = 0; i < writer->depth; i++) {
+		kore_buf_append(writer->buf,
+		    JSON_WRITER_INDENT, sizeof(JSON_WRITER_INDENT) - 1);
+	}
+}
+
+/*
+ * Append str as a JSON string. The runs in between characters that
+ * need escaping are found with the scanner the parser uses.
+ */
+static void
+json_writer_escape(struct kore_buf *buf, const char *str)
+{
+	size_t			len, run;
+	const u_int8_t		*p;
+	char			esc[8];
+
+	p = (const u_int8_t *)str;
+	len = strlen(str);
+
+	kore_buf_append(buf, "\"", 1);
+
+	while (len > 0) {
+		run = json_scan_string(p, len);
+		kore_buf_append(buf, p, run);
+
+		p += run;
+		len -= run;
+
+		if (len == 0)
+			break;
+
+		switch (*p) {
+		case '"':
+			kore_buf_append(buf, "\\\"", 2);
+			break;
+		case '\\':
+			kore_buf_append(buf, "\\\\", 2);
+			break;
+		case '\b':
+			kore_buf_append(buf, "\\b", 2);
+			break;
+		case '\f':
+			kore_buf_append(buf, "\\f", 2);
+			break;
+		case '\n':
+			kore_buf_append(buf, "\\n", 2);
+			break;
+		case '\r':
+			kore_buf_append(buf, "\\r", 2);
+			break;
+		case '\t':
+			kore_buf_append(buf, "\\t", 2);
+			break;
+		default:
+			(void)snprintf(esc, sizeof(esc), "\\u%04x", *p);
+			kore_buf_append(buf, esc, 6);
+			break;
+		}
+
+		p++;
+		len--;
+	}
+
+	kore_buf_append(buf, "\"", 1);
+}
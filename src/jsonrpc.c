@@ -24,6 +24,66 @@
 #include "http.h"
 #include "jsonrpc.h"
 
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
+#define JSONRPC_CALL_DONE	0x0001
+#define JSONRPC_CALL_TASK	0x0002
+
+struct jsonrpc_method {
+	char				*name;
+	int				flags;
+	int				(*cb)(struct jsonrpc_request *);
+	TAILQ_ENTRY(jsonrpc_method)	list;
+};
+
+/*
+ * A single call out of a request body handled by jsonrpc_dispatch().
+ * Its response is kept in response until the whole batch is done, an
+ * error set here is written for it instead.
+ */
+struct jsonrpc_call {
+#if defined(KORE_USE_TASKS)
+	struct kore_task		task;
+#endif
+	int				flags;
+	int				error;
+	struct jsonrpc_method		*method;
+	struct jsonrpc_request		req;
+	struct kore_buf			response;
+};
+
+struct jsonrpc_batch {
+	int				count;
+	int				single;
+	int				pending;
+	int				error;
+	yajl_val			json;
+	struct kore_buf			body;
+	struct jsonrpc_call		*calls;
+};
+
+static int	jsonrpc_batch_read(struct http_request *,
+		    struct jsonrpc_batch *);
+static void	jsonrpc_batch_run(struct http_request *,
+		    struct jsonrpc_batch *);
+static void	jsonrpc_batch_respond(struct http_request *,
+		    struct jsonrpc_batch *);
+static void	jsonrpc_batch_free(struct http_request *);
+static void	jsonrpc_call_finish(struct jsonrpc_call *);
+static void	jsonrpc_call_response(struct jsonrpc_request *,
+		    const unsigned char *, size_t);
+static void	jsonrpc_write_error(struct kore_json_writer *, yajl_val, int);
+static void	jsonrpc_write_id(struct kore_json_writer *, yajl_val);
+
+#if defined(KORE_USE_TASKS)
+static int	jsonrpc_task(struct kore_task *);
+#endif
+
+static TAILQ_HEAD(, jsonrpc_method)	methods =
+    TAILQ_HEAD_INITIALIZER(methods);
+
 static void
 init_log(struct jsonrpc_log *log)
 {
@@ -49,9 +109,14 @@ append_log(struct jsonrpc_log *prev, int lvl, char *msg)
 static void
 free_log(struct jsonrpc_log *root)
 {
-	for (struct jsonrpc_log *it = root->next; it != root; it = it->next) {
+	struct jsonrpc_log	*it, *next;
+
+	for (it = root->next; it != root; it = next) {
+		next = it->next;
 		kore_free(it);
 	}
+
+	init_log(root);
 }
 
 static void
@@ -65,6 +130,8 @@ init_request(struct jsonrpc_request *req)
 	req->id = NULL;
 	req->method = NULL;
 	req->params = NULL;
+	req->call = NULL;
+	req->state = NULL;
 	req->log_levels = (1 << LOG_EMERG) | (1 << LOG_ERR) | (1 << LOG_WARNING)
 			| (1 << LOG_NOTICE);
         req->flags = 0;
@@ -77,7 +144,8 @@ jsonrpc_destroy_request(struct jsonrpc_request *req)
 		yajl_gen_free(req->gen);
 		req->gen = NULL;
 	}
-	if (req->json != NULL) {
+	/* Calls of a batch point into the tree of the whole body. */
+	if (req->json != NULL && req->call == NULL) {
 		yajl_tree_free(req->json);
 		req->json = NULL;
 	}
@@ -420,16 +488,28 @@ jsonrpc_error(struct jsonrpc_request *req, int code, const char *msg)
 		goto failed;
 	}
 
-	http_response_header(req->http, "content-type", "application/json");
 	yajl_gen_get_buf(req->gen, &body, &body_len);
 succeeded:
-	http_response(req->http, 200, body, body_len);
+	if (req->call != NULL) {
+		jsonrpc_call_response(req, body, body_len);
+	} else {
+		if (body_len > 0) {
+			http_response_header(req->http,
+			    "content-type", "application/json");
+		}
+		http_response(req->http, 200, body, body_len);
+	}
 	if (req->gen != NULL)
 		yajl_gen_clear(req->gen);
 	jsonrpc_destroy_request(req);
 	return (KORE_RESULT_OK);
 failed:
-	http_response(req->http, 500, NULL, 0);
+	if (req->call != NULL) {
+		req->call->error = JSONRPC_INTERNAL_ERROR;
+		req->call->flags |= JSONRPC_CALL_DONE;
+	} else {
+		http_response(req->http, 500, NULL, 0);
+	}
 	jsonrpc_destroy_request(req);
 	return (KORE_RESULT_OK);
 }
@@ -463,16 +543,408 @@ jsonrpc_result(struct jsonrpc_request *req,
 	if (YAJL_GEN_KO(yajl_gen_map_close(req->gen)))
 		goto failed;
 	
-	http_response_header(req->http, "content-type", "application/json");
 	yajl_gen_get_buf(req->gen, &body, &body_len);
 succeeded:
-	http_response(req->http, 200, body, body_len);
+	if (req->call != NULL) {
+		jsonrpc_call_response(req, body, body_len);
+	} else {
+		if (body_len > 0) {
+			http_response_header(req->http,
+			    "content-type", "application/json");
+		}
+		http_response(req->http, 200, body, body_len);
+	}
 	if (req->gen != NULL)
 		yajl_gen_clear(req->gen);
 	jsonrpc_destroy_request(req);
 	return (KORE_RESULT_OK);
 failed:
-	http_response(req->http, 500, NULL, 0);
+	if (req->call != NULL) {
+		req->call->error = JSONRPC_INTERNAL_ERROR;
+		req->call->flags |= JSONRPC_CALL_DONE;
+	} else {
+		http_response(req->http, 500, NULL, 0);
+	}
 	jsonrpc_destroy_request(req);
 	return (KORE_RESULT_OK);
 }
+
+/*
+ * Register a method for jsonrpc_dispatch(). Its callback completes the
+ * call with jsonrpc_result() or jsonrpc_error() and returns
+ * KORE_RESULT_OK, or returns KORE_RESULT_RETRY to be called again once
+ * the HTTP request was woken up. Methods added with JSONRPC_METHOD_TASK
+ * run on a task thread and must complete the call before returning.
+ */
+void
+jsonrpc_method_add(const char *name, int (*cb)(struct jsonrpc_request *),
+    int flags)
+{
+	struct jsonrpc_method	*method;
+
+#if !defined(KORE_USE_TASKS)
+	if (flags & JSONRPC_METHOD_TASK)
+		fatal("jsonrpc method '%s' needs tasks", name);
+#endif
+
+	method = kore_calloc(1, sizeof(*method));
+	method->cb = cb;
+	method->flags = flags;
+	method->name = kore_strdup(name);
+
+	TAILQ_INSERT_TAIL(&methods, method, list);
+}
+
+/*
+ * Page handler for a JSON-RPC endpoint taking both single calls and
+ * batches of them. The calls of a batch run side by side: methods that
+ * return KORE_RESULT_RETRY are picked up again on the next wakeup while
+ * the others carry on and task methods are all started up front. The
+ * response goes out once every call is done.
+ */
+int
+jsonrpc_dispatch(struct http_request *http_req)
+{
+	struct jsonrpc_batch	*batch;
+
+	if (!http_state_exists(http_req)) {
+		batch = http_state_create(http_req,
+		    sizeof(*batch), jsonrpc_batch_free);
+
+		if (!jsonrpc_batch_read(http_req, batch)) {
+			jsonrpc_batch_respond(http_req, batch);
+			return (KORE_RESULT_OK);
+		}
+	} else {
+		batch = http_state_get(http_req);
+	}
+
+	jsonrpc_batch_run(http_req, batch);
+
+	if (batch->pending > 0)
+		return (KORE_RESULT_RETRY);
+
+	jsonrpc_batch_respond(http_req, batch);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+jsonrpc_batch_read(struct http_request *http_req, struct jsonrpc_batch *batch)
+{
+	int			i;
+	ssize_t			ret;
+	yajl_val		json;
+	struct jsonrpc_call	*call;
+	struct jsonrpc_method	*method;
+	u_int8_t		data[BUFSIZ];
+	char			error[128];
+
+	kore_buf_init(&batch->body, BUFSIZ);
+
+	for (;;) {
+		ret = http_body_read(http_req, data, sizeof(data));
+		if (ret == -1) {
+			batch->error = JSONRPC_SERVER_ERROR;
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (ret == 0)
+			break;
+
+		kore_buf_append(&batch->body, data, ret);
+	}
+
+	batch->json = yajl_tree_parse(kore_buf_stringify(&batch->body, NULL),
+	    error, sizeof(error));
+	if (batch->json == NULL) {
+		batch->error = JSONRPC_PARSE_ERROR;
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (YAJL_IS_ARRAY(batch->json)) {
+		if (batch->json->u.array.len == 0) {
+			batch->error = JSONRPC_INVALID_REQUEST;
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (batch->json->u.array.len > JSONRPC_BATCH_MAX) {
+			batch->error = JSONRPC_LIMIT_REACHED;
+			return (KORE_RESULT_ERROR);
+		}
+
+		batch->count = batch->json->u.array.len;
+	} else {
+		batch->count = 1;
+		batch->single = 1;
+	}
+
+	batch->calls = kore_calloc(batch->count, sizeof(*batch->calls));
+
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+
+		if (batch->single)
+			json = batch->json;
+		else
+			json = batch->json->u.array.values[i];
+
+		init_request(&call->req);
+		kore_buf_init(&call->response, 128);
+
+		call->req.call = call;
+		call->req.json = json;
+		call->req.http = http_req;
+
+		if (!YAJL_IS_OBJECT(json) || parse_json_body(&call->req) != 0) {
+			jsonrpc_destroy_request(&call->req);
+			call->error = JSONRPC_INVALID_REQUEST;
+			call->flags |= JSONRPC_CALL_DONE;
+			continue;
+		}
+
+		TAILQ_FOREACH(method, &methods, list) {
+			if (!strcmp(method->name, call->req.method))
+				break;
+		}
+
+		if ((call->method = method) == NULL)
+			(void)jsonrpc_error(&call->req,
+			    JSONRPC_METHOD_NOT_FOUND, NULL);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+jsonrpc_batch_run(struct http_request *http_req, struct jsonrpc_batch *batch)
+{
+	int			i;
+	struct jsonrpc_call	*call;
+
+#if defined(KORE_USE_TASKS)
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+
+		if (call->flags & JSONRPC_CALL_DONE)
+			continue;
+
+		if (call->flags & JSONRPC_CALL_TASK) {
+			if (!kore_task_finished(&call->task))
+				continue;
+
+			kore_task_destroy(&call->task);
+			call->flags &= ~JSONRPC_CALL_TASK;
+			jsonrpc_call_finish(call);
+			continue;
+		}
+
+		if (call->method->flags & JSONRPC_METHOD_TASK) {
+			call->flags |= JSONRPC_CALL_TASK;
+			kore_task_create(&call->task, jsonrpc_task);
+			kore_task_bind_request(&call->task, http_req);
+			kore_task_run(&call->task);
+		}
+	}
+#endif
+
+	batch->pending = 0;
+
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+
+		if (call->flags & JSONRPC_CALL_DONE)
+			continue;
+
+		if (call->method->flags & JSONRPC_METHOD_TASK) {
+			batch->pending++;
+			continue;
+		}
+
+		if (call->method->cb(&call->req) == KORE_RESULT_RETRY) {
+			batch->pending++;
+			continue;
+		}
+
+		jsonrpc_call_finish(call);
+	}
+}
+
+/*
+ * Responses of the calls go out in the order of the batch, calls that
+ * were notifications have none. Only a batch of nothing but
+ * notifications gets an empty body.
+ */
+static void
+jsonrpc_batch_respond(struct http_request *http_req,
+    struct jsonrpc_batch *batch)
+{
+	int			i, count;
+	struct jsonrpc_call	*call;
+	struct kore_buf		buf;
+	struct kore_json_writer	writer;
+
+	count = 0;
+
+	kore_buf_init(&buf, 1024);
+	kore_json_writer_init(&writer, &buf, 0);
+
+	if (batch->error != 0) {
+		jsonrpc_write_error(&writer, NULL, batch->error);
+		count++;
+	} else {
+		if (!batch->single)
+			kore_json_writer_array_begin(&writer);
+
+		for (i = 0; i < batch->count; i++) {
+			call = &batch->calls[i];
+
+			if (call->response.offset > 0) {
+				kore_json_writer_raw(&writer,
+				    call->response.data, call->response.offset);
+				count++;
+			} else if (call->error == JSONRPC_INVALID_REQUEST ||
+			    (call->error != 0 && call->req.id != NULL)) {
+				jsonrpc_write_error(&writer,
+				    call->req.id, call->error);
+				count++;
+			}
+		}
+
+		if (!batch->single)
+			kore_json_writer_array_end(&writer);
+	}
+
+	if (count == 0) {
+		http_response(http_req, HTTP_STATUS_OK, NULL, 0);
+	} else if (!kore_json_writer_finish(&writer)) {
+		kore_log(LOG_ERR, "jsonrpc_dispatch: %s",
+		    kore_json_writer_strerror(&writer));
+		http_response(http_req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+	} else {
+		http_response_header(http_req,
+		    "content-type", "application/json");
+		http_response(http_req, HTTP_STATUS_OK, buf.data, buf.offset);
+	}
+
+	kore_buf_cleanup(&buf);
+}
+
+/*
+ * Called when the HTTP request is freed, which is put off for as long
+ * as calls are still running on task threads.
+ */
+static void
+jsonrpc_batch_free(struct http_request *http_req)
+{
+	int			i;
+	struct jsonrpc_call	*call;
+	struct jsonrpc_batch	*batch;
+
+	batch = http_state_get(http_req);
+
+#if defined(KORE_USE_TASKS)
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+		if ((call->flags & JSONRPC_CALL_TASK) &&
+		    !kore_task_finished(&call->task))
+			return;
+	}
+#endif
+
+	for (i = 0; i < batch->count; i++) {
+		call = &batch->calls[i];
+
+#if defined(KORE_USE_TASKS)
+		if ((call->flags & JSONRPC_CALL_TASK) && call->task.req != NULL)
+			kore_task_destroy(&call->task);
+#endif
+
+		jsonrpc_destroy_request(&call->req);
+		kore_buf_cleanup(&call->response);
+		kore_free(call->req.state);
+	}
+
+	kore_free(batch->calls);
+	batch->calls = NULL;
+	batch->count = 0;
+
+	if (batch->json != NULL) {
+		yajl_tree_free(batch->json);
+		batch->json = NULL;
+	}
+
+	kore_buf_cleanup(&batch->body);
+}
+
+/* A method that did not complete its call gets an internal error. */
+static void
+jsonrpc_call_finish(struct jsonrpc_call *call)
+{
+	if (call->flags & JSONRPC_CALL_DONE)
+		return;
+
+	kore_log(LOG_NOTICE, "jsonrpc method '%s' did not complete its call",
+	    call->method->name);
+
+	jsonrpc_destroy_request(&call->req);
+
+	call->error = JSONRPC_INTERNAL_ERROR;
+	call->flags |= JSONRPC_CALL_DONE;
+}
+
+static void
+jsonrpc_call_response(struct jsonrpc_request *req, const unsigned char *body,
+    size_t len)
+{
+	if (len > 0)
+		kore_buf_append(&req->call->response, body, len);
+
+	req->call->flags |= JSONRPC_CALL_DONE;
+}
+
+static void
+jsonrpc_write_error(struct kore_json_writer *writer, yajl_val id, int code)
+{
+	kore_json_writer_object_begin(writer);
+
+	kore_json_writer_key(writer, "jsonrpc");
+	kore_json_writer_string(writer, "2.0");
+
+	jsonrpc_write_id(writer, id);
+
+	kore_json_writer_key(writer, "error");
+	kore_json_writer_object_begin(writer);
+	kore_json_writer_key(writer, "code");
+	kore_json_writer_integer(writer, code);
+	kore_json_writer_key(writer, "message");
+	kore_json_writer_string(writer, known_msg(code));
+	kore_json_writer_object_end(writer);
+
+	kore_json_writer_object_end(writer);
+}
+
+static void
+jsonrpc_write_id(struct kore_json_writer *writer, yajl_val id)
+{
+	kore_json_writer_key(writer, "id");
+
+	if (id != NULL && YAJL_IS_INTEGER(id))
+		kore_json_writer_integer(writer, YAJL_GET_INTEGER(id));
+	else if (id != NULL && YAJL_IS_STRING(id))
+		kore_json_writer_string(writer, YAJL_GET_STRING(id));
+	else
+		kore_json_writer_literal(writer, KORE_JSON_NULL);
+}
+
+#if defined(KORE_USE_TASKS)
+static int
+jsonrpc_task(struct kore_task *t)
+{
+	struct jsonrpc_call	*call = (struct jsonrpc_call *)t;
+
+	(void)call->method->cb(&call->req);
+
+	return (KORE_RESULT_OK);
+}
+#endif
@@ -23,13 +23,29 @@
  *
  * When a worker requires the private key for signing it will send a message
  * to the keymgr with the to-be-signed data (KORE_MSG_KEYMGR_REQ). The keymgr
- * will perform the signing and respond with a KORE_MSG_KEYMGR_RESP message.
+ * will perform the signing and respond with a KORE_MSG_KEYMGR_RESP message
+ * carrying the request id followed by the signature (or nothing if the
+ * signing failed). Responses are queued and written out once per event
+ * loop iteration so a burst of handshakes costs a single write.
  *
  * The keymgr can transparently reload the private keys and certificates
  * for a configured domain when it receives a SIGUSR1. It it reloads them
  * it will send the newly loaded certificate chains to the worker processes
  * which will update their TLS contexts accordingly.
  *
+ * The keymgr also generates the TLS session ticket keys and pushes them
+ * to all workers so that a ticket issued by one worker can be used to
+ * resume a session on any other. The keys are rotated every
+ * tls_ticket_rotate seconds, the previous key is kept around so that
+ * tickets issued right before a rotation remain valid.
+ *
+ * For domains with an ocsp_response file the keymgr checks the OCSP
+ * response in it against the domain certificate and pushes it to the
+ * workers, which staple it. The keymgr does not talk to the network, the
+ * file is expected to be refreshed by an outside tool. It is looked at
+ * again every few minutes, a changed or expired response is pushed out
+ * (an expired one as an empty response, so workers stop stapling it).
+ *
  * If ACME is turned on the keymgr will also hold all account and domain
  * keys and will initiate the process of acquiring new certificates against
  * the ACME provider that is configured if those certificates do not exist
@@ -41,6 +57,8 @@
 #include <sys/stat.h>
 
 #include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
 #include <openssl/rsa.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
@@ -49,6 +67,9 @@
 
 #include <ctype.h>
 #include <fcntl.h>
+#if defined(KORE_USE_TASKS)
+#include <pthread.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -65,6 +86,9 @@
 #define RAND_POLL_INTERVAL	(1800 * 1000)
 #define RAND_FILE_SIZE		1024
 
+#define OCSP_REFRESH_TIMER	(300 * 1000)
+#define OCSP_RESPONSE_MAX	(64 * 1024)
+
 #if defined(__linux__)
 #include "seccomp.h"
 
@@ -87,6 +111,9 @@ static struct sock_filter filter_keymgr[] = {
 	KORE_SYSCALL_ALLOW(fstat),
 #if defined(SYS_fstat64)
 	KORE_SYSCALL_ALLOW(fstat64),
+#endif
+#if defined(SYS_newfstatat)
+	KORE_SYSCALL_ALLOW(newfstatat),
 #endif
 	KORE_SYSCALL_ALLOW(futex),
 	KORE_SYSCALL_ALLOW(writev),
@@ -144,6 +171,20 @@ static struct sock_filter filter_keymgr[] = {
 	KORE_SYSCALL_ALLOW(getrandom),
 #endif
 
+#if defined(KORE_USE_TASKS)
+	/* Threads that load the private keys. */
+	KORE_SYSCALL_ALLOW(clone),
+#if defined(SYS_clone3)
+	KORE_SYSCALL_ALLOW(clone3),
+#endif
+	KORE_SYSCALL_ALLOW(madvise),
+	KORE_SYSCALL_ALLOW(mprotect),
+	KORE_SYSCALL_ALLOW(set_robust_list),
+#if defined(SYS_rseq)
+	KORE_SYSCALL_ALLOW(rseq),
+#endif
+#endif
+
 #if defined(KORE_USE_ACME)
 #if defined(SYS_mkdir)
 	KORE_SYSCALL_ALLOW(mkdir),
@@ -157,6 +198,8 @@ static struct sock_filter filter_keymgr[] = {
 struct key {
 	EVP_PKEY		*pkey;
 	struct kore_domain	*dom;
+	time_t			ocsp_mtime;
+	time_t			ocsp_expires;
 	TAILQ_ENTRY(key)	list;
 };
 
@@ -165,6 +208,39 @@ char				*rand_file = NULL;
 static TAILQ_HEAD(, key)	keys;
 static int			initialized = 0;
 
+static struct kore_ticket_key	ticket_keys[KORE_TICKET_KEYS];
+static int			ticket_nkeys = 0;
+
+#if defined(KORE_USE_TASKS)
+/*
+ * Private keys are parsed up front by keymgr_threads threads, in the
+ * order kore_domain_callback() visits the domains so that they can be
+ * picked up one after the other. Anything a thread could not load is
+ * loaded again by the main thread, which reports the error.
+ */
+struct keymgr_preload {
+	u_int32_t		count;
+	u_int32_t		next;
+	u_int32_t		step;
+	struct kore_domain	**doms;
+	EVP_PKEY		**pkeys;
+};
+
+struct keymgr_preload_thread {
+	pthread_t		tid;
+	u_int32_t		first;
+	struct keymgr_preload	*preload;
+};
+
+u_int16_t			keymgr_threads = 0;
+static struct keymgr_preload	preload;
+
+static void	keymgr_preload_keys(void);
+static void	keymgr_preload_free(void);
+static void	*keymgr_preload_thread(void *);
+static EVP_PKEY	*keymgr_preload_take(struct kore_domain *);
+#endif
+
 #if defined(KORE_USE_ACME)
 
 #define ACME_ORDER_STATE_INIT		1
@@ -226,6 +302,12 @@ static int	keymgr_asn1_convert_generalizedtime(const void *,
 #endif /* KORE_USE_ACME */
 
 static void	keymgr_reload(void);
+static void	keymgr_ticket_submit(u_int16_t);
+static void	keymgr_ocsp_refresh(void *, u_int64_t);
+static void	keymgr_ocsp_submit(struct kore_domain *, u_int16_t);
+static int	keymgr_ocsp_verify(struct kore_domain *, const u_int8_t *,
+		    size_t, time_t *);
+static void	keymgr_ticket_rotate(void *, u_int64_t);
 static void	keymgr_load_randfile(void);
 static void	keymgr_save_randfile(void);
 
@@ -240,6 +322,8 @@ static void	keymgr_submit_file(u_int8_t, struct kore_domain *,
 		    const char *, u_int16_t, int);
 static void	keymgr_x509_msg(const char *, const void *, size_t, int, int);
 
+static void	keymgr_sign_response(struct kore_msg *,
+		    const struct kore_keyreq *, const void *, size_t);
 static void	keymgr_rsa_encrypt(struct kore_msg *, const void *,
 		    struct key *);
 static void	keymgr_ecdsa_sign(struct kore_msg *, const void *,
@@ -289,6 +373,8 @@ kore_keymgr_run(void)
 #endif
 #if defined(KORE_USE_PYTHON)
 	kore_msg_unregister(KORE_PYTHON_SEND_OBJ);
+	kore_msg_unregister(KORE_PYTHON_SEND_RAW);
+	kore_msg_unregister(KORE_PYTHON_SEND_MARSHAL);
 #endif
 	kore_worker_privdrop(keymgr_runas_user, keymgr_root_path);
 
@@ -308,6 +394,14 @@ kore_keymgr_run(void)
 	initialized = 1;
 	keymgr_reload();
 
+	kore_timer_add(keymgr_ocsp_refresh, OCSP_REFRESH_TIMER, NULL, 0);
+
+	if (tls_ticket_rotate > 0) {
+		keymgr_ticket_rotate(NULL, 0);
+		kore_timer_add(keymgr_ticket_rotate,
+		    (u_int64_t)tls_ticket_rotate * 1000, NULL, 0);
+	}
+
 #if defined(__OpenBSD__)
 	if (pledge(keymgr_pledges, NULL) == -1)
 		fatalx("failed to pledge keymgr process");
@@ -327,6 +421,7 @@ kore_keymgr_run(void)
 
 		netwait = kore_timer_next_run(now);
 		kore_platform_event_wait(netwait);
+		kore_msg_flush();
 
 		if (sig_recv != 0) {
 			switch (sig_recv) {
@@ -381,6 +476,8 @@ kore_keymgr_cleanup(int final)
 static void
 keymgr_reload(void)
 {
+	u_int32_t		count;
+	u_int64_t		start, keys_ms;
 	struct kore_server	*srv;
 	struct kore_domain	*dom;
 
@@ -394,15 +491,32 @@ keymgr_reload(void)
 	keymgr_acme_init();
 #endif
 
+	start = kore_time_ms();
+#if defined(KORE_USE_TASKS)
+	keymgr_preload_keys();
+#endif
 	kore_domain_callback(keymgr_load_domain_privatekey);
+#if defined(KORE_USE_TASKS)
+	keymgr_preload_free();
+#endif
+	keys_ms = kore_time_ms() - start;
+
+	count = 0;
+	start = kore_time_ms();
 
 	/* can't use kore_domain_callback() due to dst parameter. */
 	LIST_FOREACH(srv, &kore_servers, list) {
 		if (srv->tls == 0)
 			continue;
-		TAILQ_FOREACH(dom, &srv->domains, list)
+		TAILQ_FOREACH(dom, &srv->domains, list) {
 			keymgr_submit_certificates(dom, KORE_MSG_WORKER_ALL);
+			count++;
+		}
 	}
+
+	kore_log(LOG_INFO, "%u domains: keys loaded in %" PRIu64 "ms, "
+	    "certificates sent in %" PRIu64 "ms", count, keys_ms,
+	    kore_time_ms() - start);
 }
 
 static void
@@ -421,6 +535,174 @@ keymgr_submit_certificates(struct kore_domain *dom, u_int16_t dst)
 
 	if (dom->crlfile != NULL)
 		keymgr_submit_file(KORE_MSG_CRL, dom, dom->crlfile, dst, 1);
+
+	if (dom->ocspfile != NULL)
+		keymgr_ocsp_submit(dom, dst);
+}
+
+static void
+keymgr_ocsp_refresh(void *unused, u_int64_t now)
+{
+	struct key	*key;
+	struct stat	st;
+
+	TAILQ_FOREACH(key, &keys, list) {
+		if (key->dom == NULL || key->dom->ocspfile == NULL)
+			continue;
+
+		if (stat(key->dom->ocspfile, &st) == -1)
+			st.st_mtime = 0;
+
+		if (st.st_mtime != key->ocsp_mtime ||
+		    (key->ocsp_expires != 0 && key->ocsp_expires <= time(NULL)))
+			keymgr_ocsp_submit(key->dom, KORE_MSG_WORKER_ALL);
+	}
+}
+
+static void
+keymgr_ocsp_submit(struct kore_domain *dom, u_int16_t dst)
+{
+	int		fd;
+	struct stat	st;
+	struct key	*key;
+	ssize_t		ret;
+	size_t		len;
+	time_t		expires;
+	u_int8_t	*der;
+
+	TAILQ_FOREACH(key, &keys, list) {
+		if (key->dom == dom)
+			break;
+	}
+
+	if (key == NULL)
+		return;
+
+	len = 0;
+	der = NULL;
+	expires = 0;
+	st.st_mtime = 0;
+
+	if ((fd = open(dom->ocspfile, O_RDONLY)) == -1) {
+		kore_log(LOG_WARNING, "[%s] cannot open %s: %s",
+		    dom->domain, dom->ocspfile, errno_s);
+		goto submit;
+	}
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0 || st.st_size > OCSP_RESPONSE_MAX) {
+		kore_log(LOG_WARNING, "[%s] %s is not a usable file",
+		    dom->domain, dom->ocspfile);
+		goto submit;
+	}
+
+	der = kore_malloc(st.st_size);
+	ret = read(fd, der, st.st_size);
+	if (ret != st.st_size) {
+		kore_log(LOG_WARNING, "[%s] short read on %s",
+		    dom->domain, dom->ocspfile);
+		goto submit;
+	}
+
+	if (keymgr_ocsp_verify(dom, der, st.st_size, &expires))
+		len = st.st_size;
+
+submit:
+	if (fd != -1)
+		close(fd);
+
+	key->ocsp_mtime = st.st_mtime;
+	key->ocsp_expires = expires;
+
+	/* An empty response tells the workers to stop stapling. */
+	keymgr_x509_msg(dom->domain, der, len, dst, KORE_MSG_OCSP);
+	kore_free(der);
+}
+
+/*
+ * Only staple a response that is for our certificate and is current,
+ * returns when it stops being so in expires. The issuer is taken from
+ * the chain in the certfile.
+ */
+static int
+keymgr_ocsp_verify(struct kore_domain *dom, const u_int8_t *der,
+    size_t len, time_t *expires)
+{
+	BIO				*bio;
+	OCSP_CERTID			*id;
+	const u_int8_t			*ptr;
+	OCSP_RESPONSE			*resp;
+	OCSP_BASICRESP			*basic;
+	X509				*x509, *issuer;
+	ASN1_GENERALIZEDTIME		*thisupd, *nextupd;
+	int				ret, status, reason, days, secs;
+
+	ret = KORE_RESULT_ERROR;
+
+	id = NULL;
+	resp = NULL;
+	basic = NULL;
+	x509 = NULL;
+	issuer = NULL;
+
+	if ((bio = BIO_new_file(dom->certfile, "r")) == NULL ||
+	    (x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) == NULL ||
+	    (issuer = PEM_read_bio_X509(bio, NULL, NULL, NULL)) == NULL) {
+		kore_log(LOG_WARNING, "[%s] no certificate and issuer in %s",
+		    dom->domain, dom->certfile);
+		goto cleanup;
+	}
+
+	if ((id = OCSP_cert_to_id(NULL, x509, issuer)) == NULL)
+		goto cleanup;
+
+	ptr = der;
+	if ((resp = d2i_OCSP_RESPONSE(NULL, &ptr, len)) == NULL ||
+	    OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL ||
+	    (basic = OCSP_response_get1_basic(resp)) == NULL) {
+		kore_log(LOG_WARNING, "[%s] %s is not a valid OCSP response",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (!OCSP_resp_find_status(basic, id, &status, &reason, NULL,
+	    &thisupd, &nextupd)) {
+		kore_log(LOG_WARNING, "[%s] %s is not for our certificate",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (status == V_OCSP_CERTSTATUS_UNKNOWN || nextupd == NULL ||
+	    !OCSP_check_validity(thisupd, nextupd, 300, -1) ||
+	    !ASN1_TIME_diff(&days, &secs, NULL, nextupd)) {
+		kore_log(LOG_WARNING, "[%s] %s is not current",
+		    dom->domain, dom->ocspfile);
+		goto cleanup;
+	}
+
+	if (status == V_OCSP_CERTSTATUS_REVOKED) {
+		kore_log(LOG_WARNING, "[%s] OCSP says certificate is revoked",
+		    dom->domain);
+	}
+
+	*expires = time(NULL) + (days * 86400) + secs;
+	ret = KORE_RESULT_OK;
+
+cleanup:
+	if (bio != NULL)
+		BIO_free(bio);
+	if (id != NULL)
+		OCSP_CERTID_free(id);
+	if (x509 != NULL)
+		X509_free(x509);
+	if (issuer != NULL)
+		X509_free(issuer);
+	if (basic != NULL)
+		OCSP_BASICRESP_free(basic);
+	if (resp != NULL)
+		OCSP_RESPONSE_free(resp);
+
+	return (ret);
 }
 
 static void
@@ -559,7 +841,14 @@ keymgr_load_domain_privatekey(struct kore_domain *dom)
 	if (dom->server->tls == 0)
 		return;
 
+#if defined(KORE_USE_TASKS)
+	key = keymgr_load_privatekey(NULL);
+	if ((key->pkey = keymgr_preload_take(dom)) == NULL &&
+	    dom->certkey != NULL)
+		key->pkey = kore_rsakey_load(dom->certkey);
+#else
 	key = keymgr_load_privatekey(dom->certkey);
+#endif
 
 	if (key->pkey == NULL) {
 #if defined(KORE_USE_ACME)
@@ -604,6 +893,36 @@ keymgr_certificate_request(struct kore_msg *msg, const void *data)
 		TAILQ_FOREACH(dom, &srv->domains, list)
 			keymgr_submit_certificates(dom, msg->src);
 	}
+
+	keymgr_ticket_submit(msg->src);
+}
+
+static void
+keymgr_ticket_rotate(void *unused, u_int64_t now)
+{
+	struct kore_ticket_key	*key;
+
+	memmove(&ticket_keys[1], &ticket_keys[0],
+	    sizeof(ticket_keys) - sizeof(ticket_keys[0]));
+
+	key = &ticket_keys[0];
+	if (RAND_bytes((unsigned char *)key, sizeof(*key)) != 1)
+		fatalx("failed to generate ticket key: %s", ssl_errno_s);
+
+	if (ticket_nkeys < KORE_TICKET_KEYS)
+		ticket_nkeys++;
+
+	keymgr_ticket_submit(KORE_MSG_WORKER_ALL);
+}
+
+static void
+keymgr_ticket_submit(u_int16_t dst)
+{
+	if (ticket_nkeys == 0)
+		return;
+
+	kore_msg_send(dst, KORE_MSG_TICKET_KEYS,
+	    ticket_keys, ticket_nkeys * sizeof(ticket_keys[0]));
 }
 
 static void
@@ -647,8 +966,11 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 			break;
 	}
 
-	if (key == NULL)
+	if (key == NULL) {
+		if (msg->id == KORE_MSG_KEYMGR_REQ)
+			keymgr_sign_response(msg, req, NULL, 0);
 		return;
+	}
 
 	switch (msg->id) {
 	case KORE_MSG_KEYMGR_REQ:
@@ -660,6 +982,7 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 			keymgr_ecdsa_sign(msg, data, key);
 			break;
 		default:
+			keymgr_sign_response(msg, req, NULL, 0);
 			break;
 		}
 		break;
@@ -680,6 +1003,27 @@ keymgr_msg_recv(struct kore_msg *msg, const void *data)
 	}
 }
 
+/*
+ * Always answer a signing request, the worker has a handshake parked
+ * on it. An empty payload after the id tells it the signing failed.
+ */
+static void
+keymgr_sign_response(struct kore_msg *msg, const struct kore_keyreq *req,
+    const void *sig, size_t len)
+{
+	u_int8_t	buf[sizeof(req->id) + 1024];
+
+	if (len > sizeof(buf) - sizeof(req->id))
+		len = 0;
+
+	memcpy(buf, &req->id, sizeof(req->id));
+	if (len > 0)
+		memcpy(buf + sizeof(req->id), sig, len);
+
+	kore_msg_queue(msg->src, KORE_MSG_KEYMGR_RESP,
+	    buf, sizeof(req->id) + len);
+}
+
 static void
 keymgr_rsa_encrypt(struct kore_msg *msg, const void *data, struct key *key)
 {
@@ -697,15 +1041,19 @@ keymgr_rsa_encrypt(struct kore_msg *msg, const void *data, struct key *key)
 	rsa = key->pkey->pkey.rsa;
 #endif
 	keylen = RSA_size(rsa);
-	if (req->data_len > keylen || keylen > sizeof(buf))
+	if (req->data_len > keylen || keylen > sizeof(buf)) {
+		keymgr_sign_response(msg, req, NULL, 0);
 		return;
+	}
 
 	ret = RSA_private_encrypt(req->data_len, req->data,
 	    buf, rsa, req->padding);
-	if (ret != RSA_size(rsa))
+	if (ret != RSA_size(rsa)) {
+		keymgr_sign_response(msg, req, NULL, 0);
 		return;
+	}
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, buf, ret);
+	keymgr_sign_response(msg, req, buf, ret);
 }
 
 static void
@@ -724,17 +1072,18 @@ keymgr_ecdsa_sign(struct kore_msg *msg, const void *data, struct key *key)
 	ec = key->pkey->pkey.ec;
 #endif
 	len = ECDSA_size(ec);
-	if (req->data_len > len || len > sizeof(sig))
+	if (req->data_len > len || len > sizeof(sig)) {
+		keymgr_sign_response(msg, req, NULL, 0);
 		return;
+	}
 
 	if (ECDSA_sign(EVP_PKEY_NONE, req->data, req->data_len,
-	    sig, &siglen, ec) == 0)
-		return;
-
-	if (siglen > sizeof(sig))
+	    sig, &siglen, ec) == 0 || siglen > sizeof(sig)) {
+		keymgr_sign_response(msg, req, NULL, 0);
 		return;
+	}
 
-	kore_msg_send(msg->src, KORE_MSG_KEYMGR_RESP, sig, siglen);
+	keymgr_sign_response(msg, req, sig, siglen);
 }
 
 static void
@@ -1382,3 +1731,116 @@ keymgr_asn1_convert_generalizedtime(const void *ptr, size_t len, time_t *out)
 	return (KORE_RESULT_OK);
 }
 #endif
+
+#if defined(KORE_USE_TASKS)
+static void
+keymgr_preload_keys(void)
+{
+	u_int32_t			i, n;
+	struct kore_server		*srv;
+	struct kore_domain		*dom;
+	struct keymgr_preload_thread	*threads;
+
+	memset(&preload, 0, sizeof(preload));
+
+	n = keymgr_threads;
+	if (n == 0)
+		n = cpu_count;
+	if (n < 2)
+		return;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		if (srv->tls == 0)
+			continue;
+		TAILQ_FOREACH(dom, &srv->domains, list)
+			preload.count++;
+	}
+
+	/* Not worth the threads for a handful of keys. */
+	if (preload.count < n * 2)
+		n = preload.count / 2;
+	if (n < 2) {
+		preload.count = 0;
+		return;
+	}
+
+	preload.step = n;
+	preload.doms = kore_calloc(preload.count, sizeof(*preload.doms));
+	preload.pkeys = kore_calloc(preload.count, sizeof(*preload.pkeys));
+
+	i = 0;
+	LIST_FOREACH(srv, &kore_servers, list) {
+		if (srv->tls == 0)
+			continue;
+		TAILQ_FOREACH(dom, &srv->domains, list)
+			preload.doms[i++] = dom;
+	}
+
+	threads = kore_calloc(n, sizeof(*threads));
+
+	for (i = 0; i < n; i++) {
+		threads[i].first = i;
+		threads[i].preload = &preload;
+		if (pthread_create(&threads[i].tid, NULL,
+		    keymgr_preload_thread, &threads[i]) != 0)
+			fatalx("pthread_create: %s", errno_s);
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i].tid, NULL);
+
+	kore_free(threads);
+}
+
+static void
+keymgr_preload_free(void)
+{
+	u_int32_t	i;
+
+	for (i = preload.next; i < preload.count; i++)
+		EVP_PKEY_free(preload.pkeys[i]);
+
+	kore_free(preload.doms);
+	kore_free(preload.pkeys);
+	memset(&preload, 0, sizeof(preload));
+}
+
+/* Runs without touching any of our own state, errors are left to main. */
+static void *
+keymgr_preload_thread(void *arg)
+{
+	FILE				*fp;
+	u_int32_t			i;
+	struct keymgr_preload_thread	*thr;
+	struct kore_domain		*dom;
+
+	thr = arg;
+
+	for (i = thr->first; i < thr->preload->count; i += thr->preload->step) {
+		dom = thr->preload->doms[i];
+		if (dom->certkey == NULL)
+			continue;
+		if ((fp = fopen(dom->certkey, "r")) == NULL)
+			continue;
+		thr->preload->pkeys[i] =
+		    PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+		fclose(fp);
+	}
+
+	return (NULL);
+}
+
+static EVP_PKEY *
+keymgr_preload_take(struct kore_domain *dom)
+{
+	EVP_PKEY	*pkey;
+
+	if (preload.next >= preload.count || preload.doms[preload.next] != dom)
+		return (NULL);
+
+	pkey = preload.pkeys[preload.next];
+	preload.pkeys[preload.next++] = NULL;
+
+	return (pkey);
+}
+#endif
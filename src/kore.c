@@ -22,6 +22,7 @@
 #include <sys/resource.h>
 
 #include <libgen.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <netdb.h>
@@ -49,6 +50,10 @@
 #include "acme.h"
 #endif
 
+#if defined(KORE_USE_HTTP2)
+#include "http2.h"
+#endif
+
 volatile sig_atomic_t	sig_recv;
 struct kore_server_list	kore_servers;
 u_int8_t		nlisteners;
@@ -66,6 +71,7 @@ char			*kore_progname = NULL;
 char			*kore_root_path = NULL;
 char			*kore_runas_user = NULL;
 u_int32_t		kore_socket_backlog = 5000;
+int			kore_socket_reuseport = 0;
 char			*kore_pidfile = KORE_PIDFILE_DEFAULT;
 char			*kore_tls_cipher_list = KORE_DEFAULT_CIPHER_LIST;
 
@@ -73,6 +79,11 @@ extern char		**environ;
 extern char		*__progname;
 static size_t		proctitle_maxlen = 0;
 
+/* Startup phases of the parent, logged before the workers are forked. */
+static char		startup_phases[256];
+static size_t		startup_off = 0;
+static u_int64_t	startup_mark = 0;
+
 static void	usage(void);
 static void	version(void);
 
@@ -81,6 +92,8 @@ static void	kore_proctitle_setup(void);
 static void	kore_server_sslstart(void);
 static void	kore_server_start(int, char *[]);
 static void	kore_call_parent_configure(int, char **);
+static int	kore_listener_reuseport_socket(struct listener *);
+static void	kore_startup_phase(const char *);
 
 #if !defined(KORE_SINGLE_BINARY) && defined(KORE_USE_PYTHON)
 static const char	*parent_config_hook = KORE_PYTHON_CONFIG_HOOK;
@@ -161,11 +174,14 @@ main(int argc, char *argv[])
 
 	kore_argc = argc;
 	kore_argv = argv;
+	kore_upgrade_save(argc, argv);
 
 #if !defined(KORE_SINGLE_BINARY)
 	kore_default_getopt(argc, argv);
 #endif
 
+	startup_mark = kore_time_ms();
+
 	kore_mem_init();
 	kore_progname = kore_strdup(argv[0]);
 	kore_proctitle_setup();
@@ -206,6 +222,7 @@ main(int argc, char *argv[])
 	kore_platform_init();
 	kore_log_init();
 	kore_msg_init();
+	kore_upgrade_inherit();
 #if !defined(KORE_NO_HTTP)
 	http_parent_init();
 #if defined(KORE_USE_CURL)
@@ -224,12 +241,14 @@ main(int argc, char *argv[])
 	kore_domain_init();
 	kore_module_init();
 	kore_server_sslstart();
+	kore_startup_phase("init");
 
 #if !defined(KORE_SINGLE_BINARY) && !defined(KORE_USE_PYTHON)
 	if (config_file == NULL)
 		usage();
 #endif
 	kore_module_load(NULL, NULL, KORE_MODULE_NATIVE);
+	kore_startup_phase("modules");
 
 #if defined(KORE_USE_PYTHON)
 	kore_python_init();
@@ -244,6 +263,7 @@ main(int argc, char *argv[])
 		parent_teardown_hook = KORE_TEARDOWN_HOOK;
 	}
 #endif
+	kore_startup_phase("python");
 #endif
 
 #if defined(KORE_SINGLE_BINARY)
@@ -256,6 +276,7 @@ main(int argc, char *argv[])
 #endif
 
 	kore_parse_config();
+	kore_startup_phase("config");
 
 #if !defined(KORE_SINGLE_BINARY)
 	free(config_file);
@@ -285,8 +306,13 @@ main(int argc, char *argv[])
 		kore_free(rcall);
 	}
 
-	if (unlink(kore_pidfile) == -1 && errno != ENOENT)
-		kore_log(LOG_NOTICE, "failed to remove pidfile (%s)", errno_s);
+	/* After an upgrade the pidfile belongs to the new master. */
+	if (!kore_upgrade_draining()) {
+		if (unlink(kore_pidfile) == -1 && errno != ENOENT) {
+			kore_log(LOG_NOTICE,
+			    "failed to remove pidfile (%s)", errno_s);
+		}
+	}
 
 	kore_server_cleanup();
 
@@ -367,7 +393,7 @@ kore_tls_sni_cb(SSL *ssl, int *ad, void *arg)
 
 	if (sname != NULL &&
 	    (dom = kore_domain_lookup(c->owner->server, sname)) != NULL) {
-		if (dom->ssl_ctx == NULL) {
+		if (!kore_domain_tls_ready(dom)) {
 			kore_log(LOG_NOTICE,
 			    "TLS configuration for %s not complete",
 			    dom->domain);
@@ -391,6 +417,37 @@ kore_tls_sni_cb(SSL *ssl, int *ad, void *arg)
 	return (SSL_TLSEXT_ERR_NOACK);
 }
 
+#if defined(KORE_USE_HTTP2) || defined(KORE_USE_ACME)
+int
+kore_tls_alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+    const unsigned char *in, unsigned int inlen, void *udata)
+{
+#if defined(KORE_USE_HTTP2)
+	unsigned char		*sel;
+#endif
+
+#if defined(KORE_USE_ACME)
+	if (kore_acme_tls_alpn(ssl, out, outlen,
+	    in, inlen, udata) == SSL_TLSEXT_ERR_OK)
+		return (SSL_TLSEXT_ERR_OK);
+#endif
+
+#if defined(KORE_USE_HTTP2)
+	if (http2_enable == 0)
+		return (SSL_TLSEXT_ERR_NOACK);
+
+	if (SSL_select_next_proto(&sel, outlen,
+	    (const unsigned char *)HTTP2_ALPN, sizeof(HTTP2_ALPN) - 1,
+	    in, inlen) == OPENSSL_NPN_NEGOTIATED) {
+		*out = sel;
+		return (SSL_TLSEXT_ERR_OK);
+	}
+#endif
+
+	return (SSL_TLSEXT_ERR_NOACK);
+}
+#endif
+
 void
 kore_tls_info_callback(const SSL *ssl, int flags, int ret)
 {
@@ -436,6 +493,17 @@ kore_server_bind(struct kore_server *srv, const char *ip, const char *port,
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (results->ai_addrlen > sizeof(l->addr))
+		fatal("kore_server_bind(): address too large");
+
+	l->addrlen = results->ai_addrlen;
+	memcpy(&l->addr, results->ai_addr, results->ai_addrlen);
+
+	if (kore_upgrade_listener(l)) {
+		freeaddrinfo(results);
+		return (KORE_RESULT_OK);
+	}
+
 	if (bind(l->fd, results->ai_addr, results->ai_addrlen) == -1) {
 		kore_listener_free(l);
 		freeaddrinfo(results);
@@ -486,6 +554,12 @@ kore_server_bind_unix(struct kore_server *srv, const char *path,
 	if (!kore_listener_init(l, AF_UNIX, ccb))
 		return (KORE_RESULT_ERROR);
 
+	l->addrlen = socklen;
+	memcpy(&l->addr, &sun, socklen);
+
+	if (kore_upgrade_listener(l))
+		return (KORE_RESULT_OK);
+
 	if (bind(l->fd, (struct sockaddr *)&sun, socklen) == -1) {
 		kore_log(LOG_ERR, "bind: %s", errno_s);
 		kore_listener_free(l);
@@ -509,6 +583,9 @@ kore_server_create(const char *name)
 	srv = kore_calloc(1, sizeof(struct kore_server));
 	srv->name = kore_strdup(name);
 	srv->tls = 1;
+	srv->tls_rec_small = KORE_TLS_RECORD_SMALL;
+	srv->tls_rec_boost = KORE_TLS_RECORD_BOOST;
+	srv->tls_rec_idle = KORE_TLS_RECORD_IDLE;
 
 	TAILQ_INIT(&srv->domains);
 	LIST_INIT(&srv->listeners);
@@ -639,6 +716,7 @@ kore_server_free(struct kore_server *srv)
 	while ((l = LIST_FIRST(&srv->listeners)) != NULL)
 		kore_listener_free(l);
 
+	kore_domain_index_free(srv);
 	kore_free(srv->name);
 	kore_free(srv);
 }
@@ -646,11 +724,20 @@ kore_server_free(struct kore_server *srv)
 void
 kore_listener_free(struct listener *l)
 {
+	u_int16_t	idx;
+
 	LIST_REMOVE(l, list);
 
 	if (l->fd != -1)
 		close(l->fd);
 
+	for (idx = 0; idx < l->nrfds; idx++) {
+		if (l->rfds[idx] != -1)
+			close(l->rfds[idx]);
+	}
+
+	kore_free(l->rfds);
+
 	kore_free(l->host);
 	kore_free(l->port);
 
@@ -660,6 +747,7 @@ kore_listener_free(struct listener *l)
 void
 kore_listener_accept(void *arg, int error)
 {
+	int			cpu;
 	struct connection	*c;
 	struct listener		*l = arg;
 	u_int32_t		accepted;
@@ -687,6 +775,184 @@ kore_listener_accept(void *arg, int error)
 
 		accepted++;
 		kore_platform_event_all(c->fd, c);
+
+		/* Count connections that were steered to the wrong cpu. */
+		if (l->steer) {
+			cpu = kore_platform_incoming_cpu(c->fd);
+			if (cpu != -1 && cpu != worker->cpu)
+				worker->accept.remote++;
+		}
+	}
+
+	worker->accept.accepted += accepted;
+}
+
+/*
+ * Called by the parent once per second with the combined accept rate
+ * of all workers, to warn when the kernel accept queue is full.
+ */
+void
+kore_listener_backlog_check(u_int32_t rate)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+	int			fd, full;
+	u_int16_t		idx, nfds;
+	u_int32_t		len, max, qlen, qmax;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->family == AF_UNIX)
+				continue;
+
+			full = 0;
+			qlen = 0;
+			qmax = 0;
+			nfds = (l->rfds != NULL) ? l->nrfds : 1;
+
+			for (idx = 0; idx < nfds; idx++) {
+				fd = (l->rfds != NULL) ? l->rfds[idx] : l->fd;
+				if (!kore_platform_listen_backlog(fd,
+				    &len, &max)) {
+					qmax = 0;
+					break;
+				}
+
+				/* One full reuseport socket is enough. */
+				if (max != 0 && len >= max)
+					full = 1;
+
+				qlen += len;
+				qmax += max;
+			}
+
+			if (qmax == 0 || full == 0)
+				continue;
+
+			l->backlog_full++;
+			kore_log(LOG_NOTICE,
+			    "%s:%s accept queue full (%u/%u), %u accepts/sec",
+			    l->host, l->port, qlen, qmax, rate);
+		}
+	}
+}
+
+/*
+ * Replace the shared listening socket of every TCP listener with one
+ * SO_REUSEPORT socket per worker so the kernel spreads new connections
+ * over the workers instead of them fighting over the accept lock.
+ *
+ * The parent keeps all sockets open, a restarted worker picks up the
+ * same socket (and the connections still queued on it) again.
+ *
+ * If cpus is given it maps each worker to the cpu it is pinned to and
+ * is used to steer connections to the worker on the receiving cpu.
+ *
+ * After a graceful upgrade to fewer workers the extra inherited sockets
+ * are kept, connections are still queued on them and the kernel keeps
+ * handing them new ones. Each is served by worker idx % count.
+ */
+void
+kore_listener_reuseport_init(const u_int16_t *cpus, u_int16_t count)
+{
+	int			fd;
+	u_int16_t		idx;
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->family == AF_UNIX)
+				continue;
+
+			close(l->fd);
+			l->fd = -1;
+
+			l->nrfds = count;
+			l->rfds = kore_calloc(count, sizeof(int));
+
+			for (idx = 0; idx < count; idx++) {
+				l->rfds[idx] = kore_upgrade_reuseport(l, idx);
+				if (l->rfds[idx] == -1) {
+					l->rfds[idx] =
+					    kore_listener_reuseport_socket(l);
+				}
+
+				if (l->rfds[idx] == -1) {
+					fatal("cannot create reuseport socket "
+					    "for %s:%s", l->host, l->port);
+				}
+			}
+
+			while (l->nrfds < USHRT_MAX &&
+			    (fd = kore_upgrade_reuseport(l, l->nrfds)) != -1) {
+				l->rfds = kore_realloc(l->rfds,
+				    (l->nrfds + 1) * sizeof(int));
+				l->rfds[l->nrfds++] = fd;
+			}
+
+			if (cpus == NULL)
+				continue;
+
+			/* Kernel side fallback if cbpf is missing. */
+			for (idx = 0; idx < l->nrfds; idx++) {
+				kore_platform_incoming_cpu_set(l->rfds[idx],
+				    cpus[idx % count]);
+			}
+
+			l->steer = 1;
+
+			if (!kore_platform_reuseport_cbpf(l->rfds[0],
+			    cpus, count)) {
+				kore_log(LOG_NOTICE,
+				    "no cbpf cpu steering for %s:%s",
+				    l->host, l->port);
+			}
+		}
+	}
+}
+
+/*
+ * Called in the worker after fork, keeps only its own reuseport sockets.
+ * Sockets beyond the worker count get a listener of their own.
+ */
+void
+kore_listener_reuseport_select(u_int16_t worker_idx, u_int16_t count)
+{
+	u_int16_t		idx;
+	struct kore_server	*srv;
+	struct listener		*l, *extra;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->rfds == NULL)
+				continue;
+
+			if (worker_idx >= l->nrfds)
+				fatal("no reuseport socket for %u", worker_idx);
+
+			for (idx = 0; idx < l->nrfds; idx++) {
+				if (idx == worker_idx) {
+					l->fd = l->rfds[idx];
+				} else if (idx >= count &&
+				    idx % count == worker_idx) {
+					extra = kore_listener_create(srv);
+					extra->fd = l->rfds[idx];
+					extra->family = l->family;
+					extra->host = kore_strdup(l->host);
+					extra->port = kore_strdup(l->port);
+					extra->connect = l->connect;
+					extra->steer = l->steer;
+					extra->addrlen = l->addrlen;
+					memcpy(&extra->addr, &l->addr,
+					    sizeof(l->addr));
+				} else {
+					close(l->rfds[idx]);
+				}
+
+				l->rfds[idx] = -1;
+			}
+		}
 	}
 }
 
@@ -704,6 +970,53 @@ kore_sockopt(int fd, int what, int opt)
 	return (KORE_RESULT_OK);
 }
 
+static int
+kore_listener_reuseport_socket(struct listener *l)
+{
+	int		fd, opt;
+
+#if defined(SO_REUSEPORT_LB)
+	opt = SO_REUSEPORT_LB;
+#else
+	opt = SO_REUSEPORT;
+#endif
+
+	if ((fd = socket(l->family, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "socket(): %s", errno_s);
+		return (-1);
+	}
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		kore_log(LOG_ERR, "fcntl(): %s", errno_s);
+		goto cleanup;
+	}
+
+	if (!kore_connection_nonblock(fd, 1)) {
+		kore_log(LOG_ERR, "kore_connection_nonblock(): %s", errno_s);
+		goto cleanup;
+	}
+
+	if (!kore_sockopt(fd, SOL_SOCKET, SO_REUSEADDR) ||
+	    !kore_sockopt(fd, SOL_SOCKET, opt))
+		goto cleanup;
+
+	if (bind(fd, (struct sockaddr *)&l->addr, l->addrlen) == -1) {
+		kore_log(LOG_ERR, "bind(): %s", errno_s);
+		goto cleanup;
+	}
+
+	if (listen(fd, kore_socket_backlog) == -1) {
+		kore_log(LOG_ERR, "listen(): %s", errno_s);
+		goto cleanup;
+	}
+
+	return (fd);
+
+cleanup:
+	close(fd);
+	return (-1);
+}
+
 void
 kore_signal_setup(void)
 {
@@ -724,6 +1037,8 @@ kore_signal_setup(void)
 		fatal("sigaction: %s", errno_s);
 	if (sigaction(SIGUSR1, &sa, NULL) == -1)
 		fatal("sigaction: %s", errno_s);
+	if (sigaction(SIGUSR2, &sa, NULL) == -1)
+		fatal("sigaction: %s", errno_s);
 	if (sigaction(SIGCHLD, &sa, NULL) == -1)
 		fatal("sigaction: %s", errno_s);
 
@@ -749,6 +1064,26 @@ kore_server_closeall(void)
 	}
 }
 
+/*
+ * Used by draining workers, unlike kore_server_closeall() this really
+ * closes the sockets. They live on in the new generation of workers.
+ */
+void
+kore_listener_closeall(void)
+{
+	struct listener		*l;
+	struct kore_server	*srv;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->fd != -1) {
+				close(l->fd);
+				l->fd = -1;
+			}
+		}
+	}
+}
+
 void
 kore_server_cleanup(void)
 {
@@ -879,6 +1214,17 @@ kore_server_start(int argc, char *argv[])
 	}
 
 	kore_platform_proctitle("[parent]");
+#if !defined(KORE_NO_HTTP)
+	http_cache_init();
+#endif
+#if defined(KORE_USE_PYTHON)
+	kore_python_fork_prepare();
+#endif
+	kore_startup_phase("prepare");
+
+	if (!kore_quiet)
+		kore_log(LOG_NOTICE, "startup: %s", startup_phases);
+
 	kore_worker_init();
 
 	/* Set worker_max_connections for kore_connection_init(). */
@@ -889,17 +1235,22 @@ kore_server_start(int argc, char *argv[])
 	kore_connection_init();
 	kore_platform_event_init();
 	kore_msg_parent_init();
+	kore_msg_register(KORE_MSG_MEM_STATS, kore_worker_mem_stats);
 
 	quit = 0;
 	worker_max_connections = tmp;
 
 	kore_timer_init();
+	kore_timer_add(kore_worker_accept_stats, 1000, NULL, 0);
+	kore_timer_add(kore_log_gather, 10, NULL, 0);
 #if !defined(KORE_NO_HTTP)
-	kore_timer_add(kore_accesslog_run, 100, NULL, 0);
+	kore_timer_add(kore_accesslog_run, 10, NULL, 0);
 #endif
 
 #if defined(KORE_USE_PYTHON)
 	kore_msg_unregister(KORE_PYTHON_SEND_OBJ);
+	kore_msg_unregister(KORE_PYTHON_SEND_RAW);
+	kore_msg_unregister(KORE_PYTHON_SEND_MARSHAL);
 #endif
 
 	while (quit != 1) {
@@ -908,6 +1259,10 @@ kore_server_start(int argc, char *argv[])
 
 			switch (sig_recv) {
 			case SIGHUP:
+				if (kore_graceful_upgrade) {
+					kore_upgrade_start();
+					break;
+				}
 				kore_worker_dispatch_signal(sig_recv);
 				kore_module_reload(0);
 				break;
@@ -920,6 +1275,10 @@ kore_server_start(int argc, char *argv[])
 			case SIGUSR1:
 				kore_worker_dispatch_signal(sig_recv);
 				break;
+			case SIGUSR2:
+				kore_worker_load_stats();
+				kore_worker_dispatch_signal(sig_recv);
+				break;
 			case SIGCHLD:
 				kore_worker_reap();
 				break;
@@ -974,3 +1333,22 @@ kore_call_parent_configure(int argc, char **argv)
 		kore_free(rcall);
 	}
 }
+
+static void
+kore_startup_phase(const char *name)
+{
+	int		len;
+	u_int64_t	now;
+
+	if (startup_off >= sizeof(startup_phases))
+		return;
+
+	now = kore_time_ms();
+	len = snprintf(startup_phases + startup_off,
+	    sizeof(startup_phases) - startup_off, "%s%s %" PRIu64 "ms",
+	    startup_off ? ", " : "", name, now - startup_mark);
+	if (len > 0)
+		startup_off += len;
+
+	startup_mark = now;
+}
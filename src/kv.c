@@ -0,0 +1,433 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A key/value store in memory shared by all workers.
+ *
+ * The parent maps a fixed size table before the workers are forked.
+ * The table is split into stripes, each with its own spinlock and a run
+ * of slots that keys hashing to the stripe are linearly probed in, so
+ * a lookup never crosses into another stripe. Every slot has room for
+ * a key of up to KORE_KV_KEY_MAX - 1 bytes and a value of up to
+ * kv_value_max bytes.
+ *
+ * Entries may carry a ttl, expired entries are dropped when a lookup
+ * runs into them.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <time.h>
+
+#include "kore.h"
+
+#define KV_STRIPES		64
+#define KV_SPIN			1024
+
+#define KV_SLOT_EMPTY		0
+#define KV_SLOT_USED		1
+#define KV_SLOT_DELETED		2
+
+#if !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS		MAP_ANON
+#endif
+
+struct kv_stripe {
+	volatile u_int16_t	lock;
+	u_int32_t		used;
+} __attribute__((aligned(64)));
+
+struct kv_slot {
+	u_int8_t		state;
+	u_int8_t		klen;
+	u_int32_t		vlen;
+	u_int32_t		hash;
+	u_int64_t		expires;
+	char			key[KORE_KV_KEY_MAX];
+	u_int8_t		value[];
+};
+
+static struct kv_slot	*kv_lookup(const char *, struct kv_stripe **,
+			    struct kv_slot **, u_int32_t *);
+static struct kv_slot	*kv_slot(u_int32_t, u_int32_t);
+static void		kv_store(struct kv_stripe *, struct kv_slot *,
+			    const char *, u_int32_t, const void *, size_t,
+			    u_int64_t);
+static void		kv_remove(struct kv_stripe *, struct kv_slot *);
+static void		kv_lock(struct kv_stripe *);
+static void		kv_unlock(struct kv_stripe *);
+
+u_int32_t			kore_kv_entries = 0;
+u_int32_t			kore_kv_value_max = 256;
+
+static size_t			kv_slot_size = 0;
+static u_int32_t		kv_nstripes = 0;
+static u_int32_t		kv_per_stripe = 0;
+static struct kv_stripe		*kv_stripes = NULL;
+static u_int8_t			*kv_slots = NULL;
+
+void
+kore_kv_init(void)
+{
+	size_t		len;
+	u_int8_t	*base;
+
+	if (kore_kv_entries == 0)
+		return;
+
+	kv_nstripes = MIN(KV_STRIPES, kore_kv_entries);
+	kv_per_stripe = (kore_kv_entries + kv_nstripes - 1) / kv_nstripes;
+
+	kv_slot_size = sizeof(struct kv_slot) + kore_kv_value_max;
+	kv_slot_size = (kv_slot_size + 7) & ~(size_t)7;
+
+	len = (sizeof(struct kv_stripe) * kv_nstripes) +
+	    (kv_slot_size * kv_per_stripe * kv_nstripes);
+
+	base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		fatal("kore_kv_init(): mmap: %s", errno_s);
+
+	/* Anonymous mappings start out zeroed, all slots are empty. */
+	kv_stripes = (struct kv_stripe *)base;
+	kv_slots = base + (sizeof(struct kv_stripe) * kv_nstripes);
+}
+
+/*
+ * A worker went away, break any stripe lock it died holding.
+ */
+void
+kore_kv_reap(struct kore_worker *kw)
+{
+	u_int32_t	i;
+
+	if (kv_stripes == NULL)
+		return;
+
+	for (i = 0; i < kv_nstripes; i++)
+		(void)__sync_bool_compare_and_swap(&kv_stripes[i].lock,
+		    kw->id, 0);
+}
+
+/*
+ * Copies the value for key into data. On input *len is the size of data,
+ * on return it holds the length of the value which may be larger, in
+ * which case only the first part was copied.
+ */
+int
+kore_kv_get(const char *key, void *data, size_t *len)
+{
+	struct kv_slot		*slot;
+	struct kv_stripe	*stripe;
+
+	if ((slot = kv_lookup(key, &stripe, NULL, NULL)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (*len > 0)
+		memcpy(data, slot->value, MIN(*len, slot->vlen));
+	*len = slot->vlen;
+
+	kv_unlock(stripe);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Store a value under key, replacing any existing one. A ttl of 0
+ * means the entry does not expire, otherwise it is in milliseconds.
+ */
+int
+kore_kv_put(const char *key, const void *data, size_t len, u_int64_t ttl)
+{
+	u_int32_t		hash;
+	struct kv_stripe	*stripe;
+	struct kv_slot		*slot, *avail;
+
+	if (len > kore_kv_value_max)
+		return (KORE_RESULT_ERROR);
+
+	if ((slot = kv_lookup(key, &stripe, &avail, &hash)) == NULL) {
+		if (stripe == NULL)
+			return (KORE_RESULT_ERROR);
+		if ((slot = avail) == NULL) {
+			kv_unlock(stripe);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	kv_store(stripe, slot, key, hash, data, len, ttl);
+	kv_unlock(stripe);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Replace the value under key with data only if it currently matches
+ * old. An old of NULL only succeeds if there is no entry for key yet.
+ */
+int
+kore_kv_cas(const char *key, const void *old, size_t oldlen,
+    const void *data, size_t len, u_int64_t ttl)
+{
+	u_int32_t		hash;
+	struct kv_stripe	*stripe;
+	struct kv_slot		*slot, *avail;
+
+	if (len > kore_kv_value_max)
+		return (KORE_RESULT_ERROR);
+
+	slot = kv_lookup(key, &stripe, &avail, &hash);
+	if (stripe == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (slot == NULL) {
+		if (old != NULL || avail == NULL) {
+			kv_unlock(stripe);
+			return (KORE_RESULT_ERROR);
+		}
+		slot = avail;
+	} else {
+		if (old == NULL || oldlen != slot->vlen ||
+		    memcmp(slot->value, old, oldlen)) {
+			kv_unlock(stripe);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	kv_store(stripe, slot, key, hash, data, len, ttl);
+	kv_unlock(stripe);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Add delta to the counter under key and return the result. A counter
+ * that does not exist yet starts at 0 and gets the given ttl, updates
+ * leave its expiry alone so it can be used for fixed rate windows.
+ */
+int
+kore_kv_incr(const char *key, int64_t delta, int64_t *result, u_int64_t ttl)
+{
+	int64_t			val;
+	u_int32_t		hash;
+	struct kv_stripe	*stripe;
+	struct kv_slot		*slot, *avail;
+
+	if (kore_kv_value_max < sizeof(val))
+		return (KORE_RESULT_ERROR);
+
+	slot = kv_lookup(key, &stripe, &avail, &hash);
+	if (stripe == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (slot == NULL) {
+		if (avail == NULL) {
+			kv_unlock(stripe);
+			return (KORE_RESULT_ERROR);
+		}
+		val = delta;
+		kv_store(stripe, avail, key, hash, &val, sizeof(val), ttl);
+	} else {
+		if (slot->vlen != sizeof(val)) {
+			kv_unlock(stripe);
+			return (KORE_RESULT_ERROR);
+		}
+		memcpy(&val, slot->value, sizeof(val));
+		val += delta;
+		memcpy(slot->value, &val, sizeof(val));
+	}
+
+	kv_unlock(stripe);
+
+	if (result != NULL)
+		*result = val;
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_kv_del(const char *key)
+{
+	struct kv_slot		*slot;
+	struct kv_stripe	*stripe;
+
+	if ((slot = kv_lookup(key, &stripe, NULL, NULL)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	kv_remove(stripe, slot);
+	kv_unlock(stripe);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Finds the slot for key and returns it with its stripe locked. If the
+ * key isn't there NULL is returned. If freep was given the stripe stays
+ * locked (unless *out is NULL, a bad key or no table) and *freep points
+ * to a slot the key can be stored in, if any.
+ */
+static struct kv_slot *
+kv_lookup(const char *key, struct kv_stripe **out, struct kv_slot **freep,
+    u_int32_t *hashp)
+{
+	size_t			klen;
+	u_int64_t		now;
+	struct kv_stripe	*stripe;
+	struct kv_slot		*slot, *avail;
+	u_int32_t		hash, idx, start, n;
+
+	*out = NULL;
+	if (freep != NULL)
+		*freep = NULL;
+
+	if (kv_stripes == NULL || worker == NULL)
+		return (NULL);
+
+	klen = strlen(key);
+	if (klen == 0 || klen >= KORE_KV_KEY_MAX)
+		return (NULL);
+
+	hash = 2166136261U;
+	for (n = 0; n < klen; n++) {
+		hash ^= (u_int8_t)key[n];
+		hash *= 16777619U;
+	}
+
+	if (hashp != NULL)
+		*hashp = hash;
+
+	idx = hash % kv_nstripes;
+	start = (hash / kv_nstripes) % kv_per_stripe;
+
+	stripe = &kv_stripes[idx];
+	kv_lock(stripe);
+	*out = stripe;
+
+	now = 0;
+	avail = NULL;
+
+	for (n = 0; n < kv_per_stripe; n++) {
+		slot = kv_slot(idx, (start + n) % kv_per_stripe);
+
+		if (slot->state == KV_SLOT_EMPTY) {
+			if (avail == NULL)
+				avail = slot;
+			break;
+		}
+
+		if (slot->state == KV_SLOT_USED && slot->expires != 0) {
+			if (now == 0)
+				now = kore_time_ms();
+			if (now >= slot->expires)
+				kv_remove(stripe, slot);
+		}
+
+		if (slot->state != KV_SLOT_USED) {
+			if (avail == NULL)
+				avail = slot;
+			continue;
+		}
+
+		if (slot->hash == hash && slot->klen == klen &&
+		    !memcmp(slot->key, key, klen))
+			return (slot);
+	}
+
+	if (freep != NULL) {
+		*freep = avail;
+	} else {
+		kv_unlock(stripe);
+		*out = NULL;
+	}
+
+	return (NULL);
+}
+
+static struct kv_slot *
+kv_slot(u_int32_t stripe, u_int32_t idx)
+{
+	return ((struct kv_slot *)(kv_slots +
+	    ((((size_t)stripe * kv_per_stripe) + idx) * kv_slot_size)));
+}
+
+static void
+kv_store(struct kv_stripe *stripe, struct kv_slot *slot, const char *key,
+    u_int32_t hash, const void *data, size_t len, u_int64_t ttl)
+{
+	if (slot->state != KV_SLOT_USED) {
+		stripe->used++;
+		slot->klen = strlen(key);
+		slot->hash = hash;
+		memcpy(slot->key, key, slot->klen);
+		slot->state = KV_SLOT_USED;
+	}
+
+	slot->vlen = len;
+	slot->expires = (ttl != 0) ? kore_time_ms() + ttl : 0;
+	memcpy(slot->value, data, len);
+}
+
+/*
+ * Marks the slot deleted. If nothing was ever probed past it, it and
+ * any deleted slots before it can go back to being empty so lookups
+ * stop early again.
+ */
+static void
+kv_remove(struct kv_stripe *stripe, struct kv_slot *slot)
+{
+	u_int32_t	sidx, idx;
+	size_t		off;
+
+	stripe->used--;
+	slot->state = KV_SLOT_DELETED;
+
+	sidx = stripe - kv_stripes;
+	off = ((u_int8_t *)slot - kv_slots) / kv_slot_size;
+	idx = off - ((size_t)sidx * kv_per_stripe);
+
+	if (kv_slot(sidx, (idx + 1) % kv_per_stripe)->state != KV_SLOT_EMPTY)
+		return;
+
+	while (slot->state == KV_SLOT_DELETED) {
+		slot->state = KV_SLOT_EMPTY;
+		idx = (idx == 0) ? kv_per_stripe - 1 : idx - 1;
+		slot = kv_slot(sidx, idx);
+	}
+}
+
+static void
+kv_lock(struct kv_stripe *stripe)
+{
+	u_int32_t		spin;
+	struct timespec		ts;
+
+	spin = 0;
+	while (!__sync_bool_compare_and_swap(&stripe->lock, 0, worker->id)) {
+		if (++spin % KV_SPIN == 0) {
+			ts.tv_sec = 0;
+			ts.tv_nsec = 1000;
+			(void)nanosleep(&ts, NULL);
+		}
+	}
+}
+
+static void
+kv_unlock(struct kv_stripe *stripe)
+{
+	(void)__sync_bool_compare_and_swap(&stripe->lock, worker->id, 0);
+}
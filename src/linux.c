@@ -18,6 +18,12 @@
 #include <sys/epoll.h>
 #include <sys/sendfile.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <linux/filter.h>
 
 #include <sched.h>
 
@@ -36,6 +42,11 @@ static int			efd = -1;
 static u_int32_t		event_count = 0;
 static struct epoll_event	*events = NULL;
 
+#if defined(KORE_USE_IOURING)
+int				kore_io_uring = 1;
+int				kore_uring_active = 0;
+#endif
+
 void
 kore_platform_init(void)
 {
@@ -66,9 +77,129 @@ kore_platform_worker_setcpu(struct kore_worker *kw)
 	}
 }
 
+/*
+ * Attach a classic BPF program to the reuseport group that fd belongs to
+ * returning the index of the worker pinned to the cpu the connection came
+ * in on. For cpus without a worker it returns an out of range index which
+ * makes the kernel fall back to its normal hash based selection.
+ */
+int
+kore_platform_reuseport_cbpf(int fd, const u_int16_t *cpus, u_int16_t count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+	u_int16_t		idx, len;
+	struct sock_fprog	prog;
+	struct sock_filter	*code;
+
+	len = (count * 2) + 2;
+	code = kore_calloc(len, sizeof(*code));
+
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+	    SKF_AD_OFF + SKF_AD_CPU);
+
+	for (idx = 0; idx < count; idx++) {
+		code[1 + (idx * 2)] = (struct sock_filter)BPF_JUMP(
+		    BPF_JMP | BPF_JEQ | BPF_K, cpus[idx], 0, 1);
+		code[2 + (idx * 2)] = (struct sock_filter)BPF_STMT(
+		    BPF_RET | BPF_K, idx);
+	}
+
+	code[len - 1] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K,
+	    0xffffffff);
+
+	prog.len = len;
+	prog.filter = code;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog)) == -1) {
+		kore_log(LOG_ERR, "SO_ATTACH_REUSEPORT_CBPF: %s", errno_s);
+		kore_free(code);
+		return (KORE_RESULT_ERROR);
+	}
+
+	kore_free(code);
+
+	return (KORE_RESULT_OK);
+#else
+	return (KORE_RESULT_ERROR);
+#endif
+}
+
+/*
+ * Return the current length and maximum of the accept queue for the
+ * listening socket fd, Linux reports these via TCP_INFO.
+ */
+int
+kore_platform_listen_backlog(int fd, u_int32_t *len, u_int32_t *max)
+{
+	struct tcp_info		info;
+	socklen_t		optlen;
+
+	optlen = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &optlen) == -1)
+		return (KORE_RESULT_ERROR);
+
+	if (info.tcpi_state != TCP_LISTEN)
+		return (KORE_RESULT_ERROR);
+
+	*len = info.tcpi_unacked;
+	*max = info.tcpi_sacked;
+
+	return (KORE_RESULT_OK);
+}
+
+/* Return the cpu that handled the last packets received on fd. */
+int
+kore_platform_incoming_cpu(int fd)
+{
+#if defined(SO_INCOMING_CPU)
+	int		cpu;
+	socklen_t	len;
+
+	len = sizeof(cpu);
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == -1)
+		return (-1);
+
+	return (cpu);
+#else
+	return (-1);
+#endif
+}
+
+/*
+ * Hint to the kernel what cpu the given reuseport listener belongs to.
+ * Newer kernels prefer the listener matching the receiving cpu when
+ * selecting a socket from the reuseport group.
+ */
+void
+kore_platform_incoming_cpu_set(int fd, u_int16_t cpu)
+{
+#if defined(SO_INCOMING_CPU)
+	int		val;
+
+	val = cpu;
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU,
+	    &val, sizeof(val)) == -1)
+		kore_debug("setsockopt(SO_INCOMING_CPU): %s", errno_s);
+#endif
+}
+
 void
 kore_platform_event_init(void)
 {
+#if defined(KORE_USE_IOURING)
+	/* Only the http workers run on io_uring, the others use epoll. */
+	if (kore_io_uring && worker != NULL &&
+	    worker->id != KORE_WORKER_KEYMGR && worker->id != KORE_WORKER_ACME) {
+		if (kore_uring_init()) {
+			kore_uring_active = 1;
+			return;
+		}
+
+		kore_log(LOG_NOTICE, "io_uring unavailable, using epoll");
+	}
+#endif
+
 	if (efd != -1)
 		close(efd);
 	if (events != NULL)
@@ -84,6 +215,14 @@ kore_platform_event_init(void)
 void
 kore_platform_event_cleanup(void)
 {
+#if defined(KORE_USE_IOURING)
+	if (kore_uring_active) {
+		kore_uring_cleanup();
+		kore_uring_active = 0;
+		return;
+	}
+#endif
+
 	if (efd != -1) {
 		close(efd);
 		efd = -1;
@@ -102,6 +241,13 @@ kore_platform_event_wait(u_int64_t timer)
 	struct kore_event	*evt;
 	int			n, i, timeo;
 
+#if defined(KORE_USE_IOURING)
+	if (kore_uring_active) {
+		kore_uring_wait(timer);
+		return;
+	}
+#endif
+
 	if (timer == KORE_WAIT_INFINITE)
 		timeo = -1;
 	else
@@ -114,6 +260,8 @@ kore_platform_event_wait(u_int64_t timer)
 		fatal("epoll_wait(): %s", errno_s);
 	}
 
+	kore_loop_woke = kore_time_us();
+
 	if (n > 0) {
 		kore_debug("main(): %d sockets available", n);
 	}
@@ -168,6 +316,14 @@ kore_platform_event_schedule(int fd, int type, int flags, void *udata)
 	kore_debug("kore_platform_event_schedule(%d, %d, %d, %p)",
 	    fd, type, flags, udata);
 
+#if defined(KORE_USE_IOURING)
+	if (kore_uring_active) {
+		kore_uring_schedule(fd, type & ~EPOLLET,
+		    !(type & EPOLLET), udata);
+		return;
+	}
+#endif
+
 	evt.events = type;
 	evt.data.ptr = udata;
 	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &evt) == -1) {
@@ -195,6 +351,13 @@ kore_platform_schedule_write(int fd, void *data)
 void
 kore_platform_disable_read(int fd)
 {
+#if defined(KORE_USE_IOURING)
+	if (kore_uring_active) {
+		kore_uring_remove(fd);
+		return;
+	}
+#endif
+
 	if (epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL) == -1)
 		fatal("kore_platform_disable_read: %s", errno_s);
 }
@@ -223,6 +386,12 @@ kore_platform_disable_accept(void)
 
 	LIST_FOREACH(srv, &kore_servers, list) {
 		LIST_FOREACH(l, &srv->listeners, list) {
+#if defined(KORE_USE_IOURING)
+			if (kore_uring_active) {
+				kore_uring_remove(l->fd);
+				continue;
+			}
+#endif
 			if (epoll_ctl(efd, EPOLL_CTL_DEL, l->fd, NULL) == -1) {
 				fatal("kore_platform_disable_accept: %s",
 				    errno_s);
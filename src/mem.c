@@ -22,7 +22,6 @@
 
 #include "kore.h"
 
-#define KORE_MEM_BLOCKS			11
 #define KORE_MEM_BLOCK_SIZE_MAX		8192
 #define KORE_MEM_BLOCK_PREALLOC		128
 
@@ -59,6 +58,20 @@ static TAILQ_HEAD(, tag)	tags;
 static struct kore_pool		tag_pool;
 static struct memblock		blocks[KORE_MEM_BLOCKS];
 
+/*
+ * Only ever read by kore_mem_stats_get(), so these are not kept exact
+ * when task threads allocate at the same time as the worker.
+ */
+static u_int64_t		mem_allocs[KORE_MEM_BLOCKS];
+static u_int64_t		mem_allocs_seen[KORE_MEM_BLOCKS];
+static u_int64_t		mem_stats_last = 0;
+static u_int64_t		large_allocs = 0;
+static u_int64_t		large_inuse = 0;
+static u_int64_t		large_bytes = 0;
+static u_int64_t		large_hwm = 0;
+static u_int32_t		tag_count = 0;
+static u_int64_t		tag_bytes = 0;
+
 void
 kore_mem_init(void)
 {
@@ -111,10 +124,17 @@ kore_malloc(size_t len)
 	if (len <= KORE_MEM_BLOCK_SIZE_MAX) {
 		idx = memblock_index(len);
 		ptr = kore_pool_get(&blocks[idx].pool);
+		mem_allocs[idx]++;
 	} else {
 		mlen = sizeof(struct memsize) + len + sizeof(struct meminfo);
 		if ((ptr = calloc(1, mlen)) == NULL)
 			fatal("kore_malloc(%zu): %d", len, errno);
+
+		large_allocs++;
+		large_inuse++;
+		large_bytes += len;
+		if (large_bytes > large_hwm)
+			large_hwm = large_bytes;
 	}
 
 	size = (struct memsize *)ptr;
@@ -190,6 +210,8 @@ kore_free(void *ptr)
 		idx = memblock_index(size->len);
 		kore_pool_put(&blocks[idx].pool, addr);
 	} else {
+		large_inuse--;
+		large_bytes -= size->len;
 		free(addr);
 	}
 }
@@ -235,6 +257,9 @@ kore_mem_tag(void *ptr, u_int32_t id)
 	tag->ptr = ptr;
 
 	TAILQ_INSERT_TAIL(&tags, tag, list);
+
+	tag_count++;
+	tag_bytes += memsize(ptr)->len;
 }
 
 void
@@ -244,6 +269,8 @@ kore_mem_untag(void *ptr)
 
 	TAILQ_FOREACH(tag, &tags, list) {
 		if (tag->ptr == ptr) {
+			tag_count--;
+			tag_bytes -= memsize(ptr)->len;
 			TAILQ_REMOVE(&tags, tag, list);
 			kore_pool_put(&tag_pool, tag);
 			break;
@@ -264,6 +291,53 @@ kore_mem_lookup(u_int32_t id)
 	return (NULL);
 }
 
+/*
+ * Fill in the allocator statistics of the calling process. The rate
+ * of each size class is per second since the previous call.
+ */
+void
+kore_mem_stats_get(struct kore_mem_stats *st)
+{
+	int			i;
+	u_int64_t		now, elapsed;
+	struct kore_mem_class	*mc;
+
+	now = kore_time_ms();
+	elapsed = (mem_stats_last != 0 && now > mem_stats_last) ?
+	    now - mem_stats_last : 0;
+	mem_stats_last = now;
+
+	memset(st, 0, sizeof(*st));
+
+	for (i = 0; i < KORE_MEM_BLOCKS; i++) {
+		mc = &st->classes[i];
+		mc->size = 8 << i;
+		mc->elms = blocks[i].pool.elms;
+		mc->inuse = blocks[i].pool.inuse;
+		mc->hwm = blocks[i].pool.hwm;
+		mc->allocs = mem_allocs[i];
+
+		if (elapsed > 0) {
+			mc->rate =
+			    ((mem_allocs[i] - mem_allocs_seen[i]) * 1000) /
+			    elapsed;
+		}
+
+		mem_allocs_seen[i] = mem_allocs[i];
+	}
+
+	st->large_allocs = large_allocs;
+	st->large_inuse = large_inuse;
+	st->large_bytes = large_bytes;
+	st->large_hwm = large_hwm;
+
+	st->tags = tag_count;
+	st->tag_bytes = tag_bytes;
+
+	kore_pool_regions(&st->regions,
+	    &st->regions_hugetlb, &st->regions_thp);
+}
+
 static size_t
 memblock_index(size_t len)
 {
@@ -0,0 +1,625 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "kore.h"
+#include "http.h"
+
+#if defined(KORE_USE_PGSQL)
+#include "pgsql.h"
+#endif
+
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
+#if defined(KORE_USE_CURL)
+#include "curl.h"
+#endif
+
+/*
+ * Every worker counts requests per route in its own part of the shared
+ * memory, without locks as it is the only writer. The metrics route sums
+ * what all workers published and returns it in the Prometheus text format.
+ */
+
+#define METRICS_OTHER		(KORE_METRICS_ROUTES - 1)
+
+#define METRICS_REQUESTS	0
+#define METRICS_RESPONSES	1
+#define METRICS_DURATION	2
+#define METRICS_FAMILIES	3
+
+static struct {
+	const char	*name;
+	const char	*type;
+} families[METRICS_FAMILIES] = {
+	{ "kore_http_requests_total",		"counter" },
+	{ "kore_http_responses_total",		"counter" },
+	{ "kore_http_request_duration_seconds",	"histogram" },
+};
+
+#define WORKER_FIELD(n, t, f)					\
+	{ n, t, offsetof(struct kore_worker, f),		\
+	    sizeof(((struct kore_worker *)0)->f) }
+
+/* Published per worker, read straight out of its kore_worker. */
+static const struct {
+	const char	*name;
+	const char	*type;
+	size_t		offset;
+	size_t		size;
+} worker_fields[] = {
+	WORKER_FIELD("kore_worker_connections", "gauge", load.connections),
+	WORKER_FIELD("kore_worker_requests", "gauge", load.requests),
+	WORKER_FIELD("kore_worker_cpu_percent", "gauge", load.cpu),
+	WORKER_FIELD("kore_worker_lag_milliseconds", "gauge", load.lag),
+	WORKER_FIELD("kore_worker_accepted_total", "counter",
+	    accept.accepted),
+	WORKER_FIELD("kore_worker_accept_errors_total", "counter",
+	    accept.errors),
+	WORKER_FIELD("kore_worker_accept_lock_milliseconds_total", "counter",
+	    accept.lock_ms),
+	WORKER_FIELD("kore_worker_accesslog_dropped_total", "counter",
+	    lb.drops),
+	WORKER_FIELD("kore_worker_log_dropped_total", "counter", log.drops),
+	WORKER_FIELD("kore_worker_loop_iterations_total", "counter",
+	    loop.iterations),
+	WORKER_FIELD("kore_worker_loop_stalls_total", "counter", loop.stalls),
+	WORKER_FIELD("kore_worker_loop_max_milliseconds", "gauge", loop.max),
+	WORKER_FIELD("kore_worker_loop_io_microseconds_total", "counter",
+	    loop.phase[KORE_LOOP_IO]),
+	WORKER_FIELD("kore_worker_loop_timers_microseconds_total", "counter",
+	    loop.phase[KORE_LOOP_TIMERS]),
+#if defined(KORE_USE_CURL)
+	WORKER_FIELD("kore_worker_loop_curl_microseconds_total", "counter",
+	    loop.phase[KORE_LOOP_CURL]),
+#endif
+	WORKER_FIELD("kore_worker_loop_http_microseconds_total", "counter",
+	    loop.phase[KORE_LOOP_HTTP]),
+#if defined(KORE_USE_PYTHON)
+	WORKER_FIELD("kore_worker_loop_python_microseconds_total", "counter",
+	    loop.phase[KORE_LOOP_PYTHON]),
+#endif
+	WORKER_FIELD("kore_worker_loop_connections_microseconds_total",
+	    "counter", loop.phase[KORE_LOOP_CONNECTIONS]),
+#if defined(KORE_USE_PGSQL)
+	WORKER_FIELD("kore_pgsql_queued", "gauge", metrics.pgsql_queued),
+	WORKER_FIELD("kore_pgsql_queue_timeouts_total", "counter",
+	    metrics.pgsql_timeouts),
+#endif
+#if defined(KORE_USE_CURL)
+	WORKER_FIELD("kore_curl_running", "gauge", metrics.curl_running),
+	WORKER_FIELD("kore_curl_transfers_total", "counter",
+	    metrics.curl_transfers),
+	WORKER_FIELD("kore_curl_connections_reused_total", "counter",
+	    metrics.curl_reused),
+	WORKER_FIELD("kore_curl_connects_total", "counter",
+	    metrics.curl_connects),
+	WORKER_FIELD("kore_curl_coalesced_total", "counter",
+	    metrics.curl_coalesced),
+#endif
+	WORKER_FIELD("kore_fileref_memory_bytes", "gauge",
+	    metrics.fileref_bytes),
+	WORKER_FIELD("kore_fileref_memory_hits_total", "counter",
+	    metrics.fileref_hits),
+	WORKER_FIELD("kore_fileref_memory_misses_total", "counter",
+	    metrics.fileref_misses),
+	WORKER_FIELD("kore_fileref_memory_evictions_total", "counter",
+	    metrics.fileref_evictions),
+#if defined(KORE_USE_TASKS)
+	WORKER_FIELD("kore_task_threads", "gauge", metrics.task_threads),
+	WORKER_FIELD("kore_task_threads_idle", "gauge", metrics.task_idle),
+	WORKER_FIELD("kore_task_queued", "gauge", metrics.task_queued),
+#endif
+};
+
+#define METRICS_WORKER_FIELDS	\
+	(sizeof(worker_fields) / sizeof(worker_fields[0]))
+
+int		metrics_serve(struct http_request *);
+
+static int	metrics_bucket(u_int64_t);
+static u_int64_t metrics_bucket_bound(int);
+static void	metrics_sum(struct kore_metrics_route *, u_int16_t);
+static void	metrics_route(struct kore_buf *, int, const char *,
+		    const char *, struct kore_metrics_route *);
+static void	metrics_workers(struct kore_buf *);
+static void	metrics_phases(struct kore_buf *);
+static void	metrics_prio(struct kore_buf *);
+#if defined(KORE_USE_PGSQL)
+static void	metrics_pgsql(struct kore_buf *);
+#endif
+static void	metrics_hist_merge(struct kore_metrics_hist *,
+		    const struct kore_metrics_hist *);
+static void	metrics_histogram(struct kore_buf *, const char *,
+		    const char *, const u_int64_t *, u_int64_t, u_int64_t);
+
+/*
+ * Hand out route slots in configuration order, every worker walks the
+ * same handlers so they all end up with the same slots.
+ */
+void
+kore_metrics_init(void)
+{
+	u_int16_t			slot;
+	struct kore_server		*srv;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+
+	slot = 0;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			TAILQ_FOREACH(hdlr, &dom->handlers, list) {
+				hdlr->metrics = MIN(slot, METRICS_OTHER);
+				slot++;
+			}
+		}
+	}
+}
+
+void
+kore_metrics_publish(void)
+{
+	int				prio;
+	struct kore_metrics		*m;
+	const struct http_prio_stats	*st;
+
+	m = &worker->metrics;
+
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		st = http_prio_stats_get(prio);
+		m->prio[prio].queued = st->queued;
+		m->prio[prio].started = st->started;
+		m->prio[prio].shed = st->shed;
+		m->prio[prio].wait_total = st->wait_total;
+		m->prio[prio].wait_max = st->wait_max;
+	}
+
+#if defined(KORE_USE_PGSQL)
+	m->pgsql_queued = pgsql_queue_count;
+	m->pgsql_timeouts = pgsql_queue_timeouts;
+#endif
+#if defined(KORE_USE_CURL)
+	m->curl_running = kore_curl_running();
+	m->curl_transfers = kore_curl_transfers;
+	m->curl_reused = kore_curl_reused;
+	m->curl_connects = kore_curl_connects;
+	m->curl_coalesced = kore_curl_coalesced;
+#endif
+#if defined(KORE_USE_TASKS)
+	kore_task_pool_stats(&m->task_threads, &m->task_idle, &m->task_queued);
+#endif
+	m->fileref_bytes = kore_fileref_memory_used;
+	m->fileref_hits = kore_fileref_memory_hits;
+	m->fileref_misses = kore_fileref_memory_misses;
+	m->fileref_evictions = kore_fileref_memory_evictions;
+}
+
+void
+kore_metrics_request(struct http_request *req)
+{
+	int				phase;
+	u_int64_t			us;
+	struct kore_metrics_hist	*hist;
+	struct kore_metrics_route	*rt;
+
+	rt = &worker->metrics.routes[req->hdlr->metrics];
+	us = kore_time_us() - req->queued_us;
+
+	rt->requests++;
+	rt->latency_sum += us;
+	rt->latency[metrics_bucket(us)]++;
+
+	if (req->status >= 100 && req->status < 600)
+		rt->status[(req->status / 100) - 1]++;
+
+	/* Phases a request did not go through are left out. */
+	for (phase = 0; phase < HTTP_TIMING_MAX; phase++) {
+		if ((us = http_request_timing(req, phase)) == 0)
+			continue;
+
+		hist = &worker->metrics.phases[phase];
+		kore_metrics_hist_add(hist, us);
+	}
+}
+
+void
+kore_metrics_hist_add(struct kore_metrics_hist *hist, u_int64_t us)
+{
+	hist->count++;
+	hist->sum += us;
+	hist->buckets[metrics_bucket(us)]++;
+}
+
+int
+kore_metrics_create(struct kore_domain *dom, const char *path)
+{
+	struct kore_module_handle	*hdlr;
+
+	if (!kore_module_handler_new(dom, path, "metrics_serve",
+	    NULL, HANDLER_TYPE_STATIC))
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_FOREACH(hdlr, &dom->handlers, list) {
+		if (!strcmp(hdlr->path, path))
+			break;
+	}
+
+	if (hdlr == NULL)
+		fatal("couldn't find newly created handler for metrics");
+
+	hdlr->methods = HTTP_METHOD_GET | HTTP_METHOD_HEAD;
+
+	return (KORE_RESULT_OK);
+}
+
+int
+metrics_serve(struct http_request *req)
+{
+	int				family, other;
+	struct kore_buf			*buf;
+	struct kore_server		*srv;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+	struct kore_metrics_route	sum;
+
+	buf = kore_buf_alloc(8192);
+
+	/* Each metric family has to be listed in one go. */
+	for (family = 0; family < METRICS_FAMILIES; family++) {
+		kore_buf_appendf(buf, "# TYPE %s %s\n",
+		    families[family].name, families[family].type);
+
+		other = 0;
+
+		LIST_FOREACH(srv, &kore_servers, list) {
+			TAILQ_FOREACH(dom, &srv->domains, list) {
+				TAILQ_FOREACH(hdlr, &dom->handlers, list) {
+					if (hdlr->metrics == METRICS_OTHER) {
+						other = 1;
+						continue;
+					}
+
+					metrics_sum(&sum, hdlr->metrics);
+					metrics_route(buf, family,
+					    dom->domain, hdlr->path, &sum);
+				}
+			}
+		}
+
+		if (other) {
+			metrics_sum(&sum, METRICS_OTHER);
+			metrics_route(buf, family, "*", "other", &sum);
+		}
+	}
+
+	metrics_phases(buf);
+	metrics_prio(buf);
+#if defined(KORE_USE_PGSQL)
+	metrics_pgsql(buf);
+#endif
+	metrics_workers(buf);
+
+	http_response_header(req, "content-type",
+	    "text/plain; version=0.0.4");
+	http_response(req, HTTP_STATUS_OK, buf->data, buf->offset);
+	kore_buf_free(buf);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+metrics_sum(struct kore_metrics_route *sum, u_int16_t slot)
+{
+	int				i;
+	u_int16_t			idx;
+	struct kore_metrics_route	*rt;
+
+	memset(sum, 0, sizeof(*sum));
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		rt = &kore_worker_data(idx)->metrics.routes[slot];
+
+		sum->requests += rt->requests;
+		sum->latency_sum += rt->latency_sum;
+
+		for (i = 0; i < 5; i++)
+			sum->status[i] += rt->status[i];
+		for (i = 0; i <= KORE_METRICS_BUCKETS; i++)
+			sum->latency[i] += rt->latency[i];
+	}
+}
+
+static void
+metrics_route(struct kore_buf *buf, int family, const char *domain,
+    const char *path, struct kore_metrics_route *rt)
+{
+	int		i;
+	int		len;
+	size_t		off;
+	const char	*name;
+	char		label[512];
+
+	if (rt->requests == 0)
+		return;
+
+	/* Route paths can be regexes, escape them for the label value. */
+	len = snprintf(label, sizeof(label), "domain=\"%s\",route=\"", domain);
+	if (len == -1 || (size_t)len >= sizeof(label) - 3)
+		return;
+
+	off = len;
+	for (i = 0; path[i] != '\0' && off < sizeof(label) - 3; i++) {
+		if (path[i] == '"' || path[i] == '\\')
+			label[off++] = '\\';
+		label[off++] = path[i];
+	}
+
+	label[off++] = '"';
+	label[off] = '\0';
+
+	name = families[family].name;
+
+	switch (family) {
+	case METRICS_REQUESTS:
+		kore_buf_appendf(buf, "%s{%s} %" PRIu64 "\n",
+		    name, label, rt->requests);
+		break;
+	case METRICS_RESPONSES:
+		for (i = 0; i < 5; i++) {
+			if (rt->status[i] == 0)
+				continue;
+			kore_buf_appendf(buf,
+			    "%s{%s,code=\"%dxx\"} %" PRIu64 "\n",
+			    name, label, i + 1, rt->status[i]);
+		}
+		break;
+	case METRICS_DURATION:
+		metrics_histogram(buf, name, label,
+		    rt->latency, rt->latency_sum, rt->requests);
+		break;
+	}
+}
+
+/*
+ * The per phase histograms (see http_request_timing()) are kept for
+ * all routes together, per route they would not fit the worker data.
+ */
+static void
+metrics_phases(struct kore_buf *buf)
+{
+	int				phase;
+	u_int16_t			idx;
+	struct kore_metrics_hist	sum, *hist;
+	char				label[32];
+
+	kore_buf_appendf(buf,
+	    "# TYPE kore_http_phase_duration_seconds histogram\n");
+
+	for (phase = 0; phase < HTTP_TIMING_MAX; phase++) {
+		memset(&sum, 0, sizeof(sum));
+
+		for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+			hist = &kore_worker_data(idx)->metrics.phases[phase];
+			metrics_hist_merge(&sum, hist);
+		}
+
+		if (sum.count == 0)
+			continue;
+
+		(void)snprintf(label, sizeof(label), "phase=\"%s\"",
+		    http_timing_name(phase));
+		metrics_histogram(buf, "kore_http_phase_duration_seconds",
+		    label, sum.buckets, sum.sum, sum.count);
+	}
+}
+
+/*
+ * Queue depth and time to first run per request class, see
+ * http_request_shed(). Waits are in milliseconds.
+ */
+static void
+metrics_prio(struct kore_buf *buf)
+{
+	int				prio;
+	u_int16_t			idx;
+	struct kore_metrics_prio	sum[KORE_METRICS_PRIOS], *mp;
+
+	memset(sum, 0, sizeof(sum));
+
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+			mp = &kore_worker_data(idx)->metrics.prio[prio];
+			sum[prio].queued += mp->queued;
+			sum[prio].started += mp->started;
+			sum[prio].shed += mp->shed;
+			sum[prio].wait_total += mp->wait_total;
+			sum[prio].wait_max =
+			    MAX(sum[prio].wait_max, mp->wait_max);
+		}
+	}
+
+	kore_buf_appendf(buf, "# TYPE kore_http_class_queued gauge\n");
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		kore_buf_appendf(buf,
+		    "kore_http_class_queued{class=\"%s\"} %u\n",
+		    http_prio_name(prio), sum[prio].queued);
+	}
+
+	kore_buf_appendf(buf, "# TYPE kore_http_class_started_total counter\n");
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		kore_buf_appendf(buf,
+		    "kore_http_class_started_total{class=\"%s\"} %" PRIu64 "\n",
+		    http_prio_name(prio), sum[prio].started);
+	}
+
+	kore_buf_appendf(buf, "# TYPE kore_http_class_shed_total counter\n");
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		kore_buf_appendf(buf,
+		    "kore_http_class_shed_total{class=\"%s\"} %" PRIu64 "\n",
+		    http_prio_name(prio), sum[prio].shed);
+	}
+
+	kore_buf_appendf(buf,
+	    "# TYPE kore_http_class_wait_milliseconds_total counter\n");
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		kore_buf_appendf(buf, "kore_http_class_wait_milliseconds_total"
+		    "{class=\"%s\"} %" PRIu64 "\n",
+		    http_prio_name(prio), sum[prio].wait_total);
+	}
+
+	kore_buf_appendf(buf,
+	    "# TYPE kore_http_class_wait_max_milliseconds gauge\n");
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		kore_buf_appendf(buf, "kore_http_class_wait_max_milliseconds"
+		    "{class=\"%s\"} %" PRIu64 "\n",
+		    http_prio_name(prio), sum[prio].wait_max);
+	}
+}
+
+#if defined(KORE_USE_PGSQL)
+/* Time spent waiting for a pgsql connection, per request class. */
+static void
+metrics_pgsql(struct kore_buf *buf)
+{
+	int				prio;
+	u_int16_t			idx;
+	struct kore_metrics_hist	sum, *hist;
+	char				label[32];
+
+	kore_buf_appendf(buf,
+	    "# TYPE kore_pgsql_queue_wait_seconds histogram\n");
+
+	for (prio = 0; prio < KORE_METRICS_PRIOS; prio++) {
+		memset(&sum, 0, sizeof(sum));
+
+		for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+			hist = &kore_worker_data(idx)->metrics.pgsql_wait[prio];
+			metrics_hist_merge(&sum, hist);
+		}
+
+		if (sum.count == 0)
+			continue;
+
+		(void)snprintf(label, sizeof(label), "class=\"%s\"",
+		    http_prio_name(prio));
+		metrics_histogram(buf, "kore_pgsql_queue_wait_seconds",
+		    label, sum.buckets, sum.sum, sum.count);
+	}
+}
+#endif
+
+static void
+metrics_hist_merge(struct kore_metrics_hist *dst,
+    const struct kore_metrics_hist *src)
+{
+	int		i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+
+	for (i = 0; i <= KORE_METRICS_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+static void
+metrics_histogram(struct kore_buf *buf, const char *name, const char *label,
+    const u_int64_t *buckets, u_int64_t sum, u_int64_t count)
+{
+	int		i;
+	u_int64_t	cumulative;
+
+	cumulative = 0;
+	for (i = 0; i < KORE_METRICS_BUCKETS; i++) {
+		cumulative += buckets[i];
+		kore_buf_appendf(buf, "%s_bucket{%s,le=\"%g\"} %" PRIu64 "\n",
+		    name, label, (double)metrics_bucket_bound(i) / 1000000,
+		    cumulative);
+	}
+
+	cumulative += buckets[KORE_METRICS_BUCKETS];
+	kore_buf_appendf(buf, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n",
+	    name, label, cumulative);
+	kore_buf_appendf(buf, "%s_sum{%s} %.6f\n", name, label,
+	    (double)sum / 1000000);
+	kore_buf_appendf(buf, "%s_count{%s} %" PRIu64 "\n", name, label, count);
+}
+
+static void
+metrics_workers(struct kore_buf *buf)
+{
+	size_t			i;
+	u_int16_t		idx;
+	u_int64_t		value;
+	struct kore_worker	*kw;
+	const u_int8_t		*field;
+
+	for (i = 0; i < METRICS_WORKER_FIELDS; i++) {
+		kore_buf_appendf(buf, "# TYPE %s %s\n",
+		    worker_fields[i].name, worker_fields[i].type);
+
+		for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+			kw = kore_worker_data(idx);
+			if (kw->pid == 0)
+				continue;
+
+			field = (const u_int8_t *)kw + worker_fields[i].offset;
+			if (worker_fields[i].size == sizeof(u_int64_t))
+				value = *(const u_int64_t *)field;
+			else
+				value = *(const u_int32_t *)field;
+
+			kore_buf_appendf(buf, "%s{worker=\"%s\"} %" PRIu64 "\n",
+			    worker_fields[i].name, kore_worker_name(kw->id),
+			    value);
+		}
+	}
+}
+
+/*
+ * Bucket i covers up to KORE_METRICS_BUCKET_MIN << (i / 2) microseconds
+ * for even i, and one and a half times that for odd i.
+ */
+static u_int64_t
+metrics_bucket_bound(int i)
+{
+	u_int64_t	base;
+
+	base = (u_int64_t)KORE_METRICS_BUCKET_MIN << (i / 2);
+	if (i & 1)
+		return (base + (base / 2));
+
+	return (base);
+}
+
+static int
+metrics_bucket(u_int64_t us)
+{
+	int		i;
+
+	for (i = 0; i < KORE_METRICS_BUCKETS; i++) {
+		if (us <= metrics_bucket_bound(i))
+			return (i);
+	}
+
+	return (KORE_METRICS_BUCKETS);
+}
@@ -29,6 +29,52 @@
 #include "python_api.h"
 #endif
 
+#if !defined(KORE_NO_HTTP)
+/*
+ * The handlers of a domain are compiled into a radix trie keyed on the
+ * path. Static handlers sit on the node matching their full path, dynamic
+ * handlers on the node matching the literal prefix of their regex, so a
+ * lookup only runs regexec() on handlers whose prefix matches the path.
+ * Every handler remembers its position in dom->handlers so the first
+ * matching handler in configuration order still wins.
+ */
+struct route_entry {
+	u_int32_t			order;
+	struct kore_module_handle	*hdlr;
+};
+
+struct kore_route_node {
+	const char			*label;
+	size_t				len;
+
+	struct route_entry		exact;
+
+	size_t				ndyn;
+	struct route_entry		*dyn;
+
+	size_t				nchild;
+	struct kore_route_node		**child;
+};
+
+#define ROUTE_ORDER_NONE	UINT32_MAX
+
+static struct kore_route_node	*route_node_new(const char *, size_t);
+static struct kore_route_node	*route_insert(struct kore_route_node *,
+				    const char *, size_t);
+static void	route_node_free(struct kore_route_node *);
+static size_t	route_prefix(const char *, const char **);
+static void	route_dump(struct kore_route_node *, int);
+
+static void		params_build(struct kore_module_handle *);
+static u_int32_t	params_hash(const char *, u_int32_t);
+
+static int		module_handler_insert(struct kore_module_handle *);
+static void		module_handlers_unbind(void);
+static struct kore_module_handle	*module_handler_alloc(
+			    struct kore_domain *, const char *,
+			    const char *, int);
+#endif
+
 static TAILQ_HEAD(, kore_module)	modules;
 
 static void	native_free(struct kore_module *);
@@ -142,6 +188,10 @@ kore_module_reload(int cbs)
 #endif
 	struct kore_module		*module;
 
+#if !defined(KORE_NO_HTTP)
+	module_handlers_unbind();
+#endif
+
 	TAILQ_FOREACH(module, &modules, list) {
 		if (module->path == NULL)
 			continue;
@@ -186,6 +236,15 @@ kore_module_reload(int cbs)
 	LIST_FOREACH(srv, &kore_servers, list) {
 		TAILQ_FOREACH(dom, &srv->domains, list) {
 			TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+				if (hdlr->direct) {
+					if (hdlr->rcall->addr == NULL &&
+					    cbs == 1) {
+						fatal("handler for '%s' not "
+						    "bound after reload",
+						    hdlr->path);
+					}
+					continue;
+				}
 				kore_free(hdlr->rcall);
 				hdlr->rcall = kore_runtime_getcall(hdlr->func);
 				if (hdlr->rcall == NULL) {
@@ -227,40 +286,173 @@ kore_module_handler_new(struct kore_domain *dom, const char *path,
 		ap = NULL;
 	}
 
-	hdlr = kore_malloc(sizeof(*hdlr));
+	hdlr = module_handler_alloc(dom, path, func, type);
 	hdlr->auth = ap;
+
+	if ((hdlr->rcall = kore_runtime_getcall(func)) == NULL) {
+		kore_module_handler_free(hdlr);
+		kore_log(LOG_ERR, "function '%s' not found", func);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!module_handler_insert(hdlr))
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Registers a handler by address instead of by symbol name, used by
+ * kore.hpp. Registering the same path and methods again rebinds the
+ * handler, which the onload callback of the module does after a reload.
+ * A path can only have one handler, registering it again for other
+ * methods fails unless the old handler was unbound by a reload.
+ */
+struct kore_module_handle *
+kore_module_handler_callback(struct kore_domain *dom, const char *path,
+    const char *name, int (*cb)(struct http_request *), int type, int methods)
+{
+	struct kore_module_handle	*hdlr;
+
+	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		if (!hdlr->direct || strcmp(hdlr->path, path))
+			continue;
+
+		if (hdlr->methods != methods && hdlr->rcall->addr != NULL) {
+			kore_log(LOG_ERR, "%s: route %s already registered",
+			    dom->domain, path);
+			return (NULL);
+		}
+
+		hdlr->rcall->addr = *(void **)&cb;
+		hdlr->methods = methods;
+		hdlr->errors = 0;
+		return (hdlr);
+	}
+
+	hdlr = module_handler_alloc(dom, path, name, type);
+	hdlr->direct = 1;
+	hdlr->methods = methods;
+
+	hdlr->rcall = kore_malloc(sizeof(*hdlr->rcall));
+	hdlr->rcall->addr = *(void **)&cb;
+	hdlr->rcall->runtime = &kore_native_runtime;
+
+	if (!module_handler_insert(hdlr))
+		return (NULL);
+
+	return (hdlr);
+}
+
+/* The programmatic equivalent of a validate line in a params block. */
+int
+kore_module_handler_param(struct kore_module_handle *hdlr, const char *name,
+    u_int8_t method, int flags, const char *validator)
+{
+	struct kore_handler_params	*p;
+	struct kore_validator		*val;
+
+	TAILQ_FOREACH(p, &(hdlr->params), list) {
+		if (p->method == method && !strcmp(p->name, name))
+			return (KORE_RESULT_OK);
+	}
+
+	if ((val = kore_validator_lookup(validator)) == NULL) {
+		kore_log(LOG_ERR, "unknown validator %s for %s",
+		    validator, name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	p = kore_calloc(1, sizeof(*p));
+	p->validator = val;
+	p->flags = flags;
+	p->method = method;
+	p->name = kore_strdup(name);
+
+	TAILQ_INSERT_TAIL(&(hdlr->params), p, list);
+	hdlr->dom->routes_dirty = 1;
+
+	return (KORE_RESULT_OK);
+}
+
+static struct kore_module_handle *
+module_handler_alloc(struct kore_domain *dom, const char *path,
+    const char *func, int type)
+{
+	struct kore_module_handle	*hdlr;
+
+	hdlr = kore_malloc(sizeof(*hdlr));
+	hdlr->auth = NULL;
+	hdlr->rcall = NULL;
+	hdlr->direct = 0;
 	hdlr->dom = dom;
 	hdlr->errors = 0;
 	hdlr->type = type;
 	hdlr->path = kore_strdup(path);
 	hdlr->func = kore_strdup(func);
 	hdlr->methods = HTTP_METHOD_ALL;
+	hdlr->stream = 0;
+	hdlr->cache = NULL;
+	hdlr->deadline = 0;
+	hdlr->priority = HTTP_PRIO_NORMAL;
+	hdlr->nparams = 0;
+	hdlr->params_table = NULL;
+#if defined(KORE_USE_ZLIB)
+	hdlr->compress = 0;
+	hdlr->ws_deflate = 0;
+	hdlr->ws_deflate_bits = 0;
+#endif
 
 	TAILQ_INIT(&(hdlr->params));
 
-	if ((hdlr->rcall = kore_runtime_getcall(func)) == NULL) {
-		kore_module_handler_free(hdlr);
-		kore_log(LOG_ERR, "function '%s' not found", func);
-		return (KORE_RESULT_ERROR);
+	return (hdlr);
+}
+
+/*
+ * The addresses of handlers registered with kore_module_handler_callback()
+ * point into the old module, the onload callback binds them again.
+ */
+static void
+module_handlers_unbind(void)
+{
+	struct kore_server		*srv;
+	struct kore_domain		*dom;
+	struct kore_module_handle	*hdlr;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		TAILQ_FOREACH(dom, &srv->domains, list) {
+			TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+				if (hdlr->direct)
+					hdlr->rcall->addr = NULL;
+			}
+		}
 	}
+}
 
+static int
+module_handler_insert(struct kore_module_handle *hdlr)
+{
 	if (hdlr->type == HANDLER_TYPE_DYNAMIC) {
 		if (regcomp(&(hdlr->rctx), hdlr->path,
 		    REG_EXTENDED | REG_NOSUB)) {
+			kore_debug("regcomp() on %s failed", hdlr->path);
 			kore_module_handler_free(hdlr);
-			kore_debug("regcomp() on %s failed", path);
 			return (KORE_RESULT_ERROR);
 		}
 	}
 
-	TAILQ_INSERT_TAIL(&(dom->handlers), hdlr, list);
+	hdlr->id = hdlr->dom->route_ids++;
+	TAILQ_INSERT_TAIL(&(hdlr->dom->handlers), hdlr, list);
+	hdlr->dom->routes_dirty = 1;
+
 	return (KORE_RESULT_OK);
 }
 
 void
 kore_module_handler_free(struct kore_module_handle *hdlr)
 {
-	struct kore_handler_params *param;
+	int				i;
+	struct kore_handler_params	*param;
 
 	if (hdlr == NULL)
 		return;
@@ -272,6 +464,14 @@ kore_module_handler_free(struct kore_module_handle *hdlr)
 	if (hdlr->type == HANDLER_TYPE_DYNAMIC)
 		regfree(&(hdlr->rctx));
 
+	if (hdlr->cache != NULL) {
+		for (i = 0; i < hdlr->cache->nargs; i++)
+			kore_free(hdlr->cache->args[i]);
+		for (i = 0; i < hdlr->cache->nheaders; i++)
+			kore_free(hdlr->cache->headers[i]);
+		kore_free(hdlr->cache);
+	}
+
 	/* Drop all validators associated with this handler */
 	while ((param = TAILQ_FIRST(&(hdlr->params))) != NULL) {
 		TAILQ_REMOVE(&(hdlr->params), param, list);
@@ -280,26 +480,404 @@ kore_module_handler_free(struct kore_module_handle *hdlr)
 		kore_free(param);
 	}
 
+	kore_free(hdlr->params_table);
 	kore_free(hdlr);
 }
 
 struct kore_module_handle *
 kore_module_handler_find(struct http_request *req, struct kore_domain *dom)
 {
+	const char			*path;
+	size_t				i, rem;
+	u_int32_t			best;
 	struct kore_module_handle	*hdlr;
+	struct kore_route_node		*node, *next;
+
+	if (dom->routes == NULL || dom->routes_dirty)
+		kore_module_routes_build(dom);
+
+	/* First find the exact static match, it bounds the regex search. */
+	node = dom->routes;
+	path = req->path;
+	rem = strlen(path);
+
+	while (rem > 0) {
+		next = NULL;
+		for (i = 0; i < node->nchild; i++) {
+			if (node->child[i]->label[0] == *path) {
+				next = node->child[i];
+				break;
+			}
+		}
+
+		if (next == NULL || next->len > rem ||
+		    memcmp(next->label, path, next->len))
+			break;
+
+		path += next->len;
+		rem -= next->len;
+		node = next;
+	}
+
+	if (rem == 0 && node->exact.hdlr != NULL) {
+		best = node->exact.order;
+		hdlr = node->exact.hdlr;
+	} else {
+		best = ROUTE_ORDER_NONE;
+		hdlr = NULL;
+	}
+
+	/* Now walk the same path again trying the dynamic candidates. */
+	node = dom->routes;
+	path = req->path;
+	rem = strlen(path);
+
+	for (;;) {
+		for (i = 0; i < node->ndyn; i++) {
+			if (node->dyn[i].order > best)
+				break;
+
+			if (!regexec(&(node->dyn[i].hdlr->rctx), req->path,
+			    HTTP_CAPTURE_GROUPS, req->cgroups, 0)) {
+				best = node->dyn[i].order;
+				hdlr = node->dyn[i].hdlr;
+				break;
+			}
+		}
+
+		if (rem == 0)
+			break;
+
+		next = NULL;
+		for (i = 0; i < node->nchild; i++) {
+			if (node->child[i]->label[0] == *path) {
+				next = node->child[i];
+				break;
+			}
+		}
+
+		if (next == NULL || next->len > rem ||
+		    memcmp(next->label, path, next->len))
+			break;
+
+		path += next->len;
+		rem -= next->len;
+		node = next;
+	}
+
+	return (hdlr);
+}
+
+void
+kore_module_routes_build(struct kore_domain *dom)
+{
+	size_t				len;
+	u_int32_t			order;
+	const char			*key;
+	struct kore_module_handle	*hdlr;
+	struct kore_route_node		*node;
+
+	kore_module_routes_free(dom);
+
+	order = 0;
+	dom->routes = route_node_new("", 0);
+	dom->route_byid = kore_calloc(dom->route_ids + 1,
+	    sizeof(*dom->route_byid));
 
 	TAILQ_FOREACH(hdlr, &(dom->handlers), list) {
+		dom->route_byid[hdlr->id] = hdlr;
+
 		if (hdlr->type == HANDLER_TYPE_STATIC) {
-			if (!strcmp(hdlr->path, req->path))
-				return (hdlr);
+			node = route_insert(dom->routes,
+			    hdlr->path, strlen(hdlr->path));
+			if (node->exact.hdlr == NULL) {
+				node->exact.order = order;
+				node->exact.hdlr = hdlr;
+			}
 		} else {
-			if (!regexec(&(hdlr->rctx), req->path,
-			    HTTP_CAPTURE_GROUPS, req->cgroups, 0))
-				return (hdlr);
+			len = route_prefix(hdlr->path, &key);
+			node = route_insert(dom->routes, key, len);
+			node->dyn = kore_realloc(node->dyn,
+			    (node->ndyn + 1) * sizeof(struct route_entry));
+			node->dyn[node->ndyn].order = order;
+			node->dyn[node->ndyn].hdlr = hdlr;
+			node->ndyn++;
 		}
+
+		params_build(hdlr);
+		order++;
 	}
 
-	return (NULL);
+	dom->routes_dirty = 0;
+
+	kore_debug("compiled %u routes for %s", order, dom->domain);
+	route_dump(dom->routes, 0);
+}
+
+void
+kore_module_routes_free(struct kore_domain *dom)
+{
+	if (dom->routes != NULL) {
+		route_node_free(dom->routes);
+		dom->routes = NULL;
+	}
+
+	kore_free(dom->route_byid);
+	dom->route_byid = NULL;
+}
+
+struct kore_module_handle *
+kore_module_handler_byid(struct kore_domain *dom, u_int16_t id)
+{
+	if (dom->routes == NULL || dom->routes_dirty)
+		kore_module_routes_build(dom);
+
+	if (id >= dom->route_ids)
+		return (NULL);
+
+	return (dom->route_byid[id]);
+}
+
+/*
+ * Returns the first params entry for an argument name on this route,
+ * the entries for other methods or for the query string follow it
+ * through its next pointer.
+ */
+struct kore_handler_params *
+kore_module_params_find(struct kore_module_handle *hdlr, const char *name)
+{
+	struct kore_handler_params	*p;
+
+	if (hdlr->params_table == NULL)
+		return (NULL);
+
+	p = hdlr->params_table[params_hash(name, hdlr->params_seed) &
+	    hdlr->params_mask];
+
+	if (p == NULL || strcmp(p->name, name))
+		return (NULL);
+
+	return (p);
+}
+
+/*
+ * Gives every distinct argument name of a route its own slot and
+ * looks for a seed that puts all names in a different bucket, so
+ * a lookup is a single hash and compare.
+ */
+static void
+params_build(struct kore_module_handle *hdlr)
+{
+	size_t				size;
+	u_int32_t			seed, idx;
+	struct kore_handler_params	*p, *head, **table;
+
+	kore_free(hdlr->params_table);
+	hdlr->params_table = NULL;
+	hdlr->nparams = 0;
+
+	TAILQ_FOREACH(p, &(hdlr->params), list) {
+		p->next = NULL;
+
+		TAILQ_FOREACH(head, &(hdlr->params), list) {
+			if (head == p || !strcmp(head->name, p->name))
+				break;
+		}
+
+		if (head == p) {
+			p->slot = hdlr->nparams++;
+			continue;
+		}
+
+		p->slot = head->slot;
+		while (head->next != NULL)
+			head = head->next;
+		head->next = p;
+	}
+
+	if (hdlr->nparams == 0)
+		return;
+
+	size = 8;
+	while (size < (size_t)hdlr->nparams * 2)
+		size *= 2;
+
+	table = NULL;
+
+	for (;;) {
+		table = kore_realloc(table, size * sizeof(*table));
+
+		for (seed = 0; seed < 1024; seed++) {
+			memset(table, 0, size * sizeof(*table));
+
+			TAILQ_FOREACH(p, &(hdlr->params), list) {
+				idx = params_hash(p->name, seed) & (size - 1);
+				if (table[idx] == NULL)
+					table[idx] = p;
+				else if (strcmp(table[idx]->name, p->name))
+					break;
+			}
+
+			if (p == NULL) {
+				hdlr->params_seed = seed;
+				hdlr->params_mask = size - 1;
+				hdlr->params_table = table;
+				return;
+			}
+		}
+
+		size *= 2;
+	}
+}
+
+/* FNV-1a */
+static u_int32_t
+params_hash(const char *name, u_int32_t seed)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U ^ seed;
+
+	while (*name != '\0') {
+		hash ^= *(const u_int8_t *)name++;
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+static struct kore_route_node *
+route_node_new(const char *label, size_t len)
+{
+	struct kore_route_node		*node;
+
+	node = kore_calloc(1, sizeof(*node));
+	node->label = label;
+	node->len = len;
+	node->exact.order = ROUTE_ORDER_NONE;
+
+	return (node);
+}
+
+/*
+ * Return the node for the given key, splitting labels where needed so
+ * the key always ends on a node boundary. Labels point into the handler
+ * paths, which outlive the trie.
+ */
+static struct kore_route_node *
+route_insert(struct kore_route_node *node, const char *key, size_t len)
+{
+	size_t				i, n;
+	struct kore_route_node		*child, *mid;
+
+	while (len > 0) {
+		child = NULL;
+		for (i = 0; i < node->nchild; i++) {
+			if (node->child[i]->label[0] == *key) {
+				child = node->child[i];
+				break;
+			}
+		}
+
+		if (child == NULL) {
+			child = route_node_new(key, len);
+			node->child = kore_realloc(node->child,
+			    (node->nchild + 1) * sizeof(*node->child));
+			node->child[node->nchild++] = child;
+			return (child);
+		}
+
+		for (n = 0; n < child->len && n < len; n++) {
+			if (child->label[n] != key[n])
+				break;
+		}
+
+		if (n < child->len) {
+			mid = route_node_new(child->label, n);
+			mid->child = kore_malloc(sizeof(*mid->child));
+			mid->child[0] = child;
+			mid->nchild = 1;
+
+			child->label += n;
+			child->len -= n;
+
+			node->child[i] = mid;
+			child = mid;
+		}
+
+		key += n;
+		len -= n;
+		node = child;
+	}
+
+	return (node);
+}
+
+static void
+route_node_free(struct kore_route_node *node)
+{
+	size_t		i;
+
+	for (i = 0; i < node->nchild; i++)
+		route_node_free(node->child[i]);
+
+	kore_free(node->child);
+	kore_free(node->dyn);
+	kore_free(node);
+}
+
+/*
+ * Find the literal prefix a regex anchored with ^ must match. Anything
+ * we cannot reason about cheaply yields an empty prefix, which puts the
+ * handler on the root node where it is tried for every path.
+ */
+static size_t
+route_prefix(const char *regex, const char **key)
+{
+	size_t		len;
+
+	*key = regex;
+
+	if (regex[0] != '^' || strchr(regex, '|') != NULL)
+		return (0);
+
+	*key = ++regex;
+
+	for (len = 0; regex[len] != '\0'; len++) {
+		if (strchr(".[]()*+?{}\\^$", regex[len]) != NULL)
+			break;
+	}
+
+	/* A quantifier makes the character in front of it optional. */
+	if (len > 0 && regex[len] != '\0' &&
+	    strchr("*+?{", regex[len]) != NULL)
+		len--;
+
+	return (len);
+}
+
+static void
+route_dump(struct kore_route_node *node, int depth)
+{
+#if defined(KORE_DEBUG)
+	size_t		i;
+
+	kore_debug("%*s'%.*s'%s%s", depth * 2, "", (int)node->len,
+	    node->label, node->exact.hdlr != NULL ? " -> " : "",
+	    node->exact.hdlr != NULL ? node->exact.hdlr->func : "");
+
+	for (i = 0; i < node->ndyn; i++) {
+		kore_debug("%*s  ~ %s -> %s (%u)", depth * 2, "",
+		    node->dyn[i].hdlr->path, node->dyn[i].hdlr->func,
+		    node->dyn[i].order);
+	}
+
+	for (i = 0; i < node->nchild; i++)
+		route_dump(node->child[i], depth + 1);
+#else
+	(void)node;
+	(void)depth;
+#endif
 }
 #endif /* !KORE_NO_HTTP */
 
@@ -17,11 +17,52 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#endif
+
 #include <signal.h>
 
 #include "kore.h"
 #include "http.h"
 
+#if defined(__linux__)
+/*
+ * With msg_shm enabled every HTTP worker gets an inbound ring in memory
+ * shared by all workers plus an eventfd doorbell. Messages between HTTP
+ * workers are written straight into the ring of the recipient instead
+ * of being relayed by the parent. Anything that does not fit, or that
+ * targets the parent, keymgr or acme, still goes over the socketpair.
+ */
+#define MSG_SHM_RING_SIZE	(256 * 1024)
+#define MSG_SHM_DATA_MAX	(16 * 1024)
+#define MSG_SHM_SPIN		1024
+
+struct msg_shm_ring {
+	volatile u_int16_t	lock;
+	volatile u_int64_t	tail;
+	volatile u_int64_t	head __attribute__((aligned(64)));
+	u_int8_t		data[MSG_SHM_RING_SIZE]
+				    __attribute__((aligned(64)));
+};
+
+struct msg_shm_event {
+	struct kore_event	evt;
+	int			fd;
+};
+
+static int	msg_shm_send(struct kore_msg *, const void *, size_t);
+static int	msg_shm_put(u_int16_t, struct kore_msg *,
+		    const void *, size_t);
+static void	msg_shm_copy_in(struct msg_shm_ring *, u_int64_t,
+		    const void *, size_t);
+static void	msg_shm_copy_out(struct msg_shm_ring *, u_int64_t,
+		    void *, size_t);
+static void	msg_shm_doorbell(int);
+static void	msg_shm_handle(void *, int);
+#endif
+
 struct msg_type {
 	u_int8_t		id;
 	void			(*cb)(struct kore_msg *, const void *);
@@ -34,15 +75,22 @@ static int		msg_recv_data(struct netbuf *);
 static void		msg_disconnected_parent(struct connection *);
 static void		msg_disconnected_worker(struct connection *);
 static void		msg_type_shutdown(struct kore_msg *, const void *);
-
-#if !defined(KORE_NO_HTTP)
-static void		msg_type_websocket(struct kore_msg *, const void *);
-#endif
+static void		msg_parent_relay(struct kore_msg *, const void *);
 
 static TAILQ_HEAD(, msg_type)	msg_types;
 static size_t			cacheidx = 0;
 static struct connection	**conncache = NULL;
 
+#if defined(__linux__)
+int				kore_msg_shm = 0;
+
+static u_int16_t		shm_count = 0;
+static int			*shm_doorbells = NULL;
+static struct msg_shm_ring	*shm_rings = NULL;
+static u_int8_t			*shm_data = NULL;
+static struct msg_shm_event	shm_event;
+#endif
+
 void
 kore_msg_init(void)
 {
@@ -110,7 +158,7 @@ void
 kore_msg_worker_init(void)
 {
 #if !defined(KORE_NO_HTTP)
-	kore_msg_register(KORE_MSG_WEBSOCKET, msg_type_websocket);
+	kore_msg_register(KORE_MSG_WEBSOCKET, kore_websocket_msg);
 #endif
 
 	worker->msg[1] = kore_connection_new(NULL);
@@ -128,7 +176,80 @@ kore_msg_worker_init(void)
 
 	net_recv_queue(worker->msg[1],
 	    sizeof(struct kore_msg), 0, msg_recv_packet);
+
+#if defined(__linux__)
+	if (shm_rings != NULL && worker->id >= 1 && worker->id <= shm_count) {
+		shm_data = kore_malloc(MSG_SHM_DATA_MAX);
+		shm_event.fd = shm_doorbells[worker->id - 1];
+		shm_event.evt.flags = 0;
+		shm_event.evt.type = KORE_TYPE_MSG_SHM;
+		shm_event.evt.handle = msg_shm_handle;
+		kore_platform_event_level_read(shm_event.fd, &shm_event);
+	}
+#endif
+}
+
+#if defined(__linux__)
+/*
+ * Called by the parent before the workers are forked so that they,
+ * and any worker restarted later, inherit the rings and doorbells.
+ */
+void
+kore_msg_shm_init(void)
+{
+	u_int16_t	i;
+	size_t		len;
+
+	if (kore_msg_shm == 0)
+		return;
+
+	shm_count = worker_count - KORE_WORKER_BASE;
+	len = sizeof(struct msg_shm_ring) * shm_count;
+
+	shm_rings = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shm_rings == MAP_FAILED)
+		fatal("kore_msg_shm_init(): mmap: %s", errno_s);
+
+	shm_doorbells = kore_calloc(shm_count, sizeof(int));
+
+	for (i = 0; i < shm_count; i++) {
+		shm_rings[i].lock = 0;
+		shm_rings[i].head = 0;
+		shm_rings[i].tail = 0;
+
+		shm_doorbells[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (shm_doorbells[i] == -1)
+			fatal("kore_msg_shm_init(): eventfd: %s", errno_s);
+	}
+}
+
+/*
+ * A worker went away. Break the ring lock in case it died while holding
+ * it and drop whatever was queued for it, the socketpair path loses
+ * those messages as well.
+ */
+void
+kore_msg_shm_reap(struct kore_worker *kw)
+{
+	u_int16_t		i;
+	struct msg_shm_ring	*ring;
+
+	if (shm_rings == NULL)
+		return;
+
+	for (i = 0; i < shm_count; i++) {
+		ring = &shm_rings[i];
+		(void)__sync_bool_compare_and_swap(&ring->lock, kw->id, 0);
+
+		if (i + 1 == kw->id) {
+			__atomic_store_n(&ring->head,
+			    __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST),
+			    __ATOMIC_SEQ_CST);
+		}
+	}
 }
+#endif
 
 void
 kore_msg_unregister(u_int8_t id)
@@ -160,6 +281,18 @@ kore_msg_register(u_int8_t id, void (*cb)(struct kore_msg *, const void *))
 
 void
 kore_msg_send(u_int16_t dst, u_int8_t id, const void *data, size_t len)
+{
+	kore_msg_queue(dst, id, data, len);
+	kore_msg_flush();
+}
+
+/*
+ * Queue a message without writing it out yet, the caller is expected
+ * to call kore_msg_flush() once it is done so that several messages
+ * go out with a single write.
+ */
+void
+kore_msg_queue(u_int16_t dst, u_int8_t id, const void *data, size_t len)
 {
 	struct kore_msg		m;
 
@@ -168,10 +301,19 @@ kore_msg_send(u_int16_t dst, u_int8_t id, const void *data, size_t len)
 	m.length = len;
 	m.src = worker->id;
 
+#if defined(__linux__)
+	if (msg_shm_send(&m, data, len))
+		return;
+#endif
+
 	net_send_queue(worker->msg[1], &m, sizeof(m));
 	if (data != NULL && len > 0)
 		net_send_queue(worker->msg[1], data, len);
+}
 
+void
+kore_msg_flush(void)
+{
 	net_send_flush(worker->msg[1]);
 }
 
@@ -191,11 +333,7 @@ msg_recv_packet(struct netbuf *nb)
 static int
 msg_recv_data(struct netbuf *nb)
 {
-	size_t			i;
-	struct connection	*c;
 	struct msg_type		*type;
-	int			deliver;
-	u_int16_t		dst, destination;
 	struct kore_msg		*msg = (struct kore_msg *)nb->buf;
 
 	if ((type = msg_type_lookup(msg->id)) != NULL) {
@@ -210,50 +348,83 @@ msg_recv_data(struct netbuf *nb)
 			type->cb(msg, NULL);
 	}
 
-	if (worker == NULL && type == NULL) {
-		destination = msg->dst;
+	if (worker == NULL && type == NULL)
+		msg_parent_relay(msg, nb->buf + sizeof(*msg));
 
-		for (i = 0; i < cacheidx; i++) {
-			c = conncache[i];
-			if (c->proto != CONN_PROTO_MSG)
-				fatal("connection not a msg connection");
+	net_recv_reset(nb->owner, sizeof(struct kore_msg), msg_recv_packet);
+	return (KORE_RESULT_OK);
+}
 
-			/*
-			 * If hdlr_extra is NULL it just means the worker
-			 * never started, ignore it.
-			 */
-			if (c->hdlr_extra == NULL)
-				continue;
+/*
+ * Send a message from the parent itself to one or all workers.
+ */
+void
+kore_msg_parent_send(u_int16_t dst, u_int8_t id, const void *data, size_t len)
+{
+	struct kore_msg		m;
 
-			deliver = 1;
-			dst = *(u_int16_t *)c->hdlr_extra;
+	if (worker != NULL)
+		fatal("kore_msg_parent_send: called from worker");
 
-			if (destination == KORE_MSG_WORKER_ALL) {
-				if (keymgr_active && dst == 0)
-					deliver = 0;
-			} else {
-				if (dst != destination)
-					deliver = 0;
-			}
+	m.id = id;
+	m.dst = dst;
+	m.length = len;
+	m.src = KORE_MSG_PARENT;
 
-			if (deliver == 0)
-				continue;
+	msg_parent_relay(&m, data);
+}
 
-			/* This allows the worker to receive the correct id. */
-			msg->dst = *(u_int16_t *)c->hdlr_extra;
+static void
+msg_parent_relay(struct kore_msg *msg, const void *data)
+{
+	size_t			i;
+	struct connection	*c;
+	int			deliver;
+	u_int16_t		dst, destination;
+
+	destination = msg->dst;
+
+	for (i = 0; i < cacheidx; i++) {
+		c = conncache[i];
+		if (c->proto != CONN_PROTO_MSG)
+			fatal("connection not a msg connection");
+
+		/*
+		 * If hdlr_extra is NULL it just means the worker
+		 * never started, ignore it.
+		 */
+		if (c->hdlr_extra == NULL)
+			continue;
 
-			net_send_queue(c, nb->buf, nb->s_off);
-			net_send_flush(c);
+		deliver = 1;
+		dst = *(u_int16_t *)c->hdlr_extra;
+
+		if (destination == KORE_MSG_WORKER_ALL) {
+			if (keymgr_active && dst == 0)
+				deliver = 0;
+		} else {
+			if (dst != destination)
+				deliver = 0;
 		}
-	}
 
-	net_recv_reset(nb->owner, sizeof(struct kore_msg), msg_recv_packet);
-	return (KORE_RESULT_OK);
+		if (deliver == 0)
+			continue;
+
+		/* This allows the worker to receive the correct id. */
+		msg->dst = *(u_int16_t *)c->hdlr_extra;
+
+		net_send_queue(c, msg, sizeof(*msg));
+		if (msg->length > 0)
+			net_send_queue(c, data, msg->length);
+		net_send_flush(c);
+	}
 }
 
 static void
 msg_disconnected_parent(struct connection *c)
 {
+	kore_log_sync();
+
 	if (!kore_quiet)
 		kore_log(LOG_ERR, "parent gone, shutting down");
 
@@ -278,18 +449,179 @@ msg_type_shutdown(struct kore_msg *msg, const void *data)
 	(void)raise(SIGQUIT);
 }
 
-#if !defined(KORE_NO_HTTP)
+#if defined(__linux__)
+static int
+msg_shm_send(struct kore_msg *m, const void *data, size_t len)
+{
+	u_int16_t	id;
+
+	if (shm_rings == NULL || worker->id < 1 || worker->id > shm_count)
+		return (KORE_RESULT_ERROR);
+
+	if (len > MSG_SHM_DATA_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if (m->dst != KORE_MSG_WORKER_ALL) {
+		if (m->dst < 1 || m->dst > shm_count)
+			return (KORE_RESULT_ERROR);
+		return (msg_shm_put(m->dst, m, data, len));
+	}
+
+	/*
+	 * Broadcasts are split up per worker, the ones whose ring is full
+	 * are sent over the socketpair addressed to that worker only.
+	 * The keymgr and acme processes do not take broadcasts from here.
+	 */
+	for (id = 1; id <= shm_count; id++) {
+		if (msg_shm_put(id, m, data, len))
+			continue;
+
+		m->dst = id;
+		net_send_queue(worker->msg[1], m, sizeof(*m));
+		if (data != NULL && len > 0)
+			net_send_queue(worker->msg[1], data, len);
+	}
+
+	net_send_flush(worker->msg[1]);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+msg_shm_put(u_int16_t id, struct kore_msg *m, const void *data, size_t len)
+{
+	int			spin;
+	struct kore_msg		hdr;
+	struct msg_shm_ring	*ring;
+	u_int64_t		head, tail, total;
+
+	ring = &shm_rings[id - 1];
+	total = (sizeof(hdr) + len + 7) & ~7;
+
+	for (spin = 0; spin < MSG_SHM_SPIN; spin++) {
+		if (__sync_bool_compare_and_swap(&ring->lock, 0, worker->id))
+			break;
+	}
+
+	if (spin == MSG_SHM_SPIN)
+		return (KORE_RESULT_ERROR);
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+	if (tail - head + total > MSG_SHM_RING_SIZE) {
+		(void)__sync_bool_compare_and_swap(&ring->lock, worker->id, 0);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdr = *m;
+	hdr.dst = id;
+
+	msg_shm_copy_in(ring, tail, &hdr, sizeof(hdr));
+	if (data != NULL && len > 0)
+		msg_shm_copy_in(ring, tail + sizeof(hdr), data, len);
+
+	__atomic_store_n(&ring->tail, tail + total, __ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+	if (!__sync_bool_compare_and_swap(&ring->lock, worker->id, 0))
+		fatal("msg_shm_put: lock of worker %u was stolen", id);
+
+	/* Only wake the consumer if it may have seen an empty ring. */
+	if (head == tail)
+		msg_shm_doorbell(shm_doorbells[id - 1]);
+
+	return (KORE_RESULT_OK);
+}
+
 static void
-msg_type_websocket(struct kore_msg *msg, const void *data)
+msg_shm_copy_in(struct msg_shm_ring *ring, u_int64_t pos,
+    const void *src, size_t len)
 {
-	struct connection	*c;
+	size_t		off, part;
 
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c->proto == CONN_PROTO_WEBSOCKET) {
-			net_send_queue(c, data, msg->length);
-			net_send_flush(c);
-		}
+	off = pos % MSG_SHM_RING_SIZE;
+	part = MIN(len, MSG_SHM_RING_SIZE - off);
+
+	memcpy(&ring->data[off], src, part);
+	if (part < len)
+		memcpy(ring->data, (const u_int8_t *)src + part, len - part);
+}
+
+static void
+msg_shm_copy_out(struct msg_shm_ring *ring, u_int64_t pos,
+    void *dst, size_t len)
+{
+	size_t		off, part;
+
+	off = pos % MSG_SHM_RING_SIZE;
+	part = MIN(len, MSG_SHM_RING_SIZE - off);
+
+	memcpy(dst, &ring->data[off], part);
+	if (part < len)
+		memcpy((u_int8_t *)dst + part, ring->data, len - part);
+}
+
+static void
+msg_shm_doorbell(int fd)
+{
+	u_int64_t	one;
+
+	one = 1;
+	if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		kore_log(LOG_ERR, "msg_shm_doorbell: write: %s", errno_s);
+}
+
+static void
+msg_shm_handle(void *arg, int error)
+{
+	struct kore_msg		m;
+	u_int64_t		val;
+	struct msg_type		*type;
+	struct msg_shm_ring	*ring;
+	u_int64_t		head, tail;
+	struct msg_shm_event	*evt = arg;
+
+	if (error)
+		fatal("msg_shm_handle: error on doorbell");
+
+	if (read(evt->fd, &val, sizeof(val)) == -1 && errno != EAGAIN)
+		fatal("msg_shm_handle: read: %s", errno_s);
+
+	ring = &shm_rings[worker->id - 1];
+	head = ring->head;
+
+	/*
+	 * Drain only what was there when we woke up so heavy senders can't
+	 * keep us here forever, and ring ourselves for whatever is left.
+	 */
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+
+	while (head != tail) {
+		msg_shm_copy_out(ring, head, &m, sizeof(m));
+		if (m.length > MSG_SHM_DATA_MAX)
+			fatal("msg_shm_handle: bad message length %zu", m.length);
+		if (m.length > 0)
+			msg_shm_copy_out(ring, head + sizeof(m),
+			    shm_data, m.length);
+
+		head += (sizeof(m) + m.length + 7) & ~7;
+		__atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+
+		if (m.dst != worker->id)
+			fatal("received message for incorrect worker");
+
+		if ((type = msg_type_lookup(m.id)) == NULL)
+			continue;
+
+		if (m.length > 0)
+			type->cb(&m, shm_data);
+		else
+			type->cb(&m, NULL);
 	}
+
+	if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) != head)
+		msg_shm_doorbell(evt->fd);
 }
 #endif
 
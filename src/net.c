@@ -17,6 +17,9 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#include <limits.h>
 
 #if defined(__linux__)
 #include <endian.h>
@@ -30,23 +33,135 @@
 
 #include "kore.h"
 
+/* Maximum number of netbufs handed to a single writev()/sendmsg() call. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define NETBUF_IOV_MAX		IOV_MAX
+#else
+#define NETBUF_IOV_MAX		64
+#endif
+
+/*
+ * Receive buffers come from a few size classes backed by pools so the
+ * header buffers handed over to requests and the buffers that grow for
+ * bodies or websocket frames are recycled instead of reallocated for
+ * every request. Anything above the largest class uses kore_malloc().
+ */
+#define NETBUF_RECV_CLASSES	3
+#define NETBUF_RECV_OVERSIZED	NETBUF_RECV_CLASSES
+#define NETBUF_RECV_MAGIC	0x7262
+
+/* Keep the buffer 16 byte aligned, same as kore_malloc(). */
+struct recvbuf {
+	u_int16_t		cls;
+	u_int16_t		magic;
+	u_int32_t		pad;
+	u_int64_t		len;
+};
+
+static const size_t	recvbuf_sizes[NETBUF_RECV_CLASSES] = {
+	4096, 16384, 65536
+};
+
+static struct kore_pool	recvbuf_pools[NETBUF_RECV_CLASSES];
+
+/* Records written by net_send() for TLS connections, per size mode. */
+static struct {
+	u_int64_t	small;
+	u_int64_t	small_bytes;
+	u_int64_t	full;
+	u_int64_t	full_bytes;
+} tls_records;
+
+static int	net_send_vector(struct connection *);
+static int	net_send_pending(struct netbuf *);
+static size_t	net_tls_record_len(struct connection *);
+
+#if defined(KORE_USE_PLATFORM_KTLS)
+static int	net_sendfile_ktls(struct connection *, struct netbuf *);
+#endif
+
 struct kore_pool		nb_pool;
 
 void
 net_init(void)
 {
+	int		i, len;
+	char		name[32];
 	u_int32_t	elm;
 
 	/* Add some overhead so we don't roll over for internal items. */
 	elm = worker_max_connections + 10;
 	kore_pool_init(&nb_pool, "nb_pool", sizeof(struct netbuf), elm);
+
+	for (i = 0; i < NETBUF_RECV_CLASSES; i++) {
+		len = snprintf(name, sizeof(name),
+		    "recvbuf-%zu", recvbuf_sizes[i]);
+		if (len == -1 || (size_t)len >= sizeof(name))
+			fatal("net_init: snprintf");
+
+		kore_pool_init(&recvbuf_pools[i], name,
+		    sizeof(struct recvbuf) + recvbuf_sizes[i], 0);
+	}
 }
 
 void
 net_cleanup(void)
 {
+	int		i;
+
 	kore_debug("net_cleanup()");
 	kore_pool_cleanup(&nb_pool);
+
+	for (i = 0; i < NETBUF_RECV_CLASSES; i++) {
+		kore_debug("%s: %zu in use, high-water %zu",
+		    recvbuf_pools[i].name, recvbuf_pools[i].inuse,
+		    recvbuf_pools[i].hwm);
+		kore_pool_cleanup(&recvbuf_pools[i]);
+	}
+}
+
+u_int8_t *
+net_recvbuf_get(size_t len, size_t *mlen)
+{
+	u_int16_t		cls;
+	struct recvbuf		*rb;
+
+	for (cls = 0; cls < NETBUF_RECV_CLASSES; cls++) {
+		if (len <= recvbuf_sizes[cls])
+			break;
+	}
+
+	if (cls == NETBUF_RECV_OVERSIZED) {
+		rb = kore_malloc(sizeof(*rb) + len);
+		*mlen = len;
+	} else {
+		rb = kore_pool_get(&recvbuf_pools[cls]);
+		*mlen = recvbuf_sizes[cls];
+	}
+
+	rb->cls = cls;
+	rb->len = *mlen;
+	rb->magic = NETBUF_RECV_MAGIC;
+
+	return ((u_int8_t *)rb + sizeof(*rb));
+}
+
+void
+net_recvbuf_put(void *buf)
+{
+	struct recvbuf		*rb;
+
+	if (buf == NULL)
+		return;
+
+	rb = (struct recvbuf *)((u_int8_t *)buf - sizeof(*rb));
+	if (rb->magic != NETBUF_RECV_MAGIC)
+		fatal("net_recvbuf_put: %p is not a receive buffer", buf);
+
+	if (rb->cls == NETBUF_RECV_OVERSIZED)
+		kore_free(rb);
+	else
+		kore_pool_put(&recvbuf_pools[rb->cls], rb);
 }
 
 struct netbuf *
@@ -147,6 +262,17 @@ net_send_stream(struct connection *c, void *data, size_t len,
 
 void
 net_send_fileref(struct connection *c, struct kore_fileref *ref)
+{
+	net_send_fileref_range(c, ref, 0, ref->size);
+}
+
+/*
+ * Queue len bytes of the fileref starting at off, the netbuf takes over
+ * the caller its reference.
+ */
+void
+net_send_fileref_range(struct connection *c, struct kore_fileref *ref,
+    off_t off, off_t len)
 {
 	struct netbuf		*nb;
 
@@ -157,18 +283,20 @@ net_send_fileref(struct connection *c, struct kore_fileref *ref)
 	nb->flags = NETBUF_IS_FILEREF;
 
 #if defined(KORE_USE_PLATFORM_SENDFILE)
-	if (c->owner->server->tls == 0) {
-		nb->fd_off = 0;
-		nb->fd_len = ref->size;
+	/* Only refs backed by an open file can go out via sendfile. */
+	if ((c->owner->server->tls == 0 ||
+	    (c->flags & CONN_TLS_KTLS_SEND)) && ref->fd != -1) {
+		nb->fd_off = off;
+		nb->fd_len = off + len;
 	} else {
-		nb->buf = ref->base;
-		nb->b_len = ref->size;
+		nb->buf = (u_int8_t *)ref->base + off;
+		nb->b_len = len;
 		nb->m_len = nb->b_len;
 		nb->flags |= NETBUF_IS_STREAM;
 	}
 #else
-	nb->buf = ref->base;
-	nb->b_len = ref->size;
+	nb->buf = (u_int8_t *)ref->base + off;
+	nb->b_len = len;
 	nb->m_len = nb->b_len;
 	nb->flags |= NETBUF_IS_STREAM;
 #endif
@@ -185,13 +313,13 @@ net_recv_reset(struct connection *c, size_t len, int (*cb)(struct netbuf *))
 	c->rnb->s_off = 0;
 	c->rnb->b_len = len;
 
+	/* Keep the buffer if it fits, don't sit on the large classes. */
 	if (c->rnb->buf != NULL && c->rnb->b_len <= c->rnb->m_len &&
-	    c->rnb->m_len < (NETBUF_SEND_PAYLOAD_MAX / 2))
+	    c->rnb->m_len <= recvbuf_sizes[1])
 		return;
 
-	kore_free(c->rnb->buf);
-	c->rnb->m_len = len;
-	c->rnb->buf = kore_malloc(c->rnb->m_len);
+	net_recvbuf_put(c->rnb->buf);
+	c->rnb->buf = net_recvbuf_get(len, &c->rnb->m_len);
 }
 
 void
@@ -207,21 +335,31 @@ net_recv_queue(struct connection *c, size_t len, int flags,
 	c->rnb->cb = cb;
 	c->rnb->owner = c;
 	c->rnb->b_len = len;
-	c->rnb->m_len = len;
 	c->rnb->flags = flags;
 	c->rnb->type = NETBUF_RECV;
-	c->rnb->buf = kore_malloc(c->rnb->b_len);
+	c->rnb->buf = net_recvbuf_get(len, &c->rnb->m_len);
 }
 
 void
 net_recv_expand(struct connection *c, size_t len, int (*cb)(struct netbuf *))
 {
+	u_int8_t	*buf;
+	size_t		mlen;
+
 	kore_debug("net_recv_expand(): %p %d", c, len);
 
 	c->rnb->cb = cb;
 	c->rnb->b_len += len;
-	c->rnb->m_len = c->rnb->b_len;
-	c->rnb->buf = kore_realloc(c->rnb->buf, c->rnb->b_len);
+
+	if (c->rnb->b_len <= c->rnb->m_len)
+		return;
+
+	buf = net_recvbuf_get(c->rnb->b_len, &mlen);
+	memcpy(buf, c->rnb->buf, c->rnb->s_off);
+	net_recvbuf_put(c->rnb->buf);
+
+	c->rnb->buf = buf;
+	c->rnb->m_len = mlen;
 }
 
 int
@@ -234,19 +372,44 @@ net_send(struct connection *c)
 #if defined(KORE_USE_PLATFORM_SENDFILE)
 	if ((c->snb->flags & NETBUF_IS_FILEREF) &&
 	    !(c->snb->flags & NETBUF_IS_STREAM)) {
+#if defined(KORE_USE_PLATFORM_KTLS)
+		if (c->flags & CONN_TLS_KTLS_SEND)
+			return (net_sendfile_ktls(c, c->snb));
+#endif
 		return (kore_platform_sendfile(c, c->snb));
 	}
 #endif
 
 	if (c->snb->b_len != 0) {
 		smin = c->snb->b_len - c->snb->s_off;
-		len = MIN(NETBUF_SEND_PAYLOAD_MAX, smin);
+
+		if (c->write == net_write_tls)
+			len = MIN(net_tls_record_len(c), smin);
+		else
+			len = MIN(NETBUF_SEND_PAYLOAD_MAX, smin);
+
+		/* SSL_write() must be retried with the same length. */
+		if (c->snb->flags & NETBUF_MUST_RESEND)
+			len = c->tls_wlen;
+		c->tls_wlen = len;
 
 		if (!c->write(c, len, &r))
 			return (KORE_RESULT_ERROR);
 		if (!(c->evt.flags & KORE_EVENT_WRITE))
 			return (KORE_RESULT_OK);
 
+		if (c->write == net_write_tls) {
+			if (len < NETBUF_TLS_RECORD_MAX &&
+			    c->tls_wsent < c->owner->server->tls_rec_boost) {
+				tls_records.small++;
+				tls_records.small_bytes += r;
+			} else {
+				tls_records.full++;
+				tls_records.full_bytes += r;
+			}
+			c->tls_wsent += r;
+		}
+
 		c->snb->s_off += r;
 		c->snb->flags &= ~NETBUF_MUST_RESEND;
 	}
@@ -260,17 +423,35 @@ net_send(struct connection *c)
 	return (KORE_RESULT_OK);
 }
 
+void
+net_tls_stats_log(void)
+{
+	kore_log(LOG_INFO, "tls records: %" PRIu64 " small (%" PRIu64
+	    " bytes), %" PRIu64 " full (%" PRIu64 " bytes)",
+	    tls_records.small, tls_records.small_bytes,
+	    tls_records.full, tls_records.full_bytes);
+}
+
 int
 net_send_flush(struct connection *c)
 {
 	kore_debug("net_send_flush(%p)", c);
+	KORE_PROBE1(net_send_flush, c);
 
 	while (!TAILQ_EMPTY(&(c->send_queue)) &&
 	    (c->evt.flags & KORE_EVENT_WRITE)) {
-		if (!net_send(c))
-			return (KORE_RESULT_ERROR);
+		/* Plaintext connections can have their netbufs coalesced. */
+		if (c->write == net_write) {
+			if (!net_send_vector(c))
+				return (KORE_RESULT_ERROR);
+		} else {
+			if (!net_send(c))
+				return (KORE_RESULT_ERROR);
+		}
 	}
 
+	KORE_PROBE2(net_send_done, c, TAILQ_EMPTY(&(c->send_queue)));
+
 	if ((c->flags & CONN_CLOSE_EMPTY) && TAILQ_EMPTY(&(c->send_queue))) {
 		kore_connection_disconnect(c);
 	}
@@ -278,6 +459,164 @@ net_send_flush(struct connection *c)
 	return (KORE_RESULT_OK);
 }
 
+/*
+ * Returns 1 if the netbuf still has bytes to send, a corked segment
+ * is only pushed out once those follow.
+ */
+static int
+net_send_pending(struct netbuf *nb)
+{
+	if ((nb->flags & NETBUF_IS_FILEREF) && !(nb->flags & NETBUF_IS_STREAM))
+		return (nb->fd_off < nb->fd_len);
+
+	return (nb->s_off < nb->b_len);
+}
+
+/*
+ * Send as many of the queued netbufs as possible in a single writev().
+ * Stops at the first netbuf that must go out via sendfile, which along
+ * with a lone netbuf is handed to net_send() instead.
+ */
+static int
+net_send_vector(struct connection *c)
+{
+	ssize_t			r;
+	int			cnt, more;
+	size_t			len, left;
+	struct netbuf		*nb, *next;
+	struct iovec		iov[NETBUF_IOV_MAX];
+#if defined(MSG_MORE)
+	struct msghdr		msg;
+#endif
+
+	cnt = 0;
+	more = 0;
+
+	TAILQ_FOREACH(nb, &(c->send_queue), list) {
+		if (cnt == NETBUF_IOV_MAX) {
+			more = net_send_pending(nb);
+			break;
+		}
+
+#if defined(KORE_USE_PLATFORM_SENDFILE)
+		if ((nb->flags & NETBUF_IS_FILEREF) &&
+		    !(nb->flags & NETBUF_IS_STREAM)) {
+			more = net_send_pending(nb);
+			break;
+		}
+#endif
+
+		if (nb->flags & NETBUF_FORCE_REMOVE)
+			break;
+
+		iov[cnt].iov_base = nb->buf + nb->s_off;
+		iov[cnt].iov_len = nb->b_len - nb->s_off;
+		cnt++;
+	}
+
+	if (cnt == 0 || (cnt == 1 && more == 0))
+		return (net_send(c));
+
+#if defined(MSG_MORE)
+	/*
+	 * If more data follows right after (headers in front of a
+	 * sendfile() body or a queue longer than one vector) tell the
+	 * kernel so it does not push out a short segment on its own.
+	 */
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+
+	r = sendmsg(c->fd, &msg, more ? MSG_MORE : 0);
+#else
+	r = writev(c->fd, iov, cnt);
+#endif
+
+	if (r == -1) {
+		switch (errno) {
+		case EINTR:
+			return (KORE_RESULT_OK);
+		case EAGAIN:
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			return (KORE_RESULT_OK);
+		default:
+			kore_debug("writev: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	len = (size_t)r;
+	c->snb = NULL;
+
+	for (nb = TAILQ_FIRST(&(c->send_queue)); nb != NULL && cnt > 0;
+	    nb = next, cnt--) {
+		next = TAILQ_NEXT(nb, list);
+		left = nb->b_len - nb->s_off;
+
+		if (len < left) {
+			nb->s_off += len;
+			break;
+		}
+
+		len -= left;
+		nb->s_off = nb->b_len;
+		net_remove_netbuf(c, nb);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+#if defined(KORE_USE_PLATFORM_KTLS)
+/*
+ * Send a fileref over a TLS connection with kernel TLS offload, the
+ * kernel encrypts the file contents as they are sent.
+ */
+static int
+net_sendfile_ktls(struct connection *c, struct netbuf *nb)
+{
+	int		r;
+	ossl_ssize_t	sent;
+	size_t		len;
+
+	len = MIN(SENDFILE_PAYLOAD_MAX, nb->fd_len - nb->fd_off);
+
+	if (len > 0) {
+		ERR_clear_error();
+		sent = SSL_sendfile(c->ssl, nb->file_ref->fd,
+		    nb->fd_off, len, 0);
+		if (sent <= 0) {
+			r = SSL_get_error(c->ssl, (int)sent);
+			switch (r) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				c->evt.flags &= ~KORE_EVENT_WRITE;
+				return (KORE_RESULT_OK);
+			case SSL_ERROR_SYSCALL:
+				if (errno == EINTR)
+					return (KORE_RESULT_OK);
+				if (errno == EAGAIN) {
+					c->evt.flags &= ~KORE_EVENT_WRITE;
+					return (KORE_RESULT_OK);
+				}
+				/* FALLTHROUGH */
+			default:
+				kore_debug("SSL_sendfile(): %s", ssl_errno_s);
+				return (KORE_RESULT_ERROR);
+			}
+		}
+
+		nb->fd_off += sent;
+	}
+
+	if (nb->fd_off == nb->fd_len) {
+		net_remove_netbuf(c, nb);
+		c->snb = NULL;
+	}
+
+	return (KORE_RESULT_OK);
+}
+#endif
+
 int
 net_recv_flush(struct connection *c)
 {
@@ -337,6 +676,32 @@ net_remove_netbuf(struct connection *c, struct netbuf *nb)
 	kore_pool_put(&nb_pool, nb);
 }
 
+/*
+ * Pick the plaintext length for the next TLS record. Connections start
+ * out with small records and move to full sized ones after the server its
+ * tls_record_boost bytes were sent, going idle starts over.
+ */
+static size_t
+net_tls_record_len(struct connection *c)
+{
+	u_int64_t		now;
+	struct kore_server	*srv;
+
+	srv = c->owner->server;
+	if (srv->tls_rec_boost == 0)
+		return (NETBUF_TLS_RECORD_MAX);
+
+	now = kore_time_ms();
+	if (now - c->tls_wlast >= srv->tls_rec_idle)
+		c->tls_wsent = 0;
+	c->tls_wlast = now;
+
+	if (c->tls_wsent >= srv->tls_rec_boost)
+		return (NETBUF_TLS_RECORD_MAX);
+
+	return (srv->tls_rec_small);
+}
+
 int
 net_write_tls(struct connection *c, size_t len, size_t *written)
 {
@@ -17,6 +17,11 @@
 #include <sys/param.h>
 #include <sys/queue.h>
 
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
 #include <libpq-fe.h>
 #include <pg_config.h>
 
@@ -45,29 +50,163 @@ static struct sock_filter filter_pgsql[] = {
 #endif
 
 struct pgsql_wait {
+	int			prio;
+	struct pgsql_db		*db;
 	struct kore_pgsql	*pgsql;
 	TAILQ_ENTRY(pgsql_wait)	list;
 };
 
 struct pgsql_job {
 	struct kore_pgsql	*pgsql;
+	struct pgsql_prepare	*prepare;
 	TAILQ_ENTRY(pgsql_job)	list;
 };
 
+/* An async query held back until its statement was prepared. */
+struct pgsql_prepare {
+	struct pgsql_statement	*stmt;
+	int			step;
+	int			binary;
+	int			count;
+	char			*data;
+	const char		**values;
+	int			*lengths;
+	int			*formats;
+};
+
+struct pgsql_statement {
+	char				*name;
+	char				*query;
+	LIST_ENTRY(pgsql_statement)	list;
+};
+
+struct pgsql_prepared {
+	struct pgsql_statement		*stmt;
+	TAILQ_ENTRY(pgsql_prepared)	list;
+};
+
 #define PGSQL_CONN_MAX		2
 #define PGSQL_CONN_FREE		0x01
+#define PGSQL_CONN_CONNECTING	0x02
+#define PGSQL_CONN_DEALLOCATE	0x04
+#define PGSQL_CONN_CHECKING	0x08
+#define PGSQL_CONN_WAITED	0x10
+#define PGSQL_DB_EJECTED	0x0001
 #define PGSQL_LIST_INSERTED	0x0100
+#define PGSQL_PIPELINE		0x0200
+#define PGSQL_QUEUE_EXPIRED	0x0400
+#define PGSQL_STREAM		0x0800
+#define PGSQL_COPY_IN		0x1000
+#define PGSQL_COPY_OUT		0x2000
+#define PGSQL_COPY_WRITE	0x4000
+#define PGSQL_COPY_BODY		0x8000
 #define PGSQL_QUEUE_LIMIT	1000
-
-static void	pgsql_queue_wakeup(void);
+#define PGSQL_CONN_CHECK	30
+#define PGSQL_QUEUE_TICK	50
+#define PGSQL_STATEMENT_MAX	32
+#define PGSQL_STATEMENT_NAME_MAX	63
+
+#define PGSQL_PREPARE_RESET	1
+#define PGSQL_PREPARE_EVICT	2
+#define PGSQL_PREPARE_STMT	3
+
+/* The type oids from pg_type.h that we decode, libpq does not have them. */
+#define PGSQL_BOOLOID		16
+#define PGSQL_BYTEAOID		17
+#define PGSQL_INT8OID		20
+#define PGSQL_INT2OID		21
+#define PGSQL_INT4OID		23
+#define PGSQL_TEXTOID		25
+#define PGSQL_JSONOID		114
+#define PGSQL_FLOAT4OID		700
+#define PGSQL_FLOAT8OID		701
+#define PGSQL_BPCHAROID		1042
+#define PGSQL_VARCHAROID	1043
+#define PGSQL_DATEOID		1082
+#define PGSQL_TIMESTAMPOID	1114
+#define PGSQL_TIMESTAMPTZOID	1184
+#define PGSQL_NUMERICOID	1700
+#define PGSQL_UUIDOID		2950
+#define PGSQL_JSONBOID		3802
+
+/* The sign word of a binary numeric. */
+#define PGSQL_NUMERIC_POS	0x0000
+#define PGSQL_NUMERIC_NEG	0x4000
+#define PGSQL_NUMERIC_NAN	0xc000
+#define PGSQL_NUMERIC_PINF	0xd000
+#define PGSQL_NUMERIC_NINF	0xf000
+
+/* Seconds from the unix epoch to the postgres one (2000-01-01). */
+#define PGSQL_EPOCH_SECS	946684800LL
+
+/* Dates further out than this do not fit a timestamp. */
+#define PGSQL_DAYS_MAX		100000000
+
+/* Replay lag of a replica in seconds, 0 when it is caught up. */
+#define PGSQL_REPLICA_QUERY						\
+	"SELECT CASE WHEN pg_last_wal_receive_lsn() = "			\
+	"pg_last_wal_replay_lsn() THEN 0 ELSE GREATEST(0, COALESCE("	\
+	"EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()), "	\
+	"0))::bigint END"
+
+static void	pgsql_queue_wakeup(struct pgsql_db *);
+static void	pgsql_queue_expire(void *, u_int64_t);
+static void	pgsql_queue_unlink(struct pgsql_wait *);
+static void	pgsql_queue_wait(struct kore_pgsql *);
+static void	pgsql_queue_fail(struct pgsql_wait *, const char *);
 static void	pgsql_cancel(struct kore_pgsql *);
 static void	pgsql_set_error(struct kore_pgsql *, const char *);
-static void	pgsql_queue_add(struct kore_pgsql *);
+static void	pgsql_queue_add(struct kore_pgsql *, struct pgsql_db *);
 static void	pgsql_queue_remove(struct kore_pgsql *);
 static void	pgsql_conn_release(struct kore_pgsql *);
 static void	pgsql_conn_cleanup(struct pgsql_conn *);
+static int	pgsql_conn_connect(struct pgsql_db *, struct kore_pgsql *);
+static void	pgsql_conn_connecting(struct pgsql_conn *, int);
+static void	pgsql_conn_maintain(void *, u_int64_t);
+static void	pgsql_conn_warmup(struct pgsql_db *);
+static int	pgsql_conn_expired(struct pgsql_conn *, u_int64_t);
 static void	pgsql_read_result(struct kore_pgsql *);
 static void	pgsql_schedule(struct kore_pgsql *);
+static int	pgsql_pipeline_exit(struct kore_pgsql *);
+static void	pgsql_stream_clear(struct kore_pgsql *);
+static void	pgsql_wake(struct kore_pgsql *);
+static int	pgsql_copy_out(struct kore_pgsql *);
+static int	pgsql_copy_flush(struct kore_pgsql *);
+static void	pgsql_copy_writable(struct kore_pgsql *);
+static PGresult	*pgsql_stream_row(struct kore_pgsql *, int *);
+static u_int8_t	*pgsql_binary(struct kore_pgsql *, int, int, Oid *, int *);
+static int	pgsql_json_value(struct kore_buf *, PGresult *, int, int);
+static void	pgsql_json_string(struct kore_buf *, const char *, size_t);
+static void	pgsql_json_time(struct kore_buf *, int64_t, int);
+static void	pgsql_json_text_time(struct kore_buf *, const char *, size_t);
+static int	pgsql_json_numeric(struct kore_buf *, const u_int8_t *, int);
+static void	pgsql_replica_check(struct pgsql_db *);
+static void	pgsql_replica_checked(struct pgsql_conn *, int);
+static void	pgsql_replica_eject(struct pgsql_db *, const char *);
+static struct pgsql_db	*pgsql_replica_pick(struct pgsql_db *);
+static void	pgsql_prepared_flush(struct pgsql_conn *);
+static void	pgsql_prepared_check(struct pgsql_conn *, PGresult *);
+static int	pgsql_prepared_get(struct kore_pgsql *,
+		    struct pgsql_statement *, int *);
+static int	pgsql_prepare_start(struct kore_pgsql *,
+		    struct pgsql_statement *, int, int, const char **,
+		    int *, int *);
+static int	pgsql_prepare_next(struct kore_pgsql *);
+static void	pgsql_prepare_read(struct kore_pgsql *);
+static void	pgsql_prepare_free(struct pgsql_job *);
+static int	pgsql_query_dispatch(struct kore_pgsql *, const char *,
+		    struct pgsql_statement *, int, int, const char **,
+		    int *, int *);
+static int	pgsql_v_query(struct kore_pgsql *, const char *,
+		    struct pgsql_statement *, int, int, va_list);
+static int	pgsql_query_send(struct kore_pgsql *, const char *,
+		    struct pgsql_statement *, int, int, const char **,
+		    int *, int *);
+
+static struct pgsql_db		*pgsql_db_lookup(const char *);
+static struct pgsql_db		*pgsql_db_create(const char *, const char *);
+static struct pgsql_statement	*pgsql_statement_lookup(struct kore_pgsql *,
+				    const char *);
 
 static struct pgsql_conn	*pgsql_conn_create(struct kore_pgsql *,
 				    struct pgsql_db *);
@@ -76,19 +215,26 @@ static struct pgsql_conn	*pgsql_conn_next(struct kore_pgsql *,
 
 static struct kore_pool			pgsql_job_pool;
 static struct kore_pool			pgsql_wait_pool;
-static TAILQ_HEAD(, pgsql_conn)		pgsql_conn_free;
-static TAILQ_HEAD(, pgsql_wait)		pgsql_wait_queue;
+static struct kore_timer		*pgsql_queue_timer = NULL;
+
+/* Same shares as the http request classes get of a worker. */
+static const int64_t	pgsql_prio_weight[KORE_PGSQL_PRIO_MAX] = { 4, 2, 1 };
 static LIST_HEAD(, pgsql_db)		pgsql_db_conn_strings;
 
 u_int32_t	pgsql_queue_count = 0;
+u_int16_t	pgsql_conn_min = 0;
 u_int16_t	pgsql_conn_max = PGSQL_CONN_MAX;
+u_int32_t	pgsql_conn_lifetime = 0;
+u_int32_t	pgsql_conn_check = PGSQL_CONN_CHECK;
+u_int16_t	pgsql_statement_max = PGSQL_STATEMENT_MAX;
+u_int32_t	pgsql_replica_lag = 0;
 u_int32_t	pgsql_queue_limit = PGSQL_QUEUE_LIMIT;
+u_int64_t	pgsql_queue_timeout = 0;
+u_int64_t	pgsql_queue_timeouts = 0;
 
 void
 kore_pgsql_sys_init(void)
 {
-	TAILQ_INIT(&pgsql_conn_free);
-	TAILQ_INIT(&pgsql_wait_queue);
 	LIST_INIT(&pgsql_db_conn_strings);
 
 	kore_pool_init(&pgsql_job_pool, "pgsql_job_pool",
@@ -105,14 +251,33 @@ kore_pgsql_sys_init(void)
 void
 kore_pgsql_sys_cleanup(void)
 {
-	struct pgsql_conn	*conn, *next;
+	struct pgsql_db		*db;
+	struct pgsql_conn	*conn;
 
 	kore_pool_cleanup(&pgsql_job_pool);
 	kore_pool_cleanup(&pgsql_wait_pool);
 
-	for (conn = TAILQ_FIRST(&pgsql_conn_free); conn != NULL; conn = next) {
-		next = TAILQ_NEXT(conn, list);
-		pgsql_conn_cleanup(conn);
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		while ((conn = TAILQ_FIRST(&db->conn_free)) != NULL)
+			pgsql_conn_cleanup(conn);
+	}
+}
+
+/*
+ * Open the pgsql_conn_min connections of every database in the
+ * background and start the timer that checks idle connections.
+ */
+void
+kore_pgsql_worker_init(void)
+{
+	struct pgsql_db		*db;
+
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist)
+		pgsql_conn_warmup(db);
+
+	if (pgsql_conn_check != 0) {
+		kore_timer_add(pgsql_conn_maintain,
+		    pgsql_conn_check * 1000, NULL, 0);
 	}
 }
 
@@ -121,6 +286,8 @@ kore_pgsql_init(struct kore_pgsql *pgsql)
 {
 	memset(pgsql, 0, sizeof(*pgsql));
 	pgsql->state = KORE_PGSQL_STATE_INIT;
+	pgsql->prio = KORE_PGSQL_PRIO_NORMAL;
+	pgsql->timeout = pgsql_queue_timeout;
 }
 
 int
@@ -128,6 +295,10 @@ kore_pgsql_setup(struct kore_pgsql *pgsql, const char *dbname, int flags)
 {
 	struct pgsql_db		*db;
 
+	/* The error was set when it gave up waiting. */
+	if (pgsql->flags & PGSQL_QUEUE_EXPIRED)
+		return (KORE_RESULT_ERROR);
+
 	if ((flags & KORE_PGSQL_ASYNC) && (flags & KORE_PGSQL_SYNC)) {
 		pgsql_set_error(pgsql, "invalid query init parameters");
 		return (KORE_RESULT_ERROR);
@@ -140,25 +311,26 @@ kore_pgsql_setup(struct kore_pgsql *pgsql, const char *dbname, int flags)
 		}
 	}
 
-	db = NULL;
 	pgsql->flags |= flags;
 
-	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
-		if (!strcmp(db->name, dbname))
-			break;
-	}
-
-	if (db == NULL) {
+	if ((db = pgsql_db_lookup(dbname)) == NULL) {
 		pgsql_set_error(pgsql, "no database found");
 		return (KORE_RESULT_ERROR);
 	}
 
+	if (pgsql->flags & KORE_PGSQL_READONLY)
+		db = pgsql_replica_pick(db);
+
 	if ((pgsql->conn = pgsql_conn_next(pgsql, db)) == NULL)
 		return (KORE_RESULT_ERROR);
 
+	if (pgsql->queued != 0)
+		pgsql_queue_wait(pgsql);
+
 	if (pgsql->flags & KORE_PGSQL_ASYNC) {
 		pgsql->conn->job = kore_pool_get(&pgsql_job_pool);
 		pgsql->conn->job->pgsql = pgsql;
+		pgsql->conn->job->prepare = NULL;
 	}
 
 	return (KORE_RESULT_OK);
@@ -172,6 +344,7 @@ kore_pgsql_bind_request(struct kore_pgsql *pgsql, struct http_request *req)
 		fatal("kore_pgsql_bind_request: already bound");
 
 	pgsql->req = req;
+	pgsql->prio = req->prio;
 	pgsql->flags |= PGSQL_LIST_INSERTED;
 
 	LIST_INSERT_HEAD(&(req->pgsqls), pgsql, rlist);
@@ -200,6 +373,12 @@ kore_pgsql_query(struct kore_pgsql *pgsql, const void *query)
 		return (KORE_RESULT_ERROR);
 	}
 
+	/* Pipelines only allow the extended query protocol. */
+	if (pgsql->flags & PGSQL_PIPELINE) {
+		return (kore_pgsql_query_param_fields(pgsql, query,
+		    0, 0, NULL, NULL, NULL));
+	}
+
 	if (pgsql->flags & KORE_PGSQL_SYNC) {
 		pgsql->result = PQexec(pgsql->conn->db, query);
 		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
@@ -215,6 +394,12 @@ kore_pgsql_query(struct kore_pgsql *pgsql, const void *query)
 			return (KORE_RESULT_ERROR);
 		}
 
+		if ((pgsql->flags & PGSQL_STREAM) &&
+		    !PQsetSingleRowMode(pgsql->conn->db)) {
+			pgsql_set_error(pgsql, "failed to enter single row mode");
+			return (KORE_RESULT_ERROR);
+		}
+
 		pgsql_schedule(pgsql);
 	}
 
@@ -225,573 +410,2925 @@ int
 kore_pgsql_v_query_params(struct kore_pgsql *pgsql,
     const void *query, int binary, int count, va_list args)
 {
-	int		i;
-	const char	**values;
-	int		*lengths, *formats, ret;
-
-	if (pgsql->conn == NULL) {
-		pgsql_set_error(pgsql, "no connection was set before query");
-		return (KORE_RESULT_ERROR);
-	}
-
-	if (count > 0) {
-		lengths = kore_calloc(count, sizeof(int));
-		formats = kore_calloc(count, sizeof(int));
-		values = kore_calloc(count, sizeof(char *));
+	return (pgsql_v_query(pgsql, query, NULL, binary, count, args));
+}
 
-		for (i = 0; i < count; i++) {
-			values[i] = va_arg(args, void *);
-			lengths[i] = va_arg(args, int);
-			formats[i] = va_arg(args, int);
-		}
-	} else {
-		lengths = NULL;
-		formats = NULL;
-		values = NULL;
-	}
+int
+kore_pgsql_query_param_fields(struct kore_pgsql *pgsql, const void *query,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	return (pgsql_query_send(pgsql, query, NULL, binary, count,
+	    values, lengths, formats));
+}
 
-	ret = kore_pgsql_query_param_fields(pgsql, query, binary, count,
-	    values, lengths, formats);
+int
+kore_pgsql_query_params(struct kore_pgsql *pgsql,
+    const void *query, int binary, int count, ...)
+{
+	int		ret;
+	va_list		args;
 
-	kore_free(values);
-	kore_free(lengths);
-	kore_free(formats);
+	va_start(args, count);
+	ret = kore_pgsql_v_query_params(pgsql, query, binary, count, args);
+	va_end(args);
 
 	return (ret);
 }
 
 int
-kore_pgsql_query_param_fields(struct kore_pgsql *pgsql, const void *query,
-    int binary, int count, const char **values, int *lengths, int *formats)
+kore_pgsql_statement(const char *dbname, const char *name, const char *query)
 {
-	if (pgsql->conn == NULL) {
-		pgsql_set_error(pgsql, "no connection was set before query");
+	const char		*p;
+	struct pgsql_db		*db;
+	struct pgsql_statement	*stmt;
+
+	if ((db = pgsql_db_lookup(dbname)) == NULL)
 		return (KORE_RESULT_ERROR);
-	}
 
-	if (pgsql->flags & KORE_PGSQL_SYNC) {
-		pgsql->result = PQexecParams(pgsql->conn->db, query, count,
-		    NULL, (const char * const *)values, lengths, formats,
-		    binary);
+	/* The name ends up unquoted in DEALLOCATE. */
+	if (*name == '\0' || strlen(name) > PGSQL_STATEMENT_NAME_MAX)
+		return (KORE_RESULT_ERROR);
 
-		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
-		    (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK)) {
-			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+	for (p = name; *p != '\0'; p++) {
+		if (!isalnum(*(const unsigned char *)p) && *p != '_')
 			return (KORE_RESULT_ERROR);
-		}
+	}
 
-		pgsql->state = KORE_PGSQL_STATE_DONE;
-	} else {
-		if (!PQsendQueryParams(pgsql->conn->db, query, count, NULL,
-		    (const char * const *)values, lengths, formats, binary)) {
-			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+	LIST_FOREACH(stmt, &db->statements, list) {
+		if (!strcmp(stmt->name, name))
 			return (KORE_RESULT_ERROR);
-		}
-
-		pgsql_schedule(pgsql);
 	}
 
+	stmt = kore_malloc(sizeof(*stmt));
+	stmt->name = kore_strdup(name);
+	stmt->query = kore_strdup(query);
+	LIST_INSERT_HEAD(&db->statements, stmt, list);
+
 	return (KORE_RESULT_OK);
 }
 
 int
-kore_pgsql_query_params(struct kore_pgsql *pgsql,
-    const void *query, int binary, int count, ...)
+kore_pgsql_v_query_prepared(struct kore_pgsql *pgsql,
+    const char *name, int binary, int count, va_list args)
+{
+	struct pgsql_statement	*stmt;
+
+	if ((stmt = pgsql_statement_lookup(pgsql, name)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (pgsql_v_query(pgsql, stmt->query, stmt, binary, count, args));
+}
+
+int
+kore_pgsql_query_prepared_fields(struct kore_pgsql *pgsql, const char *name,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	struct pgsql_statement	*stmt;
+
+	if ((stmt = pgsql_statement_lookup(pgsql, name)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	return (pgsql_query_send(pgsql, stmt->query, stmt, binary, count,
+	    values, lengths, formats));
+}
+
+int
+kore_pgsql_query_prepared(struct kore_pgsql *pgsql,
+    const char *name, int binary, int count, ...)
 {
 	int		ret;
 	va_list		args;
 
 	va_start(args, count);
-	ret = kore_pgsql_v_query_params(pgsql, query, binary, count, args);
+	ret = kore_pgsql_v_query_prepared(pgsql, name, binary, count, args);
 	va_end(args);
 
 	return (ret);
 }
 
+/*
+ * Put the connection in pipeline mode: the queries issued after this are
+ * queued and only sent to the server with kore_pgsql_pipeline_sync().
+ *
+ * Their results come back in order through the usual states, with
+ * pipeline.index telling which query a result belongs to. A query that
+ * does not return rows still gets a KORE_PGSQL_STATE_RESULT without
+ * tuples. KORE_PGSQL_STATE_DONE is reached after the last query.
+ *
+ * Unless the queries manage their own transaction they run in a single
+ * implicit one. If a query fails it is reported as KORE_PGSQL_STATE_ERROR
+ * and pipeline.failed is set to its index. The server skips the queries
+ * after it and rolls back the ones before it. Calling kore_pgsql_continue()
+ * from there still ends in KORE_PGSQL_STATE_DONE.
+ */
 int
-kore_pgsql_register(const char *dbname, const char *connstring)
+kore_pgsql_pipeline(struct kore_pgsql *pgsql)
 {
-	struct pgsql_db		*pgsqldb;
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before pipeline");
+		return (KORE_RESULT_ERROR);
+	}
 
-	LIST_FOREACH(pgsqldb, &pgsql_db_conn_strings, rlist) {
-		if (!strcmp(pgsqldb->name, dbname))
-			return (KORE_RESULT_ERROR);
+	if (!(pgsql->flags & KORE_PGSQL_ASYNC)) {
+		pgsql_set_error(pgsql, "pipeline requires an async query");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (pgsql->flags & (PGSQL_PIPELINE | PGSQL_STREAM |
+	    KORE_PGSQL_SCHEDULED)) {
+		pgsql_set_error(pgsql, "query was already started");
+		return (KORE_RESULT_ERROR);
 	}
 
-	pgsqldb = kore_malloc(sizeof(*pgsqldb));
-	pgsqldb->name = kore_strdup(dbname);
-	pgsqldb->conn_count = 0;
-	pgsqldb->conn_max = pgsql_conn_max;
-	pgsqldb->conn_string = kore_strdup(connstring);
-	LIST_INSERT_HEAD(&pgsql_db_conn_strings, pgsqldb, rlist);
+#if PG_VERSION_NUM >= 140000
+	if (!PQenterPipelineMode(pgsql->conn->db)) {
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+
+	pgsql->flags |= PGSQL_PIPELINE;
+	pgsql->pipeline.index = 0;
+	pgsql->pipeline.count = 0;
+	pgsql->pipeline.failed = -1;
 
 	return (KORE_RESULT_OK);
+#else
+	pgsql_set_error(pgsql, "pipeline requires libpq 14 or newer");
+	return (KORE_RESULT_ERROR);
+#endif
 }
 
-void
-kore_pgsql_handle(void *c, int err)
+int
+kore_pgsql_pipeline_sync(struct kore_pgsql *pgsql)
 {
-	struct kore_pgsql	*pgsql;
-	struct pgsql_conn	*conn = (struct pgsql_conn *)c;
+	if (!(pgsql->flags & PGSQL_PIPELINE)) {
+		pgsql_set_error(pgsql, "not in pipeline mode");
+		return (KORE_RESULT_ERROR);
+	}
 
-	if (err) {
-		pgsql_conn_cleanup(conn);
-		return;
+	if (pgsql->flags & KORE_PGSQL_SCHEDULED) {
+		pgsql_set_error(pgsql, "pipeline was already synced");
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (!(conn->evt.flags & KORE_EVENT_READ))
-		fatal("%s: read event not set", __func__);
+	if (pgsql->pipeline.count == 0) {
+		pgsql_set_error(pgsql, "pipeline has no queries");
+		return (KORE_RESULT_ERROR);
+	}
 
-	pgsql = conn->job->pgsql;
+#if PG_VERSION_NUM >= 140000
+	if (!PQpipelineSync(pgsql->conn->db)) {
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+#endif
 
-	pgsql_read_result(pgsql);
+	pgsql_schedule(pgsql);
 
-	if (pgsql->state == KORE_PGSQL_STATE_WAIT) {
-#if !defined(KORE_NO_HTTP)
-		if (pgsql->req != NULL)
-			http_request_sleep(pgsql->req);
-#endif
-		if (pgsql->cb != NULL)
-			pgsql->cb(pgsql, pgsql->arg);
-	} else {
-#if !defined(KORE_NO_HTTP)
-		if (pgsql->req != NULL)
-			http_request_wakeup(pgsql->req);
-#endif
-		if (pgsql->cb != NULL)
-			pgsql->cb(pgsql, pgsql->arg);
-	}
+	return (KORE_RESULT_OK);
 }
 
-void
-kore_pgsql_continue(struct kore_pgsql *pgsql)
+/*
+ * Deliver the rows of the queries that follow as they arrive instead of
+ * once the whole result was read. Each KORE_PGSQL_STATE_RESULT then
+ * carries up to batch rows, read through the usual accessors with row
+ * numbers relative to the batch, and kore_pgsql_continue() fetches the
+ * next batch.
+ *
+ * Nothing is read from the server while a batch is held, so a handler
+ * that only continues once it wrote the batch out keeps the worker's
+ * memory bounded by batch rows no matter how large the result is.
+ */
+int
+kore_pgsql_stream(struct kore_pgsql *pgsql, u_int16_t batch)
 {
-	if (pgsql->error) {
-		kore_free(pgsql->error);
-		pgsql->error = NULL;
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before stream");
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (pgsql->result) {
-		PQclear(pgsql->result);
-		pgsql->result = NULL;
+	if (!(pgsql->flags & KORE_PGSQL_ASYNC)) {
+		pgsql_set_error(pgsql, "stream requires an async query");
+		return (KORE_RESULT_ERROR);
 	}
 
-	switch (pgsql->state) {
-	case KORE_PGSQL_STATE_INIT:
-	case KORE_PGSQL_STATE_WAIT:
-		break;
-	case KORE_PGSQL_STATE_DONE:
-#if !defined(KORE_NO_HTTP)
-		if (pgsql->req != NULL)
-			http_request_wakeup(pgsql->req);
-#endif
-		pgsql_conn_release(pgsql);
-		break;
-	case KORE_PGSQL_STATE_ERROR:
-	case KORE_PGSQL_STATE_RESULT:
-	case KORE_PGSQL_STATE_NOTIFY:
-		kore_pgsql_handle(pgsql->conn, 0);
-		break;
-	default:
-		fatal("unknown pgsql state %d", pgsql->state);
+	if (pgsql->flags & (PGSQL_PIPELINE | PGSQL_STREAM |
+	    KORE_PGSQL_SCHEDULED)) {
+		pgsql_set_error(pgsql, "query was already started");
+		return (KORE_RESULT_ERROR);
 	}
-}
 
-void
-kore_pgsql_cleanup(struct kore_pgsql *pgsql)
-{
-	pgsql_queue_remove(pgsql);
+	if (batch == 0) {
+		pgsql_set_error(pgsql, "invalid stream batch size");
+		return (KORE_RESULT_ERROR);
+	}
 
-	if (pgsql->result != NULL)
-		PQclear(pgsql->result);
+	pgsql->flags |= PGSQL_STREAM;
+	pgsql->stream.batch = batch;
+	pgsql->stream.count = 0;
+	pgsql->stream.rows = kore_calloc(batch, sizeof(PGresult *));
 
-	if (pgsql->error != NULL)
-		kore_free(pgsql->error);
+	return (KORE_RESULT_OK);
+}
 
-	if (pgsql->conn != NULL)
-		pgsql_conn_release(pgsql);
+/*
+ * Send data for a COPY FROM STDIN once the query reached
+ * KORE_PGSQL_STATE_COPY_IN. Returns KORE_RESULT_RETRY if the data could
+ * not be taken yet because earlier data is still going out, the request
+ * or callback is woken up in KORE_PGSQL_STATE_COPY_IN again once the
+ * connection drained.
+ */
+int
+kore_pgsql_copy_put(struct kore_pgsql *pgsql, const void *data, size_t len)
+{
+	if (!(pgsql->flags & PGSQL_COPY_IN)) {
+		pgsql_set_error(pgsql, "no copy in progress");
+		return (KORE_RESULT_ERROR);
+	}
 
-	pgsql->result = NULL;
-	pgsql->error = NULL;
-	pgsql->conn = NULL;
+	if (len > INT_MAX) {
+		pgsql_set_error(pgsql, "copy data too large");
+		return (KORE_RESULT_ERROR);
+	}
 
-	if (pgsql->flags & PGSQL_LIST_INSERTED) {
-		LIST_REMOVE(pgsql, rlist);
-		pgsql->flags &= ~PGSQL_LIST_INSERTED;
+	if (pgsql->flags & PGSQL_COPY_WRITE)
+		goto wait;
+
+	switch (PQputCopyData(pgsql->conn->db, data, len)) {
+	case 1:
+		if (pgsql_copy_flush(pgsql) == KORE_RESULT_ERROR)
+			return (KORE_RESULT_ERROR);
+		return (KORE_RESULT_OK);
+	case 0:
+		if (pgsql_copy_flush(pgsql) == KORE_RESULT_ERROR)
+			return (KORE_RESULT_ERROR);
+		break;
+	default:
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
 	}
-}
 
-void
-kore_pgsql_logerror(struct kore_pgsql *pgsql)
-{
-	kore_log(LOG_NOTICE, "pgsql error: %s",
-	    (pgsql->error) ? pgsql->error : "unknown");
+wait:
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_sleep(pgsql->req);
+#endif
+	return (KORE_RESULT_RETRY);
 }
 
+/*
+ * Finish a COPY FROM STDIN, or abort it with error as the reason. The
+ * query then goes on to KORE_PGSQL_STATE_DONE or ERROR like any other.
+ * Returns KORE_RESULT_RETRY in the same cases kore_pgsql_copy_put() does.
+ */
 int
-kore_pgsql_ntuples(struct kore_pgsql *pgsql)
+kore_pgsql_copy_end(struct kore_pgsql *pgsql, const char *error)
 {
-	return (PQntuples(pgsql->result));
-}
+	if (!(pgsql->flags & PGSQL_COPY_IN)) {
+		pgsql_set_error(pgsql, "no copy in progress");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (pgsql->flags & PGSQL_COPY_WRITE)
+		goto wait;
+
+	switch (PQputCopyEnd(pgsql->conn->db, error)) {
+	case 1:
+		break;
+	case 0:
+		if (pgsql_copy_flush(pgsql) == KORE_RESULT_ERROR)
+			return (KORE_RESULT_ERROR);
+		goto wait;
+	default:
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+
+	pgsql->flags &= ~PGSQL_COPY_IN;
+	pgsql->state = KORE_PGSQL_STATE_WAIT;
+
+	if (pgsql_copy_flush(pgsql) == KORE_RESULT_ERROR)
+		return (KORE_RESULT_ERROR);
+
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_sleep(pgsql->req);
+#endif
+
+	/* Already out, pick up whatever the server said meanwhile. */
+	if (!(pgsql->flags & PGSQL_COPY_WRITE)) {
+		pgsql->conn->evt.flags |= KORE_EVENT_READ;
+		kore_pgsql_handle(pgsql->conn, 0);
+	}
+
+	return (KORE_RESULT_OK);
+
+wait:
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_sleep(pgsql->req);
+#endif
+	return (KORE_RESULT_RETRY);
+}
+
+#if !defined(KORE_NO_HTTP)
+/*
+ * Body callback for http_body_stream() that feeds a streamed request
+ * body into the COPY FROM STDIN of the pgsql bound to the request.
+ * Reading the body pauses while the connection to the server is full.
+ */
+int
+kore_pgsql_copy_body(struct http_request *req, const void *data, size_t len)
+{
+	int			r;
+	struct kore_pgsql	*pgsql;
+
+	LIST_FOREACH(pgsql, &req->pgsqls, rlist) {
+		if (pgsql->flags & PGSQL_COPY_IN)
+			break;
+	}
+
+	if (pgsql == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if ((r = kore_pgsql_copy_put(pgsql, data, len)) == KORE_RESULT_RETRY)
+		pgsql->flags |= PGSQL_COPY_BODY;
+
+	return (r);
+}
+#endif
+
+int
+kore_pgsql_register(const char *dbname, const char *connstring)
+{
+	if (pgsql_db_lookup(dbname) != NULL)
+		return (KORE_RESULT_ERROR);
+
+	(void)pgsql_db_create(dbname, connstring);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Add a read replica to the already registered database dbname. Queries
+ * set up with KORE_PGSQL_READONLY go to the least loaded replica that
+ * passes its health checks, or to the primary if there is none.
+ */
+int
+kore_pgsql_register_replica(const char *dbname, const char *connstring)
+{
+	char			name[64];
+	struct pgsql_db		*db, *replica;
+	int			len, count;
+
+	if ((db = pgsql_db_lookup(dbname)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	count = 1;
+	TAILQ_FOREACH(replica, &db->replicas, replica)
+		count++;
+
+	len = snprintf(name, sizeof(name), "%s:%d", dbname, count);
+	if (len == -1 || (size_t)len >= sizeof(name))
+		return (KORE_RESULT_ERROR);
+
+	replica = pgsql_db_create(name, connstring);
+	replica->primary = db;
+	TAILQ_INSERT_TAIL(&db->replicas, replica, replica);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_pgsql_handle(void *c, int err)
+{
+	struct kore_pgsql	*pgsql;
+	struct pgsql_conn	*conn = (struct pgsql_conn *)c;
+
+	if (conn->flags & PGSQL_CONN_CONNECTING) {
+		pgsql_conn_connecting(conn, err);
+		return;
+	}
+
+	if (conn->flags & PGSQL_CONN_CHECKING) {
+		pgsql_replica_checked(conn, err);
+		return;
+	}
+
+	if (err) {
+		pgsql_conn_cleanup(conn);
+		return;
+	}
+
+	pgsql = conn->job->pgsql;
+
+	if (conn->job->prepare != NULL) {
+		pgsql_prepare_read(pgsql);
+		if (pgsql->state != KORE_PGSQL_STATE_WAIT)
+			pgsql_wake(pgsql);
+		return;
+	}
+
+	if (pgsql->flags & (PGSQL_COPY_IN | PGSQL_COPY_WRITE)) {
+		/* The server only talks again once the copy ended. */
+		if (conn->evt.flags & KORE_EVENT_READ)
+			(void)PQconsumeInput(conn->db);
+
+		if (!(pgsql->flags & PGSQL_COPY_WRITE))
+			return;
+
+		switch (pgsql_copy_flush(pgsql)) {
+		case KORE_RESULT_OK:
+			break;
+		case KORE_RESULT_RETRY:
+			return;
+		default:
+			pgsql_wake(pgsql);
+			return;
+		}
+
+		if (pgsql->flags & PGSQL_COPY_IN) {
+			pgsql_copy_writable(pgsql);
+			return;
+		}
+
+		/* The end of the copy is out, its result may be in already. */
+		conn->evt.flags |= KORE_EVENT_READ;
+	}
+
+	if (!(conn->evt.flags & KORE_EVENT_READ))
+		fatal("%s: read event not set", __func__);
+
+	/* Leave the socket alone until the batch was consumed. */
+	if (pgsql->stream.count > 0 || pgsql->copy.data != NULL)
+		return;
+
+	pgsql_read_result(pgsql);
+
+	if (pgsql->state == KORE_PGSQL_STATE_WAIT) {
+#if !defined(KORE_NO_HTTP)
+		if (pgsql->req != NULL)
+			http_request_sleep(pgsql->req);
+#endif
+		if (pgsql->cb != NULL)
+			pgsql->cb(pgsql, pgsql->arg);
+	} else {
+		pgsql_wake(pgsql);
+	}
+}
+
+void
+kore_pgsql_continue(struct kore_pgsql *pgsql)
+{
+	if (pgsql->error) {
+		kore_free(pgsql->error);
+		pgsql->error = NULL;
+	}
+
+	if (pgsql->result) {
+		PQclear(pgsql->result);
+		pgsql->result = NULL;
+	}
+
+	pgsql_stream_clear(pgsql);
+
+	if (pgsql->copy.data != NULL) {
+		PQfreemem(pgsql->copy.data);
+		pgsql->copy.data = NULL;
+		pgsql->copy.len = 0;
+	}
+
+	switch (pgsql->state) {
+	case KORE_PGSQL_STATE_INIT:
+	case KORE_PGSQL_STATE_WAIT:
+	case KORE_PGSQL_STATE_COPY_IN:
+		break;
+	case KORE_PGSQL_STATE_DONE:
+#if !defined(KORE_NO_HTTP)
+		if (pgsql->req != NULL)
+			http_request_wakeup_from(pgsql->req,
+			    HTTP_WAKEUP_PGSQL);
+#endif
+		pgsql_conn_release(pgsql);
+		break;
+	case KORE_PGSQL_STATE_ERROR:
+	case KORE_PGSQL_STATE_RESULT:
+	case KORE_PGSQL_STATE_NOTIFY:
+	case KORE_PGSQL_STATE_COPY_OUT:
+		kore_pgsql_handle(pgsql->conn, 0);
+		break;
+	default:
+		fatal("unknown pgsql state %d", pgsql->state);
+	}
+}
+
+void
+kore_pgsql_cleanup(struct kore_pgsql *pgsql)
+{
+	pgsql_queue_remove(pgsql);
+
+	if (pgsql->result != NULL)
+		PQclear(pgsql->result);
+
+	if (pgsql->error != NULL)
+		kore_free(pgsql->error);
+
+	pgsql_stream_clear(pgsql);
+	kore_free(pgsql->stream.rows);
+
+	if (pgsql->copy.data != NULL)
+		PQfreemem(pgsql->copy.data);
+
+	if (pgsql->conn != NULL)
+		pgsql_conn_release(pgsql);
+
+	pgsql->result = NULL;
+	pgsql->error = NULL;
+	pgsql->conn = NULL;
+	pgsql->stream.rows = NULL;
+	pgsql->copy.data = NULL;
+
+	if (pgsql->flags & PGSQL_LIST_INSERTED) {
+		LIST_REMOVE(pgsql, rlist);
+		pgsql->flags &= ~PGSQL_LIST_INSERTED;
+	}
+}
+
+void
+kore_pgsql_logerror(struct kore_pgsql *pgsql)
+{
+	kore_log(LOG_NOTICE, "pgsql error: %s",
+	    (pgsql->error) ? pgsql->error : "unknown");
+}
+
+int
+kore_pgsql_ntuples(struct kore_pgsql *pgsql)
+{
+	if (pgsql->stream.count > 0)
+		return (pgsql->stream.count);
+
+	return (PQntuples(pgsql->result));
+}
 
 int
 kore_pgsql_nfields(struct kore_pgsql *pgsql)
 {
-	return (PQnfields(pgsql->result));
+	int		row = 0;
+
+	return (PQnfields(pgsql_stream_row(pgsql, &row)));
+}
+
+int
+kore_pgsql_getlength(struct kore_pgsql *pgsql, int row, int col)
+{
+	PGresult	*result;
+
+	result = pgsql_stream_row(pgsql, &row);
+
+	return (PQgetlength(result, row, col));
+}
+
+char *
+kore_pgsql_fieldname(struct kore_pgsql *pgsql, int field)
+{
+	int		row = 0;
+
+	return (PQfname(pgsql_stream_row(pgsql, &row), field));
+}
+
+char *
+kore_pgsql_getvalue(struct kore_pgsql *pgsql, int row, int col)
+{
+	PGresult	*result;
+
+	result = pgsql_stream_row(pgsql, &row);
+
+	return (PQgetvalue(result, row, col));
+}
+
+int
+kore_pgsql_column_binary(struct kore_pgsql *pgsql, int col)
+{
+	int		row = 0;
+
+	return (PQfformat(pgsql_stream_row(pgsql, &row), col));
+}
+
+/*
+ * Typed accessors for results in binary format (see the binary argument
+ * of kore_pgsql_query_params() and friends). They fail on NULL values,
+ * text columns and types they do not know, a smaller integer or float
+ * type is widened.
+ */
+int
+kore_pgsql_getint4(struct kore_pgsql *pgsql, int row, int col, int32_t *out)
+{
+	Oid		type;
+	int		len;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type == PGSQL_INT2OID && len == sizeof(int16_t))
+		*out = (int16_t)net_read16(val);
+	else if (type == PGSQL_INT4OID && len == sizeof(int32_t))
+		*out = (int32_t)net_read32(val);
+	else
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_pgsql_getint8(struct kore_pgsql *pgsql, int row, int col, int64_t *out)
+{
+	Oid		type;
+	int		len;
+	int32_t		v32;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type == PGSQL_INT8OID && len == sizeof(int64_t)) {
+		*out = (int64_t)net_read64(val);
+		return (KORE_RESULT_OK);
+	}
+
+	if (!kore_pgsql_getint4(pgsql, row, col, &v32))
+		return (KORE_RESULT_ERROR);
+
+	*out = v32;
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_pgsql_getfloat8(struct kore_pgsql *pgsql, int row, int col, double *out)
+{
+	Oid		type;
+	int		len;
+	float		f;
+	u_int32_t	v32;
+	u_int64_t	v64;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type == PGSQL_FLOAT8OID && len == sizeof(v64)) {
+		v64 = net_read64(val);
+		memcpy(out, &v64, sizeof(*out));
+	} else if (type == PGSQL_FLOAT4OID && len == sizeof(v32)) {
+		v32 = net_read32(val);
+		memcpy(&f, &v32, sizeof(f));
+		*out = f;
+	} else {
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+int
+kore_pgsql_getbool(struct kore_pgsql *pgsql, int row, int col, int *out)
+{
+	Oid		type;
+	int		len;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type != PGSQL_BOOLOID || len != 1)
+		return (KORE_RESULT_ERROR);
+
+	*out = (*val != 0);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * A timestamp or timestamptz as microseconds since the unix epoch, in
+ * UTC for the latter. Infinity comes back as INT64_MAX or INT64_MIN.
+ */
+int
+kore_pgsql_gettimestamp(struct kore_pgsql *pgsql, int row, int col,
+    int64_t *out)
+{
+	Oid		type;
+	int		len;
+	int64_t		usec;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if ((type != PGSQL_TIMESTAMPOID && type != PGSQL_TIMESTAMPTZOID) ||
+	    len != sizeof(usec))
+		return (KORE_RESULT_ERROR);
+
+	usec = (int64_t)net_read64(val);
+	if (usec != INT64_MAX && usec != INT64_MIN)
+		usec += PGSQL_EPOCH_SECS * 1000000;
+
+	*out = usec;
+
+	return (KORE_RESULT_OK);
+}
+
+/* A uuid in its usual text form, out must hold KORE_PGSQL_UUID_LEN bytes. */
+int
+kore_pgsql_getuuid(struct kore_pgsql *pgsql, int row, int col,
+    char *out, size_t outlen)
+{
+	Oid		type;
+	u_int8_t	*val;
+	int		i, len;
+	char		*p;
+
+	if (outlen < KORE_PGSQL_UUID_LEN)
+		return (KORE_RESULT_ERROR);
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type != PGSQL_UUIDOID || len != 16)
+		return (KORE_RESULT_ERROR);
+
+	p = out;
+	for (i = 0; i < len; i++) {
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*p++ = '-';
+		*p++ = "0123456789abcdef"[val[i] >> 4];
+		*p++ = "0123456789abcdef"[val[i] & 0x0f];
+	}
+
+	*p = '\0';
+
+	return (KORE_RESULT_OK);
+}
+
+/* The raw bytes of a bytea, valid for as long as the result is. */
+int
+kore_pgsql_getbytea(struct kore_pgsql *pgsql, int row, int col,
+    const u_int8_t **out, size_t *outlen)
+{
+	Oid		type;
+	int		len;
+	u_int8_t	*val;
+
+	if ((val = pgsql_binary(pgsql, row, col, &type, &len)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (type != PGSQL_BYTEAOID)
+		return (KORE_RESULT_ERROR);
+
+	*out = val;
+	*outlen = len;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Append the rows of the current result (or stream batch) to buf as a
+ * JSON array of objects keyed by column name, without going through a
+ * kore_json_item tree. Text and binary results both work. Numbers and
+ * booleans stay numbers and booleans, numeric included, json columns
+ * are embedded as is, timestamps become ISO 8601 strings in UTC (text
+ * ones only in the ISO DateStyle, others are passed on as sent), bytea
+ * becomes base64 and other types become strings. NaN and Infinity
+ * become null. Fails on a binary column of a type we can not decode,
+ * buf then holds a partial array.
+ */
+int
+kore_pgsql_json(struct kore_pgsql *pgsql, struct kore_buf *buf)
+{
+	PGresult	*result;
+	const char	*name;
+	int		row, col, idx, rows, fields;
+
+	rows = kore_pgsql_ntuples(pgsql);
+	fields = kore_pgsql_nfields(pgsql);
+
+	kore_buf_append(buf, "[", 1);
+
+	for (idx = 0; idx < rows; idx++) {
+		row = idx;
+		result = pgsql_stream_row(pgsql, &row);
+
+		kore_buf_append(buf, idx == 0 ? "{" : ",{", idx == 0 ? 1 : 2);
+
+		for (col = 0; col < fields; col++) {
+			if (col > 0)
+				kore_buf_append(buf, ",", 1);
+
+			name = PQfname(result, col);
+			pgsql_json_string(buf, name, strlen(name));
+			kore_buf_append(buf, ":", 1);
+
+			if (!pgsql_json_value(buf, result, row, col))
+				return (KORE_RESULT_ERROR);
+		}
+
+		kore_buf_append(buf, "}", 1);
+	}
+
+	kore_buf_append(buf, "]", 1);
+
+	return (KORE_RESULT_OK);
+}
+
+static struct pgsql_conn *
+pgsql_conn_next(struct kore_pgsql *pgsql, struct pgsql_db *db)
+{
+	PGTransactionStatusType		state;
+	struct pgsql_conn		*conn;
+	struct kore_pgsql		rollback;
+
+rescan:
+	if ((conn = TAILQ_FIRST(&db->conn_free)) != NULL) {
+		if (!(conn->flags & PGSQL_CONN_FREE))
+			fatal("got a pgsql connection that was not free?");
+
+		if (PQstatus(conn->db) != CONNECTION_OK) {
+			pgsql_conn_cleanup(conn);
+			goto rescan;
+		}
+
+		state = PQtransactionStatus(conn->db);
+		if (state == PQTRANS_INERROR) {
+			conn->flags &= ~PGSQL_CONN_FREE;
+			TAILQ_REMOVE(&db->conn_free, conn, list);
+
+			kore_pgsql_init(&rollback);
+			rollback.conn = conn;
+			rollback.flags = KORE_PGSQL_SYNC;
+
+			if (!kore_pgsql_query(&rollback, "ROLLBACK")) {
+				kore_pgsql_logerror(&rollback);
+				kore_pgsql_cleanup(&rollback);
+				pgsql_conn_cleanup(conn);
+			} else {
+				kore_pgsql_cleanup(&rollback);
+			}
+
+			goto rescan;
+		}
+	}
+
+	if (conn == NULL) {
+		if (db->conn_max != 0 &&
+		    db->conn_count >= db->conn_max) {
+			if ((pgsql->flags & KORE_PGSQL_ASYNC) &&
+			    pgsql_queue_count < pgsql_queue_limit) {
+				pgsql_queue_add(pgsql, db);
+			} else {
+				pgsql_set_error(pgsql,
+				    "no available connection");
+			}
+
+			return (NULL);
+		}
+
+		/* Async queries wait in the queue until it is connected. */
+		if (pgsql->flags & KORE_PGSQL_ASYNC) {
+			if (pgsql_queue_count >= pgsql_queue_limit) {
+				pgsql_set_error(pgsql,
+				    "no available connection");
+			} else if (pgsql_conn_connect(db, pgsql)) {
+				pgsql_queue_add(pgsql, db);
+			}
+
+			return (NULL);
+		}
+
+		if ((conn = pgsql_conn_create(pgsql, db)) == NULL)
+			return (NULL);
+	}
+
+	conn->flags &= ~PGSQL_CONN_FREE;
+	TAILQ_REMOVE(&db->conn_free, conn, list);
+
+	return (conn);
+}
+
+static void
+pgsql_set_error(struct kore_pgsql *pgsql, const char *msg)
+{
+	if (pgsql->error != NULL)
+		kore_free(pgsql->error);
+
+	pgsql->error = kore_strdup(msg);
+	pgsql->state = KORE_PGSQL_STATE_ERROR;
+}
+
+static struct pgsql_db *
+pgsql_db_lookup(const char *name)
+{
+	struct pgsql_db		*db;
+
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		if (db->primary == NULL && !strcmp(db->name, name))
+			return (db);
+	}
+
+	return (NULL);
+}
+
+static struct pgsql_db *
+pgsql_db_create(const char *name, const char *connstring)
+{
+	int			i;
+	struct pgsql_db		*db;
+
+	db = kore_calloc(1, sizeof(*db));
+	db->name = kore_strdup(name);
+	db->conn_min = pgsql_conn_min;
+	db->conn_max = pgsql_conn_max;
+	db->conn_string = kore_strdup(connstring);
+	TAILQ_INIT(&db->conn_free);
+	TAILQ_INIT(&db->replicas);
+
+	for (i = 0; i < KORE_PGSQL_PRIO_MAX; i++)
+		TAILQ_INIT(&db->queue[i]);
+
+	LIST_INIT(&db->statements);
+	LIST_INSERT_HEAD(&pgsql_db_conn_strings, db, rlist);
+
+	return (db);
+}
+
+static int
+pgsql_v_query(struct kore_pgsql *pgsql, const char *query,
+    struct pgsql_statement *stmt, int binary, int count, va_list args)
+{
+	int		i;
+	const char	**values;
+	int		*lengths, *formats, ret;
+
+	if (count > 0) {
+		lengths = kore_calloc(count, sizeof(int));
+		formats = kore_calloc(count, sizeof(int));
+		values = kore_calloc(count, sizeof(char *));
+
+		for (i = 0; i < count; i++) {
+			values[i] = va_arg(args, void *);
+			lengths[i] = va_arg(args, int);
+			formats[i] = va_arg(args, int);
+		}
+	} else {
+		lengths = NULL;
+		formats = NULL;
+		values = NULL;
+	}
+
+	ret = pgsql_query_send(pgsql, query, stmt, binary, count,
+	    values, lengths, formats);
+
+	kore_free(values);
+	kore_free(lengths);
+	kore_free(formats);
+
+	return (ret);
+}
+
+/*
+ * Send a query with parameters, using the prepared statement stmt
+ * on this connection if there is one and it could be prepared.
+ */
+static int
+pgsql_query_send(struct kore_pgsql *pgsql, const char *query,
+    struct pgsql_statement *stmt, int binary, int count,
+    const char **values, int *lengths, int *formats)
+{
+	int		prepared;
+
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before query");
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (pgsql->flags & KORE_PGSQL_SCHEDULED &&
+	    pgsql->flags & PGSQL_PIPELINE) {
+		pgsql_set_error(pgsql, "pipeline was already synced");
+		return (KORE_RESULT_ERROR);
+	}
+
+	prepared = 0;
+	if (stmt != NULL) {
+		switch (pgsql_prepared_get(pgsql, stmt, &prepared)) {
+		case KORE_RESULT_OK:
+			break;
+		case KORE_RESULT_RETRY:
+			return (pgsql_prepare_start(pgsql, stmt, binary,
+			    count, values, lengths, formats));
+		default:
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	if (pgsql->flags & KORE_PGSQL_SYNC) {
+		if (prepared) {
+			pgsql->result = PQexecPrepared(pgsql->conn->db,
+			    stmt->name, count, (const char * const *)values,
+			    lengths, formats, binary);
+		} else {
+			pgsql->result = PQexecParams(pgsql->conn->db, query,
+			    count, NULL, (const char * const *)values,
+			    lengths, formats, binary);
+		}
+
+		if ((PQresultStatus(pgsql->result) != PGRES_TUPLES_OK) &&
+		    (PQresultStatus(pgsql->result) != PGRES_COMMAND_OK)) {
+			pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+			pgsql_prepared_check(pgsql->conn, pgsql->result);
+			return (KORE_RESULT_ERROR);
+		}
+
+		pgsql->state = KORE_PGSQL_STATE_DONE;
+	} else {
+		if (!pgsql_query_dispatch(pgsql, query, prepared ? stmt : NULL,
+		    binary, count, values, lengths, formats))
+			return (KORE_RESULT_ERROR);
+
+		/* Pipelined queries are sent by kore_pgsql_pipeline_sync(). */
+		if (pgsql->flags & PGSQL_PIPELINE)
+			pgsql->pipeline.count++;
+		else
+			pgsql_schedule(pgsql);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Send the query without waiting for it, as the prepared statement stmt
+ * if it is not NULL.
+ */
+static int
+pgsql_query_dispatch(struct kore_pgsql *pgsql, const char *query,
+    struct pgsql_statement *stmt, int binary, int count,
+    const char **values, int *lengths, int *formats)
+{
+	int		ret;
+
+	if (stmt != NULL) {
+		ret = PQsendQueryPrepared(pgsql->conn->db, stmt->name,
+		    count, (const char * const *)values, lengths,
+		    formats, binary);
+	} else {
+		ret = PQsendQueryParams(pgsql->conn->db, query, count,
+		    NULL, (const char * const *)values, lengths,
+		    formats, binary);
+	}
+
+	if (!ret) {
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+
+	if ((pgsql->flags & PGSQL_STREAM) &&
+	    !PQsetSingleRowMode(pgsql->conn->db)) {
+		pgsql_set_error(pgsql, "failed to enter single row mode");
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static struct pgsql_statement *
+pgsql_statement_lookup(struct kore_pgsql *pgsql, const char *name)
+{
+	struct pgsql_db		*db;
+	struct pgsql_statement	*stmt;
+
+	if (pgsql->conn == NULL) {
+		pgsql_set_error(pgsql, "no connection was set before query");
+		return (NULL);
+	}
+
+	/* Replicas share the statements of their primary. */
+	db = pgsql->conn->owner;
+	if (db->primary != NULL)
+		db = db->primary;
+
+	LIST_FOREACH(stmt, &db->statements, list) {
+		if (!strcmp(stmt->name, name))
+			return (stmt);
+	}
+
+	pgsql_set_error(pgsql, "no such statement");
+
+	return (NULL);
+}
+
+/*
+ * Look for stmt in the prepared statements of the connection, moving it
+ * to the front of the list. If it is missing it is prepared now, pushing
+ * out the least recently used statement when the connection is full.
+ *
+ * Async queries get KORE_RESULT_RETRY back instead, pgsql_prepare_start()
+ * then does the same without blocking. In a pipeline, or when the
+ * connection is in a failed transaction, the statement is not prepared
+ * and the query is sent as text.
+ */
+static int
+pgsql_prepared_get(struct kore_pgsql *pgsql, struct pgsql_statement *stmt,
+    int *prepared)
+{
+	PGresult		*result;
+	struct pgsql_prepared	*ps;
+	char			buf[128];
+	struct pgsql_conn	*conn = pgsql->conn;
+
+	*prepared = 0;
+
+	if (!(conn->flags & PGSQL_CONN_DEALLOCATE)) {
+		TAILQ_FOREACH(ps, &conn->prepared, list) {
+			if (ps->stmt == stmt)
+				break;
+		}
+
+		if (ps != NULL) {
+			if (ps != TAILQ_FIRST(&conn->prepared)) {
+				TAILQ_REMOVE(&conn->prepared, ps, list);
+				TAILQ_INSERT_HEAD(&conn->prepared, ps, list);
+			}
+
+			*prepared = 1;
+			return (KORE_RESULT_OK);
+		}
+	}
+
+	if (pgsql_statement_max == 0 || (pgsql->flags & PGSQL_PIPELINE) ||
+	    PQtransactionStatus(conn->db) == PQTRANS_INERROR)
+		return (KORE_RESULT_OK);
+
+	if (pgsql->flags & KORE_PGSQL_ASYNC)
+		return (KORE_RESULT_RETRY);
+
+	if (conn->flags & PGSQL_CONN_DEALLOCATE) {
+		result = PQexec(conn->db, "DEALLOCATE ALL");
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			PQclear(result);
+			return (KORE_RESULT_OK);
+		}
+
+		PQclear(result);
+		pgsql_prepared_flush(conn);
+		conn->flags &= ~PGSQL_CONN_DEALLOCATE;
+	}
+
+	if (conn->nprepared >= pgsql_statement_max) {
+		ps = TAILQ_LAST(&conn->prepared, pgsql_prepared_list);
+		(void)snprintf(buf, sizeof(buf), "DEALLOCATE %s",
+		    ps->stmt->name);
+
+		result = PQexec(conn->db, buf);
+		if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+			PQclear(result);
+			return (KORE_RESULT_OK);
+		}
+
+		PQclear(result);
+
+		conn->nprepared--;
+		TAILQ_REMOVE(&conn->prepared, ps, list);
+		kore_free(ps);
+	}
+
+	result = PQprepare(conn->db, stmt->name, stmt->query, 0, NULL);
+	if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+		pgsql_set_error(pgsql, PQresultErrorMessage(result));
+		PQclear(result);
+		return (KORE_RESULT_ERROR);
+	}
+
+	PQclear(result);
+
+	ps = kore_malloc(sizeof(*ps));
+	ps->stmt = stmt;
+
+	conn->nprepared++;
+	TAILQ_INSERT_HEAD(&conn->prepared, ps, list);
+
+	*prepared = 1;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Hold on to the query and its parameters while the statement is being
+ * prepared, the caller is free to release them once we return.
+ */
+static int
+pgsql_prepare_start(struct kore_pgsql *pgsql, struct pgsql_statement *stmt,
+    int binary, int count, const char **values, int *lengths, int *formats)
+{
+	int			i;
+	size_t			len, off;
+	struct pgsql_prepare	*pp;
+
+	pp = kore_calloc(1, sizeof(*pp));
+	pp->stmt = stmt;
+	pp->binary = binary;
+	pp->count = count;
+
+	if (count > 0) {
+		pp->values = kore_calloc(count, sizeof(char *));
+		pp->lengths = kore_calloc(count, sizeof(int));
+		pp->formats = kore_calloc(count, sizeof(int));
+
+		len = 0;
+		for (i = 0; i < count; i++) {
+			if (lengths != NULL)
+				pp->lengths[i] = lengths[i];
+			if (formats != NULL)
+				pp->formats[i] = formats[i];
+
+			if (values[i] == NULL)
+				continue;
+
+			/* libpq ignores the length of text parameters. */
+			if (pp->formats[i] == 0)
+				pp->lengths[i] = strlen(values[i]);
+
+			len += pp->lengths[i] + 1;
+		}
+
+		pp->data = kore_malloc(len + 1);
+
+		off = 0;
+		for (i = 0; i < count; i++) {
+			if (values[i] == NULL)
+				continue;
+
+			memcpy(pp->data + off, values[i], pp->lengths[i]);
+			pp->data[off + pp->lengths[i]] = '\0';
+
+			pp->values[i] = pp->data + off;
+			off += pp->lengths[i] + 1;
+		}
+	}
+
+	pgsql->conn->job->prepare = pp;
+
+	if (!pgsql_prepare_next(pgsql)) {
+		pgsql_prepare_free(pgsql->conn->job);
+		return (KORE_RESULT_ERROR);
+	}
+
+	pgsql_schedule(pgsql);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Send the next command needed before the held back query can go out:
+ * DEALLOCATE ALL after the session lost track of its statements, making
+ * room for the statement and finally preparing it.
+ */
+static int
+pgsql_prepare_next(struct kore_pgsql *pgsql)
+{
+	int			ret;
+	struct pgsql_prepared	*ps;
+	char			buf[128];
+	struct pgsql_conn	*conn = pgsql->conn;
+	struct pgsql_prepare	*pp = conn->job->prepare;
+
+	if (conn->flags & PGSQL_CONN_DEALLOCATE) {
+		pp->step = PGSQL_PREPARE_RESET;
+		ret = PQsendQuery(conn->db, "DEALLOCATE ALL");
+	} else if (conn->nprepared >= pgsql_statement_max) {
+		ps = TAILQ_LAST(&conn->prepared, pgsql_prepared_list);
+		(void)snprintf(buf, sizeof(buf), "DEALLOCATE %s",
+		    ps->stmt->name);
+
+		pp->step = PGSQL_PREPARE_EVICT;
+		ret = PQsendQuery(conn->db, buf);
+	} else {
+		pp->step = PGSQL_PREPARE_STMT;
+		ret = PQsendPrepare(conn->db, pp->stmt->name,
+		    pp->stmt->query, 0, NULL);
+	}
+
+	if (!ret) {
+		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+		return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Read the outcome of the command sent by pgsql_prepare_next() and move
+ * on. If making room fails the query is sent as text, like the blocking
+ * path does. The state stays KORE_PGSQL_STATE_WAIT unless it failed.
+ */
+static void
+pgsql_prepare_read(struct kore_pgsql *pgsql)
+{
+	PGresult		*result;
+	struct pgsql_prepared	*ps;
+	int			eagain, ok, prepared;
+	struct pgsql_conn	*conn = pgsql->conn;
+	struct pgsql_prepare	*pp = conn->job->prepare;
+
+	ok = KORE_RESULT_OK;
+
+	for (;;) {
+		errno = 0;
+		if (!PQconsumeInput(conn->db)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			pgsql_prepare_free(conn->job);
+			return;
+		}
+
+		eagain = (errno == EAGAIN || errno == EWOULDBLOCK);
+
+		while (!PQisBusy(conn->db)) {
+			if ((result = PQgetResult(conn->db)) == NULL)
+				goto done;
+
+			if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+				if (pp->step == PGSQL_PREPARE_STMT) {
+					pgsql_set_error(pgsql,
+					    PQresultErrorMessage(result));
+				}
+				ok = KORE_RESULT_ERROR;
+			}
+
+			PQclear(result);
+		}
+
+		if (eagain) {
+			conn->evt.flags &= ~KORE_EVENT_READ;
+			return;
+		}
+	}
+
+done:
+	prepared = 0;
+
+	switch (pp->step) {
+	case PGSQL_PREPARE_RESET:
+		if (ok != KORE_RESULT_OK)
+			break;
+		pgsql_prepared_flush(conn);
+		conn->flags &= ~PGSQL_CONN_DEALLOCATE;
+		if (!pgsql_prepare_next(pgsql))
+			pgsql_prepare_free(conn->job);
+		return;
+	case PGSQL_PREPARE_EVICT:
+		if (ok != KORE_RESULT_OK)
+			break;
+		ps = TAILQ_LAST(&conn->prepared, pgsql_prepared_list);
+		conn->nprepared--;
+		TAILQ_REMOVE(&conn->prepared, ps, list);
+		kore_free(ps);
+		if (!pgsql_prepare_next(pgsql))
+			pgsql_prepare_free(conn->job);
+		return;
+	case PGSQL_PREPARE_STMT:
+		if (ok != KORE_RESULT_OK) {
+			pgsql_prepare_free(conn->job);
+			return;
+		}
+
+		ps = kore_malloc(sizeof(*ps));
+		ps->stmt = pp->stmt;
+
+		conn->nprepared++;
+		TAILQ_INSERT_HEAD(&conn->prepared, ps, list);
+		prepared = 1;
+		break;
+	default:
+		fatal("%s: unknown step %d", __func__, pp->step);
+	}
+
+	if (!pgsql_query_dispatch(pgsql, pp->stmt->query,
+	    prepared ? pp->stmt : NULL, pp->binary, pp->count,
+	    pp->values, pp->lengths, pp->formats)) {
+		pgsql_prepare_free(conn->job);
+		return;
+	}
+
+	pgsql_prepare_free(conn->job);
+	pgsql->state = KORE_PGSQL_STATE_WAIT;
+}
+
+static void
+pgsql_prepare_free(struct pgsql_job *job)
+{
+	struct pgsql_prepare	*pp;
+
+	if ((pp = job->prepare) == NULL)
+		return;
+
+	kore_free(pp->data);
+	kore_free(pp->values);
+	kore_free(pp->lengths);
+	kore_free(pp->formats);
+	kore_free(pp);
+
+	job->prepare = NULL;
+}
+
+/*
+ * A session that lost its prepared statements (DISCARD ALL or DEALLOCATE
+ * ran by the application) fails with invalid_sql_statement_name. We can't
+ * tell which ones are left so start over with DEALLOCATE ALL next time.
+ */
+static void
+pgsql_prepared_check(struct pgsql_conn *conn, PGresult *result)
+{
+	const char	*state;
+
+	if (conn == NULL || result == NULL)
+		return;
+
+	state = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+	if (state != NULL && !strcmp(state, "26000"))
+		conn->flags |= PGSQL_CONN_DEALLOCATE;
+}
+
+static void
+pgsql_prepared_flush(struct pgsql_conn *conn)
+{
+	struct pgsql_prepared	*ps;
+
+	while ((ps = TAILQ_FIRST(&conn->prepared)) != NULL) {
+		TAILQ_REMOVE(&conn->prepared, ps, list);
+		kore_free(ps);
+	}
+
+	conn->nprepared = 0;
+}
+
+static void
+pgsql_schedule(struct kore_pgsql *pgsql)
+{
+	int		fd;
+
+	KORE_PROBE2(pgsql_query, pgsql, pgsql->req);
+
+	fd = PQsocket(pgsql->conn->db);
+	if (fd < 0)
+		fatal("PQsocket returned < 0 fd on open connection");
+
+	kore_platform_schedule_read(fd, pgsql->conn);
+	pgsql->state = KORE_PGSQL_STATE_WAIT;
+	pgsql->flags |= KORE_PGSQL_SCHEDULED;
+
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_sleep(pgsql->req);
+#endif
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+}
+
+static void
+pgsql_queue_add(struct kore_pgsql *pgsql, struct pgsql_db *db)
+{
+	struct pgsql_wait	*pgw;
+
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_sleep(pgsql->req);
+#endif
+
+	/* A retry that has to wait again keeps its original deadline. */
+	if (pgsql->queued == 0)
+		pgsql->queued = kore_time_ms();
+
+	pgw = kore_pool_get(&pgsql_wait_pool);
+	pgw->db = db;
+	pgw->pgsql = pgsql;
+	pgw->prio = pgsql->prio;
+
+	if (pgw->prio < 0 || pgw->prio >= KORE_PGSQL_PRIO_MAX)
+		pgw->prio = KORE_PGSQL_PRIO_NORMAL;
+
+	pgsql->wait = pgw;
+
+	db->queued++;
+	pgsql_queue_count++;
+	TAILQ_INSERT_TAIL(&db->queue[pgw->prio], pgw, list);
+
+	if (pgsql->timeout != 0 && pgsql_queue_timer == NULL) {
+		pgsql_queue_timer = kore_timer_add(pgsql_queue_expire,
+		    PGSQL_QUEUE_TICK, NULL, 0);
+	}
+}
+
+static void
+pgsql_queue_remove(struct kore_pgsql *pgsql)
+{
+	if (pgsql->wait != NULL)
+		pgsql_queue_unlink(pgsql->wait);
+}
+
+static void
+pgsql_queue_unlink(struct pgsql_wait *pgw)
+{
+	pgw->db->queued--;
+	pgsql_queue_count--;
+	TAILQ_REMOVE(&pgw->db->queue[pgw->prio], pgw, list);
+
+	pgw->pgsql->wait = NULL;
+	kore_pool_put(&pgsql_wait_pool, pgw);
+}
+
+/*
+ * Wake up the next waiter for a connection to db. The classes that have
+ * waiters are picked with a smooth weighted round robin so that a busy
+ * high class gets most connections without starving the others.
+ */
+static void
+pgsql_queue_wakeup(struct pgsql_db *db)
+{
+	int			prio, best;
+	int64_t			total;
+	struct pgsql_wait	*pgw;
+	struct kore_pgsql	*pgsql;
+
+	for (;;) {
+		best = -1;
+		total = 0;
+
+		for (prio = 0; prio < KORE_PGSQL_PRIO_MAX; prio++) {
+			if (TAILQ_EMPTY(&db->queue[prio])) {
+				db->credit[prio] = 0;
+				continue;
+			}
+
+			total += pgsql_prio_weight[prio];
+			db->credit[prio] += pgsql_prio_weight[prio];
+
+			if (best == -1 || db->credit[prio] > db->credit[best])
+				best = prio;
+		}
+
+		if (best == -1)
+			return;
+
+		db->credit[best] -= total;
+
+		pgw = TAILQ_FIRST(&db->queue[best]);
+		pgsql = pgw->pgsql;
+		pgsql_queue_unlink(pgw);
+
+#if !defined(KORE_NO_HTTP)
+		if (pgsql->req != NULL) {
+			if (pgsql->req->flags & HTTP_REQUEST_DELETE)
+				continue;
+
+			http_request_wakeup_from(pgsql->req,
+			    HTTP_WAKEUP_PGSQL);
+		}
+#endif
+		if (pgsql->cb != NULL)
+			pgsql->cb(pgsql, pgsql->arg);
+
+		return;
+	}
+}
+
+/*
+ * Give up on waiters that are past their timeout: they are woken up
+ * with KORE_PGSQL_STATE_ERROR and kore_pgsql_setup() fails from then on.
+ */
+static void
+pgsql_queue_expire(void *arg, u_int64_t now)
+{
+	int			prio;
+	struct pgsql_db		*db;
+	struct kore_pgsql	*pgsql;
+	struct pgsql_wait	*pgw, *next;
+
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		for (prio = 0; prio < KORE_PGSQL_PRIO_MAX; prio++) {
+			for (pgw = TAILQ_FIRST(&db->queue[prio]);
+			    pgw != NULL; pgw = next) {
+				next = TAILQ_NEXT(pgw, list);
+				pgsql = pgw->pgsql;
+
+				if (pgsql->timeout == 0 ||
+				    now - pgsql->queued < pgsql->timeout)
+					continue;
+
+				pgsql_queue_timeouts++;
+				pgsql_queue_fail(pgw,
+				    "timed out waiting for a connection");
+			}
+		}
+	}
+
+	if (pgsql_queue_count == 0) {
+		kore_timer_remove(pgsql_queue_timer);
+		pgsql_queue_timer = NULL;
+	}
+}
+
+/*
+ * Take the waiter out of the queue and wake it up with the error, from
+ * then on kore_pgsql_setup() fails for it.
+ */
+static void
+pgsql_queue_fail(struct pgsql_wait *pgw, const char *msg)
+{
+	struct kore_pgsql	*pgsql;
+
+	pgsql = pgw->pgsql;
+	pgsql_queue_unlink(pgw);
+
+	pgsql_queue_wait(pgsql);
+	pgsql->flags |= PGSQL_QUEUE_EXPIRED;
+	pgsql_set_error(pgsql, msg);
+
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_wakeup_from(pgsql->req, HTTP_WAKEUP_PGSQL);
+#endif
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+}
+
+/* Account for the time pgsql spent in the queue. */
+static void
+pgsql_queue_wait(struct kore_pgsql *pgsql)
+{
+#if !defined(KORE_NO_HTTP)
+	int		prio;
+
+	prio = pgsql->prio;
+	if (prio < 0 || prio >= KORE_PGSQL_PRIO_MAX)
+		prio = KORE_PGSQL_PRIO_NORMAL;
+
+	kore_metrics_hist_add(&worker->metrics.pgsql_wait[prio],
+	    (kore_time_ms() - pgsql->queued) * 1000);
+#endif
+	pgsql->queued = 0;
+}
+
+static struct pgsql_conn *
+pgsql_conn_create(struct kore_pgsql *pgsql, struct pgsql_db *db)
+{
+	struct pgsql_conn	*conn;
+
+	if (db == NULL || db->conn_string == NULL)
+		fatal("pgsql_conn_create: no connection string");
+
+	db->conn_count++;
+
+	conn = kore_calloc(1, sizeof(*conn));
+	conn->fd = -1;
+	conn->job = NULL;
+	conn->owner = db;
+	conn->flags = PGSQL_CONN_FREE;
+	conn->created = kore_time_ms();
+	conn->name = kore_strdup(db->name);
+	TAILQ_INIT(&conn->prepared);
+	TAILQ_INSERT_TAIL(&db->conn_free, conn, list);
+
+	conn->evt.type = KORE_TYPE_PGSQL_CONN;
+	conn->evt.handle = kore_pgsql_handle;
+
+	conn->db = PQconnectdb(db->conn_string);
+	if (conn->db == NULL || (PQstatus(conn->db) != CONNECTION_OK)) {
+		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+		pgsql_replica_eject(db, PQerrorMessage(conn->db));
+		pgsql_conn_cleanup(conn);
+		return (NULL);
+	}
+
+	return (conn);
+}
+
+/*
+ * Bring db up to its minimum number of connections. They are opened
+ * without blocking and only handed out once established.
+ */
+static void
+pgsql_conn_warmup(struct pgsql_db *db)
+{
+	u_int16_t	min;
+
+	min = db->conn_min;
+	if (db->conn_max != 0 && min > db->conn_max)
+		min = db->conn_max;
+
+	/* An ejected replica needs a connection to be checked on. */
+	if (min == 0 && (db->flags & PGSQL_DB_EJECTED))
+		min = 1;
+
+	while (db->conn_count < min) {
+		if (!pgsql_conn_connect(db, NULL))
+			break;
+	}
+}
+
+/*
+ * Start a connection to db without blocking. If pgsql is given it was
+ * started for that query, which gets the error if it fails right away.
+ */
+static int
+pgsql_conn_connect(struct pgsql_db *db, struct kore_pgsql *pgsql)
+{
+	struct pgsql_conn	*conn;
+
+	db->conn_count++;
+
+	conn = kore_calloc(1, sizeof(*conn));
+	conn->owner = db;
+	conn->flags = PGSQL_CONN_CONNECTING;
+	if (pgsql != NULL)
+		conn->flags |= PGSQL_CONN_WAITED;
+	conn->name = kore_strdup(db->name);
+	TAILQ_INIT(&conn->prepared);
+
+	conn->evt.type = KORE_TYPE_PGSQL_CONN;
+	conn->evt.handle = kore_pgsql_handle;
+
+	conn->db = PQconnectStart(db->conn_string);
+	if (conn->db == NULL || PQstatus(conn->db) == CONNECTION_BAD) {
+		kore_log(LOG_NOTICE, "pgsql: failed to connect to %s: %s",
+		    db->name, PQerrorMessage(conn->db));
+		if (pgsql != NULL)
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+		pgsql_replica_eject(db, PQerrorMessage(conn->db));
+		conn->fd = -1;
+		pgsql_conn_cleanup(conn);
+		return (KORE_RESULT_ERROR);
+	}
+
+	/* Wait for the socket to become writable first. */
+	conn->fd = PQsocket(conn->db);
+	kore_platform_event_level_all(conn->fd, conn);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+pgsql_conn_connecting(struct pgsql_conn *conn, int err)
+{
+	int			fd, prio;
+	struct pgsql_db		*db;
+	struct pgsql_wait	*pgw;
+	PostgresPollingStatusType	status;
+
+	status = PQconnectPoll(conn->db);
+
+	switch (status) {
+	case PGRES_POLLING_READING:
+	case PGRES_POLLING_WRITING:
+		/* The socket changes if libpq moves on to another host. */
+		fd = PQsocket(conn->db);
+		if (fd == conn->fd) {
+			kore_platform_disable_read(fd);
+#if !defined(__linux__)
+			kore_platform_disable_write(fd);
+#endif
+		}
+
+		conn->fd = fd;
+
+		if (status == PGRES_POLLING_READING)
+			kore_platform_event_level_read(fd, conn);
+		else
+			kore_platform_event_level_all(fd, conn);
+		break;
+	case PGRES_POLLING_OK:
+		kore_platform_disable_read(conn->fd);
+#if !defined(__linux__)
+		kore_platform_disable_write(conn->fd);
+#endif
+		conn->fd = -1;
+		conn->evt.flags = 0;
+		conn->created = kore_time_ms();
+		conn->flags = PGSQL_CONN_FREE;
+		TAILQ_INSERT_TAIL(&conn->owner->conn_free, conn, list);
+		pgsql_queue_wakeup(conn->owner);
+		break;
+	default:
+		kore_log(LOG_NOTICE, "pgsql: failed to connect to %s: %s",
+		    conn->name, PQerrorMessage(conn->db));
+		db = conn->owner;
+		pgsql_replica_eject(db, PQerrorMessage(conn->db));
+
+		/*
+		 * Someone waits on this one, let the first in line fail
+		 * like a blocking connect would have instead of having
+		 * it retry on a server that is not there.
+		 */
+		if (conn->flags & PGSQL_CONN_WAITED) {
+			for (prio = 0; prio < KORE_PGSQL_PRIO_MAX; prio++) {
+				pgw = TAILQ_FIRST(&db->queue[prio]);
+				if (pgw != NULL) {
+					pgsql_queue_fail(pgw,
+					    PQerrorMessage(conn->db));
+					break;
+				}
+			}
+			pgsql_conn_cleanup(conn);
+		} else {
+			pgsql_conn_cleanup(conn);
+			pgsql_queue_wakeup(db);
+		}
+		break;
+	}
+}
+
+static int
+pgsql_conn_expired(struct pgsql_conn *conn, u_int64_t now)
+{
+	if (pgsql_conn_lifetime == 0)
+		return (0);
+
+	return ((now - conn->created) >= (u_int64_t)pgsql_conn_lifetime * 1000);
+}
+
+/*
+ * Check the idle connections: the ones that are past their lifetime or
+ * were closed by the server are dropped and replaced if needed. Reading
+ * whatever is pending on the socket is enough to notice the latter.
+ */
+static void
+pgsql_conn_maintain(void *arg, u_int64_t now)
+{
+	struct pgsql_db		*db;
+	struct pgsql_conn	*conn, *next;
+
+	LIST_FOREACH(db, &pgsql_db_conn_strings, rlist) {
+		for (conn = TAILQ_FIRST(&db->conn_free); conn != NULL;
+		    conn = next) {
+			next = TAILQ_NEXT(conn, list);
+
+			if (pgsql_conn_expired(conn, now)) {
+				pgsql_conn_cleanup(conn);
+				continue;
+			}
+
+			if (!PQconsumeInput(conn->db) ||
+			    PQstatus(conn->db) != CONNECTION_OK) {
+				kore_log(LOG_NOTICE,
+				    "pgsql: dropping %s connection: %s",
+				    db->name, PQerrorMessage(conn->db));
+				pgsql_conn_cleanup(conn);
+			}
+		}
+
+		pgsql_conn_warmup(db);
+
+		if (db->primary != NULL)
+			pgsql_replica_check(db);
+	}
+}
+
+static void
+pgsql_conn_release(struct kore_pgsql *pgsql)
+{
+	int		fd;
+	PGresult	*result;
+	struct pgsql_db	*db;
+
+	if (pgsql->conn == NULL)
+		return;
+
+	db = pgsql->conn->owner;
+
+	/* Async query cleanup */
+	if (pgsql->flags & KORE_PGSQL_ASYNC) {
+		if (pgsql->flags & KORE_PGSQL_SCHEDULED) {
+			fd = PQsocket(pgsql->conn->db);
+			kore_platform_disable_read(fd);
+#if !defined(__linux__)
+			if (pgsql->flags & PGSQL_COPY_WRITE)
+				kore_platform_disable_write(fd);
+#endif
+
+			if (pgsql->state != KORE_PGSQL_STATE_DONE)
+				pgsql_cancel(pgsql);
+		}
+
+		/* Cut short while preparing, we can't tell what is left. */
+		if (pgsql->conn->job->prepare != NULL) {
+			pgsql->conn->flags |= PGSQL_CONN_DEALLOCATE;
+			pgsql_prepare_free(pgsql->conn->job);
+		}
+
+		kore_pool_put(&pgsql_job_pool, pgsql->conn->job);
+	}
+
+	pgsql->conn->job = NULL;
+
+	/* A copy cut short leaves the connection in an unknown state. */
+	if (!pgsql_pipeline_exit(pgsql) ||
+	    (pgsql->flags & (PGSQL_COPY_IN | PGSQL_COPY_OUT | PGSQL_COPY_WRITE)) ||
+	    pgsql_conn_expired(pgsql->conn, kore_time_ms())) {
+		pgsql_conn_cleanup(pgsql->conn);
+		pgsql_conn_warmup(db);
+	} else {
+		/* Drain just in case. */
+		while ((result = PQgetResult(pgsql->conn->db)) != NULL)
+			PQclear(result);
+
+		pgsql->conn->flags |= PGSQL_CONN_FREE;
+		TAILQ_INSERT_TAIL(&pgsql->conn->owner->conn_free,
+		    pgsql->conn, list);
+	}
+
+	pgsql->conn = NULL;
+	pgsql->state = KORE_PGSQL_STATE_COMPLETE;
+
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+
+	pgsql_queue_wakeup(db);
 }
 
-int
-kore_pgsql_getlength(struct kore_pgsql *pgsql, int row, int col)
+static void
+pgsql_conn_cleanup(struct pgsql_conn *conn)
 {
-	return (PQgetlength(pgsql->result, row, col));
+	struct kore_pgsql	*pgsql;
+
+	if (conn->flags & PGSQL_CONN_FREE)
+		TAILQ_REMOVE(&conn->owner->conn_free, conn, list);
+
+	if (conn->flags & PGSQL_CONN_CHECKING)
+		conn->owner->checking = NULL;
+
+	if (conn->job) {
+		pgsql = conn->job->pgsql;
+#if !defined(KORE_NO_HTTP)
+		if (pgsql->req != NULL)
+			http_request_wakeup_from(pgsql->req,
+			    HTTP_WAKEUP_PGSQL);
+#endif
+		pgsql->conn = NULL;
+		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+
+		pgsql_prepare_free(conn->job);
+		kore_pool_put(&pgsql_job_pool, conn->job);
+		conn->job = NULL;
+	}
+
+	if (conn->flags & PGSQL_CONN_CONNECTING && conn->fd != -1) {
+		kore_platform_disable_read(conn->fd);
+#if !defined(__linux__)
+		kore_platform_disable_write(conn->fd);
+#endif
+	}
+
+	if (conn->db != NULL) {
+#if defined(KORE_USE_IOURING)
+		/* Pending poll requests keep the socket open otherwise. */
+		if (kore_uring_active &&
+		    !(conn->flags & PGSQL_CONN_CONNECTING))
+			kore_uring_remove(PQsocket(conn->db));
+#endif
+		PQfinish(conn->db);
+	}
+
+	conn->owner->conn_count--;
+
+	pgsql_prepared_flush(conn);
+
+	kore_free(conn->name);
+	kore_free(conn);
 }
 
-char *
-kore_pgsql_fieldname(struct kore_pgsql *pgsql, int field)
+/*
+ * The replica of db with the fewest connections in use or waited on
+ * that is not ejected, falling back to db itself. The one picked goes
+ * to the back of the list so that ties are handed out in turn.
+ */
+static struct pgsql_db *
+pgsql_replica_pick(struct pgsql_db *db)
 {
-	return (PQfname(pgsql->result, field));
+	struct pgsql_conn	*conn;
+	struct pgsql_db		*replica, *best;
+	u_int32_t		load, best_load;
+
+	best = NULL;
+	best_load = 0;
+
+	TAILQ_FOREACH(replica, &db->replicas, replica) {
+		if (replica->flags & PGSQL_DB_EJECTED)
+			continue;
+
+		load = replica->conn_count + replica->queued;
+		TAILQ_FOREACH(conn, &replica->conn_free, list)
+			load--;
+
+		if (best == NULL || load < best_load) {
+			best = replica;
+			best_load = load;
+		}
+	}
+
+	if (best == NULL)
+		return (db);
+
+	TAILQ_REMOVE(&db->replicas, best, replica);
+	TAILQ_INSERT_TAIL(&db->replicas, best, replica);
+
+	return (best);
 }
 
-char *
-kore_pgsql_getvalue(struct kore_pgsql *pgsql, int row, int col)
+/*
+ * Take db out of rotation. It is only put back by a passing health
+ * check, so without pgsql_conn_check replicas are never ejected.
+ */
+static void
+pgsql_replica_eject(struct pgsql_db *db, const char *reason)
 {
-	return (PQgetvalue(pgsql->result, row, col));
+	if (db->primary == NULL || pgsql_conn_check == 0)
+		return;
+
+	if (!(db->flags & PGSQL_DB_EJECTED)) {
+		kore_log(LOG_NOTICE, "pgsql: ejecting replica %s: %s",
+		    db->name, reason);
+	}
+
+	db->flags |= PGSQL_DB_EJECTED;
 }
 
-int
-kore_pgsql_column_binary(struct kore_pgsql *pgsql, int col)
+/*
+ * Ask the replica for its replay lag on one of its idle connections.
+ * A replica that is busy on all connections skips the check, one that
+ * did not answer the previous check in time is ejected and the
+ * connection it hangs on is dropped.
+ */
+static void
+pgsql_replica_check(struct pgsql_db *db)
 {
-	return (PQfformat(pgsql->result, col));
+	struct pgsql_conn	*conn;
+
+	if (db->checking != NULL) {
+		pgsql_replica_eject(db, "health check timed out");
+		pgsql_conn_cleanup(db->checking);
+		pgsql_conn_warmup(db);
+		return;
+	}
+
+	if ((conn = TAILQ_FIRST(&db->conn_free)) == NULL)
+		return;
+
+	conn->flags &= ~PGSQL_CONN_FREE;
+	TAILQ_REMOVE(&db->conn_free, conn, list);
+
+	if (!PQsendQuery(conn->db, PGSQL_REPLICA_QUERY)) {
+		pgsql_replica_eject(db, PQerrorMessage(conn->db));
+		pgsql_conn_cleanup(conn);
+		return;
+	}
+
+	db->checking = conn;
+	conn->flags |= PGSQL_CONN_CHECKING;
+
+	kore_platform_schedule_read(PQsocket(conn->db), conn);
 }
 
-static struct pgsql_conn *
-pgsql_conn_next(struct kore_pgsql *pgsql, struct pgsql_db *db)
+static void
+pgsql_replica_checked(struct pgsql_conn *conn, int err)
 {
-	PGTransactionStatusType		state;
-	struct pgsql_conn		*conn;
-	struct kore_pgsql		rollback;
+	PGresult		*result;
+	struct pgsql_db		*db;
+	int			eagain, ok;
+	long long		lag;
+	char			reason[64];
 
-rescan:
-	conn = NULL;
+	db = conn->owner;
+	ok = 0;
+	lag = -1;
 
-	TAILQ_FOREACH(conn, &pgsql_conn_free, list) {
-		if (!(conn->flags & PGSQL_CONN_FREE))
-			fatal("got a pgsql connection that was not free?");
-		if (!strcmp(conn->name, db->name))
-			break;
-	}
+	if (err)
+		goto fail;
 
-	if (conn != NULL) {
-		state = PQtransactionStatus(conn->db);
-		if (state == PQTRANS_INERROR) {
-			conn->flags &= ~PGSQL_CONN_FREE;
-			TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+	for (;;) {
+		errno = 0;
+		if (!PQconsumeInput(conn->db))
+			goto fail;
 
-			kore_pgsql_init(&rollback);
-			rollback.conn = conn;
-			rollback.flags = KORE_PGSQL_SYNC;
+		eagain = (errno == EAGAIN || errno == EWOULDBLOCK);
 
-			if (!kore_pgsql_query(&rollback, "ROLLBACK")) {
-				kore_pgsql_logerror(&rollback);
-				kore_pgsql_cleanup(&rollback);
-				pgsql_conn_cleanup(conn);
+		while (!PQisBusy(conn->db)) {
+			if ((result = PQgetResult(conn->db)) == NULL)
+				goto done;
+
+			if (PQresultStatus(result) == PGRES_TUPLES_OK &&
+			    PQntuples(result) == 1 && PQnfields(result) == 1) {
+				lag = kore_strtonum(PQgetvalue(result, 0, 0),
+				    10, 0, UINT_MAX, &ok);
 			} else {
-				kore_pgsql_cleanup(&rollback);
+				ok = KORE_RESULT_ERROR;
 			}
 
-			goto rescan;
+			PQclear(result);
 		}
+
+		if (eagain)
+			return;
 	}
 
-	if (conn == NULL) {
-		if (db->conn_max != 0 &&
-		    db->conn_count >= db->conn_max) {
-			if ((pgsql->flags & KORE_PGSQL_ASYNC) &&
-			    pgsql_queue_count < pgsql_queue_limit) {
-				pgsql_queue_add(pgsql);
-			} else {
-				pgsql_set_error(pgsql,
-				    "no available connection");
+done:
+	db->checking = NULL;
+	conn->flags &= ~PGSQL_CONN_CHECKING;
+	kore_platform_disable_read(PQsocket(conn->db));
+
+	conn->flags |= PGSQL_CONN_FREE;
+	TAILQ_INSERT_TAIL(&db->conn_free, conn, list);
+
+	if (ok != KORE_RESULT_OK || lag < 0) {
+		pgsql_replica_eject(db, "health check returned no lag");
+	} else if (pgsql_replica_lag != 0 && lag > pgsql_replica_lag) {
+		(void)snprintf(reason, sizeof(reason),
+		    "%lld seconds behind", lag);
+		pgsql_replica_eject(db, reason);
+	} else if (db->flags & PGSQL_DB_EJECTED) {
+		kore_log(LOG_NOTICE, "pgsql: replica %s is back", db->name);
+		db->flags &= ~PGSQL_DB_EJECTED;
+	}
+
+	pgsql_queue_wakeup(db);
+	return;
+
+fail:
+	pgsql_replica_eject(db, PQerrorMessage(conn->db));
+	pgsql_conn_cleanup(conn);
+	pgsql_queue_wakeup(db);
+}
+
+static void
+pgsql_read_result(struct kore_pgsql *pgsql)
+{
+	struct pgsql_conn	*conn;
+	PGnotify		*notify;
+	int			saved_errno;
+
+	conn = pgsql->conn;
+	KORE_PROBE2(pgsql_read_result, pgsql, pgsql->req);
+
+again:
+	if ((pgsql->flags & PGSQL_COPY_OUT) && pgsql_copy_out(pgsql))
+		return;
+
+	/* A stream hands out what libpq holds before reading more. */
+	if ((pgsql->flags & PGSQL_STREAM) && !PQisBusy(conn->db))
+		goto next;
+
+	for (;;) {
+		if (!PQconsumeInput(conn->db)) {
+			pgsql->state = KORE_PGSQL_STATE_ERROR;
+			pgsql->error = kore_strdup(PQerrorMessage(conn->db));
+			KORE_PROBE3(pgsql_result, pgsql, pgsql->req, pgsql->state);
+			return;
+		}
+
+		saved_errno = errno;
+
+		if (PQisBusy(conn->db)) {
+			if (saved_errno != EAGAIN && saved_errno != EWOULDBLOCK)
+				continue;
+
+			/* Hand out a partial batch rather than sit on it. */
+			if (pgsql->stream.count > 0) {
+				pgsql->state = KORE_PGSQL_STATE_RESULT;
+				KORE_PROBE3(pgsql_result, pgsql, pgsql->req,
+				    pgsql->state);
+				return;
 			}
 
-			return (NULL);
+			pgsql->state = KORE_PGSQL_STATE_WAIT;
+			conn->evt.flags &= ~KORE_EVENT_READ;
+			return;
 		}
 
-		if ((conn = pgsql_conn_create(pgsql, db)) == NULL)
-			return (NULL);
+		break;
 	}
 
-	conn->flags &= ~PGSQL_CONN_FREE;
-	TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+	while ((notify = PQnotifies(conn->db)) != NULL) {
+		pgsql->state = KORE_PGSQL_STATE_NOTIFY;
+		pgsql->notify.extra = notify->extra;
+		pgsql->notify.channel = notify->relname;
 
-	return (conn);
+		if (pgsql->cb != NULL)
+			pgsql->cb(pgsql, pgsql->arg);
+
+		PQfreemem(notify);
+	}
+
+next:
+	pgsql->result = PQgetResult(conn->db);
+	if (pgsql->result == NULL) {
+		/* In a pipeline this only ends the current query. */
+		if (pgsql->flags & PGSQL_PIPELINE) {
+			pgsql->pipeline.index++;
+			goto again;
+		}
+
+		pgsql->state = KORE_PGSQL_STATE_DONE;
+		KORE_PROBE3(pgsql_result, pgsql, pgsql->req, pgsql->state);
+		return;
+	}
+
+	switch (PQresultStatus(pgsql->result)) {
+	case PGRES_COPY_OUT:
+		PQclear(pgsql->result);
+		pgsql->result = NULL;
+		pgsql->flags |= PGSQL_COPY_OUT;
+		goto again;
+	case PGRES_COPY_IN:
+		PQclear(pgsql->result);
+		pgsql->result = NULL;
+
+		/* Puts must not block the worker on a full socket. */
+		if (PQsetnonblocking(conn->db, 1) == -1) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			break;
+		}
+
+		pgsql->flags |= PGSQL_COPY_IN;
+		pgsql->state = KORE_PGSQL_STATE_COPY_IN;
+		break;
+	case PGRES_COPY_BOTH:
+		pgsql_set_error(pgsql, "COPY BOTH is not supported");
+		break;
+	case PGRES_NONFATAL_ERROR:
+		break;
+	case PGRES_COMMAND_OK:
+		if (pgsql->flags & PGSQL_PIPELINE)
+			pgsql->state = KORE_PGSQL_STATE_RESULT;
+		else
+			pgsql->state = KORE_PGSQL_STATE_DONE;
+		break;
+	case PGRES_TUPLES_OK:
+		/* A stream ends with an empty result, nothing to hand out. */
+		if (pgsql->flags & PGSQL_STREAM) {
+			PQclear(pgsql->result);
+			pgsql->result = NULL;
+			if (pgsql->stream.count == 0)
+				goto again;
+		}
+		pgsql->state = KORE_PGSQL_STATE_RESULT;
+		break;
+#if PG_VERSION_NUM >= 90200
+	case PGRES_SINGLE_TUPLE:
+		if (pgsql->flags & PGSQL_STREAM) {
+			pgsql->stream.rows[pgsql->stream.count++] =
+			    pgsql->result;
+			pgsql->result = NULL;
+			if (pgsql->stream.count < pgsql->stream.batch)
+				goto again;
+		}
+		pgsql->state = KORE_PGSQL_STATE_RESULT;
+		break;
+#endif
+	case PGRES_EMPTY_QUERY:
+	case PGRES_BAD_RESPONSE:
+	case PGRES_FATAL_ERROR:
+		pgsql_stream_clear(pgsql);
+		pgsql_set_error(pgsql, PQresultErrorMessage(pgsql->result));
+		pgsql_prepared_check(pgsql->conn, pgsql->result);
+		if (pgsql->flags & PGSQL_PIPELINE &&
+		    pgsql->pipeline.failed == -1)
+			pgsql->pipeline.failed = pgsql->pipeline.index;
+		break;
+#if PG_VERSION_NUM >= 140000
+	case PGRES_PIPELINE_ABORTED:
+		/* Skipped because an earlier query failed. */
+		PQclear(pgsql->result);
+		pgsql->result = NULL;
+		goto again;
+	case PGRES_PIPELINE_SYNC:
+		PQclear(pgsql->result);
+		pgsql->result = NULL;
+
+		if (!PQexitPipelineMode(conn->db)) {
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			break;
+		}
+
+		pgsql->flags &= ~PGSQL_PIPELINE;
+		pgsql->state = KORE_PGSQL_STATE_DONE;
+		break;
+#endif
+	}
+
+	KORE_PROBE3(pgsql_result, pgsql, pgsql->req, pgsql->state);
 }
 
 static void
-pgsql_set_error(struct kore_pgsql *pgsql, const char *msg)
+pgsql_wake(struct kore_pgsql *pgsql)
 {
-	if (pgsql->error != NULL)
-		kore_free(pgsql->error);
+#if !defined(KORE_NO_HTTP)
+	if (pgsql->req != NULL)
+		http_request_wakeup_from(pgsql->req, HTTP_WAKEUP_PGSQL);
+#endif
+	if (pgsql->cb != NULL)
+		pgsql->cb(pgsql, pgsql->arg);
+}
 
-	pgsql->error = kore_strdup(msg);
-	pgsql->state = KORE_PGSQL_STATE_ERROR;
+/*
+ * Fetch the next row of a COPY TO STDOUT. Returns 1 when there is
+ * something to report (data, an error or nothing to read yet) and 0
+ * once the copy is over and its result can be read.
+ */
+static int
+pgsql_copy_out(struct kore_pgsql *pgsql)
+{
+	int			len, drained;
+	struct pgsql_conn	*conn = pgsql->conn;
+
+	drained = 0;
+
+	for (;;) {
+		len = PQgetCopyData(conn->db, &pgsql->copy.data, 1);
+
+		if (len > 0) {
+			pgsql->copy.len = len;
+			pgsql->state = KORE_PGSQL_STATE_COPY_OUT;
+			return (1);
+		}
+
+		if (len == -1) {
+			pgsql->flags &= ~PGSQL_COPY_OUT;
+			return (0);
+		}
+
+		if (len != 0) {
+			pgsql->flags &= ~PGSQL_COPY_OUT;
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			return (1);
+		}
+
+		if (drained) {
+			pgsql->state = KORE_PGSQL_STATE_WAIT;
+			conn->evt.flags &= ~KORE_EVENT_READ;
+			return (1);
+		}
+
+		errno = 0;
+		if (!PQconsumeInput(conn->db)) {
+			pgsql->flags &= ~PGSQL_COPY_OUT;
+			pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+			return (1);
+		}
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			drained = 1;
+	}
 }
 
-static void
-pgsql_schedule(struct kore_pgsql *pgsql)
+/*
+ * Push out what libpq buffered for a COPY FROM STDIN. If the socket is
+ * full we also wait for it to become writable and try again from
+ * kore_pgsql_handle(), KORE_RESULT_RETRY is returned until then.
+ */
+static int
+pgsql_copy_flush(struct kore_pgsql *pgsql)
 {
 	int		fd;
 
 	fd = PQsocket(pgsql->conn->db);
-	if (fd < 0)
-		fatal("PQsocket returned < 0 fd on open connection");
-
-	kore_platform_schedule_read(fd, pgsql->conn);
-	pgsql->state = KORE_PGSQL_STATE_WAIT;
-	pgsql->flags |= KORE_PGSQL_SCHEDULED;
 
-#if !defined(KORE_NO_HTTP)
-	if (pgsql->req != NULL)
-		http_request_sleep(pgsql->req);
+	switch (PQflush(pgsql->conn->db)) {
+	case 0:
+		if (pgsql->flags & PGSQL_COPY_WRITE) {
+			pgsql->flags &= ~PGSQL_COPY_WRITE;
+#if !defined(__linux__)
+			kore_platform_disable_write(fd);
 #endif
-	if (pgsql->cb != NULL)
-		pgsql->cb(pgsql, pgsql->arg);
+			kore_platform_schedule_read(fd, pgsql->conn);
+		}
+
+		/* Back to normal once the end of the copy went out. */
+		if (!(pgsql->flags & PGSQL_COPY_IN))
+			(void)PQsetnonblocking(pgsql->conn->db, 0);
+		return (KORE_RESULT_OK);
+	case 1:
+		if (!(pgsql->flags & PGSQL_COPY_WRITE)) {
+			pgsql->flags |= PGSQL_COPY_WRITE;
+			kore_platform_event_all(fd, pgsql->conn);
+		}
+		return (KORE_RESULT_RETRY);
+	default:
+		pgsql_set_error(pgsql, PQerrorMessage(pgsql->conn->db));
+		return (KORE_RESULT_ERROR);
+	}
 }
 
+/* The connection drained during a copy, let the data flow again. */
 static void
-pgsql_queue_add(struct kore_pgsql *pgsql)
+pgsql_copy_writable(struct kore_pgsql *pgsql)
 {
-	struct pgsql_wait	*pgw;
-
 #if !defined(KORE_NO_HTTP)
-	if (pgsql->req != NULL)
-		http_request_sleep(pgsql->req);
+	if (pgsql->flags & PGSQL_COPY_BODY) {
+		pgsql->flags &= ~PGSQL_COPY_BODY;
+		http_body_stream_resume(pgsql->req);
+		return;
+	}
 #endif
+	pgsql_wake(pgsql);
+}
 
-	pgw = kore_pool_get(&pgsql_wait_pool);
-	pgw->pgsql = pgsql;
+static u_int8_t *
+pgsql_binary(struct kore_pgsql *pgsql, int row, int col, Oid *type, int *len)
+{
+	PGresult	*result;
 
-	pgsql_queue_count++;
-	TAILQ_INSERT_TAIL(&pgsql_wait_queue, pgw, list);
+	result = pgsql_stream_row(pgsql, &row);
+
+	if (PQfformat(result, col) != KORE_PGSQL_FORMAT_BINARY ||
+	    PQgetisnull(result, row, col))
+		return (NULL);
+
+	*type = PQftype(result, col);
+	*len = PQgetlength(result, row, col);
+
+	return ((u_int8_t *)PQgetvalue(result, row, col));
 }
 
-static void
-pgsql_queue_remove(struct kore_pgsql *pgsql)
+static int
+pgsql_json_value(struct kore_buf *buf, PGresult *result, int row, int col)
 {
-	struct pgsql_wait	*pgw, *next;
+	Oid		type;
+	float		f;
+	double		d;
+	int32_t		days;
+	u_int8_t	*val;
+	char		*b64, num[32];
+	int		len, binary;
+	u_int32_t	v32;
+	u_int64_t	v64;
+
+	if (PQgetisnull(result, row, col)) {
+		kore_buf_append(buf, "null", 4);
+		return (KORE_RESULT_OK);
+	}
 
-	for (pgw = TAILQ_FIRST(&pgsql_wait_queue); pgw != NULL; pgw = next) {
-		next = TAILQ_NEXT(pgw, list);
-		if (pgw->pgsql != pgsql)
-			continue;
+	type = PQftype(result, col);
+	len = PQgetlength(result, row, col);
+	val = (u_int8_t *)PQgetvalue(result, row, col);
+	binary = (PQfformat(result, col) == KORE_PGSQL_FORMAT_BINARY);
+
+	if (!binary) {
+		switch (type) {
+		case PGSQL_BOOLOID:
+			if (*val == 't')
+				kore_buf_append(buf, "true", 4);
+			else
+				kore_buf_append(buf, "false", 5);
+			return (KORE_RESULT_OK);
+		case PGSQL_INT2OID:
+		case PGSQL_INT4OID:
+		case PGSQL_INT8OID:
+		case PGSQL_FLOAT4OID:
+		case PGSQL_FLOAT8OID:
+		case PGSQL_NUMERICOID:
+			/* NaN and Infinity are not JSON numbers. */
+			if (isdigit(*val) || (*val == '-' && isdigit(val[1])))
+				kore_buf_append(buf, val, len);
+			else
+				kore_buf_append(buf, "null", 4);
+			return (KORE_RESULT_OK);
+		case PGSQL_JSONOID:
+		case PGSQL_JSONBOID:
+			kore_buf_append(buf, val, len);
+			return (KORE_RESULT_OK);
+		case PGSQL_TIMESTAMPOID:
+		case PGSQL_TIMESTAMPTZOID:
+			pgsql_json_text_time(buf, (const char *)val, len);
+			return (KORE_RESULT_OK);
+		default:
+			pgsql_json_string(buf, (const char *)val, len);
+			return (KORE_RESULT_OK);
+		}
+	}
 
-		pgsql_queue_count--;
-		TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-		kore_pool_put(&pgsql_wait_pool, pgw);
-		return;
+	switch (type) {
+	case PGSQL_BOOLOID:
+		if (len != 1)
+			return (KORE_RESULT_ERROR);
+		if (*val)
+			kore_buf_append(buf, "true", 4);
+		else
+			kore_buf_append(buf, "false", 5);
+		break;
+	case PGSQL_INT2OID:
+		if (len != 2)
+			return (KORE_RESULT_ERROR);
+		kore_buf_appendf(buf, "%d", (int16_t)net_read16(val));
+		break;
+	case PGSQL_INT4OID:
+		if (len != 4)
+			return (KORE_RESULT_ERROR);
+		kore_buf_appendf(buf, "%d", (int32_t)net_read32(val));
+		break;
+	case PGSQL_INT8OID:
+		if (len != 8)
+			return (KORE_RESULT_ERROR);
+		kore_buf_appendf(buf, "%lld", (long long)(int64_t)net_read64(val));
+		break;
+	case PGSQL_FLOAT4OID:
+	case PGSQL_FLOAT8OID:
+		if (len == 4) {
+			v32 = net_read32(val);
+			memcpy(&f, &v32, sizeof(f));
+			d = f;
+		} else if (len == 8) {
+			v64 = net_read64(val);
+			memcpy(&d, &v64, sizeof(d));
+		} else {
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (!isfinite(d)) {
+			kore_buf_append(buf, "null", 4);
+			break;
+		}
+
+		len = snprintf(num, sizeof(num), "%.*g", len == 4 ? 9 : 17, d);
+		if (len == -1 || (size_t)len >= sizeof(num))
+			return (KORE_RESULT_ERROR);
+		kore_buf_append(buf, num, len);
+		break;
+	case PGSQL_NUMERICOID:
+		if (!pgsql_json_numeric(buf, val, len))
+			return (KORE_RESULT_ERROR);
+		break;
+	case PGSQL_DATEOID:
+		if (len != 4)
+			return (KORE_RESULT_ERROR);
+		days = (int32_t)net_read32(val);
+		if (days == INT32_MAX)
+			pgsql_json_time(buf, INT64_MAX, 1);
+		else if (days == INT32_MIN)
+			pgsql_json_time(buf, INT64_MIN, 1);
+		else if (days > PGSQL_DAYS_MAX || days < -PGSQL_DAYS_MAX)
+			kore_buf_append(buf, "null", 4);
+		else
+			pgsql_json_time(buf, (int64_t)days * 86400 * 1000000, 1);
+		break;
+	case PGSQL_TIMESTAMPOID:
+	case PGSQL_TIMESTAMPTZOID:
+		if (len != 8)
+			return (KORE_RESULT_ERROR);
+		pgsql_json_time(buf, (int64_t)net_read64(val), 0);
+		break;
+	case PGSQL_UUIDOID:
+		if (len != 16)
+			return (KORE_RESULT_ERROR);
+		kore_buf_appendf(buf, "\"%02x%02x%02x%02x-%02x%02x-%02x%02x-"
+		    "%02x%02x-%02x%02x%02x%02x%02x%02x\"", val[0], val[1],
+		    val[2], val[3], val[4], val[5], val[6], val[7], val[8],
+		    val[9], val[10], val[11], val[12], val[13], val[14],
+		    val[15]);
+		break;
+	case PGSQL_BYTEAOID:
+		if (!kore_base64_encode(val, len, &b64))
+			return (KORE_RESULT_ERROR);
+		kore_buf_appendf(buf, "\"%s\"", b64);
+		kore_free(b64);
+		break;
+	case PGSQL_JSONOID:
+		kore_buf_append(buf, val, len);
+		break;
+	case PGSQL_JSONBOID:
+		/* Binary jsonb is its text form behind a version byte. */
+		if (len < 1 || val[0] != 1)
+			return (KORE_RESULT_ERROR);
+		kore_buf_append(buf, val + 1, len - 1);
+		break;
+	case PGSQL_TEXTOID:
+	case PGSQL_BPCHAROID:
+	case PGSQL_VARCHAROID:
+		pgsql_json_string(buf, (const char *)val, len);
+		break;
+	default:
+		return (KORE_RESULT_ERROR);
 	}
+
+	return (KORE_RESULT_OK);
 }
 
+/* Append data as a JSON string, copying runs that need no escaping. */
 static void
-pgsql_queue_wakeup(void)
+pgsql_json_string(struct kore_buf *buf, const char *data, size_t len)
 {
-	struct pgsql_wait	*pgw, *next;
+	size_t		i, start;
+	u_int8_t	ch;
 
-	for (pgw = TAILQ_FIRST(&pgsql_wait_queue); pgw != NULL; pgw = next) {
-		next = TAILQ_NEXT(pgw, list);
+	kore_buf_append(buf, "\"", 1);
 
-#if !defined(KORE_NO_HTTP)
-		if (pgw->pgsql->req != NULL) {
-			if (pgw->pgsql->req->flags & HTTP_REQUEST_DELETE) {
-				pgsql_queue_count--;
-				TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-				kore_pool_put(&pgsql_wait_pool, pgw);
-				continue;
-			}
+	start = 0;
+	for (i = 0; i < len; i++) {
+		ch = data[i];
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
 
-			http_request_wakeup(pgw->pgsql->req);
-		}
-#endif
-		if (pgw->pgsql->cb != NULL)
-			pgw->pgsql->cb(pgw->pgsql, pgw->pgsql->arg);
+		if (i > start)
+			kore_buf_append(buf, data + start, i - start);
+		start = i + 1;
 
-		pgsql_queue_count--;
-		TAILQ_REMOVE(&pgsql_wait_queue, pgw, list);
-		kore_pool_put(&pgsql_wait_pool, pgw);
-		return;
+		switch (ch) {
+		case '"':
+			kore_buf_append(buf, "\\\"", 2);
+			break;
+		case '\\':
+			kore_buf_append(buf, "\\\\", 2);
+			break;
+		case '\n':
+			kore_buf_append(buf, "\\n", 2);
+			break;
+		case '\r':
+			kore_buf_append(buf, "\\r", 2);
+			break;
+		case '\t':
+			kore_buf_append(buf, "\\t", 2);
+			break;
+		default:
+			kore_buf_appendf(buf, "\\u%04x", ch);
+			break;
+		}
 	}
+
+	if (i > start)
+		kore_buf_append(buf, data + start, i - start);
+
+	kore_buf_append(buf, "\"", 1);
 }
 
-static struct pgsql_conn *
-pgsql_conn_create(struct kore_pgsql *pgsql, struct pgsql_db *db)
+/*
+ * A postgres timestamp or date, in microseconds since the postgres
+ * epoch, as an ISO 8601 string in UTC.
+ */
+static void
+pgsql_json_time(struct kore_buf *buf, int64_t usec, int date)
 {
-	struct pgsql_conn	*conn;
+	struct tm	tm;
+	time_t		secs;
+	int64_t		frac;
+	char		str[32];
 
-	if (db == NULL || db->conn_string == NULL)
-		fatal("pgsql_conn_create: no connection string");
+	if (usec == INT64_MAX) {
+		kore_buf_append(buf, "\"infinity\"", 10);
+		return;
+	}
 
-	db->conn_count++;
+	if (usec == INT64_MIN) {
+		kore_buf_append(buf, "\"-infinity\"", 11);
+		return;
+	}
 
-	conn = kore_calloc(1, sizeof(*conn));
-	conn->job = NULL;
-	conn->flags = PGSQL_CONN_FREE;
-	conn->name = kore_strdup(db->name);
-	TAILQ_INSERT_TAIL(&pgsql_conn_free, conn, list);
+	if (usec > INT64_MAX - PGSQL_EPOCH_SECS * 1000000) {
+		kore_buf_append(buf, "null", 4);
+		return;
+	}
 
-	conn->evt.type = KORE_TYPE_PGSQL_CONN;
-	conn->evt.handle = kore_pgsql_handle;
+	usec += PGSQL_EPOCH_SECS * 1000000;
 
-	conn->db = PQconnectdb(db->conn_string);
-	if (conn->db == NULL || (PQstatus(conn->db) != CONNECTION_OK)) {
-		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
-		pgsql_conn_cleanup(conn);
-		return (NULL);
+	secs = usec / 1000000;
+	frac = usec % 1000000;
+	if (frac < 0) {
+		secs--;
+		frac += 1000000;
 	}
 
-	return (conn);
+	if (gmtime_r(&secs, &tm) == NULL ||
+	    strftime(str, sizeof(str), date ? "%Y-%m-%d" : "%Y-%m-%dT%H:%M:%S",
+	    &tm) == 0) {
+		kore_buf_append(buf, "null", 4);
+		return;
+	}
+
+	if (date)
+		kore_buf_appendf(buf, "\"%s\"", str);
+	else if (frac != 0)
+		kore_buf_appendf(buf, "\"%s.%06lldZ\"", str, (long long)frac);
+	else
+		kore_buf_appendf(buf, "\"%sZ\"", str);
 }
 
+/*
+ * A text timestamp in the ISO DateStyle, with or without a zone offset,
+ * as an ISO 8601 string in UTC. Anything else (another DateStyle, BC
+ * or years past 9999) is passed on as the string postgres sent.
+ */
 static void
-pgsql_conn_release(struct kore_pgsql *pgsql)
+pgsql_json_text_time(struct kore_buf *buf, const char *val, size_t len)
 {
-	int		fd;
-	PGresult	*result;
-
-	if (pgsql->conn == NULL)
+	struct tm	tm;
+	time_t		secs;
+	const char	*p;
+	int64_t		usec, frac;
+	int		n, i, sign, off[3], noff;
+
+	if (!strcmp(val, "infinity") || !strcmp(val, "-infinity")) {
+		pgsql_json_string(buf, val, len);
 		return;
+	}
 
-	/* Async query cleanup */
-	if (pgsql->flags & KORE_PGSQL_ASYNC) {
-		if (pgsql->flags & KORE_PGSQL_SCHEDULED) {
-			fd = PQsocket(pgsql->conn->db);
-			kore_platform_disable_read(fd);
+	memset(&tm, 0, sizeof(tm));
 
-			if (pgsql->state != KORE_PGSQL_STATE_DONE)
-				pgsql_cancel(pgsql);
+	if (sscanf(val, "%4d-%2d-%2d %2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon,
+	    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) != 6 ||
+	    n != 19)
+		goto passthrough;
+
+	p = val + n;
+
+	frac = 0;
+	if (*p == '.') {
+		p++;
+		for (i = 0; i < 6; i++) {
+			frac *= 10;
+			if (isdigit((unsigned char)*p))
+				frac += *p++ - '0';
 		}
-		kore_pool_put(&pgsql_job_pool, pgsql->conn->job);
+		if (isdigit((unsigned char)*p))
+			goto passthrough;
 	}
 
-	/* Drain just in case. */
-	while ((result = PQgetResult(pgsql->conn->db)) != NULL)
-		PQclear(result);
+	/* The offset is +HH, +HH:MM or +HH:MM:SS. */
+	noff = 0;
+	sign = 0;
+	off[0] = off[1] = off[2] = 0;
+
+	if (*p == '+' || *p == '-') {
+		sign = (*p++ == '-') ? -1 : 1;
+		for (noff = 0; noff < 3; noff++) {
+			if (noff > 0 && *p++ != ':')
+				goto passthrough;
+			if (!isdigit((unsigned char)p[0]) ||
+			    !isdigit((unsigned char)p[1]))
+				goto passthrough;
+			off[noff] = (p[0] - '0') * 10 + (p[1] - '0');
+			p += 2;
+			if (*p != ':')
+				break;
+		}
+	}
 
-	pgsql->conn->job = NULL;
-	pgsql->conn->flags |= PGSQL_CONN_FREE;
-	TAILQ_INSERT_TAIL(&pgsql_conn_free, pgsql->conn, list);
+	if (*p != '\0')
+		goto passthrough;
 
-	pgsql->conn = NULL;
-	pgsql->state = KORE_PGSQL_STATE_COMPLETE;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
 
-	if (pgsql->cb != NULL)
-		pgsql->cb(pgsql, pgsql->arg);
+	secs = timegm(&tm);
+	secs -= sign * (off[0] * 3600 + off[1] * 60 + off[2]);
+	usec = ((int64_t)secs - PGSQL_EPOCH_SECS) * 1000000 + frac;
+
+	pgsql_json_time(buf, usec, 0);
+	return;
 
-	pgsql_queue_wakeup();
+passthrough:
+	pgsql_json_string(buf, val, len);
 }
 
-static void
-pgsql_conn_cleanup(struct pgsql_conn *conn)
+/*
+ * A binary numeric as a JSON number, written out like postgres does
+ * for the text form. It is sent as base 10000 digits: a count, the
+ * weight of the first digit, the sign and the display scale.
+ */
+static int
+pgsql_json_numeric(struct kore_buf *buf, const u_int8_t *val, int len)
 {
-	struct kore_pgsql	*pgsql;
-	struct pgsql_db		*pgsqldb;
+	int		i, d, dscale, weight, ndigits, printed;
+	u_int16_t	sign, digit;
+	char		num[8];
 
-	if (conn->flags & PGSQL_CONN_FREE)
-		TAILQ_REMOVE(&pgsql_conn_free, conn, list);
+	if (len < 8)
+		return (KORE_RESULT_ERROR);
 
-	if (conn->job) {
-		pgsql = conn->job->pgsql;
-#if !defined(KORE_NO_HTTP)
-		if (pgsql->req != NULL)
-			http_request_wakeup(pgsql->req);
-#endif
-		pgsql->conn = NULL;
-		pgsql_set_error(pgsql, PQerrorMessage(conn->db));
+	ndigits = (int16_t)net_read16(val);
+	weight = (int16_t)net_read16(val + 2);
+	sign = net_read16(val + 4);
+	dscale = (int16_t)net_read16(val + 6);
 
-		kore_pool_put(&pgsql_job_pool, conn->job);
-		conn->job = NULL;
+	if (ndigits < 0 || dscale < 0 || len != 8 + ndigits * 2)
+		return (KORE_RESULT_ERROR);
+
+	switch (sign) {
+	case PGSQL_NUMERIC_POS:
+	case PGSQL_NUMERIC_NEG:
+		break;
+	case PGSQL_NUMERIC_NAN:
+	case PGSQL_NUMERIC_PINF:
+	case PGSQL_NUMERIC_NINF:
+		/* NaN and Infinity are not JSON numbers. */
+		kore_buf_append(buf, "null", 4);
+		return (KORE_RESULT_OK);
+	default:
+		return (KORE_RESULT_ERROR);
 	}
 
-	if (conn->db != NULL)
-		PQfinish(conn->db);
+	for (i = 0; i < ndigits; i++) {
+		if (net_read16(val + 8 + i * 2) > 9999)
+			return (KORE_RESULT_ERROR);
+	}
 
-	LIST_FOREACH(pgsqldb, &pgsql_db_conn_strings, rlist) {
-		if (!strcmp(pgsqldb->name, conn->name)) {
-			pgsqldb->conn_count--;
-			break;
+	if (sign == PGSQL_NUMERIC_NEG)
+		kore_buf_append(buf, "-", 1);
+
+	if (weight < 0) {
+		kore_buf_append(buf, "0", 1);
+	} else {
+		for (d = 0; d <= weight; d++) {
+			digit = (d < ndigits) ? net_read16(val + 8 + d * 2) : 0;
+			if (d == 0)
+				kore_buf_appendf(buf, "%u", digit);
+			else
+				kore_buf_appendf(buf, "%04u", digit);
 		}
 	}
 
-	kore_free(conn->name);
-	kore_free(conn);
+	if (dscale == 0)
+		return (KORE_RESULT_OK);
+
+	kore_buf_append(buf, ".", 1);
+
+	for (d = weight + 1, printed = 0; printed < dscale; d++) {
+		digit = (d >= 0 && d < ndigits) ?
+		    net_read16(val + 8 + d * 2) : 0;
+		(void)snprintf(num, sizeof(num), "%04u", digit);
+		kore_buf_append(buf, num, MIN(4, dscale - printed));
+		printed += 4;
+	}
+
+	return (KORE_RESULT_OK);
 }
 
 static void
-pgsql_read_result(struct kore_pgsql *pgsql)
+pgsql_stream_clear(struct kore_pgsql *pgsql)
 {
-	struct pgsql_conn	*conn;
-	PGnotify		*notify;
-	int			saved_errno;
+	u_int16_t	i;
 
-	conn = pgsql->conn;
+	for (i = 0; i < pgsql->stream.count; i++)
+		PQclear(pgsql->stream.rows[i]);
 
-	for (;;) {
-		if (!PQconsumeInput(conn->db)) {
-			pgsql->state = KORE_PGSQL_STATE_ERROR;
-			pgsql->error = kore_strdup(PQerrorMessage(conn->db));
-			return;
-		}
+	pgsql->stream.count = 0;
+}
 
-		saved_errno = errno;
+/*
+ * Map a row number onto the result holding it, for a stream batch that
+ * is the single row result at that index.
+ */
+static PGresult *
+pgsql_stream_row(struct kore_pgsql *pgsql, int *row)
+{
+	PGresult	*result;
 
-		if (PQisBusy(conn->db)) {
-			if (saved_errno != EAGAIN && saved_errno != EWOULDBLOCK)
-				continue;
-			pgsql->state = KORE_PGSQL_STATE_WAIT;
-			conn->evt.flags &= ~KORE_EVENT_READ;
-			return;
-		}
+	if (pgsql->stream.count == 0)
+		return (pgsql->result);
 
-		break;
-	}
+	if (*row < 0 || *row >= pgsql->stream.count)
+		return (pgsql->stream.rows[0]);
 
-	while ((notify = PQnotifies(conn->db)) != NULL) {
-		pgsql->state = KORE_PGSQL_STATE_NOTIFY;
-		pgsql->notify.extra = notify->extra;
-		pgsql->notify.channel = notify->relname;
+	result = pgsql->stream.rows[*row];
+	*row = 0;
 
-		if (pgsql->cb != NULL)
-			pgsql->cb(pgsql, pgsql->arg);
+	return (result);
+}
 
-		PQfreemem(notify);
-	}
+/*
+ * Take a connection out of pipeline mode before it is handed out again,
+ * reading whatever results are still pending. A connection that cannot
+ * leave pipeline mode is useless and must be dropped.
+ */
+static int
+pgsql_pipeline_exit(struct kore_pgsql *pgsql)
+{
+#if PG_VERSION_NUM >= 140000
+	PGresult	*result;
+	PGconn		*db = pgsql->conn->db;
 
-	pgsql->result = PQgetResult(conn->db);
-	if (pgsql->result == NULL) {
-		pgsql->state = KORE_PGSQL_STATE_DONE;
-		return;
-	}
+	if (!(pgsql->flags & PGSQL_PIPELINE))
+		return (KORE_RESULT_OK);
 
-	switch (PQresultStatus(pgsql->result)) {
-	case PGRES_COPY_OUT:
-	case PGRES_COPY_IN:
-	case PGRES_NONFATAL_ERROR:
-	case PGRES_COPY_BOTH:
-		break;
-	case PGRES_COMMAND_OK:
-		pgsql->state = KORE_PGSQL_STATE_DONE;
-		break;
-	case PGRES_TUPLES_OK:
-#if PG_VERSION_NUM >= 90200
-	case PGRES_SINGLE_TUPLE:
-#endif
-		pgsql->state = KORE_PGSQL_STATE_RESULT;
-		break;
-	case PGRES_EMPTY_QUERY:
-	case PGRES_BAD_RESPONSE:
-	case PGRES_FATAL_ERROR:
-		pgsql_set_error(pgsql, PQresultErrorMessage(pgsql->result));
-		break;
+	pgsql->flags &= ~PGSQL_PIPELINE;
+
+	if (PQpipelineStatus(db) == PQ_PIPELINE_OFF)
+		return (KORE_RESULT_OK);
+
+	if (!PQpipelineSync(db))
+		return (KORE_RESULT_ERROR);
+
+	while (!PQexitPipelineMode(db)) {
+		if (PQstatus(db) != CONNECTION_OK)
+			return (KORE_RESULT_ERROR);
+		if ((result = PQgetResult(db)) != NULL)
+			PQclear(result);
 	}
+#endif
+
+	return (KORE_RESULT_OK);
 }
 
 static void
@@ -20,6 +20,10 @@
 
 #include <stdint.h>
 
+#if defined(KORE_USE_TASKS)
+#include <pthread.h>
+#endif
+
 #include "kore.h"
 
 #define POOL_MIN_ELEMENTS		16
@@ -27,42 +31,151 @@
 #define POOL_ELEMENT_BUSY		0
 #define POOL_ELEMENT_FREE		1
 
+/* Default time a region must sit unused before it is unmapped. */
+#define POOL_IDLE_DEFAULT		60000
+
+/*
+ * With kore_pool_hugepages set, regions of at least half a huge page
+ * are rounded up to whole huge pages, smaller ones would waste most
+ * of the page they land on.
+ */
+#define POOL_HUGEPAGE_SIZE		(2 * 1024 * 1024)
+#define POOL_HUGEPAGE_MIN		(POOL_HUGEPAGE_SIZE / 2)
+
+#define POOL_REGION_HUGETLB		0x0001
+#define POOL_REGION_THP			0x0002
+
 #if defined(KORE_USE_TASKS)
+/*
+ * Each thread keeps a small magazine of free entries for a pool so
+ * it only takes the pool lock to move a batch in or out of it. Pools
+ * get a magazine slot by their id, a pool finding its slot taken by
+ * another pool uses the lock for every call instead. The owner of each
+ * slot is shared by all threads so a slot given up by kore_pool_cleanup()
+ * is taken over everywhere, magazines of the old owner are then reset.
+ * A thread that exits hands the entries in its magazines back.
+ */
+#define POOL_MAGAZINES			64
+#define POOL_MAGAZINE_SIZE		32
+#define POOL_MAGAZINE_BATCH		(POOL_MAGAZINE_SIZE / 2)
+
+struct pool_magazine {
+	u_int32_t		id;
+	int			count;
+	struct kore_pool	*pool;
+	struct kore_pool_entry	*entries[POOL_MAGAZINE_SIZE];
+};
+
 static void		pool_lock(struct kore_pool *);
 static void		pool_unlock(struct kore_pool *);
+static struct pool_magazine	*pool_magazine(struct kore_pool *);
+static void		pool_magazine_fill(struct kore_pool *,
+			    struct pool_magazine *);
+static void		pool_magazine_drain(struct kore_pool *,
+			    struct pool_magazine *, int);
+static void		pool_magazine_key(void);
+static void		pool_magazine_exit(void *);
+
+static volatile u_int32_t		pool_ids = 0;
+static volatile u_int32_t		pool_slots[POOL_MAGAZINES];
+static __thread struct pool_magazine	pool_magazines[POOL_MAGAZINES];
+static __thread int			pool_magazines_used = 0;
+static pthread_key_t			pool_key;
+static pthread_once_t			pool_key_once = PTHREAD_ONCE_INIT;
 #endif
 
 static void		pool_region_create(struct kore_pool *, size_t);
 static void		pool_region_destroy(struct kore_pool *);
+static void		pool_region_trim(struct kore_pool *, u_int64_t);
+static void		pool_region_release(struct kore_pool *,
+			    struct kore_pool_region *);
+static void		pool_register(struct kore_pool *);
+static void		*pool_region_map(struct kore_pool_region *);
+static void		pool_unregister(struct kore_pool *);
+
+static struct kore_pool		**pools = NULL;
+static size_t			pools_count = 0;
+
+u_int64_t	kore_pool_idle = POOL_IDLE_DEFAULT;
+int		kore_pool_hugepages = 0;
 
 void
 kore_pool_init(struct kore_pool *pool, const char *name,
     size_t len, size_t elm)
+{
+	kore_pool_init_aligned(pool, name, len, elm, 0);
+}
+
+/*
+ * Like kore_pool_init() but every element handed out starts on an
+ * align byte boundary, align must be a power of two.
+ */
+void
+kore_pool_init_aligned(struct kore_pool *pool, const char *name,
+    size_t len, size_t elm, size_t align)
 {
 	kore_debug("kore_pool_init(%p, %s, %zu, %zu)", pool, name, len, elm);
 
 	if (elm < POOL_MIN_ELEMENTS)
 		elm = POOL_MIN_ELEMENTS;
 
+	if (align & (align - 1))
+		fatal("kore_pool_init: %s: bad alignment %zu", name, align);
+
 	if ((pool->name = strdup(name)) == NULL)
 		fatal("kore_pool_init: strdup %s", errno_s);
 
+	pool->id = 0;
 	pool->lock = 0;
 	pool->elms = 0;
+	pool->hwm = 0;
 	pool->inuse = 0;
 	pool->elen = len;
 	pool->growth = elm * 0.25f;
 	pool->slen = pool->elen + sizeof(struct kore_pool_entry);
+	pool->pad = 0;
+
+	/*
+	 * Regions are page aligned, so with the first entry header placed
+	 * just below an align boundary and a stride that is a multiple of
+	 * align all elements end up aligned.
+	 */
+	if (align > 1) {
+		pool->slen = (pool->slen + align - 1) & ~(align - 1);
+		pool->pad = (align - (sizeof(struct kore_pool_entry) % align)) %
+		    align;
+	}
 
 	LIST_INIT(&(pool->regions));
 	LIST_INIT(&(pool->freelist));
 
+#if defined(KORE_USE_TASKS)
+	pool->id = __sync_add_and_fetch(&pool_ids, 1);
+	(void)__sync_bool_compare_and_swap(
+	    &pool_slots[pool->id % POOL_MAGAZINES], 0, pool->id);
+#endif
+
 	pool_region_create(pool, elm);
+	pool_register(pool);
 }
 
 void
 kore_pool_cleanup(struct kore_pool *pool)
 {
+#if defined(KORE_USE_TASKS)
+	struct pool_magazine	*mag;
+
+	/* Entries cached by other threads go with the regions. */
+	if ((mag = pool_magazine(pool)) != NULL) {
+		mag->id = 0;
+		mag->count = 0;
+	}
+
+	(void)__sync_bool_compare_and_swap(
+	    &pool_slots[pool->id % POOL_MAGAZINES], pool->id, 0);
+#endif
+
+	pool->id = 0;
 	pool->lock = 0;
 	pool->elms = 0;
 	pool->inuse = 0;
@@ -72,16 +185,83 @@ kore_pool_cleanup(struct kore_pool *pool)
 	free(pool->name);
 	pool->name = NULL;
 
+	pool_unregister(pool);
 	pool_region_destroy(pool);
 }
 
+/*
+ * Called from a timer in the workers. Regions grown during a spike are
+ * unmapped once they sat entirely unused for kore_pool_idle ms, the
+ * region made at kore_pool_init() is always kept.
+ */
+void
+kore_pool_trim(void *arg, u_int64_t now)
+{
+	size_t			i;
+	struct kore_pool	*pool;
+
+	if (kore_pool_idle == 0)
+		return;
+
+	for (i = 0; i < pools_count; i++) {
+		pool = pools[i];
+#if defined(KORE_USE_TASKS)
+		pool_lock(pool);
+#endif
+		pool_region_trim(pool, now);
+#if defined(KORE_USE_TASKS)
+		pool_unlock(pool);
+#endif
+	}
+}
+
+void
+kore_pool_regions(u_int32_t *total, u_int32_t *hugetlb, u_int32_t *thp)
+{
+	size_t				i;
+	struct kore_pool_region		*reg;
+
+	*total = 0;
+	*hugetlb = 0;
+	*thp = 0;
+
+	for (i = 0; i < pools_count; i++) {
+#if defined(KORE_USE_TASKS)
+		pool_lock(pools[i]);
+#endif
+		LIST_FOREACH(reg, &pools[i]->regions, list) {
+			(*total)++;
+			if (reg->flags & POOL_REGION_HUGETLB)
+				(*hugetlb)++;
+			if (reg->flags & POOL_REGION_THP)
+				(*thp)++;
+		}
+#if defined(KORE_USE_TASKS)
+		pool_unlock(pools[i]);
+#endif
+	}
+}
+
 void *
 kore_pool_get(struct kore_pool *pool)
 {
 	u_int8_t			*ptr;
 	struct kore_pool_entry		*entry;
-
 #if defined(KORE_USE_TASKS)
+	struct pool_magazine		*mag;
+
+	if ((mag = pool_magazine(pool)) != NULL) {
+		if (mag->count == 0)
+			pool_magazine_fill(pool, mag);
+
+		entry = mag->entries[--mag->count];
+		if (!__sync_bool_compare_and_swap(&entry->state,
+		    POOL_ELEMENT_FREE, POOL_ELEMENT_BUSY))
+			fatal("%s: element %p was not free", pool->name, entry);
+
+		return ((u_int8_t *)entry + sizeof(struct kore_pool_entry));
+	}
+
 	pool_lock(pool);
 #endif
 
@@ -93,10 +273,14 @@ kore_pool_get(struct kore_pool *pool)
 		fatal("%s: element %p was not free", pool->name, entry);
 	LIST_REMOVE(entry, list);
 
+	entry->region->inuse++;
+	entry->region->idle = 0;
 	entry->state = POOL_ELEMENT_BUSY;
 	ptr = (u_int8_t *)entry + sizeof(struct kore_pool_entry);
 
 	pool->inuse++;
+	if (pool->inuse > pool->hwm)
+		pool->hwm = pool->inuse;
 
 #if defined(KORE_USE_TASKS)
 	pool_unlock(pool);
@@ -109,21 +293,40 @@ void
 kore_pool_put(struct kore_pool *pool, void *ptr)
 {
 	struct kore_pool_entry		*entry;
-
 #if defined(KORE_USE_TASKS)
-	pool_lock(pool);
+	struct pool_magazine		*mag;
 #endif
 
 	entry = (struct kore_pool_entry *)
 	    ((u_int8_t *)ptr - sizeof(struct kore_pool_entry));
 
+#if defined(KORE_USE_TASKS)
+	if (!__sync_bool_compare_and_swap(&entry->state,
+	    POOL_ELEMENT_BUSY, POOL_ELEMENT_FREE))
+		fatal("%s: element %p was not busy", pool->name, ptr);
+
+	if ((mag = pool_magazine(pool)) != NULL) {
+		if (mag->count == POOL_MAGAZINE_SIZE) {
+			pool_magazine_drain(pool, mag,
+			    POOL_MAGAZINE_SIZE - POOL_MAGAZINE_BATCH);
+		}
+
+		mag->entries[mag->count++] = entry;
+		return;
+	}
+
+	pool_lock(pool);
+#else
 	if (entry->state != POOL_ELEMENT_BUSY)
 		fatal("%s: element %p was not busy", pool->name, ptr);
 
 	entry->state = POOL_ELEMENT_FREE;
+#endif
+
 	LIST_INSERT_HEAD(&(pool->freelist), entry, list);
 
 	pool->inuse--;
+	entry->region->inuse--;
 
 #if defined(KORE_USE_TASKS)
 	pool_unlock(pool);
@@ -145,16 +348,24 @@ pool_region_create(struct kore_pool *pool, size_t elms)
 
 	LIST_INSERT_HEAD(&(pool->regions), reg, list);
 
-	if (SIZE_MAX / elms < pool->slen)
+	if ((SIZE_MAX - pool->pad) / elms < pool->slen)
 		fatal("pool_region_create: overflow");
 
-	reg->length = elms * pool->slen;
-	reg->start = mmap(NULL, reg->length, PROT_READ | PROT_WRITE,
-	    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-	if (reg->start == MAP_FAILED)
-		fatal("mmap: %s", errno_s);
+	reg->flags = 0;
+	reg->idle = 0;
+	reg->inuse = 0;
+	reg->length = pool->pad + elms * pool->slen;
+
+	if (kore_pool_hugepages && reg->length >= POOL_HUGEPAGE_MIN) {
+		reg->length = (reg->length + POOL_HUGEPAGE_SIZE - 1) &
+		    ~((size_t)POOL_HUGEPAGE_SIZE - 1);
+		elms = (reg->length - pool->pad) / pool->slen;
+	}
+
+	reg->elms = elms;
+	reg->start = pool_region_map(reg);
 
-	p = (u_int8_t *)reg->start;
+	p = (u_int8_t *)reg->start + pool->pad;
 
 	for (i = 0; i < elms; i++) {
 		entry = (struct kore_pool_entry *)p;
@@ -188,6 +399,162 @@ pool_region_destroy(struct kore_pool *pool)
 	pool->elms = 0;
 }
 
+/*
+ * Regions rounded up to huge pages first try MAP_HUGETLB, which only
+ * works if the admin reserved huge pages, and otherwise get an aligned
+ * mapping that is marked for transparent huge pages. Failing both the
+ * region gets normal pages.
+ */
+static void *
+pool_region_map(struct kore_pool_region *reg)
+{
+	void		*p;
+#if defined(MADV_HUGEPAGE)
+	u_int8_t	*base, *aligned;
+	size_t		head, tail;
+#endif
+
+	if (!kore_pool_hugepages || reg->length % POOL_HUGEPAGE_SIZE)
+		goto normal;
+
+#if defined(MAP_HUGETLB)
+	p = mmap(NULL, reg->length, PROT_READ | PROT_WRITE,
+	    MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		reg->flags |= POOL_REGION_HUGETLB;
+		return (p);
+	}
+#endif
+
+#if defined(MADV_HUGEPAGE)
+	p = mmap(NULL, reg->length + POOL_HUGEPAGE_SIZE,
+	    PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		fatal("mmap: %s", errno_s);
+
+	base = p;
+	aligned = (u_int8_t *)(((uintptr_t)base + POOL_HUGEPAGE_SIZE - 1) &
+	    ~((uintptr_t)POOL_HUGEPAGE_SIZE - 1));
+
+	head = aligned - base;
+	tail = POOL_HUGEPAGE_SIZE - head;
+
+	if (head > 0)
+		(void)munmap(base, head);
+	if (tail > 0)
+		(void)munmap(aligned + reg->length, tail);
+
+	if (madvise(aligned, reg->length, MADV_HUGEPAGE) == 0)
+		reg->flags |= POOL_REGION_THP;
+
+	return (aligned);
+#endif
+
+normal:
+	p = mmap(NULL, reg->length, PROT_READ | PROT_WRITE,
+	    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (p == MAP_FAILED)
+		fatal("mmap: %s", errno_s);
+
+	return (p);
+}
+
+/*
+ * Restarted workers initialize pools again that the parent set up
+ * before forking them, so a pool is only ever registered once.
+ */
+static void
+pool_register(struct kore_pool *pool)
+{
+	size_t		i;
+
+	for (i = 0; i < pools_count; i++) {
+		if (pools[i] == pool)
+			return;
+	}
+
+	pools = realloc(pools, (pools_count + 1) * sizeof(*pools));
+	if (pools == NULL)
+		fatal("pool_register: realloc: %s", errno_s);
+
+	pools[pools_count++] = pool;
+}
+
+static void
+pool_unregister(struct kore_pool *pool)
+{
+	size_t		i;
+
+	for (i = 0; i < pools_count; i++) {
+		if (pools[i] == pool) {
+			pools[i] = pools[--pools_count];
+			break;
+		}
+	}
+}
+
+/*
+ * A region is only released if the pool keeps at least a growth worth
+ * of free entries after it, so traffic hovering around the size of
+ * the pool does not unmap and mmap the same region over and over.
+ */
+static void
+pool_region_trim(struct kore_pool *pool, u_int64_t now)
+{
+	struct kore_pool_region		*reg, *next;
+
+	for (reg = LIST_FIRST(&pool->regions); reg != NULL; reg = next) {
+		next = LIST_NEXT(reg, list);
+
+		/* The initial region is the last one on the list. */
+		if (next == NULL)
+			break;
+
+		if (reg->inuse != 0)
+			continue;
+
+		if (reg->idle == 0) {
+			reg->idle = now;
+			continue;
+		}
+
+		if (now - reg->idle < kore_pool_idle)
+			continue;
+
+		if (pool->elms - reg->elms < pool->inuse + pool->growth)
+			continue;
+
+		pool_region_release(pool, reg);
+	}
+}
+
+static void
+pool_region_release(struct kore_pool *pool, struct kore_pool_region *reg)
+{
+	size_t				i;
+	u_int8_t			*p;
+	struct kore_pool_entry		*entry;
+
+	kore_debug("pool_region_release(%s, %zu)", pool->name, reg->elms);
+
+	p = (u_int8_t *)reg->start + pool->pad;
+
+	for (i = 0; i < reg->elms; i++) {
+		entry = (struct kore_pool_entry *)p;
+		if (entry->state != POOL_ELEMENT_FREE)
+			fatal("%s: releasing busy element %p", pool->name, entry);
+		LIST_REMOVE(entry, list);
+
+		p = p + pool->slen;
+	}
+
+	pool->elms -= reg->elms;
+
+	LIST_REMOVE(reg, list);
+	(void)munmap(reg->start, reg->length);
+	free(reg);
+}
+
 #if defined(KORE_USE_TASKS)
 static void
 pool_lock(struct kore_pool *pool)
@@ -204,4 +571,117 @@ pool_unlock(struct kore_pool *pool)
 	if (!__sync_bool_compare_and_swap(&pool->lock, 1, 0))
 		fatal("pool_unlock: failed to release %s", pool->name);
 }
+
+static struct pool_magazine *
+pool_magazine(struct kore_pool *pool)
+{
+	u_int32_t		slot;
+	struct pool_magazine	*mag;
+
+	if (pool->id == 0)
+		return (NULL);
+
+	slot = pool->id % POOL_MAGAZINES;
+	if (pool_slots[slot] != pool->id &&
+	    !__sync_bool_compare_and_swap(&pool_slots[slot], 0, pool->id))
+		return (NULL);
+
+	if (pool_magazines_used == 0) {
+		if (pthread_once(&pool_key_once, pool_magazine_key) != 0)
+			fatal("pool_magazine: pthread_once failed");
+		if (pthread_setspecific(pool_key, pool_magazines) != 0)
+			fatal("pool_magazine: pthread_setspecific failed");
+		pool_magazines_used = 1;
+	}
+
+	mag = &pool_magazines[slot];
+	if (mag->id != pool->id) {
+		mag->id = pool->id;
+		mag->pool = pool;
+		mag->count = 0;
+	}
+
+	return (mag);
+}
+
+static void
+pool_magazine_key(void)
+{
+	if (pthread_key_create(&pool_key, pool_magazine_exit) != 0)
+		fatal("pool_magazine_key: pthread_key_create failed");
+}
+
+/*
+ * Called when a thread that used magazines exits, entries for pools
+ * that still own their slot go back to the freelist.
+ */
+static void
+pool_magazine_exit(void *arg)
+{
+	int			slot;
+	struct pool_magazine	*mag;
+
+	mag = arg;
+
+	for (slot = 0; slot < POOL_MAGAZINES; slot++) {
+		if (mag[slot].id == 0 || mag[slot].count == 0)
+			continue;
+
+		if (pool_slots[slot] == mag[slot].id)
+			pool_magazine_drain(mag[slot].pool, &mag[slot], 0);
+
+		mag[slot].id = 0;
+		mag[slot].count = 0;
+	}
+}
+
+/*
+ * Entries in a magazine count as in use as far as the pool is
+ * concerned, they are not on its freelist.
+ */
+static void
+pool_magazine_fill(struct kore_pool *pool, struct pool_magazine *mag)
+{
+	struct kore_pool_entry		*entry;
+
+	pool_lock(pool);
+
+	while (mag->count < POOL_MAGAZINE_BATCH) {
+		if (LIST_EMPTY(&(pool->freelist)))
+			pool_region_create(pool, pool->growth);
+
+		entry = LIST_FIRST(&(pool->freelist));
+		if (entry->state != POOL_ELEMENT_FREE)
+			fatal("%s: element %p was not free", pool->name, entry);
+		LIST_REMOVE(entry, list);
+
+		mag->entries[mag->count++] = entry;
+		pool->inuse++;
+		entry->region->inuse++;
+		entry->region->idle = 0;
+	}
+
+	if (pool->inuse > pool->hwm)
+		pool->hwm = pool->inuse;
+
+	pool_unlock(pool);
+}
+
+static void
+pool_magazine_drain(struct kore_pool *pool, struct pool_magazine *mag,
+    int keep)
+{
+	struct kore_pool_entry		*entry;
+
+	pool_lock(pool);
+
+	while (mag->count > keep) {
+		entry = mag->entries[--mag->count];
+		LIST_INSERT_HEAD(&(pool->freelist), entry, list);
+		pool->inuse--;
+		entry->region->inuse--;
+	}
+
+	pool_unlock(pool);
+}
 #endif
@@ -0,0 +1,1392 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reverse proxy routes. Requests on a proxy route are forwarded as
+ * HTTP/1.1 to a server of an upstream, over connections that live in
+ * the worker its event loop and are kept alive in a per server pool.
+ *
+ * Request and response bodies are relayed a piece at a time, straight
+ * from the receiving netbuf into the other side its send queue. While
+ * one side is slow the other is not read from.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <netdb.h>
+#include <stdio.h>
+
+#include "kore.h"
+#include "http.h"
+
+#if defined(__linux__)
+#include "seccomp.h"
+
+static struct sock_filter filter_proxy[] = {
+	/* Connections to upstream servers. */
+	KORE_SYSCALL_ALLOW(connect),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET),
+	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET6),
+	KORE_SYSCALL_ALLOW_ARG(getsockopt, 2, SO_ERROR),
+};
+#endif
+
+#define PROXY_HEAD_MAX		(16 * 1024)
+#define PROXY_LINE_MAX		1024
+#define PROXY_BUFFER_MAX	(256 * 1024)
+#define PROXY_RETRY_MAX		2
+
+#define PROXY_SERVER_DOWN	0x0001
+#define PROXY_SERVER_PROBING	0x0002
+
+#define PROXY_CONN_CONNECTING	0x0001
+#define PROXY_CONN_REUSED	0x0002
+#define PROXY_CONN_IDLE		0x0004
+#define PROXY_CONN_PROBE	0x0008
+#define PROXY_CONN_STARTED	0x0010
+
+#define PROXY_REQ_CHUNKED_UP	0x0001
+#define PROXY_REQ_BODY_SENDING	0x0002
+#define PROXY_REQ_BODY_SENT	0x0004
+#define PROXY_REQ_BODY_DONE	0x0008
+#define PROXY_REQ_HEAD_DONE	0x0010
+#define PROXY_REQ_STARTED	0x0020
+#define PROXY_REQ_SENDING	0x0040
+#define PROXY_REQ_PAUSED	0x0080
+#define PROXY_REQ_DONE		0x0100
+#define PROXY_REQ_FAILED	0x0200
+#define PROXY_REQ_NO_REUSE	0x0400
+#define PROXY_REQ_NO_CONNECT	0x0800
+#define PROXY_REQ_STALE		0x1000
+
+#define PROXY_BODY_NONE		0
+#define PROXY_BODY_LENGTH	1
+#define PROXY_BODY_CHUNKED	2
+#define PROXY_BODY_CLOSE	3
+
+#define PROXY_CHUNK_SIZE	0
+#define PROXY_CHUNK_DATA	1
+#define PROXY_CHUNK_DATA_END	2
+#define PROXY_CHUNK_TRAILER	3
+
+struct proxy_request;
+
+struct kore_upstream_server {
+	int				flags;
+	char				*name;
+	u_int32_t			idle;
+	u_int32_t			active;
+	socklen_t			addrlen;
+	struct sockaddr_storage		addr;
+	struct kore_upstream		*upstream;
+	TAILQ_HEAD(, proxy_conn)	pool;
+};
+
+/* Lives in hdlr_extra of an upstream connection, freed with it. */
+struct proxy_conn {
+	int				flags;
+	struct connection		*c;
+	struct kore_upstream_server	*server;
+	struct proxy_request		*pr;
+	TAILQ_ENTRY(proxy_conn)		list;
+};
+
+/*
+ * Outlives its request if a piece of a body is still in a send queue
+ * when the request is freed, the last send callback frees it then.
+ */
+struct proxy_request {
+	int				flags;
+	int				mode;
+	int				chunk;
+	int				status;
+	int				retries;
+	u_int64_t			remaining;
+	struct http_request		*req;
+	struct proxy_conn		*pc;
+	struct kore_upstream		*upstream;
+	struct kore_buf			line;
+	struct kore_buf			body;
+	struct kore_buf			pending;
+	struct kore_buf			inflight;
+};
+
+struct proxy_route {
+	struct kore_module_handle	*hdlr;
+	struct kore_upstream		*upstream;
+	TAILQ_ENTRY(proxy_route)	list;
+};
+
+int	proxy_handle(struct http_request *);
+
+static int	proxy_request_run(struct proxy_request *);
+static int	proxy_request_send(struct proxy_request *);
+static void	proxy_request_head(struct proxy_request *, struct kore_buf *);
+static void	proxy_request_free(struct http_request *);
+static void	proxy_request_release(struct proxy_request *);
+static int	proxy_request_retry(struct proxy_request *);
+
+static int	proxy_body_data(struct http_request *, const void *, size_t);
+static int	proxy_body_sent(struct netbuf *);
+
+static int	proxy_response_data(struct proxy_request *,
+		    const u_int8_t *, size_t);
+static ssize_t	proxy_response_head(struct proxy_request *,
+		    const u_int8_t *, size_t);
+static int	proxy_response_parse(struct proxy_request *);
+static void	proxy_response_start(struct proxy_request *);
+static ssize_t	proxy_response_line(struct proxy_request *,
+		    const u_int8_t *, size_t, char **);
+static ssize_t	proxy_response_chunked(struct proxy_request *,
+		    const u_int8_t *, size_t);
+static void	proxy_response_flush(struct proxy_request *);
+static int	proxy_response_sent(struct netbuf *);
+
+static struct kore_upstream_server	*proxy_server_pick(
+					    struct kore_upstream *);
+static void	proxy_server_down(struct kore_upstream_server *);
+
+static struct proxy_conn	*proxy_conn_get(struct kore_upstream *);
+static struct proxy_conn	*proxy_conn_new(struct kore_upstream_server *);
+static int	proxy_conn_connect(struct connection *);
+static int	proxy_conn_handle(struct connection *);
+static void	proxy_conn_event(void *, int);
+static void	proxy_conn_disconnect(struct connection *);
+static void	proxy_conn_release(struct proxy_conn *, int);
+static void	proxy_conn_park(struct proxy_conn *);
+static int	proxy_conn_recv(struct netbuf *);
+static int	proxy_conn_idle(struct netbuf *);
+static void	proxy_conn_resume(struct proxy_request *);
+
+static void	proxy_health_check(void *, u_int64_t);
+static int	proxy_hop_header(const char *);
+
+static TAILQ_HEAD(, proxy_route)	routes =
+					    TAILQ_HEAD_INITIALIZER(routes);
+static LIST_HEAD(, kore_upstream)	upstreams =
+					    LIST_HEAD_INITIALIZER(upstreams);
+
+/* Headers that only concern a single connection, never forwarded. */
+static const char *hop_headers[] = {
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"proxy-authenticate",
+	"proxy-authorization",
+	"te",
+	"trailer",
+	"transfer-encoding",
+	"upgrade",
+	"content-length",
+	"expect",
+	NULL
+};
+
+struct kore_upstream *
+kore_proxy_upstream_create(const char *name)
+{
+	struct kore_upstream	*up;
+
+	if (kore_proxy_upstream_lookup(name) != NULL)
+		return (NULL);
+
+	up = kore_calloc(1, sizeof(*up));
+	up->name = kore_strdup(name);
+	up->balance = KORE_PROXY_BALANCE_ROUNDROBIN;
+	up->keepalive = KORE_PROXY_KEEPALIVE;
+	up->timeout = KORE_PROXY_TIMEOUT * 1000;
+	up->connect_timeout = KORE_PROXY_CONNECT_TIMEOUT * 1000;
+	up->health_check = KORE_PROXY_HEALTH_CHECK * 1000;
+
+#if defined(__linux__)
+	/* Upstreams are set up before the workers enable their sandbox. */
+	if (LIST_EMPTY(&upstreams)) {
+		kore_seccomp_filter("proxy", filter_proxy,
+		    KORE_FILTER_LEN(filter_proxy));
+	}
+#endif
+
+	LIST_INSERT_HEAD(&upstreams, up, list);
+
+	return (up);
+}
+
+struct kore_upstream *
+kore_proxy_upstream_lookup(const char *name)
+{
+	struct kore_upstream	*up;
+
+	LIST_FOREACH(up, &upstreams, list) {
+		if (!strcmp(up->name, name))
+			return (up);
+	}
+
+	return (NULL);
+}
+
+int
+kore_proxy_upstream_server(struct kore_upstream *up, const char *host,
+    const char *port)
+{
+	int				r;
+	struct kore_upstream_server	*server;
+	struct addrinfo			hints, *results;
+	char				name[256];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if ((r = getaddrinfo(host, port, &hints, &results)) != 0) {
+		kore_log(LOG_ERR, "getaddrinfo(%s): %s", host, gai_strerror(r));
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (results->ai_addrlen > sizeof(server->addr))
+		fatal("%s: address too large", __func__);
+
+	r = snprintf(name, sizeof(name), "%s:%s", host, port);
+	if (r == -1 || (size_t)r >= sizeof(name)) {
+		freeaddrinfo(results);
+		return (KORE_RESULT_ERROR);
+	}
+
+	server = kore_calloc(1, sizeof(*server));
+	server->upstream = up;
+	server->name = kore_strdup(name);
+	server->addrlen = results->ai_addrlen;
+	memcpy(&server->addr, results->ai_addr, results->ai_addrlen);
+	TAILQ_INIT(&server->pool);
+
+	freeaddrinfo(results);
+
+	up->servers = kore_realloc(up->servers,
+	    (up->server_count + 1) * sizeof(*up->servers));
+	up->servers[up->server_count++] = server;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Forward everything under path on dom to the named upstream. Bodies
+ * of requests on the route are streamed, see http_body_stream().
+ */
+int
+kore_proxy_create(struct kore_domain *dom, const char *path, const char *name)
+{
+	int				len;
+	struct kore_upstream		*up;
+	struct proxy_route		*route;
+	struct kore_module_handle	*hdlr;
+	char				regex[1024];
+
+	if ((up = kore_proxy_upstream_lookup(name)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (path[0] != '/')
+		return (KORE_RESULT_ERROR);
+
+	len = snprintf(regex, sizeof(regex), "^%s.*$", path);
+	if (len == -1 || (size_t)len >= sizeof(regex))
+		return (KORE_RESULT_ERROR);
+
+	if (!kore_module_handler_new(dom, regex, "proxy_handle",
+	    NULL, HANDLER_TYPE_DYNAMIC))
+		return (KORE_RESULT_ERROR);
+
+	TAILQ_FOREACH(hdlr, &dom->handlers, list) {
+		if (!strcmp(hdlr->path, regex))
+			break;
+	}
+
+	if (hdlr == NULL)
+		fatal("couldn't find newly created handler for proxy");
+
+	hdlr->stream = 1;
+
+	route = kore_calloc(1, sizeof(*route));
+	route->hdlr = hdlr;
+	route->upstream = up;
+	TAILQ_INSERT_TAIL(&routes, route, list);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_proxy_worker_init(void)
+{
+	struct kore_upstream	*up;
+
+	LIST_FOREACH(up, &upstreams, list) {
+		if (up->health_check > 0) {
+			kore_timer_add(proxy_health_check,
+			    up->health_check, up, 0);
+		}
+	}
+}
+
+int
+proxy_handle(struct http_request *req)
+{
+	struct proxy_route	*route;
+	struct proxy_request	*pr;
+
+	if ((pr = req->hdlr_extra) != NULL)
+		return (proxy_request_run(pr));
+
+	TAILQ_FOREACH(route, &routes, list) {
+		if (route->hdlr == req->hdlr)
+			break;
+	}
+
+	if (route == NULL) {
+		http_response(req, HTTP_STATUS_INTERNAL_ERROR, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	pr = kore_calloc(1, sizeof(*pr));
+	pr->req = req;
+	pr->upstream = route->upstream;
+
+	kore_buf_init(&pr->line, 128);
+	kore_buf_init(&pr->body, NETBUF_SEND_PAYLOAD_MAX);
+	kore_buf_init(&pr->pending, NETBUF_SEND_PAYLOAD_MAX);
+	kore_buf_init(&pr->inflight, NETBUF_SEND_PAYLOAD_MAX);
+
+	req->hdlr_extra = pr;
+	req->onfree = proxy_request_free;
+	req->flags |= HTTP_REQUEST_RETAIN_EXTRA;
+
+	if (!proxy_request_send(pr)) {
+		http_response(req, HTTP_STATUS_BAD_GATEWAY, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	return (proxy_request_run(pr));
+}
+
+/*
+ * Called for every wakeup of a proxied request: keeps its body going
+ * upstream and the response going downstream until both are done.
+ */
+static int
+proxy_request_run(struct proxy_request *pr)
+{
+	int			r;
+	struct http_request	*req = pr->req;
+
+	if (pr->flags & PROXY_REQ_FAILED) {
+		if (proxy_request_retry(pr))
+			return (proxy_request_run(pr));
+
+		if (!(pr->flags & PROXY_REQ_HEAD_DONE)) {
+			http_response(req, HTTP_STATUS_BAD_GATEWAY, NULL, 0);
+			return (KORE_RESULT_OK);
+		}
+
+		/* A cut short body must not look complete to the client. */
+		if ((pr->flags & PROXY_REQ_STARTED) && req->owner != NULL &&
+		    req->owner->proto == CONN_PROTO_HTTP)
+			kore_connection_disconnect(req->owner);
+
+		return (KORE_RESULT_OK);
+	}
+
+	if (!(pr->flags & PROXY_REQ_BODY_DONE)) {
+		r = http_body_stream(req, proxy_body_data);
+		if (r == KORE_RESULT_ERROR)
+			return (KORE_RESULT_OK);
+
+		if (r == KORE_RESULT_OK) {
+			pr->flags |= PROXY_REQ_BODY_DONE;
+			if ((pr->flags & PROXY_REQ_CHUNKED_UP) && pr->pc != NULL) {
+				net_send_queue(pr->pc->c, "0\r\n\r\n", 5);
+				if (!(pr->pc->flags & PROXY_CONN_CONNECTING) &&
+				    !net_send_flush(pr->pc->c))
+					kore_connection_disconnect(pr->pc->c);
+			}
+		} else if (!(pr->flags & PROXY_REQ_BODY_SENDING)) {
+			http_body_stream_resume(req);
+		}
+	}
+
+	proxy_response_flush(pr);
+
+	if ((pr->flags & PROXY_REQ_PAUSED) && pr->pending.offset == 0)
+		proxy_conn_resume(pr);
+
+	if ((pr->flags & PROXY_REQ_DONE) &&
+	    !(pr->flags & PROXY_REQ_SENDING) && pr->pending.offset == 0) {
+		if (pr->flags & PROXY_REQ_STARTED)
+			http_response_chunk_end(req);
+		return (KORE_RESULT_OK);
+	}
+
+	http_request_sleep(req);
+
+	return (KORE_RESULT_RETRY);
+}
+
+/*
+ * Retry on another connection if the request never reached a server,
+ * or if a kept alive connection turned out to be closed underneath an
+ * idempotent request.
+ */
+static int
+proxy_request_retry(struct proxy_request *pr)
+{
+	struct http_request	*req = pr->req;
+
+	if (pr->retries >= PROXY_RETRY_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if (pr->flags & (PROXY_REQ_HEAD_DONE | PROXY_REQ_BODY_SENT))
+		return (KORE_RESULT_ERROR);
+
+	if (!(pr->flags & PROXY_REQ_NO_CONNECT)) {
+		if (!(pr->flags & PROXY_REQ_STALE))
+			return (KORE_RESULT_ERROR);
+
+		switch (req->method) {
+		case HTTP_METHOD_GET:
+		case HTTP_METHOD_HEAD:
+		case HTTP_METHOD_PUT:
+		case HTTP_METHOD_DELETE:
+		case HTTP_METHOD_OPTIONS:
+			break;
+		default:
+			return (KORE_RESULT_ERROR);
+		}
+	}
+
+	pr->retries++;
+	pr->flags &= ~(PROXY_REQ_FAILED | PROXY_REQ_NO_CONNECT |
+	    PROXY_REQ_STALE | PROXY_REQ_NO_REUSE | PROXY_REQ_CHUNKED_UP);
+
+	return (proxy_request_send(pr));
+}
+
+static int
+proxy_request_send(struct proxy_request *pr)
+{
+	struct kore_buf		head;
+	struct proxy_conn	*pc;
+	struct connection	*c;
+
+	if ((pc = proxy_conn_get(pr->upstream)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	c = pc->c;
+	pc->pr = pr;
+	pr->pc = pc;
+	pc->server->active++;
+
+	kore_buf_init(&head, 1024);
+	proxy_request_head(pr, &head);
+	net_send_queue(c, head.data, head.offset);
+	kore_buf_cleanup(&head);
+
+	if (pc->flags & PROXY_CONN_CONNECTING) {
+		c->evt.flags |= KORE_EVENT_WRITE;
+		if (!c->handle(c))
+			kore_connection_disconnect(c);
+		return (KORE_RESULT_OK);
+	}
+
+	net_recv_reset(c, NETBUF_SEND_PAYLOAD_MAX, proxy_conn_recv);
+	c->idle_timer.length = pr->upstream->timeout;
+	kore_connection_start_idletimer(c);
+
+	if (!net_send_flush(c))
+		kore_connection_disconnect(c);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+proxy_request_head(struct proxy_request *pr, struct kore_buf *buf)
+{
+	struct http_header	*hdr;
+	const void		*addr;
+	struct http_request	*req = pr->req;
+	struct connection	*c = req->owner;
+	const char		*xff;
+	char			ip[INET6_ADDRSTRLEN];
+
+	kore_buf_appendf(buf, "%s %s%s%s HTTP/1.1\r\n",
+	    http_method_text(req->method), req->path,
+	    req->query_string != NULL ? "?" : "",
+	    req->query_string != NULL ? req->query_string : "");
+
+	xff = NULL;
+
+	TAILQ_FOREACH(hdr, &req->req_headers, list) {
+		if (hdr->header[0] == ':' || !strcasecmp(hdr->header, "host"))
+			continue;
+
+		if (!strcasecmp(hdr->header, "x-forwarded-for")) {
+			xff = hdr->value;
+			continue;
+		}
+
+		if (!strcasecmp(hdr->header, "x-forwarded-proto") ||
+		    proxy_hop_header(hdr->header))
+			continue;
+
+		kore_buf_appendf(buf, "%s: %s\r\n", hdr->header, hdr->value);
+	}
+
+	if (req->host != NULL)
+		kore_buf_appendf(buf, "host: %s\r\n", req->host);
+
+	switch (c->family) {
+	case AF_INET:
+		addr = &c->addr.ipv4.sin_addr;
+		break;
+	case AF_INET6:
+		addr = &c->addr.ipv6.sin6_addr;
+		break;
+	default:
+		addr = NULL;
+		break;
+	}
+
+	if (addr != NULL && inet_ntop(c->family, addr, ip, sizeof(ip))) {
+		if (xff != NULL) {
+			kore_buf_appendf(buf,
+			    "x-forwarded-for: %s, %s\r\n", xff, ip);
+		} else {
+			kore_buf_appendf(buf, "x-forwarded-for: %s\r\n", ip);
+		}
+	}
+
+	kore_buf_appendf(buf, "x-forwarded-proto: %s\r\n",
+	    c->ssl != NULL ? "https" : "http");
+
+	/* HTTP/2 bodies need not announce their length. */
+	if ((req->flags & HTTP_REQUEST_EXPECT_BODY) &&
+	    req->http_body_length == 0) {
+		pr->flags |= PROXY_REQ_CHUNKED_UP;
+		kore_buf_appendf(buf, "transfer-encoding: chunked\r\n");
+	} else if ((req->flags & HTTP_REQUEST_EXPECT_BODY) ||
+	    req->method == HTTP_METHOD_POST || req->method == HTTP_METHOD_PUT ||
+	    req->method == HTTP_METHOD_PATCH) {
+		kore_buf_appendf(buf, "content-length: %zu\r\n",
+		    req->http_body_length);
+	}
+
+	kore_buf_appendf(buf, "\r\n");
+}
+
+static void
+proxy_request_free(struct http_request *req)
+{
+	struct proxy_conn	*pc;
+	struct proxy_request	*pr = req->hdlr_extra;
+
+	req->hdlr_extra = NULL;
+	pr->req = NULL;
+
+	if ((pc = pr->pc) != NULL) {
+		pc->pr = NULL;
+		pr->pc = NULL;
+		pc->server->active--;
+		kore_connection_disconnect(pc->c);
+	}
+
+	proxy_request_release(pr);
+}
+
+static void
+proxy_request_release(struct proxy_request *pr)
+{
+	if (pr->req != NULL ||
+	    (pr->flags & (PROXY_REQ_SENDING | PROXY_REQ_BODY_SENDING)))
+		return;
+
+	kore_buf_cleanup(&pr->line);
+	kore_buf_cleanup(&pr->body);
+	kore_buf_cleanup(&pr->pending);
+	kore_buf_cleanup(&pr->inflight);
+	kore_free(pr);
+}
+
+/*
+ * A piece of the request body, held back while the previous one is
+ * still on its way upstream.
+ */
+static int
+proxy_body_data(struct http_request *req, const void *data, size_t len)
+{
+	struct netbuf		*nb;
+	struct proxy_conn	*pc;
+	struct proxy_request	*pr = req->hdlr_extra;
+
+	if ((pc = pr->pc) == NULL || (pr->flags & PROXY_REQ_BODY_SENDING))
+		return (KORE_RESULT_RETRY);
+
+	kore_buf_reset(&pr->body);
+
+	if (pr->flags & PROXY_REQ_CHUNKED_UP) {
+		kore_buf_append_hex(&pr->body, len);
+		kore_buf_append(&pr->body, "\r\n", 2);
+		kore_buf_append(&pr->body, data, len);
+		kore_buf_append(&pr->body, "\r\n", 2);
+	} else {
+		kore_buf_append(&pr->body, data, len);
+	}
+
+	pr->flags |= PROXY_REQ_BODY_SENDING | PROXY_REQ_BODY_SENT;
+
+	net_send_stream(pc->c, pr->body.data, pr->body.offset,
+	    proxy_body_sent, &nb);
+	nb->extra = pr;
+
+	if (!(pc->flags & PROXY_CONN_CONNECTING) && !net_send_flush(pc->c))
+		kore_connection_disconnect(pc->c);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+proxy_body_sent(struct netbuf *nb)
+{
+	struct proxy_request	*pr = nb->extra;
+
+	pr->flags &= ~PROXY_REQ_BODY_SENDING;
+
+	if (pr->req == NULL)
+		proxy_request_release(pr);
+	else
+		http_request_wakeup(pr->req);
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+proxy_response_data(struct proxy_request *pr, const u_int8_t *data,
+    size_t len)
+{
+	ssize_t		n;
+
+	while (len > 0 && !(pr->flags & PROXY_REQ_DONE)) {
+		if (!(pr->flags & PROXY_REQ_HEAD_DONE)) {
+			n = proxy_response_head(pr, data, len);
+		} else {
+			switch (pr->mode) {
+			case PROXY_BODY_LENGTH:
+				n = MIN(len, pr->remaining);
+				kore_buf_append(&pr->pending, data, n);
+				pr->remaining -= n;
+				if (pr->remaining == 0)
+					pr->flags |= PROXY_REQ_DONE;
+				break;
+			case PROXY_BODY_CHUNKED:
+				n = proxy_response_chunked(pr, data, len);
+				break;
+			case PROXY_BODY_CLOSE:
+				n = len;
+				kore_buf_append(&pr->pending, data, n);
+				break;
+			default:
+				n = -1;
+				break;
+			}
+		}
+
+		if (n == -1)
+			return (KORE_RESULT_ERROR);
+
+		data += n;
+		len -= n;
+	}
+
+	/* Anything after the response means we lost track of the stream. */
+	if (len > 0)
+		pr->flags |= PROXY_REQ_NO_REUSE;
+
+	return (KORE_RESULT_OK);
+}
+
+static ssize_t
+proxy_response_head(struct proxy_request *pr, const u_int8_t *data,
+    size_t len)
+{
+	size_t		off, start;
+	u_int8_t	*end;
+
+	off = pr->line.offset;
+	start = off > 3 ? off - 3 : 0;
+
+	kore_buf_append(&pr->line, data, MIN(len, PROXY_HEAD_MAX - off + 1));
+	end = kore_mem_find(pr->line.data + start,
+	    pr->line.offset - start, "\r\n\r\n", 4);
+
+	if (end == NULL) {
+		if (pr->line.offset > PROXY_HEAD_MAX) {
+			kore_log(LOG_NOTICE, "upstream %s: response head "
+			    "too large", pr->pc->server->name);
+			return (-1);
+		}
+		return (len);
+	}
+
+	pr->line.offset = (end - pr->line.data) + 4;
+	start = pr->line.offset - off;
+
+	if (!proxy_response_parse(pr))
+		return (-1);
+
+	kore_buf_reset(&pr->line);
+
+	return (start);
+}
+
+/*
+ * Parse the response head in pr->line, hand its end to end headers to
+ * the client response and figure out how the body is delimited.
+ */
+static int
+proxy_response_parse(struct proxy_request *pr)
+{
+	int			i, cnt, err, length;
+	struct http_request	*req = pr->req;
+	char			*head, *lines[HTTP_REQ_HEADER_MAX];
+	char			*value, *status[3];
+
+	head = kore_buf_stringify(&pr->line, NULL);
+	cnt = kore_split_string(head, "\r\n", lines, HTTP_REQ_HEADER_MAX);
+	if (cnt < 1)
+		return (KORE_RESULT_ERROR);
+
+	if (kore_split_string(lines[0], " ", status, 3) < 2 ||
+	    strncmp(status[0], "HTTP/1.", 7))
+		return (KORE_RESULT_ERROR);
+
+	pr->status = kore_strtonum(status[1], 10, 100, 599, &err);
+	if (err != KORE_RESULT_OK)
+		return (KORE_RESULT_ERROR);
+
+	/* Interim responses are dropped, upgrades are not supported. */
+	if (pr->status < 200) {
+		if (pr->status == 101)
+			return (KORE_RESULT_ERROR);
+		return (KORE_RESULT_OK);
+	}
+
+	if (strcmp(status[0], "HTTP/1.1"))
+		pr->flags |= PROXY_REQ_NO_REUSE;
+
+	length = 0;
+	pr->mode = PROXY_BODY_CLOSE;
+
+	for (i = 1; i < cnt; i++) {
+		if ((value = http_validate_header(lines[i])) == NULL)
+			continue;
+
+		if (!strcasecmp(lines[i], "content-length")) {
+			pr->remaining = kore_strtonum64(value, 0, &err);
+			if (err != KORE_RESULT_OK)
+				return (KORE_RESULT_ERROR);
+			if (pr->mode != PROXY_BODY_CHUNKED)
+				pr->mode = PROXY_BODY_LENGTH;
+			length = 1;
+			continue;
+		}
+
+		if (!strcasecmp(lines[i], "transfer-encoding")) {
+			if (strcasestr(value, "chunked") != NULL) {
+				pr->mode = PROXY_BODY_CHUNKED;
+				pr->chunk = PROXY_CHUNK_SIZE;
+			}
+			continue;
+		}
+
+		if (!strcasecmp(lines[i], "connection")) {
+			if (strcasestr(value, "close") != NULL)
+				pr->flags |= PROXY_REQ_NO_REUSE;
+			continue;
+		}
+
+		if (proxy_hop_header(lines[i]) ||
+		    !strcasecmp(lines[i], "server") ||
+		    !strcasecmp(lines[i], "date"))
+			continue;
+
+		http_response_header(req, lines[i], value);
+	}
+
+	if (req->method == HTTP_METHOD_HEAD || pr->status == 204 ||
+	    pr->status == 304 || (length && pr->mode == PROXY_BODY_LENGTH &&
+	    pr->remaining == 0))
+		pr->mode = PROXY_BODY_NONE;
+
+	if (pr->mode == PROXY_BODY_CLOSE)
+		pr->flags |= PROXY_REQ_NO_REUSE;
+
+	pr->flags |= PROXY_REQ_HEAD_DONE;
+	proxy_response_start(pr);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+proxy_response_start(struct proxy_request *pr)
+{
+	if (pr->mode == PROXY_BODY_NONE) {
+		pr->flags |= PROXY_REQ_DONE;
+		http_response(pr->req, pr->status, NULL, 0);
+		return;
+	}
+
+	pr->flags |= PROXY_REQ_STARTED;
+	http_response_chunked(pr->req, pr->status);
+}
+
+/*
+ * Collect a CRLF terminated line in pr->line, returns how much of data
+ * was used. *out is set once the line is complete.
+ */
+static ssize_t
+proxy_response_line(struct proxy_request *pr, const u_int8_t *data,
+    size_t len, char **out)
+{
+	size_t		n;
+	u_int8_t	*nl;
+
+	*out = NULL;
+
+	if ((nl = memchr(data, '\n', len)) != NULL)
+		n = (nl - data) + 1;
+	else
+		n = len;
+
+	if (pr->line.offset + n > PROXY_LINE_MAX)
+		return (-1);
+
+	kore_buf_append(&pr->line, data, n);
+
+	if (nl != NULL) {
+		*out = kore_buf_stringify(&pr->line, NULL);
+		kore_buf_reset(&pr->line);
+		(*out)[strcspn(*out, "\r\n")] = '\0';
+	}
+
+	return (n);
+}
+
+static ssize_t
+proxy_response_chunked(struct proxy_request *pr, const u_int8_t *data,
+    size_t len)
+{
+	ssize_t		n;
+	char		*line;
+	const char	*hexdigits = "0123456789abcdefABCDEF";
+
+	if (pr->chunk == PROXY_CHUNK_DATA) {
+		n = MIN(len, pr->remaining);
+		kore_buf_append(&pr->pending, data, n);
+		pr->remaining -= n;
+		if (pr->remaining == 0)
+			pr->chunk = PROXY_CHUNK_DATA_END;
+		return (n);
+	}
+
+	if ((n = proxy_response_line(pr, data, len, &line)) == -1)
+		return (-1);
+
+	if (line == NULL)
+		return (n);
+
+	switch (pr->chunk) {
+	case PROXY_CHUNK_SIZE:
+		line[strcspn(line, "; \t")] = '\0';
+		if (line[0] == '\0' || strspn(line, hexdigits) != strlen(line))
+			return (-1);
+		errno = 0;
+		pr->remaining = strtoull(line, NULL, 16);
+		if (errno == ERANGE)
+			return (-1);
+		if (pr->remaining == 0)
+			pr->chunk = PROXY_CHUNK_TRAILER;
+		else
+			pr->chunk = PROXY_CHUNK_DATA;
+		break;
+	case PROXY_CHUNK_DATA_END:
+		if (line[0] != '\0')
+			return (-1);
+		pr->chunk = PROXY_CHUNK_SIZE;
+		break;
+	case PROXY_CHUNK_TRAILER:
+		if (line[0] == '\0')
+			pr->flags |= PROXY_REQ_DONE;
+		break;
+	}
+
+	return (n);
+}
+
+/* Hand what came in to the client unless a piece is still on its way. */
+static void
+proxy_response_flush(struct proxy_request *pr)
+{
+	struct kore_buf		swap;
+	struct http_request	*req = pr->req;
+
+	if (!(pr->flags & PROXY_REQ_STARTED) ||
+	    (pr->flags & PROXY_REQ_SENDING) || pr->pending.offset == 0)
+		return;
+
+	if (req->owner == NULL) {
+		kore_buf_reset(&pr->pending);
+		return;
+	}
+
+	swap = pr->inflight;
+	pr->inflight = pr->pending;
+	pr->pending = swap;
+
+	pr->flags |= PROXY_REQ_SENDING;
+	http_response_chunk(req, pr->inflight.data, pr->inflight.offset,
+	    proxy_response_sent, pr);
+}
+
+static int
+proxy_response_sent(struct netbuf *nb)
+{
+	struct proxy_request	*pr = nb->extra;
+
+	pr->flags &= ~PROXY_REQ_SENDING;
+	kore_buf_reset(&pr->inflight);
+
+	if (pr->req == NULL)
+		proxy_request_release(pr);
+	else
+		http_request_wakeup(pr->req);
+
+	return (KORE_RESULT_OK);
+}
+
+static struct kore_upstream_server *
+proxy_server_pick(struct kore_upstream *up)
+{
+	u_int32_t			i, idx;
+	struct kore_upstream_server	*server, *best;
+
+	best = NULL;
+
+	for (i = 0; i < up->server_count; i++) {
+		idx = (up->next + i) % up->server_count;
+		server = up->servers[idx];
+
+		if (server->flags & PROXY_SERVER_DOWN)
+			continue;
+
+		if (up->balance == KORE_PROXY_BALANCE_ROUNDROBIN) {
+			best = server;
+			break;
+		}
+
+		if (best == NULL || server->active < best->active)
+			best = server;
+	}
+
+	up->next = (up->next + 1) % up->server_count;
+
+	return (best);
+}
+
+static void
+proxy_server_down(struct kore_upstream_server *server)
+{
+	struct proxy_conn	*pc;
+
+	if (server->upstream->health_check == 0 ||
+	    (server->flags & PROXY_SERVER_DOWN))
+		return;
+
+	kore_log(LOG_NOTICE, "upstream %s: %s is down",
+	    server->upstream->name, server->name);
+
+	server->flags |= PROXY_SERVER_DOWN;
+
+	while ((pc = TAILQ_FIRST(&server->pool)) != NULL)
+		kore_connection_disconnect(pc->c);
+}
+
+static struct proxy_conn *
+proxy_conn_get(struct kore_upstream *up)
+{
+	struct proxy_conn		*pc;
+	struct kore_upstream_server	*server;
+
+	if ((server = proxy_server_pick(up)) == NULL)
+		return (NULL);
+
+	if ((pc = TAILQ_FIRST(&server->pool)) != NULL) {
+		TAILQ_REMOVE(&server->pool, pc, list);
+		server->idle--;
+		pc->flags = PROXY_CONN_REUSED;
+		return (pc);
+	}
+
+	return (proxy_conn_new(server));
+}
+
+static struct proxy_conn *
+proxy_conn_new(struct kore_upstream_server *server)
+{
+	int			fd;
+	struct connection	*c;
+	struct proxy_conn	*pc;
+
+	if ((fd = socket(server->addr.ss_family, SOCK_STREAM, 0)) == -1) {
+		kore_log(LOG_ERR, "socket(): %s", errno_s);
+		return (NULL);
+	}
+
+	if (!kore_connection_nonblock(fd, 1)) {
+		close(fd);
+		return (NULL);
+	}
+
+	c = kore_connection_new(NULL);
+	c->fd = fd;
+	c->family = server->addr.ss_family;
+	c->read = net_read;
+	c->write = net_write;
+	c->proto = CONN_PROTO_UNKNOWN;
+	c->state = CONN_STATE_ESTABLISHED;
+	c->handle = proxy_conn_connect;
+	c->disconnect = proxy_conn_disconnect;
+	c->evt.handle = proxy_conn_event;
+	c->idle_timer.length = server->upstream->connect_timeout;
+
+	pc = kore_calloc(1, sizeof(*pc));
+	pc->c = c;
+	pc->server = server;
+	pc->flags = PROXY_CONN_CONNECTING;
+	c->hdlr_extra = pc;
+
+	c->evt.flags = 0;
+
+	/* Removing a connection always drops the count again. */
+	worker_active_connections++;
+
+	TAILQ_INSERT_TAIL(&connections, c, list);
+	kore_platform_schedule_write(fd, c);
+	kore_connection_start_idletimer(c);
+
+	return (pc);
+}
+
+static int
+proxy_conn_connect(struct connection *c)
+{
+	int			error;
+	socklen_t		len;
+	struct proxy_conn	*pc = c->hdlr_extra;
+
+	if (!(c->evt.flags & KORE_EVENT_WRITE))
+		return (KORE_RESULT_OK);
+
+	if (pc->flags & PROXY_CONN_STARTED) {
+		/* The connect() in progress finished, see how it went. */
+		len = sizeof(error);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+	} else if (connect(c->fd, (struct sockaddr *)&pc->server->addr,
+	    pc->server->addrlen) == -1) {
+		error = errno;
+		if (error == EINPROGRESS || error == EINTR) {
+			pc->flags |= PROXY_CONN_STARTED;
+			c->evt.flags &= ~KORE_EVENT_WRITE;
+			return (KORE_RESULT_OK);
+		}
+	} else {
+		error = 0;
+	}
+
+	if (error != 0) {
+		kore_log(LOG_NOTICE, "upstream %s: connect to %s: %s",
+		    pc->server->upstream->name, pc->server->name,
+		    strerror(error));
+		return (KORE_RESULT_ERROR);
+	}
+
+	pc->flags &= ~PROXY_CONN_CONNECTING;
+
+	if (pc->server->flags & PROXY_SERVER_DOWN) {
+		kore_log(LOG_NOTICE, "upstream %s: %s is up",
+		    pc->server->upstream->name, pc->server->name);
+		pc->server->flags &= ~PROXY_SERVER_DOWN;
+	}
+
+	c->handle = proxy_conn_handle;
+	c->idle_timer.length = pc->server->upstream->timeout;
+
+	net_recv_queue(c, NETBUF_SEND_PAYLOAD_MAX,
+	    NETBUF_CALL_CB_ALWAYS, proxy_conn_recv);
+	kore_platform_event_all(c->fd, c);
+
+	if (pc->flags & PROXY_CONN_PROBE) {
+		pc->flags &= ~PROXY_CONN_PROBE;
+		pc->server->flags &= ~PROXY_SERVER_PROBING;
+		proxy_conn_park(pc);
+		return (KORE_RESULT_OK);
+	}
+
+	return (c->handle(c));
+}
+
+static int
+proxy_conn_handle(struct connection *c)
+{
+	int			r;
+	struct proxy_conn	*pc = c->hdlr_extra;
+
+	r = kore_connection_handle(c);
+
+	/* A paused upstream waits on the client, not the other way. */
+	if (pc->pr != NULL && (pc->pr->flags & PROXY_REQ_PAUSED))
+		kore_connection_stop_idletimer(c);
+
+	return (r);
+}
+
+/*
+ * A hangup is reported as an error before what came with it was read,
+ * for a response that ends with the connection that is all of it.
+ */
+static void
+proxy_conn_event(void *arg, int error)
+{
+	struct connection	*c = arg;
+	struct proxy_conn	*pc = c->hdlr_extra;
+
+	if (error && pc->pr != NULL && c->handle == proxy_conn_handle &&
+	    (c->evt.flags & KORE_EVENT_READ)) {
+		kore_connection_event(c, 0);
+		if (c->state == CONN_STATE_DISCONNECTING)
+			return;
+
+		/* The rest is read once the client caught up. */
+		if (pc->pr != NULL && (pc->pr->flags & PROXY_REQ_PAUSED))
+			return;
+	}
+
+	kore_connection_event(c, error);
+}
+
+static void
+proxy_conn_disconnect(struct connection *c)
+{
+	struct proxy_request		*pr;
+	struct proxy_conn		*pc = c->hdlr_extra;
+	struct kore_upstream_server	*server = pc->server;
+
+	if (pc->flags & PROXY_CONN_IDLE) {
+		TAILQ_REMOVE(&server->pool, pc, list);
+		server->idle--;
+	}
+
+	if (pc->flags & PROXY_CONN_PROBE)
+		server->flags &= ~PROXY_SERVER_PROBING;
+
+	if (pc->flags & PROXY_CONN_CONNECTING)
+		proxy_server_down(server);
+
+	pc->flags &= ~PROXY_CONN_IDLE;
+
+	if ((pr = pc->pr) == NULL)
+		return;
+
+	pc->pr = NULL;
+	pr->pc = NULL;
+	server->active--;
+
+	if ((pr->flags & PROXY_REQ_HEAD_DONE) && pr->mode == PROXY_BODY_CLOSE) {
+		pr->flags |= PROXY_REQ_DONE;
+	} else if (!(pr->flags & PROXY_REQ_DONE)) {
+		pr->flags |= PROXY_REQ_FAILED;
+		if (pc->flags & PROXY_CONN_CONNECTING)
+			pr->flags |= PROXY_REQ_NO_CONNECT;
+		/* A server that timed out is not asked again. */
+		if ((pc->flags & PROXY_CONN_REUSED) &&
+		    kore_time_ms() - c->idle_timer.start < c->idle_timer.length)
+			pr->flags |= PROXY_REQ_STALE;
+	}
+
+	if (pr->req != NULL)
+		http_request_wakeup(pr->req);
+}
+
+/*
+ * The response is complete, keep the connection for the next request
+ * if it can be trusted to be at the start of a new response.
+ */
+static void
+proxy_conn_release(struct proxy_conn *pc, int reuse)
+{
+	struct kore_upstream_server	*server = pc->server;
+
+	pc->pr->pc = NULL;
+	pc->pr = NULL;
+	server->active--;
+
+	if (!reuse || server->idle >= server->upstream->keepalive ||
+	    (server->flags & PROXY_SERVER_DOWN)) {
+		kore_connection_disconnect(pc->c);
+		return;
+	}
+
+	proxy_conn_park(pc);
+}
+
+static void
+proxy_conn_park(struct proxy_conn *pc)
+{
+	struct kore_upstream_server	*server = pc->server;
+
+	if (server->idle >= server->upstream->keepalive) {
+		kore_connection_disconnect(pc->c);
+		return;
+	}
+
+	pc->flags = PROXY_CONN_IDLE;
+	TAILQ_INSERT_HEAD(&server->pool, pc, list);
+	server->idle++;
+
+	net_recv_reset(pc->c, NETBUF_SEND_PAYLOAD_MAX, proxy_conn_idle);
+	pc->c->idle_timer.length = server->upstream->timeout;
+	kore_connection_start_idletimer(pc->c);
+}
+
+static int
+proxy_conn_recv(struct netbuf *nb)
+{
+	struct connection	*c = nb->owner;
+	struct proxy_conn	*pc = c->hdlr_extra;
+	struct proxy_request	*pr = pc->pr;
+
+	if (pr == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (!proxy_response_data(pr, nb->buf, nb->s_off)) {
+		kore_log(LOG_NOTICE, "upstream %s: bad response from %s",
+		    pc->server->upstream->name, pc->server->name);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (pr->req != NULL) {
+		proxy_response_flush(pr);
+		http_request_wakeup(pr->req);
+	}
+
+	if (pr->flags & PROXY_REQ_DONE) {
+		proxy_conn_release(pc, !(pr->flags & PROXY_REQ_NO_REUSE) &&
+		    (pr->flags & PROXY_REQ_BODY_DONE));
+		return (c->state == CONN_STATE_DISCONNECTING ?
+		    KORE_RESULT_ERROR : KORE_RESULT_OK);
+	}
+
+	if (pr->pending.offset >= PROXY_BUFFER_MAX) {
+		/* Stop reading until the client caught up. */
+		pr->flags |= PROXY_REQ_PAUSED;
+		net_recvbuf_put(nb->buf);
+		nb->buf = NULL;
+		nb->m_len = 0;
+		kore_connection_stop_idletimer(c);
+		return (KORE_RESULT_OK);
+	}
+
+	net_recv_reset(c, NETBUF_SEND_PAYLOAD_MAX, proxy_conn_recv);
+
+	return (KORE_RESULT_OK);
+}
+
+/* Nothing is expected on an idle connection, not even a close. */
+static int
+proxy_conn_idle(struct netbuf *nb)
+{
+	return (KORE_RESULT_ERROR);
+}
+
+static void
+proxy_conn_resume(struct proxy_request *pr)
+{
+	struct connection	*c;
+
+	pr->flags &= ~PROXY_REQ_PAUSED;
+
+	if (pr->pc == NULL)
+		return;
+
+	c = pr->pc->c;
+
+	net_recv_reset(c, NETBUF_SEND_PAYLOAD_MAX, proxy_conn_recv);
+	kore_connection_start_idletimer(c);
+
+	if ((c->evt.flags & KORE_EVENT_READ) && !net_recv_flush(c))
+		kore_connection_disconnect(c);
+}
+
+/* Try to reach servers that are down, a success brings them back. */
+static void
+proxy_health_check(void *arg, u_int64_t now)
+{
+	u_int32_t			i;
+	struct proxy_conn		*pc;
+	struct kore_upstream_server	*server;
+	struct kore_upstream		*up = arg;
+
+	for (i = 0; i < up->server_count; i++) {
+		server = up->servers[i];
+
+		if (!(server->flags & PROXY_SERVER_DOWN) ||
+		    (server->flags & PROXY_SERVER_PROBING))
+			continue;
+
+		if ((pc = proxy_conn_new(server)) == NULL)
+			continue;
+
+		pc->flags |= PROXY_CONN_PROBE;
+		server->flags |= PROXY_SERVER_PROBING;
+
+		pc->c->evt.flags |= KORE_EVENT_WRITE;
+		if (!pc->c->handle(pc->c))
+			kore_connection_disconnect(pc->c);
+	}
+}
+
+static int
+proxy_hop_header(const char *name)
+{
+	int		i;
+
+	for (i = 0; hop_headers[i] != NULL; i++) {
+		if (!strcasecmp(hop_headers[i], name))
+			return (1);
+	}
+
+	return (0);
+}
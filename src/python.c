@@ -17,6 +17,7 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -43,6 +44,10 @@
 #include "acme.h"
 #endif
 
+#if defined(KORE_USE_TASKS)
+#include "tasks.h"
+#endif
+
 #include "python_api.h"
 #include "python_methods.h"
 
@@ -51,6 +56,10 @@
 #endif
 
 #include <frameobject.h>
+#include <marshal.h>
+
+/* Deepest nesting kore.sendobj() will pick marshal for by itself. */
+#define PYTHON_MARSHAL_DEPTH	32
 
 struct reqcall {
 	PyObject		*f;
@@ -65,6 +74,8 @@ static PyObject		*pyconnection_alloc(struct connection *);
 static PyObject		*python_callable(PyObject *, const char *);
 static void		python_split_arguments(char *, char **, size_t);
 static void		python_kore_recvobj(struct kore_msg *, const void *);
+static int		python_marshal_safe(PyObject *, int);
+static void		python_sendobj_flush(void);
 
 static PyObject		*python_cmsg_to_list(struct msghdr *);
 static const char	*python_string_from_dict(PyObject *, const char *);
@@ -72,6 +83,7 @@ static int		python_bool_from_dict(PyObject *, const char *, int *);
 static int		python_long_from_dict(PyObject *, const char *, long *);
 
 static int		pyhttp_response_sent(struct netbuf *);
+static int		pyhttp_response_buffer_sent(struct netbuf *);
 static PyObject		*pyhttp_file_alloc(struct http_file *);
 static PyObject		*pyhttp_request_alloc(const struct http_request *);
 
@@ -82,6 +94,21 @@ static int		python_coro_run(struct python_coro *);
 static void		python_coro_wakeup(struct python_coro *);
 static void		python_coro_suspend(struct python_coro *);
 static void		python_coro_trace(const char *, struct python_coro *);
+static void		*python_freelist_get(int);
+static void		python_freelist_put(int, void *);
+static void		python_freelist_drain(void);
+static int		python_coro_step(struct python_coro *);
+
+#if defined(KORE_USE_TASKS)
+static struct pyfs_op	*pyfs_op_create(int);
+static PyObject		*pyfs_op_result(struct pyfs_op *);
+static int		pyfs_sendfile_cached(struct pyfs_op *);
+static int		pyfs_sendfile_respond(struct pyfs_op *);
+static int		pyfs_job_run(struct kore_task *);
+static void		pyfs_job_done(struct kore_task *);
+static void		pyfs_job_free(struct pyfs_job *);
+#endif
+static int		python_corostats_add(PyObject *, struct coro_list *);
 
 static void		pysocket_evt_handle(void *, int);
 static void		pysocket_op_timeout(void *, u_int64_t);
@@ -111,6 +138,8 @@ static void		pyhttp_iterobj_disconnect(struct connection *);
 static int		pydomain_params(PyObject *,
 			    struct kore_module_handle *, const char *, int);
 static int		pydomain_auth(PyObject *, struct kore_module_handle *);
+static int		pydomain_priority(PyObject *,
+			    struct kore_module_handle *);
 
 #if defined(KORE_USE_PGSQL)
 static int		pykore_pgsql_result(struct pykore_pgsql *);
@@ -240,6 +269,13 @@ static struct sock_filter filter_python[] = {
 	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET),
 	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_INET6),
 	KORE_SYSCALL_ALLOW_ARG(socket, 0, AF_UNIX),
+
+#if defined(KORE_USE_TASKS)
+	/* Required for kore.fs */
+	KORE_SYSCALL_ALLOW(fsync),
+	KORE_SYSCALL_ALLOW(pread64),
+	KORE_SYSCALL_ALLOW(pwrite64),
+#endif
 };
 
 #define PYSECCOMP_ACTION_ALLOW		1
@@ -271,27 +307,102 @@ static struct kore_pool			gather_result_pool;
 static u_int64_t			coro_id;
 static int				coro_count;
 static int				coro_tracing;
-static struct coro_list			coro_runnable;
+static struct coro_list			coro_runnable[HTTP_PRIO_MAX];
 static struct coro_list			coro_suspended;
 
+/* Share of python_coro_ms and python_coro_limit each class gets. */
+static const u_int64_t	coro_prio_weight[HTTP_PRIO_MAX] = { 4, 2, 1 };
+
+u_int32_t	kore_python_coro_ms = 10;
+u_int32_t	kore_python_coro_limit = 1000;
+int		kore_python_gc_freeze = 1;
+
 extern const char *__progname;
 
 static PyObject		*pickle = NULL;
 static PyObject		*kore_app = NULL;
 static PyObject		*pickle_dumps = NULL;
 static PyObject		*pickle_loads = NULL;
+static int			sendobj_queued = 0;
 static PyObject		*python_tracer = NULL;
 
 /* XXX */
 static struct python_coro		*coro_running = NULL;
 
+/*
+ * Per type freelists for the objects that come and go for every
+ * request or await. A freed object keeps its memory and links to
+ * the next one right behind its header, PyObject_Init() brings it
+ * back to life. Every creator sets all fields of its objects.
+ */
+#define PYTHON_FREELIST_MAX		256
+
+#define PYTHON_FREELIST_REQUEST		0
+#define PYTHON_FREELIST_SOCKET_OP	1
+#define PYTHON_FREELIST_QUEUE_OP	2
+#define PYTHON_FREELIST_LOCK_OP		3
+#define PYTHON_FREELIST_PROC_OP		4
+#define PYTHON_FREELIST_SUSPEND_OP	5
+#define PYTHON_FREELIST_MAXTYPES	6
+
+struct python_freelist {
+	const char		*name;
+	PyTypeObject		*type;
+	PyObject		*head;
+	u_int32_t		count;
+	u_int64_t		hits;
+	u_int64_t		misses;
+};
+
+static struct python_freelist	python_freelists[PYTHON_FREELIST_MAXTYPES] = {
+	{ "pyhttp_request", &pyhttp_request_type, NULL, 0, 0, 0 },
+	{ "pysocket_op", &pysocket_op_type, NULL, 0, 0, 0 },
+	{ "pyqueue_op", &pyqueue_op_type, NULL, 0, 0, 0 },
+	{ "pylock_op", &pylock_op_type, NULL, 0, 0, 0 },
+	{ "pyproc_op", &pyproc_op_type, NULL, 0, 0, 0 },
+	{ "pysuspend_op", &pysuspend_op_type, NULL, 0, 0, 0 },
+};
+
+#define PYTHON_FREELIST_NEXT(o)		(*(PyObject **)((o) + 1))
+
 #if !defined(KORE_SINGLE_BINARY)
 const char	*kore_pymodule = NULL;
 #endif
 
+/*
+ * Called in the parent right before the workers are forked. Objects
+ * that exist now are moved out of reach of the collector so a worker
+ * running gc does not touch, and thus copy, the pages they live on.
+ */
+void
+kore_python_fork_prepare(void)
+{
+#if PY_VERSION_HEX >= 0x03070000
+	PyObject	*gc, *ret;
+
+	if (!kore_python_gc_freeze)
+		return;
+
+	if ((gc = PyImport_ImportModule("gc")) == NULL) {
+		kore_python_log_error("fork_prepare");
+		return;
+	}
+
+	ret = PyObject_CallMethod(gc, "collect", NULL);
+	Py_XDECREF(ret);
+
+	if ((ret = PyObject_CallMethod(gc, "freeze", NULL)) == NULL)
+		kore_python_log_error("gc.freeze");
+
+	Py_XDECREF(ret);
+	Py_DECREF(gc);
+#endif
+}
+
 void
 kore_python_init(void)
 {
+	int				prio;
 	struct kore_runtime_call	*rcall;
 
 	coro_id = 0;
@@ -301,9 +412,11 @@ kore_python_init(void)
 	TAILQ_INIT(&prereq);
 
 	TAILQ_INIT(&procs);
-	TAILQ_INIT(&coro_runnable);
 	TAILQ_INIT(&coro_suspended);
 
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++)
+		TAILQ_INIT(&coro_runnable[prio]);
+
 	kore_pool_init(&coro_pool, "coropool", sizeof(struct python_coro), 100);
 
 	kore_pool_init(&iterobj_pool, "iterobj_pool",
@@ -326,6 +439,8 @@ kore_python_init(void)
 #endif
 
 	kore_msg_register(KORE_PYTHON_SEND_OBJ, python_kore_recvobj);
+	kore_msg_register(KORE_PYTHON_SEND_RAW, python_kore_recvobj);
+	kore_msg_register(KORE_PYTHON_SEND_MARSHAL, python_kore_recvobj);
 
 	if (PyImport_AppendInittab("kore", &python_module_init) == -1)
 		fatal("kore_python_init: failed to add new module");
@@ -358,36 +473,159 @@ kore_python_cleanup(void)
 {
 	if (Py_IsInitialized()) {
 		PyErr_Clear();
+		python_freelist_drain();
 		Py_Finalize();
 	}
 }
 
+void
+kore_python_freelist_log(void)
+{
+	int				i;
+	const struct python_freelist	*fl;
+
+	for (i = 0; i < PYTHON_FREELIST_MAXTYPES; i++) {
+		fl = &python_freelists[i];
+		if (fl->hits == 0 && fl->misses == 0)
+			continue;
+
+		kore_log(LOG_INFO, "python %s: %u free, %" PRIu64 " reused, %"
+		    PRIu64 " allocated", fl->name, fl->count, fl->hits,
+		    fl->misses);
+	}
+}
+
+static void *
+python_freelist_get(int idx)
+{
+	PyObject		*obj;
+	struct python_freelist	*fl;
+
+	fl = &python_freelists[idx];
+
+	if ((obj = fl->head) == NULL) {
+		fl->misses++;
+		return (_PyObject_New(fl->type));
+	}
+
+	fl->head = PYTHON_FREELIST_NEXT(obj);
+	fl->count--;
+	fl->hits++;
+
+	return (PyObject_Init(obj, fl->type));
+}
+
+static void
+python_freelist_put(int idx, void *ptr)
+{
+	PyObject		*obj;
+	struct python_freelist	*fl;
+
+	obj = ptr;
+	fl = &python_freelists[idx];
+
+	if (fl->count >= PYTHON_FREELIST_MAX) {
+		PyObject_Del(obj);
+		return;
+	}
+
+	PYTHON_FREELIST_NEXT(obj) = fl->head;
+	fl->head = obj;
+	fl->count++;
+}
+
+static void
+python_freelist_drain(void)
+{
+	int			i;
+	PyObject		*obj;
+	struct python_freelist	*fl;
+
+	for (i = 0; i < PYTHON_FREELIST_MAXTYPES; i++) {
+		fl = &python_freelists[i];
+		while ((obj = fl->head) != NULL) {
+			fl->head = PYTHON_FREELIST_NEXT(obj);
+			PyObject_Del(obj);
+		}
+		fl->count = 0;
+	}
+}
+
 void
 kore_python_path(const char *path)
 {
 	python_append_path(path);
 }
 
+/*
+ * Run the runnable coroutines, class by class. Every class that has
+ * coroutines gets its weighted share of python_coro_ms and of
+ * python_coro_limit runs, the rest waits for the next worker loop.
+ */
 void
 kore_python_coro_run(void)
 {
+	int			r, prio;
 	struct pygather_op	*op;
 	struct python_coro	*coro;
+	char			name[32];
+	u_int64_t		total, budget, runs, limit, weights;
 
-	while ((coro = TAILQ_FIRST(&coro_runnable)) != NULL) {
-		if (coro->state != CORO_STATE_RUNNABLE)
-			fatal("non-runnable coro on coro_runnable");
+	weights = 0;
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!TAILQ_EMPTY(&coro_runnable[prio]))
+			weights += coro_prio_weight[prio];
+	}
 
-		if (python_coro_run(coro) == KORE_RESULT_OK) {
-			if (coro->gatherop != NULL) {
-				op = coro->gatherop;
-				if (op->coro->request != NULL)
-					http_request_wakeup(op->coro->request);
-				else
-					python_coro_wakeup(op->coro);
-				pygather_reap_coro(op, coro);
-			} else {
-				kore_python_coro_delete(coro);
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (TAILQ_EMPTY(&coro_runnable[prio]))
+			continue;
+
+		budget = (kore_python_coro_ms * 1000ULL *
+		    coro_prio_weight[prio]) / weights;
+		budget = MAX(budget, 1);
+		limit = (kore_python_coro_limit *
+		    coro_prio_weight[prio]) / weights;
+		limit = MAX(limit, 1);
+
+		runs = 0;
+		total = 0;
+
+		while ((coro = TAILQ_FIRST(&coro_runnable[prio])) != NULL) {
+			if (total >= budget)
+				break;
+			if (kore_python_coro_limit != 0 && runs >= limit)
+				break;
+
+			if (coro->state != CORO_STATE_RUNNABLE)
+				fatal("non-runnable coro on coro_runnable");
+
+			r = python_coro_run(coro);
+
+			runs++;
+			total += coro->slice_us;
+
+			if (coro->name == NULL) {
+				(void)snprintf(name, sizeof(name),
+				    "%u", coro->id);
+			}
+			kore_worker_loop_note("coro",
+			    coro->name ? coro->name : name,
+			    coro->slice_us / 1000);
+
+			if (r == KORE_RESULT_OK) {
+				if (coro->gatherop != NULL) {
+					op = coro->gatherop;
+					if (op->coro->request != NULL) {
+						http_request_wakeup(
+						    op->coro->request);
+					} else {
+						python_coro_wakeup(op->coro);
+					}
+					pygather_reap_coro(op, coro);
+				} else {
+					kore_python_coro_delete(coro);
+				}
 			}
 		}
 	}
@@ -408,6 +646,9 @@ kore_python_coro_run(void)
 	 */
 	kore_curl_do_timeout();
 #endif
+
+	/* Objects sent during this iteration go out in a single write. */
+	python_sendobj_flush();
 }
 
 void
@@ -420,6 +661,12 @@ kore_python_coro_delete(void *obj)
 
 	python_coro_trace(coro->killed ? "killed" : "deleted", coro);
 
+	if (coro_tracing) {
+		kore_log(LOG_NOTICE, "coro %u ran %u times for %" PRIu64
+		    "us, longest slice %" PRIu64 "us", coro->id, coro->runs,
+		    coro->run_us, coro->slice_max);
+	}
+
 	coro_running = coro;
 
 	if (coro->lockop != NULL) {
@@ -433,7 +680,7 @@ kore_python_coro_delete(void *obj)
 	coro_running = NULL;
 
 	if (coro->state == CORO_STATE_RUNNABLE)
-		TAILQ_REMOVE(&coro_runnable, coro, list);
+		TAILQ_REMOVE(&coro_runnable[coro->prio], coro, list);
 	else
 		TAILQ_REMOVE(&coro_suspended, coro, list);
 
@@ -446,7 +693,14 @@ kore_python_coro_delete(void *obj)
 int
 kore_python_coro_pending(void)
 {
-	return (!TAILQ_EMPTY(&coro_runnable));
+	int		prio;
+
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!TAILQ_EMPTY(&coro_runnable[prio]))
+			return (1);
+	}
+
+	return (0);
 }
 
 void
@@ -1007,12 +1261,24 @@ python_coro_create(PyObject *obj, struct http_request *req)
 	coro->exception_msg = NULL;
 
 	coro->obj = obj;
+	coro->runs = 0;
+	coro->run_us = 0;
 	coro->killed = 0;
+	coro->slice_us = 0;
+	coro->slice_max = 0;
 	coro->request = req;
 	coro->id = coro_id++;
 	coro->state = CORO_STATE_RUNNABLE;
 
-	TAILQ_INSERT_TAIL(&coro_runnable, coro, list);
+	/* Requests bring their route's class, others inherit it. */
+	if (req != NULL)
+		coro->prio = req->prio;
+	else if (coro_running != NULL)
+		coro->prio = coro_running->prio;
+	else
+		coro->prio = HTTP_PRIO_NORMAL;
+
+	TAILQ_INSERT_TAIL(&coro_runnable[coro->prio], coro, list);
 
 	if (coro->request != NULL)
 		http_request_sleep(coro->request);
@@ -1024,6 +1290,23 @@ python_coro_create(PyObject *obj, struct http_request *req)
 
 static int
 python_coro_run(struct python_coro *coro)
+{
+	int		ret;
+	u_int64_t	start;
+
+	start = kore_time_us();
+	ret = python_coro_step(coro);
+
+	coro->runs++;
+	coro->slice_us = kore_time_us() - start;
+	coro->run_us += coro->slice_us;
+	coro->slice_max = MAX(coro->slice_max, coro->slice_us);
+
+	return (ret);
+}
+
+static int
+python_coro_step(struct python_coro *coro)
 {
 	PyObject	*item;
 	PyObject	*type, *traceback;
@@ -1083,7 +1366,7 @@ python_coro_wakeup(struct python_coro *coro)
 
 	coro->state = CORO_STATE_RUNNABLE;
 	TAILQ_REMOVE(&coro_suspended, coro, list);
-	TAILQ_INSERT_TAIL(&coro_runnable, coro, list);
+	TAILQ_INSERT_TAIL(&coro_runnable[coro->prio], coro, list);
 
 	python_coro_trace("wokeup", coro);
 }
@@ -1095,7 +1378,7 @@ python_coro_suspend(struct python_coro *coro)
 		return;
 
 	coro->state = CORO_STATE_SUSPENDED;
-	TAILQ_REMOVE(&coro_runnable, coro, list);
+	TAILQ_REMOVE(&coro_runnable[coro->prio], coro, list);
 	TAILQ_INSERT_TAIL(&coro_suspended, coro, list);
 
 	python_coro_trace("suspended", coro);
@@ -1153,7 +1436,47 @@ pyhttp_dealloc(struct pyhttp_request *pyreq)
 {
 	Py_XDECREF(pyreq->dict);
 	Py_XDECREF(pyreq->data);
-	PyObject_Del((PyObject *)pyreq);
+	Py_XDECREF(pyreq->body);
+	python_freelist_put(PYTHON_FREELIST_REQUEST, pyreq);
+}
+
+static void
+pyhttp_body_dealloc(struct pyhttp_body *body)
+{
+	if (body->map != NULL)
+		(void)munmap(body->map, body->length);
+
+	if (body->buf != NULL)
+		kore_buf_free(body->buf);
+
+	PyObject_Del((PyObject *)body);
+}
+
+static int
+pyhttp_body_getbuffer(struct pyhttp_body *body, Py_buffer *view, int flags)
+{
+	return (PyBuffer_FillInfo(view, (PyObject *)body,
+	    body->data, (Py_ssize_t)body->length, 1, flags));
+}
+
+/*
+ * Called when the request goes away while a body view still exists,
+ * the view takes over the in-memory body so it does not get freed.
+ */
+void
+kore_python_body_detach(struct http_request *req)
+{
+	struct pyhttp_body	*body;
+
+	body = (struct pyhttp_body *)PyMemoryView_GET_BASE(req->py_body);
+
+	if (body->map == NULL && body->data != NULL) {
+		body->buf = req->http_body;
+		req->http_body = NULL;
+	}
+
+	Py_DECREF((PyObject *)req->py_body);
+	req->py_body = NULL;
 }
 
 static void
@@ -1436,6 +1759,9 @@ python_runtime_execute(void *addr)
 	pyret = PyObject_Call(callable, args, NULL);
 	Py_DECREF(args);
 
+	/* The worker teardown hook runs after the last event loop pass. */
+	python_sendobj_flush();
+
 	if (pyret == NULL) {
 		kore_python_log_error("python_runtime_execute");
 		fatal("failed to execute python call");
@@ -1479,6 +1805,8 @@ python_runtime_configure(void *addr, int argc, char **argv)
 	pyret = PyObject_Call(callable, args, NULL);
 	Py_DECREF(args);
 
+	python_sendobj_flush();
+
 	if (pyret == NULL) {
 		kore_python_log_error("python_runtime_configure");
 		fatal("failed to configure your application");
@@ -1508,6 +1836,8 @@ python_runtime_onload(void *addr, int action)
 	pyret = PyObject_Call(callable, args, NULL);
 	Py_DECREF(args);
 
+	python_sendobj_flush();
+
 	if (pyret == NULL) {
 		kore_python_log_error("python_runtime_onload");
 		return (KORE_RESULT_ERROR);
@@ -1556,10 +1886,21 @@ python_module_init(void)
 	int			i;
 	struct pyconfig		*config;
 	PyObject		*pykore;
+#if defined(KORE_USE_TASKS)
+	PyObject		*pyfs;
+#endif
 
 	if ((pykore = PyModule_Create(&pykore_module)) == NULL)
 		fatal("python_module_init: failed to setup pykore module");
 
+#if defined(KORE_USE_TASKS)
+	if ((pyfs = PyModule_Create(&pyfs_module)) == NULL)
+		fatal("python_module_init: failed to setup kore.fs module");
+
+	if (PyModule_AddObject(pykore, "fs", pyfs) == -1)
+		fatal("python_module_init: failed to add kore.fs module");
+#endif
+
 	python_push_type("pyproc", pykore, &pyproc_type);
 	python_push_type("pylock", pykore, &pylock_type);
 	python_push_type("pytimer", pykore, &pytimer_type);
@@ -1584,6 +1925,7 @@ python_module_init(void)
 
 	python_push_type("pyhttp_file", pykore, &pyhttp_file_type);
 	python_push_type("pyhttp_request", pykore, &pyhttp_request_type);
+	python_push_type("pyhttp_body", pykore, &pyhttp_body_type);
 
 	for (i = 0; python_integers[i].symbol != NULL; i++) {
 		python_push_integer(pykore, python_integers[i].symbol,
@@ -1840,6 +2182,7 @@ python_kore_task_create(PyObject *self, PyObject *args)
 static PyObject *
 python_kore_task_kill(PyObject *self, PyObject *args)
 {
+	int			prio;
 	u_int32_t		id;
 	struct python_coro	*coro, *active;
 
@@ -1855,12 +2198,14 @@ python_kore_task_kill(PyObject *self, PyObject *args)
 	/* Remember active coro, as delete sets coro_running to NULL. */
 	active = coro_running;
 
-	TAILQ_FOREACH(coro, &coro_runnable, list) {
-		if (coro->id == id) {
-			coro->killed++;
-			kore_python_coro_delete(coro);
-			coro_running = active;
-			Py_RETURN_TRUE;
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		TAILQ_FOREACH(coro, &coro_runnable[prio], list) {
+			if (coro->id == id) {
+				coro->killed++;
+				kore_python_coro_delete(coro);
+				coro_running = active;
+				Py_RETURN_TRUE;
+			}
 		}
 	}
 
@@ -2229,157 +2574,497 @@ python_kore_setname(PyObject *self, PyObject *args)
 }
 
 static PyObject *
-python_kore_sendobj(PyObject *self, PyObject *args, PyObject *kwargs)
+python_kore_kv_get(PyObject *self, PyObject *args)
 {
-	long		val;
-	u_int16_t	dst;
-	char		*ptr;
-	Py_ssize_t	length;
-	PyObject	*object, *bytes;
+	const char	*key;
+	size_t		len;
+	PyObject	*bytes;
 
-	if (!PyArg_ParseTuple(args, "O", &object))
-		return (NULL);
-
-	bytes = PyObject_CallFunctionObjArgs(pickle_dumps, object, NULL);
-	if (bytes == NULL)
+	if (!PyArg_ParseTuple(args, "s", &key))
 		return (NULL);
 
-	if (PyBytes_AsStringAndSize(bytes, &ptr, &length) == -1) {
-		Py_DECREF(bytes);
-		return (NULL);
-	}
+	/* The value may change size in between, go again if it did. */
+	for (;;) {
+		len = 0;
+		if (!kore_kv_get(key, NULL, &len))
+			Py_RETURN_NONE;
 
-	dst = KORE_MSG_WORKER_ALL;
+		if ((bytes = PyBytes_FromStringAndSize(NULL, len)) == NULL)
+			return (NULL);
 
-	if (kwargs != NULL) {
-		if (python_long_from_dict(kwargs, "worker", &val)) {
-			if (val <= 0 || val > worker_count ||
-			    val >= KORE_WORKER_MAX) {
-				PyErr_Format(PyExc_RuntimeError,
-				    "worker %ld invalid", val);
-				Py_DECREF(bytes);
-				return (NULL);
-			}
+		if (kore_kv_get(key, PyBytes_AS_STRING(bytes), &len) &&
+		    len == (size_t)PyBytes_GET_SIZE(bytes))
+			break;
 
-			dst = val;
-		}
+		Py_DECREF(bytes);
 	}
 
-	kore_msg_send(dst, KORE_PYTHON_SEND_OBJ, ptr, length);
-	Py_DECREF(bytes);
-
-	Py_RETURN_NONE;
+	return (bytes);
 }
 
-static void
-python_kore_recvobj(struct kore_msg *msg, const void *data)
+static PyObject *
+python_kore_kv_put(PyObject *self, PyObject *args)
 {
-	struct kore_runtime	*rt;
-	PyObject		*onmsg, *ret, *bytes, *obj;
-
-	if ((onmsg = kore_module_getsym("koreapp.onmsg", &rt)) == NULL)
-		return;
-
-	if (rt->type != KORE_RUNTIME_PYTHON)
-		return;
-
-	if ((bytes = PyBytes_FromStringAndSize(data, msg->length)) == NULL) {
-		Py_DECREF(onmsg);
-		kore_python_log_error("kore.recvobj");
-		return;
-	}
+	const char		*key;
+	char			*data;
+	Py_ssize_t		len;
+	PyObject		*obj;
+	unsigned long long	ttl;
 
-	obj = PyObject_CallFunctionObjArgs(pickle_loads, bytes, NULL);
-	Py_DECREF(bytes);
+	ttl = 0;
+	if (!PyArg_ParseTuple(args, "sS|K", &key, &obj, &ttl))
+		return (NULL);
 
-	if (obj == NULL) {
-		Py_DECREF(onmsg);
-		kore_python_log_error("kore.recvobj");
-		return;
-	}
+	if (PyBytes_AsStringAndSize(obj, &data, &len) == -1)
+		return (NULL);
 
-	ret = PyObject_CallFunctionObjArgs(onmsg, obj, NULL);
+	if (!kore_kv_put(key, data, len, ttl))
+		Py_RETURN_FALSE;
 
-	Py_DECREF(obj);
-	Py_DECREF(onmsg);
-	Py_XDECREF(ret);
+	Py_RETURN_TRUE;
 }
 
 static PyObject *
-python_kore_suspend(PyObject *self, PyObject *args)
+python_kore_kv_cas(PyObject *self, PyObject *args)
 {
-	struct pysuspend_op	*op;
-	int			delay;
+	const char		*key;
+	char			*old, *data;
+	Py_ssize_t		oldlen, len;
+	PyObject		*pyold, *obj;
+	unsigned long long	ttl;
 
-	if (!PyArg_ParseTuple(args, "i", &delay))
+	ttl = 0;
+	if (!PyArg_ParseTuple(args, "sOS|K", &key, &pyold, &obj, &ttl))
 		return (NULL);
 
-	op = PyObject_New(struct pysuspend_op, &pysuspend_op_type);
-	if (op == NULL)
+	if (pyold == Py_None) {
+		old = NULL;
+		oldlen = 0;
+	} else if (PyBytes_AsStringAndSize(pyold, &old, &oldlen) == -1) {
 		return (NULL);
+	}
 
-	op->timer = NULL;
-	op->delay = delay;
-	op->coro = coro_running;
-	op->state = PYSUSPEND_OP_INIT;
-
-	return ((PyObject *)op);
-}
+	if (PyBytes_AsStringAndSize(obj, &data, &len) == -1)
+		return (NULL);
 
-static PyObject *
-python_kore_shutdown(PyObject *self, PyObject *args)
-{
-	kore_shutdown();
+	if (!kore_kv_cas(key, old, oldlen, data, len, ttl))
+		Py_RETURN_FALSE;
 
 	Py_RETURN_TRUE;
 }
 
 static PyObject *
-python_kore_coroname(PyObject *self, PyObject *args)
+python_kore_kv_del(PyObject *self, PyObject *args)
 {
-	const char		*name;
-
-	if (coro_running == NULL) {
-		PyErr_SetString(PyExc_RuntimeError,
-		    "kore.coroname() only available in coroutines");
-		return (NULL);
-	}
+	const char	*key;
 
-	if (!PyArg_ParseTuple(args, "s", &name))
+	if (!PyArg_ParseTuple(args, "s", &key))
 		return (NULL);
 
-	kore_free(coro_running->name);
-	coro_running->name = kore_strdup(name);
+	if (!kore_kv_del(key))
+		Py_RETURN_FALSE;
 
-	Py_RETURN_NONE;
+	Py_RETURN_TRUE;
 }
 
 static PyObject *
-python_kore_corotrace(PyObject *self, PyObject *args)
+python_kore_auth_invalidate(PyObject *self, PyObject *args)
 {
-	if (!PyArg_ParseTuple(args, "b", &coro_tracing))
+	const char	*name, *value;
+
+	if (!PyArg_ParseTuple(args, "ss", &name, &value))
 		return (NULL);
 
+	kore_auth_cache_invalidate(name, value);
+
 	Py_RETURN_NONE;
 }
 
 static PyObject *
-python_kore_timer(PyObject *self, PyObject *args, PyObject *kwargs)
+python_kore_kv_incr(PyObject *self, PyObject *args)
 {
-	u_int64_t		ms;
-	PyObject		*obj;
-	int			flags;
-	struct pytimer		*timer;
+	const char		*key;
+	long long		delta;
+	int64_t			result;
+	unsigned long long	ttl;
 
-	if (!PyArg_ParseTuple(args, "OKi", &obj, &ms, &flags))
+	ttl = 0;
+	delta = 1;
+
+	if (!PyArg_ParseTuple(args, "s|LK", &key, &delta, &ttl))
 		return (NULL);
 
-	if (flags & ~(KORE_TIMER_FLAGS)) {
-		PyErr_SetString(PyExc_RuntimeError, "invalid flags");
+	if (!kore_kv_incr(key, delta, &result, ttl)) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "failed to increment '%s'", key);
 		return (NULL);
 	}
 
-	if ((timer = PyObject_New(struct pytimer, &pytimer_type)) == NULL)
+	return (PyLong_FromLongLong(result));
+}
+
+/*
+ * Send an object to other workers. The codec decides how it travels:
+ *	"auto"		bytes as is, plain data through marshal, else pickle.
+ *	"raw"		any bytes-like object as is, arrives as bytes.
+ *	"marshal"	marshal only, fails for what it cannot encode.
+ *	"pickle"	pickle only.
+ * The message id tells the receiving side which one was used. Messages
+ * are queued and flushed together once the event loop iteration is done.
+ */
+static PyObject *
+python_kore_sendobj(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	long		val;
+	u_int16_t	dst;
+	u_int8_t	id;
+	Py_buffer	view;
+	const char	*codec;
+	PyObject	*object, *bytes;
+
+	if (!PyArg_ParseTuple(args, "O", &object))
+		return (NULL);
+
+	codec = "auto";
+	dst = KORE_MSG_WORKER_ALL;
+
+	if (kwargs != NULL) {
+		if (python_long_from_dict(kwargs, "worker", &val)) {
+			if (val <= 0 || val > worker_count ||
+			    val >= KORE_WORKER_MAX) {
+				PyErr_Format(PyExc_RuntimeError,
+				    "worker %ld invalid", val);
+				return (NULL);
+			}
+
+			dst = val;
+		}
+
+		if (PyDict_GetItemString(kwargs, "codec") != NULL) {
+			codec = python_string_from_dict(kwargs, "codec");
+			if (codec == NULL) {
+				PyErr_SetString(PyExc_TypeError,
+				    "codec must be a string");
+				return (NULL);
+			}
+		}
+	}
+
+	if (!strcmp(codec, "raw") ||
+	    (!strcmp(codec, "auto") && PyBytes_CheckExact(object))) {
+		if (PyObject_GetBuffer(object, &view, PyBUF_SIMPLE) == -1)
+			return (NULL);
+
+		kore_msg_queue(dst, KORE_PYTHON_SEND_RAW, view.buf,
+		    (size_t)view.len);
+		PyBuffer_Release(&view);
+		sendobj_queued = 1;
+
+		Py_RETURN_NONE;
+	}
+
+	if (!strcmp(codec, "marshal") ||
+	    (!strcmp(codec, "auto") && python_marshal_safe(object, 0))) {
+		id = KORE_PYTHON_SEND_MARSHAL;
+		bytes = PyMarshal_WriteObjectToString(object,
+		    Py_MARSHAL_VERSION);
+	} else if (!strcmp(codec, "pickle") || !strcmp(codec, "auto")) {
+		id = KORE_PYTHON_SEND_OBJ;
+		bytes = PyObject_CallFunctionObjArgs(pickle_dumps,
+		    object, NULL);
+	} else {
+		PyErr_Format(PyExc_RuntimeError, "unknown codec '%s'", codec);
+		return (NULL);
+	}
+
+	if (bytes == NULL)
+		return (NULL);
+
+	kore_msg_queue(dst, id, PyBytes_AS_STRING(bytes),
+	    (size_t)PyBytes_GET_SIZE(bytes));
+	Py_DECREF(bytes);
+	sendobj_queued = 1;
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Write out what kore.sendobj() queued. Called after every event loop pass
+ * and after the hooks that run outside of it (configure, onload and the
+ * worker teardown) so nothing is left behind in the queue.
+ */
+static void
+python_sendobj_flush(void)
+{
+	if (!sendobj_queued)
+		return;
+
+	sendobj_queued = 0;
+	kore_msg_flush();
+}
+
+/*
+ * Only exact builtin types come back out of marshal as they went in,
+ * anything else (subclasses, bytearray, ...) is left to pickle.
+ */
+static int
+python_marshal_safe(PyObject *obj, int depth)
+{
+	Py_ssize_t	idx;
+	PyObject	*key, *value, *iter, *item;
+
+	if (depth > PYTHON_MARSHAL_DEPTH)
+		return (0);
+
+	if (obj == Py_None || obj == Py_True || obj == Py_False ||
+	    PyLong_CheckExact(obj) || PyFloat_CheckExact(obj) ||
+	    PyUnicode_CheckExact(obj) || PyBytes_CheckExact(obj))
+		return (1);
+
+	if (PyTuple_CheckExact(obj) || PyList_CheckExact(obj)) {
+		for (idx = 0; idx < PySequence_Fast_GET_SIZE(obj); idx++) {
+			item = PySequence_Fast_GET_ITEM(obj, idx);
+			if (!python_marshal_safe(item, depth + 1))
+				return (0);
+		}
+		return (1);
+	}
+
+	if (PyDict_CheckExact(obj)) {
+		idx = 0;
+		while (PyDict_Next(obj, &idx, &key, &value)) {
+			if (!python_marshal_safe(key, depth + 1) ||
+			    !python_marshal_safe(value, depth + 1))
+				return (0);
+		}
+		return (1);
+	}
+
+	if (Py_TYPE(obj) == &PySet_Type || PyFrozenSet_CheckExact(obj)) {
+		if ((iter = PyObject_GetIter(obj)) == NULL) {
+			PyErr_Clear();
+			return (0);
+		}
+
+		while ((item = PyIter_Next(iter)) != NULL) {
+			if (!python_marshal_safe(item, depth + 1)) {
+				Py_DECREF(item);
+				Py_DECREF(iter);
+				return (0);
+			}
+			Py_DECREF(item);
+		}
+
+		Py_DECREF(iter);
+		return (1);
+	}
+
+	return (0);
+}
+
+static void
+python_kore_recvobj(struct kore_msg *msg, const void *data)
+{
+	struct kore_runtime	*rt;
+	PyObject		*onmsg, *ret, *bytes, *obj;
+
+	if ((onmsg = kore_module_getsym("koreapp.onmsg", &rt)) == NULL)
+		return;
+
+	if (rt->type != KORE_RUNTIME_PYTHON)
+		return;
+
+	switch (msg->id) {
+	case KORE_PYTHON_SEND_RAW:
+		obj = PyBytes_FromStringAndSize(data, msg->length);
+		break;
+	case KORE_PYTHON_SEND_MARSHAL:
+		obj = PyMarshal_ReadObjectFromString(data,
+		    (Py_ssize_t)msg->length);
+		break;
+	default:
+		bytes = PyBytes_FromStringAndSize(data, msg->length);
+		if (bytes == NULL) {
+			obj = NULL;
+			break;
+		}
+		obj = PyObject_CallFunctionObjArgs(pickle_loads, bytes, NULL);
+		Py_DECREF(bytes);
+		break;
+	}
+
+	if (obj == NULL) {
+		Py_DECREF(onmsg);
+		kore_python_log_error("kore.recvobj");
+		return;
+	}
+
+	ret = PyObject_CallFunctionObjArgs(onmsg, obj, NULL);
+
+	Py_DECREF(obj);
+	Py_DECREF(onmsg);
+	Py_XDECREF(ret);
+}
+
+static PyObject *
+python_kore_suspend(PyObject *self, PyObject *args)
+{
+	struct pysuspend_op	*op;
+	int			delay;
+
+	if (!PyArg_ParseTuple(args, "i", &delay))
+		return (NULL);
+
+	op = python_freelist_get(PYTHON_FREELIST_SUSPEND_OP);
+	if (op == NULL)
+		return (NULL);
+
+	op->timer = NULL;
+	op->delay = delay;
+	op->coro = coro_running;
+	op->state = PYSUSPEND_OP_INIT;
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+python_kore_shutdown(PyObject *self, PyObject *args)
+{
+	kore_shutdown();
+
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+python_kore_warmup_hold(PyObject *self, PyObject *args)
+{
+	if (worker == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "only usable in a worker");
+		return (NULL);
+	}
+
+	kore_worker_warmup_hold();
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+python_kore_warmup_release(PyObject *self, PyObject *args)
+{
+	if (worker == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "only usable in a worker");
+		return (NULL);
+	}
+
+	kore_worker_warmup_release();
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+python_kore_coroname(PyObject *self, PyObject *args)
+{
+	const char		*name;
+
+	if (coro_running == NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "kore.coroname() only available in coroutines");
+		return (NULL);
+	}
+
+	if (!PyArg_ParseTuple(args, "s", &name))
+		return (NULL);
+
+	kore_free(coro_running->name);
+	coro_running->name = kore_strdup(name);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+python_kore_corotrace(PyObject *self, PyObject *args)
+{
+	if (!PyArg_ParseTuple(args, "b", &coro_tracing))
+		return (NULL);
+
+	Py_RETURN_NONE;
+}
+
+/*
+ * Returns a dict per live coroutine with its scheduling class and how
+ * often and how long (in microseconds) it ran so far.
+ */
+static PyObject *
+python_kore_corostats(PyObject *self, PyObject *args)
+{
+	int			prio;
+	PyObject		*list;
+
+	if ((list = PyList_New(0)) == NULL)
+		return (NULL);
+
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!python_corostats_add(list, &coro_runnable[prio])) {
+			Py_DECREF(list);
+			return (NULL);
+		}
+	}
+
+	if (!python_corostats_add(list, &coro_suspended)) {
+		Py_DECREF(list);
+		return (NULL);
+	}
+
+	return (list);
+}
+
+static int
+python_corostats_add(PyObject *list, struct coro_list *head)
+{
+	int			ret;
+	PyObject		*dict;
+	struct python_coro	*coro;
+
+	TAILQ_FOREACH(coro, head, list) {
+		dict = Py_BuildValue("{s:I,s:s,s:s,s:s,s:I,s:K,s:K}",
+		    "id", coro->id,
+		    "name", coro->name ? coro->name : "",
+		    "priority", http_prio_name(coro->prio),
+		    "state", coro->state == CORO_STATE_RUNNABLE ?
+		    "runnable" : "suspended",
+		    "runs", coro->runs,
+		    "run_us", (unsigned long long)coro->run_us,
+		    "slice_max", (unsigned long long)coro->slice_max);
+		if (dict == NULL)
+			return (KORE_RESULT_ERROR);
+
+		ret = PyList_Append(list, dict);
+		Py_DECREF(dict);
+
+		if (ret == -1)
+			return (KORE_RESULT_ERROR);
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static PyObject *
+python_kore_timer(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	u_int64_t		ms;
+	PyObject		*obj;
+	int			flags;
+	struct pytimer		*timer;
+
+	if (!PyArg_ParseTuple(args, "OKi", &obj, &ms, &flags))
+		return (NULL);
+
+	if (flags & ~(KORE_TIMER_FLAGS)) {
+		PyErr_SetString(PyExc_RuntimeError, "invalid flags");
+		return (NULL);
+	}
+
+	if ((timer = PyObject_New(struct pytimer, &pytimer_type)) == NULL)
 		return (NULL);
 
 	timer->udata = NULL;
@@ -2747,7 +3432,7 @@ pysuspend_op_dealloc(struct pysuspend_op *op)
 		op->timer = NULL;
 	}
 
-	PyObject_Del((PyObject *)op);
+	python_freelist_put(PYTHON_FREELIST_SUSPEND_OP, op);
 }
 
 static PyObject *
@@ -3073,7 +3758,7 @@ pysocket_op_dealloc(struct pysocket_op *op)
 	op->coro->sockop = NULL;
 	Py_DECREF(op->socket);
 
-	PyObject_Del((PyObject *)op);
+	python_freelist_put(PYTHON_FREELIST_SOCKET_OP, op);
 }
 
 static PyObject *
@@ -3108,7 +3793,7 @@ pysocket_op_create(struct pysocket *sock, int type, const void *ptr, size_t len)
 		fatal("unknown pysocket_op type %u", type);
 	}
 
-	op = PyObject_New(struct pysocket_op, &pysocket_op_type);
+	op = python_freelist_get(PYTHON_FREELIST_SOCKET_OP);
 	if (op == NULL)
 		return (NULL);
 
@@ -3581,7 +4266,7 @@ pyqueue_pop(struct pyqueue *queue, PyObject *args)
 {
 	struct pyqueue_op	*op;
 
-	if ((op = PyObject_New(struct pyqueue_op, &pyqueue_op_type)) == NULL)
+	if ((op = python_freelist_get(PYTHON_FREELIST_QUEUE_OP)) == NULL)
 		return (NULL);
 
 	op->queue = queue;
@@ -3658,7 +4343,7 @@ pyqueue_op_dealloc(struct pyqueue_op *op)
 	}
 
 	Py_DECREF((PyObject *)op->queue);
-	PyObject_Del((PyObject *)op);
+	python_freelist_put(PYTHON_FREELIST_QUEUE_OP, op);
 }
 
 static PyObject *
@@ -3756,7 +4441,7 @@ pylock_aenter(struct pylock *lock, PyObject *args)
 		return (NULL);
 	}
 
-	if ((op = PyObject_New(struct pylock_op, &pylock_op_type)) == NULL)
+	if ((op = python_freelist_get(PYTHON_FREELIST_LOCK_OP)) == NULL)
 		return (NULL);
 
 	op->active = 1;
@@ -3787,7 +4472,7 @@ pylock_aexit(struct pylock *lock, PyObject *args)
 		return (NULL);
 	}
 
-	if ((op = PyObject_New(struct pylock_op, &pylock_op_type)) == NULL)
+	if ((op = python_freelist_get(PYTHON_FREELIST_LOCK_OP)) == NULL)
 		return (NULL);
 
 	op->active = 1;
@@ -3841,7 +4526,7 @@ pylock_op_dealloc(struct pylock_op *op)
 	op->coro->lockop = NULL;
 
 	Py_DECREF((PyObject *)op->lock);
-	PyObject_Del((PyObject *)op);
+	python_freelist_put(PYTHON_FREELIST_LOCK_OP, op);
 }
 
 static PyObject *
@@ -3986,7 +4671,7 @@ pyproc_reap(struct pyproc *proc, PyObject *args)
 		proc->timer = NULL;
 	}
 
-	if ((op = PyObject_New(struct pyproc_op, &pyproc_op_type)) == NULL)
+	if ((op = python_freelist_get(PYTHON_FREELIST_PROC_OP)) == NULL)
 		return (NULL);
 
 	op->proc = proc;
@@ -4074,7 +4759,7 @@ static void
 pyproc_op_dealloc(struct pyproc_op *op)
 {
 	Py_DECREF((PyObject *)op->proc);
-	PyObject_Del((PyObject *)op);
+	python_freelist_put(PYTHON_FREELIST_PROC_OP, op);
 }
 
 static PyObject *
@@ -4253,7 +4938,7 @@ pyhttp_request_alloc(const struct http_request *req)
 	union { const void *cp; void *p; }	ptr;
 	struct pyhttp_request			*pyreq;
 
-	pyreq = PyObject_New(struct pyhttp_request, &pyhttp_request_type);
+	pyreq = python_freelist_get(PYTHON_FREELIST_REQUEST);
 	if (pyreq == NULL)
 		return (NULL);
 
@@ -4267,6 +4952,7 @@ pyhttp_request_alloc(const struct http_request *req)
 	pyreq->req = ptr.p;
 	pyreq->data = NULL;
 	pyreq->dict = NULL;
+	pyreq->body = NULL;
 
 	return ((PyObject *)pyreq);
 }
@@ -4336,6 +5022,7 @@ pyhttp_response(struct pyhttp_request *pyreq, PyObject *args)
 	char			*ptr;
 	Py_ssize_t		length;
 	int			status;
+	Py_buffer		*view;
 	struct pyhttp_iterobj	*iterobj;
 	PyObject		*obj, *iterator;
 
@@ -4359,12 +5046,37 @@ pyhttp_response(struct pyhttp_request *pyreq, PyObject *args)
 		    pyhttp_response_sent, obj);
 	} else if (obj == Py_None) {
 		http_response(pyreq->req, status, NULL, 0);
+	} else if (PyObject_CheckBuffer(obj)) {
+		/* Sent straight from the object, it is held until then. */
+		view = kore_malloc(sizeof(*view));
+		if (PyObject_GetBuffer(obj, view, PyBUF_SIMPLE) == -1) {
+			kore_free(view);
+			return (NULL);
+		}
+
+		http_response_stream(pyreq->req, status, view->buf,
+		    (size_t)view->len, pyhttp_response_buffer_sent, view);
+
+		/* No body goes out for these, so nothing calls back. */
+		if (pyreq->req->owner == NULL ||
+		    pyreq->req->method == HTTP_METHOD_HEAD) {
+			PyBuffer_Release(view);
+			kore_free(view);
+		}
 	} else {
 		c = pyreq->req->owner;
 		if (c->state == CONN_STATE_DISCONNECTING) {
 			Py_RETURN_FALSE;
 		}
 
+#if defined(KORE_USE_HTTP2)
+		if (c->proto == CONN_PROTO_HTTP2) {
+			PyErr_SetString(PyExc_RuntimeError,
+			    "iterator responses require HTTP/1.x");
+			return (NULL);
+		}
+#endif
+
 		if ((iterator = PyObject_GetIter(obj)) == NULL)
 			return (NULL);
 
@@ -4401,6 +5113,18 @@ pyhttp_response_sent(struct netbuf *nb)
 	return (KORE_RESULT_OK);
 }
 
+static int
+pyhttp_response_buffer_sent(struct netbuf *nb)
+{
+	Py_buffer	*view;
+
+	view = nb->extra;
+	PyBuffer_Release(view);
+	kore_free(view);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 pyhttp_iterobj_next(struct pyhttp_iterobj *iterobj)
 {
@@ -4815,43 +5539,95 @@ pyhttp_get_path(struct pyhttp_request *pyreq, void *closure)
 	return (path);
 }
 
+/* A single copy of body_view, made on first use and kept. */
 static PyObject *
 pyhttp_get_body(struct pyhttp_request *pyreq, void *closure)
 {
-	ssize_t			ret;
-	struct kore_buf		buf;
-	PyObject		*body;
-	u_int8_t		data[BUFSIZ];
+	PyObject	*view;
 
-	kore_buf_init(&buf, 1024);
-	if (!http_body_rewind(pyreq->req)) {
-		PyErr_SetString(PyExc_RuntimeError,
-		    "http_body_rewind() failed");
-		return (NULL);
+	if (pyreq->body == NULL) {
+		if ((view = pyhttp_get_body_view(pyreq, NULL)) == NULL)
+			return (NULL);
+
+		pyreq->body = PyBytes_FromObject(view);
+		Py_DECREF(view);
+
+		if (pyreq->body == NULL)
+			return (NULL);
 	}
 
-	for (;;) {
-		ret = http_body_read(pyreq->req, data, sizeof(data));
-		if (ret == -1) {
-			kore_buf_cleanup(&buf);
-			PyErr_SetString(PyExc_RuntimeError,
-			    "http_body_read() failed");
+	Py_INCREF(pyreq->body);
+
+	return (pyreq->body);
+}
+
+/*
+ * A read-only memoryview on the request body without copying it, the
+ * same view is handed out on every access.
+ */
+static PyObject *
+pyhttp_get_body_view(struct pyhttp_request *pyreq, void *closure)
+{
+	struct stat		st;
+	struct http_request	*req;
+	struct pyhttp_body	*body;
+	PyObject		*view;
+
+	req = pyreq->req;
+
+	if (req->py_body != NULL) {
+		Py_INCREF((PyObject *)req->py_body);
+		return (req->py_body);
+	}
+
+	body = PyObject_New(struct pyhttp_body, &pyhttp_body_type);
+	if (body == NULL)
+		return (NULL);
+
+	body->map = NULL;
+	body->buf = NULL;
+	body->data = NULL;
+	body->length = 0;
+
+	if (req->http_body_fd != -1) {
+		if (fstat(req->http_body_fd, &st) == -1) {
+			Py_DECREF((PyObject *)body);
+			PyErr_Format(PyExc_RuntimeError, "fstat(%s): %s",
+			    req->http_body_path, errno_s);
 			return (NULL);
 		}
 
-		if (ret == 0)
-			break;
+		if (st.st_size > 0) {
+			body->map = mmap(NULL, (size_t)st.st_size, PROT_READ,
+			    MAP_PRIVATE, req->http_body_fd, 0);
+			if (body->map == MAP_FAILED) {
+				body->map = NULL;
+				Py_DECREF((PyObject *)body);
+				PyErr_Format(PyExc_RuntimeError,
+				    "mmap(%s): %s", req->http_body_path,
+				    errno_s);
+				return (NULL);
+			}
 
-		kore_buf_append(&buf, data, (size_t)ret);
+			body->data = body->map;
+			body->length = (size_t)st.st_size;
+		}
+	} else if (req->http_body != NULL) {
+		body->data = req->http_body->data;
+		body->length = MIN(req->content_length,
+		    req->http_body->length);
 	}
 
-	body = PyBytes_FromStringAndSize((char *)buf.data, buf.offset);
-	kore_buf_free(&buf);
+	view = PyMemoryView_FromObject((PyObject *)body);
+	Py_DECREF((PyObject *)body);
 
-	if (body == NULL)
-		return (PyErr_NoMemory());
+	if (view == NULL)
+		return (NULL);
 
-	return (body);
+	Py_INCREF(view);
+	req->py_body = view;
+
+	return (view);
 }
 
 static PyObject *
@@ -4910,6 +5686,36 @@ pyhttp_get_connection(struct pyhttp_request *pyreq, void *closure)
 	return (pyc);
 }
 
+static PyObject *
+pyhttp_get_timing(struct pyhttp_request *pyreq, void *closure)
+{
+	int		phase;
+	PyObject	*dict, *us;
+
+	if ((dict = PyDict_New()) == NULL)
+		return (PyErr_NoMemory());
+
+	for (phase = 0; phase < HTTP_TIMING_MAX; phase++) {
+		us = PyLong_FromUnsignedLongLong(
+		    http_request_timing(pyreq->req, phase));
+		if (us == NULL) {
+			Py_DECREF(dict);
+			return (PyErr_NoMemory());
+		}
+
+		if (PyDict_SetItemString(dict,
+		    http_timing_name(phase), us) == -1) {
+			Py_DECREF(us);
+			Py_DECREF(dict);
+			return (NULL);
+		}
+
+		Py_DECREF(us);
+	}
+
+	return (dict);
+}
+
 static PyObject *
 pyhttp_file_get_name(struct pyhttp_file *pyfile, void *closure)
 {
@@ -5035,6 +5841,7 @@ pydomain_route(struct pydomain *domain, PyObject *args, PyObject *kwargs)
 	hdlr->func = kore_strdup(val);
 	hdlr->path = kore_strdup(path);
 	hdlr->methods = HTTP_METHOD_ALL;
+	hdlr->priority = HTTP_PRIO_NORMAL;
 	TAILQ_INIT(&hdlr->params);
 
 	Py_DECREF(repr);
@@ -5090,6 +5897,13 @@ pydomain_route(struct pydomain *domain, PyObject *args, PyObject *kwargs)
 				return (NULL);
 			}
 		}
+
+		if ((obj = PyDict_GetItemString(kwargs, "priority")) != NULL) {
+			if (!pydomain_priority(obj, hdlr)) {
+				kore_module_handler_free(hdlr);
+				return (NULL);
+			}
+		}
 	}
 
 	if (path[0] == '/') {
@@ -5106,7 +5920,9 @@ pydomain_route(struct pydomain *domain, PyObject *args, PyObject *kwargs)
 	}
 
 	Py_INCREF(callable);
+	hdlr->id = domain->config->route_ids++;
 	TAILQ_INSERT_TAIL(&domain->config->handlers, hdlr, list);
+	domain->config->routes_dirty = 1;
 
 	Py_RETURN_NONE;
 }
@@ -5182,10 +5998,36 @@ pydomain_params(PyObject *kwargs, struct kore_module_handle *hdlr,
 	return (KORE_RESULT_OK);
 }
 
+static int
+pydomain_priority(PyObject *obj, struct kore_module_handle *hdlr)
+{
+	int		prio;
+	const char	*val;
+
+	if ((val = PyUnicode_AsUTF8(obj)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	for (prio = 0; prio < HTTP_PRIO_MAX; prio++) {
+		if (!strcmp(http_prio_name(prio), val))
+			break;
+	}
+
+	if (prio == HTTP_PRIO_MAX) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "unknown priority class '%s'", val);
+		return (KORE_RESULT_ERROR);
+	}
+
+	hdlr->priority = prio;
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 pydomain_auth(PyObject *dict, struct kore_module_handle *hdlr)
 {
-	int			type;
+	long			entries, ttl;
+	int			type, shared;
 	struct kore_auth	*auth;
 	struct kore_validator	*vldr;
 	PyObject		*obj, *repr;
@@ -5219,6 +6061,35 @@ pydomain_auth(PyObject *dict, struct kore_module_handle *hdlr)
 
 	redir = python_string_from_dict(dict, "redirect");
 
+	entries = 0;
+	ttl = 60;
+	shared = 0;
+
+	if (PyDict_GetItemString(dict, "cache") != NULL &&
+	    (!python_long_from_dict(dict, "cache", &entries) ||
+	    entries < 1 || entries > (1 << 24))) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "invalid 'cache' in auth dictionary for '%s'", hdlr->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (PyDict_GetItemString(dict, "cache_ttl") != NULL &&
+	    (!python_long_from_dict(dict, "cache_ttl", &ttl) ||
+	    ttl < 1 || ttl > 86400)) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "invalid 'cache_ttl' in auth dictionary for '%s'",
+		    hdlr->path);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (PyDict_GetItemString(dict, "cache_shared") != NULL &&
+	    !python_bool_from_dict(dict, "cache_shared", &shared)) {
+		PyErr_Format(PyExc_RuntimeError,
+		    "invalid 'cache_shared' in auth dictionary for '%s'",
+		    hdlr->path);
+		return (KORE_RESULT_ERROR);
+	}
+
 	if ((obj = PyDict_GetItemString(dict, "verify")) == NULL ||
 	    !PyCallable_Check(obj)) {
 		PyErr_Format(PyExc_RuntimeError,
@@ -5255,6 +6126,13 @@ pydomain_auth(PyObject *dict, struct kore_module_handle *hdlr)
 	auth->validator = vldr;
 	hdlr->auth = auth;
 
+	if (entries > 0) {
+		auth->cache_size = entries;
+		auth->cache_ttl = ttl * 1000;
+		auth->cache_shared = shared;
+		kore_auth_cache_create(auth);
+	}
+
 	return (KORE_RESULT_OK);
 }
 
@@ -6185,3 +7063,499 @@ python_curl_handle_callback(struct kore_curl *curl, void *arg)
 		python_coro_wakeup(op->coro);
 }
 #endif
+
+#if defined(KORE_USE_TASKS)
+static PyObject *
+pyfs_open(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	PyObject		*path;
+	int			flags, mode;
+
+	flags = O_RDONLY;
+	mode = 0644;
+
+	if (!PyArg_ParseTuple(args, "O&|ii",
+	    PyUnicode_FSConverter, &path, &flags, &mode))
+		return (NULL);
+
+	if ((op = pyfs_op_create(PYFS_OP_OPEN)) == NULL) {
+		Py_DECREF(path);
+		return (NULL);
+	}
+
+	op->job->path_obj = path;
+	op->job->path = PyBytes_AS_STRING(path);
+	op->job->flags = flags;
+	op->job->mode = mode;
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_read(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	int			fd;
+	Py_ssize_t		length;
+	long long		offset;
+
+	offset = -1;
+
+	if (!PyArg_ParseTuple(args, "in|L", &fd, &length, &offset))
+		return (NULL);
+
+	if (length < 0) {
+		PyErr_SetString(PyExc_ValueError, "negative length");
+		return (NULL);
+	}
+
+	if ((op = pyfs_op_create(PYFS_OP_READ)) == NULL)
+		return (NULL);
+
+	op->job->buffer = PyBytes_FromStringAndSize(NULL, length);
+	if (op->job->buffer == NULL) {
+		Py_DECREF((PyObject *)op);
+		return (NULL);
+	}
+
+	op->job->fd = fd;
+	op->job->offset = offset;
+	op->job->length = length;
+	op->job->data = (u_int8_t *)PyBytes_AS_STRING(op->job->buffer);
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_write(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	int			fd;
+	Py_buffer		view;
+	long long		offset;
+
+	offset = -1;
+
+	if (!PyArg_ParseTuple(args, "iy*|L", &fd, &view, &offset))
+		return (NULL);
+
+	if ((op = pyfs_op_create(PYFS_OP_WRITE)) == NULL) {
+		PyBuffer_Release(&view);
+		return (NULL);
+	}
+
+	op->job->view = view;
+	op->job->fd = fd;
+	op->job->offset = offset;
+	op->job->data = view.buf;
+	op->job->length = view.len;
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_fsync(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	int			fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return (NULL);
+
+	if ((op = pyfs_op_create(PYFS_OP_FSYNC)) == NULL)
+		return (NULL);
+
+	op->job->fd = fd;
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_stat(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	PyObject		*path;
+
+	if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &path))
+		return (NULL);
+
+	if ((op = pyfs_op_create(PYFS_OP_STAT)) == NULL) {
+		Py_DECREF(path);
+		return (NULL);
+	}
+
+	op->job->path_obj = path;
+	op->job->path = PyBytes_AS_STRING(path);
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_close(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	int			fd;
+
+	if (!PyArg_ParseTuple(args, "i", &fd))
+		return (NULL);
+
+	if ((op = pyfs_op_create(PYFS_OP_CLOSE)) == NULL)
+		return (NULL);
+
+	op->job->fd = fd;
+
+	return ((PyObject *)op);
+}
+
+static PyObject *
+pyfs_sendfile(PyObject *self, PyObject *args)
+{
+	struct pyfs_op		*op;
+	struct pyhttp_request	*pyreq;
+	PyObject		*path;
+	int			status;
+
+	status = HTTP_STATUS_OK;
+
+	if (!PyArg_ParseTuple(args, "O!O&|i", &pyhttp_request_type, &pyreq,
+	    PyUnicode_FSConverter, &path, &status))
+		return (NULL);
+
+	/* The request has to outlive the op, its own coroutine does. */
+	if (coro_running == NULL || coro_running->request != pyreq->req) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "kore.fs.sendfile() only works for the current request");
+		Py_DECREF(path);
+		return (NULL);
+	}
+
+	if ((op = pyfs_op_create(PYFS_OP_SENDFILE)) == NULL) {
+		Py_DECREF(path);
+		return (NULL);
+	}
+
+	op->req = pyreq->req;
+	op->status = status;
+	op->job->path_obj = path;
+	op->job->path = PyBytes_AS_STRING(path);
+
+	return ((PyObject *)op);
+}
+
+static struct pyfs_op *
+pyfs_op_create(int type)
+{
+	struct pyfs_op		*op;
+	struct pyfs_job		*job;
+
+	if (coro_running == NULL) {
+		PyErr_SetString(PyExc_RuntimeError,
+		    "kore.fs only available in coroutines");
+		return (NULL);
+	}
+
+	if ((op = PyObject_New(struct pyfs_op, &pyfs_op_type)) == NULL)
+		return (NULL);
+
+	job = kore_calloc(1, sizeof(*job));
+	job->op = op;
+	job->fd = -1;
+	job->type = type;
+	job->result = -1;
+
+	kore_task_create(&job->task, pyfs_job_run);
+	kore_task_bind_callback(&job->task, pyfs_job_done);
+	kore_task_set_priority(&job->task, coro_running->prio);
+
+	op->job = job;
+	op->req = NULL;
+	op->status = 0;
+	op->coro = coro_running;
+	op->state = PYFS_STATE_INIT;
+
+	return (op);
+}
+
+static void
+pyfs_op_dealloc(struct pyfs_op *op)
+{
+	/* A job still on a task thread is left to clean up after itself. */
+	if (op->state == PYFS_STATE_WAIT)
+		op->job->op = NULL;
+	else
+		pyfs_job_free(op->job);
+
+	PyObject_Del((PyObject *)op);
+}
+
+static PyObject *
+pyfs_op_await(PyObject *obj)
+{
+	Py_INCREF(obj);
+	return (obj);
+}
+
+static PyObject *
+pyfs_op_iternext(struct pyfs_op *op)
+{
+	switch (op->state) {
+	case PYFS_STATE_INIT:
+		if (op->job->type == PYFS_OP_SENDFILE &&
+		    pyfs_sendfile_cached(op)) {
+			PyErr_SetNone(PyExc_StopIteration);
+			return (NULL);
+		}
+		op->state = PYFS_STATE_WAIT;
+		kore_task_run(&op->job->task);
+		break;
+	case PYFS_STATE_WAIT:
+		break;
+	case PYFS_STATE_DONE:
+		return (pyfs_op_result(op));
+	default:
+		fatal("unknown state %d for pyfs_op", op->state);
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+pyfs_op_result(struct pyfs_op *op)
+{
+	PyObject		*obj;
+	struct pyfs_job		*job;
+
+	job = op->job;
+
+	if (job->result == -1) {
+		errno = job->error;
+		if (job->path != NULL) {
+			PyErr_SetFromErrnoWithFilename(PyExc_OSError,
+			    job->path);
+		} else {
+			PyErr_SetFromErrno(PyExc_OSError);
+		}
+		return (NULL);
+	}
+
+	switch (job->type) {
+	case PYFS_OP_OPEN:
+		obj = PyLong_FromLong(job->result);
+		job->result = -1;
+		break;
+	case PYFS_OP_READ:
+		if (job->buffer == NULL) {
+			PyErr_SetString(PyExc_RuntimeError,
+			    "kore.fs.read() result already taken");
+			return (NULL);
+		}
+		if (_PyBytes_Resize(&job->buffer, job->result) == -1)
+			return (NULL);
+		obj = job->buffer;
+		job->buffer = NULL;
+		break;
+	case PYFS_OP_WRITE:
+		obj = PyLong_FromSsize_t(job->result);
+		break;
+	case PYFS_OP_STAT:
+		obj = Py_BuildValue("{s:L,s:I,s:I,s:I,s:K,s:K,s:d,s:d,s:d}",
+		    "size", (long long)job->st.st_size,
+		    "mode", (unsigned int)job->st.st_mode,
+		    "uid", (unsigned int)job->st.st_uid,
+		    "gid", (unsigned int)job->st.st_gid,
+		    "ino", (unsigned long long)job->st.st_ino,
+		    "nlink", (unsigned long long)job->st.st_nlink,
+		    "atime", job->st.st_atim.tv_sec +
+		    job->st.st_atim.tv_nsec / 1e9,
+		    "mtime", job->st.st_mtim.tv_sec +
+		    job->st.st_mtim.tv_nsec / 1e9,
+		    "ctime", job->st.st_ctim.tv_sec +
+		    job->st.st_ctim.tv_nsec / 1e9);
+		break;
+	case PYFS_OP_SENDFILE:
+		if (!pyfs_sendfile_respond(op))
+			return (NULL);
+		/* FALLTHROUGH */
+	case PYFS_OP_FSYNC:
+	case PYFS_OP_CLOSE:
+		PyErr_SetNone(PyExc_StopIteration);
+		return (NULL);
+	default:
+		fatal("unknown pyfs_op type %d", job->type);
+	}
+
+	if (obj == NULL)
+		return (NULL);
+
+	PyErr_SetObject(PyExc_StopIteration, obj);
+	Py_DECREF(obj);
+
+	return (NULL);
+}
+
+/* Serve the file straight away if there already is a fileref for it. */
+static int
+pyfs_sendfile_cached(struct pyfs_op *op)
+{
+	struct kore_fileref	*ref;
+	struct kore_server	*srv;
+
+	if (op->req->owner == NULL)
+		return (1);
+
+	srv = op->req->owner->owner->server;
+	if ((ref = kore_fileref_get(op->job->path, srv->tls)) == NULL)
+		return (0);
+
+	http_response_fileref(op->req, op->status, ref);
+
+	return (1);
+}
+
+static int
+pyfs_sendfile_respond(struct pyfs_op *op)
+{
+	struct kore_fileref	*ref;
+	struct pyfs_job		*job;
+	struct kore_server	*srv;
+
+	job = op->job;
+
+	if (op->req->owner == NULL)
+		return (KORE_RESULT_OK);
+
+	if (job->st.st_size == 0) {
+		http_response(op->req, op->status, NULL, 0);
+		return (KORE_RESULT_OK);
+	}
+
+	srv = op->req->owner->owner->server;
+
+	/* Another request may have created it in the meantime. */
+	if ((ref = kore_fileref_get(job->path, srv->tls)) == NULL) {
+		ref = kore_fileref_create(srv, job->path, job->result,
+		    job->st.st_size, &job->st.st_mtim);
+		if (ref == NULL) {
+			PyErr_Format(PyExc_RuntimeError,
+			    "failed to create fileref for %s", job->path);
+			return (KORE_RESULT_ERROR);
+		}
+
+		/* The fileref owns the descriptor now. */
+		job->result = -1;
+	}
+
+	http_response_fileref(op->req, op->status, ref);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Runs on a task thread, nothing but the syscalls happen here.
+ */
+static int
+pyfs_job_run(struct kore_task *t)
+{
+	struct pyfs_job		*job = (struct pyfs_job *)t;
+
+	switch (job->type) {
+	case PYFS_OP_OPEN:
+		job->result = open(job->path, job->flags | O_CLOEXEC,
+		    job->mode);
+		break;
+	case PYFS_OP_READ:
+		do {
+			if (job->offset == -1) {
+				job->result = read(job->fd,
+				    job->data, job->length);
+			} else {
+				job->result = pread(job->fd, job->data,
+				    job->length, job->offset);
+			}
+		} while (job->result == -1 && errno == EINTR);
+		break;
+	case PYFS_OP_WRITE:
+		do {
+			if (job->offset == -1) {
+				job->result = write(job->fd,
+				    job->data, job->length);
+			} else {
+				job->result = pwrite(job->fd, job->data,
+				    job->length, job->offset);
+			}
+		} while (job->result == -1 && errno == EINTR);
+		break;
+	case PYFS_OP_FSYNC:
+		job->result = fsync(job->fd);
+		break;
+	case PYFS_OP_STAT:
+		job->result = stat(job->path, &job->st);
+		break;
+	case PYFS_OP_CLOSE:
+		job->result = close(job->fd);
+		break;
+	case PYFS_OP_SENDFILE:
+		job->result = open(job->path, O_RDONLY | O_CLOEXEC);
+		if (job->result == -1)
+			break;
+
+		if (fstat(job->result, &job->st) == -1) {
+			job->error = errno;
+		} else if (!S_ISREG(job->st.st_mode)) {
+			job->error = S_ISDIR(job->st.st_mode) ?
+			    EISDIR : EINVAL;
+		} else {
+			break;
+		}
+
+		close(job->result);
+		job->result = -1;
+		return (KORE_RESULT_OK);
+	}
+
+	if (job->result == -1)
+		job->error = errno;
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+pyfs_job_done(struct kore_task *t)
+{
+	struct pyfs_job		*job = (struct pyfs_job *)t;
+
+	if (!kore_task_finished(t))
+		return;
+
+	if (job->op == NULL) {
+		pyfs_job_free(job);
+		return;
+	}
+
+	job->op->state = PYFS_STATE_DONE;
+
+	if (job->op->coro->request != NULL)
+		http_request_wakeup(job->op->coro->request);
+	else
+		python_coro_wakeup(job->op->coro);
+}
+
+static void
+pyfs_job_free(struct pyfs_job *job)
+{
+	/* Opened descriptors nobody took over. */
+	if ((job->type == PYFS_OP_OPEN || job->type == PYFS_OP_SENDFILE) &&
+	    job->result != -1)
+		close(job->result);
+
+	if (job->view.obj != NULL)
+		PyBuffer_Release(&job->view);
+
+	Py_XDECREF(job->buffer);
+	Py_XDECREF(job->path_obj);
+
+	kore_task_destroy(&job->task);
+	kore_free(job);
+}
+#endif
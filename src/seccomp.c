@@ -55,6 +55,9 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(open),
 #endif
 	KORE_SYSCALL_ALLOW(read),
+#if defined(KORE_USE_HTTP2) || defined(KORE_USE_ZLIB)
+	KORE_SYSCALL_ALLOW(pread64),
+#endif
 #if defined(SYS_stat)
 	KORE_SYSCALL_ALLOW(stat),
 #endif
@@ -135,7 +138,9 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(send),
 #endif
 	KORE_SYSCALL_ALLOW(sendto),
+	KORE_SYSCALL_ALLOW(sendmsg),
 	KORE_SYSCALL_ALLOW(accept),
+	KORE_SYSCALL_ALLOW(accept4),
 	KORE_SYSCALL_ALLOW(sendfile),
 #if defined(SYS_recv)
 	KORE_SYSCALL_ALLOW(recv),
@@ -143,10 +148,14 @@ static struct sock_filter filter_kore[] = {
 	KORE_SYSCALL_ALLOW(recvfrom),
 	KORE_SYSCALL_ALLOW(epoll_ctl),
 	KORE_SYSCALL_ALLOW(setsockopt),
+	KORE_SYSCALL_ALLOW(getsockopt),
 #if defined(SYS_epoll_wait)
 	KORE_SYSCALL_ALLOW(epoll_wait),
 #endif
 	KORE_SYSCALL_ALLOW(epoll_pwait),
+#if defined(KORE_USE_IOURING)
+	KORE_SYSCALL_ALLOW(io_uring_enter),
+#endif
 
 	/* Signal related. */
 	KORE_SYSCALL_ALLOW(sigaltstack),
@@ -182,9 +191,66 @@ static struct sock_filter filter_epilogue[] = {
 	BPF_STMT(BPF_RET+BPF_K, SECCOMP_KILL_POLICY)
 };
 
+/*
+ * Unconditionally allowed system calls that are checked before the
+ * binary search, in order, as workers make them the most.
+ */
+static const u_int32_t filter_hot[] = {
+#if defined(SYS_epoll_wait)
+	SYS_epoll_wait,
+#else
+	SYS_epoll_pwait,
+#endif
+	SYS_read,
+	SYS_write,
+	SYS_sendfile,
+};
+
+/*
+ * A rule is one KORE_SYSCALL_* entry of a filter: a compare against the
+ * system call number followed by a body that either returns or reloads
+ * the system call number and falls through to the next rule.
+ */
+struct rule {
+	u_int32_t		nr;
+	size_t			order;
+	struct sock_filter	*body;
+	size_t			len;
+};
+
+struct program {
+	struct sock_filter	*sf;
+	size_t			len;
+	size_t			size;
+};
+
+/* A jump from the search into the rules of a group. */
+struct fixup {
+	size_t			at;
+	size_t			group;
+};
+
+/* Groups at or below this many are checked one by one. */
+#define SECCOMP_LEAF_RULES	3
+
+/* Group g is a single rule that returns straight away. */
+#define SECCOMP_GROUP_RETURNS(_groups, _g)			\
+    ((_groups)[(_g) + 1] - (_groups)[(_g)] == 1 &&		\
+    (_groups)[(_g)]->len == 1)
+
 static struct sock_filter	*seccomp_filter_update(struct sock_filter *,
 				    const char *, size_t);
 
+static int	seccomp_rule_cmp(const void *, const void *);
+static int	seccomp_rules_parse(struct rule **, size_t *);
+static void	seccomp_program_linear(struct program *);
+static void	seccomp_program_search(struct program *,
+		    struct rule *, size_t);
+static void	seccomp_program_tree(struct program *, struct rule **,
+		    size_t, size_t, struct fixup *, size_t *);
+static size_t	seccomp_program_emit(struct program *, u_int16_t, u_int8_t,
+		    u_int8_t, u_int32_t);
+
 #define filter_prologue_len	KORE_FILTER_LEN(filter_prologue)
 #define filter_epilogue_len	KORE_FILTER_LEN(filter_epilogue)
 
@@ -233,11 +299,11 @@ kore_seccomp_drop(void)
 void
 kore_seccomp_enable(void)
 {
-	struct sock_filter		*sf;
+	struct rule			*rules;
+	struct program			bpf;
 	struct sock_fprog		prog;
 	struct kore_runtime_call	*rcall;
-	struct filter			*filter;
-	size_t				prog_len, off, i;
+	size_t				nrules;
 
 	/*
 	 * If kore_seccomp_tracing is turned on, set the default policy to
@@ -268,38 +334,26 @@ kore_seccomp_enable(void)
 		    KORE_FILTER_LEN(filter_kore));
 	}
 
-	/* Start with the prologue. */
-	prog_len = filter_prologue_len;
-
-	/* Now account for all enabled filters. */
-	TAILQ_FOREACH(filter, &filters, list)
-		prog_len += filter->instructions;
-
-	/* Finally add the epilogue. */
-	prog_len += filter_epilogue_len;
+	memset(&bpf, 0, sizeof(bpf));
 
-	/* Build the entire bpf program now. */
-	if ((sf = calloc(prog_len, sizeof(*sf))) == NULL)
-		fatalx("calloc");
-
-	off = 0;
-	for (i = 0; i < filter_prologue_len; i++)
-		sf[off++] = filter_prologue[i];
-
-	TAILQ_FOREACH(filter, &filters, list) {
-		for (i = 0; i < filter->instructions; i++)
-			sf[off++] = filter->prog[i];
+	/*
+	 * Filters made out of KORE_SYSCALL_* rules are compiled into a
+	 * binary search on the system call number, anything else (such
+	 * as raw statements from Python) keeps the linear program.
+	 */
+	if (seccomp_rules_parse(&rules, &nrules)) {
+		seccomp_program_search(&bpf, rules, nrules);
+		free(rules);
+	} else {
+		seccomp_program_linear(&bpf);
 	}
 
-	for (i = 0; i < filter_epilogue_len; i++)
-		sf[off++] = filter_epilogue[i];
-
 	/* Lock and load it. */
 	if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1)
 		fatalx("prctl: %s", errno_s);
 
-	prog.filter = sf;
-	prog.len = prog_len;
+	prog.filter = bpf.sf;
+	prog.len = bpf.len;
 
 	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) == -1)
 		fatalx("prctl: %s", errno_s);
@@ -452,6 +506,275 @@ kore_seccomp_syscall_flag(const char *name, int action, int arg, int value)
 	return (seccomp_filter_update(filter, name, KORE_FILTER_LEN(filter)));
 }
 
+/*
+ * Split all filters into their rules, in the order they would be
+ * checked by the linear program. Returns KORE_RESULT_ERROR if any
+ * filter has instructions that are not part of a rule.
+ */
+static int
+seccomp_rules_parse(struct rule **out, size_t *count)
+{
+	struct filter		*filter;
+	struct rule		*rules;
+	struct sock_filter	*ins, *body;
+	size_t			i, j, len, n, max, target;
+
+	max = 0;
+	TAILQ_FOREACH(filter, &filters, list)
+		max += filter->instructions;
+
+	if ((rules = calloc(max + 1, sizeof(*rules))) == NULL)
+		fatalx("calloc");
+
+	n = 0;
+
+	TAILQ_FOREACH(filter, &filters, list) {
+		for (i = 0; i < filter->instructions; i += len + 1) {
+			ins = &filter->prog[i];
+			if (ins->code != (BPF_JMP + BPF_JEQ + BPF_K) ||
+			    ins->jt != 0)
+				goto linear;
+
+			len = ins->jf;
+			if (len == 0 || i + 1 + len > filter->instructions)
+				goto linear;
+
+			body = ins + 1;
+
+			/* All jumps must stay inside of the body. */
+			for (j = 0; j < len; j++) {
+				if (BPF_CLASS(body[j].code) != BPF_JMP)
+					continue;
+				if (BPF_OP(body[j].code) == BPF_JA) {
+					if (j + 1 + body[j].k >= len)
+						goto linear;
+					continue;
+				}
+				target = j + 1 + MAX(body[j].jt, body[j].jf);
+				if (target >= len)
+					goto linear;
+			}
+
+			/* Either it returns or it leaves nr loaded. */
+			if (BPF_CLASS(body[len - 1].code) != BPF_RET &&
+			    (body[len - 1].code != (BPF_LD + BPF_W + BPF_ABS) ||
+			    body[len - 1].k != offsetof(struct seccomp_data, nr)))
+				goto linear;
+
+			rules[n].nr = ins->k;
+			rules[n].order = n;
+			rules[n].body = body;
+			rules[n].len = len;
+
+			n++;
+		}
+	}
+
+	qsort(rules, n, sizeof(*rules), seccomp_rule_cmp);
+
+	*out = rules;
+	*count = n;
+
+	return (KORE_RESULT_OK);
+
+linear:
+	kore_log(LOG_NOTICE,
+	    "seccomp filter '%s' is not made of rules, not optimizing",
+	    filter->name);
+	free(rules);
+
+	return (KORE_RESULT_ERROR);
+}
+
+static int
+seccomp_rule_cmp(const void *a, const void *b)
+{
+	const struct rule	*ra = a;
+	const struct rule	*rb = b;
+
+	if (ra->nr != rb->nr)
+		return (ra->nr < rb->nr ? -1 : 1);
+
+	/* Rules for the same system call keep their order. */
+	return (ra->order < rb->order ? -1 : 1);
+}
+
+/* The program as before: every filter after each other. */
+static void
+seccomp_program_linear(struct program *bpf)
+{
+	struct filter		*filter;
+	size_t			i;
+
+	for (i = 0; i < filter_prologue_len; i++) {
+		seccomp_program_emit(bpf, filter_prologue[i].code,
+		    filter_prologue[i].jt, filter_prologue[i].jf,
+		    filter_prologue[i].k);
+	}
+
+	TAILQ_FOREACH(filter, &filters, list) {
+		for (i = 0; i < filter->instructions; i++) {
+			seccomp_program_emit(bpf, filter->prog[i].code,
+			    filter->prog[i].jt, filter->prog[i].jf,
+			    filter->prog[i].k);
+		}
+	}
+
+	seccomp_program_emit(bpf, filter_epilogue[0].code,
+	    0, 0, filter_epilogue[0].k);
+}
+
+/*
+ * Rules are grouped per system call number, they only ever run for that
+ * number so their order relative to other numbers does not matter. The
+ * hot system calls are checked first, then a binary search over the
+ * numbers jumps to the rules of the group, which end in the default
+ * action if none of them returned.
+ */
+static void
+seccomp_program_search(struct program *bpf, struct rule *rules, size_t n)
+{
+	struct rule		**groups;
+	struct fixup		*fixups;
+	size_t			*starts;
+	size_t			i, j, g, ngroups, nfix;
+
+	if ((groups = calloc(n + 1, sizeof(*groups))) == NULL)
+		fatalx("calloc");
+
+	ngroups = 0;
+	for (i = 0; i < n; i++) {
+		if (i == 0 || rules[i].nr != rules[i - 1].nr)
+			groups[ngroups++] = &rules[i];
+	}
+	groups[ngroups] = &rules[n];
+
+	if ((fixups = calloc(ngroups + 1, sizeof(*fixups))) == NULL)
+		fatalx("calloc");
+	if ((starts = calloc(ngroups + 1, sizeof(*starts))) == NULL)
+		fatalx("calloc");
+
+	for (i = 0; i < filter_prologue_len; i++) {
+		seccomp_program_emit(bpf, filter_prologue[i].code,
+		    filter_prologue[i].jt, filter_prologue[i].jf,
+		    filter_prologue[i].k);
+	}
+
+	for (i = 0; i < KORE_FILTER_LEN(filter_hot); i++) {
+		for (g = 0; g < ngroups; g++) {
+			if (groups[g]->nr == filter_hot[i])
+				break;
+		}
+
+		if (g == ngroups || !SECCOMP_GROUP_RETURNS(groups, g))
+			continue;
+
+		seccomp_program_emit(bpf, BPF_JMP + BPF_JEQ + BPF_K,
+		    0, 1, groups[g]->nr);
+		seccomp_program_emit(bpf, groups[g]->body[0].code,
+		    0, 0, groups[g]->body[0].k);
+	}
+
+	nfix = 0;
+	seccomp_program_tree(bpf, groups, 0, ngroups, fixups, &nfix);
+
+	for (g = 0; g < ngroups; g++) {
+		starts[g] = bpf->len;
+		if (SECCOMP_GROUP_RETURNS(groups, g))
+			continue;
+
+		for (i = 0; &groups[g][i] != groups[g + 1]; i++) {
+			for (j = 0; j < groups[g][i].len; j++) {
+				seccomp_program_emit(bpf,
+				    groups[g][i].body[j].code,
+				    groups[g][i].body[j].jt,
+				    groups[g][i].body[j].jf,
+				    groups[g][i].body[j].k);
+			}
+		}
+
+		seccomp_program_emit(bpf, filter_epilogue[0].code,
+		    0, 0, filter_epilogue[0].k);
+	}
+
+	for (i = 0; i < nfix; i++) {
+		bpf->sf[fixups[i].at].k =
+		    starts[fixups[i].group] - (fixups[i].at + 1);
+	}
+
+	free(starts);
+	free(fixups);
+	free(groups);
+}
+
+/*
+ * Emit the search over groups[lo, hi). Small ranges compare each number,
+ * larger ones split on the number in the middle. Conditional jumps skip
+ * at most one instruction, longer ones go through BPF_JA which takes a
+ * 32-bit offset.
+ */
+static void
+seccomp_program_tree(struct program *bpf, struct rule **groups, size_t lo,
+    size_t hi, struct fixup *fixups, size_t *nfix)
+{
+	size_t		g, mid, right;
+
+	if (hi - lo <= SECCOMP_LEAF_RULES) {
+		for (g = lo; g < hi; g++) {
+			seccomp_program_emit(bpf, BPF_JMP + BPF_JEQ + BPF_K,
+			    0, 1, groups[g]->nr);
+
+			/* A group that is a single return goes inline. */
+			if (SECCOMP_GROUP_RETURNS(groups, g)) {
+				seccomp_program_emit(bpf,
+				    groups[g]->body[0].code, 0, 0,
+				    groups[g]->body[0].k);
+				continue;
+			}
+
+			fixups[*nfix].group = g;
+			fixups[*nfix].at =
+			    seccomp_program_emit(bpf, BPF_JMP + BPF_JA, 0, 0, 0);
+			(*nfix)++;
+		}
+
+		seccomp_program_emit(bpf, filter_epilogue[0].code,
+		    0, 0, filter_epilogue[0].k);
+		return;
+	}
+
+	mid = lo + ((hi - lo) / 2);
+
+	seccomp_program_emit(bpf, BPF_JMP + BPF_JGE + BPF_K,
+	    0, 1, groups[mid]->nr);
+	right = seccomp_program_emit(bpf, BPF_JMP + BPF_JA, 0, 0, 0);
+
+	seccomp_program_tree(bpf, groups, lo, mid, fixups, nfix);
+	bpf->sf[right].k = bpf->len - (right + 1);
+	seccomp_program_tree(bpf, groups, mid, hi, fixups, nfix);
+}
+
+static size_t
+seccomp_program_emit(struct program *bpf, u_int16_t code, u_int8_t jt,
+    u_int8_t jf, u_int32_t k)
+{
+	struct sock_filter	*sf;
+
+	if (bpf->len == bpf->size) {
+		bpf->size = MAX(256, bpf->size * 2);
+		if ((sf = realloc(bpf->sf, bpf->size * sizeof(*sf))) == NULL)
+			fatalx("realloc");
+		bpf->sf = sf;
+	}
+
+	bpf->sf[bpf->len].code = code;
+	bpf->sf[bpf->len].jt = jt;
+	bpf->sf[bpf->len].jf = jf;
+	bpf->sf[bpf->len].k = k;
+
+	return (bpf->len++);
+}
+
 static void
 seccomp_register_violation(pid_t pid)
 {
@@ -14,10 +14,32 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Background tasks run on a fixed pool of threads per worker.
+ *
+ * kore_task_run() queues a task on one of the threads its deques, one
+ * per priority, in a round-robin fashion. A thread runs the oldest
+ * task of the highest priority in its own deque and steals the newest
+ * one from another thread when it has nothing left to do.
+ *
+ * Channels are lock free single producer, single consumer rings. The
+ * other side is only woken up through a condition variable if it is
+ * actually waiting on the ring. The event loop empties a task its out
+ * ring into a buffer whenever it is told about it, so a task is never
+ * stuck on a full ring because its data is only read once it finished. A task that writes data or finishes
+ * pushes itself on a lock free list and pokes a single eventfd (a pipe
+ * on other platforms) so the event loop picks up all tasks with news
+ * in one go.
+ */
+
 #include <sys/param.h>
 #include <sys/queue.h>
-#include <sys/socket.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,41 +53,91 @@
 
 static struct sock_filter filter_task[] = {
 	KORE_SYSCALL_ALLOW(clone),
-	KORE_SYSCALL_ALLOW(socketpair),
+#if defined(SYS_clone3)
+	KORE_SYSCALL_ALLOW(clone3),
+#endif
+	KORE_SYSCALL_ALLOW(eventfd2),
 	KORE_SYSCALL_ALLOW(set_robust_list),
+#if defined(SYS_rseq)
+	KORE_SYSCALL_ALLOW(rseq),
+#endif
 };
 #endif
 
+#define TASK_EVENT_DATA		0x01
+#define TASK_EVENT_DONE		0x02
+
 static u_int8_t				threads;
-static TAILQ_HEAD(, kore_task_thread)	task_threads;
+static u_int32_t			next_thread;
+static struct kore_task_thread		*pool = NULL;
+static pthread_t			task_main;
+static int				notify_fd[2];
+static struct kore_task *volatile	notify_list = NULL;
+static struct kore_event		notify_evt;
+
+static pthread_mutex_t			pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t			pool_cond = PTHREAD_COND_INITIALIZER;
+static volatile u_int32_t		pool_idle = 0;
+static volatile u_int32_t		pool_queued = 0;
 
 u_int16_t	kore_task_threads = KORE_TASK_THREADS;
+u_int32_t	kore_task_spill_max = KORE_TASK_SPILL_MAX;
 
 static void	*task_thread(void *);
-static void	task_channel_read(int, void *, u_int32_t);
-static void	task_channel_write(int, void *, u_int32_t);
-static void	task_thread_spawn(struct kore_task_thread **);
-
-#define THREAD_FD_ASSIGN(t, f, i, o)				\
-	do {							\
-		if (pthread_self() == t) {			\
-			f = i;					\
-		} else {					\
-			f = o;					\
-		}						\
-	} while (0);
+static void	task_pool_start(void);
+static void	task_notified(void *, int);
+static void	task_notify(struct kore_task *, u_int32_t);
+static void	task_wake(struct kore_task *);
+static struct kore_task	*task_dequeue(struct kore_task_thread *);
+static struct kore_task	*task_take(struct kore_task_thread *, int, int);
+static void	task_channel_wait(struct kore_task *,
+		    struct kore_task_channel *);
+static void	task_channel_spill(struct kore_task *);
+static void	task_spill_read(struct kore_task *, void *, u_int32_t);
+static void	task_channel_read(struct kore_task *,
+		    struct kore_task_channel *, void *, u_int32_t);
+static void	task_channel_write(struct kore_task *,
+		    struct kore_task_channel *, const void *, u_int32_t);
 
 void
 kore_task_init(void)
 {
 	threads = 0;
-	TAILQ_INIT(&task_threads);
+	next_thread = 0;
+	task_main = pthread_self();
+
+#if defined(__linux__)
+	if ((notify_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+		fatal("kore_task_init: eventfd: %s", errno_s);
+	notify_fd[1] = notify_fd[0];
+#else
+	if (pipe(notify_fd) == -1)
+		fatal("kore_task_init: pipe: %s", errno_s);
+	if (!kore_connection_nonblock(notify_fd[0], 0) ||
+	    !kore_connection_nonblock(notify_fd[1], 0))
+		fatal("kore_task_init: failed to make pipe non-blocking");
+	(void)fcntl(notify_fd[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(notify_fd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+	notify_evt.flags = 0;
+	notify_evt.type = KORE_TYPE_TASK;
+	notify_evt.handle = task_notified;
+	kore_platform_schedule_read(notify_fd[0], &notify_evt);
 
 #if defined(__linux__)
 	kore_seccomp_filter("task", filter_task, KORE_FILTER_LEN(filter_task));
 #endif
 }
 
+void
+kore_task_pool_stats(u_int32_t *nthreads, u_int32_t *idle, u_int32_t *queued)
+{
+	*nthreads = threads;
+	*idle = pool_idle;
+	*queued = pool_queued;
+}
+
 void
 kore_task_create(struct kore_task *t, int (*entry)(struct kore_task *))
 {
@@ -73,15 +145,25 @@ kore_task_create(struct kore_task *t, int (*entry)(struct kore_task *))
 #if !defined(KORE_NO_HTTP)
 	t->req = NULL;
 #endif
-	t->evt.type = KORE_TYPE_TASK;
-	t->evt.handle = kore_task_handle;
 
+	t->done = 0;
+	t->events = 0;
+	t->next = NULL;
+	t->spill = NULL;
+	t->spill_off = 0;
+	t->sleepers = 0;
 	t->entry = entry;
+	t->priority = KORE_TASK_PRIO_NORMAL;
 	t->state = KORE_TASK_STATE_CREATED;
-	pthread_rwlock_init(&(t->lock), NULL);
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, t->fds) == -1)
-		fatal("kore_task_create: socketpair() %s", errno_s);
+	t->in = kore_malloc(sizeof(*t->in));
+	t->out = kore_malloc(sizeof(*t->out));
+	t->in->head = t->in->tail = 0;
+	t->out->head = t->out->tail = 0;
+
+	pthread_rwlock_init(&(t->lock), NULL);
+	pthread_mutex_init(&(t->wlock), NULL);
+	pthread_cond_init(&(t->wcond), NULL);
 }
 
 void
@@ -89,24 +171,32 @@ kore_task_run(struct kore_task *t)
 {
 	struct kore_task_thread		*tt;
 
-	kore_platform_schedule_read(t->fds[0], t);
-	if (threads < kore_task_threads) {
-		/* task_thread_spawn() will lock tt->lock for us. */
-		task_thread_spawn(&tt);
-	} else {
-		/* Cycle task around. */
-		if ((tt = TAILQ_FIRST(&task_threads)) == NULL)
-			fatal("no available tasks threads?");
-		pthread_mutex_lock(&(tt->lock));
-		TAILQ_REMOVE(&task_threads, tt, list);
-		TAILQ_INSERT_TAIL(&task_threads, tt, list);
-	}
+	if (pool == NULL)
+		task_pool_start();
 
-	t->thread = tt;
-	TAILQ_INSERT_TAIL(&(tt->tasks), t, list);
+	tt = &pool[next_thread++ % threads];
 
+	pthread_mutex_lock(&(tt->lock));
+	TAILQ_INSERT_TAIL(&(tt->tasks[t->priority]), t, list);
+	__sync_fetch_and_add(&tt->queued, 1);
 	pthread_mutex_unlock(&(tt->lock));
-	pthread_cond_signal(&(tt->cond));
+
+	__sync_fetch_and_add(&pool_queued, 1);
+
+	if (pool_idle > 0) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+void
+kore_task_set_priority(struct kore_task *t, int priority)
+{
+	if (priority < KORE_TASK_PRIO_HIGH || priority >= KORE_TASK_PRIO_MAX)
+		fatal("kore_task_set_priority: bad priority %d", priority);
+
+	t->priority = priority;
 }
 
 #if !defined(KORE_NO_HTTP)
@@ -147,19 +237,17 @@ kore_task_destroy(struct kore_task *t)
 	}
 #endif
 
-	pthread_rwlock_wrlock(&(t->lock));
+	kore_free(t->in);
+	kore_free(t->out);
+	t->in = t->out = NULL;
 
-	if (t->fds[0] != -1) {
-		(void)close(t->fds[0]);
-		t->fds[0] = -1;
+	if (t->spill != NULL) {
+		kore_buf_free(t->spill);
+		t->spill = NULL;
 	}
 
-	if (t->fds[1] != -1) {
-		(void)close(t->fds[1]);
-		t->fds[1] = -1;
-	}
-
-	pthread_rwlock_unlock(&(t->lock));
+	pthread_cond_destroy(&(t->wcond));
+	pthread_mutex_destroy(&(t->wlock));
 	pthread_rwlock_destroy(&(t->lock));
 }
 
@@ -169,49 +257,75 @@ kore_task_finished(struct kore_task *t)
 	return ((kore_task_state(t) == KORE_TASK_STATE_FINISHED));
 }
 
+/*
+ * Called from the task thread once the task its entry point returned.
+ * The event loop may free the task as soon as it sees TASK_EVENT_DONE
+ * so it must not be touched after task_notify().
+ */
 void
 kore_task_finish(struct kore_task *t)
 {
 	kore_debug("kore_task_finished: %p (%d)", t, t->result);
-	pthread_rwlock_wrlock(&(t->lock));
 
-	if (t->fds[1] != -1) {
-		(void)close(t->fds[1]);
-		t->fds[1] = -1;
-	}
-
-	pthread_rwlock_unlock(&(t->lock));
+	t->done = 1;
+	task_wake(t);
+	task_notify(t, TASK_EVENT_DONE);
 }
 
 void
 kore_task_channel_write(struct kore_task *t, void *data, u_int32_t len)
 {
-	int		fd;
+	struct kore_task_channel	*ch;
 
 	kore_debug("kore_task_channel_write: %p <- %p (%ld)", t, data, len);
 
-	THREAD_FD_ASSIGN(t->thread->tid, fd, t->fds[1], t->fds[0]);
-	task_channel_write(fd, &len, sizeof(len));
-	task_channel_write(fd, data, len);
+	if (pthread_equal(pthread_self(), task_main))
+		ch = t->in;
+	else
+		ch = t->out;
+
+	task_channel_write(t, ch, &len, sizeof(len));
+	task_channel_write(t, ch, data, len);
 }
 
 u_int32_t
 kore_task_channel_read(struct kore_task *t, void *out, u_int32_t len)
 {
-	int		fd;
-	u_int32_t	dlen, bytes;
+	int			loop;
+	u_int32_t		dlen, bytes;
+	u_int8_t		discard[256];
 
 	kore_debug("kore_task_channel_read: %p -> %p (%ld)", t, out, len);
 
-	THREAD_FD_ASSIGN(t->thread->tid, fd, t->fds[1], t->fds[0]);
-	task_channel_read(fd, &dlen, sizeof(dlen));
+	loop = pthread_equal(pthread_self(), task_main);
+
+	if (loop) {
+		task_spill_read(t, &dlen, sizeof(dlen));
+	} else {
+		task_channel_read(t, t->in, &dlen, sizeof(dlen));
+	}
 
 	if (dlen > len)
 		bytes = len;
 	else
 		bytes = dlen;
 
-	task_channel_read(fd, out, bytes);
+	if (loop) {
+		task_spill_read(t, out, bytes);
+	} else {
+		task_channel_read(t, t->in, out, bytes);
+	}
+
+	/* Drop what did not fit so the next read starts on a message. */
+	while (bytes < dlen) {
+		len = MIN(sizeof(discard), dlen - bytes);
+		if (loop) {
+			task_spill_read(t, discard, len);
+		} else {
+			task_channel_read(t, t->in, discard, len);
+		}
+		bytes += len;
+	}
 
 	return (dlen);
 }
@@ -225,11 +339,10 @@ kore_task_handle(void *arg, int finished)
 
 #if !defined(KORE_NO_HTTP)
 	if (t->req != NULL)
-		http_request_wakeup(t->req);
+		http_request_wakeup_from(t->req, HTTP_WAKEUP_TASK);
 #endif
 
 	if (finished) {
-		kore_platform_disable_read(t->fds[0]);
 		kore_task_set_state(t, KORE_TASK_STATE_FINISHED);
 #if !defined(KORE_NO_HTTP)
 		if (t->req != NULL) {
@@ -284,64 +397,366 @@ kore_task_set_result(struct kore_task *t, int result)
 }
 
 static void
-task_channel_write(int fd, void *data, u_int32_t len)
+task_channel_write(struct kore_task *t, struct kore_task_channel *ch,
+    const void *data, u_int32_t len)
 {
-	ssize_t		r;
-	u_int8_t	*d;
-	u_int32_t	offset;
+	const u_int8_t	*d;
+	u_int32_t	head, space, off, n;
 
 	d = data;
-	offset = 0;
-	while (offset != len) {
-		r = send(fd, d + offset, len - offset, 0);
-		if (r == -1 && errno == EINTR)
+
+	while (len > 0) {
+		head = ch->head;
+		space = KORE_TASK_CHANNEL_SIZE - (head - ch->tail);
+
+		if (space == 0) {
+			pthread_mutex_lock(&(t->wlock));
+			__sync_fetch_and_add(&t->sleepers, 1);
+			while (KORE_TASK_CHANNEL_SIZE - (head - ch->tail) == 0)
+				pthread_cond_wait(&(t->wcond), &(t->wlock));
+			__sync_fetch_and_sub(&t->sleepers, 1);
+			pthread_mutex_unlock(&(t->wlock));
 			continue;
-		if (r == -1)
-			fatal("task_channel_write: %s", errno_s);
-		offset += r;
+		}
+
+		n = MIN(space, len);
+		off = head & (KORE_TASK_CHANNEL_SIZE - 1);
+
+		if (off + n > KORE_TASK_CHANNEL_SIZE) {
+			memcpy(&ch->data[off], d, KORE_TASK_CHANNEL_SIZE - off);
+			memcpy(ch->data, d + (KORE_TASK_CHANNEL_SIZE - off),
+			    n - (KORE_TASK_CHANNEL_SIZE - off));
+		} else {
+			memcpy(&ch->data[off], d, n);
+		}
+
+		__sync_synchronize();
+		ch->head = head + n;
+		__sync_synchronize();
+
+		d += n;
+		len -= n;
+
+		task_wake(t);
+		if (ch == t->out)
+			task_notify(t, TASK_EVENT_DATA);
 	}
 }
 
 static void
-task_channel_read(int fd, void *out, u_int32_t len)
+task_channel_read(struct kore_task *t, struct kore_task_channel *ch,
+    void *out, u_int32_t len)
 {
-	ssize_t		r;
 	u_int8_t	*d;
-	u_int32_t	offset;
+	u_int32_t	tail, avail, off, n;
 
 	d = out;
-	offset = 0;
-	while (offset != len) {
-		r = read(fd, d + offset, len - offset);
-		if (r == -1 && errno == EINTR)
+
+	while (len > 0) {
+		tail = ch->tail;
+		avail = ch->head - tail;
+
+		if (avail == 0) {
+			task_channel_wait(t, ch);
 			continue;
-		if (r == -1)
-			fatal("task_channel_read: %s", errno_s);
-		if (r == 0)
+		}
+
+		__sync_synchronize();
+
+		n = MIN(avail, len);
+		off = tail & (KORE_TASK_CHANNEL_SIZE - 1);
+
+		if (off + n > KORE_TASK_CHANNEL_SIZE) {
+			memcpy(d, &ch->data[off], KORE_TASK_CHANNEL_SIZE - off);
+			memcpy(d + (KORE_TASK_CHANNEL_SIZE - off), ch->data,
+			    n - (KORE_TASK_CHANNEL_SIZE - off));
+		} else {
+			memcpy(d, &ch->data[off], n);
+		}
+
+		__sync_synchronize();
+		ch->tail = tail + n;
+		__sync_synchronize();
+
+		d += n;
+		len -= n;
+
+		task_wake(t);
+	}
+}
+
+/*
+ * Event loop side of reading from a task, first whatever was spilled
+ * before, otherwise straight out of the ring.
+ */
+static void
+task_spill_read(struct kore_task *t, void *out, u_int32_t len)
+{
+	u_int8_t	*d;
+	size_t		avail, n;
+
+	d = out;
+
+	while (len > 0) {
+		task_channel_spill(t);
+
+		if (t->spill != NULL)
+			avail = t->spill->offset - t->spill_off;
+		else
+			avail = 0;
+
+		if (avail == 0) {
+			task_channel_wait(t, t->out);
+			continue;
+		}
+
+		n = MIN(avail, len);
+		memcpy(d, t->spill->data + t->spill_off, n);
+
+		t->spill_off += n;
+		if (t->spill_off == t->spill->offset) {
+			t->spill_off = 0;
+			kore_buf_reset(t->spill);
+		}
+
+		d += n;
+		len -= n;
+	}
+
+	/* Make room in the ring for a task blocked on it. */
+	task_channel_spill(t);
+}
+
+/*
+ * Move what is in the out ring of a task into its spill buffer, up to
+ * kore_task_spill_max unread bytes. Past that the task blocks on its
+ * full ring until the event loop reads.
+ */
+static void
+task_channel_spill(struct kore_task *t)
+{
+	struct kore_task_channel	*ch;
+	size_t				unread;
+	u_int32_t			tail, avail, off;
+
+	ch = t->out;
+	tail = ch->tail;
+
+	if ((avail = ch->head - tail) == 0)
+		return;
+
+	__sync_synchronize();
+
+	if (t->spill == NULL)
+		t->spill = kore_buf_alloc(KORE_TASK_CHANNEL_SIZE);
+
+	unread = t->spill->offset - t->spill_off;
+	if (unread >= kore_task_spill_max)
+		return;
+
+	avail = MIN(avail, kore_task_spill_max - unread);
+
+	if (t->spill_off > 0) {
+		memmove(t->spill->data, t->spill->data + t->spill_off, unread);
+		t->spill->offset = unread;
+		t->spill_off = 0;
+	}
+
+	off = tail & (KORE_TASK_CHANNEL_SIZE - 1);
+
+	if (off + avail > KORE_TASK_CHANNEL_SIZE) {
+		kore_buf_append(t->spill, &ch->data[off],
+		    KORE_TASK_CHANNEL_SIZE - off);
+		kore_buf_append(t->spill, ch->data,
+		    avail - (KORE_TASK_CHANNEL_SIZE - off));
+	} else {
+		kore_buf_append(t->spill, &ch->data[off], avail);
+	}
+
+	__sync_synchronize();
+	ch->tail = tail + avail;
+	__sync_synchronize();
+
+	task_wake(t);
+}
+
+/*
+ * Block until there is data in the given ring. Only the event loop can
+ * run into a task that is gone while waiting on it.
+ */
+static void
+task_channel_wait(struct kore_task *t, struct kore_task_channel *ch)
+{
+	u_int32_t	tail;
+
+	tail = ch->tail;
+
+	pthread_mutex_lock(&(t->wlock));
+	__sync_fetch_and_add(&t->sleepers, 1);
+
+	while (ch->head == tail) {
+		if (ch == t->out && t->done)
 			fatal("task_channel_read: unexpected eof");
+		pthread_cond_wait(&(t->wcond), &(t->wlock));
+	}
+
+	__sync_fetch_and_sub(&t->sleepers, 1);
+	pthread_mutex_unlock(&(t->wlock));
+}
+
+/*
+ * Wake up the other side of a channel if it is blocked on it. The
+ * sleeper announces itself before it checks the ring again under the
+ * lock so either it sees our update or we see it and signal.
+ */
+static void
+task_wake(struct kore_task *t)
+{
+	if (t->sleepers == 0)
+		return;
+
+	pthread_mutex_lock(&(t->wlock));
+	pthread_cond_broadcast(&(t->wcond));
+	pthread_mutex_unlock(&(t->wlock));
+}
+
+/*
+ * Tell the event loop something happened on the task. Only the first
+ * event since the event loop last looked queues the task and only the
+ * first task on an empty list pokes the notification fd.
+ */
+static void
+task_notify(struct kore_task *t, u_int32_t event)
+{
+	struct kore_task	*head;
+	u_int64_t		one;
 
-		offset += r;
+	if (__sync_fetch_and_or(&t->events, event) != 0)
+		return;
+
+	do {
+		head = notify_list;
+		t->next = head;
+	} while (!__sync_bool_compare_and_swap(&notify_list, head, t));
+
+	if (head != NULL)
+		return;
+
+	one = 1;
+#if defined(__linux__)
+	if (write(notify_fd[1], &one, sizeof(one)) == -1 && errno != EAGAIN)
+#else
+	if (write(notify_fd[1], &one, 1) == -1 && errno != EAGAIN)
+#endif
+		fatal("task_notify: write: %s", errno_s);
+}
+
+static void
+task_notified(void *arg, int error)
+{
+	u_int32_t		events;
+	u_int8_t		buf[64];
+	struct kore_task	*t, *next, *list;
+
+	if (error)
+		fatal("task_notified: error on notification fd");
+
+	while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+		;
+
+	list = __sync_lock_test_and_set(&notify_list, NULL);
+
+	/* Tasks were pushed in front, handle them in the order they came. */
+	next = NULL;
+	while (list != NULL) {
+		t = list->next;
+		list->next = next;
+		next = list;
+		list = t;
+	}
+
+	for (t = next; t != NULL; t = next) {
+		next = t->next;
+		events = __sync_lock_test_and_set(&t->events, 0);
+		task_channel_spill(t);
+		kore_task_handle(t, events & TASK_EVENT_DONE);
 	}
 }
 
 static void
-task_thread_spawn(struct kore_task_thread **out)
+task_pool_start(void)
 {
+	int				i;
 	struct kore_task_thread		*tt;
 
-	tt = kore_malloc(sizeof(*tt));
-	tt->idx = threads++;
+	if (kore_task_threads == 0)
+		fatal("no task threads configured");
+
+	threads = kore_task_threads;
+	pool = kore_calloc(threads, sizeof(*pool));
+
+	for (tt = pool; tt < pool + threads; tt++) {
+		tt->idx = tt - pool;
+		tt->queued = 0;
+		pthread_mutex_init(&(tt->lock), NULL);
+		for (i = 0; i < KORE_TASK_PRIO_MAX; i++)
+			TAILQ_INIT(&(tt->tasks[i]));
+	}
+
+	for (tt = pool; tt < pool + threads; tt++) {
+		if (pthread_create(&(tt->tid), NULL, task_thread, tt) != 0)
+			fatal("pthread_create: %s", errno_s);
+	}
+}
+
+/*
+ * Pick the next task for tt, the highest priority first. Within a
+ * priority tt its own deque comes first, after that the others are
+ * robbed starting with the thread next to tt.
+ */
+static struct kore_task *
+task_dequeue(struct kore_task_thread *tt)
+{
+	int			prio;
+	u_int8_t		i;
+	struct kore_task	*t;
+
+	for (prio = 0; prio < KORE_TASK_PRIO_MAX; prio++) {
+		for (i = 0; i < threads; i++) {
+			t = task_take(&pool[(tt->idx + i) % threads],
+			    prio, i != 0);
+			if (t != NULL)
+				return (t);
+		}
+	}
+
+	return (NULL);
+}
+
+static struct kore_task *
+task_take(struct kore_task_thread *tt, int prio, int steal)
+{
+	struct kore_task	*t;
+
+	if (tt->queued == 0)
+		return (NULL);
 
-	TAILQ_INIT(&(tt->tasks));
-	pthread_cond_init(&(tt->cond), NULL);
-	pthread_mutex_init(&(tt->lock), NULL);
 	pthread_mutex_lock(&(tt->lock));
-	TAILQ_INSERT_TAIL(&task_threads, tt, list);
 
-	if (pthread_create(&(tt->tid), NULL, task_thread, tt) != 0)
-		fatal("pthread_create: %s", errno_s);
+	if (steal)
+		t = TAILQ_LAST(&(tt->tasks[prio]), kore_task_list);
+	else
+		t = TAILQ_FIRST(&(tt->tasks[prio]));
+
+	if (t != NULL) {
+		TAILQ_REMOVE(&(tt->tasks[prio]), t, list);
+		__sync_fetch_and_sub(&tt->queued, 1);
+		__sync_fetch_and_sub(&pool_queued, 1);
+	}
+
+	pthread_mutex_unlock(&(tt->lock));
 
-	*out = tt;
+	return (t);
 }
 
 static void *
@@ -352,25 +767,24 @@ task_thread(void *arg)
 
 	kore_debug("task_thread: #%d starting", tt->idx);
 
-	pthread_mutex_lock(&(tt->lock));
-
 	for (;;) {
-		if (TAILQ_EMPTY(&(tt->tasks)))
-			pthread_cond_wait(&(tt->cond), &(tt->lock));
-
-		kore_debug("task_thread#%d: woke up", tt->idx);
-
-		t = TAILQ_FIRST(&(tt->tasks));
-		TAILQ_REMOVE(&(tt->tasks), t, list);
-		pthread_mutex_unlock(&(tt->lock));
+		if ((t = task_dequeue(tt)) == NULL) {
+			pthread_mutex_lock(&pool_lock);
+			__sync_fetch_and_add(&pool_idle, 1);
+			while (pool_queued == 0)
+				pthread_cond_wait(&pool_cond, &pool_lock);
+			__sync_fetch_and_sub(&pool_idle, 1);
+			pthread_mutex_unlock(&pool_lock);
+			continue;
+		}
 
 		kore_debug("task_thread#%d: executing %p", tt->idx, t);
 
+		KORE_PROBE2(task_start, t, tt->idx);
 		kore_task_set_state(t, KORE_TASK_STATE_RUNNING);
 		kore_task_set_result(t, t->entry(t));
+		KORE_PROBE2(task_finish, t, t->result);
 		kore_task_finish(t);
-
-		pthread_mutex_lock(&(tt->lock));
 	}
 
 	pthread_exit(NULL);
@@ -14,25 +14,73 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Timers are kept in a hierarchical timing wheel with a resolution of
+ * one millisecond. Each level has TIMER_SLOTS slots, a slot on level n
+ * covers TIMER_SLOTS^n milliseconds. Timers are placed on the lowest
+ * level on which their deadline and the wheel clock share all higher
+ * bits and are cascaded down a level once the clock reaches their slot.
+ *
+ * Deadlines too far out for the top level sit on an overflow list that
+ * is redistributed each time the top level wraps around.
+ *
+ * Adding, removing and expiring a timer are O(1), per level a bitmap
+ * of occupied slots lets us find the next deadline without walking.
+ */
+
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/queue.h>
 
 #include "kore.h"
 
-TAILQ_HEAD(timerlist, kore_timer)	kore_timers;
+#define TIMER_LEVELS		5
+#define TIMER_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_BITS)
+#define TIMER_MASK		(TIMER_SLOTS - 1)
+#define TIMER_OVERFLOW		TIMER_LEVELS
+
+#define TIMER_SHIFT(l)		((l) * TIMER_BITS)
+#define TIMER_SPAN(l)		((u_int64_t)1 << TIMER_SHIFT(l))
+
+#define TIMER_STATE_QUEUED	1
+#define TIMER_STATE_RUNNING	2
+#define TIMER_STATE_REMOVED	3
+
+TAILQ_HEAD(timerlist, kore_timer);
+
+static void	timer_place(struct kore_timer *, u_int64_t);
+static void	timer_unlink(struct kore_timer *);
+static void	timer_cascade(struct timerlist *);
+
+static u_int64_t		timer_clock = 0;
+static u_int32_t		timer_count = 0;
+static u_int64_t		timer_bitmap[TIMER_LEVELS];
+static struct timerlist		timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static struct timerlist		timer_overflow;
 
 void
 kore_timer_init(void)
 {
-	TAILQ_INIT(&kore_timers);
+	int		l, s;
+
+	for (l = 0; l < TIMER_LEVELS; l++) {
+		timer_bitmap[l] = 0;
+		for (s = 0; s < TIMER_SLOTS; s++)
+			TAILQ_INIT(&timer_wheel[l][s]);
+	}
+
+	TAILQ_INIT(&timer_overflow);
+
+	timer_count = 0;
+	timer_clock = kore_time_ms();
 }
 
 struct kore_timer *
 kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
     void *arg, int flags)
 {
-	struct kore_timer	*timer, *t;
+	struct kore_timer	*timer;
 
 	timer = kore_malloc(sizeof(*timer));
 
@@ -42,69 +90,193 @@ kore_timer_add(void (*cb)(void *, u_int64_t), u_int64_t interval,
 	timer->interval = interval;
 	timer->nextrun = kore_time_ms() + timer->interval;
 
-	TAILQ_FOREACH(t, &kore_timers, list) {
-		if (t->nextrun > timer->nextrun) {
-			TAILQ_INSERT_BEFORE(t, timer, list);
-			return (timer);
-		}
-	}
+	timer_place(timer, timer->nextrun);
 
-	TAILQ_INSERT_TAIL(&kore_timers, timer, list);
 	return (timer);
 }
 
 void
 kore_timer_remove(struct kore_timer *timer)
 {
-	TAILQ_REMOVE(&kore_timers, timer, list);
+	/* Freed by kore_timer_run() once its callback returns. */
+	if (timer->state == TIMER_STATE_RUNNING) {
+		timer->state = TIMER_STATE_REMOVED;
+		return;
+	}
+
+	timer_unlink(timer);
 	kore_free(timer);
 }
 
 u_int64_t
 kore_timer_next_run(u_int64_t now)
 {
-	struct kore_timer	*timer;
+	int			l;
+	u_int64_t		bits, base, when;
+	u_int32_t		idx;
+
+	if (timer_count == 0)
+		return (KORE_WAIT_INFINITE);
+
+	when = 0;
+
+	for (l = 0; l < TIMER_LEVELS; l++) {
+		idx = (timer_clock >> TIMER_SHIFT(l)) & TIMER_MASK;
+		bits = timer_bitmap[l] & (~(u_int64_t)0 << idx);
 
-	if ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer->nextrun > now)
-			return (timer->nextrun - now);
-		return (0);
+		if (bits == 0)
+			continue;
+
+		/* The start of the slot, when it expires or cascades. */
+		base = timer_clock & ~(TIMER_SPAN(l + 1) - 1);
+		when = base + ((u_int64_t)__builtin_ctzll(bits) *
+		    TIMER_SPAN(l));
+		break;
+	}
+
+	if (l == TIMER_LEVELS) {
+		when = (timer_clock | (TIMER_SPAN(TIMER_LEVELS) - 1)) + 1;
 	}
 
-	return (KORE_WAIT_INFINITE);
+	if (when > now)
+		return (when - now);
+
+	return (0);
 }
 
 void
 kore_timer_run(u_int64_t now)
 {
-	struct kore_timer	*timer, *t, *prev;
-
-	prev = NULL;
+	int			l;
+	struct timerlist	*head;
+	struct kore_timer	*timer;
+	u_int64_t		bits, next;
+	u_int32_t		idx;
 
-	while ((timer = TAILQ_FIRST(&kore_timers)) != NULL) {
-		if (timer == prev)
+	while (timer_clock <= now) {
+		if (timer_count == 0) {
+			timer_clock = now + 1;
 			break;
+		}
 
-		if (timer->nextrun > now)
-			break;
+		if ((timer_clock & TIMER_MASK) == 0) {
+			for (l = 1; l < TIMER_LEVELS; l++) {
+				if (timer_clock & (TIMER_SPAN(l) - 1))
+					break;
+				idx = (timer_clock >> TIMER_SHIFT(l)) &
+				    TIMER_MASK;
+				timer_cascade(&timer_wheel[l][idx]);
+				timer_bitmap[l] &= ~((u_int64_t)1 << idx);
+			}
 
-		TAILQ_REMOVE(&kore_timers, timer, list);
-		timer->cb(timer->arg, now);
+			if (l == TIMER_LEVELS)
+				timer_cascade(&timer_overflow);
+		}
 
-		if (timer->flags & KORE_TIMER_ONESHOT) {
-			kore_free(timer);
-		} else {
-			prev = timer;
-			timer->nextrun = now + timer->interval;
-			TAILQ_FOREACH(t, &kore_timers, list) {
-				if (t->nextrun > timer->nextrun) {
-					TAILQ_INSERT_BEFORE(t, timer, list);
-					break;
-				}
+		idx = timer_clock & TIMER_MASK;
+		head = &timer_wheel[0][idx];
+
+		/* Timers (re)added by the callbacks land past this slot. */
+		timer_clock++;
+
+		while ((timer = TAILQ_FIRST(head)) != NULL) {
+			timer_unlink(timer);
+
+			timer->state = TIMER_STATE_RUNNING;
+			timer->cb(timer->arg, now);
+
+			if (timer->state == TIMER_STATE_REMOVED ||
+			    (timer->flags & KORE_TIMER_ONESHOT)) {
+				kore_free(timer);
+			} else {
+				timer->nextrun = now + timer->interval;
+				timer_place(timer,
+				    MAX(timer->nextrun, now + 1));
 			}
+		}
 
-			if (t == NULL)
-				TAILQ_INSERT_TAIL(&kore_timers, timer, list);
+		if (timer_clock > now || (timer_clock & TIMER_MASK) == 0)
+			continue;
+
+		/* Skip ahead to the next occupied slot or level boundary. */
+		idx = timer_clock & TIMER_MASK;
+		bits = timer_bitmap[0] & (~(u_int64_t)0 << idx);
+
+		if (bits != 0) {
+			next = (timer_clock & ~(u_int64_t)TIMER_MASK) +
+			    __builtin_ctzll(bits);
+		} else {
+			next = (timer_clock | TIMER_MASK) + 1;
 		}
+
+		timer_clock = MIN(next, now + 1);
+	}
+}
+
+static void
+timer_place(struct kore_timer *timer, u_int64_t when)
+{
+	int			l;
+	struct timerlist	*head;
+
+	if (when < timer_clock)
+		when = timer_clock;
+
+	for (l = 0; l < TIMER_LEVELS; l++) {
+		if ((when >> TIMER_SHIFT(l + 1)) ==
+		    (timer_clock >> TIMER_SHIFT(l + 1)))
+			break;
+	}
+
+	if (l == TIMER_LEVELS) {
+		timer->level = TIMER_OVERFLOW;
+		timer->slot = 0;
+		head = &timer_overflow;
+	} else {
+		timer->level = l;
+		timer->slot = (when >> TIMER_SHIFT(l)) & TIMER_MASK;
+		head = &timer_wheel[l][timer->slot];
+		timer_bitmap[l] |= ((u_int64_t)1 << timer->slot);
+	}
+
+	timer->state = TIMER_STATE_QUEUED;
+	TAILQ_INSERT_TAIL(head, timer, list);
+
+	timer_count++;
+}
+
+static void
+timer_unlink(struct kore_timer *timer)
+{
+	struct timerlist	*head;
+
+	if (timer->level == TIMER_OVERFLOW) {
+		TAILQ_REMOVE(&timer_overflow, timer, list);
+	} else {
+		head = &timer_wheel[timer->level][timer->slot];
+		TAILQ_REMOVE(head, timer, list);
+
+		if (TAILQ_EMPTY(head)) {
+			timer_bitmap[timer->level] &=
+			    ~((u_int64_t)1 << timer->slot);
+		}
+	}
+
+	timer_count--;
+}
+
+static void
+timer_cascade(struct timerlist *head)
+{
+	struct timerlist	list;
+	struct kore_timer	*timer;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, head, list);
+
+	while ((timer = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, timer, list);
+		timer_count--;
+		timer_place(timer, timer->nextrun);
 	}
 }
@@ -0,0 +1,658 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Graceful upgrades.
+ *
+ * With graceful_upgrade enabled a SIGHUP to the parent no longer reloads
+ * modules in place. Instead the parent executes itself again (picking up
+ * a new binary, configuration and TLS domains) and hands the new master
+ * all of its listening sockets over a socketpair using SCM_RIGHTS.
+ *
+ * The new master claims the sockets that match its own bind directives,
+ * closes the rest and tells the old parent it is ready right before it
+ * forks its workers. The old parent then asks its workers to drain: they
+ * stop accepting, close their listeners and exit once their connections
+ * are gone or worker_drain_timeout expires, after which the old parent
+ * shuts down. Connections queued on the sockets are never dropped as both
+ * generations share them.
+ *
+ * If the new master fails before it is ready the old parent notices the
+ * socketpair closing and keeps serving. This is also how an attempt to
+ * switch socket_reuseport on or off is refused.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+
+#include "kore.h"
+
+#define UPGRADE_ENV		"KORE_UPGRADE_FD"
+#define UPGRADE_FD		3
+#define UPGRADE_FDS_MAX		65536
+#define UPGRADE_POLL		100
+#define UPGRADE_GRACE		2000
+
+#define UPGRADE_STATE_IDLE	0
+#define UPGRADE_STATE_PENDING	1
+#define UPGRADE_STATE_DRAINING	2
+#define UPGRADE_STATE_DONE	3
+
+struct upgrade_fd {
+	int				fd;
+	int32_t				idx;
+	int				claimed;
+	socklen_t			len;
+	struct sockaddr_storage		addr;
+};
+
+static int	upgrade_send(int);
+static int	upgrade_sendfd(int, int32_t, int);
+static int	upgrade_recvfd(int, int32_t *, int *);
+static int	upgrade_read(int, void *, size_t);
+static int	upgrade_addr_match(const struct sockaddr_storage *, socklen_t,
+		    const struct sockaddr_storage *, socklen_t);
+static void	upgrade_exec(int);
+static void	upgrade_abort(const char *);
+static void	upgrade_poll(void *, u_int64_t);
+static struct upgrade_fd	*upgrade_lookup(struct listener *, int32_t);
+
+int				kore_graceful_upgrade = 0;
+
+static char			**upgrade_argv = NULL;
+static char			*upgrade_cwd = NULL;
+static int			upgrade_state = UPGRADE_STATE_IDLE;
+static int			upgrade_fd = -1;
+static pid_t			upgrade_pid = -1;
+static u_int64_t		upgrade_deadline = 0;
+static struct kore_timer	*upgrade_timer = NULL;
+static struct upgrade_fd	*inherited = NULL;
+static u_int32_t		ninherited = 0;
+
+/*
+ * Keep our own copy of how we were started, getopt() may shuffle argv
+ * and kore_proctitle() overwrites it. Called before the memory subsystem
+ * is up so only use libc here.
+ */
+void
+kore_upgrade_save(int argc, char **argv)
+{
+	int		i;
+
+	if ((upgrade_argv = calloc(argc + 1, sizeof(char *))) == NULL)
+		fatal("calloc");
+
+	for (i = 0; i < argc; i++) {
+		if ((upgrade_argv[i] = strdup(argv[i])) == NULL)
+			fatal("strdup");
+	}
+
+	upgrade_argv[argc] = NULL;
+
+	if ((upgrade_cwd = getcwd(NULL, 0)) == NULL)
+		fatal("getcwd: %s", errno_s);
+}
+
+/*
+ * Called early in a new master, picks up the listening sockets the
+ * previous parent handed to us.
+ */
+void
+kore_upgrade_inherit(void)
+{
+	int			fd, err;
+	u_int32_t		i, count;
+	const char		*env;
+	struct upgrade_fd	*ufd;
+
+	if ((env = getenv(UPGRADE_ENV)) == NULL)
+		return;
+
+	fd = kore_strtonum(env, 10, 0, INT_MAX, &err);
+	if (err != KORE_RESULT_OK)
+		fatal("invalid %s '%s'", UPGRADE_ENV, env);
+
+	if (unsetenv(UPGRADE_ENV) == -1)
+		fatal("unsetenv: %s", errno_s);
+
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1)
+		fatal("fcntl: %s", errno_s);
+
+	if (!upgrade_read(fd, &count, sizeof(count)))
+		fatal("failed to read listener count from old parent");
+
+	if (count > UPGRADE_FDS_MAX)
+		fatal("old parent is handing over %u sockets?", count);
+
+	inherited = kore_calloc(count, sizeof(*inherited));
+
+	for (i = 0; i < count; i++) {
+		ufd = &inherited[i];
+
+		if (!upgrade_recvfd(fd, &ufd->idx, &ufd->fd))
+			fatal("failed to receive listener from old parent");
+
+		ninherited++;
+
+		if (fcntl(ufd->fd, F_SETFD, FD_CLOEXEC) == -1)
+			fatal("fcntl: %s", errno_s);
+
+		ufd->len = sizeof(ufd->addr);
+		if (getsockname(ufd->fd,
+		    (struct sockaddr *)&ufd->addr, &ufd->len) == -1)
+			fatal("getsockname: %s", errno_s);
+	}
+
+	upgrade_fd = fd;
+
+	if (!kore_quiet)
+		kore_log(LOG_NOTICE, "inherited %u listening sockets", count);
+}
+
+/*
+ * Called from kore_server_bind() and friends, if we inherited a socket
+ * for this address use it instead of binding a new one.
+ *
+ * Per-worker reuseport sockets are picked up by kore_upgrade_reuseport(),
+ * the listener keeps no socket of its own in that case.
+ */
+int
+kore_upgrade_listener(struct listener *l)
+{
+	struct upgrade_fd	*ufd;
+
+	if (upgrade_fd == -1)
+		return (KORE_RESULT_ERROR);
+
+	if ((ufd = upgrade_lookup(l, -1)) != NULL) {
+		ufd->claimed = 1;
+		close(l->fd);
+		l->fd = ufd->fd;
+		return (KORE_RESULT_OK);
+	}
+
+	if (upgrade_lookup(l, 0) != NULL) {
+		close(l->fd);
+		l->fd = -1;
+		return (KORE_RESULT_OK);
+	}
+
+	return (KORE_RESULT_ERROR);
+}
+
+/*
+ * Returns the inherited reuseport socket for the given worker index on
+ * this listener, or -1 if there is none.
+ */
+int
+kore_upgrade_reuseport(struct listener *l, u_int16_t idx)
+{
+	u_int32_t		i;
+	struct upgrade_fd	*ufd;
+
+	if (upgrade_fd == -1)
+		return (-1);
+
+	/* The shared socket was claimed by kore_upgrade_listener(). */
+	for (i = 0; i < ninherited; i++) {
+		ufd = &inherited[i];
+		if (ufd->idx == -1 && upgrade_addr_match(&ufd->addr,
+		    ufd->len, &l->addr, l->addrlen)) {
+			fatal("%s:%s: socket_reuseport can't be switched on "
+			    "by a graceful upgrade", l->host, l->port);
+		}
+	}
+
+	if ((ufd = upgrade_lookup(l, idx)) == NULL)
+		return (-1);
+
+	ufd->claimed = 1;
+
+	return (ufd->fd);
+}
+
+/*
+ * Called right before the workers are forked. Anything we did not
+ * claim is closed so no worker ends up holding on to it, then the old
+ * parent is told it can start draining.
+ */
+void
+kore_upgrade_finish(void)
+{
+	u_int32_t		i;
+	struct listener		*l;
+	struct kore_server	*srv;
+	struct upgrade_fd	*ufd;
+	u_int8_t		ready;
+
+	if (upgrade_fd == -1)
+		return;
+
+	/*
+	 * Dropping the per-worker sockets would reset the connections
+	 * queued on them, refuse and let the old parent keep serving.
+	 */
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->fd != -1 || l->rfds != NULL)
+				continue;
+			fatal("%s:%s: socket_reuseport can't be switched off "
+			    "by a graceful upgrade", l->host, l->port);
+		}
+	}
+
+	for (i = 0; i < ninherited; i++) {
+		ufd = &inherited[i];
+		if (ufd->claimed)
+			continue;
+
+		kore_log(LOG_NOTICE,
+		    "closing inherited socket %d, no longer configured",
+		    ufd->fd);
+		close(ufd->fd);
+	}
+
+	ready = 1;
+	if (write(upgrade_fd, &ready, sizeof(ready)) == -1)
+		kore_log(LOG_NOTICE, "failed to signal old parent: %s", errno_s);
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+
+	kore_free(inherited);
+	inherited = NULL;
+	ninherited = 0;
+}
+
+/*
+ * Start a new master from the parent, called on SIGHUP.
+ */
+void
+kore_upgrade_start(void)
+{
+	int		sv[2];
+
+	if (upgrade_state != UPGRADE_STATE_IDLE) {
+		kore_log(LOG_NOTICE, "upgrade already in progress, ignoring");
+		return;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		kore_log(LOG_ERR, "upgrade: socketpair: %s", errno_s);
+		return;
+	}
+
+	if ((upgrade_pid = fork()) == -1) {
+		kore_log(LOG_ERR, "upgrade: fork: %s", errno_s);
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+
+	if (upgrade_pid == 0) {
+		close(sv[0]);
+		upgrade_exec(sv[1]);
+		/* NOTREACHED */
+	}
+
+	close(sv[1]);
+
+	upgrade_fd = sv[0];
+	upgrade_state = UPGRADE_STATE_PENDING;
+
+	if (!upgrade_send(upgrade_fd)) {
+		upgrade_abort("failed to hand over listeners");
+		return;
+	}
+
+	if (!kore_connection_nonblock(upgrade_fd, 0)) {
+		upgrade_abort("failed to make handoff socket nonblocking");
+		return;
+	}
+
+	upgrade_timer = kore_timer_add(upgrade_poll, UPGRADE_POLL, NULL, 0);
+
+	if (!kore_quiet) {
+		kore_log(LOG_NOTICE, "upgrade: started new master (pid#%d)",
+		    upgrade_pid);
+	}
+}
+
+int
+kore_upgrade_draining(void)
+{
+	return (upgrade_state == UPGRADE_STATE_DRAINING ||
+	    upgrade_state == UPGRADE_STATE_DONE);
+}
+
+static void
+upgrade_exec(int fd)
+{
+	long		max;
+	int		i;
+	char		num[16];
+
+	if (fd != UPGRADE_FD) {
+		if (dup2(fd, UPGRADE_FD) == -1)
+			_exit(1);
+	}
+
+	/* Nothing but the handoff socket crosses over. */
+	if ((max = sysconf(_SC_OPEN_MAX)) == -1)
+		max = 1024;
+
+	for (i = UPGRADE_FD + 1; i < max; i++)
+		(void)close(i);
+
+	(void)snprintf(num, sizeof(num), "%d", UPGRADE_FD);
+
+	if (setenv(UPGRADE_ENV, num, 1) == -1)
+		_exit(1);
+
+	if (chdir(upgrade_cwd) == -1)
+		_exit(1);
+
+	execvp(upgrade_argv[0], upgrade_argv);
+	_exit(1);
+}
+
+static void
+upgrade_abort(const char *reason)
+{
+	kore_log(LOG_ERR, "upgrade aborted: %s", reason);
+
+	if (upgrade_timer != NULL) {
+		kore_timer_remove(upgrade_timer);
+		upgrade_timer = NULL;
+	}
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	upgrade_pid = -1;
+	upgrade_state = UPGRADE_STATE_IDLE;
+}
+
+static void
+upgrade_poll(void *arg, u_int64_t now)
+{
+	u_int8_t		idx;
+	ssize_t			ret;
+	u_int8_t		ready;
+	struct kore_worker	*kw;
+
+	if (upgrade_state == UPGRADE_STATE_PENDING) {
+		ret = read(upgrade_fd, &ready, sizeof(ready));
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			upgrade_abort(errno_s);
+			return;
+		}
+
+		if (ret == 0) {
+			upgrade_abort("new master exited before taking over");
+			return;
+		}
+
+		close(upgrade_fd);
+		upgrade_fd = -1;
+
+		upgrade_state = UPGRADE_STATE_DRAINING;
+		upgrade_deadline = now + (worker_drain_timeout * 1000);
+
+		if (!kore_quiet) {
+			kore_log(LOG_NOTICE,
+			    "upgrade: new master (pid#%d) took over, draining",
+			    upgrade_pid);
+		}
+
+		kore_msg_parent_send(KORE_MSG_WORKER_ALL,
+		    KORE_MSG_DRAIN, NULL, 0);
+		return;
+	}
+
+	if (upgrade_state != UPGRADE_STATE_DRAINING)
+		return;
+
+	/* The workers enforce the deadline themselves, this is a backstop. */
+	if (now < upgrade_deadline + UPGRADE_GRACE) {
+		for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+			kw = kore_worker_data(idx);
+			if (kw->running)
+				return;
+		}
+	}
+
+	upgrade_state = UPGRADE_STATE_DONE;
+
+	kore_timer_remove(upgrade_timer);
+	upgrade_timer = NULL;
+
+	if (raise(SIGTERM) != 0)
+		kore_log(LOG_WARNING, "failed to raise SIGTERM signal");
+}
+
+static int
+upgrade_send(int fd)
+{
+	u_int16_t		idx;
+	struct listener		*l;
+	struct kore_server	*srv;
+	u_int32_t		count;
+
+	count = 0;
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->fd != -1)
+				count++;
+			for (idx = 0; idx < l->nrfds; idx++) {
+				if (l->rfds[idx] != -1)
+					count++;
+			}
+		}
+	}
+
+	if (write(fd, &count, sizeof(count)) != sizeof(count))
+		return (KORE_RESULT_ERROR);
+
+	LIST_FOREACH(srv, &kore_servers, list) {
+		LIST_FOREACH(l, &srv->listeners, list) {
+			if (l->fd != -1 && !upgrade_sendfd(fd, -1, l->fd))
+				return (KORE_RESULT_ERROR);
+
+			for (idx = 0; idx < l->nrfds; idx++) {
+				if (l->rfds[idx] == -1)
+					continue;
+				if (!upgrade_sendfd(fd, idx, l->rfds[idx]))
+					return (KORE_RESULT_ERROR);
+			}
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+upgrade_sendfd(int sock, int32_t idx, int fd)
+{
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct cmsghdr		*cmsg;
+	union {
+		struct cmsghdr	hdr;
+		u_int8_t	buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsgbuf, 0, sizeof(cmsgbuf));
+
+	iov.iov_base = &idx;
+	iov.iov_len = sizeof(idx);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	for (;;) {
+		if (sendmsg(sock, &msg, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			kore_log(LOG_ERR, "upgrade: sendmsg: %s", errno_s);
+			return (KORE_RESULT_ERROR);
+		}
+		break;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+upgrade_recvfd(int sock, int32_t *idx, int *fd)
+{
+	ssize_t			ret;
+	struct msghdr		msg;
+	struct iovec		iov;
+	struct cmsghdr		*cmsg;
+	union {
+		struct cmsghdr	hdr;
+		u_int8_t	buf[CMSG_SPACE(sizeof(int))];
+	} cmsgbuf;
+
+	memset(&msg, 0, sizeof(msg));
+
+	iov.iov_base = idx;
+	iov.iov_len = sizeof(*idx);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	for (;;) {
+		if ((ret = recvmsg(sock, &msg, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (KORE_RESULT_ERROR);
+		}
+		break;
+	}
+
+	if (ret != sizeof(*idx) || (msg.msg_flags & MSG_CTRUNC))
+		return (KORE_RESULT_ERROR);
+
+	if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL)
+		return (KORE_RESULT_ERROR);
+
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return (KORE_RESULT_ERROR);
+
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+upgrade_read(int fd, void *data, size_t len)
+{
+	ssize_t		ret;
+	size_t		off;
+	u_int8_t	*p = data;
+
+	off = 0;
+	while (off < len) {
+		if ((ret = read(fd, p + off, len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (ret == 0)
+			return (KORE_RESULT_ERROR);
+
+		off += ret;
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Look up an unclaimed inherited socket bound to the same address as
+ * the listener. An idx of -1 is a shared listener socket, anything
+ * else is the reuseport socket for that worker index.
+ */
+static struct upgrade_fd *
+upgrade_lookup(struct listener *l, int32_t idx)
+{
+	u_int32_t		i;
+	struct upgrade_fd	*ufd;
+
+	for (i = 0; i < ninherited; i++) {
+		ufd = &inherited[i];
+
+		if (ufd->claimed || ufd->idx != idx)
+			continue;
+
+		if (upgrade_addr_match(&ufd->addr, ufd->len,
+		    &l->addr, l->addrlen))
+			return (ufd);
+	}
+
+	return (NULL);
+}
+
+static int
+upgrade_addr_match(const struct sockaddr_storage *a, socklen_t alen,
+    const struct sockaddr_storage *b, socklen_t blen)
+{
+	const struct sockaddr_un	*ua, *ub;
+
+	if (a->ss_family != b->ss_family)
+		return (0);
+
+	if (a->ss_family != AF_UNIX)
+		return (alen == blen && !memcmp(a, b, alen));
+
+	ua = (const struct sockaddr_un *)a;
+	ub = (const struct sockaddr_un *)b;
+
+	alen -= offsetof(struct sockaddr_un, sun_path);
+	blen -= offsetof(struct sockaddr_un, sun_path);
+
+	/* Path names may or may not carry their terminating NUL. */
+	if (ua->sun_path[0] != '\0') {
+		while (alen > 0 && ua->sun_path[alen - 1] == '\0')
+			alen--;
+		while (blen > 0 && ub->sun_path[blen - 1] == '\0')
+			blen--;
+	}
+
+	return (alen == blen && !memcmp(ua->sun_path, ub->sun_path, alen));
+}
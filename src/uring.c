@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) 2026 The Kore Authors
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring based event notification for the Linux workers.
+ *
+ * Every descriptor that is scheduled gets a poll request on the ring.
+ * Edge triggered descriptors use a multishot poll, level triggered ones
+ * a oneshot poll that is rearmed after its event was handled. All poll
+ * additions and removals queued during a turn of the event loop are
+ * submitted together with the wait for new completions, in a single
+ * io_uring_enter() call.
+ *
+ * Poll requests hold a reference to the underlying file, a descriptor
+ * must therefore be removed with kore_uring_remove() before it is closed.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <poll.h>
+#include <time.h>
+
+#include "kore.h"
+
+#define URING_ENTRIES		1024
+
+struct uring_fd {
+	void			*udata;
+	u_int32_t		events;
+	u_int32_t		gen;
+	int			level;
+	int			active;
+};
+
+static struct io_uring_sqe	*uring_sqe_get(void);
+static int			uring_enter(u_int32_t, struct timespec *);
+static void			uring_poll_add(int, struct uring_fd *);
+static void			uring_poll_remove(int, struct uring_fd *);
+static void			uring_fd_grow(int);
+
+static int			ring_fd = -1;
+static void			*sq_ring = NULL;
+static void			*sqes_map = NULL;
+static size_t			sq_ring_len = 0;
+static size_t			sqes_len = 0;
+static u_int32_t		*sq_head = NULL;
+static u_int32_t		*sq_tail = NULL;
+static u_int32_t		*sq_mask = NULL;
+static u_int32_t		*sq_array = NULL;
+static u_int32_t		sq_entries = 0;
+static struct io_uring_sqe	*sqes = NULL;
+static u_int32_t		*cq_head = NULL;
+static u_int32_t		*cq_tail = NULL;
+static u_int32_t		*cq_mask = NULL;
+static struct io_uring_cqe	*cqes = NULL;
+
+static struct uring_fd		*uring_fds = NULL;
+static size_t			uring_nfds = 0;
+
+int
+kore_uring_init(void)
+{
+	u_int32_t			idx;
+	u_int8_t			*p;
+	struct io_uring_params		params;
+	struct io_uring_restriction	res[2];
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_R_DISABLED;
+
+	ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring_fd == -1) {
+		kore_log(LOG_NOTICE, "io_uring_setup: %s", errno_s);
+		return (KORE_RESULT_ERROR);
+	}
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(params.features & IORING_FEAT_NODROP) ||
+	    !(params.features & IORING_FEAT_EXT_ARG)) {
+		kore_log(LOG_NOTICE, "io_uring: missing required features");
+		close(ring_fd);
+		ring_fd = -1;
+		return (KORE_RESULT_ERROR);
+	}
+
+	/*
+	 * io_uring_enter() is allowed by the seccomp filter, so limit
+	 * the ring to the poll operations we use before enabling it.
+	 */
+	memset(res, 0, sizeof(res));
+	res[0].opcode = IORING_RESTRICTION_SQE_OP;
+	res[0].sqe_op = IORING_OP_POLL_ADD;
+	res[1].opcode = IORING_RESTRICTION_SQE_OP;
+	res[1].sqe_op = IORING_OP_POLL_REMOVE;
+
+	if (syscall(__NR_io_uring_register, ring_fd,
+	    IORING_REGISTER_RESTRICTIONS, res, 2) == -1 ||
+	    syscall(__NR_io_uring_register, ring_fd,
+	    IORING_REGISTER_ENABLE_RINGS, NULL, 0) == -1) {
+		kore_log(LOG_NOTICE, "io_uring_register: %s", errno_s);
+		close(ring_fd);
+		ring_fd = -1;
+		return (KORE_RESULT_ERROR);
+	}
+
+	sq_ring_len = params.sq_off.array +
+	    params.sq_entries * sizeof(u_int32_t);
+	if (params.cq_off.cqes + params.cq_entries *
+	    sizeof(struct io_uring_cqe) > sq_ring_len) {
+		sq_ring_len = params.cq_off.cqes +
+		    params.cq_entries * sizeof(struct io_uring_cqe);
+	}
+
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		fatal("io_uring: mmap(sq_ring): %s", errno_s);
+
+	sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes_map = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (sqes_map == MAP_FAILED)
+		fatal("io_uring: mmap(sqes): %s", errno_s);
+
+	p = sq_ring;
+	sq_head = (u_int32_t *)(p + params.sq_off.head);
+	sq_tail = (u_int32_t *)(p + params.sq_off.tail);
+	sq_mask = (u_int32_t *)(p + params.sq_off.ring_mask);
+	sq_array = (u_int32_t *)(p + params.sq_off.array);
+	sq_entries = params.sq_entries;
+
+	cq_head = (u_int32_t *)(p + params.cq_off.head);
+	cq_tail = (u_int32_t *)(p + params.cq_off.tail);
+	cq_mask = (u_int32_t *)(p + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(p + params.cq_off.cqes);
+
+	sqes = sqes_map;
+
+	/* Submission queue entries map 1:1 onto the ring slots. */
+	for (idx = 0; idx < sq_entries; idx++)
+		sq_array[idx] = idx;
+
+	uring_fd_grow(worker_rlimit_nofiles);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_uring_cleanup(void)
+{
+	if (sqes_map != NULL) {
+		(void)munmap(sqes_map, sqes_len);
+		sqes_map = NULL;
+	}
+
+	if (sq_ring != NULL) {
+		(void)munmap(sq_ring, sq_ring_len);
+		sq_ring = NULL;
+	}
+
+	if (ring_fd != -1) {
+		close(ring_fd);
+		ring_fd = -1;
+	}
+
+	kore_free(uring_fds);
+	uring_fds = NULL;
+	uring_nfds = 0;
+}
+
+void
+kore_uring_wait(u_int64_t timer)
+{
+	struct uring_fd		*ufd;
+	struct kore_event	*evt;
+	struct timespec		ts, *tsp;
+	void			*udata;
+	u_int32_t		head, tail, gen, wait, flags;
+	int			fd, r, res, more;
+	u_int64_t		data;
+
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	/* Only wait if there aren't completions left over already. */
+	if (head == tail && timer != 0) {
+		wait = 1;
+		if (timer == KORE_WAIT_INFINITE) {
+			tsp = NULL;
+		} else {
+			ts.tv_sec = timer / 1000;
+			ts.tv_nsec = (timer % 1000) * 1000000;
+			tsp = &ts;
+		}
+	} else {
+		wait = 0;
+		tsp = NULL;
+	}
+
+	if (!uring_enter(wait, tsp))
+		return;
+
+	kore_loop_woke = kore_time_us();
+
+	head = *cq_head;
+	tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		data = cqes[head & *cq_mask].user_data;
+		res = cqes[head & *cq_mask].res;
+		flags = cqes[head & *cq_mask].flags;
+
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		/* Completions for poll removals carry no user data. */
+		if (data == 0)
+			continue;
+
+		fd = (int)(data >> 32);
+		gen = (u_int32_t)data;
+
+		if ((size_t)fd >= uring_nfds)
+			continue;
+
+		ufd = &uring_fds[fd];
+		if (ufd->active == 0 || ufd->gen != gen)
+			continue;
+
+		more = (flags & IORING_CQE_F_MORE);
+
+		if (res < 0) {
+			if (res == -EBADF) {
+				ufd->active = 0;
+				continue;
+			}
+
+			if (!more)
+				uring_poll_add(fd, ufd);
+			continue;
+		}
+
+		r = 0;
+		udata = ufd->udata;
+		evt = (struct kore_event *)udata;
+
+		if (res & POLLIN)
+			evt->flags |= KORE_EVENT_READ;
+
+		if (res & POLLOUT)
+			evt->flags |= KORE_EVENT_WRITE;
+
+		if (res & (POLLERR | POLLHUP | POLLRDHUP))
+			r = 1;
+
+		evt->handle(udata, r);
+
+		/* The handler may have removed or rescheduled the fd. */
+		ufd = &uring_fds[fd];
+		if (ufd->active == 0 || ufd->gen != gen)
+			continue;
+
+		if (ufd->level || !more)
+			uring_poll_add(fd, ufd);
+
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+void
+kore_uring_schedule(int fd, u_int32_t events, int level, void *udata)
+{
+	struct uring_fd		*ufd;
+
+	if (fd < 0)
+		fatal("kore_uring_schedule: bad fd %d", fd);
+
+	if ((size_t)fd >= uring_nfds)
+		uring_fd_grow(fd + 1);
+
+	ufd = &uring_fds[fd];
+
+	if (ufd->active)
+		uring_poll_remove(fd, ufd);
+
+	if (++ufd->gen == 0)
+		ufd->gen = 1;
+
+	ufd->active = 1;
+	ufd->level = level;
+	ufd->udata = udata;
+	ufd->events = events;
+
+	uring_poll_add(fd, ufd);
+}
+
+void
+kore_uring_remove(int fd)
+{
+	struct uring_fd		*ufd;
+
+	if (fd < 0 || (size_t)fd >= uring_nfds)
+		return;
+
+	ufd = &uring_fds[fd];
+	if (ufd->active == 0)
+		return;
+
+	uring_poll_remove(fd, ufd);
+
+	ufd->active = 0;
+	ufd->udata = NULL;
+
+	if (++ufd->gen == 0)
+		ufd->gen = 1;
+}
+
+static void
+uring_poll_add(int fd, struct uring_fd *ufd)
+{
+	u_int32_t		events;
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe_get();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->user_data = ((u_int64_t)fd << 32) | ufd->gen;
+
+	events = ufd->events;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+
+	if (ufd->level == 0)
+		sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+static void
+uring_poll_remove(int fd, struct uring_fd *ufd)
+{
+	struct io_uring_sqe	*sqe;
+
+	sqe = uring_sqe_get();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = ((u_int64_t)fd << 32) | ufd->gen;
+	sqe->user_data = 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe_get(void)
+{
+	u_int32_t		tail;
+	struct io_uring_sqe	*sqe;
+
+	tail = *sq_tail;
+
+	/* Flush the submission queue to the kernel if it is full. */
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+		(void)uring_enter(0, NULL);
+		if (tail - __atomic_load_n(sq_head,
+		    __ATOMIC_ACQUIRE) == sq_entries)
+			fatal("io_uring: unable to flush submission queue");
+	}
+
+	sqe = &sqes[tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return (sqe);
+}
+
+/*
+ * Submit whatever is pending and optionally wait for a completion.
+ * Returns KORE_RESULT_ERROR only if interrupted by a signal.
+ */
+static int
+uring_enter(u_int32_t wait, struct timespec *ts)
+{
+	u_int32_t			submit, flags;
+	struct io_uring_getevents_arg	arg;
+
+	submit = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && wait == 0)
+		return (KORE_RESULT_OK);
+
+	flags = IORING_ENTER_EXT_ARG;
+	if (wait)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (u_int64_t)(uintptr_t)ts;
+
+	if (syscall(__NR_io_uring_enter, ring_fd, submit, wait,
+	    flags, &arg, sizeof(arg)) == -1) {
+		switch (errno) {
+		case EINTR:
+			return (KORE_RESULT_ERROR);
+		case ETIME:
+		case EBUSY:
+		case EAGAIN:
+			break;
+		default:
+			fatal("io_uring_enter: %s", errno_s);
+		}
+	}
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+uring_fd_grow(int count)
+{
+	size_t		len;
+
+	if ((size_t)count <= uring_nfds)
+		return;
+
+	len = count;
+	if (len < uring_nfds * 2)
+		len = uring_nfds * 2;
+
+	uring_fds = kore_realloc(uring_fds, len * sizeof(struct uring_fd));
+	memset(&uring_fds[uring_nfds], 0,
+	    (len - uring_nfds) * sizeof(struct uring_fd));
+
+	uring_nfds = len;
+}
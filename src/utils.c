@@ -49,7 +49,22 @@ static struct {
 	{ NULL,		0 },
 };
 
+/* Call sites are told apart by their format string and priority. */
+#define LOG_RATE_SLOTS		256
+#define LOG_RATE_PROBE		8
+
+struct log_rate {
+	const char		*fmt;
+	int			prio;
+	u_int64_t		second;
+	u_int32_t		count;
+	u_int32_t		suppressed;
+};
+
 static void	fatal_log(const char *, va_list);
+static void	log_write(int, const char *, const char *, size_t);
+static int	log_rate_check(int, const char *, u_int32_t *);
+static int	log_ring_put(int, const char *, size_t);
 static int	utils_base64_encode(const void *, size_t, char **,
 		    const char *, int);
 static int	utils_base64_decode(const char *, u_int8_t **,
@@ -64,6 +79,14 @@ static char b64url_table[] = 	\
 /* b64_table and b64url_table are the same size. */
 #define B64_TABLE_LEN		(sizeof(b64_table))
 
+int			kore_log_overflow = KORE_LOG_OVERFLOW_DROP;
+u_int32_t		kore_log_rate_limit = 100;
+
+static volatile int	log_lock = 0;
+static int		log_direct = 0;
+static u_int64_t	log_drops_reported = 0;
+static struct log_rate	log_rates[LOG_RATE_SLOTS];
+
 #if defined(KORE_DEBUG)
 void
 kore_debug_internal(char *file, int line, const char *fmt, ...)
@@ -93,29 +116,101 @@ kore_log_init(void)
 		openlog(name, LOG_NDELAY | LOG_PID, LOG_DAEMON);
 }
 
+/*
+ * Worker processes hand their messages to the parent through the log ring
+ * in their shared memory so a backed up syslog or stdout never stalls the
+ * event loop. The parent, and workers that can no longer count on it,
+ * write directly.
+ */
 void
 kore_log(int prio, const char *fmt, ...)
 {
 	va_list		args;
-	const char	*name;
+	int		len;
+	u_int32_t	suppressed;
 	char		buf[2048];
 
+	while (!__sync_bool_compare_and_swap(&log_lock, 0, 1))
+		;
+
+	if (!log_rate_check(prio, fmt, &suppressed)) {
+		(void)__sync_bool_compare_and_swap(&log_lock, 1, 0);
+		return;
+	}
+
 	va_start(args, fmt);
-	(void)vsnprintf(buf, sizeof(buf), fmt, args);
+	len = vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
 
-	if (worker != NULL) {
-		name = kore_worker_name(worker->id);
+	if (len < 0)
+		len = 0;
+	else if ((size_t)len >= sizeof(buf))
+		len = sizeof(buf) - 1;
 
-		if (foreground)
-			printf("%s: %s\n", name, buf);
-		else
-			syslog(prio, "%s: %s", name, buf);
-	} else {
-		if (foreground)
-			printf("[parent]: %s\n", buf);
-		else
-			syslog(prio, "[parent]: %s", buf);
+	if (suppressed > 0) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+		    " (%u similar messages suppressed)", suppressed);
+		if ((size_t)len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+	}
+
+	if (worker == NULL) {
+		log_write(prio, "[parent]", buf, len);
+	} else if (log_direct || !log_ring_put(prio, buf, len)) {
+		if (log_direct || prio <= LOG_ERR ||
+		    kore_log_overflow == KORE_LOG_OVERFLOW_SYNC) {
+			log_write(prio,
+			    kore_worker_name(worker->id), buf, len);
+		} else {
+			__atomic_add_fetch(&worker->log.drops, 1,
+			    __ATOMIC_SEQ_CST);
+		}
+	}
+
+	(void)__sync_bool_compare_and_swap(&log_lock, 1, 0);
+}
+
+/* From here on this process writes its logs itself. */
+void
+kore_log_sync(void)
+{
+	log_direct = 1;
+}
+
+void
+kore_log_gather(void *arg, u_int64_t now)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+	struct kore_log_record	*rec;
+	u_int64_t		drops;
+	u_int32_t		head, tail;
+
+	for (idx = 0; idx < worker_count; idx++) {
+		kw = kore_worker_data(idx);
+
+		tail = kw->log.tail;
+		head = __atomic_load_n(&kw->log.head, __ATOMIC_SEQ_CST);
+
+		while (tail != head) {
+			rec = &kw->log.ring[tail & (KORE_LOG_RECORDS - 1)];
+			log_write(rec->prio, kore_worker_name(kw->id),
+			    rec->msg, rec->len);
+			tail++;
+		}
+
+		__atomic_store_n(&kw->log.tail, tail, __ATOMIC_SEQ_CST);
+
+		/* Report drops at most once a second. */
+		drops = __atomic_load_n(&kw->log.drops, __ATOMIC_SEQ_CST);
+		if (drops != kw->log.reported &&
+		    now - log_drops_reported >= 1000) {
+			kore_log(LOG_NOTICE,
+			    "%s dropped %" PRIu64 " log messages",
+			    kore_worker_name(kw->id), drops - kw->log.reported);
+			kw->log.reported = drops;
+			log_drops_reported = now;
+		}
 	}
 }
 
@@ -424,6 +519,16 @@ kore_time_ms(void)
 	return ((u_int64_t)(ts.tv_sec * 1000 + (ts.tv_nsec / 1000000)));
 }
 
+u_int64_t
+kore_time_us(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)(ts.tv_sec * 1000000 + (ts.tv_nsec / 1000)));
+}
+
 int
 kore_base64url_encode(const void *data, size_t len, char **out, int flags)
 {
@@ -693,6 +798,8 @@ fatal_log(const char *fmt, va_list args)
 
 	(void)vsnprintf(buf, sizeof(buf), fmt, args);
 
+	kore_log_sync();
+
 	if (!foreground)
 		kore_log(LOG_ERR, "%s", buf);
 
@@ -702,6 +809,97 @@ fatal_log(const char *fmt, va_list args)
 	printf("%s: %s\n", kore_progname, buf);
 }
 
+static void
+log_write(int prio, const char *name, const char *msg, size_t len)
+{
+	if (foreground)
+		printf("%s: %.*s\n", name, (int)len, msg);
+	else
+		syslog(prio, "%s: %.*s", name, (int)len, msg);
+}
+
+/*
+ * Allow kore_log_rate_limit messages per call site per second. The number
+ * of suppressed messages is returned with the first one let through after.
+ * Errors, and so fatal(), are never limited. A call site takes the first
+ * free slot after its hash, or one that was idle for a second, if there is
+ * none within LOG_RATE_PROBE slots it is not limited.
+ */
+static int
+log_rate_check(int prio, const char *fmt, u_int32_t *suppressed)
+{
+	u_int64_t		now;
+	u_int32_t		idx, i;
+	struct log_rate		*rate, *slot;
+
+	*suppressed = 0;
+
+	if (kore_log_rate_limit == 0 || prio <= LOG_ERR)
+		return (KORE_RESULT_OK);
+
+	now = kore_time_ms() / 1000;
+	idx = (u_int32_t)(((uintptr_t)fmt >> 3) ^ ((uintptr_t)prio << 5));
+
+	slot = NULL;
+	for (i = 0; i < LOG_RATE_PROBE; i++) {
+		rate = &log_rates[(idx + i) % LOG_RATE_SLOTS];
+		if (rate->fmt == fmt && rate->prio == prio)
+			break;
+		if (slot == NULL &&
+		    (rate->fmt == NULL || rate->second != now))
+			slot = rate;
+	}
+
+	if (i == LOG_RATE_PROBE) {
+		if ((rate = slot) == NULL)
+			return (KORE_RESULT_OK);
+
+		rate->fmt = fmt;
+		rate->prio = prio;
+		rate->count = 0;
+		rate->second = now;
+		rate->suppressed = 0;
+	}
+
+	if (rate->second != now) {
+		*suppressed = rate->suppressed;
+		rate->count = 0;
+		rate->second = now;
+		rate->suppressed = 0;
+	}
+
+	if (rate->count >= kore_log_rate_limit) {
+		rate->suppressed++;
+		return (KORE_RESULT_ERROR);
+	}
+
+	rate->count++;
+
+	return (KORE_RESULT_OK);
+}
+
+static int
+log_ring_put(int prio, const char *msg, size_t len)
+{
+	struct kore_log_record	*rec;
+	u_int32_t		head, tail;
+
+	head = worker->log.head;
+	tail = __atomic_load_n(&worker->log.tail, __ATOMIC_SEQ_CST);
+
+	if (head - tail >= KORE_LOG_RECORDS)
+		return (KORE_RESULT_ERROR);
+
+	rec = &worker->log.ring[head & (KORE_LOG_RECORDS - 1)];
+	rec->prio = prio;
+	rec->len = MIN(len, sizeof(rec->msg));
+	memcpy(rec->msg, msg, rec->len);
+
+	__atomic_store_n(&worker->log.head, head + 1, __ATOMIC_SEQ_CST);
+
+	return (KORE_RESULT_OK);
+}
+
 static int
 utils_base64_encode(const void *data, size_t len, char **out,
     const char *table, int flags)
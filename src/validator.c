@@ -16,14 +16,29 @@
 
 #include <sys/types.h>
 
+#include <ctype.h>
+#include <limits.h>
+
 #include "kore.h"
 
+#define VALIDATOR_BUCKETS		64
+
+static u_int32_t	validator_hash(const char *);
+static int		validator_range(struct kore_validator *, const char *);
+static int		validator_uuid(const char *);
+
 TAILQ_HEAD(, kore_validator)		validators;
+LIST_HEAD(, kore_validator)		validator_buckets[VALIDATOR_BUCKETS];
 
 void
 kore_validator_init(void)
 {
+	int		i;
+
 	TAILQ_INIT(&validators);
+
+	for (i = 0; i < VALIDATOR_BUCKETS; i++)
+		LIST_INIT(&validator_buckets[i]);
 }
 
 int
@@ -56,6 +71,17 @@ kore_validator_add(const char *name, u_int8_t type, const char *arg)
 			return (KORE_RESULT_ERROR);
 		}
 		break;
+	case KORE_VALIDATOR_TYPE_INT:
+	case KORE_VALIDATOR_TYPE_LENGTH:
+		if (!validator_range(val, arg)) {
+			kore_free(val);
+			kore_log(LOG_NOTICE,
+			    "validator %s has bad range %s", name, arg);
+			return (KORE_RESULT_ERROR);
+		}
+		break;
+	case KORE_VALIDATOR_TYPE_UUID:
+		break;
 	default:
 		kore_free(val);
 		return (KORE_RESULT_ERROR);
@@ -64,6 +90,7 @@ kore_validator_add(const char *name, u_int8_t type, const char *arg)
 	val->arg = kore_strdup(arg);
 	val->name = kore_strdup(name);
 	TAILQ_INSERT_TAIL(&validators, val, list);
+	LIST_INSERT_HEAD(&validator_buckets[validator_hash(name)], val, hlist);
 
 	return (KORE_RESULT_OK);
 }
@@ -73,21 +100,18 @@ kore_validator_run(struct http_request *req, const char *name, char *data)
 {
 	struct kore_validator		*val;
 
-	TAILQ_FOREACH(val, &validators, list) {
-		if (strcmp(val->name, name))
-			continue;
-
-		return (kore_validator_check(req, val, data));
-	}
+	if ((val = kore_validator_lookup(name)) == NULL)
+		return (KORE_RESULT_ERROR);
 
-	return (KORE_RESULT_ERROR);
+	return (kore_validator_check(req, val, data));
 }
 
 int
 kore_validator_check(struct http_request *req, struct kore_validator *val,
     const void *data)
 {
-	int		r;
+	int		r, err;
+	size_t		len;
 
 	switch (val->type) {
 	case KORE_VALIDATOR_TYPE_REGEX:
@@ -99,6 +123,26 @@ kore_validator_check(struct http_request *req, struct kore_validator *val,
 	case KORE_VALIDATOR_TYPE_FUNCTION:
 		r = kore_runtime_validator(val->rcall, req, data);
 		break;
+	case KORE_VALIDATOR_TYPE_INT:
+		/* strtoll() would skip leading whitespace and a '+'. */
+		if (*(const char *)data != '-' &&
+		    !isdigit(*(const unsigned char *)data)) {
+			r = KORE_RESULT_ERROR;
+			break;
+		}
+		(void)kore_strtonum(data, 10, val->min, val->max, &err);
+		r = err;
+		break;
+	case KORE_VALIDATOR_TYPE_UUID:
+		r = validator_uuid(data);
+		break;
+	case KORE_VALIDATOR_TYPE_LENGTH:
+		len = strlen(data);
+		if ((long long)len >= val->min && (long long)len <= val->max)
+			r = KORE_RESULT_OK;
+		else
+			r = KORE_RESULT_ERROR;
+		break;
 	default:
 		r = KORE_RESULT_ERROR;
 		kore_log(LOG_NOTICE, "invalid type %d for validator %s",
@@ -130,10 +174,77 @@ kore_validator_lookup(const char *name)
 {
 	struct kore_validator		*val;
 
-	TAILQ_FOREACH(val, &validators, list) {
+	LIST_FOREACH(val, &validator_buckets[validator_hash(name)], hlist) {
 		if (!strcmp(val->name, name))
 			return (val);
 	}
 
 	return (NULL);
 }
+
+/* FNV-1a, folded onto the buckets. */
+static u_int32_t
+validator_hash(const char *name)
+{
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+
+	while (*name != '\0') {
+		hash ^= *(const u_int8_t *)name++;
+		hash *= 16777619U;
+	}
+
+	return (hash & (VALIDATOR_BUCKETS - 1));
+}
+
+/* Parses the "min:max" argument of the int and length types. */
+static int
+validator_range(struct kore_validator *val, const char *arg)
+{
+	int		err;
+	long long	low;
+	char		*sep, buf[64];
+
+	if (kore_strlcpy(buf, arg, sizeof(buf)) >= sizeof(buf))
+		return (KORE_RESULT_ERROR);
+
+	if ((sep = strchr(buf, ':')) == NULL)
+		return (KORE_RESULT_ERROR);
+	*(sep)++ = '\0';
+
+	low = (val->type == KORE_VALIDATOR_TYPE_LENGTH) ? 0 : LLONG_MIN;
+
+	val->min = kore_strtonum(buf, 10, low, LLONG_MAX, &err);
+	if (err != KORE_RESULT_OK)
+		return (KORE_RESULT_ERROR);
+
+	val->max = kore_strtonum(sep, 10, val->min, LLONG_MAX, &err);
+	if (err != KORE_RESULT_OK)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+/* 8-4-4-4-12 hex digits, either case. */
+static int
+validator_uuid(const char *data)
+{
+	int		i;
+
+	for (i = 0; i < 36; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (data[i] != '-')
+				return (KORE_RESULT_ERROR);
+			continue;
+		}
+
+		if (!isxdigit((const unsigned char)data[i]))
+			return (KORE_RESULT_ERROR);
+	}
+
+	if (data[i] != '\0')
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
@@ -20,8 +20,13 @@
 #include <openssl/sha.h>
 
 #include <limits.h>
+#include <stdint.h>
 #include <string.h>
 
+#if defined(KORE_USE_ZLIB)
+#include <zlib.h>
+#endif
+
 #include "kore.h"
 #include "http.h"
 
@@ -36,9 +41,66 @@
 #define WEBSOCKET_HAS_MASK(x)		((x) & (1 << 7))
 #define WEBSOCKET_HAS_FINFLAG(x)	((x) & (1 << 7))
 #define WEBSOCKET_RSV(x, i)		((x) & (1 << (7 - i)))
+#define WEBSOCKET_RSV1			0x40
 
 #define WEBSOCKET_SERVER_RESPONSE	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
+#define WEBSOCKET_TOPIC_MAX		255
+#define WEBSOCKET_TOPIC_BUCKETS		256
+
+struct websocket_topic {
+	char				*name;
+	size_t				len;
+	TAILQ_HEAD(, websocket_sub)	subs;
+	LIST_ENTRY(websocket_topic)	list;
+};
+
+struct websocket_sub {
+	struct connection		*c;
+	struct websocket_topic		*topic;
+	TAILQ_ENTRY(websocket_sub)	tlist;
+	TAILQ_ENTRY(websocket_sub)	clist;
+};
+
+#define WEBSOCKET_DEFLATE_BITS		15
+#define WEBSOCKET_DEFLATE_OFFERS	8
+#define WEBSOCKET_DEFLATE_PARAMS	8
+
+/*
+ * Frames for a broadcast or publish, built the first time a connection
+ * needs them: one plain and one deflated per window size in use.
+ */
+struct websocket_frames {
+	u_int8_t		op;
+	const void		*data;
+	size_t			len;
+	struct http_body_ref	*plain;
+#if defined(KORE_USE_ZLIB)
+	u_int32_t		deflate_none;
+	struct http_body_ref	*deflated[WEBSOCKET_DEFLATE_BITS + 1];
+#endif
+};
+
+#if defined(KORE_USE_ZLIB)
+#define WEBSOCKET_DEFLATE_TX_TAKEOVER	0x0001
+#define WEBSOCKET_DEFLATE_RX_TAKEOVER	0x0002
+#define WEBSOCKET_DEFLATE_TX_INIT	0x0004
+#define WEBSOCKET_DEFLATE_RX_INIT	0x0008
+
+/*
+ * Negotiated permessage-deflate (RFC 7692) state. The z_streams are only
+ * set up when the connection uses context takeover in that direction,
+ * otherwise the worker its shared streams are used and reset after each
+ * message.
+ */
+struct websocket_deflate {
+	int			flags;
+	int			tx_bits;
+	int			rx_bits;
+	z_stream		tx;
+	z_stream		rx;
+};
+#endif
 
 u_int64_t	kore_websocket_timeout = 120000;
 u_int64_t	kore_websocket_maxframe = 16384;
@@ -46,8 +108,83 @@ u_int64_t	kore_websocket_maxframe = 16384;
 static int	websocket_recv_frame(struct netbuf *);
 static int	websocket_recv_opcode(struct netbuf *);
 static void	websocket_disconnect(struct connection *);
-static void	websocket_frame_build(struct kore_buf *, u_int8_t,
+static int	websocket_frame_sent(struct netbuf *);
+static void	websocket_frame_queue(struct connection *,
+		    struct websocket_frames *);
+static void	websocket_fanout(const char *, size_t, struct connection *,
+		    struct websocket_frames *);
+static void	websocket_global(const char *, size_t, u_int8_t,
 		    const void *, size_t);
+static void	websocket_frames_release(struct websocket_frames *);
+static struct http_body_ref	*websocket_frames_get(struct websocket_frames *,
+				    struct connection *);
+static void	websocket_sub_remove(struct websocket_sub *);
+static u_int32_t		websocket_topic_hash(const char *, size_t);
+static struct websocket_topic	*websocket_topic_lookup(const char *, size_t);
+
+#if defined(KORE_USE_ZLIB)
+static struct websocket_deflate	*websocket_deflate_negotiate(
+				    struct http_request *);
+static int	websocket_deflate_offer(struct kore_module_handle *, char *,
+		    struct websocket_deflate *, struct kore_buf *);
+static int	websocket_deflate_frame(struct websocket_deflate *,
+		    struct kore_buf *, u_int8_t, const void *, size_t);
+static int	websocket_deflate(z_stream *, int, const void *, size_t);
+static int	websocket_inflate(struct connection *, const u_int8_t *,
+		    size_t);
+static int	websocket_inflate_input(z_stream *, const void *, size_t);
+static z_stream	*websocket_deflate_shared(int);
+static int	websocket_deflate_eligible(u_int8_t, size_t);
+static void	websocket_deflate_free(struct connection *);
+
+static z_stream		ws_tx_shared[WEBSOCKET_DEFLATE_BITS + 1];
+static u_int32_t	ws_tx_shared_init = 0;
+static z_stream		ws_rx_shared;
+static int		ws_rx_shared_init = 0;
+static struct kore_buf	ws_zbuf;
+static struct kore_buf	ws_ibuf;
+#endif
+
+static struct connection_list	ws_connections;
+static LIST_HEAD(, websocket_topic)	ws_topics[WEBSOCKET_TOPIC_BUCKETS];
+
+void
+kore_websocket_init(void)
+{
+	int		i;
+
+	TAILQ_INIT(&ws_connections);
+
+	for (i = 0; i < WEBSOCKET_TOPIC_BUCKETS; i++)
+		LIST_INIT(&ws_topics[i]);
+
+#if defined(KORE_USE_ZLIB)
+	kore_buf_init(&ws_zbuf, 0);
+	kore_buf_init(&ws_ibuf, 0);
+#endif
+}
+
+void
+kore_websocket_cleanup(void)
+{
+#if defined(KORE_USE_ZLIB)
+	int		bits;
+
+	for (bits = 0; bits <= WEBSOCKET_DEFLATE_BITS; bits++) {
+		if (ws_tx_shared_init & (1 << bits))
+			(void)deflateEnd(&ws_tx_shared[bits]);
+	}
+
+	if (ws_rx_shared_init)
+		(void)inflateEnd(&ws_rx_shared);
+
+	ws_tx_shared_init = 0;
+	ws_rx_shared_init = 0;
+
+	kore_buf_cleanup(&ws_zbuf);
+	kore_buf_cleanup(&ws_ibuf);
+#endif
+}
 
 void
 kore_websocket_handshake(struct http_request *req, const char *onconnect,
@@ -59,12 +196,21 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	const char		*key, *version;
 	u_int8_t		digest[SHA_DIGEST_LENGTH];
 
-	if (!http_request_header(req, "sec-websocket-key", &key)) {
+#if defined(KORE_USE_HTTP2)
+	/* No extended CONNECT (RFC 8441), websockets need HTTP/1.1. */
+	if (req->owner->proto == CONN_PROTO_HTTP2) {
 		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
 		return;
 	}
+#endif
 
-	if (!http_request_header(req, "sec-websocket-version", &version)) {
+	if (!http_request_header_id(req, HTTP_HEADER_SEC_WEBSOCKET_KEY, &key)) {
+		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
+		return;
+	}
+
+	if (!http_request_header_id(req,
+	    HTTP_HEADER_SEC_WEBSOCKET_VERSION, &version)) {
 		http_response_header(req, "sec-websocket-version", "13");
 		http_response(req, HTTP_STATUS_BAD_REQUEST, NULL, 0);
 		return;
@@ -96,6 +242,12 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	http_response_header(req, "sec-websocket-accept", base64);
 	kore_free(base64);
 
+#if defined(KORE_USE_ZLIB)
+	req->owner->ws_deflate = websocket_deflate_negotiate(req);
+#else
+	req->owner->ws_deflate = NULL;
+#endif
+
 	kore_debug("%p: new websocket connection", req->owner);
 
 	req->owner->proto = CONN_PROTO_WEBSOCKET;
@@ -105,9 +257,13 @@ kore_websocket_handshake(struct http_request *req, const char *onconnect,
 	req->owner->disconnect = websocket_disconnect;
 	req->owner->rnb->flags &= ~NETBUF_CALL_CB_ALWAYS;
 
+	TAILQ_INIT(&req->owner->ws_subs);
+	TAILQ_INSERT_TAIL(&ws_connections, req->owner, ws_list);
+
 	req->owner->http_timeout = 0;
 	req->owner->idle_timer.start = kore_time_ms();
 	req->owner->idle_timer.length = kore_websocket_timeout;
+	kore_connection_timeout_update(req->owner);
 
 	if (onconnect != NULL) {
 		req->owner->ws_connect = kore_runtime_getcall(onconnect);
@@ -151,7 +307,12 @@ kore_websocket_send(struct connection *c, u_int8_t op, const void *data,
 	struct kore_buf		frame;
 
 	kore_buf_init(&frame, len);
-	websocket_frame_build(&frame, op, data, len);
+#if defined(KORE_USE_ZLIB)
+	if (!websocket_deflate_frame(c->ws_deflate, &frame, op, data, len))
+		kore_websocket_frame_build(&frame, op, data, len);
+#else
+	kore_websocket_frame_build(&frame, op, data, len);
+#endif
 	net_send_stream(c, frame.data, frame.offset,
 	    kore_websocket_send_clean, NULL);
 
@@ -162,34 +323,334 @@ kore_websocket_send(struct connection *c, u_int8_t op, const void *data,
 	net_send_flush(c);
 }
 
+/*
+ * The frame is built once, the send queue of every websocket connection
+ * references it instead of getting a copy.
+ */
 void
 kore_websocket_broadcast(struct connection *src, u_int8_t op, const void *data,
     size_t len, int scope)
 {
-	struct connection	*c;
-	struct kore_buf		*frame;
+	struct websocket_frames		frames;
+
+	if (scope == WEBSOCKET_BROADCAST_GLOBAL)
+		websocket_global(NULL, 0, op, data, len);
+
+	memset(&frames, 0, sizeof(frames));
+	frames.op = op;
+	frames.data = data;
+	frames.len = len;
+
+	websocket_fanout(NULL, 0, src, &frames);
+	websocket_frames_release(&frames);
+}
+
+int
+kore_websocket_subscribe(struct connection *c, const char *name)
+{
+	size_t			len;
+	struct websocket_sub	*sub;
+	struct websocket_topic	*topic;
+
+	if (c->proto != CONN_PROTO_WEBSOCKET ||
+	    c->state != CONN_STATE_ESTABLISHED)
+		return (KORE_RESULT_ERROR);
+
+	len = strlen(name);
+	if (len == 0 || len > WEBSOCKET_TOPIC_MAX)
+		return (KORE_RESULT_ERROR);
+
+	if ((topic = websocket_topic_lookup(name, len)) == NULL) {
+		topic = kore_malloc(sizeof(*topic));
+		topic->name = kore_strdup(name);
+		topic->len = len;
+		TAILQ_INIT(&topic->subs);
+		LIST_INSERT_HEAD(&ws_topics[websocket_topic_hash(name, len)],
+		    topic, list);
+	} else {
+		TAILQ_FOREACH(sub, &c->ws_subs, clist) {
+			if (sub->topic == topic)
+				return (KORE_RESULT_OK);
+		}
+	}
+
+	sub = kore_malloc(sizeof(*sub));
+	sub->c = c;
+	sub->topic = topic;
+	TAILQ_INSERT_TAIL(&topic->subs, sub, tlist);
+	TAILQ_INSERT_TAIL(&c->ws_subs, sub, clist);
+
+	return (KORE_RESULT_OK);
+}
+
+void
+kore_websocket_unsubscribe(struct connection *c, const char *name)
+{
+	struct websocket_sub	*sub;
+
+	if (c->proto != CONN_PROTO_WEBSOCKET)
+		return;
+
+	TAILQ_FOREACH(sub, &c->ws_subs, clist) {
+		if (!strcmp(sub->topic->name, name)) {
+			websocket_sub_remove(sub);
+			return;
+		}
+	}
+}
+
+/*
+ * Send a frame to every connection subscribed to the topic, with
+ * WEBSOCKET_BROADCAST_GLOBAL to subscribers on the other workers too.
+ */
+void
+kore_websocket_publish(const char *name, u_int8_t op, const void *data,
+    size_t len, int scope)
+{
+	size_t				tlen;
+	struct websocket_frames		frames;
+
+	tlen = strlen(name);
+	if (tlen == 0 || tlen > WEBSOCKET_TOPIC_MAX)
+		fatal("kore_websocket_publish: bad topic length %zu", tlen);
+
+	if (scope == WEBSOCKET_BROADCAST_GLOBAL)
+		websocket_global(name, tlen, op, data, len);
+
+	memset(&frames, 0, sizeof(frames));
+	frames.op = op;
+	frames.data = data;
+	frames.len = len;
+
+	websocket_fanout(name, tlen, NULL, &frames);
+	websocket_frames_release(&frames);
+}
+
+/*
+ * A broadcast or publish from another worker. The payload is the topic
+ * length, the topic, the opcode and the message, each worker builds its
+ * own frames from that. We skip our own messages, those were already
+ * delivered locally when they were sent.
+ */
+void
+kore_websocket_msg(struct kore_msg *msg, const void *data)
+{
+	size_t				tlen;
+	struct websocket_frames		frames;
+	const u_int8_t			*d = data;
+
+	if (msg->src == worker->id || msg->length < 1)
+		return;
+
+	tlen = d[0];
+	if (msg->length < tlen + 2) {
+		kore_log(LOG_NOTICE, "short websocket msg from %u", msg->src);
+		return;
+	}
+
+	memset(&frames, 0, sizeof(frames));
+	frames.op = d[tlen + 1];
+	frames.data = &d[tlen + 2];
+	frames.len = msg->length - tlen - 2;
 
-	frame = kore_buf_alloc(len);
-	websocket_frame_build(frame, op, data, len);
+	websocket_fanout((const char *)&d[1], tlen, NULL, &frames);
+	websocket_frames_release(&frames);
+}
 
-	TAILQ_FOREACH(c, &connections, list) {
-		if (c != src && c->proto == CONN_PROTO_WEBSOCKET) {
-			net_send_queue(c, frame->data, frame->offset);
-			net_send_flush(c);
+static void
+websocket_fanout(const char *name, size_t tlen, struct connection *src,
+    struct websocket_frames *frames)
+{
+	struct connection	*c, *next;
+	struct websocket_topic	*topic;
+	struct websocket_sub	*sub, *snext;
+
+	if (tlen == 0) {
+		for (c = TAILQ_FIRST(&ws_connections); c != NULL; c = next) {
+			next = TAILQ_NEXT(c, ws_list);
+			if (c != src)
+				websocket_frame_queue(c, frames);
 		}
+		return;
 	}
 
-	if (scope == WEBSOCKET_BROADCAST_GLOBAL) {
-		kore_msg_send(KORE_MSG_WORKER_ALL,
-		    KORE_MSG_WEBSOCKET, frame->data, frame->offset);
+	if ((topic = websocket_topic_lookup(name, tlen)) == NULL)
+		return;
+
+	/*
+	 * Queueing can disconnect the connection which drops its subs and,
+	 * with the last one, the topic. So never look at sub afterwards.
+	 */
+	for (sub = TAILQ_FIRST(&topic->subs); sub != NULL; sub = snext) {
+		snext = TAILQ_NEXT(sub, tlist);
+		websocket_frame_queue(sub->c, frames);
 	}
+}
+
+static void
+websocket_frame_queue(struct connection *c, struct websocket_frames *frames)
+{
+	struct netbuf		*nb;
+	struct http_body_ref	*ref;
+
+	if (c->state != CONN_STATE_ESTABLISHED)
+		return;
+
+	ref = websocket_frames_get(frames, c);
+	ref->refs++;
+	net_send_stream(c, ref->data, ref->length, websocket_frame_sent, &nb);
+	nb->extra = ref;
+	net_send_flush(c);
+}
 
-	kore_buf_free(frame);
+static int
+websocket_frame_sent(struct netbuf *nb)
+{
+	http_body_ref_release(nb->extra);
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * The frame a connection gets: the deflated one if it negotiated
+ * permessage-deflate and the message compresses, the plain one if not.
+ */
+static struct http_body_ref *
+websocket_frames_get(struct websocket_frames *frames, struct connection *c)
+{
+	struct kore_buf			*frame;
+#if defined(KORE_USE_ZLIB)
+	int				bits;
+	struct websocket_deflate	*wd;
+
+	wd = c->ws_deflate;
+	if (wd != NULL && websocket_deflate_eligible(frames->op, frames->len))
+		bits = wd->tx_bits;
+	else
+		bits = 0;
+
+	if (bits != 0 && !(frames->deflate_none & (1 << bits))) {
+		if (frames->deflated[bits] == NULL) {
+			if (websocket_deflate(websocket_deflate_shared(bits), 0,
+			    frames->data, frames->len)) {
+				frame = kore_buf_alloc(ws_zbuf.offset + 16);
+				kore_websocket_frame_build(frame,
+				    frames->op | WEBSOCKET_RSV1,
+				    ws_zbuf.data, ws_zbuf.offset);
+				frames->deflated[bits] =
+				    http_body_ref_create(frame);
+			} else {
+				frames->deflate_none |= (1 << bits);
+			}
+		}
+
+		/*
+		 * The shared frame was compressed without any history, the
+		 * connection its own stream may not refer back past it.
+		 */
+		if (frames->deflated[bits] != NULL) {
+			if (wd->flags & WEBSOCKET_DEFLATE_TX_INIT)
+				(void)deflateReset(&wd->tx);
+			return (frames->deflated[bits]);
+		}
+	}
+#endif
+
+	if (frames->plain == NULL) {
+		frame = kore_buf_alloc(frames->len + 16);
+		kore_websocket_frame_build(frame, frames->op,
+		    frames->data, frames->len);
+		frames->plain = http_body_ref_create(frame);
+	}
+
+	return (frames->plain);
 }
 
 static void
-websocket_frame_build(struct kore_buf *frame, u_int8_t op, const void *data,
-    size_t len)
+websocket_frames_release(struct websocket_frames *frames)
+{
+#if defined(KORE_USE_ZLIB)
+	int		bits;
+
+	for (bits = 0; bits <= WEBSOCKET_DEFLATE_BITS; bits++) {
+		if (frames->deflated[bits] != NULL)
+			http_body_ref_release(frames->deflated[bits]);
+	}
+#endif
+
+	if (frames->plain != NULL)
+		http_body_ref_release(frames->plain);
+}
+
+static void
+websocket_global(const char *name, size_t tlen, u_int8_t op,
+    const void *data, size_t len)
+{
+	struct kore_buf		*msg;
+	u_int8_t		tl;
+
+	tl = tlen;
+
+	msg = kore_buf_alloc(2 + tlen + len);
+	kore_buf_append(msg, &tl, sizeof(tl));
+	if (tlen > 0)
+		kore_buf_append(msg, name, tlen);
+	kore_buf_append(msg, &op, sizeof(op));
+	if (len > 0)
+		kore_buf_append(msg, data, len);
+
+	kore_msg_send(KORE_MSG_WORKER_ALL, KORE_MSG_WEBSOCKET,
+	    msg->data, msg->offset);
+
+	kore_buf_free(msg);
+}
+
+static void
+websocket_sub_remove(struct websocket_sub *sub)
+{
+	struct websocket_topic	*topic = sub->topic;
+
+	TAILQ_REMOVE(&topic->subs, sub, tlist);
+	TAILQ_REMOVE(&sub->c->ws_subs, sub, clist);
+	kore_free(sub);
+
+	if (TAILQ_EMPTY(&topic->subs)) {
+		LIST_REMOVE(topic, list);
+		kore_free(topic->name);
+		kore_free(topic);
+	}
+}
+
+static struct websocket_topic *
+websocket_topic_lookup(const char *name, size_t len)
+{
+	struct websocket_topic	*topic;
+
+	LIST_FOREACH(topic, &ws_topics[websocket_topic_hash(name, len)], list) {
+		if (topic->len == len && !memcmp(topic->name, name, len))
+			return (topic);
+	}
+
+	return (NULL);
+}
+
+static u_int32_t
+websocket_topic_hash(const char *name, size_t len)
+{
+	size_t		i;
+	u_int32_t	hash;
+
+	hash = 2166136261U;
+	for (i = 0; i < len; i++) {
+		hash ^= (u_int8_t)name[i];
+		hash *= 16777619U;
+	}
+
+	return (hash % WEBSOCKET_TOPIC_BUCKETS);
+}
+
+void
+kore_websocket_frame_build(struct kore_buf *frame, u_int8_t op,
+    const void *data, size_t len)
 {
 	u_int8_t		len_1;
 	u_int16_t		len16;
@@ -238,15 +699,21 @@ websocket_recv_opcode(struct netbuf *nb)
 		return (KORE_RESULT_ERROR);
 	}
 
-	if (WEBSOCKET_RSV(nb->buf[0], 1) || WEBSOCKET_RSV(nb->buf[0], 2) ||
-	    WEBSOCKET_RSV(nb->buf[0], 3)) {
+	if (WEBSOCKET_RSV(nb->buf[0], 2) || WEBSOCKET_RSV(nb->buf[0], 3)) {
 		kore_debug("%p: RSV bits are not zero", c);
 		return (KORE_RESULT_ERROR);
 	}
 
 	len = WEBSOCKET_FRAME_LENGTH(nb->buf[1]);
 
+	/* RSV1 marks a compressed message if permessage-deflate is on. */
 	op = nb->buf[0] & WEBSOCKET_OPCODE_MASK;
+	if (WEBSOCKET_RSV(nb->buf[0], 1) && (c->ws_deflate == NULL ||
+	    (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY))) {
+		kore_debug("%p: RSV1 set without compression", c);
+		return (KORE_RESULT_ERROR);
+	}
+
 	switch (op) {
 	case WEBSOCKET_OP_CONT:
 	case WEBSOCKET_OP_TEXT:
@@ -340,6 +807,20 @@ websocket_recv_frame(struct netbuf *nb)
 		break;
 	case WEBSOCKET_OP_TEXT:
 	case WEBSOCKET_OP_BINARY:
+#if defined(KORE_USE_ZLIB)
+		if (WEBSOCKET_RSV(nb->buf[0], 1)) {
+			if (!websocket_inflate(c, &nb->buf[moff + 4], len)) {
+				kore_debug("%p: failed to inflate message", c);
+				ret = KORE_RESULT_ERROR;
+				break;
+			}
+			if (c->ws_message != NULL) {
+				kore_runtime_wsmessage(c->ws_message,
+				    c, op, ws_ibuf.data, ws_ibuf.offset);
+			}
+			break;
+		}
+#endif
 		if (c->ws_message != NULL) {
 			kore_runtime_wsmessage(c->ws_message,
 			    c, op, &nb->buf[moff + 4], len);
@@ -370,12 +851,427 @@ websocket_recv_frame(struct netbuf *nb)
 static void
 websocket_disconnect(struct connection *c)
 {
+	struct websocket_sub	*sub;
+
 	if (c->ws_disconnect != NULL)
 		kore_runtime_wsdisconnect(c->ws_disconnect, c);
 
+	while ((sub = TAILQ_FIRST(&c->ws_subs)) != NULL)
+		websocket_sub_remove(sub);
+
+	TAILQ_REMOVE(&ws_connections, c, ws_list);
+
 	if (!(c->flags & CONN_WS_CLOSE_SENT)) {
 		c->flags |= CONN_WS_CLOSE_SENT;
 		c->evt.flags &= ~KORE_EVENT_READ;
 		kore_websocket_send(c, WEBSOCKET_OP_CLOSE, NULL, 0);
 	}
+
+#if defined(KORE_USE_ZLIB)
+	websocket_deflate_free(c);
+#endif
+}
+
+#if defined(KORE_USE_ZLIB)
+/*
+ * Pick the first permessage-deflate offer from the client we can accept
+ * under the route its settings and answer it.
+ */
+static struct websocket_deflate *
+websocket_deflate_negotiate(struct http_request *req)
+{
+	int				i;
+	struct kore_buf			resp;
+	struct websocket_deflate	*wd;
+	const char			*header;
+	char				*copy, *offers[WEBSOCKET_DEFLATE_OFFERS];
+
+	if (req->hdlr == NULL || req->hdlr->ws_deflate == 0)
+		return (NULL);
+
+	if (!http_request_header_id(req,
+	    HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS, &header))
+		return (NULL);
+
+	copy = kore_strdup(header);
+	(void)kore_split_string(copy, ",", offers, WEBSOCKET_DEFLATE_OFFERS);
+
+	wd = kore_calloc(1, sizeof(*wd));
+	kore_buf_init(&resp, 128);
+
+	for (i = 0; offers[i] != NULL; i++) {
+		if (websocket_deflate_offer(req->hdlr, offers[i], wd, &resp))
+			break;
+	}
+
+	if (offers[i] != NULL) {
+		http_response_header(req, "sec-websocket-extensions",
+		    kore_buf_stringify(&resp, NULL));
+	} else {
+		kore_free(wd);
+		wd = NULL;
+	}
+
+	kore_buf_cleanup(&resp);
+	kore_free(copy);
+
+	return (wd);
+}
+
+static int
+websocket_deflate_offer(struct kore_module_handle *hdlr, char *offer,
+    struct websocket_deflate *wd, struct kore_buf *resp)
+{
+	int		i, err, bits, seen, client_bits;
+	int		tx_takeover, rx_takeover, server_bits;
+	char		*name, *value, *params[WEBSOCKET_DEFLATE_PARAMS];
+
+	(void)kore_split_string(offer, ";", params, WEBSOCKET_DEFLATE_PARAMS);
+	if (params[0] == NULL)
+		return (KORE_RESULT_ERROR);
+
+	kore_strip_chars(params[0], ' ', &name);
+	i = strcmp(name, "permessage-deflate");
+	kore_free(name);
+
+	if (i != 0)
+		return (KORE_RESULT_ERROR);
+
+	seen = 0;
+	server_bits = 0;
+	client_bits = 0;
+	tx_takeover = (hdlr->ws_deflate == WEBSOCKET_DEFLATE_TAKEOVER);
+	rx_takeover = tx_takeover;
+
+	wd->tx_bits = hdlr->ws_deflate_bits;
+	wd->rx_bits = WEBSOCKET_DEFLATE_BITS;
+
+	for (i = 1; params[i] != NULL; i++) {
+		kore_strip_chars(params[i], ' ', &name);
+
+		if ((value = strchr(name, '=')) != NULL) {
+			*value++ = '\0';
+			if (*value == '"' && strlen(value) > 1 &&
+			    value[strlen(value) - 1] == '"') {
+				value[strlen(value) - 1] = '\0';
+				value++;
+			}
+		}
+
+		if (!strcmp(name, "server_no_context_takeover")) {
+			bits = 0x01;
+			tx_takeover = 0;
+		} else if (!strcmp(name, "client_no_context_takeover")) {
+			bits = 0x02;
+			rx_takeover = 0;
+		} else if (!strcmp(name, "server_max_window_bits")) {
+			bits = 0x04;
+			if (value == NULL) {
+				err = KORE_RESULT_ERROR;
+			} else {
+				server_bits = kore_strtonum(value,
+				    10, 8, 15, &err);
+			}
+
+			/* zlib can not deflate with a 256 byte window. */
+			if (err != KORE_RESULT_OK || server_bits < 9)
+				bits = -1;
+		} else if (!strcmp(name, "client_max_window_bits")) {
+			bits = 0x08;
+			if (value != NULL) {
+				client_bits = kore_strtonum(value,
+				    10, 8, 15, &err);
+				if (err != KORE_RESULT_OK)
+					bits = -1;
+			} else {
+				client_bits = WEBSOCKET_DEFLATE_BITS;
+			}
+		} else {
+			bits = -1;
+		}
+		kore_free(name);
+
+		if (bits == -1 || (seen & bits))
+			return (KORE_RESULT_ERROR);
+
+		seen |= bits;
+	}
+
+	if (server_bits != 0 && server_bits < wd->tx_bits)
+		wd->tx_bits = server_bits;
+
+	kore_buf_reset(resp);
+	kore_buf_appendf(resp, "permessage-deflate");
+
+	if (!tx_takeover)
+		kore_buf_appendf(resp, "; server_no_context_takeover");
+	if (!rx_takeover)
+		kore_buf_appendf(resp, "; client_no_context_takeover");
+
+	if (server_bits != 0 || wd->tx_bits < WEBSOCKET_DEFLATE_BITS) {
+		kore_buf_appendf(resp,
+		    "; server_max_window_bits=%d", wd->tx_bits);
+	}
+
+	/* Only a client that offered it may be told to use a smaller window. */
+	if (rx_takeover && client_bits != 0 &&
+	    hdlr->ws_deflate_bits < WEBSOCKET_DEFLATE_BITS) {
+		wd->rx_bits = hdlr->ws_deflate_bits;
+		kore_buf_appendf(resp,
+		    "; client_max_window_bits=%d", wd->rx_bits);
+	}
+
+	wd->flags = 0;
+	if (tx_takeover)
+		wd->flags |= WEBSOCKET_DEFLATE_TX_TAKEOVER;
+	if (rx_takeover)
+		wd->flags |= WEBSOCKET_DEFLATE_RX_TAKEOVER;
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Build a compressed frame for a single connection. Returns
+ * KORE_RESULT_ERROR, leaving frame alone, if it goes out as is.
+ */
+static int
+websocket_deflate_frame(struct websocket_deflate *wd, struct kore_buf *frame,
+    u_int8_t op, const void *data, size_t len)
+{
+	z_stream	*zs;
+	int		takeover;
+
+	if (wd == NULL || !websocket_deflate_eligible(op, len))
+		return (KORE_RESULT_ERROR);
+
+	if (wd->flags & WEBSOCKET_DEFLATE_TX_TAKEOVER) {
+		if (!(wd->flags & WEBSOCKET_DEFLATE_TX_INIT)) {
+			if (deflateInit2(&wd->tx, http_compress_level,
+			    Z_DEFLATED, -wd->tx_bits, wd->tx_bits - 7,
+			    Z_DEFAULT_STRATEGY) != Z_OK) {
+				kore_log(LOG_ERR, "deflateInit2: %s",
+				    wd->tx.msg != NULL ? wd->tx.msg : "failed");
+				wd->flags &= ~WEBSOCKET_DEFLATE_TX_TAKEOVER;
+				return (KORE_RESULT_ERROR);
+			}
+			wd->flags |= WEBSOCKET_DEFLATE_TX_INIT;
+		}
+		zs = &wd->tx;
+		takeover = 1;
+	} else {
+		zs = websocket_deflate_shared(wd->tx_bits);
+		takeover = 0;
+	}
+
+	if (!websocket_deflate(zs, takeover, data, len))
+		return (KORE_RESULT_ERROR);
+
+	kore_websocket_frame_build(frame, op | WEBSOCKET_RSV1,
+	    ws_zbuf.data, ws_zbuf.offset);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Compress a message into ws_zbuf, minus the 0x00 0x00 0xff 0xff tail
+ * that RFC 7692 has us strip. A stream that keeps its context and whose
+ * output is not sent is reset, the peer never saw what went into it.
+ */
+static int
+websocket_deflate(z_stream *zs, int takeover, const void *data, size_t len)
+{
+	int		r;
+	size_t		bound;
+
+	if (zs == NULL || len > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	bound = deflateBound(zs, len) + 16;
+	if (bound > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	kore_buf_reset(&ws_zbuf);
+	if (ws_zbuf.length < bound) {
+		ws_zbuf.data = kore_realloc(ws_zbuf.data, bound);
+		ws_zbuf.length = bound;
+	}
+
+	zs->next_in = (Bytef *)(uintptr_t)data;
+	zs->avail_in = len;
+	zs->next_out = ws_zbuf.data;
+	zs->avail_out = bound;
+
+	r = deflate(zs, Z_SYNC_FLUSH);
+	ws_zbuf.offset = bound - zs->avail_out;
+
+	if (r != Z_OK || zs->avail_in != 0 || zs->avail_out == 0 ||
+	    ws_zbuf.offset < 4 || ws_zbuf.offset - 4 >= len ||
+	    memcmp(ws_zbuf.data + ws_zbuf.offset - 4, "\x00\x00\xff\xff", 4)) {
+		(void)deflateReset(zs);
+		return (KORE_RESULT_ERROR);
+	}
+
+	ws_zbuf.offset -= 4;
+
+	if (!takeover)
+		(void)deflateReset(zs);
+
+	return (KORE_RESULT_OK);
+}
+
+/*
+ * Inflate a compressed message into ws_ibuf, bounded by the maximum
+ * frame size so a small frame can't blow up into a huge message.
+ */
+static int
+websocket_inflate(struct connection *c, const u_int8_t *data, size_t len)
+{
+	z_stream			*zs;
+	int				ret;
+	struct websocket_deflate	*wd = c->ws_deflate;
+
+	if (wd->flags & WEBSOCKET_DEFLATE_RX_TAKEOVER) {
+		if (!(wd->flags & WEBSOCKET_DEFLATE_RX_INIT)) {
+			if (inflateInit2(&wd->rx, -wd->rx_bits) != Z_OK) {
+				kore_log(LOG_ERR, "inflateInit2: %s",
+				    wd->rx.msg != NULL ? wd->rx.msg : "failed");
+				return (KORE_RESULT_ERROR);
+			}
+			wd->flags |= WEBSOCKET_DEFLATE_RX_INIT;
+		}
+		zs = &wd->rx;
+	} else {
+		if (!ws_rx_shared_init) {
+			memset(&ws_rx_shared, 0, sizeof(ws_rx_shared));
+			if (inflateInit2(&ws_rx_shared,
+			    -WEBSOCKET_DEFLATE_BITS) != Z_OK) {
+				kore_log(LOG_ERR, "inflateInit2: %s",
+				    ws_rx_shared.msg != NULL ?
+				    ws_rx_shared.msg : "failed");
+				return (KORE_RESULT_ERROR);
+			}
+			ws_rx_shared_init = 1;
+		}
+		zs = &ws_rx_shared;
+	}
+
+	kore_buf_reset(&ws_ibuf);
+
+	ret = websocket_inflate_input(zs, data, len);
+	if (ret == KORE_RESULT_OK)
+		ret = websocket_inflate_input(zs, "\x00\x00\xff\xff", 4);
+
+	if (!(wd->flags & WEBSOCKET_DEFLATE_RX_TAKEOVER))
+		(void)inflateReset(zs);
+
+	return (ret);
+}
+
+static int
+websocket_inflate_input(z_stream *zs, const void *data, size_t len)
+{
+	int		r;
+	size_t		nlen;
+
+	if (len > UINT_MAX)
+		return (KORE_RESULT_ERROR);
+
+	zs->next_in = (Bytef *)(uintptr_t)data;
+	zs->avail_in = len;
+
+	for (;;) {
+		if (ws_ibuf.offset == ws_ibuf.length) {
+			if (ws_ibuf.length > kore_websocket_maxframe)
+				return (KORE_RESULT_ERROR);
+
+			nlen = ws_ibuf.length < 4096 ? 4096 : ws_ibuf.length * 2;
+			if (nlen > kore_websocket_maxframe + 1)
+				nlen = kore_websocket_maxframe + 1;
+
+			ws_ibuf.data = kore_realloc(ws_ibuf.data, nlen);
+			ws_ibuf.length = nlen;
+		}
+
+		zs->next_out = ws_ibuf.data + ws_ibuf.offset;
+		zs->avail_out = ws_ibuf.length - ws_ibuf.offset;
+
+		r = inflate(zs, Z_SYNC_FLUSH);
+		ws_ibuf.offset = ws_ibuf.length - zs->avail_out;
+
+		if (ws_ibuf.offset > kore_websocket_maxframe)
+			return (KORE_RESULT_ERROR);
+
+		switch (r) {
+		case Z_OK:
+			break;
+		case Z_STREAM_END:
+			/* The peer finished its stream, start a new one. */
+			(void)inflateReset(zs);
+			break;
+		case Z_BUF_ERROR:
+			if (zs->avail_out != 0) {
+				return (zs->avail_in == 0 ?
+				    KORE_RESULT_OK : KORE_RESULT_ERROR);
+			}
+			break;
+		default:
+			return (KORE_RESULT_ERROR);
+		}
+
+		if (zs->avail_in == 0 && zs->avail_out != 0)
+			return (KORE_RESULT_OK);
+	}
+}
+
+/* The per worker stream for messages that do not keep their context. */
+static z_stream *
+websocket_deflate_shared(int bits)
+{
+	z_stream	*zs;
+
+	zs = &ws_tx_shared[bits];
+	if (ws_tx_shared_init & (1 << bits))
+		return (zs);
+
+	memset(zs, 0, sizeof(*zs));
+	if (deflateInit2(zs, http_compress_level, Z_DEFLATED, -bits,
+	    bits - 7, Z_DEFAULT_STRATEGY) != Z_OK) {
+		kore_log(LOG_ERR, "deflateInit2: %s",
+		    zs->msg != NULL ? zs->msg : "failed");
+		return (NULL);
+	}
+
+	ws_tx_shared_init |= (1 << bits);
+
+	return (zs);
+}
+
+static int
+websocket_deflate_eligible(u_int8_t op, size_t len)
+{
+	if (op != WEBSOCKET_OP_TEXT && op != WEBSOCKET_OP_BINARY)
+		return (KORE_RESULT_ERROR);
+
+	if (len == 0 || len < http_compress_min)
+		return (KORE_RESULT_ERROR);
+
+	return (KORE_RESULT_OK);
+}
+
+static void
+websocket_deflate_free(struct connection *c)
+{
+	struct websocket_deflate	*wd = c->ws_deflate;
+
+	if (wd == NULL)
+		return;
+
+	if (wd->flags & WEBSOCKET_DEFLATE_TX_INIT)
+		(void)deflateEnd(&wd->tx);
+	if (wd->flags & WEBSOCKET_DEFLATE_RX_INIT)
+		(void)inflateEnd(&wd->rx);
+
+	kore_free(wd);
+	c->ws_deflate = NULL;
 }
+#endif
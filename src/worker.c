@@ -26,6 +26,7 @@
 
 #include <fcntl.h>
 #include <grp.h>
+#include <inttypes.h>
 #include <pwd.h>
 #include <signal.h>
 
@@ -39,6 +40,10 @@
 #include "http.h"
 #endif
 
+#if defined(KORE_USE_HTTP2)
+#include "http2.h"
+#endif
+
 #if defined(KORE_USE_PGSQL)
 #include "pgsql.h"
 #endif
@@ -65,6 +70,9 @@
 
 #define WORKER_SOLO_COUNT	3
 
+/* A peer that is busy this long (ms) is not counted as a candidate. */
+#define WORKER_LOAD_STALL	100
+
 #define WORKER(id)						\
 	(struct kore_worker *)((u_int8_t *)kore_workers +	\
 	    (sizeof(struct kore_worker) * id))
@@ -82,21 +90,78 @@ static inline int	worker_acceptlock_obtain(void);
 static inline void	worker_acceptlock_release(void);
 static void		worker_accept_avail(struct kore_msg *, const void *);
 
+static void	worker_reuseport_init(void);
 static void	worker_entropy_recv(struct kore_msg *, const void *);
 static void	worker_keymgr_response(struct kore_msg *, const void *);
+static void	worker_mem_stats_send(void);
+static void	worker_drain(struct kore_msg *, const void *);
+static void	worker_drain_start(void);
+static int	worker_drain_check(u_int64_t);
+static int	worker_least_loaded(void);
+static void	worker_load_update(void *, u_int64_t);
+static u_int32_t	worker_load_score(struct kore_worker *);
+static u_int64_t	worker_loop_phase(int, u_int64_t);
+static void		worker_loop_account(u_int64_t, u_int64_t);
+static void		worker_startup_phase(const char *);
+static void		worker_startup_done(void);
 
 static int				accept_avail;
 static struct kore_worker		*kore_workers;
 static int				worker_no_lock;
+static int				worker_draining;
+static u_int64_t			worker_drain_deadline;
+static u_int64_t			worker_drain_last;
+static int				worker_accept_deferred;
 static int				shm_accept_key;
 static struct wlock			*accept_lock;
 
+/*
+ * Time spent per phase in the current event loop iteration and the
+ * slowest piece of work handed to kore_worker_loop_note() during it.
+ */
+static u_int64_t			loop_phase[KORE_LOOP_PHASES];
+static u_int64_t			loop_note_ms;
+static char				loop_note[128];
+static u_int32_t			loop_max;
+
+static const char *loop_phase_names[KORE_LOOP_PHASES] = {
+	"io", "timers", "curl", "http", "python", "connections"
+};
+
+/*
+ * Where the worker spent its startup, logged once it is ready. It is
+ * not ready until all kore_worker_warmup_hold() calls were released
+ * or worker_warmup_timeout passed and won't take the accept lock.
+ *
+ * With reuseport a warming worker keeps its socket in the reuseport
+ * group, connections hashed to it queue up until it is ready. Taking
+ * the socket out would drop them and break the cpu steering, which
+ * maps workers to sockets by their index in the group.
+ */
+#define WORKER_STARTUP_PHASES	12
+
+static struct {
+	const char	*name;
+	u_int64_t	ms;
+} startup_phases[WORKER_STARTUP_PHASES];
+
+static int				startup_nphases;
+static u_int64_t			startup_mark;
+static u_int32_t			warmup_holds;
+static u_int64_t			warmup_deadline;
+static int				worker_warming;
+
 struct kore_worker		*worker = NULL;
 u_int8_t			worker_set_affinity = 1;
 u_int32_t			worker_accept_threshold = 16;
+u_int32_t			worker_accept_slack = 0;
 u_int32_t			worker_rlimit_nofiles = 768;
 u_int32_t			worker_max_connections = 512;
 u_int32_t			worker_active_connections = 0;
+u_int32_t			worker_drain_timeout = 30;
+u_int32_t			worker_stall_ms = 250;
+u_int32_t			worker_warmup_timeout = 10;
+u_int64_t			kore_loop_woke = 0;
 int				worker_policy = KORE_WORKER_POLICY_RESTART;
 
 void
@@ -114,6 +179,11 @@ kore_worker_init(void)
 	/* Account for the keymgr/acme even if we don't end up starting it. */
 	worker_count += 2;
 
+#if defined(__linux__)
+	kore_msg_shm_init();
+#endif
+	kore_kv_init();
+
 	len = sizeof(*accept_lock) +
 	    (sizeof(struct kore_worker) * worker_count);
 
@@ -140,9 +210,19 @@ kore_worker_init(void)
 	/* Setup log buffers. */
 	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
 		kw = WORKER(idx);
-		kw->lb.offset = 0;
+		kw->lb.head = 0;
+		kw->lb.tail = 0;
+		kw->lb.drops = 0;
+		kw->lb.reported = 0;
+		memset(&kw->accept, 0, sizeof(kw->accept));
 	}
 
+	if (kore_socket_reuseport)
+		worker_reuseport_init();
+
+	/* After a graceful upgrade, settle the inherited listeners. */
+	kore_upgrade_finish();
+
 	/* Now start all the workers. */
 	id = 1;
 	cpu = 1;
@@ -178,6 +258,8 @@ kore_worker_spawn(u_int16_t idx, u_int16_t id, u_int16_t cpu)
 	kw->has_lock = 0;
 	kw->active_hdlr = NULL;
 	kw->running = 1;
+	kw->spawned = kore_time_ms();
+	kw->ready_ms = 0;
 
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, kw->pipe) == -1)
 		fatal("socketpair(): %s", errno_s);
@@ -237,6 +319,9 @@ kore_worker_shutdown(void)
 				kw->pid = 0;
 				kw->running = 0;
 
+				/* Pick up its last words. */
+				kore_log_gather(NULL, kore_time_ms());
+
 				if (!kore_quiet) {
 					kore_log(LOG_NOTICE, "worker %s exited",
 					    kore_worker_name(kw->id));
@@ -271,6 +356,11 @@ kore_worker_dispatch_signal(int sig)
 
 	for (idx = 0; idx < worker_count; idx++) {
 		kw = WORKER(idx);
+
+		/* A pid of 0 would signal our entire process group. */
+		if (kw->pid == 0)
+			continue;
+
 		if (kill(kw->pid, sig) == -1) {
 			kore_debug("kill(%d, %d): %s", kw->pid, sig, errno_s);
 		}
@@ -349,10 +439,14 @@ kore_worker_entry(struct kore_worker *kw)
 	struct kore_runtime_call	*rcall;
 	u_int64_t			last_seed;
 	int				quit, had_lock;
-	u_int64_t			netwait, now, next_timeo;
+	u_int64_t			netwait, now, woke, mark;
 
 	worker = kw;
 
+	startup_nphases = 0;
+	startup_mark = kw->spawned;
+	worker_startup_phase("fork");
+
 #if defined(__linux__)
 	kore_seccomp_traceme();
 #endif
@@ -378,6 +472,12 @@ kore_worker_entry(struct kore_worker *kw)
 	}
 #endif
 
+	if (kore_socket_reuseport) {
+		kore_listener_reuseport_select(kw->id - 1,
+		    worker_count - KORE_WORKER_BASE);
+		worker_no_lock = 1;
+	}
+
 	net_init();
 	kore_connection_init();
 	kore_platform_event_init();
@@ -386,28 +486,47 @@ kore_worker_entry(struct kore_worker *kw)
 #if defined(KORE_USE_TASKS)
 	kore_task_init();
 #endif
+	worker_startup_phase("init");
 
 	kore_worker_privdrop(kore_runas_user, kore_root_path);
+	worker_startup_phase("privdrop");
 
 #if !defined(KORE_NO_HTTP)
 	http_init();
 	kore_filemap_resolve_paths();
 	kore_accesslog_worker_init();
+	kore_auth_worker_init();
+	kore_metrics_init();
 #endif
 	kore_timer_init();
+#if !defined(KORE_NO_HTTP)
+	kore_proxy_worker_init();
+#endif
 	kore_fileref_init();
+	worker_startup_phase("http");
+#if !defined(KORE_NO_HTTP)
+	kore_filemap_preload_paths();
+	worker_startup_phase("filemap");
+#endif
 	kore_domain_keymgr_init();
 
+	if (kore_pool_idle != 0)
+		kore_timer_add(kore_pool_trim, 1000, NULL, 0);
+
+	memset(&kw->load, 0, sizeof(kw->load));
+	kore_timer_add(worker_load_update, 1000, NULL, 0);
+
 	quit = 0;
 	had_lock = 0;
-	next_timeo = 0;
 	accept_avail = 1;
+	worker_draining = 0;
 	worker_active_connections = 0;
 
 	last_seed = 0;
 
 	if (keymgr_active) {
 		kore_msg_register(KORE_MSG_CRL, worker_keymgr_response);
+		kore_msg_register(KORE_MSG_OCSP, worker_keymgr_response);
 		kore_msg_register(KORE_MSG_ENTROPY_RESP, worker_entropy_recv);
 		kore_msg_register(KORE_MSG_CERTIFICATE, worker_keymgr_response);
 
@@ -424,6 +543,7 @@ kore_worker_entry(struct kore_worker *kw)
 	}
 
 	kore_msg_register(KORE_MSG_ACCEPT_AVAILABLE, worker_accept_avail);
+	kore_msg_register(KORE_MSG_DRAIN, worker_drain);
 
 	if (nlisteners == 0)
 		worker_no_lock = 1;
@@ -434,13 +554,34 @@ kore_worker_entry(struct kore_worker *kw)
 		    kw->id, kw->cpu, kw->pid);
 	}
 
+	worker_startup_phase("setup");
+
 	rcall = kore_runtime_getcall("kore_worker_configure");
 	if (rcall != NULL) {
 		kore_runtime_execute(rcall);
 		kore_free(rcall);
 	}
+	worker_startup_phase("configure");
 
 	kore_module_onload();
+#if defined(KORE_USE_PGSQL)
+	kore_pgsql_worker_init();
+#endif
+	worker_startup_phase("onload");
+
+	warmup_holds = 0;
+	worker_warming = 1;
+	warmup_deadline = kore_time_ms() + (worker_warmup_timeout * 1000);
+
+	rcall = kore_runtime_getcall("kore_worker_warmup");
+	if (rcall != NULL) {
+		kore_runtime_execute(rcall);
+		kore_free(rcall);
+	}
+
+	if (warmup_holds == 0)
+		worker_startup_done();
+
 	worker->restarted = 0;
 
 	for (;;) {
@@ -452,7 +593,16 @@ kore_worker_entry(struct kore_worker *kw)
 			last_seed = now;
 		}
 
-		if (!worker->has_lock && accept_avail) {
+		worker_accept_deferred = 0;
+
+		if (worker_warming && now >= warmup_deadline) {
+			kore_log(LOG_NOTICE, "warmup not done after %us, "
+			    "accepting anyway", worker_warmup_timeout);
+			worker_startup_done();
+		}
+
+		if (!worker->has_lock && accept_avail && !worker_draining &&
+		    !worker_warming) {
 			if (worker_acceptlock_obtain()) {
 				accept_avail = 0;
 				if (had_lock == 0) {
@@ -471,25 +621,58 @@ kore_worker_entry(struct kore_worker *kw)
 			if (http_request_count > 0)
 				netwait = 100;
 #endif
+		}
+
 #if defined(KORE_USE_PYTHON)
-			if (kore_python_coro_pending())
-				netwait = 10;
+		/* Coroutines that did not fit the last run go next. */
+		if (kore_python_coro_pending())
+			netwait = 0;
 #endif
-		}
 
+#if !defined(KORE_NO_HTTP)
+		/* Woken up requests wait for the next http_process(). */
+		if (http_wakeup_pending())
+			netwait = 0;
+#endif
+
+		/* Passed on the lock for now, check again soon. */
+		if (worker_accept_deferred)
+			netwait = MIN(netwait, 10);
+
+		if (worker_warming)
+			netwait = MIN(netwait, warmup_deadline - now);
+
+		netwait = MIN(netwait, kore_connection_timeout_next(now));
+
+		worker->load.connections = worker_active_connections;
+#if !defined(KORE_NO_HTTP)
+		worker->load.requests = http_request_count;
+		kore_metrics_publish();
+#endif
+		worker->load.busy = 0;
+
+		kore_loop_woke = 0;
 		kore_platform_event_wait(netwait);
 		now = kore_time_ms();
+		worker->load.busy = now;
+
+		mark = kore_time_us();
+		woke = (kore_loop_woke != 0) ? kore_loop_woke : mark;
+		loop_phase[KORE_LOOP_IO] = mark - woke;
 
 		if (worker->has_lock)
 			worker_acceptlock_release();
 
-		if (!worker->has_lock) {
+		if (!worker->has_lock || worker_draining == 1) {
 			if (had_lock == 1) {
 				had_lock = 0;
 				kore_platform_disable_accept();
 			}
 		}
 
+		if (worker_draining == 1)
+			worker_drain_start();
+
 		if (sig_recv != 0) {
 			switch (sig_recv) {
 			case SIGHUP:
@@ -503,6 +686,18 @@ kore_worker_entry(struct kore_worker *kw)
 			case SIGCHLD:
 #if defined(KORE_USE_PYTHON)
 				kore_python_proc_reap();
+#endif
+				break;
+			case SIGUSR2:
+				worker_mem_stats_send();
+#if !defined(KORE_NO_HTTP)
+				http_wakeup_log();
+				http_prio_log();
+#endif
+				kore_domain_tls_stats_log();
+				net_tls_stats_log();
+#if defined(KORE_USE_PYTHON)
+				kore_python_freelist_log();
 #endif
 				break;
 			default:
@@ -512,26 +707,33 @@ kore_worker_entry(struct kore_worker *kw)
 			sig_recv = 0;
 		}
 
+		if (worker_draining && worker_drain_check(now))
+			quit = 1;
+
 		if (quit)
 			break;
 
 		kore_timer_run(now);
+		mark = worker_loop_phase(KORE_LOOP_TIMERS, mark);
 #if defined(KORE_USE_CURL)
 		kore_curl_run_scheduled();
 		kore_curl_do_timeout();
+		mark = worker_loop_phase(KORE_LOOP_CURL, mark);
 #endif
 #if !defined(KORE_NO_HTTP)
 		http_process();
+		mark = worker_loop_phase(KORE_LOOP_HTTP, mark);
 #endif
 #if defined(KORE_USE_PYTHON)
 		kore_python_coro_run();
+		mark = worker_loop_phase(KORE_LOOP_PYTHON, mark);
 #endif
-		if (next_timeo <= now) {
-			kore_connection_check_timeout(now);
-			next_timeo = now + 500;
-		}
+		kore_connection_check_timeout(now);
 
 		kore_connection_prune(KORE_CONNECTION_PRUNE_DISCONNECT);
+		mark = worker_loop_phase(KORE_LOOP_CONNECTIONS, mark);
+
+		worker_loop_account(woke, mark);
 	}
 
 	rcall = kore_runtime_getcall("kore_worker_teardown");
@@ -540,7 +742,10 @@ kore_worker_entry(struct kore_worker *kw)
 		kore_free(rcall);
 	}
 
-	kore_msg_send(KORE_MSG_PARENT, KORE_MSG_SHUTDOWN, NULL, 0);
+	/* A drained worker leaving is expected, don't take the parent down. */
+	if (!worker_draining)
+		kore_msg_send(KORE_MSG_PARENT, KORE_MSG_SHUTDOWN, NULL, 0);
+
 	kore_server_cleanup();
 
 	kore_platform_event_cleanup();
@@ -592,6 +797,92 @@ kore_worker_reap(void)
 	}
 }
 
+void
+kore_worker_accept_stats(void *arg, u_int64_t now)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+	u_int64_t		elapsed;
+	u_int32_t		total;
+	static u_int64_t	last = 0;
+	static u_int64_t	*seen = NULL;
+
+	if (seen == NULL)
+		seen = kore_calloc(worker_count, sizeof(*seen));
+
+	elapsed = (last != 0 && now > last) ? now - last : 1000;
+	last = now;
+
+	total = 0;
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+		kw->accept.rate =
+		    ((kw->accept.accepted - seen[idx]) * 1000) / elapsed;
+		seen[idx] = kw->accept.accepted;
+		total += kw->accept.rate;
+	}
+
+	kore_listener_backlog_check(total);
+}
+
+/*
+ * Log the allocator statistics a worker sent us after SIGUSR2. Only
+ * the size classes that have allocated any entries are shown.
+ */
+void
+kore_worker_mem_stats(struct kore_msg *msg, const void *data)
+{
+	int				i;
+	struct kore_mem_stats		st;
+	const struct kore_mem_class	*mc;
+
+	if (msg->length != sizeof(st)) {
+		kore_log(LOG_WARNING, "invalid memory stats from %u (%zu)",
+		    msg->src, msg->length);
+		return;
+	}
+
+	memcpy(&st, data, sizeof(st));
+
+	for (i = 0; i < KORE_MEM_BLOCKS; i++) {
+		mc = &st.classes[i];
+		if (mc->allocs == 0)
+			continue;
+
+		kore_log(LOG_INFO, "worker %u: block-%u: %u/%u in use, "
+		    "hwm %u, %" PRIu64 " allocs, %" PRIu64 "/s", msg->src,
+		    mc->size, mc->inuse, mc->elms, mc->hwm, mc->allocs,
+		    mc->rate);
+	}
+
+	kore_log(LOG_INFO, "worker %u: large: %" PRIu64 " in use, %" PRIu64
+	    " bytes, hwm %" PRIu64 " bytes, %" PRIu64 " allocs", msg->src,
+	    st.large_inuse, st.large_bytes, st.large_hwm, st.large_allocs);
+
+	kore_log(LOG_INFO, "worker %u: tagged: %u in use, %" PRIu64 " bytes",
+	    msg->src, st.tags, st.tag_bytes);
+
+	kore_log(LOG_INFO, "worker %u: pool regions: %u, %u hugetlb, %u thp",
+	    msg->src, st.regions, st.regions_hugetlb, st.regions_thp);
+}
+
+void
+kore_worker_warmup_hold(void)
+{
+	if (worker_warming)
+		warmup_holds++;
+}
+
+void
+kore_worker_warmup_release(void)
+{
+	if (!worker_warming || warmup_holds == 0)
+		return;
+
+	if (--warmup_holds == 0)
+		worker_startup_done();
+}
+
 void
 kore_worker_make_busy(void)
 {
@@ -726,7 +1017,14 @@ worker_reaper(pid_t pid, int status)
 		    worker_no_lock == 0)
 			worker_unlock();
 
+#if defined(__linux__)
+		kore_msg_shm_reap(kw);
+#endif
+		kore_kv_reap(kw);
+
 #if !defined(KORE_NO_HTTP)
+		http_cache_reap(pid);
+
 		if (kw->active_hdlr != NULL) {
 			kw->active_hdlr->errors++;
 			kore_log(LOG_NOTICE,
@@ -747,6 +1045,12 @@ worker_reaper(pid_t pid, int status)
 			break;
 		}
 
+		/* Workers of an old generation are not brought back. */
+		if (kore_upgrade_draining()) {
+			kw->pid = 0;
+			break;
+		}
+
 		kore_log(LOG_NOTICE, "restarting worker %d", kw->id);
 		kw->restarted = 1;
 		kore_msg_parent_remove(kw);
@@ -768,10 +1072,12 @@ worker_acceptlock_release(void)
 
 	if (worker_active_connections < worker_max_connections) {
 #if !defined(KORE_NO_HTTP)
-		if (http_request_count < http_request_limit)
+		if (http_request_count < http_request_limit &&
+		    (worker_accept_slack == 0 || worker_least_loaded()))
 			return;
 #else
-		return;
+		if (worker_accept_slack == 0 || worker_least_loaded())
+			return;
 #endif
 	}
 
@@ -806,6 +1112,11 @@ worker_acceptlock_obtain(void)
 		return (0);
 #endif
 
+	if (worker_accept_slack != 0 && !worker_least_loaded()) {
+		worker_accept_deferred = 1;
+		return (0);
+	}
+
 	r = 0;
 	if (worker_trylock()) {
 		r = 1;
@@ -825,6 +1136,7 @@ worker_trylock(void)
 		return (0);
 
 	accept_lock->current = worker->pid;
+	worker->time_locked = kore_time_ms();
 
 	return (1);
 }
@@ -832,11 +1144,317 @@ worker_trylock(void)
 static void
 worker_unlock(void)
 {
+	/* The parent releases the lock on behalf of dead workers. */
+	if (worker != NULL)
+		worker->accept.lock_ms += kore_time_ms() - worker->time_locked;
+
 	accept_lock->current = 0;
 	if (!__sync_bool_compare_and_swap(&(accept_lock->lock), 1, 0))
 		kore_log(LOG_NOTICE, "worker_unlock(): wasn't locked");
 }
 
+static void
+worker_reuseport_init(void)
+{
+	u_int16_t	*cpus, idx, cpu, count;
+
+	count = worker_count - KORE_WORKER_BASE;
+
+	/*
+	 * Only steer connections by cpu if each worker has its own cpu,
+	 * this uses the same cpu assignment as kore_worker_init().
+	 */
+	if (worker_set_affinity == 1 && count <= cpu_count) {
+		cpus = kore_calloc(count, sizeof(*cpus));
+
+		cpu = 1;
+		for (idx = 0; idx < count; idx++) {
+			if (cpu >= cpu_count)
+				cpu = 0;
+			cpus[idx] = cpu++;
+		}
+	} else {
+		cpus = NULL;
+	}
+
+	kore_listener_reuseport_init(cpus, count);
+	kore_free(cpus);
+}
+
+static void
+worker_mem_stats_send(void)
+{
+	struct kore_mem_stats		st;
+
+	kore_mem_stats_get(&st);
+	kore_msg_send(KORE_MSG_PARENT, KORE_MSG_MEM_STATS, &st, sizeof(st));
+}
+
+/*
+ * The parent handed our listeners to a new generation of workers. Stop
+ * accepting and leave once our connections are done or the drain
+ * timeout hits.
+ */
+static void
+worker_drain(struct kore_msg *msg, const void *data)
+{
+	if (worker_draining)
+		return;
+
+	worker_draining = 1;
+	worker_drain_last = 0;
+	worker_drain_deadline = kore_time_ms() + (worker_drain_timeout * 1000);
+
+#if !defined(KORE_NO_HTTP)
+	/* Finish what is in flight but stop keeping connections alive. */
+	http_keepalive_time = 0;
+#endif
+
+	if (!kore_quiet) {
+		kore_log(LOG_NOTICE, "worker %d draining %u connections",
+		    worker->id, worker_active_connections);
+	}
+}
+
+static void
+worker_drain_start(void)
+{
+	if (worker->has_lock) {
+		if (worker_count != WORKER_SOLO_COUNT && worker_no_lock == 0)
+			worker_unlock();
+		worker->has_lock = 0;
+	}
+
+	kore_listener_closeall();
+	worker_draining = 2;
+}
+
+static int
+worker_drain_check(u_int64_t now)
+{
+#if !defined(KORE_NO_HTTP)
+	struct connection	*c, *next;
+#endif
+
+	if (worker_active_connections == 0)
+		return (1);
+
+	if (now >= worker_drain_deadline) {
+		if (!kore_quiet) {
+			kore_log(LOG_NOTICE,
+			    "worker %d drain timeout, dropping %u connections",
+			    worker->id, worker_active_connections);
+		}
+		return (1);
+	}
+
+	if (now - worker_drain_last < 100)
+		return (0);
+
+	worker_drain_last = now;
+
+#if !defined(KORE_NO_HTTP)
+	/* Idle keep-alive connections won't send us anything we need. */
+	for (c = TAILQ_FIRST(&connections); c != NULL; c = next) {
+		next = TAILQ_NEXT(c, list);
+
+		if (c->state != CONN_STATE_ESTABLISHED)
+			continue;
+
+		if (c->proto != CONN_PROTO_HTTP && c->proto != CONN_PROTO_HTTP2)
+			continue;
+
+		if (!TAILQ_EMPTY(&c->http_requests) ||
+		    !TAILQ_EMPTY(&c->send_queue))
+			continue;
+
+		/* Part of a request already arrived. */
+		if (c->rnb != NULL && c->rnb->s_off > 0)
+			continue;
+
+#if defined(KORE_USE_HTTP2)
+		/* Let the peer know instead of just dropping it. */
+		if (c->proto == CONN_PROTO_HTTP2) {
+			http2_goaway(c);
+			continue;
+		}
+#endif
+
+		kore_connection_disconnect(c);
+	}
+#endif
+
+	return (0);
+}
+
+/*
+ * Only compete for the accept lock if no other worker that can accept
+ * right now is less loaded than us by more than worker_accept_slack.
+ */
+static int
+worker_least_loaded(void)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+	u_int64_t		now, busy;
+	u_int32_t		score;
+
+	now = kore_time_ms();
+	score = worker_load_score(worker);
+
+	if (score <= worker_accept_slack)
+		return (1);
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+		if (kw == worker || kw->running == 0)
+			continue;
+
+		/* Stuck in a handler, it won't take connections soon. */
+		busy = kw->load.busy;
+		if (busy != 0 && now > busy && now - busy > WORKER_LOAD_STALL)
+			continue;
+
+		if (worker_load_score(kw) + worker_accept_slack < score)
+			return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * Connections and queued requests, each ms of average loop lag and each
+ * 10% of cpu use count as one more.
+ */
+static u_int32_t
+worker_load_score(struct kore_worker *kw)
+{
+	return (kw->load.connections + kw->load.requests +
+	    kw->load.lag + (kw->load.cpu / 10));
+}
+
+static void
+worker_load_update(void *arg, u_int64_t now)
+{
+	struct timespec		ts;
+	u_int64_t		cpu, lag;
+	static u_int64_t	last_cpu = 0;
+	static u_int64_t	last = 0;
+
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == -1)
+		return;
+
+	cpu = (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+	if (last != 0 && now > last) {
+		worker->load.cpu = ((cpu - last_cpu) * 100) / (now - last);
+
+		/*
+		 * The timer fires late by however long the loop was
+		 * busy, keep a moving average of that.
+		 */
+		lag = (now - last > 1000) ? now - last - 1000 : 0;
+		worker->load.lag = ((worker->load.lag * 3) + lag) / 4;
+	}
+
+	worker->loop.max = loop_max;
+	loop_max = 0;
+
+	last = now;
+	last_cpu = cpu;
+}
+
+/*
+ * Called in the parent on SIGUSR2, logs the load each worker published.
+ */
+void
+kore_worker_load_stats(void)
+{
+	u_int16_t		idx;
+	struct kore_worker	*kw;
+
+	for (idx = KORE_WORKER_BASE; idx < worker_count; idx++) {
+		kw = WORKER(idx);
+		if (kw->running == 0)
+			continue;
+
+		kore_log(LOG_INFO, "worker %u: %u connections, %u requests, "
+		    "lag %ums, cpu %u%%, %" PRIu64 " accepted (%u/s), "
+		    "lock held %" PRIu64 "ms, %" PRIu64 " loop stalls",
+		    kw->id, kw->load.connections, kw->load.requests,
+		    kw->load.lag, kw->load.cpu, kw->accept.accepted,
+		    kw->accept.rate, kw->accept.lock_ms, kw->loop.stalls);
+	}
+}
+
+/*
+ * Handlers, coroutines and anything else that can hold up the event loop
+ * report how long they ran, the slowest of the current iteration is
+ * named if the iteration stalls.
+ */
+void
+kore_worker_loop_note(const char *what, const char *name, u_int64_t ms)
+{
+	if (ms <= loop_note_ms)
+		return;
+
+	loop_note_ms = ms;
+	(void)snprintf(loop_note, sizeof(loop_note), "%s %s", what, name);
+}
+
+static u_int64_t
+worker_loop_phase(int phase, u_int64_t mark)
+{
+	u_int64_t	now;
+
+	now = kore_time_us();
+	loop_phase[phase] = now - mark;
+
+	return (now);
+}
+
+/*
+ * An iteration runs from the event wait returning to the next wait, if
+ * it took worker_stall_ms or longer every connection on this worker sat
+ * still for that long, log what held it up.
+ */
+static void
+worker_loop_account(u_int64_t woke, u_int64_t end)
+{
+	int		i, slow;
+	u_int64_t	ms;
+
+	worker->loop.iterations++;
+
+	slow = 0;
+	for (i = 0; i < KORE_LOOP_PHASES; i++) {
+		worker->loop.phase[i] += loop_phase[i];
+		if (loop_phase[i] > loop_phase[slow])
+			slow = i;
+	}
+
+	ms = (end - woke) / 1000;
+	loop_max = MAX(loop_max, ms);
+
+	if (worker_stall_ms != 0 && ms >= worker_stall_ms) {
+		worker->loop.stalls++;
+
+		if (loop_note_ms != 0) {
+			kore_log(LOG_WARNING, "event loop stalled for %" PRIu64
+			    "ms, %" PRIu64 "ms in %s, slowest was %s (%"
+			    PRIu64 "ms)", ms, loop_phase[slow] / 1000,
+			    loop_phase_names[slow], loop_note, loop_note_ms);
+		} else {
+			kore_log(LOG_WARNING, "event loop stalled for %" PRIu64
+			    "ms, %" PRIu64 "ms in %s", ms,
+			    loop_phase[slow] / 1000, loop_phase_names[slow]);
+		}
+	}
+
+	memset(loop_phase, 0, sizeof(loop_phase));
+	loop_note_ms = 0;
+}
+
 static void
 worker_accept_avail(struct kore_msg *msg, const void *data)
 {
@@ -869,15 +1487,17 @@ worker_keymgr_response(struct kore_msg *msg, const void *data)
 
 	switch (msg->id) {
 	case KORE_MSG_CERTIFICATE:
-		kore_domain_tlsinit(dom, KORE_PEM_CERT_CHAIN,
-		    req->data, req->data_len);
+		kore_domain_tls_certificate(dom, req->data, req->data_len);
 		break;
 	case KORE_MSG_CRL:
 		kore_domain_crl_add(dom, req->data, req->data_len);
 		break;
+	case KORE_MSG_OCSP:
+		kore_domain_ocsp_set(dom, req->data, req->data_len);
+		break;
 #if defined(KORE_USE_ACME)
 	case KORE_ACME_CHALLENGE_SET_CERT:
-		if (dom->ssl_ctx == NULL) {
+		if (!kore_domain_tls_ready(dom)) {
 			kore_domain_tlsinit(dom, KORE_DER_CERT_DATA,
 			    req->data, req->data_len);
 		}
@@ -904,3 +1524,46 @@ worker_keymgr_response(struct kore_msg *msg, const void *data)
 		break;
 	}
 }
+
+static void
+worker_startup_phase(const char *name)
+{
+	u_int64_t	now;
+
+	now = kore_time_ms();
+
+	if (startup_nphases < WORKER_STARTUP_PHASES) {
+		startup_phases[startup_nphases].name = name;
+		startup_phases[startup_nphases].ms = now - startup_mark;
+		startup_nphases++;
+	}
+
+	startup_mark = now;
+}
+
+static void
+worker_startup_done(void)
+{
+	int		i;
+	char		buf[256];
+	size_t		off;
+
+	worker_warming = 0;
+	worker_startup_phase("warmup");
+	worker->ready_ms = (u_int32_t)(kore_time_ms() - worker->spawned);
+
+	if (kore_quiet)
+		return;
+
+	off = 0;
+	buf[0] = '\0';
+
+	for (i = 0; i < startup_nphases && off < sizeof(buf); i++) {
+		off += snprintf(buf + off, sizeof(buf) - off, "%s%s %" PRIu64,
+		    i ? ", " : "", startup_phases[i].name,
+		    startup_phases[i].ms);
+	}
+
+	kore_log(LOG_NOTICE, "worker %d ready in %ums (%s)", worker->id,
+	    worker->ready_ms, buf);
+}